@@ -0,0 +1,102 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of CPUs the kernel keeps per-CPU state for
+#define MAX_CPUS 16
+
+// RFLAGS interrupt enable bit
+#define CPU_RFLAGS_IF (1ULL << 9)
+
+// MSRs holding the per-CPU area pointer
+#define MSR_GS_BASE         0xC0000101
+#define MSR_KERNEL_GS_BASE  0xC0000102  // Swapped in by swapgs on kernel entry
+
+// Per-CPU area, GS base points here in kernel mode
+// (syscall_entry uses the stack fields by offset, keep them first)
+typedef struct cpu_local {
+    struct cpu_local *self;     // 0x00 Linear address of this area
+    uint64_t kernel_stack;      // 0x08 Stack loaded by syscall_entry
+    uint64_t user_stack;        // 0x10 User RSP saved by syscall_entry
+    uint32_t id;                // 0x18 Index into per-CPU arrays
+    uint32_t lapic_id;          // Local APIC ID reported by the bootloader
+    volatile bool online;       // Running the scheduler
+    uint64_t syscall_frame;     // 0x28 User registers saved by syscall_entry
+} cpu_local_t;
+
+// Read a model-specific register
+static inline uint64_t cpu_read_msr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Write a model-specific register
+static inline void cpu_write_msr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "a"((uint32_t)value), "d"((uint32_t)(value >> 32)), "c"(msr));
+}
+
+// Per-CPU area of the executing CPU
+static inline cpu_local_t *cpu_local(void) {
+    cpu_local_t *local;
+    __asm__ volatile("mov %%gs:0x00, %0" : "=r"(local));
+    return local;
+}
+
+// Index of the executing CPU
+static inline uint32_t cpu_current_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:0x18, %0" : "=r"(id));
+    return id;
+}
+
+// CPUID leaf 1 feature bits
+#define CPUID_1_ECX_PCID         (1U << 17)  // Process-context identifiers
+#define CPUID_1_ECX_X2APIC       (1U << 21)
+#define CPUID_1_ECX_TSC_DEADLINE (1U << 24)  // LAPIC timer TSC-deadline mode
+#define CPUID_1_ECX_XSAVE        (1U << 26)  // XSAVE/XRSTOR and XCR0
+#define CPUID_1_ECX_AVX          (1U << 28)
+#define CPUID_1_EDX_TSC          (1U << 4)   // Time stamp counter
+#define CPUID_1_EDX_APIC         (1U << 9)   // On-chip local APIC
+#define CPUID_1_EDX_FXSR         (1U << 24)  // FXSAVE/FXRSTOR
+
+// CPUID leaf 7 feature bits
+#define CPUID_7_EBX_ERMS    (1U << 9)   // Enhanced rep movsb/stosb
+#define CPUID_7_EBX_INVPCID (1U << 10)  // INVPCID instruction
+#define CPUID_7_EDX_FSRM    (1U << 4)   // Fast short rep movsb
+
+// CPUID leaf 0x80000007 feature bits
+#define CPUID_80000007_EDX_INVARIANT_TSC (1U << 8)  // TSC rate is constant across P/C-states
+
+// Execute CPUID for a leaf and subleaf
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+// Read the time-stamp counter
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Restore the interrupt state saved by cpu_irq_save
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & CPU_RFLAGS_IF) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
+#endif // CPU_H
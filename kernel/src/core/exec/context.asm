@@ -1,21 +1,15 @@
 section .text
 global task_switch_context
 global task_restore_context
+global kthread_start
 
+; Every switch is a call from C, so the caller-saved registers are already dead and only
+; RBX, RBP, R12-R15, RSP and RFLAGS carry across it. They keep their cpu_context_t slots.
 task_switch_context:
     ; Save the current task's context
-    mov [rdi + 0], rax    ; Save RAX
     mov [rdi + 8], rbx    ; Save RBX
-    mov [rdi + 16], rcx   ; Save RCX
-    mov [rdi + 24], rdx   ; Save RDX
-    mov [rdi + 32], rsi   ; Save RSI
-    mov [rdi + 40], rdi   ; Save RDI
     mov [rdi + 48], rbp   ; Save RBP
     mov [rdi + 56], rsp   ; Save RSP
-    mov [rdi + 64], r8    ; Save R8
-    mov [rdi + 72], r9    ; Save R9
-    mov [rdi + 80], r10   ; Save R10
-    mov [rdi + 88], r11   ; Save R11
     mov [rdi + 96], r12   ; Save R12
     mov [rdi + 104], r13  ; Save R13
     mov [rdi + 112], r14  ; Save R14
@@ -26,18 +20,9 @@ task_switch_context:
     pop qword [rdi + 128]
 
     ; Restore the next task's context
-    mov rax, [rsi + 0]    ; Restore RAX
     mov rbx, [rsi + 8]    ; Restore RBX
-    mov rcx, [rsi + 16]   ; Restore RCX
-    mov rdx, [rsi + 24]   ; Restore RDX
-    mov rsi, [rsi + 32]   ; Restore RSI
-    mov rdi, [rsi + 40]   ; Restore RDI
     mov rbp, [rsi + 48]   ; Restore RBP
     mov rsp, [rsi + 56]   ; Restore RSP
-    mov r8, [rsi + 64]    ; Restore R8
-    mov r9, [rsi + 72]    ; Restore R9
-    mov r10, [rsi + 80]   ; Restore R10
-    mov r11, [rsi + 88]   ; Restore R11
     mov r12, [rsi + 96]   ; Restore R12
     mov r13, [rsi + 104]  ; Restore R13
     mov r14, [rsi + 112]  ; Restore R14
@@ -52,18 +37,9 @@ task_switch_context:
 
 task_restore_context:
     ; Restore the task's context
-    mov rax, [rdi + 0]    ; Restore RAX
     mov rbx, [rdi + 8]    ; Restore RBX
-    mov rcx, [rdi + 16]   ; Restore RCX
-    mov rdx, [rdi + 24]   ; Restore RDX
-    mov rsi, [rdi + 32]   ; Restore RSI
-    mov rdi, [rdi + 40]   ; Restore RDI
     mov rbp, [rdi + 48]   ; Restore RBP
     mov rsp, [rdi + 56]   ; Restore RSP
-    mov r8, [rdi + 64]    ; Restore R8
-    mov r9, [rdi + 72]    ; Restore R9
-    mov r10, [rdi + 80]   ; Restore R10
-    mov r11, [rdi + 88]   ; Restore R11
     mov r12, [rdi + 96]   ; Restore R12
     mov r13, [rdi + 104]  ; Restore R13
     mov r14, [rdi + 112]  ; Restore R14
@@ -74,4 +50,15 @@ task_restore_context:
     popfq
 
     ; Jump to the task's instruction pointer (RIP)
-    ret
\ No newline at end of file
+    ret
+
+; First instruction of a kernel thread, the switch into it left the entry in RBX and its
+; argument in R12
+extern scheduler_finish_fork
+extern scheduler_kthread_exit
+kthread_start:
+    call scheduler_finish_fork
+    sti
+    mov rdi, r12
+    call rbx
+    call scheduler_kthread_exit
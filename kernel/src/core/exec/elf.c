@@ -1,15 +1,40 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
 #include <core/exec/elf.h>
 #include <memory/pmm.h>
 #include <memory/vmm.h>
+#include <memory/vma.h>
+#include <memory/slab.h>
 #include <fs/ext2.h>
+#include <fs/icache.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
 #include <lib/string.h>
 #include <utils/log.h>
 
+// Validated headers of an executable on disk, shared by every elf_file_t parsed from it. The
+// table holds one reference, each elf_file_t using the headers another.
+typedef struct elf_image {
+    uint32_t ino;
+    uint64_t write_seq;             // A rewrite of the file changes one of these three
+    uint32_t file_size;
+    uint32_t generation;
+    void *headers;
+    size_t header_bytes;
+    uint32_t refs;
+    uint64_t last_used;             // Cache clock of the last hit, the oldest goes first
+} elf_image_t;
+
+static elf_image_t *image_cache[ELF_CACHE_ENTRIES];
+static spinlock_t image_lock;            // Zeroed, unlocked
+static uint64_t image_clock = 0;
+static elf_cache_stats_t image_stats;
+
 // Forward declarations
 static bool elf_validate_header(elf64_ehdr_t *ehdr);
 static bool elf_load_program_headers(elf_file_t *elf);
 static bool elf_load_section_headers(elf_file_t *elf);
-static bool elf_load_segments(elf_file_t *elf, uint64_t base_addr);
+static bool elf_load_segments(elf_file_t *elf, mm_t *mm, uint64_t base_addr);
 static bool elf_find_symbol_tables(elf_file_t *elf);
 static char *elf_get_string(elf_file_t *elf, size_t string_table_offset, uint32_t offset);
 
@@ -184,6 +209,114 @@ bool elf_parse_memory(void *data, size_t size, elf_file_t *elf) {
     return true;
 }
 
+// Drop a reference to cached headers, image_lock must be held
+static void image_put_locked(elf_image_t *image) {
+    if (--image->refs == 0) {
+        kfree(image->headers);
+        kfree(image);
+    }
+}
+
+// Take image_lock with interrupts off
+static uint64_t image_lock_acquire(void) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&image_lock);
+    return flags;
+}
+
+static void image_lock_release(uint64_t flags) {
+    spinlock_release(&image_lock);
+    cpu_irq_restore(flags);
+}
+
+// Find the cached headers of an inode in its current version and take a reference to them.
+// A version the file no longer has is dropped.
+static elf_image_t *image_get(const ext2_inode_t *inode, uint32_t ino, uint64_t write_seq) {
+    uint64_t flags = image_lock_acquire();
+    elf_image_t *found = NULL;
+    for (int i = 0; i < ELF_CACHE_ENTRIES; i++) {
+        elf_image_t *image = image_cache[i];
+        if (!image || image->ino != ino) continue;
+
+        if (image->write_seq != write_seq || image->file_size != inode->i_size ||
+            image->generation != inode->i_generation) {
+            image_cache[i] = NULL;
+            image_put_locked(image);
+            image_stats.stale++;
+            image_stats.entries--;
+            continue;
+        }
+
+        image->refs++;
+        image->last_used = ++image_clock;
+        found = image;
+        break;
+    }
+
+    if (found) {
+        image_stats.hits++;
+    } else {
+        image_stats.misses++;
+    }
+    image_lock_release(flags);
+    return found;
+}
+
+// Cache freshly validated headers, the reference returned belongs to the caller. NULL when
+// out of memory, the caller then keeps its headers private.
+static elf_image_t *image_insert(const ext2_inode_t *inode, uint32_t ino, uint64_t write_seq,
+                                 void *headers, size_t header_bytes) {
+    elf_image_t *image = kmalloc(sizeof(elf_image_t));
+    if (!image) {
+        return NULL;
+    }
+    image->ino = ino;
+    image->write_seq = write_seq;
+    image->file_size = inode->i_size;
+    image->generation = inode->i_generation;
+    image->headers = headers;
+    image->header_bytes = header_bytes;
+    image->refs = 2;
+
+    uint64_t flags = image_lock_acquire();
+    image->last_used = ++image_clock;
+
+    // An empty slot, or the one used longest ago. Images in use survive eviction through
+    // the references of their users.
+    int slot = 0;
+    for (int i = 0; i < ELF_CACHE_ENTRIES; i++) {
+        if (!image_cache[i]) {
+            slot = i;
+            break;
+        }
+        if (image_cache[i]->last_used < image_cache[slot]->last_used) {
+            slot = i;
+        }
+    }
+    if (image_cache[slot]) {
+        image_put_locked(image_cache[slot]);
+        image_stats.evictions++;
+    } else {
+        image_stats.entries++;
+    }
+    image_cache[slot] = image;
+
+    image_lock_release(flags);
+    return image;
+}
+
+// Point an elf_file_t at validated headers
+static void elf_use_headers(elf_file_t *elf, void *headers, size_t header_bytes, uint32_t ino) {
+    memset(elf, 0, sizeof(elf_file_t));
+    elf->data = headers;
+    elf->size = header_bytes;
+    elf->ino = ino;
+    memcpy(&elf->header, headers, sizeof(elf64_ehdr_t));
+}
+
+// Parse the headers of an executable on disk, its segments are paged in when touched
+// (section headers are not read, symbols are only available for images in memory). Headers
+// of a file that has not changed since its last exec come from the image cache.
 bool elf_parse_file(const char *filename, elf_file_t *elf) {
     if (!filename || !elf) {
         LOG_ERROR_MSG("Invalid filename or ELF structure");
@@ -197,102 +330,69 @@ bool elf_parse_file(const char *filename, elf_file_t *elf) {
         return false;
     }
     
-    // Read the ELF header first to validate and get file info
-    elf64_ehdr_t header;
-    ssize_t header_bytes = ext2_read(fd, &header, sizeof(elf64_ehdr_t));
-    
-    if (header_bytes != sizeof(elf64_ehdr_t)) {
-        LOG_ERROR("Failed to read ELF header");
+    ext2_file_t *file = ext2_get_file(fd);
+    if (!file || !file->inode || !file->cached) {
         ext2_close(fd);
         return false;
     }
+    uint32_t ino = file->inode_num;
+    ext2_inode_t inode = *file->inode;
+    uint64_t write_seq = file->cached->write_seq;
     
-    // Validate the header
-    if (!elf_validate_header(&header)) {
-        LOG_ERROR_MSG("Invalid ELF header");
+    elf_image_t *image = image_get(&inode, ino, write_seq);
+    if (image) {
         ext2_close(fd);
-        return false;
-    }
-    
-    // Reopen the file to reset position
-    ext2_close(fd);
-    fd = ext2_open(filename, EXT2_O_RDONLY);
-    if (fd < 0) {
-        LOG_ERROR("Failed to reopen ELF file: %s", filename);
-        return false;
+        elf_use_headers(elf, image->headers, image->header_bytes, ino);
+        elf_load_program_headers(elf);
+        elf->image = image;
+        return true;
     }
     
-    // Allocate an initial buffer - we'll start with a reasonable size and expand if needed
-    size_t initial_size = 64 * 1024; // 64 KB initial buffer
-    void *file_data = pmm_alloc_pages((initial_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
-    if (!file_data) {
-        LOG_ERROR("Failed to allocate memory for ELF file");
+    void *headers = kmalloc(ELF_HEADER_MAX);
+    if (!headers) {
+        LOG_ERROR("Failed to allocate memory for ELF headers");
         ext2_close(fd);
         return false;
     }
     
-    // Read file in chunks
-    size_t total_read = 0;
-    size_t buffer_size = initial_size;
-    ssize_t bytes_read;
-    
-    while ((bytes_read = ext2_read(fd, (uint8_t*)file_data + total_read, 
-                                  buffer_size - total_read)) > 0) {
-        total_read += bytes_read;
-        
-        // Check if we need to expand the buffer
-        if (total_read >= buffer_size) {
-            // Expand buffer by 64 KB
-            size_t new_size = buffer_size + 64 * 1024;
-            void *new_data = pmm_alloc_pages((new_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
-            
-            if (!new_data) {
-                LOG_ERROR("Failed to expand buffer for ELF file");
-                pmm_free_pages(file_data, (buffer_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
-                ext2_close(fd);
-                return false;
-            }
-            
-            // Copy existing data to new buffer
-            memcpy(new_data, file_data, total_read);
-            
-            // Free old buffer
-            pmm_free_pages(file_data, (buffer_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
-            
-            // Update pointers and sizes
-            file_data = new_data;
-            buffer_size = new_size;
-        }
-    }
-    
-    // Close the file
+    // The ELF header and the program headers sit at the start of the file
+    ssize_t header_bytes = ext2_read(fd, headers, ELF_HEADER_MAX);
     ext2_close(fd);
     
-    // Parse the file from memory
-    bool result = elf_parse_memory(file_data, total_read, elf);
+    if (header_bytes < (ssize_t)sizeof(elf64_ehdr_t) || !elf_validate_header((elf64_ehdr_t*)headers)) {
+        LOG_ERROR_MSG("Invalid ELF header");
+        kfree(headers);
+        return false;
+    }
     
-    // If parsing failed, free the allocated memory
-    if (!result) {
-        pmm_free_pages(file_data, (total_read + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
+    elf_use_headers(elf, headers, (size_t)header_bytes, ino);
+    if (!elf_load_program_headers(elf)) {
+        LOG_ERROR("Program headers of %s are not within the first %u bytes", filename, ELF_HEADER_MAX);
+        kfree(headers);
+        memset(elf, 0, sizeof(elf_file_t));
+        return false;
     }
+    elf->image = image_insert(&inode, ino, write_seq, headers, (size_t)header_bytes);
     
-    return result;
+    LOG_INFO("Parsed ELF file %s: entry=0x%llX, %u program headers",
+             filename, elf->header.e_entry, elf->header.e_phnum);
+    return true;
 }
 
-bool elf_load(elf_file_t *elf, uint64_t base_addr) {
-    if (!elf || !elf->program_headers) {
+bool elf_load(elf_file_t *elf, mm_t *mm, uint64_t base_addr) {
+    if (!elf || !elf->program_headers || !mm) {
         LOG_ERROR_MSG("Invalid ELF file or no program headers");
         return false;
     }
     
     // Store base address
     elf->base_addr = base_addr;
+    elf->mm = mm;
     
     // Load program segments
-    if (!elf_load_segments(elf, base_addr)) {
+    if (!elf_load_segments(elf, mm, base_addr)) {
         return false;
     }
-    
     // Calculate entry point
     elf->entry_point = (void*)(elf->header.e_entry + 
                               (elf->header.e_type == ET_DYN ? base_addr : 0));
@@ -303,7 +403,9 @@ bool elf_load(elf_file_t *elf, uint64_t base_addr) {
     return true;
 }
 
-static bool elf_load_segments(elf_file_t *elf, uint64_t base_addr) {
+// Describe the PT_LOAD segments as areas of the address space. File images are paged in
+// from the page cache on first touch, images in memory are copied in up front.
+static bool elf_load_segments(elf_file_t *elf, mm_t *mm, uint64_t base_addr) {
     elf->top_addr = 0;
     
     // Process all program headers
@@ -311,7 +413,7 @@ static bool elf_load_segments(elf_file_t *elf, uint64_t base_addr) {
         elf64_phdr_t *phdr = &elf->program_headers[i];
         
         // Only load PT_LOAD segments
-        if (phdr->p_type != PT_LOAD) {
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
         }
         
@@ -321,69 +423,67 @@ static bool elf_load_segments(elf_file_t *elf, uint64_t base_addr) {
             vaddr += base_addr;
         }
         
-        // Calculate size in pages (rounded up)
-        size_t page_size = PAGE_SIZE_4K;
-        size_t segment_size = phdr->p_memsz;
-        size_t pages = (segment_size + page_size - 1) / page_size;
+        // Areas start on a page, the file offset moves back by as much as the address
+        uint64_t page_vaddr = vaddr & ~(PAGE_SIZE_4K - 1);
+        uint64_t lead = vaddr - page_vaddr;
+        uint64_t length = lead + phdr->p_memsz;
         
-        // Allocate memory
-        void *segment_memory = pmm_alloc_pages(pages);
-        if (!segment_memory) {
-            LOG_ERROR("Failed to allocate memory for segment");
+        uint32_t flags = VMA_READ;
+        if (phdr->p_flags & PF_W) flags |= VMA_WRITE;
+        if (phdr->p_flags & PF_X) flags |= VMA_EXEC;
+        
+        if (phdr->p_filesz > phdr->p_memsz) {
+            LOG_ERROR("Segment %d has more file data than memory", i);
             return false;
         }
         
-        // Clear memory
-        memset(segment_memory, 0, pages * page_size);
-        
-        // Copy segment data
-        if (phdr->p_filesz > 0) {
-            // Check bounds
+        if (elf->ino) {
+            if ((phdr->p_offset & (PAGE_SIZE_4K - 1)) != lead) {
+                LOG_ERROR("Segment %d is not aligned like its file offset", i);
+                return false;
+            }
+            
+            // Everything past p_filesz (the BSS) reads as zero
+            if (!vma_map_file(mm, page_vaddr, length, flags, elf->ino,
+                              phdr->p_offset - lead, lead + phdr->p_filesz)) {
+                return false;
+            }
+        } else {
             if (phdr->p_offset + phdr->p_filesz > elf->size) {
                 LOG_ERROR("Segment data outside file bounds");
-                pmm_free_pages(segment_memory, pages);
                 return false;
             }
             
-            // Copy data
-            void *segment_data = (uint8_t*)elf->data + phdr->p_offset;
-            memcpy(segment_memory, segment_data, phdr->p_filesz);
-        }
-        
-        // Map segment to virtual memory
-        uint64_t flags = VMM_FLAG_PRESENT;
-        if (phdr->p_flags & PF_W) flags |= VMM_FLAG_WRITABLE;
-        if (!(phdr->p_flags & PF_X)) flags |= VMM_FLAG_NO_EXECUTE;
-        
-        // Align virtual address to page boundary
-        uint64_t page_vaddr = vaddr & ~(page_size - 1);
-        
-        // Map pages
-        for (size_t j = 0; j < pages; j++) {
-            uint64_t page_phys = (uint64_t)segment_memory + j * page_size;
-            uint64_t page_virt = page_vaddr + j * page_size;
-            
-            if (!vmm_map_page(page_virt, page_phys, flags)) {
-                LOG_ERROR("Failed to map segment page to virtual memory");
+            // Only the pages holding file data are backed now, the BSS is zero-filled on fault
+            if (!vma_map_anon(mm, page_vaddr, length, flags) ||
+                !vma_copy_to(mm, vaddr, (uint8_t*)elf->data + phdr->p_offset, phdr->p_filesz)) {
+                LOG_ERROR("Failed to load segment %d", i);
                 return false;
             }
         }
         
         // Update top address
-        uint64_t segment_end = vaddr + segment_size;
+        uint64_t segment_end = vaddr + phdr->p_memsz;
         if (segment_end > elf->top_addr) {
             elf->top_addr = segment_end;
         }
         
-        LOG_DEBUG("Loaded segment %d: vaddr=0x%llX, size=%zu, flags=0x%llX", 
-                 i, vaddr, segment_size, flags);
+        LOG_DEBUG("Loaded segment %d: vaddr=0x%llX, size=%zu, flags=0x%X", 
+                 i, vaddr, phdr->p_memsz, flags);
+    }
+    
+    // The heap starts on the page after the image
+    uint64_t brk = (elf->top_addr + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    if (brk > mm->brk_start) {
+        mm->brk_start = brk;
+        mm->brk = brk;
     }
     
     return true;
 }
 
 bool elf_unload(elf_file_t *elf) {
-    if (!elf || elf->base_addr == 0) {
+    if (!elf || elf->base_addr == 0 || !elf->mm) {
         return false;
     }
     
@@ -392,7 +492,7 @@ bool elf_unload(elf_file_t *elf) {
         elf64_phdr_t *phdr = &elf->program_headers[i];
         
         // Only unload PT_LOAD segments
-        if (phdr->p_type != PT_LOAD) {
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
         }
         
@@ -402,34 +502,15 @@ bool elf_unload(elf_file_t *elf) {
             vaddr += elf->base_addr;
         }
         
-        // Calculate size in pages (rounded up)
-        size_t page_size = PAGE_SIZE_4K;
-        size_t segment_size = phdr->p_memsz;
-        size_t pages = (segment_size + page_size - 1) / page_size;
-        
-        // Align virtual address to page boundary
-        uint64_t page_vaddr = vaddr & ~(page_size - 1);
-        
-        // Unmap pages and free physical memory
-        for (size_t j = 0; j < pages; j++) {
-            uint64_t page_virt = page_vaddr + j * page_size;
-            uint64_t page_phys = vmm_get_physical_address(page_virt);
-            
-            if (page_phys) {
-                // Unmap page
-                vmm_unmap_page(page_virt);
-                
-                // Free physical memory (only once per contiguous block)
-                if (j == 0 || vmm_get_physical_address(page_virt - page_size) != page_phys - page_size) {
-                    pmm_free_page((void*)page_phys);
-                }
-            }
-        }
+        // The areas go, and with them whatever pages were faulted in
+        uint64_t page_vaddr = vaddr & ~(PAGE_SIZE_4K - 1);
+        vma_unmap(elf->mm, page_vaddr, vaddr - page_vaddr + phdr->p_memsz);
     }
     
     // Reset base address
     elf->base_addr = 0;
     elf->top_addr = 0;
+    elf->mm = NULL;
     
     return true;
 }
@@ -444,10 +525,22 @@ void elf_free(elf_file_t *elf) {
         elf_unload(elf);
     }
     
-    // Free file data
-    if (elf->data) {
-        pmm_free_pages(elf->data, (elf->size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
-        elf->data = NULL;
+    elf_close(elf);
+}
+
+// Drop the headers of a parsed ELF, segments already loaded stay mapped
+void elf_close(elf_file_t *elf) {
+    if (!elf) {
+        return;
+    }
+    
+    // Only the headers read by elf_parse_file belong to the ELF, memory images to the caller
+    if (elf->image) {
+        uint64_t flags = image_lock_acquire();
+        image_put_locked(elf->image);
+        image_lock_release(flags);
+    } else if (elf->data && elf->ino) {
+        kfree(elf->data);
     }
     
     // Reset structure
@@ -479,4 +572,25 @@ void *elf_get_symbol_address(elf_file_t *elf, const char *symbol_name) {
     }
     
     return NULL;
-}
\ No newline at end of file
+}
+
+// Get executable image cache statistics
+void elf_cache_get_stats(elf_cache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    
+    uint64_t flags = image_lock_acquire();
+    *stats = image_stats;
+    image_lock_release(flags);
+}
+
+// Print executable image cache statistics
+void elf_cache_print_stats(void) {
+    elf_cache_stats_t stats;
+    elf_cache_get_stats(&stats);
+    
+    LOG_INFO("ELF image cache: %u of %u entries, %u hits, %u misses, %u stale, %u evictions",
+             (uint32_t)stats.entries, ELF_CACHE_ENTRIES, (uint32_t)stats.hits, (uint32_t)stats.misses,
+             (uint32_t)stats.stale, (uint32_t)stats.evictions);
+}
@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+struct mm;
+struct elf_image;
+
 // ELF file magic number
 #define ELF_MAGIC 0x464C457F // "\x7FELF" in little endian
 
@@ -28,6 +31,15 @@
 #define EM_386      3  // Intel 80386
 #define EM_X86_64   62 // AMD x86-64
 
+// Load address of position-independent executables
+#define ELF_DYN_BASE 0x400000ULL
+
+// Largest header area elf_parse_file reads, program headers must lie within it
+#define ELF_HEADER_MAX 4096
+
+// Executables whose parsed headers elf_parse_file keeps for the next exec
+#define ELF_CACHE_ENTRIES 16
+
 // Program header types
 #define PT_NULL     0 // Unused entry
 #define PT_LOAD     1 // Loadable segment
@@ -66,6 +78,12 @@
 #define SHF_ALLOC       0x2 // Occupies memory during execution
 #define SHF_EXECINSTR   0x4 // Executable
 
+// Symbol types, the low nibble of st_info
+#define STT_NOTYPE      0 // Unspecified, what assembly labels get
+#define STT_OBJECT      1 // Data object
+#define STT_FUNC        2 // Function
+#define ELF64_ST_TYPE(info) ((info) & 0xF)
+
 // ELF64 header structure
 typedef struct {
     uint8_t  e_ident[16]; // Magic number and other info
@@ -134,14 +152,29 @@ typedef struct {
     void *entry_point;            // Entry point
     uint64_t base_addr;           // Base address
     uint64_t top_addr;            // Top address (highest address used)
+    uint32_t ino;                 // Inode the segments are paged in from, 0 for images in memory
+    struct mm *mm;                // Address space the segments are loaded into
+    struct elf_image *image;      // Cached headers data points into, NULL when data is private
 } elf_file_t;
 
+// Executable image cache statistics
+typedef struct {
+    size_t hits;                  // Parses served from cached headers
+    size_t misses;                // Parses that read the file
+    size_t stale;                 // Entries dropped because the file changed
+    size_t evictions;             // Entries dropped to make room
+    size_t entries;               // Entries cached now
+} elf_cache_stats_t;
+
 // ELF file functions
 bool elf_parse_memory(void *data, size_t size, elf_file_t *elf);
 bool elf_parse_file(const char *filename, elf_file_t *elf);
-bool elf_load(elf_file_t *elf, uint64_t base_addr);
+bool elf_load(elf_file_t *elf, struct mm *mm, uint64_t base_addr);
 bool elf_unload(elf_file_t *elf);
 void elf_free(elf_file_t *elf);
+void elf_close(elf_file_t *elf);
+void elf_cache_get_stats(elf_cache_stats_t *stats);
+void elf_cache_print_stats(void);
 void *elf_get_symbol_address(elf_file_t *elf, const char *symbol_name);
 char *elf_get_section_name(elf_file_t *elf, elf64_shdr_t *section);
 
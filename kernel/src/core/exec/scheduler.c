@@ -1,26 +1,55 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
 #include <core/exec/scheduler.h>
 #include <core/exec/elf.h>
+#include <core/exec/vdso.h>
+#include <core/exec/uring.h>
+#include <fs/vfs.h>
 #include <memory/vmm.h>
 #include <memory/pmm.h>
+#include <memory/slab.h>
+#include <memory/vma.h>
+#include <core/cpu.h>
+#include <core/fpu.h>
+#include <core/smp.h>
+#include <core/gdt.h>
 #include <drivers/timer/timer.h>
 #include <utils/log.h>
+#include <utils/trace.h>
 #include <lib/string.h>
+#include <lib/asm.h>
 
 // Default time quantum in timer ticks
 #define DEFAULT_TIME_QUANTUM 20
 
-// Task table
-static task_t task_table[TASK_MAX_COUNT];
+// Task table, task structures come from a dedicated slab cache
+static task_t* task_table[TASK_MAX_COUNT];
+static kmem_cache_t* task_cache = NULL;
 static uint32_t next_tid = 1;
-static task_t* current_task = NULL;
-static task_t* idle_task = NULL;
 
-// Task queues
-static task_t* ready_queue_head = NULL;
-static task_t* ready_queue_tail = NULL;
+// Per-CPU scheduling state
+static task_t* current_task[MAX_CPUS];
+static task_t* idle_task[MAX_CPUS];
+static task_t* switch_prev[MAX_CPUS];      // Task whose context is being saved on each CPU
+static bool preempting[MAX_CPUS];          // The tick is switching away, the switch is involuntary
+
+// Run queue of one CPU, one FIFO list per priority level, its lock guards all of them
+typedef struct run_queue {
+    spinlock_t lock;
+    task_t* head[TASK_PRIORITY_COUNT];
+    task_t* tail[TASK_PRIORITY_COUNT];
+    volatile uint32_t bitmap;           // Bit of every non-empty level, see level_bit
+    volatile uint32_t count;
+    volatile bool online;               // The CPU schedules from this queue
+} run_queue_t;
+
+static run_queue_t run_queues[MAX_CPUS];
+
+// Tasks waiting for an event, guarded by task_lock
 static task_t* blocked_queue_head = NULL;
 
-// Task table lock
+// Task table lock, taken before any run queue lock. Wakeups take it from interrupt handlers,
+// so it is only ever held with interrupts off.
 static spinlock_t task_lock;
 
 // Scheduler statistics
@@ -31,6 +60,13 @@ void add_to_ready_queue(task_t* task);
 void free_task_resources(task_t* task);
 void remove_from_blocked_queue(task_t* task);
 void context_switch(task_t* next);
+static void add_to_blocked_queue(task_t* task);
+static task_t* find_task(uint32_t tid);
+static void finish_switch(void);
+static void release_kernel_stack(task_t* task);
+static uint64_t kernel_stack_top(task_t* task);
+static inline uint32_t level_bit(task_priority_t priority);
+static void decay_priority(task_t* task);
 
 // Scheduler configuration
 static scheduler_config_t scheduler_config = {
@@ -43,7 +79,12 @@ static scheduler_config_t scheduler_config = {
 };
 
 task_t* scheduler_get_current_task(void) {
-    return current_task;
+    return current_task[cpu_current_id()];
+}
+
+// Task running on a CPU, for callers that cannot trust the GS base (NMI handlers)
+task_t* scheduler_get_cpu_task(uint32_t cpu) {
+    return cpu < MAX_CPUS ? current_task[cpu] : NULL;
 }
 
 // Timer callback for preemptive scheduling
@@ -52,24 +93,29 @@ static void timer_callback(uint64_t tick_count) {
 
     // Update scheduler statistics
     scheduler_stats.ticks_since_boot++;
+    vdso_update();
 
-    // Check if we need to schedule another task
-    if (current_task && current_task->state == TASK_STATE_RUNNING) {
-        current_task->cpu_time++;
+    uint32_t cpu = cpu_current_id();
+    task_t* current = current_task[cpu];
 
-        // If the task has used its time quantum, reschedule
-        if (current_task->cpu_time - current_task->last_schedule >= current_task->quantum) {
-            // Move current task back to ready queue
-            spinlock_acquire(&task_lock);
-
-            if (current_task != idle_task) {
-                current_task->state = TASK_STATE_READY;
-                add_to_ready_queue(current_task);
+    // Check if we need to schedule another task
+    if (current && current->state == TASK_STATE_RUNNING) {
+        current->cpu_time++;
+
+        // Reschedule when the quantum is used up or a higher priority task is waiting
+        bool expired = current->cpu_time - current->last_schedule >= current->quantum;
+        bool preempted = (run_queues[cpu].bitmap & (level_bit(current->dynamic_priority) - 1)) != 0;
+        if (expired || preempted) {
+            // Move current task back to its run queue
+            if (current != idle_task[cpu]) {
+                if (expired) {
+                    decay_priority(current);
+                }
+                add_to_ready_queue(current);
             }
 
-            spinlock_release(&task_lock);
-
             // Schedule next task
+            preempting[cpu] = true;
             schedule_next();
         }
     } else {
@@ -80,59 +126,250 @@ static void timer_callback(uint64_t tick_count) {
 
 // Helper Functions (submodule: extra)
 
-void add_to_ready_queue(task_t* task) {
-    if (!task) return;
+// Bitmap bit of a priority level, higher priorities get lower bits so ctz finds the best
+static inline uint32_t level_bit(task_priority_t priority) {
+    return 1U << (TASK_PRIORITY_REALTIME - priority);
+}
+
+// Highest priority level with a queued task, bitmap must not be empty
+static inline task_priority_t best_level(uint32_t bitmap) {
+    return (task_priority_t)(TASK_PRIORITY_REALTIME - __builtin_ctz(bitmap));
+}
+
+// A task that wakes from a wait gets one level above its base
+static void boost_priority(task_t* task) {
+    if (task->base_priority == TASK_PRIORITY_REALTIME) {
+        return;
+    }
+
+    task_priority_t ceiling = task->base_priority < TASK_PRIORITY_HIGH ?
+                              task->base_priority + 1 : task->base_priority;
+    if (task->dynamic_priority < ceiling) {
+        task->dynamic_priority = ceiling;
+    }
+}
+
+// A task that burns its whole quantum drifts down to one level below its base
+static void decay_priority(task_t* task) {
+    if (task->base_priority == TASK_PRIORITY_REALTIME) {
+        return;
+    }
+
+    task_priority_t floor = task->base_priority > TASK_PRIORITY_LOW ?
+                            task->base_priority - 1 : task->base_priority;
+    if (task->dynamic_priority > floor) {
+        task->dynamic_priority--;
+    }
+}
+
+// Link a task at the tail of its priority level, rq->lock must be held
+static void enqueue_task(run_queue_t* rq, task_t* task) {
+    task_priority_t level = task->dynamic_priority;
 
     task->next = NULL;
+    task->prev = rq->tail[level];
 
-    if (!ready_queue_head) {
-        // Queue is empty
-        ready_queue_head = task;
-        ready_queue_tail = task;
-        task->prev = NULL;
+    if (rq->tail[level]) {
+        rq->tail[level]->next = task;
     } else {
-        // Add to the end of the queue
-        ready_queue_tail->next = task;
-        task->prev = ready_queue_tail;
-        ready_queue_tail = task;
+        rq->head[level] = task;
+        rq->bitmap |= level_bit(level);
     }
+    rq->tail[level] = task;
 
+    task->rq = rq;
     task->state = TASK_STATE_READY;
+    task->acct.queued = cpu_rdtsc();
+    rq->count++;
+}
+
+// Unlink a task from its run queue, rq->lock must be held
+static void dequeue_task(run_queue_t* rq, task_t* task) {
+    task_priority_t level = task->dynamic_priority;
+
+    if (task->prev) {
+        task->prev->next = task->next;
+    } else {
+        rq->head[level] = task->next;
+    }
+
+    if (task->next) {
+        task->next->prev = task->prev;
+    } else {
+        rq->tail[level] = task->prev;
+    }
+
+    if (!rq->head[level]) {
+        rq->bitmap &= ~level_bit(level);
+    }
+
+    task->next = NULL;
+    task->prev = NULL;
+    task->rq = NULL;
+    rq->count--;
+}
+
+// Wake the CPU owning a queue if it idles, or else an idle CPU that can steal the task
+static void kick_idle_cpu(uint32_t cpu, uint32_t queued) {
+    uint32_t self = cpu_current_id();
+    if (cpu != self && current_task[cpu] == idle_task[cpu]) {
+        smp_send_resched(cpu);
+        return;
+    }
+    // The executing CPU picks from its own queue next, leave it one task
+    if (queued < (cpu == self ? 2U : 1U)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (i != self && i != cpu && run_queues[i].online && run_queues[i].count == 0 &&
+            current_task[i] == idle_task[i]) {
+            smp_send_resched(i);
+            return;
+        }
+    }
 }
 
+// Queue a task on the CPU it last ran on, safe to call from interrupt handlers
+void add_to_ready_queue(task_t* task) {
+    if (!task) return;
+
+    run_queue_t* rq = &run_queues[task->cpu];
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&rq->lock);
+    enqueue_task(rq, task);
+    uint32_t queued = rq->count;
+    spinlock_release(&rq->lock);
+
+    // A tickless idle CPU only notices new work when something wakes it
+    kick_idle_cpu(task->cpu, queued);
+    cpu_irq_restore(flags);
+}
+
+// Take a task off whichever run queue holds it
 void remove_from_ready_queue(task_t* task) {
     if (!task) return;
 
-    if (task == ready_queue_head) {
-        // Task is at the head of the queue
-        ready_queue_head = task->next;
-        if (ready_queue_head) {
-            ready_queue_head->prev = NULL;
-        } else {
-            // Queue is now empty
-            ready_queue_tail = NULL;
+    uint64_t flags = cpu_irq_save();
+
+    // A stealing CPU can move the task between reading the queue and locking it
+    for (;;) {
+        run_queue_t* rq = task->rq;
+        if (!rq) {
+            break;
         }
-    } else if (task == ready_queue_tail) {
-        // Task is at the tail of the queue
-        ready_queue_tail = task->prev;
-        if (ready_queue_tail) {
-            ready_queue_tail->next = NULL;
-        } else {
-            // Queue is now empty
-            ready_queue_head = NULL;
+
+        spinlock_acquire(&rq->lock);
+        if (task->rq == rq) {
+            dequeue_task(rq, task);
+            spinlock_release(&rq->lock);
+            break;
         }
-    } else {
-        // Task is in the middle of the queue
-        if (task->prev) {
-            task->prev->next = task->next;
+        spinlock_release(&rq->lock);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+// Pick the online CPU with the shortest run queue for a new task
+static uint32_t select_cpu(void) {
+    uint32_t best = cpu_current_id();
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (run_queues[i].online && run_queues[i].count < run_queues[best].count) {
+            best = i;
         }
-        if (task->next) {
-            task->next->prev = task->prev;
+    }
+
+    return best;
+}
+
+// Take the first task of the highest non-empty level of the executing CPU's queue
+static task_t* pick_local_task(uint32_t cpu) {
+    run_queue_t* rq = &run_queues[cpu];
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+
+    spinlock_acquire(&rq->lock);
+    task_t* task = NULL;
+    if (rq->bitmap) {
+        task = rq->head[best_level(rq->bitmap)];
+        dequeue_task(rq, task);
+    }
+    spinlock_release(&rq->lock);
+
+    return task;
+}
+
+// Take a task from the busiest other CPU, starting at the tail where tasks are coldest
+static task_t* steal_task(uint32_t cpu) {
+    run_queue_t* busiest = NULL;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        run_queue_t* rq = &run_queues[i];
+        if (i == cpu || !rq->online || rq->count == 0) {
+            continue;
+        }
+        if (!busiest || rq->count > busiest->count) {
+            busiest = rq;
         }
     }
 
-    task->next = NULL;
-    task->prev = NULL;
+    if (!busiest) {
+        return NULL;
+    }
+
+    spinlock_acquire(&busiest->lock);
+
+    // Highest level first, a task still on_cpu has not finished saving its registers
+    task_t* task = NULL;
+    uint32_t levels = busiest->bitmap;
+    while (levels && !task) {
+        task_priority_t level = best_level(levels);
+        levels &= levels - 1;
+
+        task = busiest->tail[level];
+        while (task && task->on_cpu) {
+            task = task->prev;
+        }
+    }
+    if (task) {
+        dequeue_task(busiest, task);
+        task->cpu = cpu;
+        scheduler_stats.migrations++;
+    }
+
+    spinlock_release(&busiest->lock);
+    return task;
+}
+
+// Create the idle task of a CPU from the context it is running in
+static task_t* create_idle_task(uint32_t cpu) {
+    task_t* idle = kmem_cache_alloc(task_cache);
+    if (!idle) {
+        LOG_ERROR("Failed to allocate idle task for CPU %u", cpu);
+        return NULL;
+    }
+    memset(idle, 0, sizeof(task_t));
+
+    idle->tid = 0;
+    idle->state = TASK_STATE_RUNNING;
+    idle->cpu = cpu;
+    idle->on_cpu = true;
+    strncpy(idle->name, "idle_task", sizeof(idle->name) - 1);
+
+    // The idle task already has a context (current kernel execution context)
+    idle->context.cr3 = vmm_get_current_address_space();
+
+    // Set up other fields
+    idle->quantum = UINT64_MAX; // Idle task runs until another task is ready
+    idle->base_priority = TASK_PRIORITY_IDLE;
+    idle->dynamic_priority = TASK_PRIORITY_IDLE;
+
+    idle_task[cpu] = idle;
+    current_task[cpu] = idle;
+    return idle;
 }
 
 // Initialize the scheduler
@@ -142,8 +379,18 @@ bool scheduler_init(void) {
     // Initialize task table
     memset(task_table, 0, sizeof(task_table));
 
-    // Initialize spinlock
+    task_cache = kmem_cache_create("task", sizeof(task_t), KMEM_CACHE_ALIGN);
+    if (!task_cache) {
+        LOG_ERROR("Failed to create task cache");
+        return false;
+    }
+
+    // Initialize spinlocks and the per-CPU run queues
     spinlock_init(&task_lock);
+    memset(run_queues, 0, sizeof(run_queues));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spinlock_init(&run_queues[i].lock);
+    }
 
     // Register timer callback for preemptive scheduling
     timer_register_callback(timer_callback);
@@ -151,31 +398,75 @@ bool scheduler_init(void) {
     // Initialize timer with the configured tick rate
     timer_init(scheduler_config.tick_rate);
 
-    // Create idle task
-    idle_task = &task_table[0]; // Reserve slot 0 for idle
-    memset(idle_task, 0, sizeof(task_t));
+    // Create the BSP's idle task
+    uint32_t cpu = cpu_current_id();
+    task_t* idle = create_idle_task(cpu);
+    if (!idle) {
+        return false;
+    }
+    task_table[0] = idle; // Reserve slot 0 for idle
 
-    idle_task->tid = 0;
-    idle_task->state = TASK_STATE_READY;
-    strncpy(idle_task->name, "idle_task", sizeof(idle_task->name) - 1);
+    LOG_DEBUG("Idle kernel task created with TID 0 and task state RUNNING");
 
-    LOG_DEBUG("Idle kernel task created with TID 0 and task state READY");
+    run_queues[cpu].online = true;
 
-    // The idle task already has a context (current kernel execution context)
-    idle_task->context.cr3 = vmm_get_current_address_space();
+    LOG_INFO("Scheduler initialized successfully");
+    return true;
+}
 
-    // Set up other fields
-    idle_task->quantum = UINT64_MAX; // Idle task runs until another task is ready
-    idle_task->base_priority = TASK_PRIORITY_IDLE;
-    idle_task->dynamic_priority = TASK_PRIORITY_IDLE;
+// Give an application processor its idle task and start scheduling onto it
+bool scheduler_init_cpu(void) {
+    uint32_t cpu = cpu_current_id();
+    if (!task_cache || cpu >= MAX_CPUS) {
+        return false;
+    }
 
-    // Set as idle task
-    current_task = idle_task;
+    if (!create_idle_task(cpu)) {
+        return false;
+    }
 
-    LOG_INFO("Scheduler initialized successfully");
+    run_queues[cpu].online = true;
     return true;
 }
 
+// Idle loop of a CPU, runs queued work, steals from busier CPUs and otherwise halts tickless
+void scheduler_idle(void) {
+    for (;;) {
+        uint32_t cpu = cpu_current_id();
+        bool work = run_queues[cpu].count > 0;
+
+        for (uint32_t i = 0; i < MAX_CPUS && !work; i++) {
+            work = run_queues[i].online && run_queues[i].count > 0;
+        }
+
+        if (work) {
+            uint64_t flags = cpu_irq_save();
+            schedule_next();
+            cpu_irq_restore(flags);
+            continue;
+        }
+
+        // Idle time tops up the serial FIFO, the transmit interrupt sends the rest
+        log_drain();
+
+        // And clears pages ahead for zeroed allocations, a few at a time so new work is
+        // noticed soon
+        if (pmm_zero_refill(PMM_ZERO_BATCH) > 0) {
+            continue;
+        }
+
+        // Nothing to run: stop the tick and sleep until the next timer event or a kick,
+        // sti only takes effect after hlt so a wakeup cannot slip in between
+        __asm__ volatile("cli");
+        if (run_queues[cpu].count == 0) {
+            timer_idle_enter();
+            __asm__ volatile("sti; hlt; cli");
+            timer_idle_exit();
+        }
+        __asm__ volatile("sti");
+    }
+}
+
 // Allocate a new task ID
 static uint32_t allocate_tid(void) {
     // Simple TID allocation: increment and wrap around if needed
@@ -202,59 +493,19 @@ static uintptr_t create_task_address_space(void) {
     return page_table;
 }
 
-// Create a stack for a task
-static void* create_task_stack(size_t stack_size, uintptr_t page_table) {
+// Create a stack for a task, a demand-zero area whose unmapped gap below is the guard
+static void* create_task_stack(size_t stack_size, mm_t* mm) {
     // Align stack size to page boundary
     stack_size = (stack_size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
 
-    // Allocate physical memory for the stack
-    size_t page_count = stack_size / PAGE_SIZE_4K;
-    void* stack_phys = pmm_alloc_pages(page_count);
-    if (!stack_phys) {
-        LOG_ERROR("Failed to allocate physical memory for task stack");
-        return NULL;
-    }
-
     // Define a virtual address for the stack (just below 2GB marker for user space)
     uint64_t stack_virt = 0x00000000EFFFF000ULL - stack_size + PAGE_SIZE_4K;
 
-    // Save current address space
-    uintptr_t old_cr3 = vmm_get_current_address_space();
-
-    // Switch to task address space
-    vmm_switch_address_space(page_table);
-
-    // Map stack pages into task address space
-    for (size_t i = 0; i < stack_size; i += PAGE_SIZE_4K) {
-        if (!vmm_map_page(stack_virt + i, (uint64_t)stack_phys + i, 
-                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER)) {
-            LOG_ERROR("Failed to map task stack page at 0x%lx", stack_virt + i);
-
-            // Clean up already mapped pages
-            for (size_t j = 0; j < i; j += PAGE_SIZE_4K) {
-                vmm_unmap_page(stack_virt + j);
-            }
-
-            // Switch back to original address space
-            vmm_switch_address_space(old_cr3);
-
-            // Free physical memory
-            pmm_free_pages(stack_phys, page_count);
-
-            return NULL;
-        }
-    }
-
-    // Add a guard page below the stack
-    uint64_t guard_virt = stack_virt - PAGE_SIZE_4K;
-    if (!vmm_map_page(guard_virt, 0, VMM_FLAG_PRESENT | VMM_FLAG_NO_EXECUTE)) {
-        LOG_WARN("Failed to create stack guard page");
-        // Continue anyway, this is just a protection feature
+    if (!vma_map_anon(mm, stack_virt, stack_size, VMA_READ | VMA_WRITE)) {
+        LOG_ERROR("Failed to add the task stack area at 0x%llx", stack_virt);
+        return NULL;
     }
 
-    // Switch back to original address space
-    vmm_switch_address_space(old_cr3);
-
     // Return the stack top (stacks grow downward)
     return (void*)(stack_virt + stack_size);
 }
@@ -347,22 +598,31 @@ static void init_task_context(task_t* task, uint64_t entry_point, uint64_t stack
     task->context.rsp = (uint64_t)stack_ptr_u64;
 }
 
-uint32_t scheduler_create_task(const void* elf_data, size_t elf_size, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]) {
-    spinlock_acquire(&task_lock);
-
-    // Find a free slot in the task table
+// Take a task table slot and reset it for a new task, task_lock must be held. An unused slot
+// takes the spare descriptor, which is then cleared.
+static task_t* alloc_task_locked(const char* name, task_priority_t priority, task_t** spare) {
+    // Find a free slot in the task table, reusing terminated tasks
     task_t* task = NULL;
-    for (int i = 0; i < TASK_MAX_COUNT; i++) {
-        if (task_table[i].state == TASK_STATE_TERMINATED || task_table[i].state == TASK_STATE_NEW) {
-            task = &task_table[i];
+    for (int i = 1; i < TASK_MAX_COUNT; i++) {
+        if (!task_table[i]) {
+            if (!*spare) {
+                continue;
+            }
+            task = *spare;
+            *spare = NULL;
+            task_table[i] = task;
+            break;
+        }
+        // A terminated task may still be switching away on its CPU, a new one is being set up
+        if (task_table[i]->state == TASK_STATE_TERMINATED && !task_table[i]->on_cpu) {
+            task = task_table[i];
             break;
         }
     }
 
     if (!task) {
-        spinlock_release(&task_lock);
         LOG_ERROR("No free task slots available");
-        return 0;
+        return NULL;
     }
 
     // Initialize the task structure
@@ -373,57 +633,267 @@ uint32_t scheduler_create_task(const void* elf_data, size_t elf_size, const char
     task->dynamic_priority = priority;
     task->quantum = scheduler_config.default_time_quantum;
     task->start_time = scheduler_stats.ticks_since_boot;
+    task->cpu = select_cpu();
     strncpy(task->name, name, sizeof(task->name) - 1);
+    return task;
+}
+
+// Take a slot for a task that is then set up without task_lock, so allocations and page faults
+// never happen under it. The slot stays TASK_STATE_NEW, which nobody reuses, until the task
+// is queued by publish_task or given up by discard_task.
+static task_t* reserve_task(const char* name, task_priority_t priority) {
+    // The descriptor for a slot never used before is allocated ahead of the lock
+    task_t* spare = kmem_cache_alloc(task_cache);
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    task_t* task = alloc_task_locked(name, priority, &spare);
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+
+    if (spare) {
+        kmem_cache_free(task_cache, spare);
+    }
+    return task;
+}
+
+// Queue a task set up after reserve_task, returns its ID
+static uint32_t publish_task(task_t* task) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    add_to_ready_queue(task);
+    scheduler_stats.total_tasks_created++;
+    scheduler_stats.current_task_count++;
+    uint32_t tid = task->tid;
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return tid;
+}
+
+// Undo a task that failed setup after reserve_task, its slot can be reused afterwards
+static void discard_task(task_t* task) {
+    free_task_resources(task);
+    __atomic_store_n(&task->state, TASK_STATE_TERMINATED, __ATOMIC_SEQ_CST);
+}
+
+// Create a task running a parsed ELF, its segments are mapped into a fresh address space
+static uint32_t create_task_from_elf(elf_file_t* elf, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]) {
+    task_t* task = reserve_task(name, priority);
+    if (!task) {
+        return 0;
+    }
 
     // Create a new address space for the task
     task->page_table = create_task_address_space();
     if (!task->page_table) {
-        spinlock_release(&task_lock);
         LOG_ERROR("Failed to create address space for task %u", task->tid);
+        discard_task(task);
+        return 0;
+    }
+
+    // Pages of the address space are backed from its areas when first touched
+    task->mm = mm_create(task->page_table);
+    if (!task->mm) {
+        LOG_ERROR("Failed to create memory map for task %u", task->tid);
+        discard_task(task);
+        return 0;
+    }
+
+    // Descriptors start out empty, working in the root
+    task->files = vfs_fdtable_create();
+    if (!task->files) {
+        LOG_ERROR("Failed to create descriptor table for task %u", task->tid);
+        discard_task(task);
+        return 0;
+    }
+
+    // System calls and interrupts from user mode run on a stack of the task's own, so it
+    // can sleep in the kernel without another task overwriting its frames
+    task->kernel_stack = pmm_alloc_pages(TASK_KERNEL_STACK_PAGES);
+    task->kernel_stack_pages = TASK_KERNEL_STACK_PAGES;
+    if (!task->kernel_stack) {
+        LOG_ERROR("Failed to create kernel stack for task %u", task->tid);
+        discard_task(task);
         return 0;
     }
 
     // Create a stack for the task
     task->stack_size = scheduler_config.user_stack_size;
-    task->stack_top = create_task_stack(task->stack_size, task->page_table);
+    task->stack_top = create_task_stack(task->stack_size, task->mm);
     if (!task->stack_top) {
-        vmm_delete_address_space(task->page_table);
-        spinlock_release(&task_lock);
         LOG_ERROR("Failed to create stack for task %u", task->tid);
+        discard_task(task);
         return 0;
     }
 
-    // Load the ELF binary into the task's address space
-    uint64_t entry_point;
-    if (!elf_load(elf_data, elf_size)) {
-        free_task_resources(task);
-        spinlock_release(&task_lock);
+    // Map the ELF segments into the task's address space, they are read in on demand
+    if (!elf_load(elf, task->mm, ELF_DYN_BASE)) {
         LOG_ERROR("Failed to load ELF for task %u", task->tid);
+        discard_task(task);
+        return 0;
+    }
+    uint64_t entry_point = (uint64_t)elf->entry_point;
+
+    // Clock reads and getpid run from the vDSO without entering the kernel
+    if (!vdso_map(task->mm, task->tid)) {
+        LOG_ERROR("Failed to map the vDSO for task %u", task->tid);
+        discard_task(task);
         return 0;
     }
 
-    // Initialize the task's context with proper stack setup for argv and envp
+    // Initialize the task's context with proper stack setup for argv and envp, the stack
+    // pages fault in as it is written
+    uint64_t old_space, flags;
+    mm_t* old_mm = mm_enter(task->mm, &old_space, &flags);
     init_task_context(task, entry_point, (uint64_t)task->stack_top, argc, argv, envp);
+    mm_leave(old_mm, old_space, flags);
 
-    // Add the task to the ready queue
-    add_to_ready_queue(task);
+    uint32_t tid = publish_task(task);
+    LOG_DEBUG("Created task %u: %s", tid, name);
+    return tid;
+}
 
-    // Update scheduler statistics
-    scheduler_stats.total_tasks_created++;
-    scheduler_stats.current_task_count++;
+uint32_t scheduler_create_task(const void* elf_data, size_t elf_size, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]) {
+    elf_file_t elf;
+    if (!elf_parse_memory((void*)elf_data, elf_size, &elf)) {
+        LOG_ERROR("Failed to parse ELF for task %s", name);
+        return 0;
+    }
+    return create_task_from_elf(&elf, name, priority, argc, argv, envp);
+}
 
-    spinlock_release(&task_lock);
+// Create a task running an executable on disk. Its headers come from the image cache when
+// the file is unchanged, and read-only pages map the page cache's frames, so instances of
+// one program only pay for the pages they write.
+uint32_t scheduler_create_task_from_file(const char* path, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]) {
+    // Parsed before a task slot is taken, so a bad file costs none
+    elf_file_t elf;
+    if (!elf_parse_file(path, &elf)) {
+        return 0;
+    }
+
+    uint32_t tid = create_task_from_elf(&elf, name, priority, argc, argv, envp);
+    elf_close(&elf);
+    return tid;
+}
+
+// Duplicate the current task, its memory is shared copy-on-write and the child starts in
+// entry on its kernel stack with a copy of frame on top
+uint32_t scheduler_fork_task(const void* frame, size_t frame_size, void (*entry)(void)) {
+    task_t* parent = scheduler_get_current_task();
+    if (!parent || !parent->page_table || !frame || !entry ||
+        frame_size + sizeof(uint64_t) > TASK_KERNEL_STACK_PAGES * PAGE_SIZE_4K) {
+        return 0;
+    }
+
+    task_t* child = reserve_task(parent->name, parent->base_priority);
+    if (!child) {
+        return 0;
+    }
+    child->argc = parent->argc;
+    child->argv = parent->argv;
+    child->envp = parent->envp;
+
+    // Only page tables are copied, frames are copied on the first write to them
+    child->page_table = vmm_clone_address_space(parent->page_table);
+    if (!child->page_table) {
+        LOG_ERROR("Failed to clone the address space of task %u", parent->tid);
+        discard_task(child);
+        return 0;
+    }
+    child->stack_top = parent->stack_top;
+    child->stack_size = parent->stack_size;
+
+    child->mm = mm_clone(parent->mm, child->page_table);
+    child->files = vfs_fdtable_clone(parent->files);  // Open files and positions are shared
+    child->kernel_stack = pmm_alloc_pages(TASK_KERNEL_STACK_PAGES);
+    child->kernel_stack_pages = TASK_KERNEL_STACK_PAGES;
+    if (!child->mm || !child->files || !vdso_fork(child->mm, child->tid) || !child->kernel_stack ||
+        !fpu_fork(parent, child)) {
+        LOG_ERROR("Out of memory forking task %u", parent->tid);
+        discard_task(child);
+        return 0;
+    }
+
+    // The ring stays with the parent, the child only inherited its mapping
+    uring_fork(parent, child);
+
+    // The first switch returns into entry with the frame right above the return address
+    uint64_t stack_top = kernel_stack_top(child);
+    uint64_t frame_base = (stack_top - frame_size) & ~0xFULL;  // Aligned for the calls entry makes
+    uint64_t rsp = frame_base - sizeof(uint64_t);
+    *(uint64_t*)rsp = (uint64_t)entry;
+    memcpy((void*)frame_base, frame, frame_size);
+
+    child->context = parent->context;
+    child->context.rsp = rsp;
+    child->context.rflags = 0x2;     // Interrupts stay off until entry returns to user mode
+    child->context.cr3 = child->page_table;
+
+    uint32_t tid = publish_task(child);
+    LOG_DEBUG("Forked task %u from %u", tid, parent->tid);
+    return tid;
+}
 
-    LOG_DEBUG("Created task %u: %s", task->tid, task->name);
-    return task->tid;
+// The first switch into a forked task skips context_switch's epilogue, its entry finishes it
+void scheduler_finish_fork(void) {
+    finish_switch();
+}
+
+// Start a kernel thread running entry(arg) on a stack of its own. It has no address space,
+// switching into it keeps whichever one the CPU has loaded.
+uint32_t scheduler_create_kthread(const char* name, void (*entry)(void*), void* arg, task_priority_t priority) {
+    if (!name || !entry) {
+        return 0;
+    }
+
+    task_t* task = reserve_task(name, priority);
+    if (!task) {
+        return 0;
+    }
+
+    task->kernel_stack = pmm_alloc_pages(TASK_KTHREAD_STACK_PAGES);
+    if (!task->kernel_stack) {
+        LOG_ERROR("Out of memory for the stack of kernel thread %s", name);
+        discard_task(task);
+        return 0;
+    }
+    task->kernel_stack_pages = TASK_KTHREAD_STACK_PAGES;
+
+    // The first switch returns into kthread_start, then the entry is called on an aligned stack
+    uint64_t stack_top = kernel_stack_top(task);
+    uint64_t rsp = stack_top - sizeof(uint64_t);
+    *(uint64_t*)rsp = (uint64_t)kthread_start;
+
+    task->context.rsp = rsp;
+    task->context.rbp = 0;               // Ends frame pointer walks
+    task->context.rbx = (uint64_t)entry;
+    task->context.r12 = (uint64_t)arg;
+    task->context.rflags = 0x2;          // kthread_start enables interrupts once the switch is done
+
+    return publish_task(task);
+}
+
+// A kernel thread's entry returned, the thread ends and its stack is freed after it switched away
+void scheduler_kthread_exit(void) {
+    task_t* self = scheduler_get_current_task();
+    if (self) {
+        scheduler_terminate_task(self->tid, 0);
+    }
+    scheduler_yield();
+
+    // Terminated tasks are never picked again
+    hcf();
 }
 
 bool scheduler_execute_task(uint32_t tid, int argc, char* argv[], char* envp[]) {
+    uint64_t flags = cpu_irq_save();
     spinlock_acquire(&task_lock);
 
-    task_t* task = scheduler_get_task_by_id(tid);
+    task_t* task = find_task(tid);
     if (!task || task->state != TASK_STATE_READY) {
         spinlock_release(&task_lock);
+        cpu_irq_restore(flags);
         LOG_ERROR("Task %u is not ready to execute", tid);
         return false;
     }
@@ -433,40 +903,44 @@ bool scheduler_execute_task(uint32_t tid, int argc, char* argv[], char* envp[])
     task->argv = argv;
     task->envp = envp;
 
-    // Switch to the task's context
-    context_switch(task);
-
     spinlock_release(&task_lock);
+
+    // Switch to the task's context, it runs on this CPU from now on. Interrupts stay off
+    // from the lookup on.
+    remove_from_ready_queue(task);
+    task->cpu = cpu_current_id();
+    context_switch(task);
+    cpu_irq_restore(flags);
     return true;
 }
 
+// Give up the CPU, no scheduler lock is held across the switch
 void scheduler_yield(void) {
-    spinlock_acquire(&task_lock);
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    task_t* current = current_task[cpu];
 
-    if (current_task && current_task->state == TASK_STATE_RUNNING) {
-        current_task->state = TASK_STATE_READY;
-        add_to_ready_queue(current_task);
+    if (current && current != idle_task[cpu] && current->state == TASK_STATE_RUNNING) {
+        add_to_ready_queue(current);
     }
 
     schedule_next();
-
-    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
 }
 
 bool scheduler_terminate_task(uint32_t tid, int exit_code) {
+    uint64_t flags = cpu_irq_save();
     spinlock_acquire(&task_lock);
 
-    task_t* task = scheduler_get_task_by_id(tid);
-    if (!task || task->state == TASK_STATE_TERMINATED) {
+    // A new task is still being set up by its creator, which undoes it on failure
+    task_t* task = find_task(tid);
+    if (!task || task->state == TASK_STATE_TERMINATED || task->state == TASK_STATE_NEW) {
         spinlock_release(&task_lock);
+        cpu_irq_restore(flags);
         LOG_ERROR("Task %u is already terminated or does not exist", tid);
         return false;
     }
 
-    // Set the task's state to terminated
-    task->state = TASK_STATE_TERMINATED;
-    task->exit_code = exit_code;
-
     // Remove the task from any queues
     if (task->state == TASK_STATE_READY) {
         remove_from_ready_queue(task);
@@ -474,6 +948,14 @@ bool scheduler_terminate_task(uint32_t tid, int exit_code) {
         remove_from_blocked_queue(task);
     }
 
+    // Set the task's state to terminated, ordered before free_task_resources looks at on_cpu
+    __atomic_store_n(&task->state, TASK_STATE_TERMINATED, __ATOMIC_SEQ_CST);
+    task->exit_code = exit_code;
+
+    // Closing the last descriptor of a file may sleep, the table goes after task_lock
+    vfs_fdtable_t* files = task->files;
+    task->files = NULL;
+
     // Free the task's resources
     free_task_resources(task);
 
@@ -481,23 +963,263 @@ bool scheduler_terminate_task(uint32_t tid, int exit_code) {
     scheduler_stats.current_task_count--;
 
     spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+
+    vfs_fdtable_destroy(files);
 
     LOG_DEBUG("Terminated task %u with exit code %d", tid, exit_code);
     return true;
 }
 
+// Find a task in the table, task_lock must be held
+static task_t* find_task(uint32_t tid) {
+    for (int i = 0; i < TASK_MAX_COUNT; i++) {
+        if (task_table[i] && task_table[i]->tid == tid) {
+            return task_table[i];
+        }
+    }
+
+    return NULL;
+}
+
 task_t* scheduler_get_task_by_id(uint32_t tid) {
+    uint64_t flags = cpu_irq_save();
     spinlock_acquire(&task_lock); // Protect the task table
+    task_t* task = find_task(tid);
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return task;
+}
 
-    for (int i = 0; i < TASK_MAX_COUNT; i++) {
-        if (task_table[i].tid == tid) {
-            spinlock_release(&task_lock);
-            return &task_table[i]; // Return the task if found
+// Fill tids with the IDs of the tasks that have not terminated, returns how many
+int scheduler_get_task_list(uint32_t* tids, int max_count) {
+    if (!tids || max_count <= 0) {
+        return 0;
+    }
+
+    int count = 0;
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    for (int i = 0; i < TASK_MAX_COUNT && count < max_count; i++) {
+        if (task_table[i] && task_table[i]->state != TASK_STATE_TERMINATED) {
+            tids[count++] = task_table[i]->tid;
+        }
+    }
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return count;
+}
+
+// Copy a task's resource usage in the exported layout, the stretch it is in is not counted yet
+bool scheduler_get_task_acct(uint32_t tid, task_stats_t* stats) {
+    if (!stats) {
+        return false;
+    }
+
+    timer_stats_t timer;
+    timer_get_stats(&timer);
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    task_t* task = find_task(tid);
+    if (!task) {
+        spinlock_release(&task_lock);
+        cpu_irq_restore(flags);
+        return false;
+    }
+
+    memset(stats, 0, sizeof(task_stats_t));
+    stats->version = TASK_STATS_VERSION;
+    stats->size = sizeof(task_stats_t);
+    stats->tid = task->tid;
+    stats->state = (uint32_t)task->state;
+    memcpy(stats->name, task->name, sizeof(stats->name));
+    stats->tsc_hz = timer.tsc_hz;
+    stats->user_cycles = task->acct.user_cycles;
+    stats->kernel_cycles = task->acct.kernel_cycles;
+    stats->voluntary_switches = task->acct.voluntary_switches;
+    stats->involuntary_switches = task->acct.involuntary_switches;
+    stats->page_faults = task->acct.page_faults;
+    stats->bytes_read = task->acct.bytes_read;
+    stats->bytes_written = task->acct.bytes_written;
+    stats->syscalls = task->acct.syscalls;
+    stats->wait_cycles = task->acct.wait_cycles;
+    stats->wait_max_cycles = task->acct.wait_max_cycles;
+    stats->cpu_ticks = task->cpu_time;
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// Charge the user stretch the executing CPU's task just ended
+void scheduler_acct_enter_kernel(void) {
+    task_t* task = current_task[cpu_current_id()];
+    if (!task) {
+        return;
+    }
+    uint64_t now = cpu_rdtsc();
+    if (task->acct.mark) {
+        task->acct.user_cycles += now - task->acct.mark;
+    }
+    task->acct.mark = now;
+}
+
+// Charge the kernel stretch the executing CPU's task is about to end
+void scheduler_acct_exit_kernel(void) {
+    task_t* task = current_task[cpu_current_id()];
+    if (!task) {
+        return;
+    }
+    uint64_t now = cpu_rdtsc();
+    if (task->acct.mark) {
+        task->acct.kernel_cycles += now - task->acct.mark;
+    }
+    task->acct.mark = now;
+}
+
+// Count a system call of the executing CPU's task
+void scheduler_acct_syscall(void) {
+    task_t* task = current_task[cpu_current_id()];
+    if (task) {
+        task->acct.syscalls++;
+    }
+}
+
+// Count a page fault resolved for the executing CPU's task
+void scheduler_acct_fault(void) {
+    task_t* task = current_task[cpu_current_id()];
+    if (task) {
+        task->acct.page_faults++;
+    }
+}
+
+// Count bytes the executing CPU's task moved through file system calls
+void scheduler_acct_io(uint64_t bytes_read, uint64_t bytes_written) {
+    task_t* task = current_task[cpu_current_id()];
+    if (task) {
+        task->acct.bytes_read += bytes_read;
+        task->acct.bytes_written += bytes_written;
+    }
+}
+
+// Block the current task, dropping the caller's lock only once the task is on the blocked queue
+static bool block_current(task_state_t state, spinlock_t* release) {
+    // Interrupts stay off until the switch so a wakeup cannot slip in before we sleep
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+
+    // The idle task (and early boot code running as it) has nothing to switch to
+    uint32_t cpu = cpu_current_id();
+    task_t* current = current_task[cpu];
+    if (!current || current == idle_task[cpu] || current->state != TASK_STATE_RUNNING) {
+        spinlock_release(&task_lock);
+        cpu_irq_restore(flags);
+        return false;
+    }
+
+    // The wakeup came in before the task got here (a waker on another CPU)
+    if (current->wake_pending) {
+        current->wake_pending = false;
+        spinlock_release(&task_lock);
+        if (release) {
+            spinlock_release(release);
         }
+        cpu_irq_restore(flags);
+        return true;
+    }
+
+    add_to_blocked_queue(current);
+    current->state = state;
+    scheduler_stats.blocked_tasks++;
+
+    spinlock_release(&task_lock);
+    if (release) {
+        spinlock_release(release);
+    }
+    schedule_next();
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// Put the current task to sleep until scheduler_unblock_task wakes it
+void scheduler_block_task(task_state_t state) {
+    block_current(state, NULL);
+}
+
+// Sleep on behalf of a wait queue, lock is released once a wakeup can no longer be missed
+bool scheduler_sleep_locked(spinlock_t* lock) {
+    return block_current(TASK_STATE_BLOCKED, lock);
+}
+
+// Move a blocked task back to its run queue, called with task_lock held
+static bool wake_locked(task_t* task) {
+    if (!task) {
+        return false;
+    }
+    if (task->state != TASK_STATE_BLOCKED) {
+        if (task->state == TASK_STATE_RUNNING) {
+            task->wake_pending = true;
+        }
+        return false;
+    }
+
+    remove_from_blocked_queue(task);
+    boost_priority(task);
+    add_to_ready_queue(task);
+    scheduler_stats.blocked_tasks--;
+    return true;
+}
+
+// Wake a blocked task, safe to call from interrupt handlers
+bool scheduler_wake_task(task_t* task) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    bool woken = wake_locked(task);
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return woken;
+}
+
+// Move a blocked task back to the ready queue, safe to call from interrupt handlers
+bool scheduler_unblock_task(uint32_t tid) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+    bool woken = wake_locked(find_task(tid));
+    spinlock_release(&task_lock);
+    cpu_irq_restore(flags);
+    return woken;
+}
+
+// Change a task's base priority, its dynamic priority restarts from there
+bool scheduler_set_task_priority(uint32_t tid, task_priority_t priority) {
+    if (priority > TASK_PRIORITY_REALTIME || tid == 0) {
+        return false;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&task_lock);
+
+    task_t* task = find_task(tid);
+    if (!task || task->state == TASK_STATE_TERMINATED) {
+        spinlock_release(&task_lock);
+        cpu_irq_restore(flags);
+        return false;
+    }
+
+    // A queued task moves to the list of its new level
+    bool queued = task->rq != NULL;
+    if (queued) {
+        remove_from_ready_queue(task);
+    }
+    task->base_priority = priority;
+    task->dynamic_priority = priority;
+    if (queued) {
+        add_to_ready_queue(task);
     }
 
     spinlock_release(&task_lock);
-    return NULL; // Task not found
+    cpu_irq_restore(flags);
+    return true;
 }
 
 // Add a task to the blocked queue
@@ -538,27 +1260,107 @@ void remove_from_blocked_queue(task_t* task) {
 void free_task_resources(task_t* task) {
     if (!task) return;
 
+    // Drop FPU state (and ownership of the live registers)
+    fpu_release(task);
+
     // Free page table (if any)
     if (task->page_table) {
         vmm_delete_address_space(task->page_table);
         task->page_table = 0;
     }
 
-    // Free stack memory (if any)
-    if (task->stack_top) {
-        pmm_free_pages(task->stack_top, task->stack_size / PAGE_SIZE_4K);
-        task->stack_top = NULL;
+    // The ring's frames were mapped without references, they are only freed here
+    uring_destroy(task);
+
+    // Only new or just cloned tables get here, they hold no last reference so this cannot sleep
+    if (task->files) {
+        vfs_fdtable_destroy(task->files);
+        task->files = NULL;
+    }
+
+    // The stack is one of the areas, its pages went with the page tables
+    if (task->mm) {
+        mm_destroy(task->mm);
+        task->mm = NULL;
+    }
+    task->stack_top = NULL;
+
+    // A kernel thread ending itself still runs on its stack, its switch away frees it
+    if (!__atomic_load_n(&task->on_cpu, __ATOMIC_SEQ_CST)) {
+        release_kernel_stack(task);
+    }
+}
+
+// Free a task's kernel stack, whichever of the terminating CPU and the switch away comes last
+static void release_kernel_stack(task_t* task) {
+    void* stack = __atomic_exchange_n(&task->kernel_stack, NULL, __ATOMIC_SEQ_CST);
+    if (stack) {
+        pmm_free_pages(stack, task->kernel_stack_pages);
     }
 }
 
-// Context switch to another task
+// Address right above a task's kernel stack, what syscall_entry and TSS rsp0 start from
+static uint64_t kernel_stack_top(task_t* task) {
+    return (uint64_t)vmm_phys_to_virt((uint64_t)task->kernel_stack) +
+           task->kernel_stack_pages * PAGE_SIZE_4K;
+}
+
+// Let the task switched away from on this CPU be stolen, its registers are saved now
+static void finish_switch(void) {
+    uint32_t cpu = cpu_current_id();
+    task_t* prev = switch_prev[cpu];
+    if (prev) {
+        switch_prev[cpu] = NULL;
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&prev->state, __ATOMIC_SEQ_CST) == TASK_STATE_TERMINATED) {
+            release_kernel_stack(prev);
+        }
+    }
+}
+
+// Context switch to another task, interrupts must be off
 void context_switch(task_t* next) {
-    if (!next || next == current_task) {
+    uint32_t cpu = cpu_current_id();
+    task_t* prev = current_task[cpu];
+    if (!next) {
         return;
     }
 
-    task_t* prev = current_task;
-    current_task = next;
+    // A task woken before it switched away can be picked again, it just keeps running
+    if (next == prev) {
+        next->state = TASK_STATE_RUNNING;
+        next->acct.queued = 0;
+        preempting[cpu] = false;
+        return;
+    }
+
+    // Switches only happen in the kernel, the stretch prev ends here is kernel time
+    uint64_t now = cpu_rdtsc();
+    if (prev) {
+        if (prev->acct.mark) {
+            prev->acct.kernel_cycles += now - prev->acct.mark;
+        }
+        if (preempting[cpu]) {
+            prev->acct.involuntary_switches++;
+        } else {
+            prev->acct.voluntary_switches++;
+        }
+    }
+    preempting[cpu] = false;
+
+    if (next->acct.queued) {
+        uint64_t wait = now - next->acct.queued;
+        next->acct.wait_cycles += wait;
+        if (wait > next->acct.wait_max_cycles) {
+            next->acct.wait_max_cycles = wait;
+        }
+        next->acct.queued = 0;
+    }
+    next->acct.mark = now;
+
+    TRACE(TRACE_SCHED_SWITCH, prev ? prev->tid : 0, next->tid);
+
+    current_task[cpu] = next;
 
     // Update task states
     if (prev) {
@@ -569,15 +1371,40 @@ void context_switch(task_t* next) {
 
     next->state = TASK_STATE_RUNNING;
     next->last_schedule = next->cpu_time;
+    next->cpu = cpu;
+    next->on_cpu = true;
+
+    // System calls and ring 3 interrupts land on next's own stack. Idle tasks never leave
+    // the kernel, and only tasks with a stack of their own reach user mode.
+    if (next->kernel_stack) {
+        uint64_t top = kernel_stack_top(next);
+        cpu_local()->kernel_stack = top;
+        gdt_set_kernel_stack(top);
+    }
+
+    // FPU registers follow lazily, the first SIMD use after the switch traps
+    fpu_switch(prev, next);
+
+    // Kernel threads (idle tasks included) only touch the kernel half every address space
+    // shares, so they run on whichever one is loaded. vmm keeps a space that is still
+    // loaded somewhere until its last CPU moved off it.
+    mm_switch(next->mm);
+    if (next->page_table) {
+        vmm_switch_address_space(next->page_table);
+    } else {
+        scheduler_stats.lazy_switches++;
+    }
 
     // Perform the actual context switch
     if (prev) {
         // Save current context and switch to new one
-        vmm_switch_address_space(next->page_table);
+        switch_prev[cpu] = prev;
         task_switch_context((uint64_t*)&prev->context, (uint64_t*)&next->context);
+
+        // Running again, possibly on another CPU
+        finish_switch();
     } else {
         // No previous context, just restore new one
-        vmm_switch_address_space(next->page_table);
         task_restore_context((uint64_t*)&next->context);
     }
 }
@@ -587,25 +1414,15 @@ void schedule_next(void) {
     // Disable interrupts while scheduling
     __asm__ volatile("cli");
 
-    // Try to get next task from ready queue
-    task_t* next = NULL;
-
-    // Simple round-robin scheduler
-    if (ready_queue_head) {
-        next = ready_queue_head;
-        ready_queue_head = ready_queue_head->next;
-
-        if (ready_queue_head) {
-            ready_queue_head->prev = NULL;
-        } else {
-            ready_queue_tail = NULL;
-        }
-
-        next->next = NULL;
-        next->prev = NULL;
-    } else {
+    // Round-robin over this CPU's queue, then work from the busiest other CPU
+    uint32_t cpu = cpu_current_id();
+    task_t* next = pick_local_task(cpu);
+    if (!next) {
+        next = steal_task(cpu);
+    }
+    if (!next) {
         // No ready tasks, use idle task
-        next = idle_task;
+        next = idle_task[cpu];
     }
 
     // Switch to the next task
@@ -7,8 +7,19 @@
 #include <memory/vmm.h>
 #include <memory/pmm.h>
 
+struct mm;
+struct uring;
+struct vfs_fdtable;
+
 #define TASK_MAX_COUNT 256
 
+// Kernel stack of a user task, its system calls and interrupts taken in ring 3 run on it
+// (a forked task also starts on it, with the frame its entry returns through on top)
+#define TASK_KERNEL_STACK_PAGES 4
+
+// Stack of a kernel thread, it runs on it for its whole life
+#define TASK_KTHREAD_STACK_PAGES 4
+
 // Task states
 typedef enum {
     TASK_STATE_NEW,         // Task is newly created
@@ -27,6 +38,9 @@ typedef enum {
     TASK_PRIORITY_REALTIME = 4 // Highest priority, real-time tasks
 } task_priority_t;
 
+// Number of priority levels, each has its own list in a run queue
+#define TASK_PRIORITY_COUNT (TASK_PRIORITY_REALTIME + 1)
+
 // CPU context structure (x86_64)
 typedef struct {
     uint64_t rax, rbx, rcx, rdx;
@@ -38,6 +52,22 @@ typedef struct {
     uint64_t cr3; // Page table base
 } cpu_context_t;
 
+// Resource usage of a task, times in TSC cycles
+typedef struct {
+    uint64_t user_cycles;              // Running in ring 3
+    uint64_t kernel_cycles;            // Running in the kernel, interrupts taken included
+    uint64_t voluntary_switches;       // Gave up the CPU by blocking or yielding
+    uint64_t involuntary_switches;     // Preempted by the tick
+    uint64_t page_faults;              // Faults resolved on the task's behalf
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls;
+    uint64_t wait_cycles;              // Ready on a run queue but not running
+    uint64_t wait_max_cycles;          // Longest single wait
+    uint64_t mark;                     // TSC the current user or kernel stretch started at
+    uint64_t queued;                   // TSC the task became ready at, 0 while not queued
+} task_acct_t;
+
 typedef struct task {
     uint32_t tid;                      // Task ID
     char name[32];                     // Task name
@@ -51,14 +81,27 @@ typedef struct task {
     int exit_code;                     // Exit code (if terminated)
     
     cpu_context_t context;             // CPU context
+    void* fpu_state;                   // Saved FPU/SIMD registers, allocated on first use
+    uint32_t fpu_cpu;                  // CPU that last loaded them, its owner slot is only valid there
     uintptr_t page_table;              // Page table (CR3 value)
     void* stack_top;                   // Top of the task's stack
     size_t stack_size;                 // Size of the task's stack
+    void* kernel_stack;                // Physical base of the task's own kernel stack
+    size_t kernel_stack_pages;         // Pages of kernel_stack
+    struct mm* mm;                     // Areas the task's page faults are resolved from
+    struct uring* uring;               // Submission and completion ring, NULL until set up
+    struct vfs_fdtable* files;         // Descriptors and working directory, NULL for kernel tasks
+    task_acct_t acct;                  // Resource usage
     
     int argc;                          // Number of arguments
     char** argv;                       // Argument vector
     char** envp;                       // Environment variables
     
+    uint32_t cpu;                      // CPU whose run queue the task belongs to
+    volatile bool on_cpu;              // Registers not yet saved, other CPUs must not run it
+    volatile bool wake_pending;        // Woken while still running, its next block returns at once
+    struct run_queue* rq;              // Run queue holding the task, NULL while not queued
+
     struct task* next;                 // Next task in queue
     struct task* prev;                 // Previous task in queue
 } task_t;
@@ -84,8 +127,38 @@ typedef struct {
     uint64_t idle_ticks;               // Time spent in idle task
     uint64_t kernel_ticks;             // Time spent in kernel tasks
     uint64_t user_ticks;               // Time spent in user tasks
+    uint64_t migrations;               // Tasks stolen by an idle CPU
+    uint64_t lazy_switches;            // Switches into kernel threads that kept the loaded address space
 } scheduler_stats_t;
 
+// Version of task_stats_t, bumped when fields are appended
+#define TASK_STATS_VERSION 1
+
+// Pass as the task ID of sys_taskstats to get every task
+#define TASK_STATS_ALL     0xFFFFFFFFU
+
+// Resource usage of a task as sys_taskstats copies it out. The layout is fixed, new fields
+// are only appended and readers check size before using them.
+typedef struct {
+    uint32_t version;                  // TASK_STATS_VERSION
+    uint32_t size;                     // sizeof(task_stats_t) of the kernel that filled it in
+    uint32_t tid;
+    uint32_t state;                    // task_state_t
+    char name[32];
+    uint64_t tsc_hz;                   // Cycles per second of the cycle counts, 0 if unknown
+    uint64_t user_cycles;
+    uint64_t kernel_cycles;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t page_faults;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls;
+    uint64_t wait_cycles;
+    uint64_t wait_max_cycles;
+    uint64_t cpu_ticks;                // Scheduler ticks charged, what the quantum is measured in
+} task_stats_t;
+
 // Spinlock structure
 typedef struct {
     volatile int locked;               // Lock state (0 = unlocked, 1 = locked)
@@ -103,25 +176,49 @@ static inline void spinlock_acquire(spinlock_t* lock) {
     }
 }
 
+// Take the lock only if it is free
+static inline bool spinlock_try_acquire(spinlock_t* lock) {
+    return !__sync_lock_test_and_set(&lock->locked, 1);
+}
+
 static inline void spinlock_release(spinlock_t* lock) {
     __sync_lock_release(&lock->locked);
 }
 
 // Scheduler functions
 bool scheduler_init(void);
+bool scheduler_init_cpu(void);
+void scheduler_idle(void);
 bool scheduler_register_kernel_idle(void);
 uint32_t scheduler_create_task(const void* elf_data, size_t elf_size, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]);
+uint32_t scheduler_create_task_from_file(const char* path, const char* name, task_priority_t priority, int argc, char* argv[], char* envp[]);
+uint32_t scheduler_fork_task(const void* frame, size_t frame_size, void (*entry)(void));
+void scheduler_finish_fork(void);
+uint32_t scheduler_create_kthread(const char* name, void (*entry)(void*), void* arg, task_priority_t priority);
+void scheduler_kthread_exit(void);
 bool scheduler_execute_task(uint32_t tid, int argc, char* argv[], char* envp[]);
 bool scheduler_terminate_task(uint32_t tid, int exit_code);
 task_t* scheduler_get_current_task(void);
+task_t* scheduler_get_cpu_task(uint32_t cpu);
 task_t* scheduler_get_task_by_id(uint32_t tid);
 void scheduler_yield(void);
 void scheduler_block_task(task_state_t state);
 bool scheduler_unblock_task(uint32_t tid);
+bool scheduler_sleep_locked(spinlock_t* lock);
+bool scheduler_wake_task(task_t* task);
 bool scheduler_set_task_priority(uint32_t tid, task_priority_t priority);
 bool scheduler_get_task_stats(uint32_t tid, uint64_t* cpu_time, task_state_t* state);
 int scheduler_get_task_list(uint32_t* tids, int max_count);
+bool scheduler_get_task_acct(uint32_t tid, task_stats_t* stats);
+
+// Accounting hooks, each works on the task running on the executing CPU
+void scheduler_acct_enter_kernel(void);                 // Entered from user mode
+void scheduler_acct_exit_kernel(void);                  // About to return to user mode
+void scheduler_acct_syscall(void);
+void scheduler_acct_fault(void);
+void scheduler_acct_io(uint64_t bytes_read, uint64_t bytes_written);
 extern void task_switch_context(uint64_t* old_ctx, uint64_t* new_ctx);
 extern void task_restore_context(uint64_t* ctx);
+extern void kthread_start(void);
 
 #endif // SCHEDULER_H
\ No newline at end of file
@@ -1,13 +1,20 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
 #include <core/exec/syscalls.h>
 #include <memory/vmm.h>
+#include <memory/vma.h>
 #include <utils/log.h>
-#include <fs/ext2.h>
+#include <utils/trace.h>
+#include <utils/profile.h>
+#include <fs/vfs.h>
+#include <fs/pagecache.h>
 #include <core/exec/scheduler.h>
+#include <core/exec/vdso.h>
+#include <core/exec/uring.h>
+#include <core/cpu.h>
 #include <stdint.h>
 #include <lib/string.h>
 
-ext2_fs_t ext2_fs;
-
 // MSR addresses for syscall/sysret
 #define IA32_STAR  0xC0000081
 #define IA32_LSTAR 0xC0000082
@@ -16,6 +23,9 @@ ext2_fs_t ext2_fs;
 // Syscall handler function
 extern void syscall_entry(void);
 
+// Entry of a forked child, restores the syscall_frame_t on its stack and returns 0 to user mode
+extern void syscall_fork_return(void);
+
 // Read from an MSR
 static inline uint64_t read_msr(uint32_t msr) {
     uint32_t low, high;
@@ -32,6 +42,13 @@ static inline void write_msr(uint32_t msr, uint64_t value) {
 
 // Initialize syscalls for x86_64
 void syscalls_init(void) {
+    syscalls_init_cpu();
+    vdso_init();
+    LOG_INFO("Syscalls initialized");
+}
+
+// Program the SYSCALL MSRs of the executing CPU
+void syscalls_init_cpu(void) {
     // Set the STAR MSR:
     // - CS = 0x08 (kernel code segment)
     // - SS = 0x10 (kernel data segment)
@@ -51,78 +68,209 @@ void syscalls_init(void) {
     uint64_t efer = read_msr(0xC0000080); // EFER MSR
     efer |= (1 << 0); // Set the SCE (SYSCALL Enable) bit
     write_msr(0xC0000080, efer);
-
-    LOG_INFO("Syscalls initialized");
 }
 
+// Adapt a system call to the register arguments of the dispatch table
+#define SYSCALL_WRAP(name, call) \
+    static long name##_call(long a1, long a2, long a3, long a4, long a5, long a6) { \
+        (void)a1; (void)a2; (void)a3; (void)a4; (void)a5; (void)a6; \
+        return call; \
+    }
+
+SYSCALL_WRAP(sys_read, sys_read((int)a1, (void*)a2, (size_t)a3))
+SYSCALL_WRAP(sys_write, sys_write((int)a1, (const void*)a2, (size_t)a3))
+SYSCALL_WRAP(sys_open, sys_open((const char*)a1, (int)a2, (int)a3))
+SYSCALL_WRAP(sys_close, sys_close((int)a1))
+SYSCALL_WRAP(sys_fstat, sys_fstat((int)a1, (struct stat*)a2))
+SYSCALL_WRAP(sys_lseek, sys_lseek((int)a1, (off_t)a2, (int)a3))
+SYSCALL_WRAP(sys_mmap, sys_mmap((void*)a1, (size_t)a2, (int)a3, (int)a4, (int)a5, (off_t)a6))
+SYSCALL_WRAP(sys_munmap, sys_munmap((void*)a1, (size_t)a2))
+SYSCALL_WRAP(sys_brk, sys_brk((void*)a1))
+SYSCALL_WRAP(sys_pread64, sys_pread64((int)a1, (void*)a2, (size_t)a3, (off_t)a4))
+SYSCALL_WRAP(sys_pwrite64, sys_pwrite64((int)a1, (const void*)a2, (size_t)a3, (off_t)a4))
+SYSCALL_WRAP(sys_readv, sys_readv((int)a1, (const struct iovec*)a2, (int)a3))
+SYSCALL_WRAP(sys_writev, sys_writev((int)a1, (const struct iovec*)a2, (int)a3))
+SYSCALL_WRAP(sys_getpid, sys_getpid())
+SYSCALL_WRAP(sys_sendfile, sys_sendfile((int)a1, (int)a2, (off_t*)a3, (size_t)a4))
+SYSCALL_WRAP(sys_fork, (long)(int32_t)sys_fork())
+SYSCALL_WRAP(sys_execve, sys_execve((const char*)a1, (char* const*)a2, (char* const*)a3))
+SYSCALL_WRAP(sys_exit, (sys_exit((int)a1), 0))
+SYSCALL_WRAP(sys_waitpid, sys_waitpid((pid_t)a1, (int*)a2, (int)a3))
+SYSCALL_WRAP(sys_getdents, sys_getdents((int)a1, (struct linux_dirent64*)a2, (unsigned int)a3))
+SYSCALL_WRAP(sys_getcwd, sys_getcwd((char*)a1, (size_t)a2))
+SYSCALL_WRAP(sys_chdir, sys_chdir((const char*)a1))
+SYSCALL_WRAP(sys_mkdir, sys_mkdir((const char*)a1, (int)a2))
+SYSCALL_WRAP(sys_rmdir, sys_rmdir((const char*)a1))
+SYSCALL_WRAP(sys_unlink, sys_unlink((const char*)a1))
+SYSCALL_WRAP(sys_gettimeofday, sys_gettimeofday((struct timeval*)a1, (void*)a2))
+SYSCALL_WRAP(sys_syslog, sys_syslog((int)a1, (char*)a2, (int)a3))
+SYSCALL_WRAP(sys_clock_gettime, sys_clock_gettime((int)a1, (struct timespec*)a2))
+SYSCALL_WRAP(sys_io_uring_setup, sys_io_uring_setup((uint32_t)a1, (void*)a2))
+SYSCALL_WRAP(sys_io_uring_enter, sys_io_uring_enter((uint32_t)a1, (uint32_t)a2, (uint32_t)a3, (uint32_t)a4))
+SYSCALL_WRAP(sys_ktrace, sys_ktrace((int)a1, (void*)a2, (size_t)a3))
+SYSCALL_WRAP(sys_kprofile, sys_kprofile((int)a1, (void*)a2, (size_t)a3))
+SYSCALL_WRAP(sys_taskstats, sys_taskstats((uint32_t)a1, (void*)a2, (size_t)a3))
+
+typedef long (*syscall_fn_t)(long, long, long, long, long, long);
+
+typedef struct {
+    syscall_fn_t fn;
+    const char *name;
+} syscall_desc_t;
+
+#define SYSCALL_DESC(nr, name) [nr] = { sys_##name##_call, #name }
+
+// Dispatch table indexed by system call number, empty slots are unknown calls
+static const syscall_desc_t syscall_table[SYSCALL_TABLE_SIZE] = {
+    SYSCALL_DESC(SYS_READ, read),
+    SYSCALL_DESC(SYS_WRITE, write),
+    SYSCALL_DESC(SYS_OPEN, open),
+    SYSCALL_DESC(SYS_CLOSE, close),
+    SYSCALL_DESC(SYS_FSTAT, fstat),
+    SYSCALL_DESC(SYS_LSEEK, lseek),
+    SYSCALL_DESC(SYS_MMAP, mmap),
+    SYSCALL_DESC(SYS_MUNMAP, munmap),
+    SYSCALL_DESC(SYS_BRK, brk),
+    SYSCALL_DESC(SYS_PREAD64, pread64),
+    SYSCALL_DESC(SYS_PWRITE64, pwrite64),
+    SYSCALL_DESC(SYS_READV, readv),
+    SYSCALL_DESC(SYS_WRITEV, writev),
+    SYSCALL_DESC(SYS_GETPID, getpid),
+    SYSCALL_DESC(SYS_SENDFILE, sendfile),
+    SYSCALL_DESC(SYS_FORK, fork),
+    SYSCALL_DESC(SYS_EXECVE, execve),
+    SYSCALL_DESC(SYS_EXIT, exit),
+    SYSCALL_DESC(SYS_WAITPID, waitpid),
+    SYSCALL_DESC(SYS_GETDENTS, getdents),
+    SYSCALL_DESC(SYS_GETCWD, getcwd),
+    SYSCALL_DESC(SYS_CHDIR, chdir),
+    SYSCALL_DESC(SYS_MKDIR, mkdir),
+    SYSCALL_DESC(SYS_RMDIR, rmdir),
+    SYSCALL_DESC(SYS_UNLINK, unlink),
+    SYSCALL_DESC(SYS_GETTIMEOFDAY, gettimeofday),
+    SYSCALL_DESC(SYS_SYSLOG, syslog),
+    SYSCALL_DESC(SYS_CLOCK_GETTIME, clock_gettime),
+    SYSCALL_DESC(SYS_IO_URING_SETUP, io_uring_setup),
+    SYSCALL_DESC(SYS_IO_URING_ENTER, io_uring_enter),
+    SYSCALL_DESC(SYS_KTRACE, ktrace),
+    SYSCALL_DESC(SYS_KPROFILE, kprofile),
+    SYSCALL_DESC(SYS_TASKSTATS, taskstats),
+};
+
+// Per-CPU call counts, SYSCALL masks interrupts so the CPU cannot change under an increment
+static uint64_t syscall_counts[MAX_CPUS][SYSCALL_TABLE_SIZE];
+static uint64_t unknown_syscalls[MAX_CPUS];
+
 // System call handler
 long handle_syscall(long syscall_number, long arg1, long arg2, long arg3, long arg4, long arg5, long arg6) {
-    switch (syscall_number) {
-        case SYS_READ:
-            return sys_read((int)arg1, (void*)arg2, (size_t)arg3);
-        case SYS_WRITE:
-            return sys_write((int)arg1, (const void*)arg2, (size_t)arg3);
-        case SYS_OPEN:
-            return sys_open((const char*)arg1, (int)arg2, (int)arg3);
-        case SYS_CLOSE:
-            return sys_close((int)arg1);
-        case SYS_BRK:
-            return sys_brk((void*)arg1);
-        case SYS_EXIT:
-            sys_exit((int)arg1);
-            return 0; // Never reached
-        case SYS_GETPID:
-            return sys_getpid();
-        case SYS_FORK:
-            return sys_fork();
-        case SYS_EXECVE:
-            return sys_execve((const char*)arg1, (char* const*)arg2, (char* const*)arg3);
-        case SYS_WAITPID:
-            return sys_waitpid((pid_t)arg1, (int*)arg2, (int)arg3);
-        case SYS_MMAP:
-            return sys_mmap((void*)arg1, (size_t)arg2, (int)arg3, (int)arg4, (int)arg5, (off_t)arg6);
-        case SYS_MUNMAP:
-            return sys_munmap((void*)arg1, (size_t)arg2);
-        case SYS_GETDENTS:
-            return sys_getdents((int)arg1, (struct linux_dirent64*)arg2, (unsigned int)arg3);
-        case SYS_GETCWD:
-            return sys_getcwd((char*)arg1, (size_t)arg2);
-        case SYS_CHDIR:
-            return sys_chdir((const char*)arg1);
-        case SYS_FSTAT:
-            return sys_fstat((int)arg1, (struct stat*)arg2);
-        case SYS_LSEEK:
-            return sys_lseek((int)arg1, (off_t)arg2, (int)arg3);
-        case SYS_MKDIR:
-            return sys_mkdir((const char*)arg1, (int)arg2);
-        case SYS_RMDIR:
-            return sys_rmdir((const char*)arg1);
-        case SYS_UNLINK:
-            return sys_unlink((const char*)arg1);
-        default:
-            LOG_ERROR("Unknown syscall number: %ld", syscall_number);
-            return -1; // Return -1 for unknown syscalls
+    uint32_t cpu = cpu_current_id();
+    scheduler_acct_enter_kernel();
+    scheduler_acct_syscall();
+    TRACE(TRACE_SYSCALL_ENTER, syscall_number, arg1);
+
+    if ((unsigned long)syscall_number >= SYSCALL_TABLE_SIZE || !syscall_table[syscall_number].fn) {
+        unknown_syscalls[cpu]++;
+        LOG_DEBUG("Unknown syscall number: %ld", syscall_number);
+        scheduler_acct_exit_kernel();
+        return -1; // Return -1 for unknown syscalls
+    }
+
+    syscall_counts[cpu][syscall_number]++;
+    long result = syscall_table[syscall_number].fn(arg1, arg2, arg3, arg4, arg5, arg6);
+
+    TRACE(TRACE_SYSCALL_EXIT, syscall_number, result);
+    scheduler_acct_exit_kernel();
+    return result;
+}
+
+// Get how often a system call was made on all CPUs
+uint64_t syscalls_get_count(long syscall_number) {
+    if ((unsigned long)syscall_number >= SYSCALL_TABLE_SIZE) {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += syscall_counts[cpu][syscall_number];
+    }
+    return total;
+}
+
+// Print the calls made so far by number, and the unknown ones
+void syscalls_print_stats(void) {
+    LOG_INFO("System Call Statistics:");
+    for (long nr = 0; nr < SYSCALL_TABLE_SIZE; nr++) {
+        uint64_t count = syscalls_get_count(nr);
+        if (count) {
+            LOG_INFO("  %s (%u): %u calls", syscall_table[nr].name, (uint32_t)nr, (uint32_t)count);
+        }
     }
+
+    uint64_t unknown = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        unknown += unknown_syscalls[cpu];
+    }
+    LOG_INFO("  Unknown calls: %u", (uint32_t)unknown);
 }
 
-// Assembly syscall entry point
+// Assembly syscall entry point, the user registers form a syscall_frame_t on the kernel stack
 __asm__(
     ".global syscall_entry\n"
+    ".global syscall_fork_return\n"
     "syscall_entry:\n"
     "    swapgs\n" // Switch to kernel GS base
     "    mov %rsp, %gs:0x10\n" // Save user stack pointer
     "    mov %gs:0x8, %rsp\n" // Load kernel stack pointer
+    "    pushq %gs:0x10\n" // Save user RSP
     "    push %rcx\n" // Save user RIP
     "    push %r11\n" // Save user RFLAGS
     "    push %rax\n" // Save syscall number
-    "    mov %r10, %rcx\n" // Move 4th argument to RCX (x86_64 calling convention)
+    "    push %rdi\n"
+    "    push %rsi\n"
+    "    push %rdx\n"
+    "    push %r10\n"
+    "    push %r8\n"
+    "    push %r9\n"
+    "    push %rbx\n"
+    "    push %rbp\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    mov %rsp, %gs:0x28\n" // Publish the frame for sys_fork
+    "    sub $8, %rsp\n" // Keep the stack 16-byte aligned at the call
+    "    push %r9\n" // 6th argument goes on the stack
+    "    mov %r8, %r9\n" // Shift the Linux argument registers into the C ones
+    "    mov %r10, %r8\n"
+    "    mov %rdx, %rcx\n"
+    "    mov %rsi, %rdx\n"
+    "    mov %rdi, %rsi\n"
+    "    mov %rax, %rdi\n"
     "    call handle_syscall\n" // Call the C handler
-    "    pop %rcx\n" // Restore syscall number
+    "    add $16, %rsp\n"
+    "syscall_restore_frame:\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %rbp\n"
+    "    pop %rbx\n"
+    "    pop %r9\n"
+    "    pop %r8\n"
+    "    pop %r10\n"
+    "    pop %rdx\n"
+    "    pop %rsi\n"
+    "    pop %rdi\n"
+    "    add $8, %rsp\n" // Skip the syscall number, RAX holds the result
     "    pop %r11\n" // Restore RFLAGS
     "    pop %rcx\n" // Restore RIP
-    "    mov %gs:0x10, %rsp\n" // Restore user stack pointer
+    "    pop %rsp\n" // Restore user stack pointer
     "    swapgs\n" // Switch back to user GS base
     "    sysretq\n" // Return to user mode
+    "syscall_fork_return:\n" // A forked child's first instruction, its frame is on its own stack
+    "    call scheduler_finish_fork\n"
+    "    xor %eax, %eax\n" // fork returns 0 in the child
+    "    jmp syscall_restore_frame\n"
 );
 
 // System call implementations
@@ -132,11 +280,40 @@ long sys_read(int fd, void *buf, size_t count) {
         LOG_ERROR("Invalid arguments for sys_read");
         return -1;
     }
-    ssize_t bytes_read = ext2_read(fd, buf, count);
+    ssize_t bytes_read = vfs_read(fd, buf, count);
+    if (bytes_read < 0) {
+        LOG_ERROR("Failed to read from file descriptor %d", fd);
+        return -1;
+    }
+    scheduler_acct_io((uint64_t)bytes_read, 0);
+    return bytes_read;
+}
+
+long sys_pread64(int fd, void *buf, size_t count, off_t offset) {
+    if (fd < 0 || !buf || offset < 0) {
+        LOG_ERROR("Invalid arguments for sys_pread64");
+        return -1;
+    }
+    ssize_t bytes_read = vfs_pread(fd, buf, count, (uint64_t)offset);
+    if (bytes_read < 0) {
+        LOG_ERROR("Failed to read from file descriptor %d", fd);
+        return -1;
+    }
+    scheduler_acct_io((uint64_t)bytes_read, 0);
+    return bytes_read;
+}
+
+long sys_readv(int fd, const struct iovec *iov, int iovcnt) {
+    if (fd < 0 || !iov || iovcnt < 0 || iovcnt > IOV_MAX) {
+        LOG_ERROR("Invalid arguments for sys_readv");
+        return -1;
+    }
+    ssize_t bytes_read = vfs_readv(fd, (const vfs_iovec_t*)iov, iovcnt);
     if (bytes_read < 0) {
         LOG_ERROR("Failed to read from file descriptor %d", fd);
         return -1;
     }
+    scheduler_acct_io((uint64_t)bytes_read, 0);
     return bytes_read;
 }
 
@@ -145,20 +322,68 @@ long sys_write(int fd, const void *buf, size_t count) {
         LOG_ERROR("Invalid arguments for sys_write");
         return -1;
     }
-    ssize_t bytes_written = ext2_write(fd, buf, count);
+    ssize_t bytes_written = vfs_write(fd, buf, count);
+    if (bytes_written < 0) {
+        LOG_ERROR("Failed to write to file descriptor %d", fd);
+        return -1;
+    }
+    scheduler_acct_io(0, (uint64_t)bytes_written);
+    return bytes_written;
+}
+
+long sys_pwrite64(int fd, const void *buf, size_t count, off_t offset) {
+    if (fd < 0 || !buf || offset < 0) {
+        LOG_ERROR("Invalid arguments for sys_pwrite64");
+        return -1;
+    }
+    ssize_t bytes_written = vfs_pwrite(fd, buf, count, (uint64_t)offset);
+    if (bytes_written < 0) {
+        LOG_ERROR("Failed to write to file descriptor %d", fd);
+        return -1;
+    }
+    scheduler_acct_io(0, (uint64_t)bytes_written);
+    return bytes_written;
+}
+
+long sys_writev(int fd, const struct iovec *iov, int iovcnt) {
+    if (fd < 0 || !iov || iovcnt < 0 || iovcnt > IOV_MAX) {
+        LOG_ERROR("Invalid arguments for sys_writev");
+        return -1;
+    }
+    ssize_t bytes_written = vfs_writev(fd, (const vfs_iovec_t*)iov, iovcnt);
     if (bytes_written < 0) {
         LOG_ERROR("Failed to write to file descriptor %d", fd);
         return -1;
     }
+    scheduler_acct_io(0, (uint64_t)bytes_written);
     return bytes_written;
 }
 
+// Copy between two files inside the kernel, the data never visits user memory
+long sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (out_fd < 0 || in_fd < 0 || (offset && *offset < 0)) {
+        LOG_ERROR("Invalid arguments for sys_sendfile");
+        return -1;
+    }
+    uint64_t pos = offset ? (uint64_t)*offset : 0;
+    ssize_t bytes_sent = vfs_sendfile(out_fd, in_fd, offset ? &pos : NULL, count);
+    if (bytes_sent < 0) {
+        LOG_ERROR("Failed to send file descriptor %d to %d", in_fd, out_fd);
+        return -1;
+    }
+    if (offset) {
+        *offset = (off_t)pos;
+    }
+    scheduler_acct_io((uint64_t)bytes_sent, (uint64_t)bytes_sent);
+    return bytes_sent;
+}
+
 long sys_open(const char *filename, int flags, int mode) {
     if (!filename) {
         LOG_ERROR("Invalid filename for sys_open");
         return -1;
     }
-    int fd = ext2_open(filename, flags);
+    int fd = vfs_open(filename, flags);
     if (fd < 0) {
         LOG_ERROR("Failed to open file: %s", filename);
         return -1;
@@ -171,20 +396,20 @@ long sys_close(int fd) {
         LOG_ERROR("Invalid file descriptor for sys_close");
         return -1;
     }
-    if (!ext2_close(fd)) {
+    if (!vfs_close(fd)) {
         LOG_ERROR("Failed to close file descriptor %d", fd);
         return -1;
     }
     return 0;
 }
 
+// Move the program break, the heap is demand-zero memory above the loaded image
 long sys_brk(void *addr) {
-    void *new_brk = vmm_allocate((size_t)addr, VMM_FLAG_USER | VMM_FLAG_WRITABLE);
-    if (!new_brk) {
-        LOG_ERROR("Failed to allocate memory for brk");
+    task_t *current_task = scheduler_get_current_task();
+    if (!current_task || !current_task->mm) {
         return -1;
     }
-    return (long)new_brk;
+    return (long)mm_set_brk(current_task->mm, (uint64_t)addr);
 }
 
 void sys_exit(int status) {
@@ -199,46 +424,25 @@ void sys_exit(int status) {
 long sys_getpid(void) {
     task_t *current_task = scheduler_get_current_task();
     if (!current_task) {
-        LOG_ERROR("No current task found");
         return -1;
     }
     return current_task->tid;
 }
 
 uint32_t sys_fork(void) {
-    task_t* current_task = scheduler_get_current_task();
-    if (!current_task) {
-        return (uint32_t)-1; // No current task, return error
-    }
-
-    // Create a new task as a copy of the current task
-    uint32_t new_tid = scheduler_create_task(
-        NULL, // No ELF data (forked task is a copy of the current task)
-        0,    // No ELF size
-        "forked_task", // Name of the new task
-        current_task->base_priority, // Inherit parent's priority
-        current_task->argc, // Inherit parent's argc
-        current_task->argv, // Inherit parent's argv
-        current_task->envp  // Inherit parent's envp
-    );
-
-    if (new_tid == 0) {
-        return (uint32_t)-1; // Failed to create task, return error
+    // The child resumes from a copy of the registers syscall_entry saved for this call
+    const syscall_frame_t* frame = (const syscall_frame_t*)cpu_local()->syscall_frame;
+    if (!frame) {
+        return (uint32_t)-1; // Not entered through syscall_entry
     }
 
-    // Copy the parent's CPU context to the child task
-    task_t* new_task = scheduler_get_task_by_id(new_tid);
-    if (!new_task) {
-        return (uint32_t)-1; // Failed to find new task, return error
+    uint32_t child_tid = scheduler_fork_task(frame, sizeof(*frame), syscall_fork_return);
+    if (child_tid == 0) {
+        return (uint32_t)-1; // Out of task slots or memory
     }
 
-    memcpy(&new_task->context, &current_task->context, sizeof(cpu_context_t));
-
-    // Set the child's return value to 0 (child process)
-    new_task->context.rax = 0;
-
     // Return the child's TID to the parent
-    return new_tid;
+    return child_tid;
 }
 
 long sys_execve(const char *filename, char *const argv[], char *const envp[]) {
@@ -275,55 +479,143 @@ long sys_waitpid(pid_t pid, int *status, int options) {
     return pid;
 }
 
+// Pick where a mapping goes: MAP_FIXED takes addr as is, a free hint is honoured, anything
+// else lands in the lowest gap above VMA_MMAP_BASE. Huge page areas are 2 MiB aligned.
+static uint64_t mmap_place(mm_t *mm, uint64_t addr, uint64_t length, int flags) {
+    uint64_t align = (flags & MAP_HUGETLB) ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+
+    if (flags & MAP_FIXED) {
+        if (addr % PAGE_SIZE_4K || addr < mm->map_start || addr + length > mm->map_end) {
+            return 0;
+        }
+        vma_unmap(mm, addr, length);  // Whatever was mapped there is replaced
+        return addr;
+    }
+
+    if (addr && addr % align == 0 && vma_find_gap(mm, length, align, addr) == addr) {
+        return addr;
+    }
+    return vma_find_gap(mm, length, align, VMA_MMAP_BASE);
+}
+
 long sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    if (!addr || length == 0) {
+    task_t *current_task = scheduler_get_current_task();
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (!current_task || !current_task->mm || length == 0 ||
+        (type != MAP_SHARED && type != MAP_PRIVATE)) {
         LOG_ERROR("Invalid arguments for mmap");
         return -1;
     }
-    void *mapped_addr = vmm_map_physical((uint64_t)addr, length, VMM_FLAG_USER | VMM_FLAG_WRITABLE);
-    if (!mapped_addr) {
-        LOG_ERROR("Failed to map memory for mmap");
+    mm_t *mm = current_task->mm;
+    length = (length + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+
+    uint32_t vma_flags = 0;
+    if (prot & PROT_READ) vma_flags |= VMA_READ;
+    if (prot & PROT_WRITE) vma_flags |= VMA_WRITE;
+    if (prot & PROT_EXEC) vma_flags |= VMA_EXEC;
+    if (type == MAP_SHARED) vma_flags |= VMA_SHARED;
+
+    // File mappings are paged in from the page cache, private ones copied on the first write
+    vfs_file_t *file = NULL;
+    vfs_stat_t st;
+    if (!(flags & MAP_ANONYMOUS)) {
+        file = vfs_get_file(fd);
+        if (!file || !file->ino || !vfs_fstat(fd, &st) || !VFS_S_ISREG(st.mode)) {
+            LOG_ERROR("mmap: fd %d is not a regular file", fd);
+            return -1;
+        }
+        if (offset < 0 || (offset % PCACHE_PAGE_SIZE) != 0) {
+            LOG_ERROR("mmap: unaligned offset");
+            return -1;
+        }
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && !VFS_WRITABLE(file->flags)) {
+            LOG_ERROR("mmap: shared writable mapping of a read-only file");
+            return -1;
+        }
+    } else if (flags & MAP_HUGETLB) {
+        vma_flags |= VMA_HUGE;  // Only anonymous memory can take 2 MiB pages
+    }
+
+    uint64_t start = mmap_place(mm, (uint64_t)addr, length, flags);
+    if (!start) {
+        LOG_ERROR("mmap: no room for 0x%llx bytes", (uint64_t)length);
+        return -1;
+    }
+
+    bool ok;
+    if (file) {
+        uint64_t file_bytes = (uint64_t)offset < st.size ? st.size - (uint64_t)offset : 0;
+        ok = vma_map_file(mm, start, length, vma_flags, file->ino, (uint64_t)offset, file_bytes);
+    } else {
+        ok = vma_map_anon(mm, start, length, vma_flags);
+    }
+    if (!ok) {
         return -1;
     }
-    return (long)mapped_addr;
+
+    // Pre-faulting is best effort, the rest comes in on first touch
+    if ((flags & MAP_POPULATE) && !vma_populate(mm, start, length)) {
+        LOG_WARN("mmap: could not populate 0x%llx", start);
+    }
+    return (long)start;
 }
 
 long sys_munmap(void *addr, size_t length) {
-    if (!addr || length == 0) {
+    task_t *current_task = scheduler_get_current_task();
+    if (!current_task || !current_task->mm || ((uint64_t)addr % PAGE_SIZE_4K) || length == 0) {
         LOG_ERROR("Invalid arguments for munmap");
         return -1;
     }
-    vmm_unmap_physical(addr, length);
+
+    // Areas the range cuts are split, their pages and page cache references are released
+    vma_unmap(current_task->mm, (uint64_t)addr, length);
     return 0;
 }
 
+// Fill dirp with as many whole records as fit, an entry that does not fit is read again
+// by the next call
 long sys_getdents(int fd, struct linux_dirent64 *dirp, unsigned int count) {
     if (fd < 0 || !dirp || count == 0) {
         LOG_ERROR("Invalid arguments for getdents");
         return -1;
     }
-    ext2_file_t *file = &ext2_fs.open_files[fd];
-    if (!file->is_open || !EXT2_S_ISDIR(file->inode.i_mode)) {
+    vfs_file_t *file = vfs_get_file(fd);
+    vfs_stat_t st;
+    if (!file || !vfs_fstat(fd, &st) || !VFS_S_ISDIR(st.mode)) {
         LOG_ERROR("File descriptor %d is not a directory", fd);
         return -1;
     }
-    // Read directory entries
+
     uint32_t bytes_read = 0;
-    while (bytes_read < count) {
-        ext2_dir_entry_t entry;
-        if (!ext2_read(fd, &entry, sizeof(entry))) {
+    while (true) {
+        uint64_t pos = file->position;
+        vfs_dirent_t entry;
+        int result = vfs_readdir(fd, &entry);
+        if (result < 0) {
+            return bytes_read > 0 ? (long)bytes_read : -1;
+        }
+        if (result == 0) {
             break;
         }
-        if (entry.inode == 0) {
-            continue; // Skip unused entries
+
+        size_t name_len = strlen(entry.name);
+        uint32_t reclen = (offsetof(struct linux_dirent64, d_name) + name_len + 1 + 7) & ~7U;
+        if (bytes_read + reclen > count) {
+            file->position = pos;
+            if (bytes_read == 0) {
+                LOG_ERROR("getdents: buffer too small");
+                return -1;
+            }
+            break;
         }
+
         struct linux_dirent64 *ldirp = (struct linux_dirent64*)((char*)dirp + bytes_read);
-        ldirp->d_ino = entry.inode;
-        ldirp->d_off = entry.rec_len;
-        ldirp->d_reclen = entry.rec_len;
-        strncpy(ldirp->d_name, entry.name, entry.name_len);
-        ldirp->d_name[entry.name_len] = '\0';
-        bytes_read += entry.rec_len;
+        ldirp->d_ino = entry.ino;
+        ldirp->d_off = file->position;
+        ldirp->d_reclen = reclen;
+        ldirp->d_type = entry.type;
+        memcpy(ldirp->d_name, entry.name, name_len + 1);
+        bytes_read += reclen;
     }
     return bytes_read;
 }
@@ -333,7 +625,7 @@ long sys_getcwd(char *buf, size_t size) {
         LOG_ERROR("Invalid arguments for getcwd");
         return -1;
     }
-    strncpy(buf, ext2_fs.current_dir, size);
+    strncpy(buf, vfs_getcwd(), size);
     buf[size - 1] = '\0'; // Ensure null termination
     return strlen(buf);
 }
@@ -343,22 +635,10 @@ long sys_chdir(const char *path) {
         LOG_ERROR("Invalid path for chdir");
         return -1;
     }
-    uint32_t inode_num = ext2_lookup_path(ext2_fs.drive_index, path);
-    if (inode_num == 0) {
-        LOG_ERROR("Path not found: %s", path);
+    if (!vfs_chdir(path)) {
+        LOG_ERROR("Not a directory: %s", path);
         return -1;
     }
-    ext2_inode_t inode;
-    if (!ext2_read_inode(ext2_fs.drive_index, inode_num, &inode)) {
-        LOG_ERROR("Failed to read inode for path: %s", path);
-        return -1;
-    }
-    if (!EXT2_S_ISDIR(inode.i_mode)) {
-        LOG_ERROR("Path is not a directory: %s", path);
-        return -1;
-    }
-    strncpy(ext2_fs.current_dir, path, EXT2_MAX_PATH);
-    ext2_fs.current_dir[EXT2_MAX_PATH - 1] = '\0';
     return 0;
 }
 
@@ -367,17 +647,21 @@ long sys_fstat(int fd, struct stat *statbuf) {
         LOG_ERROR("Invalid arguments for fstat");
         return -1;
     }
-    ext2_file_t *file = &ext2_fs.open_files[fd];
-    if (!file->is_open) {
+    vfs_stat_t st;
+    if (!vfs_fstat(fd, &st)) {
         LOG_ERROR("File descriptor %d is not open", fd);
         return -1;
     }
     memset(statbuf, 0, sizeof(struct stat));
-    statbuf->st_ino = file->inode_num;
-    statbuf->st_mode = file->inode.i_mode;
-    statbuf->st_size = file->inode.i_size;
-    statbuf->st_blocks = file->inode.i_blocks;
-    statbuf->st_blksize = ext2_fs.block_size;
+    statbuf->st_ino = st.ino;
+    statbuf->st_mode = st.mode;
+    statbuf->st_nlink = st.nlink;
+    statbuf->st_size = st.size;
+    statbuf->st_blocks = st.blocks;
+    statbuf->st_blksize = st.block_size;
+    statbuf->st_atime = st.atime;
+    statbuf->st_mtime = st.mtime;
+    statbuf->st_ctime = st.ctime;
     return 0;
 }
 
@@ -386,26 +670,12 @@ long sys_lseek(int fd, off_t offset, int whence) {
         LOG_ERROR("Invalid file descriptor for lseek");
         return -1;
     }
-    ext2_file_t *file = &ext2_fs.open_files[fd];
-    if (!file->is_open) {
-        LOG_ERROR("File descriptor %d is not open", fd);
+    int64_t position = vfs_lseek(fd, offset, whence);
+    if (position < 0) {
+        LOG_ERROR("Failed to seek file descriptor %d", fd);
         return -1;
     }
-    switch (whence) {
-        case SEEK_SET:
-            file->position = offset;
-            break;
-        case SEEK_CUR:
-            file->position += offset;
-            break;
-        case SEEK_END:
-            file->position = file->inode.i_size + offset;
-            break;
-        default:
-            LOG_ERROR("Invalid whence value: %d", whence);
-            return -1;
-    }
-    return file->position;
+    return position;
 }
 
 long sys_mkdir(const char *pathname, int mode) {
@@ -413,7 +683,7 @@ long sys_mkdir(const char *pathname, int mode) {
         LOG_ERROR("Invalid pathname for mkdir");
         return -1;
     }
-    if (!ext2_mkdir(pathname, mode)) {
+    if (!vfs_mkdir(pathname, mode)) {
         LOG_ERROR("Failed to create directory: %s", pathname);
         return -1;
     }
@@ -425,7 +695,7 @@ long sys_rmdir(const char *pathname) {
         LOG_ERROR("Invalid pathname for rmdir");
         return -1;
     }
-    if (!ext2_rmdir(pathname)) {
+    if (!vfs_rmdir(pathname)) {
         LOG_ERROR("Failed to remove directory: %s", pathname);
         return -1;
     }
@@ -437,9 +707,144 @@ long sys_unlink(const char *pathname) {
         LOG_ERROR("Invalid pathname for unlink");
         return -1;
     }
-    if (!ext2_unlink(pathname)) {
+    if (!vfs_unlink(pathname)) {
         LOG_ERROR("Failed to unlink file: %s", pathname);
         return -1;
     }
     return 0;
-}
\ No newline at end of file
+}
+// Slow path of the vDSO entry points, for clocks it does not read itself
+long sys_clock_gettime(int clock, struct timespec *ts) {
+    uint64_t ns;
+    if (!ts || !vdso_clock_ns(clock, &ns)) {
+        return -1;
+    }
+    ts->tv_sec = (int64_t)(ns / 1000000000ULL);
+    ts->tv_nsec = (int64_t)(ns % 1000000000ULL);
+    return 0;
+}
+
+long sys_gettimeofday(struct timeval *tv, void *tz) {
+    if (tz) {
+        memset(tz, 0, 8); // struct timezone, UTC without daylight saving
+    }
+    if (tv) {
+        uint64_t ns;
+        vdso_clock_ns(CLOCK_REALTIME, &ns);
+        tv->tv_sec = (int64_t)(ns / 1000000000ULL);
+        tv->tv_usec = (int64_t)((ns % 1000000000ULL) / 1000);
+    }
+    return 0;
+}
+
+// Set up the caller's submission and completion ring, params is a uring_params_t
+long sys_io_uring_setup(uint32_t entries, void *params) {
+    return uring_setup(entries, (uring_params_t*)params);
+}
+
+// Run queued ring entries, their completions are posted before this returns
+long sys_io_uring_enter(uint32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return uring_enter(fd, to_submit, min_complete, flags);
+}
+
+// Read the kernel log the way dmesg does
+long sys_syslog(int type, char *buf, int len) {
+    switch (type) {
+        case SYSLOG_ACTION_READ_ALL:
+            if (!buf || len < 0) {
+                return -1;
+            }
+            return (long)log_read_all(buf, (size_t)len);
+        case SYSLOG_ACTION_SIZE_BUFFER:
+            return (long)log_buffer_size();
+        default:
+            return -1;
+    }
+}
+
+// Control the tracepoints and read their records, arg is the event mask or the buffer size
+long sys_ktrace(int op, void *buf, size_t arg) {
+    switch (op) {
+        case TRACE_OP_SET_MASK:
+            return trace_set_mask((uint32_t)arg) ? 0 : -1;
+        case TRACE_OP_GET_MASK:
+            return (long)trace_get_mask();
+        case TRACE_OP_READ:
+            if (!buf) {
+                return -1;
+            }
+            return (long)trace_read(buf, arg);
+        case TRACE_OP_DUMP:
+            trace_dump();
+            return 0;
+        case TRACE_OP_CLEAR:
+            trace_clear();
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Control the sampling profiler and read its samples, arg is the event and period or the buffer size
+long sys_kprofile(int op, void *buf, size_t arg) {
+    switch (op) {
+        case PROFILE_OP_START:
+            return profile_start((profile_event_t)(arg & 0xFF), arg >> 8) ? 0 : -1;
+        case PROFILE_OP_STOP:
+            profile_stop();
+            return 0;
+        case PROFILE_OP_READ:
+            if (!buf) {
+                return -1;
+            }
+            return (long)profile_read(buf, arg);
+        case PROFILE_OP_REPORT:
+            profile_report();
+            return 0;
+        case PROFILE_OP_CLEAR:
+            profile_clear();
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Copy the resource usage of a task (0 for the caller) or of every task, returns the bytes copied.
+// A single task's record is cut to size, the list only holds whole records.
+long sys_taskstats(uint32_t tid, void *buf, size_t size) {
+    if (!buf) {
+        return -1;
+    }
+
+    if (tid != TASK_STATS_ALL) {
+        if (tid == 0) {
+            task_t *self = scheduler_get_current_task();
+            if (!self) {
+                return -1;
+            }
+            tid = self->tid;
+        }
+
+        task_stats_t stats;
+        if (!scheduler_get_task_acct(tid, &stats)) {
+            return -1;
+        }
+        size_t n = size < sizeof(stats) ? size : sizeof(stats);
+        memcpy(buf, &stats, n);
+        return (long)n;
+    }
+
+    uint32_t tids[TASK_MAX_COUNT];
+    int count = scheduler_get_task_list(tids, TASK_MAX_COUNT);
+    task_stats_t *out = buf;
+    size_t max = size / sizeof(task_stats_t);
+    size_t n = 0;
+
+    // A task that terminated since the list was taken is skipped
+    for (int i = 0; i < count && n < max; i++) {
+        if (scheduler_get_task_acct(tids[i], &out[n])) {
+            n++;
+        }
+    }
+    return (long)(n * sizeof(task_stats_t));
+}
@@ -5,7 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <memory/vmm.h>
-#include <fs/ext2.h>
+#include <fs/vfs.h>
 #include <core/exec/scheduler.h>
 
 typedef int32_t pid_t;
@@ -15,6 +15,29 @@ typedef int64_t off_t;
 #define SEEK_CUR 1  // Seek from the current position
 #define SEEK_END 2  // Seek from the end of the file
 
+// mmap protection and flags
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_POPULATE  0x8000            // Fault every page in before returning
+#define MAP_HUGETLB   0x40000           // Align to 2 MiB and back anonymous memory with 2 MiB pages
+
+// User registers saved by syscall_entry, lowest address first
+typedef struct {
+    uint64_t r15, r14, r13, r12, rbp, rbx;
+    uint64_t r9, r8, r10, rdx, rsi, rdi;
+    uint64_t rax;                      // Syscall number
+    uint64_t rflags;                   // Saved from R11 by SYSCALL
+    uint64_t rip;                      // Saved from RCX by SYSCALL
+    uint64_t rsp;                      // User stack pointer
+} syscall_frame_t;
+
 typedef unsigned long long ino64_t;  // 64-bit inode number
 typedef long long off64_t;           // 64-bit file offset
 
@@ -26,6 +49,36 @@ struct linux_dirent64 {
     char           d_name[]; // Null-terminated filename
 };
 
+// One buffer of readv/writev, laid out like vfs_iovec_t
+struct iovec {
+    void  *iov_base;     // Start of the buffer
+    size_t iov_len;      // Its length in bytes
+};
+
+#define IOV_MAX 1024     // Most buffers one readv/writev accepts
+
+// Clocks of clock_gettime, REALTIME counts from boot until a wall clock source sets its offset
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+#define CLOCK_MONOTONIC_RAW     4
+#define CLOCK_REALTIME_COARSE   5       // As of the last scheduler tick
+#define CLOCK_MONOTONIC_COARSE  6
+#define CLOCK_BOOTTIME          7
+
+// syslog actions
+#define SYSLOG_ACTION_READ_ALL      3   // Copy the buffered kernel log
+#define SYSLOG_ACTION_SIZE_BUFFER   10  // Get the most bytes READ_ALL returns
+
+struct timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
+struct timeval {
+    int64_t tv_sec;
+    int64_t tv_usec;
+};
+
 struct stat {
     uint32_t st_dev;     // ID of device containing file
     uint32_t st_ino;     // Inode number
@@ -63,8 +116,27 @@ struct stat {
 #define SYS_MKDIR           83
 #define SYS_RMDIR           84
 #define SYS_UNLINK          87
+#define SYS_PREAD64         17
+#define SYS_PWRITE64        18
+#define SYS_READV           19
+#define SYS_WRITEV          20
+#define SYS_SENDFILE        40
+#define SYS_GETTIMEOFDAY    96
+#define SYS_SYSLOG          103
+#define SYS_CLOCK_GETTIME   228
+#define SYS_IO_URING_SETUP  425
+#define SYS_IO_URING_ENTER  426
+
+// Calls of this kernel's own, numbered past the Linux ones
+#define SYS_KTRACE          500
+#define SYS_KPROFILE        501
+#define SYS_TASKSTATS       502
+
+// Dispatch table size, room for every Linux x86_64 number and the calls of this kernel
+#define SYSCALL_TABLE_SIZE  512
 
 void syscalls_init(void);
+void syscalls_init_cpu(void);
 
 // System call function prototypes
 long sys_read(int fd, void *buf, size_t count);
@@ -87,8 +159,27 @@ long sys_lseek(int fd, off_t offset, int whence);
 long sys_mkdir(const char *pathname, int mode);
 long sys_rmdir(const char *pathname);
 long sys_unlink(const char *pathname);
+long sys_pread64(int fd, void *buf, size_t count, off_t offset);
+long sys_pwrite64(int fd, const void *buf, size_t count, off_t offset);
+long sys_readv(int fd, const struct iovec *iov, int iovcnt);
+long sys_writev(int fd, const struct iovec *iov, int iovcnt);
+long sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+long sys_gettimeofday(struct timeval *tv, void *tz);
+long sys_syslog(int type, char *buf, int len);
+long sys_clock_gettime(int clock, struct timespec *ts);
+long sys_io_uring_setup(uint32_t entries, void *params);
+long sys_io_uring_enter(uint32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+long sys_ktrace(int op, void *buf, size_t arg);
+long sys_kprofile(int op, void *buf, size_t arg);
+long sys_taskstats(uint32_t tid, void *buf, size_t size);
 
 // System call handler
 long handle_syscall(long syscall_number, long arg1, long arg2, long arg3, long arg4, long arg5, long arg6);
 
+// Get how often a system call was made on all CPUs
+uint64_t syscalls_get_count(long syscall_number);
+
+// Print the calls made so far by number, and the unknown ones
+void syscalls_print_stats(void);
+
 #endif // SYSCALLS_H
\ No newline at end of file
@@ -0,0 +1,292 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
+#include <core/exec/uring.h>
+#include <core/exec/syscalls.h>
+#include <core/exec/scheduler.h>
+#include <memory/vma.h>
+#include <memory/vmm.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <fs/vfs.h>
+#include <fs/pagecache.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// The submission entries start on a cache line after the ring head
+#define URING_SQES_OFF  64
+
+_Static_assert(sizeof(uring_sqe_t) == 64, "uring_sqe_t must match the Linux layout");
+_Static_assert(sizeof(uring_cqe_t) == 16, "uring_cqe_t must match the Linux layout");
+_Static_assert(sizeof(uring_rings_t) <= URING_SQES_OFF, "ring head overlaps the entries");
+
+static uring_stats_t uring_stats;
+
+// Create the current task's ring and map it into its address space
+long uring_setup(uint32_t entries, uring_params_t *params) {
+    task_t *task = scheduler_get_current_task();
+    if (!task || !task->mm || task->uring || !params || entries == 0 || entries > URING_MAX_ENTRIES) {
+        return -1;
+    }
+
+    uint32_t sq_entries = 1;
+    while (sq_entries < entries) {
+        sq_entries <<= 1;
+    }
+    uint32_t cq_entries = sq_entries * 2;
+
+    uint32_t cqes_off = URING_SQES_OFF + sq_entries * sizeof(uring_sqe_t);
+    uint64_t size = (cqes_off + cq_entries * sizeof(uring_cqe_t) + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    size_t pages = size / PAGE_SIZE_4K;
+
+    uring_t *ring = kzalloc(sizeof(uring_t));
+    void *frames = pmm_alloc_pages(pages);
+    if (!ring || !frames) {
+        LOG_ERROR("uring: out of memory for %u entries", sq_entries);
+        if (frames) pmm_free_pages(frames, pages);
+        if (ring) kfree(ring);
+        return -1;
+    }
+
+    uint8_t *region = vmm_phys_to_virt((uint64_t)frames);
+    memset(region, 0, size);
+    ring->rings = (uring_rings_t*)region;
+    ring->sqes = (uring_sqe_t*)(region + URING_SQES_OFF);
+    ring->cqes = (uring_cqe_t*)(region + cqes_off);
+    ring->frames = frames;
+    ring->pages = pages;
+    ring->size = size;
+    ring->rings->sq_mask = sq_entries - 1;
+    ring->rings->cq_mask = cq_entries - 1;
+    ring->rings->sq_entries = sq_entries;
+    ring->rings->cq_entries = cq_entries;
+
+    // The frames stay the kernel's, the mapping is shared so fork never write-protects them
+    mm_t *mm = task->mm;
+    ring->user_addr = vma_find_gap(mm, size, PAGE_SIZE_4K, VMA_MMAP_BASE);
+    bool ok = ring->user_addr && vma_map_anon(mm, ring->user_addr, size, VMA_READ | VMA_WRITE | VMA_SHARED);
+    if (ok) {
+        uint64_t old_space, irq_flags;
+        mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+        for (size_t i = 0; i < pages && ok; i++) {
+            ok = vmm_map_page(ring->user_addr + i * PAGE_SIZE_4K, (uint64_t)frames + i * PAGE_SIZE_4K,
+                              VMM_FLAG_USER | VMM_FLAG_WRITABLE | VMM_FLAG_NO_EXECUTE | VMM_FLAG_SHARED);
+        }
+        mm_leave(old_mm, old_space, irq_flags);
+    }
+    if (!ok) {
+        if (ring->user_addr) vma_unmap(mm, ring->user_addr, size);
+        pmm_free_pages(frames, pages);
+        kfree(ring);
+        LOG_ERROR("uring: failed to map a ring for task %u", task->tid);
+        return -1;
+    }
+
+    params->sq_entries = sq_entries;
+    params->cq_entries = cq_entries;
+    params->ring_addr = ring->user_addr;
+    params->ring_size = size;
+    params->sqes_off = URING_SQES_OFF;
+    params->cqes_off = cqes_off;
+
+    task->uring = ring;
+    uring_stats.rings++;
+    return URING_FD;
+}
+
+// File range a read entry covers, for batched readahead
+static bool read_range(const uring_sqe_t *sqe, pcache_range_t *range) {
+    vfs_file_t *file = vfs_get_file(sqe->fd);
+    vfs_stat_t st;
+    if (!file || !file->ino || !file->ops->stat || !file->ops->stat(file, &st)) {
+        return false;
+    }
+
+    uint64_t len = sqe->len;
+    if (sqe->opcode == URING_OP_READV) {
+        const struct iovec *iov = (const struct iovec*)sqe->addr;
+        if (!iov || sqe->len > IOV_MAX) {
+            return false;
+        }
+        len = 0;
+        for (uint32_t i = 0; i < sqe->len; i++) {
+            len += iov[i].iov_len;
+        }
+    }
+
+    uint64_t off = sqe->off == URING_OFF_CURRENT ? file->position : sqe->off;
+    uint64_t end = off + len;
+    if (end > st.size) {
+        end = st.size;
+    }
+    if (len == 0 || off >= end) {
+        return false;
+    }
+
+    range->ino = file->ino;
+    range->index = (uint32_t)(off / PCACHE_PAGE_SIZE);
+    range->count = (end - 1) / PCACHE_PAGE_SIZE - range->index + 1;
+    return true;
+}
+
+// Read the uncached pages of every read in a batch with one fill, so the drive gets the
+// whole batch at once instead of one entry's worth at a time
+static void prefetch_batch(const uring_sqe_t *sqes, size_t count) {
+    pcache_range_t ranges[URING_BATCH];
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if ((sqes[i].opcode == URING_OP_READ || sqes[i].opcode == URING_OP_READV) &&
+            read_range(&sqes[i], &ranges[n])) {
+            n++;
+        }
+    }
+
+    if (n > 0) {
+        uring_stats.prefetched += pcache_readahead_batch(ranges, n);
+    }
+}
+
+// Vectored transfer at an explicit offset, stopping at the first short one like readv
+static long transfer_vector_at(int fd, const struct iovec *iov, uint32_t count, uint64_t off, bool write) {
+    if (!iov || count > IOV_MAX) {
+        return -1;
+    }
+
+    long total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (iov[i].iov_len == 0) continue;
+
+        long n = write ? sys_pwrite64(fd, iov[i].iov_base, iov[i].iov_len, (off_t)(off + total))
+                       : sys_pread64(fd, iov[i].iov_base, iov[i].iov_len, (off_t)(off + total));
+        if (n < 0) return total > 0 ? total : -1;
+        total += n;
+        if ((size_t)n < iov[i].iov_len) break;
+    }
+    return total;
+}
+
+// Run one entry, returns what its system call would
+static long execute(uring_rings_t *rings, const uring_sqe_t *sqe) {
+    bool current = sqe->off == URING_OFF_CURRENT;
+
+    switch (sqe->opcode) {
+        case URING_OP_NOP:
+            return 0;
+        case URING_OP_READ:
+            return current ? sys_read(sqe->fd, (void*)sqe->addr, sqe->len)
+                           : sys_pread64(sqe->fd, (void*)sqe->addr, sqe->len, (off_t)sqe->off);
+        case URING_OP_WRITE:
+            return current ? sys_write(sqe->fd, (const void*)sqe->addr, sqe->len)
+                           : sys_pwrite64(sqe->fd, (const void*)sqe->addr, sqe->len, (off_t)sqe->off);
+        case URING_OP_READV:
+            return current ? sys_readv(sqe->fd, (const struct iovec*)sqe->addr, (int)sqe->len)
+                           : transfer_vector_at(sqe->fd, (const struct iovec*)sqe->addr, sqe->len, sqe->off, false);
+        case URING_OP_WRITEV:
+            return current ? sys_writev(sqe->fd, (const struct iovec*)sqe->addr, (int)sqe->len)
+                           : transfer_vector_at(sqe->fd, (const struct iovec*)sqe->addr, sqe->len, sqe->off, true);
+        case URING_OP_FSYNC:
+            return vfs_fsync(sqe->fd) ? 0 : -1;
+        case URING_OP_OPENAT:
+            // Relative paths start in the working directory, the directory descriptor in fd is not used
+            return sys_open((const char*)sqe->addr, (int)sqe->op_flags, (int)sqe->len);
+        case URING_OP_CLOSE:
+            return sys_close(sqe->fd);
+        default:
+            rings->sq_dropped++;
+            return -1;
+    }
+}
+
+// Run up to to_submit queued entries and post their completions
+long uring_enter(uint32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    task_t *task = scheduler_get_current_task();
+    uring_t *ring = task ? task->uring : NULL;
+    if (!ring || fd != URING_FD) {
+        return -1;
+    }
+    uring_stats.enters++;
+
+    uring_rings_t *rings = ring->rings;
+    uint32_t sq_head = rings->sq_head;
+    uint32_t sq_tail = __atomic_load_n(&rings->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t cq_head = __atomic_load_n(&rings->cq_head, __ATOMIC_ACQUIRE);
+    uint32_t cq_tail = rings->cq_tail;
+
+    // Every entry taken needs a free completion slot, the rest stay queued
+    uint32_t queued = sq_tail - sq_head;
+    uint32_t cq_free = rings->cq_entries - (cq_tail - cq_head);
+    if (queued > rings->sq_entries) {
+        return -1;  // The tail was moved past the entries
+    }
+    uint32_t count = to_submit < queued ? to_submit : queued;
+    if (count > cq_free) {
+        count = cq_free;
+    }
+
+    uint32_t done = 0;
+    while (done < count) {
+        // Entries are copied first, userspace may reuse the slots while they run
+        uring_sqe_t batch[URING_BATCH];
+        size_t n = count - done < URING_BATCH ? count - done : URING_BATCH;
+        for (size_t i = 0; i < n; i++) {
+            batch[i] = ring->sqes[(sq_head + i) & rings->sq_mask];
+        }
+        sq_head += n;
+        __atomic_store_n(&rings->sq_head, sq_head, __ATOMIC_RELEASE);
+
+        prefetch_batch(batch, n);
+
+        for (size_t i = 0; i < n; i++) {
+            uring_cqe_t *cqe = &ring->cqes[cq_tail & rings->cq_mask];
+            cqe->user_data = batch[i].user_data;
+            cqe->res = (int32_t)execute(rings, &batch[i]);
+            cqe->flags = 0;
+            cq_tail++;
+        }
+
+        // Completions of a batch become visible together
+        __atomic_store_n(&rings->cq_tail, cq_tail, __ATOMIC_RELEASE);
+        done += n;
+    }
+    uring_stats.submitted += done;
+
+    // Every entry completes before this returns, so there is never anything to wait for
+    (void)min_complete;
+    (void)flags;
+    return done;
+}
+
+// Drop the ring mapping a forked child inherited, the ring stays with the parent
+void uring_fork(const task_t *parent, task_t *child) {
+    if (parent->uring && child->mm) {
+        vma_unmap(child->mm, parent->uring->user_addr, parent->uring->size);
+    }
+}
+
+// Free a task's ring once its address space is gone
+void uring_destroy(task_t *task) {
+    uring_t *ring = task->uring;
+    if (!ring) {
+        return;
+    }
+
+    pmm_free_pages(ring->frames, ring->pages);
+    kfree(ring);
+    task->uring = NULL;
+    uring_stats.rings--;
+}
+
+// Get ring statistics
+void uring_get_stats(uring_stats_t *stats) {
+    if (stats) {
+        *stats = uring_stats;
+    }
+}
+
+// Print ring statistics
+void uring_print_stats(void) {
+    LOG_INFO("uring Statistics:");
+    LOG_INFO("  Rings: %u, enters: %u, entries: %u",
+             (uint32_t)uring_stats.rings, (uint32_t)uring_stats.enters, (uint32_t)uring_stats.submitted);
+    LOG_INFO("  Pages read ahead for batches: %u", (uint32_t)uring_stats.prefetched);
+}
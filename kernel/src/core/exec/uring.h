@@ -0,0 +1,117 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct task;
+
+// Ring limits
+#define URING_MAX_ENTRIES   1024        // Submission entries of one ring, completions get twice as many
+#define URING_BATCH         16          // Entries taken off the submission queue at once
+#define URING_FD            0           // Descriptor of a task's ring, each task has at most one
+
+// Operations, numbered like their Linux IORING_OP_* counterparts
+#define URING_OP_NOP        0
+#define URING_OP_READV      1
+#define URING_OP_WRITEV     2
+#define URING_OP_FSYNC      3
+#define URING_OP_OPENAT     18
+#define URING_OP_CLOSE      19
+#define URING_OP_READ       22
+#define URING_OP_WRITE      23
+
+// io_uring_enter flags
+#define URING_ENTER_GETEVENTS   (1U << 0)
+
+// Offset meaning the file's current position
+#define URING_OFF_CURRENT   ((uint64_t)-1)
+
+// Submission queue entry, the fields used here sit where Linux has them
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;                       // File offset or URING_OFF_CURRENT
+    uint64_t addr;                      // Buffer, iovec array or path
+    uint32_t len;                       // Bytes, iovec count or open mode
+    uint32_t op_flags;                  // Open flags
+    uint64_t user_data;                 // Copied to the completion
+    uint64_t pad[3];
+} uring_sqe_t;
+
+// Completion queue entry
+typedef struct {
+    uint64_t user_data;
+    int32_t res;                        // What the matching system call returns
+    uint32_t flags;
+} uring_cqe_t;
+
+// Head of the shared region, followed by the submission and completion entries. Userspace
+// moves sq_tail and cq_head, the kernel sq_head and cq_tail.
+typedef struct {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    volatile uint32_t sq_dropped;       // Entries with an unknown opcode
+    uint32_t reserved[7];
+} uring_rings_t;
+
+// io_uring_setup parameters, sq_entries is rounded up to a power of two and the rest is
+// filled in by the kernel
+typedef struct {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t resv;
+    uint64_t ring_addr;                 // User address of the shared region
+    uint64_t ring_size;
+    uint32_t sqes_off;                  // Offsets of the entry arrays in the region
+    uint32_t cqes_off;
+} uring_params_t;
+
+// Kernel side of a task's ring
+typedef struct uring {
+    uring_rings_t *rings;               // Kernel view of the shared region
+    uring_sqe_t *sqes;
+    uring_cqe_t *cqes;
+    void *frames;                       // Physical base of the region
+    size_t pages;
+    uint64_t user_addr;
+    uint64_t size;
+} uring_t;
+
+// Ring statistics
+typedef struct {
+    size_t rings;                       // Live rings
+    size_t enters;                      // io_uring_enter calls
+    size_t submitted;                   // Entries consumed
+    size_t prefetched;                  // Page cache pages read by batched readahead
+} uring_stats_t;
+
+// Create the current task's ring and map it into its address space
+long uring_setup(uint32_t entries, uring_params_t *params);
+
+// Run up to to_submit queued entries and post their completions
+long uring_enter(uint32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+
+// Drop the ring mapping a forked child inherited, the ring stays with the parent
+void uring_fork(const struct task *parent, struct task *child);
+
+// Free a task's ring once its address space is gone
+void uring_destroy(struct task *task);
+
+// Get ring statistics
+void uring_get_stats(uring_stats_t *stats);
+
+// Print ring statistics
+void uring_print_stats(void);
+
+#endif // URING_H
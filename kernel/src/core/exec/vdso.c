@@ -0,0 +1,268 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
+#include <core/exec/vdso.h>
+#include <core/exec/syscalls.h>
+#include <core/exec/scheduler.h>
+#include <memory/vma.h>
+#include <memory/vmm.h>
+#include <memory/pmm.h>
+#include <drivers/timer/timer.h>
+#include <utils/log.h>
+#include <lib/string.h>
+#include <stddef.h>
+
+#define VDSO_STR(x)     #x
+#define VDSO_XSTR(x)    VDSO_STR(x)
+
+// The entry code reads the data page at these offsets
+_Static_assert(offsetof(vdso_data_t, seq) == 0, "vdso_data_t layout");
+_Static_assert(offsetof(vdso_data_t, clock_mode) == 4, "vdso_data_t layout");
+_Static_assert(offsetof(vdso_data_t, tsc_boot) == 8, "vdso_data_t layout");
+_Static_assert(offsetof(vdso_data_t, tsc_ns_mult) == 16, "vdso_data_t layout");
+_Static_assert(offsetof(vdso_data_t, realtime_offset_ns) == 24, "vdso_data_t layout");
+_Static_assert(offsetof(vdso_data_t, coarse_ns) == 32, "vdso_data_t layout");
+
+// Entry code, copied to its own page. It only uses relative jumps and the fixed data
+// addresses, so it runs wherever the page is mapped.
+extern const uint8_t vdso_text_start[];
+extern const uint8_t vdso_text_end[];
+
+__asm__(
+    ".pushsection .rodata\n"
+    ".balign 16\n"
+    ".global vdso_text_start\n"
+    ".global vdso_text_end\n"
+    "vdso_text_start:\n"
+    "    jmp vdso_clock_gettime\n"
+    "    .balign 8, 0xCC\n"
+    "    jmp vdso_gettimeofday\n"
+    "    .balign 8, 0xCC\n"
+    "    jmp vdso_getpid\n"
+    "    .balign 8, 0xCC\n"
+
+    // Nanoseconds into RAX, EDI bit 0 adds the wall clock offset and bit 1 picks the coarse clock
+    "vdso_read_ns:\n"
+    "    movabs $" VDSO_XSTR(VDSO_DATA_ADDR) ", %rsi\n"
+    ".Lvdso_retry:\n"
+    "    mov (%rsi), %r8d\n"
+    "    test $1, %r8d\n" // An update is in progress
+    "    jnz .Lvdso_busy\n"
+    "    mov 32(%rsi), %rax\n"
+    "    test $2, %edi\n"
+    "    jnz .Lvdso_offset\n"
+    "    cmpl $" VDSO_XSTR(VDSO_CLOCK_TSC) ", 4(%rsi)\n"
+    "    jne .Lvdso_offset\n"
+    "    lfence\n" // Keep RDTSC after the sequence read
+    "    rdtsc\n"
+    "    shl $32, %rdx\n"
+    "    or %rdx, %rax\n"
+    "    sub 8(%rsi), %rax\n"
+    "    mulq 16(%rsi)\n"
+    "    shrd $32, %rdx, %rax\n"
+    ".Lvdso_offset:\n"
+    "    test $1, %edi\n"
+    "    jz .Lvdso_check\n"
+    "    add 24(%rsi), %rax\n"
+    ".Lvdso_check:\n"
+    "    cmp (%rsi), %r8d\n"
+    "    jne .Lvdso_retry\n"
+    "    ret\n"
+    ".Lvdso_busy:\n"
+    "    pause\n"
+    "    jmp .Lvdso_retry\n"
+
+    // long clock_gettime(int clock, struct timespec *ts)
+    "vdso_clock_gettime:\n"
+    "    cmp $" VDSO_XSTR(CLOCK_BOOTTIME) ", %edi\n"
+    "    ja .Lvdso_clock_syscall\n"
+    "    mov $0xF3, %eax\n" // Clocks 0, 1, 4, 5, 6 and 7
+    "    bt %edi, %eax\n"
+    "    jnc .Lvdso_clock_syscall\n"
+    "    mov %rsi, %r9\n"
+    "    lea (%rdi,%rdi), %ecx\n"
+    "    mov $0x2C01, %eax\n" // Two read_ns flag bits per clock
+    "    shr %cl, %eax\n"
+    "    and $3, %eax\n"
+    "    mov %eax, %edi\n"
+    "    call vdso_read_ns\n"
+    "    xor %edx, %edx\n"
+    "    mov $1000000000, %ecx\n"
+    "    div %rcx\n"
+    "    mov %rax, (%r9)\n"
+    "    mov %rdx, 8(%r9)\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+    ".Lvdso_clock_syscall:\n"
+    "    mov $" VDSO_XSTR(SYS_CLOCK_GETTIME) ", %eax\n"
+    "    syscall\n"
+    "    ret\n"
+
+    // long gettimeofday(struct timeval *tv, void *tz), the time zone reads as UTC
+    "vdso_gettimeofday:\n"
+    "    test %rsi, %rsi\n"
+    "    jz .Lvdso_tv\n"
+    "    movq $0, (%rsi)\n"
+    ".Lvdso_tv:\n"
+    "    test %rdi, %rdi\n"
+    "    jz .Lvdso_tv_done\n"
+    "    mov %rdi, %r9\n"
+    "    mov $1, %edi\n"
+    "    call vdso_read_ns\n"
+    "    xor %edx, %edx\n"
+    "    mov $1000, %ecx\n"
+    "    div %rcx\n"
+    "    xor %edx, %edx\n"
+    "    mov $1000000, %ecx\n"
+    "    div %rcx\n"
+    "    mov %rax, (%r9)\n"
+    "    mov %rdx, 8(%r9)\n"
+    ".Lvdso_tv_done:\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+
+    // long getpid(void)
+    "vdso_getpid:\n"
+    "    movabs $" VDSO_XSTR(VDSO_TASK_ADDR) ", %rax\n"
+    "    mov (%rax), %eax\n"
+    "    ret\n"
+    "vdso_text_end:\n"
+    ".popsection\n"
+);
+
+// Frames shared by every address space
+static uint64_t data_frame = 0;
+static uint64_t text_frame = 0;
+static vdso_data_t *data = NULL;
+static spinlock_t update_lock;
+
+// Set up the clock data and entry code pages
+bool vdso_init(void) {
+    size_t text_size = (size_t)(vdso_text_end - vdso_text_start);
+    if (text_size > PAGE_SIZE_4K) {
+        LOG_ERROR("vDSO: entry code is %u bytes, more than a page", (uint32_t)text_size);
+        return false;
+    }
+
+    void *data_page = pmm_alloc_page();
+    void *text_page = pmm_alloc_page();
+    if (!data_page || !text_page) {
+        LOG_ERROR_MSG("vDSO: out of memory");
+        if (data_page) pmm_free_page(data_page);
+        if (text_page) pmm_free_page(text_page);
+        return false;
+    }
+    data_frame = (uint64_t)data_page;
+    text_frame = (uint64_t)text_page;
+
+    // Padding traps, a jump past the end of the code cannot run into stale bytes
+    uint8_t *text = vmm_phys_to_virt(text_frame);
+    memset(text, 0xCC, PAGE_SIZE_4K);
+    memcpy(text, vdso_text_start, text_size);
+
+    data = vmm_phys_to_virt(data_frame);
+    memset(data, 0, PAGE_SIZE_4K);
+    data->clock_mode = timer_get_tsc_clock(&data->tsc_boot, &data->tsc_ns_mult) ?
+                       VDSO_CLOCK_TSC : VDSO_CLOCK_COARSE;
+    data->coarse_ns = timer_get_uptime_ns();
+    spinlock_init(&update_lock);
+
+    LOG_INFO("vDSO: %s clock, entry code %u bytes at 0x%llx",
+             data->clock_mode == VDSO_CLOCK_TSC ? "TSC" : "tick", (uint32_t)text_size,
+             (uint64_t)VDSO_TEXT_ADDR);
+    return true;
+}
+
+// Map a fresh task page into the current address space, replacing an inherited one
+static bool map_task_page(uint32_t pid) {
+    void *frame = pmm_alloc_page();
+    if (!frame) {
+        return false;
+    }
+
+    vdso_task_t *task = vmm_phys_to_virt((uint64_t)frame);
+    memset(task, 0, PAGE_SIZE_4K);
+    task->pid = pid;
+
+    vmm_release_pages(VDSO_TASK_ADDR, 1);
+    if (!vmm_map_page(VDSO_TASK_ADDR, (uint64_t)frame,
+                      VMM_FLAG_USER | VMM_FLAG_NO_EXECUTE | VMM_FLAG_REF)) {
+        pmm_free_page(frame);
+        return false;
+    }
+    return true;
+}
+
+// Map the vDSO into a new address space
+bool vdso_map(mm_t *mm, uint32_t pid) {
+    if (!data || !mm) {
+        return false;
+    }
+
+    // The areas keep mmap away, the pages are mapped now and never faulted in
+    if (!vma_map_anon(mm, VDSO_DATA_ADDR, 2 * PAGE_SIZE_4K, VMA_READ) ||
+        !vma_map_anon(mm, VDSO_TEXT_ADDR, PAGE_SIZE_4K, VMA_READ | VMA_EXEC)) {
+        return false;
+    }
+
+    uint64_t old_space, irq_flags;
+    mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+    bool ok = vmm_map_page(VDSO_DATA_ADDR, data_frame, VMM_FLAG_USER | VMM_FLAG_NO_EXECUTE) &&
+              vmm_map_page(VDSO_TEXT_ADDR, text_frame, VMM_FLAG_USER) &&
+              map_task_page(pid);
+    mm_leave(old_mm, old_space, irq_flags);
+    return ok;
+}
+
+// Give a forked address space a task page of its own
+bool vdso_fork(mm_t *mm, uint32_t pid) {
+    if (!data || !mm) {
+        return true;  // Nothing was mapped to inherit
+    }
+
+    uint64_t old_space, irq_flags;
+    mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+    bool ok = map_task_page(pid);
+    mm_leave(old_mm, old_space, irq_flags);
+    return ok;
+}
+
+// Refresh the coarse clock, a CPU that finds another one updating skips its turn
+void vdso_update(void) {
+    if (!data || !spinlock_try_acquire(&update_lock)) {
+        return;
+    }
+
+    uint64_t now = timer_get_uptime_ns();
+    data->seq++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    data->coarse_ns = now;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    data->seq++;
+
+    spinlock_release(&update_lock);
+}
+
+// Read a clock the way the vDSO does
+bool vdso_clock_ns(int clock, uint64_t *ns) {
+    uint64_t offset = data ? data->realtime_offset_ns : 0;
+    uint64_t coarse = data ? data->coarse_ns : timer_get_uptime_ns();
+
+    switch (clock) {
+        case CLOCK_REALTIME:
+            *ns = timer_get_uptime_ns() + offset;
+            return true;
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_BOOTTIME:
+            *ns = timer_get_uptime_ns();
+            return true;
+        case CLOCK_REALTIME_COARSE:
+            *ns = coarse + offset;
+            return true;
+        case CLOCK_MONOTONIC_COARSE:
+            *ns = coarse;
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct mm;
+
+// Fixed user addresses of the vDSO pages, just below the top of the lower half. The values
+// have no suffix since the entry code uses them as assembler immediates.
+#define VDSO_DATA_ADDR      0x7FFFFFFFC000      // Clock data, one frame shared by every task
+#define VDSO_TASK_ADDR      0x7FFFFFFFD000      // Data of the task it is mapped in
+#define VDSO_TEXT_ADDR      0x7FFFFFFFE000      // Entry points
+#define VDSO_PAGES          3
+
+// Entry points as offsets from VDSO_TEXT_ADDR, called with the SysV ABI. Unsupported clocks
+// fall back to the system call.
+#define VDSO_CLOCK_GETTIME  0x00                // long clock_gettime(int clock, struct timespec *ts)
+#define VDSO_GETTIMEOFDAY   0x08                // long gettimeofday(struct timeval *tv, void *tz)
+#define VDSO_GETPID         0x10                // long getpid(void)
+
+// How the clock data is read
+#define VDSO_CLOCK_TSC      0                   // Scale the TSC like timer_get_uptime_ns does
+#define VDSO_CLOCK_COARSE   1                   // Only coarse_ns, updated every tick
+
+// Clock data page, a sequence count guards the fields the kernel changes after boot
+typedef struct {
+    volatile uint32_t seq;                      // Odd while an update is in progress
+    uint32_t clock_mode;
+    uint64_t tsc_boot;                          // TSC reading at uptime 0
+    uint64_t tsc_ns_mult;                       // 32.32 nanoseconds per TSC cycle
+    uint64_t realtime_offset_ns;                // Wall clock time at uptime 0
+    uint64_t coarse_ns;                         // Uptime at the last tick
+} vdso_data_t;
+
+// Task data page
+typedef struct {
+    uint32_t pid;
+} vdso_task_t;
+
+// Set up the clock data and entry code pages
+bool vdso_init(void);
+
+// Map the vDSO into a new address space
+bool vdso_map(struct mm *mm, uint32_t pid);
+
+// Give a forked address space a task page of its own
+bool vdso_fork(struct mm *mm, uint32_t pid);
+
+// Refresh the coarse clock, called from the scheduler tick on any CPU
+void vdso_update(void);
+
+// Read a clock the way the vDSO does, false for clocks it does not provide
+bool vdso_clock_ns(int clock, uint64_t *ns);
+
+#endif // VDSO_H
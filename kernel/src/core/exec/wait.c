@@ -0,0 +1,321 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_SCHED
+
+#include <core/exec/wait.h>
+#include <core/cpu.h>
+#include <drivers/timer/timer.h>
+#include <utils/log.h>
+#include <stddef.h>
+
+// Completion count that stays set for every later waiter
+#define COMPLETION_ALL  0x7FFFFFFFU
+
+// Statistics
+static wait_stats_t wait_stats = {0};
+
+// Link a waiter at the tail, called with the queue lock held
+static void enqueue_entry(wait_queue_t* wq, wait_entry_t* entry) {
+    entry->next = NULL;
+    entry->prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = entry;
+    } else {
+        wq->head = entry;
+    }
+    wq->tail = entry;
+    entry->queued = true;
+}
+
+// Unlink a waiter, called with the queue lock held
+static void dequeue_entry(wait_queue_t* wq, wait_entry_t* entry) {
+    if (!entry->queued) {
+        return;
+    }
+
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wq->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        wq->tail = entry->prev;
+    }
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->queued = false;
+}
+
+// Timeout of a sleeping waiter
+static void timeout_handler(void* arg) {
+    scheduler_wake_task((task_t*)arg);
+}
+
+void wait_queue_init(wait_queue_t* wq) {
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Sleep until cond holds or the uptime reaches deadline_ns, returns the last result of cond
+bool wait_event_deadline(wait_queue_t* wq, wait_cond_t cond, void* arg, uint64_t deadline_ns) {
+    task_t* task = scheduler_get_current_task();
+    wait_entry_t entry = { .task = task };
+    timer_event_t timeout;
+    timer_event_init(&timeout, timeout_handler, task);
+
+    for (;;) {
+        uint64_t flags = cpu_irq_save();
+        spinlock_acquire(&wq->lock);
+
+        // The condition wins over the timeout so a wakeup that raced with it is not lost
+        if (cond && cond(arg)) {
+            spinlock_release(&wq->lock);
+            cpu_irq_restore(flags);
+            return true;
+        }
+        if (timer_get_uptime_ns() >= deadline_ns) {
+            spinlock_release(&wq->lock);
+            cpu_irq_restore(flags);
+            wait_stats.timeouts++;
+            return false;
+        }
+
+        // Queue first, then block: a waker takes the lock and finds the entry
+        if (task) {
+            enqueue_entry(wq, &entry);
+            if (deadline_ns != UINT64_MAX) {
+                timer_event_add(&timeout, deadline_ns);
+            }
+
+            if (scheduler_sleep_locked(&wq->lock)) {
+                wait_stats.sleeps++;
+                spinlock_acquire(&wq->lock);
+                dequeue_entry(wq, &entry);
+                spinlock_release(&wq->lock);
+                timer_event_cancel(&timeout);
+                cpu_irq_restore(flags);
+                continue;
+            }
+
+            dequeue_entry(wq, &entry);
+            timer_event_cancel(&timeout);
+        }
+
+        // Interrupt handlers, the idle task and early boot code cannot sleep, they poll
+        spinlock_release(&wq->lock);
+        cpu_irq_restore(flags);
+        wait_stats.polls++;
+        __asm__ volatile("pause");
+    }
+}
+
+// Sleep until cond holds
+bool wait_event(wait_queue_t* wq, wait_cond_t cond, void* arg) {
+    return wait_event_deadline(wq, cond, arg, UINT64_MAX);
+}
+
+// Sleep until cond holds or timeout_ms pass, returns false on timeout
+bool wait_event_timeout(wait_queue_t* wq, wait_cond_t cond, void* arg, uint32_t timeout_ms) {
+    if (timeout_ms == WAIT_FOREVER) {
+        return wait_event(wq, cond, arg);
+    }
+    return wait_event_deadline(wq, cond, arg, timer_get_uptime_ns() + (uint64_t)timeout_ms * 1000000);
+}
+
+// Wake up to limit waiters in FIFO order, safe from interrupt handlers
+static uint32_t wake_waiters(wait_queue_t* wq, uint32_t limit) {
+    uint32_t woken = 0;
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&wq->lock);
+
+    // A waiter polling (or not yet asleep) is skipped, it sees the condition itself
+    wait_entry_t* entry = wq->head;
+    while (entry && woken < limit) {
+        wait_entry_t* next = entry->next;
+        if (entry->task && scheduler_wake_task(entry->task)) {
+            dequeue_entry(wq, entry);
+            woken++;
+        }
+        entry = next;
+    }
+
+    spinlock_release(&wq->lock);
+    cpu_irq_restore(flags);
+    wait_stats.wakeups += woken;
+    return woken;
+}
+
+// Wake the longest waiting task
+uint32_t wait_wake_one(wait_queue_t* wq) {
+    return wake_waiters(wq, 1);
+}
+
+// Wake every waiting task
+uint32_t wait_wake_all(wait_queue_t* wq) {
+    return wake_waiters(wq, UINT32_MAX);
+}
+
+// Completions
+
+static bool completion_cond(void* arg) {
+    completion_t* c = arg;
+    if (c->done == 0) {
+        return false;
+    }
+    if (c->done != COMPLETION_ALL) {
+        c->done--;
+    }
+    return true;
+}
+
+void completion_init(completion_t* c) {
+    wait_queue_init(&c->wait);
+    c->done = 0;
+}
+
+// Make a completion usable again, no waiters may be left
+void completion_reinit(completion_t* c) {
+    c->done = 0;
+}
+
+// Let one waiter (present or future) through
+void completion_signal(completion_t* c) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&c->wait.lock);
+    if (c->done != COMPLETION_ALL) {
+        c->done++;
+    }
+    spinlock_release(&c->wait.lock);
+    cpu_irq_restore(flags);
+    wait_wake_one(&c->wait);
+}
+
+// Let every waiter through until completion_reinit
+void completion_signal_all(completion_t* c) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&c->wait.lock);
+    c->done = COMPLETION_ALL;
+    spinlock_release(&c->wait.lock);
+    cpu_irq_restore(flags);
+    wait_wake_all(&c->wait);
+}
+
+void completion_wait(completion_t* c) {
+    wait_event(&c->wait, completion_cond, c);
+}
+
+bool completion_wait_timeout(completion_t* c, uint32_t timeout_ms) {
+    return wait_event_timeout(&c->wait, completion_cond, c, timeout_ms);
+}
+
+// Mutexes
+
+static bool mutex_cond(void* arg) {
+    mutex_t* m = arg;
+    if (m->locked) {
+        return false;
+    }
+    m->locked = true;
+    m->owner = scheduler_get_current_task();
+    return true;
+}
+
+void mutex_init(mutex_t* m) {
+    wait_queue_init(&m->wait);
+    m->owner = NULL;
+    m->locked = false;
+}
+
+void mutex_lock(mutex_t* m) {
+    if (m->locked && m->owner && m->owner == scheduler_get_current_task()) {
+        LOG_ERROR("Mutex: task %u locks a mutex it already holds", m->owner->tid);
+    }
+    wait_event(&m->wait, mutex_cond, m);
+}
+
+bool mutex_trylock(mutex_t* m) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&m->wait.lock);
+    bool taken = mutex_cond(m);
+    spinlock_release(&m->wait.lock);
+    cpu_irq_restore(flags);
+    return taken;
+}
+
+// Release the mutex and hand the chance to take it to the longest waiter
+void mutex_unlock(mutex_t* m) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&m->wait.lock);
+    if (m->owner != scheduler_get_current_task()) {
+        LOG_WARN("Mutex: unlocked by a task that does not own it");
+    }
+    m->owner = NULL;
+    m->locked = false;
+    spinlock_release(&m->wait.lock);
+    cpu_irq_restore(flags);
+    wait_wake_one(&m->wait);
+}
+
+bool mutex_is_locked(mutex_t* m) {
+    return m->locked;
+}
+
+// Semaphores
+
+static bool semaphore_cond(void* arg) {
+    semaphore_t* s = arg;
+    if (s->count <= 0) {
+        return false;
+    }
+    s->count--;
+    return true;
+}
+
+void semaphore_init(semaphore_t* s, int32_t count) {
+    wait_queue_init(&s->wait);
+    s->count = count;
+}
+
+void semaphore_down(semaphore_t* s) {
+    wait_event(&s->wait, semaphore_cond, s);
+}
+
+bool semaphore_down_timeout(semaphore_t* s, uint32_t timeout_ms) {
+    return wait_event_timeout(&s->wait, semaphore_cond, s, timeout_ms);
+}
+
+bool semaphore_trydown(semaphore_t* s) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&s->wait.lock);
+    bool taken = semaphore_cond(s);
+    spinlock_release(&s->wait.lock);
+    cpu_irq_restore(flags);
+    return taken;
+}
+
+// Safe from interrupt handlers
+void semaphore_up(semaphore_t* s) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&s->wait.lock);
+    s->count++;
+    spinlock_release(&s->wait.lock);
+    cpu_irq_restore(flags);
+    wait_wake_one(&s->wait);
+}
+
+// Get wait queue statistics
+void wait_get_stats(wait_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+    *stats = wait_stats;
+}
+
+// Print wait queue statistics
+void wait_print_stats(void) {
+    LOG_INFO("Wait Queue Statistics:");
+    LOG_INFO("  Sleeps: %u, wakeups: %u, timeouts: %u, polled waits: %u",
+             (uint32_t)wait_stats.sleeps, (uint32_t)wait_stats.wakeups,
+             (uint32_t)wait_stats.timeouts, (uint32_t)wait_stats.polls);
+}
@@ -0,0 +1,90 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/exec/scheduler.h>
+
+// Timeout that never expires
+#define WAIT_FOREVER    0xFFFFFFFFU
+
+// Waiter linked into a wait queue, lives on the sleeping task's stack
+typedef struct wait_entry {
+    task_t* task;
+    struct wait_entry* next;
+    struct wait_entry* prev;
+    bool queued;
+} wait_entry_t;
+
+// FIFO of tasks sleeping until an event, the lock also guards whatever the condition reads
+typedef struct {
+    spinlock_t lock;
+    wait_entry_t* head;
+    wait_entry_t* tail;
+} wait_queue_t;
+
+// Condition checked with the queue lock held, it may consume the event it waits for
+typedef bool (*wait_cond_t)(void* arg);
+
+// One-shot or counted event, each completion_signal lets one waiter through
+typedef struct {
+    wait_queue_t wait;
+    volatile uint32_t done;
+} completion_t;
+
+// Sleeping mutex, only the owner may unlock it
+typedef struct {
+    wait_queue_t wait;
+    task_t* volatile owner;
+    volatile bool locked;
+} mutex_t;
+
+// Counting semaphore
+typedef struct {
+    wait_queue_t wait;
+    volatile int32_t count;
+} semaphore_t;
+
+// Wait queue statistics
+typedef struct {
+    uint64_t sleeps;                    // Times a task blocked on a queue
+    uint64_t wakeups;                   // Waiters woken by wait_wake_one/wait_wake_all
+    uint64_t timeouts;                  // Waits that ended on their timeout
+    uint64_t polls;                     // Waits spun because the caller could not block
+} wait_stats_t;
+
+// Wait queues
+void wait_queue_init(wait_queue_t* wq);
+bool wait_event(wait_queue_t* wq, wait_cond_t cond, void* arg);
+bool wait_event_timeout(wait_queue_t* wq, wait_cond_t cond, void* arg, uint32_t timeout_ms);
+bool wait_event_deadline(wait_queue_t* wq, wait_cond_t cond, void* arg, uint64_t deadline_ns);
+uint32_t wait_wake_one(wait_queue_t* wq);
+uint32_t wait_wake_all(wait_queue_t* wq);
+
+// Completions
+void completion_init(completion_t* c);
+void completion_reinit(completion_t* c);
+void completion_signal(completion_t* c);
+void completion_signal_all(completion_t* c);
+void completion_wait(completion_t* c);
+bool completion_wait_timeout(completion_t* c, uint32_t timeout_ms);
+
+// Mutexes
+void mutex_init(mutex_t* m);
+void mutex_lock(mutex_t* m);
+bool mutex_trylock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
+bool mutex_is_locked(mutex_t* m);
+
+// Semaphores
+void semaphore_init(semaphore_t* s, int32_t count);
+void semaphore_down(semaphore_t* s);
+bool semaphore_down_timeout(semaphore_t* s, uint32_t timeout_ms);
+bool semaphore_trydown(semaphore_t* s);
+void semaphore_up(semaphore_t* s);
+
+// Statistics
+void wait_get_stats(wait_stats_t* stats);
+void wait_print_stats(void);
+
+#endif // WAIT_H
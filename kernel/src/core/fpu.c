@@ -0,0 +1,385 @@
+#include <core/fpu.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <core/exec/scheduler.h>
+#include <memory/slab.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Control register bits
+#define CR0_MP          (1ULL << 1)     // WAIT honours TS
+#define CR0_EM          (1ULL << 2)     // Emulate x87, must be clear
+#define CR0_TS          (1ULL << 3)     // Task switched, next FPU use raises #NM
+#define CR0_NE          (1ULL << 5)     // Native x87 error reporting
+#define CR4_OSFXSR      (1ULL << 9)     // FXSAVE/FXRSTOR and SSE
+#define CR4_OSXMMEXCPT  (1ULL << 10)    // Unmasked SSE exceptions raise #XM
+#define CR4_OSXSAVE     (1ULL << 18)    // XSAVE and XCR0
+
+// XCR0 state components
+#define XCR0_X87        (1ULL << 0)
+#define XCR0_SSE        (1ULL << 1)
+#define XCR0_AVX        (1ULL << 2)
+
+// Legacy FXSAVE area size, also the minimum XSAVE area
+#define FXSAVE_SIZE     512
+
+// Default MXCSR, all SIMD exceptions masked
+#define MXCSR_DEFAULT   0x1F80
+
+// SSE2 page kernels in lib/simd.asm
+extern void simd_clear_page(void *page);
+extern void simd_copy_page(void *dest, const void *src);
+
+// FPU configuration
+static bool ready = false;
+static bool use_xsave = false;
+static uint64_t xcr0 = 0;
+static uint32_t state_size = FXSAVE_SIZE;
+static kmem_cache_t *state_cache = NULL;
+static void *init_state = NULL;         // Registers after reset, loaded on a task's first use
+
+// Task whose registers each CPU holds, NULL once a kernel section clobbered them. A task's
+// registers are saved whenever it switches out, so the slot only spares a reload when it
+// comes back to the same CPU, and only while fpu_cpu still names that CPU.
+static struct task *owner[MAX_CPUS];
+
+// Kernel FPU sections
+static uint32_t kernel_depth[MAX_CPUS];
+static uint64_t kernel_flags[MAX_CPUS];
+
+// Statistics
+static uint64_t stat_traps = 0;
+static uint64_t stat_saves = 0;
+static uint64_t stat_restores = 0;
+static uint64_t stat_kernel_sections = 0;
+
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    __asm__ volatile("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// Write the live registers to a state area
+static void save_state(void *area) {
+    if (use_xsave) {
+        __asm__ volatile("xsave64 (%0)"
+                         : : "r"(area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32))
+                         : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+    stat_saves++;
+}
+
+// Load the registers from a state area
+static void restore_state(const void *area) {
+    if (use_xsave) {
+        __asm__ volatile("xrstor64 (%0)"
+                         : : "r"(area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32))
+                         : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+    stat_restores++;
+}
+
+// Check if the registers of a CPU hold a task's latest values
+static inline bool holds(uint32_t cpu, struct task *task) {
+    return task && owner[cpu] == task && task->fpu_cpu == cpu;
+}
+
+// #NM handler: hand the registers to the current task
+static void fpu_trap_handler(struct interrupt_frame *frame) {
+    (void)frame;
+    uint32_t cpu = cpu_current_id();
+    task_t *task = scheduler_get_current_task();
+
+    clts();
+    stat_traps++;
+
+    if (holds(cpu, task)) {
+        return;  // Nobody touched the registers since this task last used them
+    }
+
+    // The previous owner saved its registers when it switched out
+    owner[cpu] = NULL;
+
+    if (!task) {
+        restore_state(init_state);
+        return;
+    }
+
+    // First use starts from the reset state
+    if (!task->fpu_state) {
+        task->fpu_state = kmem_cache_alloc(state_cache);
+        if (!task->fpu_state) {
+            LOG_ERROR("FPU: no memory for the state of task %u", task->tid);
+            restore_state(init_state);
+            return;
+        }
+        memcpy(task->fpu_state, init_state, state_size);
+    }
+
+    restore_state(task->fpu_state);
+    owner[cpu] = task;
+    task->fpu_cpu = cpu;
+}
+
+// Turn on the units in the control registers of the executing CPU
+static void enable_unit(void) {
+    write_cr0((read_cr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    if (use_xsave) {
+        write_cr4(read_cr4() | CR4_OSXSAVE);
+        xsetbv(0, xcr0);
+    }
+}
+
+// Enable the FPU and SIMD units
+bool fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_FXSR)) {
+        LOG_ERROR_MSG("FPU: FXSAVE not supported");
+        return false;
+    }
+
+    // XSAVE covers AVX state too, FXSAVE only x87 and SSE
+    use_xsave = (ecx & CPUID_1_ECX_XSAVE) != 0;
+    xcr0 = XCR0_X87 | XCR0_SSE;
+    if (use_xsave && (ecx & CPUID_1_ECX_AVX)) {
+        xcr0 |= XCR0_AVX;
+    }
+    enable_unit();
+
+    state_size = FXSAVE_SIZE;
+    if (use_xsave) {
+        // EBX of leaf 0xD reports the area size for the components enabled in XCR0
+        cpu_cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        state_size = ebx;
+    }
+
+    // XSAVE areas must be 64-byte aligned, FXSAVE areas 16-byte aligned
+    if (!state_cache) {
+        state_cache = kmem_cache_create("fpu_state", state_size, 64);
+        if (!state_cache) {
+            LOG_ERROR_MSG("FPU: failed to create state cache");
+            return false;
+        }
+    }
+
+    // Capture the reset state once, new tasks copy it
+    init_state = kmem_cache_alloc(state_cache);
+    if (!init_state) {
+        LOG_ERROR_MSG("FPU: failed to allocate initial state");
+        return false;
+    }
+    memset(init_state, 0, state_size);
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    __asm__ volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    save_state(init_state);
+
+    memset(owner, 0, sizeof(owner));
+    memset(kernel_depth, 0, sizeof(kernel_depth));
+    idt_register_handler(FPU_NM_VECTOR, fpu_trap_handler);
+
+    // From now on the first FPU instruction of a task traps and loads its state
+    stts();
+    ready = true;
+
+    LOG_INFO("FPU: %s, %u byte state%s", use_xsave ? "XSAVE" : "FXSAVE", state_size,
+             (xcr0 & XCR0_AVX) ? ", AVX enabled" : "");
+    return true;
+}
+
+// Enable the units on an application processor, with the settings chosen by fpu_init
+bool fpu_init_cpu(void) {
+    if (!ready) {
+        return false;
+    }
+
+    uint32_t cpu = cpu_current_id();
+    enable_unit();
+    owner[cpu] = NULL;
+    kernel_depth[cpu] = 0;
+    stts();
+    return true;
+}
+
+// Check if kernel_fpu_begin can be used
+bool fpu_available(void) {
+    return ready;
+}
+
+// prev's registers are saved as it leaves, since another CPU may steal it. They stay loaded,
+// so coming back here without having run elsewhere needs no reload, and TS makes any other
+// task trap on first use.
+void fpu_switch(struct task *prev, struct task *next) {
+    if (!ready) {
+        return;
+    }
+
+    uint32_t cpu = cpu_current_id();
+    if (holds(cpu, prev) && prev->fpu_state) {
+        clts();
+        save_state(prev->fpu_state);
+    }
+
+    if (holds(cpu, next)) {
+        clts();
+    } else {
+        stts();
+    }
+}
+
+// Give a new task a copy of its parent's FPU state
+bool fpu_fork(struct task *parent, struct task *child) {
+    if (!ready || !parent || !child || !parent->fpu_state) {
+        return true;  // Child starts from the reset state on first use
+    }
+
+    if (!child->fpu_state) {
+        child->fpu_state = kmem_cache_alloc(state_cache);
+        if (!child->fpu_state) {
+            return false;
+        }
+    }
+
+    // The parent's latest values may only be in the registers
+    uint64_t flags = cpu_irq_save();
+    if (holds(cpu_current_id(), parent)) {
+        clts();
+        save_state(parent->fpu_state);
+    }
+    memcpy(child->fpu_state, parent->fpu_state, state_size);
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// Free a task's FPU state
+void fpu_release(struct task *task) {
+    if (!task) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (owner[i] == task) {
+            owner[i] = NULL;
+        }
+    }
+    cpu_irq_restore(flags);
+
+    if (task->fpu_state) {
+        kmem_cache_free(state_cache, task->fpu_state);
+        task->fpu_state = NULL;
+    }
+}
+
+// Start a kernel FPU section
+void kernel_fpu_begin(void) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+
+    if (kernel_depth[cpu]++ > 0) {
+        return;  // Nested, the outer section already owns the registers
+    }
+    kernel_flags[cpu] = flags;
+    stat_kernel_sections++;
+
+    // The running task's registers are saved before the kernel clobbers them, an owner that
+    // switched out saved its own
+    clts();
+    task_t *task = scheduler_get_current_task();
+    if (holds(cpu, task) && task->fpu_state) {
+        save_state(task->fpu_state);
+    }
+    owner[cpu] = NULL;
+}
+
+// End the kernel FPU section
+void kernel_fpu_end(void) {
+    uint32_t cpu = cpu_current_id();
+    if (kernel_depth[cpu] == 0 || --kernel_depth[cpu] > 0) {
+        return;
+    }
+
+    // Nobody owns the registers now, the next user reloads its own
+    stts();
+    cpu_irq_restore(kernel_flags[cpu]);
+}
+
+// Zero a page with streaming stores
+void fpu_clear_page(void *page) {
+    if (!ready || ((uintptr_t)page & 15)) {
+        memset(page, 0, 4096);
+        return;
+    }
+
+    kernel_fpu_begin();
+    simd_clear_page(page);
+    kernel_fpu_end();
+}
+
+// Copy a page with SIMD loads and streaming stores
+void fpu_copy_page(void *dest, const void *src) {
+    if (!ready || (((uintptr_t)dest | (uintptr_t)src) & 15)) {
+        memcpy(dest, src, 4096);
+        return;
+    }
+
+    kernel_fpu_begin();
+    simd_copy_page(dest, src);
+    kernel_fpu_end();
+}
+
+// Get FPU statistics
+void fpu_get_stats(fpu_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->xsave = use_xsave;
+    stats->features = xcr0;
+    stats->state_size = state_size;
+    stats->traps = stat_traps;
+    stats->saves = stat_saves;
+    stats->restores = stat_restores;
+    stats->kernel_sections = stat_kernel_sections;
+}
+
+// Print FPU statistics
+void fpu_print_stats(void) {
+    LOG_INFO("FPU Statistics:");
+    LOG_INFO("  Mode: %s, state size: %u bytes, XCR0: 0x%llx",
+             use_xsave ? "XSAVE" : "FXSAVE", state_size, xcr0);
+    LOG_INFO("  #NM traps: %u, saves: %u, restores: %u",
+             (uint32_t)stat_traps, (uint32_t)stat_saves, (uint32_t)stat_restores);
+    LOG_INFO("  Kernel sections: %u", (uint32_t)stat_kernel_sections);
+}
@@ -0,0 +1,60 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct task;
+
+// Device-not-available exception, raised by FPU/SIMD instructions while CR0.TS is set
+#define FPU_NM_VECTOR 7
+
+// FPU statistics
+typedef struct {
+    bool xsave;                         // XSAVE in use (otherwise FXSAVE)
+    uint64_t features;                  // XCR0 state components
+    uint32_t state_size;                // Bytes saved per task
+    uint64_t traps;                     // #NM traps taken
+    uint64_t saves;                     // Register states written to memory
+    uint64_t restores;                  // Register states loaded from memory
+    uint64_t kernel_sections;           // kernel_fpu_begin calls
+} fpu_stats_t;
+
+// Enable x87/SSE (and AVX with XSAVE), install the #NM handler and arm lazy switching
+bool fpu_init(void);
+
+// Enable the same units on an application processor
+bool fpu_init_cpu(void);
+
+// Check if kernel_fpu_begin can be used
+bool fpu_available(void);
+
+// Called on every context switch, registers are reloaded lazily on the next FPU use
+void fpu_switch(struct task *prev, struct task *next);
+
+// Give a new task a copy of its parent's FPU state
+bool fpu_fork(struct task *parent, struct task *child);
+
+// Free a task's FPU state
+void fpu_release(struct task *task);
+
+// Start a section of kernel code that uses FPU/SIMD registers, runs with interrupts off
+void kernel_fpu_begin(void);
+
+// End the section, the interrupted task's registers come back on its next FPU use
+void kernel_fpu_end(void);
+
+// Zero a 4 KiB page with non-temporal SIMD stores (falls back to memset)
+void fpu_clear_page(void *page);
+
+// Copy a 4 KiB page with SIMD (falls back to memcpy)
+void fpu_copy_page(void *dest, const void *src);
+
+// Get FPU statistics
+void fpu_get_stats(fpu_stats_t *stats);
+
+// Print FPU statistics
+void fpu_print_stats(void);
+
+#endif // FPU_H
@@ -55,6 +55,7 @@ enum gdt_selector {
 
 // Functions declarations
 void gdt_init(void);
+void gdt_init_cpu(uint32_t cpu);
 bool gdt_check_integrity(void);
 void gdt_reload(void);
 bool gdt_recover(void);
@@ -88,8 +88,32 @@ IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
 
+; Vectors handed out at runtime, MSIs and routed I/O APIC inputs
+%assign vector 48
+%rep 176
+global isr%+vector
+isr%+vector:
+    push 0                  ; Push dummy error code
+    push vector             ; Push the interrupt number
+    jmp common_interrupt_handler
+%assign vector vector + 1
+%endrep
+
+; Local APIC timer, reschedule and sync IPI and spurious vectors
+ISR_NO_ERR_CODE 239
+ISR_NO_ERR_CODE 240
+ISR_NO_ERR_CODE 241
+ISR_NO_ERR_CODE 255
+
 ; The common interrupt handler
 common_interrupt_handler:
+    ; Coming from user mode, swap in the kernel GS base (the per-CPU area)
+    ; CS sits above the interrupt number, error code and RIP
+    test qword [rsp + 24], 3
+    jz .from_kernel
+    swapgs
+.from_kernel:
+    
     ; Push all general purpose registers to create our interrupt frame
     push rax
     push rbx
@@ -142,5 +166,21 @@ common_interrupt_handler:
     ; Clean up the error code and interrupt number
     add rsp, 16
     
+    ; Going back to user mode, restore its GS base
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
+    
     ; Return from interrupt
-    iretq
\ No newline at end of file
+    iretq
+
+; Entry points of the runtime vectors, in order
+section .rodata
+global idt_dynamic_stubs
+idt_dynamic_stubs:
+%assign vector 48
+%rep 176
+    dq isr%+vector
+%assign vector vector + 1
+%endrep
@@ -2,7 +2,11 @@
 #include <lib/string.h>
 #include <lib/asm.h>
 #include <utils/log.h>
+#include <utils/trace.h>
+#include <core/exec/scheduler.h>
 #include <drivers/pic/pic.h>
+#include <drivers/apic/lapic.h>
+#include <drivers/apic/ioapic.h>
 
 // The IDT entries
 static struct idt_entry idt[IDT_ENTRIES];
@@ -17,6 +21,9 @@ static struct idt_ptr idt_pointer_backup;
 // Array of handler pointers
 static interrupt_handler_t interrupt_handlers[IDT_ENTRIES] = {0};
 
+// Serializes claiming runtime vectors, a taken one has a handler
+static spinlock_t vector_lock;
+
 // External assembly function to load the IDT
 extern void idt_load(struct idt_ptr* idt_ptr);
 
@@ -72,6 +79,15 @@ extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
 
+// Runtime vector stubs from assembly
+extern const uint64_t idt_dynamic_stubs[IDT_DYNAMIC_COUNT];
+
+// Local APIC vectors from assembly
+extern void isr239(void);
+extern void isr240(void);
+extern void isr241(void);
+extern void isr255(void);
+
 // Default exception names for logging
 static const char *exception_names[] = {
     "Divide By Zero",
@@ -178,6 +194,17 @@ static void idt_initialize_gates(void) {
     idt_set_gate(45, (uint64_t)irq13, 0x08, 0, 0x8E);
     idt_set_gate(46, (uint64_t)irq14, 0x08, 0, 0x8E);
     idt_set_gate(47, (uint64_t)irq15, 0x08, 0, 0x8E);
+
+    // Runtime vectors, unused ones only ever see the EOI
+    for (int i = 0; i < IDT_DYNAMIC_COUNT; i++) {
+        idt_set_gate(IDT_DYNAMIC_BASE + i, idt_dynamic_stubs[i], 0x08, 0, 0x8E);
+    }
+
+    // Local APIC vectors, their handlers send the EOI themselves
+    idt_set_gate(239, (uint64_t)isr239, 0x08, 0, 0x8E);
+    idt_set_gate(240, (uint64_t)isr240, 0x08, 0, 0x8E);
+    idt_set_gate(241, (uint64_t)isr241, 0x08, 0, 0x8E);
+    idt_set_gate(255, (uint64_t)isr255, 0x08, 0, 0x8E);
 }
 
 // Initialize the IDT
@@ -264,8 +291,72 @@ void idt_register_handler(uint8_t vector, interrupt_handler_t handler) {
     }
 }
 
+// Claim a free runtime vector for handler, -1 when all are taken. The EOI is sent for
+// the handler.
+int idt_alloc_vector(interrupt_handler_t handler) {
+    if (!handler) {
+        return -1;
+    }
+
+    int vector = -1;
+    spinlock_acquire(&vector_lock);
+    for (int i = IDT_DYNAMIC_BASE; i < IDT_DYNAMIC_BASE + IDT_DYNAMIC_COUNT; i++) {
+        if (!interrupt_handlers[i]) {
+            interrupt_handlers[i] = handler;
+            vector = i;
+            break;
+        }
+    }
+    spinlock_release(&vector_lock);
+
+    if (vector < 0) {
+        LOG_WARN_MSG("IDT: out of runtime vectors");
+    }
+    return vector;
+}
+
+// Give a runtime vector back, its source must no longer fire
+void idt_free_vector(uint8_t vector) {
+    if (vector < IDT_DYNAMIC_BASE || vector >= IDT_DYNAMIC_BASE + IDT_DYNAMIC_COUNT) {
+        return;
+    }
+
+    spinlock_acquire(&vector_lock);
+    interrupt_handlers[vector] = NULL;
+    spinlock_release(&vector_lock);
+}
+
+// Mask a legacy IRQ line
+void irq_mask(uint8_t irq) {
+    if (ioapic_available()) {
+        ioapic_mask(ioapic_isa_gsi(irq));
+    } else {
+        pic_mask_irq(irq);
+    }
+}
+
+// Unmask a legacy IRQ line
+void irq_unmask(uint8_t irq) {
+    if (ioapic_available()) {
+        ioapic_unmask(ioapic_isa_gsi(irq));
+    } else {
+        pic_unmask_irq(irq);
+    }
+}
+
 // The main C interrupt handler
 void interrupt_handler(struct interrupt_frame *frame) {
+    // Time up to here was the interrupted task's in user mode
+    bool from_user = (frame->cs & 3) != 0;
+    if (from_user) {
+        scheduler_acct_enter_kernel();
+    }
+
+    // Exceptions stay untraced, the int3 of a site being patched must not run into it again
+    if (frame->int_no >= 32) {
+        TRACE(TRACE_IRQ_ENTER, frame->int_no, frame->rip);
+    }
+
     // If we have a custom handler registered, call it
     if (interrupt_handlers[frame->int_no] != NULL) {
         interrupt_handlers[frame->int_no](frame);
@@ -293,9 +384,20 @@ void interrupt_handler(struct interrupt_frame *frame) {
         hcf();
     }
     
-    // Send EOI to the PIC for hardware interrupts (32-47)
-    if (frame->int_no >= 32 && frame->int_no < 48) {
-        pic_send_eoi(frame->int_no - 32);
+    // Send EOI for hardware interrupts, ISA lines (32-47) arrive through the I/O APIC or PIC
+    if (frame->int_no >= IRQ0 && frame->int_no <= IRQ15) {
+        if (ioapic_available()) {
+            lapic_eoi();
+        } else {
+            pic_send_eoi(frame->int_no - IRQ0);
+        }
+    } else if (frame->int_no >= IDT_DYNAMIC_BASE &&
+               frame->int_no < IDT_DYNAMIC_BASE + IDT_DYNAMIC_COUNT) {
+        lapic_eoi();
+    }
+
+    if (from_user) {
+        scheduler_acct_exit_kernel();
     }
 }
 
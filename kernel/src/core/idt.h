@@ -85,6 +85,10 @@ struct idt_ptr {
 #define IRQ_PRIMARY_ATA        IRQ14
 #define IRQ_SECONDARY_ATA      IRQ15
 
+// Vectors handed out at runtime to MSIs and routed inputs, below the local APIC's own
+#define IDT_DYNAMIC_BASE       0x30
+#define IDT_DYNAMIC_COUNT      176
+
 // Register structure passed to handlers
 struct interrupt_frame {
     uint64_t r15;
@@ -127,6 +131,17 @@ void idt_register_handler(uint8_t vector, interrupt_handler_t handler);
 // Function to register an ISR handler
 bool idt_set_gate(uint8_t num, uint64_t base, uint16_t selector, uint8_t ist, uint8_t type_attr);
 
+// Claim a free runtime vector for handler, -1 when all are taken. The EOI is sent for
+// the handler.
+int idt_alloc_vector(interrupt_handler_t handler);
+
+// Give a runtime vector back, its source must no longer fire
+void idt_free_vector(uint8_t vector);
+
+// Mask or unmask a legacy IRQ line, at the I/O APIC when there is one and the PIC otherwise
+void irq_mask(uint8_t irq);
+void irq_unmask(uint8_t irq);
+
 // Hardware interrupt control
 void interrupt_enable(void);
 void interrupt_disable(void);
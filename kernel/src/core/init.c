@@ -0,0 +1,123 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_KERNEL
+
+#include <core/init.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
+#include <drivers/timer/timer.h>
+#include <utils/log.h>
+
+static init_stage_t stages[INIT_MAX_STAGES];
+static uint32_t stage_count = 0;
+static uint32_t done_mask = 0;         // Stages finished, set by whichever CPU ran them
+static uint64_t run_start_ns = 0;
+static uint64_t run_end_ns = 0;
+
+// Register a stage after the ones it depends on, which also keeps the graph acyclic
+int init_add(const char *name, init_fn_t fn, uint32_t deps, uint32_t flags) {
+    if (!name || !fn || stage_count >= INIT_MAX_STAGES) {
+        LOG_ERROR("Init: cannot add stage %s", name ? name : "(null)");
+        return -1;
+    }
+
+    if (deps & ~(INIT_DEP(stage_count) - 1)) {
+        LOG_ERROR("Init: stage %s depends on a stage added after it", name);
+        return -1;
+    }
+
+    init_stage_t *stage = &stages[stage_count];
+    stage->name = name;
+    stage->fn = fn;
+    stage->deps = deps;
+    stage->flags = flags;
+    return (int)stage_count++;
+}
+
+static void run_stage(init_stage_t *stage) {
+    stage->cpu = cpu_current_id();
+    stage->start_ns = timer_get_uptime_ns();
+    stage->ok = stage->fn();
+    stage->end_ns = timer_get_uptime_ns();
+    __atomic_fetch_or(&done_mask, INIT_DEP(stage - stages), __ATOMIC_RELEASE);
+}
+
+// Body of an INIT_ASYNC stage's thread, the thread ends when it returns
+static void stage_thread(void *arg) {
+    run_stage(arg);
+}
+
+// Start every stage once its dependencies are done and return when all are
+void init_run(void) {
+    uint32_t all = stage_count == 32 ? ~0U : (1U << stage_count) - 1;
+    uint32_t started = 0;
+    run_start_ns = timer_get_uptime_ns();
+
+    for (;;) {
+        uint32_t done = __atomic_load_n(&done_mask, __ATOMIC_ACQUIRE);
+        if ((done & all) == all) {
+            break;
+        }
+
+        bool progress = false;
+        for (uint32_t i = 0; i < stage_count; i++) {
+            init_stage_t *stage = &stages[i];
+            if ((started & INIT_DEP(i)) || (stage->deps & done) != stage->deps) {
+                continue;
+            }
+
+            started |= INIT_DEP(i);
+            progress = true;
+            if ((stage->flags & INIT_ASYNC) &&
+                scheduler_create_kthread(stage->name, stage_thread, stage, TASK_PRIORITY_HIGH)) {
+                continue;
+            }
+            run_stage(stage);       // Synchronous, or no thread could be made for it
+        }
+
+        // Run stage threads queued here, the other CPUs steal the rest
+        if (!progress) {
+            scheduler_yield();
+            __asm__ volatile("pause");
+        }
+    }
+
+    run_end_ns = timer_get_uptime_ns();
+}
+
+// Get boot timing
+void init_get_stats(init_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->stages = stage_count;
+    stats->failed = 0;
+    stats->cpus = 0;
+    stats->serial_ns = run_start_ns;
+    stats->wall_ns = run_end_ns - run_start_ns;
+    stats->work_ns = 0;
+
+    uint32_t cpus = 0;
+    for (uint32_t i = 0; i < stage_count; i++) {
+        stats->work_ns += stages[i].end_ns - stages[i].start_ns;
+        if (!stages[i].ok) stats->failed++;
+        if (stages[i].cpu < 32) cpus |= 1U << stages[i].cpu;
+    }
+    stats->cpus = __builtin_popcount(cpus);
+}
+
+// Print the time every stage took
+void init_print_report(void) {
+    init_stats_t stats;
+    init_get_stats(&stats);
+
+    LOG_INFO("Boot: serial setup %u ms, %u stages on %u CPUs in %u ms (%u ms run one after another), %u not up",
+             (uint32_t)(stats.serial_ns / 1000000), stats.stages, stats.cpus,
+             (uint32_t)(stats.wall_ns / 1000000), (uint32_t)(stats.work_ns / 1000000), stats.failed);
+    for (uint32_t i = 0; i < stage_count; i++) {
+        init_stage_t *stage = &stages[i];
+        LOG_INFO("  %s: +%u us, took %u us on CPU %u%s", stage->name,
+                 (uint32_t)((stage->start_ns - run_start_ns) / 1000),
+                 (uint32_t)((stage->end_ns - stage->start_ns) / 1000),
+                 stage->cpu, stage->ok ? "" : ", not up");
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef INIT_H
+#define INIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Stages one boot can register, dependencies are a bit mask of their ids
+#define INIT_MAX_STAGES     32
+#define INIT_DEP(id)        (1U << (id))
+
+// Stage flags
+#define INIT_ASYNC          0x1     // Runs in a kernel thread on whichever CPU is free
+
+// Stage body, false when the subsystem did not come up, a missing device included
+// The subsystem logs why, the report only marks it
+typedef bool (*init_fn_t)(void);
+
+// One step of the boot and how it went
+typedef struct {
+    const char *name;
+    init_fn_t fn;
+    uint32_t deps;                     // Stages that must finish first
+    uint32_t flags;
+    uint32_t cpu;                      // CPU it ran on
+    bool ok;
+    uint64_t start_ns;                 // Uptime at start and end
+    uint64_t end_ns;
+} init_stage_t;
+
+// Boot timing
+typedef struct {
+    uint32_t stages;
+    uint32_t failed;                   // Stages that did not come up
+    uint32_t cpus;                     // CPUs that ran a stage
+    uint64_t serial_ns;                // Uptime when the staged part started
+    uint64_t wall_ns;                  // Time from the first stage to the last one finishing
+    uint64_t work_ns;                  // Sum of the stage times, the wall time run serially
+} init_stats_t;
+
+// Register a stage after the ones it depends on, returns its id or -1
+int init_add(const char *name, init_fn_t fn, uint32_t deps, uint32_t flags);
+
+// Start every stage once its dependencies are done and return when all are. Synchronous
+// stages run on the calling CPU, which must not sleep, so stages that may are INIT_ASYNC.
+void init_run(void);
+
+// Get boot timing
+void init_get_stats(init_stats_t *stats);
+
+// Print the time every stage took
+void init_print_report(void);
+
+#endif // INIT_H
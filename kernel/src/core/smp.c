@@ -0,0 +1,331 @@
+#include <core/smp.h>
+#include <core/gdt.h>
+#include <core/idt.h>
+#include <core/fpu.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/syscalls.h>
+#include <drivers/apic/lapic.h>
+#include <drivers/timer/timer.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <utils/log.h>
+#include <lib/string.h>
+#include <lib/asm.h>
+#include <limine.h>
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0,
+    .flags = 0
+};
+
+// Per-CPU areas, indexed by the kernel's CPU number (not the LAPIC ID)
+static cpu_local_t cpus[MAX_CPUS];
+
+// SMP state
+static volatile uint32_t cpus_online = 0;
+static uint32_t cpus_reported = 1;
+static uint32_t bsp_lapic_id = 0;
+static bool x2apic = false;
+static uint64_t stat_resched_ipis = 0;
+static uint64_t stat_sync_ipis = 0;
+
+// Last sync round each CPU answered, the caller waits for all of them to reach its round
+static volatile uint64_t sync_acks[MAX_CPUS];
+
+// Function the sync IPI runs before answering, one caller at a time
+static spinlock_t sync_lock;
+static smp_call_t sync_call = NULL;
+static volatile uint64_t sync_round = 0;
+
+// Make a per-CPU area the GS base of the executing CPU
+static void set_local(uint32_t id) {
+    cpu_local_t *local = &cpus[id];
+    local->self = local;
+    local->id = id;
+
+    // Kernel mode runs on the per-CPU GS base, swapgs trades it for the user one
+    cpu_write_msr(MSR_GS_BASE, (uint64_t)local);
+    cpu_write_msr(MSR_KERNEL_GS_BASE, 0);
+}
+
+// Give a CPU its kernel stack
+static bool alloc_kernel_stack(cpu_local_t *local) {
+    void *phys = pmm_alloc_pages(SMP_KERNEL_STACK_PAGES);
+    if (!phys) {
+        return false;
+    }
+
+    local->kernel_stack = (uint64_t)vmm_phys_to_virt((uint64_t)phys) +
+                          SMP_KERNEL_STACK_PAGES * PAGE_SIZE_4K;
+    return true;
+}
+
+// Per-CPU bring-up on an application processor, runs on the kernel stack
+static void ap_main(struct limine_smp_info *info) {
+    uint32_t id = (uint32_t)info->extra_argument;
+
+    // Own GDT and TSS, the shared IDT, then everything that lives in per-CPU registers
+    gdt_init_cpu(id);
+    set_local(id);
+    cpus[id].lapic_id = info->lapic_id;
+    idt_reload();
+    vmm_init_cpu();
+    fpu_init_cpu();
+    syscalls_init_cpu();
+    gdt_set_kernel_stack(cpus[id].kernel_stack);
+
+    if (!scheduler_init_cpu()) {
+        LOG_ERROR("SMP: CPU %u could not join the scheduler", id);
+        hcf();
+    }
+
+    // Local APIC and per-CPU clockevent, ticks call into the scheduler from here on
+    if (!timer_init_cpu()) {
+        LOG_WARN("SMP: CPU %u has no local timer, it runs without preemption", id);
+    }
+
+    cpus[id].online = true;
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+    LOG_INFO("SMP: CPU %u (LAPIC %u) online", id, info->lapic_id);
+
+    __asm__ volatile("sti");
+    scheduler_idle();
+}
+
+// Limine entry point of an application processor
+static void ap_entry(struct limine_smp_info *info) {
+    // The bootloader's stack lives in reclaimable memory, leave it before anything else
+    uint64_t stack = cpus[(uint32_t)info->extra_argument].kernel_stack;
+    __asm__ volatile("mov %0, %%rsp\n"
+                     "xor %%ebp, %%ebp\n"
+                     "call *%1\n"
+                     : : "r"(stack), "r"(ap_main), "D"(info) : "memory");
+    hcf();
+}
+
+// Run the call of the round in progress unless this CPU already answered it, false if
+// there was nothing to answer. A round is answered once even if its IPI arrives late.
+static bool sync_answer(void) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    uint64_t round = __atomic_load_n(&sync_round, __ATOMIC_ACQUIRE);
+    bool answered = sync_acks[cpu] != round;
+    if (answered) {
+        smp_call_t fn = __atomic_load_n(&sync_call, __ATOMIC_ACQUIRE);
+        if (fn) {
+            fn();
+        }
+        __atomic_store_n(&sync_acks[cpu], round, __ATOMIC_RELEASE);
+    }
+    cpu_irq_restore(flags);
+    return answered;
+}
+
+// Taking the interrupt serializes the CPU, so it refetches code changed before the IPI
+static void sync_handler(struct interrupt_frame *frame) {
+    (void)frame;
+    sync_answer();
+    lapic_eoi();
+}
+
+// Answer the round in progress as the sync IPI would, for a CPU spinning with interrupts off
+void smp_poll_calls(void) {
+    if (sync_answer()) {
+        uint32_t eax, ebx, ecx, edx;
+        cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    }
+}
+
+// Take sync_lock. A caller with interrupts off cannot take the IPI of the CPU holding
+// it, so it answers that CPU's round while it waits instead.
+static void sync_lock_acquire(void) {
+    while (!spinlock_try_acquire(&sync_lock)) {
+        smp_poll_calls();
+        __asm__ volatile("pause");
+    }
+}
+
+// Point GS at the BSP's per-CPU area
+void smp_init_bsp(void) {
+    set_local(0);
+}
+
+// Start every application processor the bootloader found
+bool smp_init(void) {
+    LOG_INFO("Initializing SMP");
+
+    // The BSP needs a kernel stack for syscalls as well
+    if (!alloc_kernel_stack(&cpus[0])) {
+        LOG_ERROR("SMP: failed to allocate the BSP kernel stack");
+        return false;
+    }
+    gdt_set_kernel_stack(cpus[0].kernel_stack);
+    cpus[0].online = true;
+    cpus_online = 1;
+    spinlock_init(&sync_lock);
+    idt_register_handler(LAPIC_SYNC_VECTOR, sync_handler);
+
+    struct limine_smp_response *response = smp_request.response;
+    if (!response) {
+        LOG_WARN("SMP: no response from the bootloader, running on the BSP only");
+        return false;
+    }
+
+    bsp_lapic_id = response->bsp_lapic_id;
+    cpus[0].lapic_id = bsp_lapic_id;
+    x2apic = (response->flags & LIMINE_SMP_X2APIC) != 0;
+    cpus_reported = (uint32_t)response->cpu_count;
+
+    uint32_t next_id = 1;
+    for (uint64_t i = 0; i < response->cpu_count; i++) {
+        struct limine_smp_info *info = response->cpus[i];
+        if (info->lapic_id == bsp_lapic_id) {
+            continue;
+        }
+
+        if (next_id >= MAX_CPUS) {
+            LOG_WARN("SMP: only %u CPUs supported, ignoring the rest", MAX_CPUS);
+            break;
+        }
+
+        if (!alloc_kernel_stack(&cpus[next_id])) {
+            LOG_ERROR("SMP: no memory for the stack of CPU %u", next_id);
+            break;
+        }
+
+        // APs come up one at a time so their per-CPU setup never interleaves
+        uint32_t expected = cpus_online + 1;
+        info->extra_argument = next_id;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+
+        uint64_t spins = 0;
+        while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < expected &&
+               spins < SMP_AP_TIMEOUT_SPINS) {
+            __asm__ volatile("pause");
+            spins++;
+        }
+        if (spins == SMP_AP_TIMEOUT_SPINS) {
+            LOG_ERROR("SMP: CPU %u (LAPIC %u) did not start", next_id, info->lapic_id);
+        }
+
+        // A late AP still owns its index
+        next_id++;
+    }
+
+    LOG_INFO("SMP: %u of %u CPUs online%s", cpus_online, cpus_reported,
+             x2apic ? " (x2APIC)" : "");
+    return true;
+}
+
+// Number of CPUs running the scheduler
+uint32_t smp_cpu_count(void) {
+    return cpus_online;
+}
+
+// Per-CPU area of a CPU
+cpu_local_t *smp_cpu(uint32_t id) {
+    if (id >= MAX_CPUS) {
+        return NULL;
+    }
+    return &cpus[id];
+}
+
+// Wake a CPU so it looks at its run queue again
+void smp_send_resched(uint32_t id) {
+    if (id >= MAX_CPUS || !cpus[id].online || id == cpu_current_id()) {
+        return;
+    }
+
+    lapic_send_ipi(cpus[id].lapic_id, LAPIC_RESCHED_VECTOR);
+    stat_resched_ipis++;
+}
+
+// Send every other online CPU a sync IPI and wait until each one answered it
+static bool sync_others(void) {
+    uint32_t self = cpu_current_id();
+    uint64_t round = __atomic_add_fetch(&sync_round, 1, __ATOMIC_ACQ_REL);
+    bool ok = true;
+
+    // The caller takes no part in its own round
+    __atomic_store_n(&sync_acks[self], round, __ATOMIC_RELEASE);
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        if (id == self || !cpus[id].online) continue;
+        lapic_send_ipi(cpus[id].lapic_id, LAPIC_SYNC_VECTOR);
+        stat_sync_ipis++;
+    }
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        if (id == self || !cpus[id].online) continue;
+        uint64_t spins = 0;
+        while (__atomic_load_n(&sync_acks[id], __ATOMIC_ACQUIRE) < round &&
+               spins < SMP_AP_TIMEOUT_SPINS) {
+            __asm__ volatile("pause");
+            spins++;
+        }
+        if (spins == SMP_AP_TIMEOUT_SPINS) {
+            LOG_ERROR("SMP: CPU %u did not answer a sync IPI", id);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// Make every other online CPU run a serializing instruction, false if one did not answer.
+// The caller must not hold a lock another CPU spins on with interrupts off.
+bool smp_sync_cores(void) {
+    sync_lock_acquire();
+    bool ok = sync_others();
+    spinlock_release(&sync_lock);
+
+    // The executing CPU serializes itself
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    return ok;
+}
+
+// Run fn on every online CPU with interrupts off and wait for all of them, false if a
+// CPU did not answer. The same locking rule as for smp_sync_cores applies.
+bool smp_call_all(smp_call_t fn) {
+    sync_lock_acquire();
+    __atomic_store_n(&sync_call, fn, __ATOMIC_RELEASE);
+    bool ok = sync_others();
+    __atomic_store_n(&sync_call, NULL, __ATOMIC_RELEASE);
+
+    uint64_t flags = cpu_irq_save();
+    fn();
+    cpu_irq_restore(flags);
+
+    spinlock_release(&sync_lock);
+    return ok;
+}
+
+// Get SMP statistics
+void smp_get_stats(smp_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->cpus_reported = cpus_reported;
+    stats->cpus_online = cpus_online;
+    stats->bsp_lapic_id = bsp_lapic_id;
+    stats->x2apic = x2apic;
+    stats->resched_ipis = stat_resched_ipis;
+    stats->sync_ipis = stat_sync_ipis;
+}
+
+// Print SMP statistics
+void smp_print_stats(void) {
+    LOG_INFO("SMP Statistics:");
+    LOG_INFO("  CPUs online: %u of %u, BSP LAPIC ID: %u%s", cpus_online, cpus_reported,
+             bsp_lapic_id, x2apic ? ", x2APIC" : "");
+    LOG_INFO("  Reschedule IPIs: %u, sync IPIs: %u", (uint32_t)stat_resched_ipis, (uint32_t)stat_sync_ipis);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].online) {
+            LOG_INFO("  CPU %u: LAPIC %u", i, cpus[i].lapic_id);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/cpu.h>
+
+// Kernel stack of every CPU, used for syscalls and ring 0 entry through the TSS
+#define SMP_KERNEL_STACK_PAGES  4
+
+// Spins the BSP waits for an application processor to report in
+#define SMP_AP_TIMEOUT_SPINS    100000000
+
+// Function smp_call_all runs on every CPU
+typedef void (*smp_call_t)(void);
+
+// SMP statistics
+typedef struct {
+    uint32_t cpus_reported;            // CPUs the bootloader found
+    uint32_t cpus_online;              // CPUs running the scheduler
+    uint32_t bsp_lapic_id;
+    bool x2apic;                       // Bootloader switched the local APICs to x2APIC mode
+    uint64_t resched_ipis;             // Idle CPUs woken for new work
+    uint64_t sync_ipis;                // CPUs serialized after code changes
+} smp_stats_t;
+
+// Point GS at the BSP's per-CPU area, must run right after gdt_init
+void smp_init_bsp(void);
+
+// Start every application processor the bootloader found
+bool smp_init(void);
+
+// Number of CPUs running the scheduler
+uint32_t smp_cpu_count(void);
+
+// Per-CPU area of a CPU, NULL if the index is out of range
+cpu_local_t *smp_cpu(uint32_t id);
+
+// Wake a CPU so it looks at its run queue again
+void smp_send_resched(uint32_t id);
+
+// Make every other online CPU run a serializing instruction, false if one did not answer
+bool smp_sync_cores(void);
+
+// Run fn on every online CPU with interrupts off and wait for all of them
+bool smp_call_all(smp_call_t fn);
+
+// Answer another CPU's smp_call_all or smp_sync_cores, for loops that spin on a lock with
+// interrupts off while the CPU holding it may be waiting for them
+void smp_poll_calls(void);
+
+// Get SMP statistics
+void smp_get_stats(smp_stats_t *stats);
+
+// Print SMP statistics
+void smp_print_stats(void);
+
+#endif // SMP_H
@@ -0,0 +1,105 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/acpi/acpi.h>
+#include <memory/vmm.h>
+#include <lib/string.h>
+#include <utils/log.h>
+#include <limine.h>
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0
+};
+
+static const acpi_sdt_header_t *root = NULL;   // XSDT, or the RSDT before ACPI 2.0
+static bool extended = false;                   // Root entries are 64-bit
+
+// Sum of a table's bytes, 0 for a valid one
+static uint8_t checksum(const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+// Map length bytes at phys, which need not be page aligned
+static const void *map(uint64_t phys, size_t length) {
+    uint64_t page = phys & ~(uint64_t)(PAGE_SIZE_4K - 1);
+    uint8_t *virt = vmm_map_physical(page, length + (phys - page), VMM_FLAG_PRESENT);
+    return virt ? virt + (phys - page) : NULL;
+}
+
+// Map a whole table, its header tells the length
+static const acpi_sdt_header_t *map_table(uint64_t phys) {
+    const acpi_sdt_header_t *header = map(phys, sizeof(acpi_sdt_header_t));
+    if (!header || header->length < sizeof(acpi_sdt_header_t)) {
+        return NULL;
+    }
+    return map(phys, header->length);
+}
+
+// Find the tables the bootloader's RSDP points at
+bool acpi_init(void) {
+    struct limine_rsdp_response *response = rsdp_request.response;
+    if (!response || !response->address) {
+        LOG_WARN("ACPI: the bootloader passed no RSDP");
+        return false;
+    }
+
+    // Base revision 3 hands over the physical address
+    const acpi_rsdp_t *rsdp = map((uint64_t)response->address, sizeof(acpi_rsdp_t));
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || checksum(rsdp, 20) != 0) {
+        LOG_ERROR("ACPI: invalid RSDP");
+        return false;
+    }
+
+    extended = rsdp->revision >= 2 && rsdp->xsdt_address;
+    root = map_table(extended ? rsdp->xsdt_address : rsdp->rsdt_address);
+    if (!root || checksum(root, root->length) != 0) {
+        LOG_ERROR("ACPI: invalid %s", extended ? "XSDT" : "RSDT");
+        root = NULL;
+        return false;
+    }
+
+    char oem[7];
+    memcpy(oem, rsdp->oem_id, 6);
+    oem[6] = '\0';
+    LOG_INFO("ACPI: revision %u, %s with %u tables, OEM %s", rsdp->revision,
+             extended ? "XSDT" : "RSDT",
+             (root->length - (uint32_t)sizeof(acpi_sdt_header_t)) / (extended ? 8 : 4), oem);
+    return true;
+}
+
+// Check if the ACPI tables were found
+bool acpi_available(void) {
+    return root != NULL;
+}
+
+// Map the first table with the signature, NULL when there is none or its checksum is bad
+const acpi_sdt_header_t *acpi_find_table(const char *signature) {
+    if (!root) {
+        return NULL;
+    }
+
+    const uint8_t *entries = (const uint8_t *)root + sizeof(acpi_sdt_header_t);
+    size_t width = extended ? 8 : 4;
+    size_t count = (root->length - sizeof(acpi_sdt_header_t)) / width;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * width, width);
+
+        const acpi_sdt_header_t *table = map_table(phys);
+        if (!table || memcmp(table->signature, signature, 4) != 0) continue;
+
+        if (checksum(table, table->length) != 0) {
+            LOG_WARN("ACPI: table %s has a bad checksum", signature);
+            return NULL;
+        }
+        return table;
+    }
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Root System Description Pointer
+typedef struct {
+    char signature[8];              // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;               // 0 for ACPI 1.0, the fields below start with 2
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// Header every system description table starts with
+typedef struct {
+    char signature[4];
+    uint32_t length;                // Bytes including the header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// Find the tables the bootloader's RSDP points at
+bool acpi_init(void);
+
+// Check if the ACPI tables were found
+bool acpi_available(void);
+
+// Map the first table with the signature, NULL when there is none or its checksum is bad
+const acpi_sdt_header_t *acpi_find_table(const char *signature);
+
+#endif // ACPI_H
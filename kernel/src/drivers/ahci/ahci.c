@@ -0,0 +1,670 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/ahci/ahci.h>
+#include <drivers/block/block.h>
+#include <drivers/pci/pci.h>
+#include <drivers/apic/lapic.h>
+#include <drivers/apic/ioapic.h>
+#include <drivers/timer/timer.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <core/idt.h>
+#include <core/exec/wait.h>
+#include <lib/string.h>
+#include <lib/stdio.h>
+#include <utils/log.h>
+
+// ATA commands used over AHCI
+#define ATA_CMD_READ_DMA            0xC8
+#define ATA_CMD_WRITE_DMA           0xCA
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
+#define ATA_CMD_FLUSH_CACHE         0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+#define ATA_CMD_IDENTIFY            0xEC
+
+// Task file status bits (PxTFD)
+#define ATA_STATUS_ERR              0x01
+#define ATA_STATUS_DRQ              0x08
+#define ATA_STATUS_BSY              0x80
+
+#define FIS_TYPE_REG_H2D            0x27
+#define SATA_SIG_ATA                0x00000101
+#define AHCI_PRD_MAX_BYTES          0x400000    // 4MB per PRD
+#define AHCI_CMD_TABLES_PAGES       ((AHCI_MAX_SLOTS * sizeof(ahci_cmd_table_t) + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE)
+#define AHCI_DMA_LIMIT              0x100000000ULL
+
+// Per-port state
+typedef struct {
+    ahci_port_regs_t *regs;
+    uint8_t index;
+    ahci_cmd_header_t *cmd_list;        // 32 headers, followed by the received FIS area
+    uint64_t cmd_list_phys;
+    ahci_cmd_table_t *tables;           // One table per slot
+    uint64_t tables_phys;
+    uint64_t size;                      // Capacity in sectors
+    bool lba48;
+    bool ncq;
+    uint32_t depth;                     // Commands kept in flight
+    volatile uint32_t irq_status;       // PxIS bits collected by the interrupt handler
+    wait_queue_t wait;                  // Synchronous command waiters, woken by the interrupt handler
+    char model[41];
+
+    // Block layer batch driven by the interrupt handler
+    block_device_t *blockdev;
+    const block_command_t *batch;       // NULL when no batch is running
+    size_t batch_count;
+    size_t batch_next;                  // Next command to issue
+    size_t batch_done;
+    uint32_t pending;                   // Slots in flight
+    uint8_t batch_command;
+    uint64_t deadline;                  // Reset whenever a slot finishes
+} ahci_port_t;
+
+// Controller state
+static ahci_hba_t *hba = NULL;
+static uint32_t slot_count = 0;
+static bool addr64 = false;
+static bool irq_enabled = false;
+static ahci_port_t ports[AHCI_MAX_PORTS];
+static int port_count = 0;
+
+// Wait until (reg & mask) == value
+static bool ahci_wait_reg(volatile uint32_t *reg, uint32_t mask, uint32_t value, uint32_t timeout_ms) {
+    uint64_t deadline = timer_get_uptime_ms() + timeout_ms;
+    while ((*reg & mask) != value) {
+        if (timer_get_uptime_ms() > deadline) {
+            return false;
+        }
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+// Stop command processing and FIS reception on a port
+static bool ahci_stop_port(ahci_port_t *port) {
+    port->regs->cmd &= ~AHCI_PORT_CMD_ST;
+    if (!ahci_wait_reg(&port->regs->cmd, AHCI_PORT_CMD_CR, 0, 500)) {
+        return false;
+    }
+
+    port->regs->cmd &= ~AHCI_PORT_CMD_FRE;
+    return ahci_wait_reg(&port->regs->cmd, AHCI_PORT_CMD_FR, 0, 500);
+}
+
+// Start FIS reception and command processing on a port
+static void ahci_start_port(ahci_port_t *port) {
+    ahci_wait_reg(&port->regs->cmd, AHCI_PORT_CMD_CR, 0, 500);
+    port->regs->cmd |= AHCI_PORT_CMD_FRE;
+    port->regs->cmd |= AHCI_PORT_CMD_ST;
+}
+
+// Bring a port back after a failed command
+static void ahci_recover_port(ahci_port_t *port) {
+    ahci_stop_port(port);
+
+    // Clear a device stuck busy with a command list override
+    if (port->regs->tfd & (ATA_STATUS_BSY | ATA_STATUS_DRQ)) {
+        port->regs->cmd |= AHCI_PORT_CMD_CLO;
+        ahci_wait_reg(&port->regs->cmd, AHCI_PORT_CMD_CLO, 0, 500);
+    }
+
+    port->regs->serr = 0xFFFFFFFF;
+    port->regs->is = 0xFFFFFFFF;
+    ahci_start_port(port);
+}
+
+// Check if a physical range is usable by the HBA
+static bool ahci_dma_ok(uint64_t phys, size_t size) {
+    return phys != 0 && (addr64 || phys + size <= AHCI_DMA_LIMIT);
+}
+
+// Allocate the command list, FIS area and command tables of a port
+static bool ahci_alloc_port_memory(ahci_port_t *port) {
+    // Command list (1K) and received FIS area (256 bytes) share a page
+    void *list = pmm_alloc_page();
+    if (!list || !ahci_dma_ok((uint64_t)list, PMM_BLOCK_SIZE)) {
+        if (list) pmm_free_page(list);
+        return false;
+    }
+
+    void *tables = pmm_alloc_pages(AHCI_CMD_TABLES_PAGES);
+    if (!tables || !ahci_dma_ok((uint64_t)tables, AHCI_CMD_TABLES_PAGES * PMM_BLOCK_SIZE)) {
+        if (tables) pmm_free_pages(tables, AHCI_CMD_TABLES_PAGES);
+        pmm_free_page(list);
+        return false;
+    }
+
+    port->cmd_list_phys = (uint64_t)list;
+    port->cmd_list = vmm_phys_to_virt(port->cmd_list_phys);
+    port->tables_phys = (uint64_t)tables;
+    port->tables = vmm_phys_to_virt(port->tables_phys);
+    memset(port->cmd_list, 0, PMM_BLOCK_SIZE);
+    memset(port->tables, 0, AHCI_CMD_TABLES_PAGES * PMM_BLOCK_SIZE);
+
+    uint64_t fis_phys = port->cmd_list_phys + AHCI_MAX_SLOTS * sizeof(ahci_cmd_header_t);
+    port->regs->clb = (uint32_t)port->cmd_list_phys;
+    port->regs->clbu = (uint32_t)(port->cmd_list_phys >> 32);
+    port->regs->fb = (uint32_t)fis_phys;
+    port->regs->fbu = (uint32_t)(fis_phys >> 32);
+
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        uint64_t table_phys = port->tables_phys + slot * sizeof(ahci_cmd_table_t);
+        port->cmd_list[slot].ctba = (uint32_t)table_phys;
+        port->cmd_list[slot].ctbau = (uint32_t)(table_phys >> 32);
+    }
+
+    return true;
+}
+
+// Fill a slot's PRD table from a segment list, returns the entry count or 0
+static uint16_t ahci_build_prdt(ahci_cmd_table_t *table, const block_segment_t *segments, size_t segment_count) {
+    uint16_t entries = 0;
+
+    for (size_t i = 0; i < segment_count; i++) {
+        uint8_t *virt = segments[i].buffer;
+        size_t bytes = (size_t)segments[i].sectors * BLOCK_SECTOR_SIZE;
+
+        // Data buffers must be word aligned
+        if ((uint64_t)virt & 1) {
+            return 0;
+        }
+
+        // Translate page by page, buffers need not be physically contiguous
+        while (bytes > 0) {
+            uint32_t chunk = PMM_BLOCK_SIZE - ((uint64_t)virt & (PMM_BLOCK_SIZE - 1));
+            if (chunk > bytes) chunk = bytes;
+
+            uint64_t phys = vmm_virt_to_phys(virt);
+            if (!ahci_dma_ok(phys, chunk)) {
+                return 0;
+            }
+
+            // Extend the previous entry when memory is physically contiguous
+            ahci_prd_t *last = entries > 0 ? &table->prdt[entries - 1] : NULL;
+            uint32_t last_bytes = last ? (last->dbc & 0x3FFFFF) + 1 : 0;
+            uint64_t last_end = last ? (((uint64_t)last->dbau << 32) | last->dba) + last_bytes : 0;
+
+            if (last && last_end == phys && last_bytes + chunk <= AHCI_PRD_MAX_BYTES) {
+                last->dbc = last_bytes + chunk - 1;
+            } else {
+                if (entries >= AHCI_PRDT_ENTRIES) {
+                    return 0;
+                }
+                table->prdt[entries].dba = (uint32_t)phys;
+                table->prdt[entries].dbau = (uint32_t)(phys >> 32);
+                table->prdt[entries].reserved = 0;
+                table->prdt[entries].dbc = chunk - 1;
+                entries++;
+            }
+
+            virt += chunk;
+            bytes -= chunk;
+        }
+    }
+
+    return entries;
+}
+
+// Fill a slot's command header and FIS
+static void ahci_setup_command(ahci_port_t *port, uint32_t slot, uint8_t command,
+                               uint64_t lba, uint32_t count, bool write, uint16_t prd_entries) {
+    ahci_cmd_header_t *header = &port->cmd_list[slot];
+    ahci_fis_h2d_t *fis = (ahci_fis_h2d_t*)port->tables[slot].cfis;
+
+    memset(fis, 0, sizeof(ahci_fis_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = 0x80;
+    fis->command = command;
+    fis->device = 0x40;
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        // Queued commands carry the count in the features field and the tag in the count field
+        fis->feature_low = (uint8_t)count;
+        fis->feature_high = (uint8_t)(count >> 8);
+        fis->count_low = (uint8_t)(slot << 3);
+    } else {
+        fis->count_low = (uint8_t)count;
+        fis->count_high = (uint8_t)(count >> 8);
+        if (command == ATA_CMD_IDENTIFY || command == ATA_CMD_FLUSH_CACHE ||
+            command == ATA_CMD_FLUSH_CACHE_EXT) {
+            fis->device = 0;
+        } else if (command == ATA_CMD_READ_DMA || command == ATA_CMD_WRITE_DMA) {
+            fis->device = 0x40 | ((lba >> 24) & 0x0F);
+        }
+    }
+
+    header->flags = (sizeof(ahci_fis_h2d_t) / 4) | (write ? (1 << 6) : 0);
+    header->prdtl = prd_entries;
+    header->prdbc = 0;
+}
+
+// Hand a prepared slot to the HBA
+static void ahci_issue(ahci_port_t *port, uint32_t slot, bool queued) {
+    // Command tables live in normal memory, make sure they are written first
+    __asm__ volatile("" ::: "memory");
+
+    if (queued) {
+        port->regs->sact = 1u << slot;
+    }
+    port->regs->ci = 1u << slot;
+}
+
+// Check a port for a failed command
+static bool ahci_port_failed(ahci_port_t *port) {
+    return ((port->regs->is | port->irq_status) & AHCI_PORT_IS_ERRORS) ||
+           (port->regs->tfd & ATA_STATUS_ERR);
+}
+
+// Slots a synchronous waiter is watching
+typedef struct {
+    ahci_port_t *port;
+    uint32_t mask;
+} ahci_slot_wait_t;
+
+// Wait condition: a watched slot finished or the port failed
+static bool ahci_slots_cond(void *arg) {
+    ahci_slot_wait_t *wait = arg;
+    ahci_port_t *port = wait->port;
+    return ahci_port_failed(port) || (wait->mask & ~(port->regs->ci | port->regs->sact));
+}
+
+// Wait for any of the slots in mask to finish, returns the finished ones or 0 on error
+static uint32_t ahci_wait_slots(ahci_port_t *port, uint32_t mask) {
+    uint64_t deadline = timer_get_uptime_ms() + AHCI_TIMEOUT;
+    ahci_slot_wait_t wait = { port, mask };
+
+    while (true) {
+        // Queued commands stay in SACT after leaving CI until the device finishes them
+        uint32_t done = mask & ~(port->regs->ci | port->regs->sact);
+
+        if (ahci_port_failed(port)) {
+            return 0;
+        }
+        if (done) {
+            return done;
+        }
+        if (timer_get_uptime_ms() > deadline) {
+            return 0;
+        }
+
+        // Sleep until the port interrupt, without one the slots are polled every millisecond
+        wait_event_timeout(&port->wait, ahci_slots_cond, &wait, irq_enabled ? AHCI_POLL_MS : 1);
+    }
+}
+
+// Run one non-queued command in slot 0 and wait for it
+static bool ahci_exec(ahci_port_t *port, uint8_t command, uint64_t lba, uint32_t count,
+                      const block_segment_t *segments, size_t segment_count, bool write) {
+    uint16_t entries = 0;
+    if (segment_count > 0) {
+        entries = ahci_build_prdt(&port->tables[0], segments, segment_count);
+        if (entries == 0) {
+            LOG_ERROR("AHCI port %d: buffer not usable for DMA", port->index);
+            return false;
+        }
+    }
+
+    ahci_setup_command(port, 0, command, lba, count, write, entries);
+    port->regs->is = 0xFFFFFFFF;
+    port->irq_status = 0;
+    ahci_issue(port, 0, false);
+
+    if (!ahci_wait_slots(port, 1)) {
+        LOG_ERROR("AHCI port %d: command 0x%X failed (TFD=0x%X, IS=0x%X)",
+                  port->index, command, port->regs->tfd, port->regs->is);
+        ahci_recover_port(port);
+        return false;
+    }
+
+    return true;
+}
+
+// Issue the batch's next commands into free slots, false if a buffer is not usable for DMA
+static bool ahci_fill_slots(ahci_port_t *port) {
+    uint32_t depth = port->ncq ? port->depth : 1;
+    uint32_t in_flight = (uint32_t)(port->batch_next - port->batch_done);
+    bool write = port->batch_command == ATA_CMD_WRITE_FPDMA_QUEUED ||
+                 port->batch_command == ATA_CMD_WRITE_DMA_EXT ||
+                 port->batch_command == ATA_CMD_WRITE_DMA;
+
+    while (port->batch_next < port->batch_count && in_flight < depth) {
+        // Tags must stay below the queue depth, the lowest free one always is
+        uint32_t slot = 0;
+        while (port->pending & (1u << slot)) {
+            slot++;
+        }
+
+        const block_command_t *cmd = &port->batch[port->batch_next];
+        uint16_t entries = ahci_build_prdt(&port->tables[slot], cmd->segments, cmd->segment_count);
+        if (entries == 0) {
+            LOG_ERROR("AHCI port %d: buffer not usable for DMA", port->index);
+            return false;
+        }
+
+        ahci_setup_command(port, slot, port->batch_command, cmd->sector, cmd->count, write, entries);
+        ahci_issue(port, slot, port->ncq);
+        port->pending |= 1u << slot;
+        port->batch_next++;
+        in_flight++;
+    }
+
+    return true;
+}
+
+// End the port's batch and report it to the block layer
+static void ahci_finish_batch(ahci_port_t *port, bool ok) {
+    if (!ok) {
+        LOG_ERROR("AHCI port %d: batch failed (TFD=0x%X, IS=0x%X, SERR=0x%X)", port->index,
+                  port->regs->tfd, port->regs->is | port->irq_status, port->regs->serr);
+        ahci_recover_port(port);
+    }
+
+    port->batch = NULL;
+    port->pending = 0;
+    block_complete(port->blockdev, ok);
+}
+
+// Retire finished slots and refill them, called from the interrupt handler and the poll hook
+static void ahci_progress(ahci_port_t *port) {
+    if (!port->batch) {
+        return;
+    }
+
+    if (ahci_port_failed(port)) {
+        ahci_finish_batch(port, false);
+        return;
+    }
+
+    // Queued commands stay in SACT after leaving CI until the device finishes them
+    uint32_t finished = port->pending & ~(port->regs->ci | port->regs->sact);
+    if (!finished) {
+        if (timer_get_uptime_ms() > port->deadline) {
+            ahci_finish_batch(port, false);
+        }
+        return;
+    }
+
+    for (uint32_t slot = 0; finished; slot++) {
+        if (finished & (1u << slot)) {
+            finished &= ~(1u << slot);
+            port->pending &= ~(1u << slot);
+            port->batch_done++;
+        }
+    }
+    port->deadline = timer_get_uptime_ms() + AHCI_TIMEOUT;
+
+    if (port->batch_done == port->batch_count) {
+        ahci_finish_batch(port, true);
+    } else if (!ahci_fill_slots(port)) {
+        ahci_finish_batch(port, false);
+    }
+}
+
+// Block layer entry point: put up to depth commands in flight, the interrupt handler refills slots
+static bool ahci_block_start(block_device_t *dev, const block_command_t *commands, size_t count, bool write) {
+    ahci_port_t *port = dev->driver_data;
+
+    if (port->ncq) {
+        port->batch_command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    } else if (port->lba48) {
+        port->batch_command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    } else {
+        port->batch_command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+
+    port->regs->is = 0xFFFFFFFF;
+    port->irq_status = 0;
+    port->batch = commands;
+    port->batch_count = count;
+    port->batch_next = 0;
+    port->batch_done = 0;
+    port->pending = 0;
+    port->deadline = timer_get_uptime_ms() + AHCI_TIMEOUT;
+
+    if (!ahci_fill_slots(port)) {
+        if (port->pending) {
+            // Part of the batch is already in flight, fail it as a whole
+            ahci_finish_batch(port, false);
+            return true;
+        }
+        port->batch = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+// Block layer poll hook, catches missed interrupts and timeouts
+static void ahci_block_poll(block_device_t *dev) {
+    ahci_progress(dev->driver_data);
+}
+
+// Block layer flush hook
+static bool ahci_block_flush(block_device_t *dev) {
+    ahci_port_t *port = dev->driver_data;
+    return ahci_exec(port, port->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE,
+                     0, 0, NULL, 0, false);
+}
+
+// Copy a byte-swapped IDENTIFY string
+static void ahci_copy_string(char *dest, const uint16_t *words, int count) {
+    for (int i = 0; i < count; i++) {
+        dest[i * 2] = (char)(words[i] >> 8);
+        dest[i * 2 + 1] = (char)(words[i] & 0xFF);
+    }
+    dest[count * 2] = '\0';
+
+    for (int i = count * 2 - 1; i >= 0 && dest[i] == ' '; i--) {
+        dest[i] = '\0';
+    }
+}
+
+// Identify the disk on a port and read its size and queuing support
+static bool ahci_identify(ahci_port_t *port) {
+    void *page = pmm_alloc_page();
+    if (!page || !ahci_dma_ok((uint64_t)page, PMM_BLOCK_SIZE)) {
+        if (page) pmm_free_page(page);
+        return false;
+    }
+
+    uint16_t *identify = vmm_phys_to_virt((uint64_t)page);
+    block_segment_t segment = { identify, 1 };
+    bool ok = ahci_exec(port, ATA_CMD_IDENTIFY, 0, 0, &segment, 1, false);
+
+    if (ok) {
+        ahci_copy_string(port->model, &identify[27], 20);
+
+        port->lba48 = (identify[83] & (1 << 10)) != 0;
+        if (port->lba48) {
+            port->size = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+                         ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+        } else {
+            port->size = (uint64_t)identify[60] | ((uint64_t)identify[61] << 16);
+        }
+
+        // Queued commands need HBA and device support, tags are bounded by both
+        port->ncq = (hba->cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8)) && port->lba48;
+        port->depth = port->ncq ? (identify[75] & 0x1F) + 1 : 1;
+        if (port->depth > slot_count) {
+            port->depth = slot_count;
+        }
+    }
+
+    pmm_free_page(page);
+    return ok && port->size > 0;
+}
+
+// Port interrupt: acknowledge, advance queued batches and wake synchronous waiters
+static void ahci_irq_handler(struct interrupt_frame *frame) {
+    (void)frame;
+
+    uint32_t pending = hba->is;
+    for (int i = 0; i < port_count; i++) {
+        if (pending & (1u << ports[i].index)) {
+            // Keep the status for the waiter, the line must drop before EOI
+            uint32_t status = ports[i].regs->is;
+            ports[i].irq_status |= status;
+            ports[i].regs->is = status;
+            ahci_progress(&ports[i]);
+            wait_wake_all(&ports[i].wait);
+        }
+    }
+    hba->is = pending;
+}
+
+// Set up one implemented port, register it if a SATA disk is attached
+static void ahci_probe_port(uint8_t index) {
+    ahci_port_regs_t *regs = &hba->ports[index];
+
+    // Device present (DET=3) and interface active (IPM=1)
+    uint32_t ssts = regs->ssts;
+    if ((ssts & 0x0F) != 3 || ((ssts >> 8) & 0x0F) != 1) {
+        return;
+    }
+
+    if (regs->sig != SATA_SIG_ATA) {
+        LOG_INFO("AHCI port %d: non-disk device (signature 0x%X), skipped", index, regs->sig);
+        return;
+    }
+
+    ahci_port_t *port = &ports[port_count];
+    memset(port, 0, sizeof(ahci_port_t));
+    port->regs = regs;
+    port->index = index;
+    wait_queue_init(&port->wait);
+
+    if (!ahci_stop_port(port)) {
+        LOG_WARN("AHCI port %d: failed to stop command engine", index);
+        return;
+    }
+
+    if (!ahci_alloc_port_memory(port)) {
+        LOG_WARN("AHCI port %d: no DMA memory for the command list", index);
+        return;
+    }
+
+    regs->serr = 0xFFFFFFFF;
+    regs->is = 0xFFFFFFFF;
+    regs->ie = irq_enabled ? 0xFFFFFFFF : 0;
+    ahci_start_port(port);
+
+    if (!ahci_identify(port)) {
+        LOG_WARN("AHCI port %d: IDENTIFY failed", index);
+        ahci_stop_port(port);
+        pmm_free_pages((void*)port->tables_phys, AHCI_CMD_TABLES_PAGES);
+        pmm_free_page((void*)port->cmd_list_phys);
+        return;
+    }
+
+    block_device_t dev;
+    memset(&dev, 0, sizeof(dev));
+    snprintf(dev.name, sizeof(dev.name), "sata%d", index);
+    dev.sectors = port->size;
+    dev.max_sectors = AHCI_MAX_SECTORS;
+    dev.max_segments = AHCI_MAX_SEGMENTS;
+    dev.interrupts = irq_enabled;
+    dev.driver_data = port;
+    dev.start = ahci_block_start;
+    dev.poll = ahci_block_poll;
+    dev.flush = ahci_block_flush;
+
+    port_count++;
+    int drive = block_register_device(&dev);
+    if (drive < 0) {
+        LOG_WARN("AHCI port %d: block device table full", index);
+        return;
+    }
+    port->blockdev = block_get_device(drive);
+}
+
+// Find the AHCI controller and register its SATA disks with the block layer
+bool ahci_init(void) {
+    pci_device_t controller;
+    if (!pci_find_device_by_class(0x01, 0x06, &controller) || controller.prog_if != 0x01) {
+        LOG_INFO_MSG("No AHCI controller found");
+        return false;
+    }
+
+    uint64_t abar = pci_get_bar(&controller, 5);
+    if (abar == 0) {
+        LOG_ERROR_MSG("AHCI controller has no ABAR");
+        return false;
+    }
+
+    // Enable memory space and bus mastering
+    uint32_t command = pci_read_config_dword(controller.bus, controller.device, controller.function, PCI_COMMAND);
+    pci_write_config_dword(controller.bus, controller.device, controller.function, PCI_COMMAND, command | 0x6);
+
+    hba = vmm_map_physical(abar, sizeof(ahci_hba_t), VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!hba) {
+        LOG_ERROR("AHCI: failed to map ABAR at 0x%llx", abar);
+        return false;
+    }
+
+    hba->ghc |= AHCI_GHC_AE;
+
+    uint32_t cap = hba->cap;
+    slot_count = ((cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+    addr64 = (cap & AHCI_CAP_S64A) != 0;
+
+    // The interrupt only wakes waiters early, completion is also polled. An MSI vector of
+    // its own comes first, the INTx line is only known while the PIC routes it.
+    int vector = idt_alloc_vector(ahci_irq_handler);
+    if (vector >= 0 && pci_enable_msi(&controller, (uint8_t)vector, lapic_id())) {
+        irq_enabled = true;
+        LOG_INFO("AHCI: MSI on vector 0x%x", vector);
+    } else {
+        if (vector >= 0) {
+            idt_free_vector((uint8_t)vector);
+        }
+
+        uint8_t line = pci_read_config_dword(controller.bus, controller.device, controller.function,
+                                             PCI_INTERRUPT_LINE) & 0xFF;
+        if (!ioapic_available() && line > 2 && line < 16 && line != 12 && line != 14 && line != 15) {
+            idt_register_handler(32 + line, ahci_irq_handler);
+            irq_unmask(line);
+            irq_enabled = true;
+        }
+    }
+
+    hba->is = 0xFFFFFFFF;
+    uint32_t implemented = hba->pi;
+    for (uint8_t i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (implemented & (1u << i)) {
+            ahci_probe_port(i);
+        }
+    }
+
+    if (irq_enabled) {
+        hba->ghc |= AHCI_GHC_IE;
+    }
+
+    LOG_INFO("AHCI %d.%d: %u slots, NCQ %s, %d disks", hba->vs >> 16, (hba->vs >> 8) & 0xFF, slot_count,
+             (cap & AHCI_CAP_SNCQ) ? "supported" : "unsupported", port_count);
+    ahci_print_info();
+    return port_count > 0;
+}
+
+// Print information about the attached disks
+void ahci_print_info(void) {
+    for (int i = 0; i < port_count; i++) {
+        ahci_port_t *port = &ports[i];
+        LOG_INFO("AHCI port %d: %s", port->index, port->model);
+        LOG_INFO("  Size: %u MB", (uint32_t)(port->size / 2048));
+        LOG_INFO("  Addressing: %s", port->lba48 ? "LBA48" : "LBA28");
+        if (port->ncq) {
+            LOG_INFO("  NCQ: %u commands in flight", port->depth);
+        } else {
+            LOG_INFO_MSG("  NCQ: not used");
+        }
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AHCI_MAX_PORTS         32
+#define AHCI_MAX_SLOTS         32      // Command slots per port (and NCQ tags)
+#define AHCI_PRDT_ENTRIES      56      // PRDs per command table, keeps the table at 1K
+#define AHCI_MAX_SECTORS       256     // Per command
+#define AHCI_MAX_SEGMENTS      16      // Per command
+#define AHCI_TIMEOUT           5000    // Command timeout in ms
+#define AHCI_POLL_MS           10      // Waiters recheck the port this often in case an interrupt is missed
+
+// HBA Capabilities (CAP) Bit Definitions
+#define AHCI_CAP_NCS_SHIFT     8          // Number of command slots - 1 (bits 12:8)
+#define AHCI_CAP_SNCQ          (1u << 30) // Supports native command queuing
+#define AHCI_CAP_S64A          (1u << 31) // Supports 64-bit addressing
+
+// Global HBA Control (GHC) Bit Definitions
+#define AHCI_GHC_IE            (1u << 1)  // Interrupt Enable
+#define AHCI_GHC_AE            (1u << 31) // AHCI Enable
+
+// AHCI Port Command Register (PxCMD) Bit Definitions
+#define AHCI_PORT_CMD_ST       (1u << 0)   // Start
+#define AHCI_PORT_CMD_SUD      (1u << 1)   // Spin-Up Device
+#define AHCI_PORT_CMD_POD      (1u << 2)   // Power On Device
+#define AHCI_PORT_CMD_CLO      (1u << 3)   // Command List Override
+#define AHCI_PORT_CMD_FRE      (1u << 4)   // FIS Receive Enable
+#define AHCI_PORT_CMD_CCS      (1u << 8)   // Current Command Slot
+#define AHCI_PORT_CMD_MPSS     (1u << 13)  // Mechanical Presence Switch State
+#define AHCI_PORT_CMD_FR       (1u << 14)  // FIS Receive Running
+#define AHCI_PORT_CMD_CR       (1u << 15)  // Command List Running
+#define AHCI_PORT_CMD_CPS      (1u << 16)  // Cold Presence State
+#define AHCI_PORT_CMD_PMA      (1u << 17)  // Port Multiplier Attached
+#define AHCI_PORT_CMD_HPCP     (1u << 18)  // Hot Plug Capable Port
+#define AHCI_PORT_CMD_MPSP     (1u << 19)  // Mechanical Presence Switch Attached
+#define AHCI_PORT_CMD_FBSCP    (1u << 22)  // FIS-Based Switching Capable Port
+#define AHCI_PORT_CMD_CQE      (1u << 23)  // Command List Quality Event
+#define AHCI_PORT_CMD_ATAPI    (1u << 24)  // Device is ATAPI
+#define AHCI_PORT_CMD_APSTE    (1u << 25)  // Automatic Partial to Slumber Transitions Enabled
+#define AHCI_PORT_CMD_DLAE     (1u << 30)  // Device LED Active on External
+#define AHCI_PORT_CMD_ASP      (1u << 31)  // Aggressive Slumber/Partial
+
+// Port Interrupt Status (PxIS) Bit Definitions
+#define AHCI_PORT_IS_TFES      (1u << 30)  // Task File Error Status
+#define AHCI_PORT_IS_ERRORS    0x7D000010u // TFES, HBFS, HBDS, IFS, INFS, OFS, UFS
+
+// Port registers, one block per implemented port
+typedef volatile struct {
+    uint32_t clb;           // Command list base (1K aligned)
+    uint32_t clbu;
+    uint32_t fb;            // Received FIS base (256 byte aligned)
+    uint32_t fbu;
+    uint32_t is;            // Interrupt status
+    uint32_t ie;            // Interrupt enable
+    uint32_t cmd;           // Command and status
+    uint32_t reserved0;
+    uint32_t tfd;           // Task file data
+    uint32_t sig;           // Device signature
+    uint32_t ssts;          // SATA status
+    uint32_t sctl;          // SATA control
+    uint32_t serr;          // SATA error
+    uint32_t sact;          // NCQ tags outstanding
+    uint32_t ci;            // Command slots issued
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+} ahci_port_regs_t;
+
+// HBA memory registers (ABAR)
+typedef volatile struct {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is;            // Pending interrupt per port
+    uint32_t pi;            // Ports implemented
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_pts;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t reserved[0xA0 - 0x2C];
+    uint8_t vendor[0x100 - 0xA0];
+    ahci_port_regs_t ports[AHCI_MAX_PORTS];
+} ahci_hba_t;
+
+// Command list entry, one per slot
+typedef struct {
+    uint16_t flags;         // CFL in bits 4:0, write in bit 6
+    uint16_t prdtl;         // PRD entries in the table
+    volatile uint32_t prdbc; // Bytes transferred
+    uint32_t ctba;          // Command table base (128 byte aligned)
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+// Physical region descriptor
+typedef struct {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;           // Byte count - 1 in bits 21:0
+} __attribute__((packed)) ahci_prd_t;
+
+// Command table, one per slot
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+// Host to device register FIS
+typedef struct {
+    uint8_t type;           // 0x27
+    uint8_t flags;          // Bit 7 set for a command
+    uint8_t command;
+    uint8_t feature_low;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_high;
+    uint8_t count_low;
+    uint8_t count_high;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__((packed)) ahci_fis_h2d_t;
+
+// Find the AHCI controller and register its SATA disks with the block layer
+bool ahci_init(void);
+
+// Print information about the attached disks
+void ahci_print_info(void);
+
+#endif // AHCI_H
@@ -0,0 +1,245 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/apic/ioapic.h>
+#include <drivers/apic/lapic.h>
+#include <drivers/acpi/acpi.h>
+#include <drivers/pic/pic.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <core/exec/scheduler.h>
+#include <memory/vmm.h>
+#include <utils/log.h>
+
+// Multiple APIC Description Table, variable length entries follow
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) madt_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct {
+    madt_entry_t entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+// An ISA line wired to another input or with non-ISA polarity and trigger
+typedef struct {
+    madt_entry_t entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) madt_override_t;
+
+// MPS INTI flags of an override
+#define MPS_POLARITY_MASK       0x3
+#define MPS_POLARITY_LOW        0x3
+#define MPS_TRIGGER_MASK        0xC
+#define MPS_TRIGGER_LEVEL       0xC
+
+typedef struct {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t inputs;
+    uint8_t id;
+} ioapic_t;
+
+static ioapic_t ioapics[IOAPIC_MAX];
+static uint32_t ioapic_count = 0;
+static spinlock_t lock;             // The select and window pair is shared by every CPU
+
+// Input and redirection flags of each ISA line
+static uint32_t isa_gsi[IOAPIC_ISA_IRQS];
+static uint32_t isa_flags[IOAPIC_ISA_IRQS];
+
+static bool ready = false;
+
+static uint32_t read_reg(ioapic_t *ioapic, uint8_t reg) {
+    ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+    return ioapic->regs[IOAPIC_WINDOW / 4];
+}
+
+static void write_reg(ioapic_t *ioapic, uint8_t reg, uint32_t value) {
+    ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+    ioapic->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+// I/O APIC handling a global system interrupt, NULL when none does
+static ioapic_t *find_ioapic(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].inputs) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+// Map an I/O APIC from the MADT and mask all its inputs
+static void add_ioapic(const madt_ioapic_t *entry) {
+    if (ioapic_count >= IOAPIC_MAX) {
+        LOG_WARN("IOAPIC: ignoring I/O APIC %u, only %u are supported", entry->id, IOAPIC_MAX);
+        return;
+    }
+
+    ioapic_t *ioapic = &ioapics[ioapic_count];
+    ioapic->regs = vmm_map_physical(entry->address, PAGE_SIZE_4K,
+                                    VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!ioapic->regs) {
+        LOG_ERROR("IOAPIC: failed to map registers at 0x%x", entry->address);
+        return;
+    }
+
+    ioapic->id = entry->id;
+    ioapic->gsi_base = entry->gsi_base;
+    ioapic->inputs = ((read_reg(ioapic, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+    for (uint32_t i = 0; i < ioapic->inputs; i++) {
+        write_reg(ioapic, IOAPIC_REG_REDIRECT + i * 2, IOAPIC_MASKED);
+    }
+    ioapic_count++;
+
+    LOG_INFO("IOAPIC: ID %u at 0x%x, GSIs %u-%u", ioapic->id, entry->address,
+             ioapic->gsi_base, ioapic->gsi_base + ioapic->inputs - 1);
+}
+
+// Take an interrupt source override for an ISA line
+static void add_override(const madt_override_t *entry) {
+    if (entry->bus != 0 || entry->source >= IOAPIC_ISA_IRQS) {
+        return;
+    }
+
+    uint32_t flags = 0;
+    if ((entry->flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) flags |= IOAPIC_ACTIVE_LOW;
+    if ((entry->flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) flags |= IOAPIC_LEVEL;
+
+    isa_gsi[entry->source] = entry->gsi;
+    isa_flags[entry->source] = flags;
+    LOG_DEBUG("IOAPIC: IRQ %u -> GSI %u%s%s", entry->source, entry->gsi,
+              flags & IOAPIC_ACTIVE_LOW ? ", active low" : "",
+              flags & IOAPIC_LEVEL ? ", level" : "");
+}
+
+// Find the I/O APICs and route the ISA lines to vectors IRQ0-IRQ15 on the BSP, masked.
+// The PIC is disabled once they are.
+bool ioapic_init(void) {
+    spinlock_init(&lock);
+
+    // Redirection entries name LAPIC IDs, there is nothing to deliver to without one
+    if (!lapic_available()) {
+        return false;
+    }
+
+    const madt_t *madt = (const madt_t *)acpi_find_table("APIC");
+    if (!madt) {
+        LOG_WARN("IOAPIC: no MADT, staying on the PIC");
+        return false;
+    }
+
+    // ISA lines are identity mapped, edge triggered and active high unless overridden
+    for (uint8_t irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+        isa_gsi[irq] = irq;
+        isa_flags[irq] = 0;
+    }
+
+    const uint8_t *p = (const uint8_t *)madt + sizeof(madt_t);
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+    while (p + sizeof(madt_entry_t) <= end) {
+        const madt_entry_t *entry = (const madt_entry_t *)p;
+        if (entry->length < sizeof(madt_entry_t) || p + entry->length > end) break;
+
+        if (entry->type == MADT_IOAPIC && entry->length >= sizeof(madt_ioapic_t)) {
+            add_ioapic((const madt_ioapic_t *)entry);
+        } else if (entry->type == MADT_OVERRIDE && entry->length >= sizeof(madt_override_t)) {
+            add_override((const madt_override_t *)entry);
+        }
+        p += entry->length;
+    }
+
+    if (ioapic_count == 0) {
+        LOG_WARN("IOAPIC: none in the MADT, staying on the PIC");
+        return false;
+    }
+
+    uint32_t bsp = lapic_id();
+    for (uint8_t irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+        if (irq == IRQ_CASCADE - IRQ0) continue;
+        ioapic_route(isa_gsi[irq], IRQ0 + irq, bsp, isa_flags[irq]);
+    }
+
+    // Nothing may arrive through the 8259s any more, their lines are wired to the I/O APIC too
+    if (madt->flags & MADT_PCAT_COMPAT) {
+        pic_disable();
+    }
+    ready = true;
+
+    LOG_INFO("IOAPIC: %u I/O APICs, ISA lines routed to LAPIC %u", ioapic_count, bsp);
+    return true;
+}
+
+// Check if interrupts go through the I/O APICs
+bool ioapic_available(void) {
+    return ready;
+}
+
+// Global system interrupt an ISA line arrives on
+uint32_t ioapic_isa_gsi(uint8_t irq) {
+    return irq < IOAPIC_ISA_IRQS ? isa_gsi[irq] : irq;
+}
+
+// Deliver an input to vector on the CPU with the APIC ID, flags are IOAPIC_ACTIVE_LOW and
+// IOAPIC_LEVEL. The input keeps its mask.
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags) {
+    ioapic_t *ioapic = find_ioapic(gsi);
+    if (!ioapic || apic_id > 0xFF) {
+        return false;
+    }
+
+    uint8_t reg = IOAPIC_REG_REDIRECT + (gsi - ioapic->gsi_base) * 2;
+    uint64_t irq_flags = cpu_irq_save();
+    spinlock_acquire(&lock);
+
+    // Fixed delivery in physical destination mode, the high dword goes first so the entry
+    // never points at the old CPU with the new vector
+    uint32_t mask = read_reg(ioapic, reg) & IOAPIC_MASKED;
+    write_reg(ioapic, reg, IOAPIC_MASKED);
+    write_reg(ioapic, reg + 1, apic_id << 24);
+    write_reg(ioapic, reg, vector | (flags & (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL)) | mask);
+
+    spinlock_release(&lock);
+    cpu_irq_restore(irq_flags);
+    return true;
+}
+
+// Set or clear the mask bit of an input
+static void set_masked(uint32_t gsi, bool masked) {
+    ioapic_t *ioapic = find_ioapic(gsi);
+    if (!ioapic) {
+        return;
+    }
+
+    uint8_t reg = IOAPIC_REG_REDIRECT + (gsi - ioapic->gsi_base) * 2;
+    uint64_t irq_flags = cpu_irq_save();
+    spinlock_acquire(&lock);
+
+    uint32_t low = read_reg(ioapic, reg);
+    write_reg(ioapic, reg, masked ? low | IOAPIC_MASKED : low & ~IOAPIC_MASKED);
+
+    spinlock_release(&lock);
+    cpu_irq_restore(irq_flags);
+}
+
+// Mask or unmask an input
+void ioapic_mask(uint32_t gsi) {
+    set_masked(gsi, true);
+}
+
+void ioapic_unmask(uint32_t gsi) {
+    set_masked(gsi, false);
+}
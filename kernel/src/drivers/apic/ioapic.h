@@ -0,0 +1,48 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// I/O APICs the MADT may describe
+#define IOAPIC_MAX              8
+
+// Registers, reached through the select and window pair
+#define IOAPIC_REGSEL           0x00
+#define IOAPIC_WINDOW           0x10
+#define IOAPIC_REG_ID           0x00
+#define IOAPIC_REG_VERSION      0x01    // Bits 16-23 hold the last redirection entry
+#define IOAPIC_REG_REDIRECT     0x10    // Two registers per input, low dword first
+
+// Redirection entry bits
+#define IOAPIC_ACTIVE_LOW       (1U << 13)
+#define IOAPIC_LEVEL            (1U << 15)
+#define IOAPIC_MASKED           (1U << 16)
+
+// MADT entries
+#define MADT_IOAPIC             1
+#define MADT_OVERRIDE           2
+#define MADT_PCAT_COMPAT        (1U << 0)   // Dual 8259s are present
+
+// Legacy ISA lines
+#define IOAPIC_ISA_IRQS         16
+
+// Find the I/O APICs and route the ISA lines to vectors IRQ0-IRQ15 on the BSP, masked.
+// The PIC is disabled once they are.
+bool ioapic_init(void);
+
+// Check if interrupts go through the I/O APICs
+bool ioapic_available(void);
+
+// Global system interrupt an ISA line arrives on
+uint32_t ioapic_isa_gsi(uint8_t irq);
+
+// Deliver an input to vector on the CPU with the APIC ID, flags are IOAPIC_ACTIVE_LOW and
+// IOAPIC_LEVEL. The input keeps its mask.
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags);
+
+// Mask or unmask an input
+void ioapic_mask(uint32_t gsi);
+void ioapic_unmask(uint32_t gsi);
+
+#endif // IOAPIC_H
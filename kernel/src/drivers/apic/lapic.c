@@ -0,0 +1,174 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/apic/lapic.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <memory/vmm.h>
+#include <utils/log.h>
+#include <stddef.h>
+
+// Local APIC state, the MMIO window is the same physical page on every CPU
+static bool ready = false;
+static bool x2apic = false;
+static bool tsc_deadline = false;
+static volatile uint32_t *mmio = NULL;
+
+// Read a local APIC register
+static uint32_t lapic_read(uint32_t reg) {
+    if (x2apic) {
+        return (uint32_t)cpu_read_msr(MSR_X2APIC_BASE + (reg >> 4));
+    }
+    return mmio[reg / 4];
+}
+
+// Write a local APIC register
+static void lapic_write(uint32_t reg, uint32_t value) {
+    if (x2apic) {
+        cpu_write_msr(MSR_X2APIC_BASE + (reg >> 4), value);
+        return;
+    }
+    mmio[reg / 4] = value;
+}
+
+// Spurious interrupts need no EOI
+static void spurious_handler(struct interrupt_frame *frame) {
+    (void)frame;
+}
+
+// A reschedule IPI only has to wake the CPU, its idle loop looks at the run queue
+static void resched_handler(struct interrupt_frame *frame) {
+    (void)frame;
+    lapic_eoi();
+}
+
+// Software-enable the executing CPU's local APIC
+static void enable_local(void) {
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+}
+
+// Map and enable the BSP's local APIC
+bool lapic_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_APIC)) {
+        LOG_WARN("LAPIC: not present");
+        return false;
+    }
+
+    uint64_t base = cpu_read_msr(MSR_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE)) {
+        LOG_WARN("LAPIC: disabled by firmware");
+        return false;
+    }
+
+    // The bootloader decides the mode, APs inherit it
+    x2apic = (base & APIC_BASE_X2APIC) != 0;
+    if (!x2apic) {
+        mmio = vmm_map_physical(base & APIC_BASE_ADDR_MASK, PAGE_SIZE_4K,
+                                VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+        if (!mmio) {
+            LOG_ERROR("LAPIC: failed to map registers at 0x%llx", base & APIC_BASE_ADDR_MASK);
+            return false;
+        }
+    }
+
+    tsc_deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+
+    idt_register_handler(LAPIC_RESCHED_VECTOR, resched_handler);
+    idt_register_handler(LAPIC_SPURIOUS_VECTOR, spurious_handler);
+    enable_local();
+    ready = true;
+
+    LOG_INFO("LAPIC: %s mode, ID %u, version 0x%x%s", x2apic ? "x2APIC" : "xAPIC",
+             lapic_id(), lapic_read(LAPIC_REG_VERSION) & 0xFF,
+             tsc_deadline ? ", TSC-deadline timer" : "");
+    return true;
+}
+
+// Enable the local APIC of an application processor
+void lapic_init_cpu(void) {
+    if (ready) {
+        enable_local();
+    }
+}
+
+// Check if the local APIC is usable
+bool lapic_available(void) {
+    return ready;
+}
+
+// Check if the timer supports TSC-deadline mode
+bool lapic_has_tsc_deadline(void) {
+    return tsc_deadline;
+}
+
+// Local APIC ID of the executing CPU
+uint32_t lapic_id(void) {
+    uint32_t id = lapic_read(LAPIC_REG_ID);
+    return x2apic ? id : id >> 24;
+}
+
+// Signal end of interrupt for the vector being serviced
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+// Send a fixed interrupt to another CPU
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (!ready) {
+        return;
+    }
+
+    if (x2apic) {
+        // One 64-bit write, destination in the upper half
+        cpu_write_msr(MSR_X2APIC_BASE + (LAPIC_REG_ICR_LOW >> 4),
+                      ((uint64_t)apic_id << 32) | LAPIC_ICR_ASSERT | vector);
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_ASSERT | vector);
+    cpu_irq_restore(flags);
+}
+
+// Set up the timer LVT, masked until armed
+void lapic_timer_setup(bool use_deadline) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR |
+                (use_deadline ? LAPIC_TIMER_TSC_DEADLINE : LAPIC_TIMER_ONESHOT));
+}
+
+// Fire the timer once after count timer ticks
+void lapic_timer_oneshot(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count ? count : 1);
+}
+
+// Fire the timer once the TSC reaches deadline
+void lapic_timer_deadline(uint64_t deadline) {
+    cpu_write_msr(MSR_TSC_DEADLINE, deadline);
+}
+
+// Cancel a pending timer interrupt
+void lapic_timer_stop(void) {
+    // Zero disarms both modes
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+    if (tsc_deadline) {
+        cpu_write_msr(MSR_TSC_DEADLINE, 0);
+    }
+}
+
+// Timer ticks left of a one-shot count
+uint32_t lapic_timer_current(void) {
+    return lapic_read(LAPIC_REG_TIMER_CURRENT);
+}
+
+// Set the performance counter LVT of the executing CPU
+void lapic_set_lvt_perf(uint32_t value) {
+    lapic_write(LAPIC_REG_LVT_PERF, value);
+}
@@ -0,0 +1,85 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC registers (xAPIC MMIO offsets, x2APIC MSR = 0x800 + offset / 16)
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_VERSION       0x030
+#define LAPIC_REG_TPR           0x080   // Task priority
+#define LAPIC_REG_EOI           0x0B0
+#define LAPIC_REG_SVR           0x0F0   // Spurious interrupt vector
+#define LAPIC_REG_ICR_LOW       0x300   // Interrupt command
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_LVT_PERF      0x340   // Performance counter overflow
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+// Register bits
+#define LAPIC_SVR_ENABLE        (1U << 8)
+#define LAPIC_LVT_NMI           (4U << 8)   // Deliver as an NMI, the vector is ignored
+#define LAPIC_LVT_MASKED        (1U << 16)
+#define LAPIC_TIMER_ONESHOT     (0U << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2U << 17)
+#define LAPIC_TIMER_DIVIDE_16   0x3
+#define LAPIC_ICR_PENDING       (1U << 12)  // xAPIC only, x2APIC sends synchronously
+#define LAPIC_ICR_ASSERT        (1U << 14)
+
+// MSRs
+#define MSR_APIC_BASE           0x1B
+#define MSR_TSC_DEADLINE        0x6E0
+#define MSR_X2APIC_BASE         0x800
+#define APIC_BASE_X2APIC        (1ULL << 10)
+#define APIC_BASE_ENABLE        (1ULL << 11)
+#define APIC_BASE_ADDR_MASK     0x000FFFFFFFFFF000ULL
+
+// Vectors owned by the local APIC
+#define LAPIC_TIMER_VECTOR      0xEF
+#define LAPIC_RESCHED_VECTOR    0xF0    // Wakes an idle CPU to look at its run queue
+#define LAPIC_SYNC_VECTOR       0xF1    // Serializes a CPU after kernel code changed under it
+#define LAPIC_SPURIOUS_VECTOR   0xFF
+
+// Map and enable the BSP's local APIC
+bool lapic_init(void);
+
+// Enable the local APIC of an application processor
+void lapic_init_cpu(void);
+
+// Check if the local APIC is usable
+bool lapic_available(void);
+
+// Check if the timer supports TSC-deadline mode
+bool lapic_has_tsc_deadline(void);
+
+// Local APIC ID of the executing CPU
+uint32_t lapic_id(void);
+
+// Signal end of interrupt for the vector being serviced
+void lapic_eoi(void);
+
+// Send a fixed interrupt to another CPU
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Set up the timer LVT (one-shot or TSC-deadline), masked until armed
+void lapic_timer_setup(bool tsc_deadline);
+
+// Fire the timer once after count timer ticks (bus clock / 16)
+void lapic_timer_oneshot(uint32_t count);
+
+// Fire the timer once the TSC reaches deadline
+void lapic_timer_deadline(uint64_t deadline);
+
+// Cancel a pending timer interrupt
+void lapic_timer_stop(void);
+
+// Timer ticks left of a one-shot count
+uint32_t lapic_timer_current(void);
+
+// Set the performance counter LVT of the executing CPU. Delivery masks it again, so an
+// overflow handler rewrites it every time.
+void lapic_set_lvt_perf(uint32_t value);
+
+#endif // LAPIC_H
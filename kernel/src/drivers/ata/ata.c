@@ -1,9 +1,17 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/ata/ata.h>
 #include <drivers/pci/pci.h>
 #include <lib/io.h>
 #include <lib/string.h>
+#include <lib/stdio.h>
 #include <utils/log.h>
+#include <utils/trace.h>
 #include <memory/vmm.h>
+#include <core/idt.h>
+#include <drivers/timer/timer.h>
+#include <core/cpu.h>
+#include <core/exec/wait.h>
 
 // ATA controller I/O ports
 #define ATA_PRIMARY_DATA            0x1F0
@@ -35,6 +43,10 @@
 #define ATA_CMD_READ_PIO_EXT        0x24
 #define ATA_CMD_WRITE_PIO           0x30
 #define ATA_CMD_WRITE_PIO_EXT       0x34
+#define ATA_CMD_READ_DMA            0xC8
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA           0xCA
+#define ATA_CMD_WRITE_DMA_EXT       0x35
 #define ATA_CMD_IDENTIFY            0xEC
 #define ATA_CMD_CACHE_FLUSH         0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT     0xEA
@@ -57,9 +69,30 @@
 #define ATA_DEVICE_SLAVE            0x10
 #define ATA_DEVICE_LBA              0x40
 
+// Bus Master IDE registers (offsets from the channel's BMIDE base)
+#define BM_COMMAND                  0x00
+#define BM_STATUS                   0x02
+#define BM_PRDT                     0x04
+#define BM_CHANNEL_STRIDE           0x08
+
+#define BM_CMD_START                0x01
+#define BM_CMD_READ                 0x08  // Bus master writes to memory (disk read)
+
+#define BM_STATUS_ACTIVE            0x01
+#define BM_STATUS_ERR               0x02
+#define BM_STATUS_IRQ               0x04
+
+// Physical Region Descriptor flags
+#define PRD_EOT                     0x8000
+#define PRD_MAX_BYTES               0x10000
+#define PRD_MAX_ENTRIES             (PMM_BLOCK_SIZE / sizeof(ata_prd_t))
+
 // Polling timeout in milliseconds
 #define ATA_TIMEOUT                 1000
 
+// DMA waiters recheck the engine this often in case the IRQ was missed
+#define ATA_POLL_MS                 10
+
 // Drive types for detection
 #define DRIVE_TYPE_UNKNOWN          0x00
 #define DRIVE_TYPE_PATA             0x01
@@ -79,6 +112,48 @@ typedef struct {
     uint32_t size;       // Size in sectors
 } ata_drive_info_t;
 
+// Physical Region Descriptor (one contiguous DMA buffer)
+typedef struct {
+    uint32_t phys;       // Physical address (below 4GB)
+    uint16_t bytes;      // Byte count, 0 means 64K
+    uint16_t flags;      // PRD_EOT on the last entry
+} __attribute__((packed)) ata_prd_t;
+
+// Position within a segment list, carried across commands
+typedef struct {
+    const block_segment_t *segments;
+    size_t segment_count;
+    size_t index;
+    uint32_t offset;    // Sectors already transferred in the current segment
+} ata_cursor_t;
+
+// Per-channel bus master state
+typedef struct {
+    uint16_t bmide;              // Bus master base for this channel, 0 if no DMA
+    uint16_t base;               // Command block base
+    ata_prd_t *prdt;             // PRD table (HHDM view)
+    uint64_t prdt_phys;
+    volatile bool irq_fired;     // Set by the channel's IRQ handler
+    wait_queue_t wait;           // Synchronous DMA waiters and drains, woken by the IRQ handler
+    volatile uint8_t bm_status;  // Bus master status captured by the handler
+    ata_cursor_t dma_cursor;     // Cursor after the DMA command in flight
+    
+    // Block layer batch driven by the IRQ handler
+    block_device_t *blockdev;    // NULL when no batch is running
+    const block_command_t *commands;
+    size_t command_count;
+    size_t command_index;
+    ata_cursor_t cursor;         // Position in the current command's segments
+    uint64_t lba;                // Next sector of the current command
+    uint32_t remaining;          // Sectors left in the current command
+    uint32_t chunk;              // Sectors in the DMA command in flight
+    uint8_t drive;
+    bool write;
+    uint64_t deadline;
+} ata_dma_channel_t;
+
+static ata_dma_channel_t dma_channels[2];
+
 // Static array to store detected drives
 static ata_drive_t detected_drives[ATA_MAX_DRIVES];
 static int drive_count = 0;
@@ -94,6 +169,9 @@ static void ata_software_reset(uint16_t control_port);
 static void ata_detect_drive(uint16_t base, uint16_t control, bool master);
 static void ata_identify_drive(int drive_idx);
 static void ata_extract_string(char* dest, uint16_t* src, int length);
+static void ata_dma_init(void);
+static void ata_register_block_device(int drive_idx);
+static void ata_async_progress(ata_dma_channel_t *channel);
 
 // Initialize the ATA driver
 void ata_init() {
@@ -147,7 +225,7 @@ void ata_init() {
             // Check if controller is in AHCI mode
             uint8_t prog_if = controller.prog_if;
             if (prog_if == 0x01) {
-                LOG_INFO("Controller in AHCI mode - Stay tuned for AHCI support soon.");
+                LOG_INFO_MSG("Controller in AHCI mode - SATA ports are handled by the AHCI driver");
             }
         }
     } else {
@@ -165,6 +243,14 @@ void ata_init() {
     ata_detect_drive(ATA_SECONDARY_DATA, ATA_SECONDARY_CONTROL, true);
     ata_detect_drive(ATA_SECONDARY_DATA, ATA_SECONDARY_CONTROL, false);
     
+    // Set up bus master DMA on the IDE controller
+    ata_dma_init();
+    
+    // Expose the drives through the block layer
+    for (int i = 0; i < drive_count; i++) {
+        ata_register_block_device(i);
+    }
+    
     LOG_INFO("ATA driver initialized with %d drives", drive_count);
     
     // Print info about detected drives
@@ -288,13 +374,16 @@ static void ata_detect_drive(uint16_t base, uint16_t control, bool master) {
     detected_drives[drive_count].type = drive_type;
     detected_drives[drive_count].signature = (lba_high << 8) | lba_mid;
     detected_drives[drive_count].capabilities = identify_data[49];
+    detected_drives[drive_count].dma = (identify_data[49] & (1 << 8)) != 0;
     detected_drives[drive_count].command_sets = identify_data[83];
     
     // LBA28 or LBA48 size
     if (identify_data[83] & (1 << 10)) {
-        // LBA48 supported - get size from bytes 100-103
+        // LBA48 supported - get size from words 100-103
+        detected_drives[drive_count].lba48 = true;
         detected_drives[drive_count].size = 
-            ((uint32_t)identify_data[101] << 16) | identify_data[100];
+            ((uint64_t)identify_data[103] << 48) | ((uint64_t)identify_data[102] << 32) |
+            ((uint64_t)identify_data[101] << 16) | identify_data[100];
     } else {
         // LBA28 - get size from bytes 60-61
         detected_drives[drive_count].size = 
@@ -323,9 +412,9 @@ static void ata_detect_drive(uint16_t base, uint16_t control, bool master) {
     detected_drives[drive_count].sectors = identify_data[6];
     
     LOG_INFO("Drive %d: %s", drive_count, detected_drives[drive_count].model);
-    LOG_INFO("  Size: %u sectors (%u MB)", 
+    LOG_INFO("  Size: 0x%llX sectors (%u MB)", 
              detected_drives[drive_count].size,
-             detected_drives[drive_count].size / 2048);
+             (uint32_t)(detected_drives[drive_count].size / 2048));
     
     // Register the drive
     drive_count++;
@@ -381,15 +470,20 @@ void ata_print_info() {
         LOG_INFO("  Model: %s", detected_drives[i].model);
         LOG_INFO("  Serial: %s", detected_drives[i].serial);
         LOG_INFO("  Type: %s", type_str);
-        LOG_INFO("  Size: %u sectors (%u MB)", 
+        LOG_INFO("  Size: 0x%llX sectors (%u MB)", 
                  detected_drives[i].size, 
-                 detected_drives[i].size / 2048);
+                 (uint32_t)(detected_drives[i].size / 2048));
         LOG_INFO("  CHS: %u/%u/%u", 
                  detected_drives[i].cylinders, 
                  detected_drives[i].heads, 
                  detected_drives[i].sectors);
         
-        if (detected_drives[i].capabilities & (1 << 9)) {
+        LOG_INFO("  DMA: %s", detected_drives[i].dma && dma_channels[i < 2 ? 0 : 1].bmide ?
+                 "Bus master" : "PIO only");
+        
+        if (detected_drives[i].lba48) {
+            LOG_INFO("  LBA: 48-bit");
+        } else if (detected_drives[i].capabilities & (1 << 9)) {
             LOG_INFO("  LBA: Supported");
         } else {
             LOG_INFO("  LBA: Not supported");
@@ -526,15 +620,102 @@ static void ata_software_reset(uint16_t control_port) {
     ata_wait_not_busy(status_port, 100);
 }
 
-// Read sectors from a drive
-bool ata_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, void* buffer) {
-    if (!ata_drive_present(drive_index) || buffer == NULL || count == 0) {
-        return false;
+// Disk IRQ: latch bus master completion and acknowledge the drive
+static void ata_irq_handler(struct interrupt_frame *frame) {
+    ata_dma_channel_t *channel = &dma_channels[frame->int_no == IRQ_PRIMARY_ATA ? 0 : 1];
+    
+    if (channel->bmide) {
+        uint8_t status = inb(channel->bmide + BM_STATUS);
+        if (status & BM_STATUS_IRQ) {
+            channel->bm_status = status;
+            channel->irq_fired = true;
+            outb(channel->bmide + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+        }
+    }
+    
+    // Reading the status register clears the drive's interrupt
+    inb(channel->base + 7);
+    
+    // Move a queued batch on to its next command
+    if (channel->blockdev) {
+        ata_async_progress(channel);
+    }
+    
+    wait_wake_all(&channel->wait);
+}
+
+// Find the PCI IDE controller and set up a PRD table per channel
+static void ata_dma_init(void) {
+    pci_device_t ide;
+    if (!pci_find_device_by_class(0x01, 0x01, &ide)) {
+        LOG_INFO_MSG("No PCI IDE controller, ATA transfers use PIO");
+        return;
+    }
+    
+    // BAR4 must be an I/O BAR holding the bus master registers
+    uint32_t bar4 = pci_read_config_dword(ide.bus, ide.device, ide.function, PCI_BASE_ADDRESS_4);
+    if (!(bar4 & 0x1) || (bar4 & 0xFFFC) == 0) {
+        LOG_WARN("IDE controller has no bus master I/O BAR, ATA transfers use PIO");
+        return;
+    }
+    uint16_t bmide = bar4 & 0xFFFC;
+    
+    // Enable I/O space and bus mastering
+    uint32_t command = pci_read_config_dword(ide.bus, ide.device, ide.function, PCI_COMMAND);
+    pci_write_config_dword(ide.bus, ide.device, ide.function, PCI_COMMAND, command | 0x5);
+    
+    for (int i = 0; i < 2; i++) {
+        ata_dma_channel_t *channel = &dma_channels[i];
+        channel->base = i == 0 ? ATA_PRIMARY_DATA : ATA_SECONDARY_DATA;
+        wait_queue_init(&channel->wait);
+        
+        // The PRD table must sit below 4GB
+        void *page = pmm_alloc_page();
+        if (!page || (uint64_t)page + PMM_BLOCK_SIZE > 0x100000000ULL) {
+            LOG_WARN("ATA channel %d: no PRD table memory below 4GB, using PIO", i);
+            if (page) pmm_free_page(page);
+            continue;
+        }
+        
+        channel->prdt_phys = (uint64_t)page;
+        channel->prdt = vmm_phys_to_virt(channel->prdt_phys);
+        channel->bmide = bmide + i * BM_CHANNEL_STRIDE;
+        
+        // Stop the engine and clear stale status
+        outb(channel->bmide + BM_COMMAND, 0);
+        outb(channel->bmide + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+    }
+    
+    idt_register_handler(IRQ_PRIMARY_ATA, ata_irq_handler);
+    idt_register_handler(IRQ_SECONDARY_ATA, ata_irq_handler);
+    irq_unmask(14);
+    irq_unmask(15);
+    
+    LOG_INFO("ATA bus master DMA enabled (BMIDE 0x%X)", bmide);
+}
+
+// Next sector buffer in the segment list
+static uint16_t* ata_cursor_next(ata_cursor_t *cursor) {
+    while (cursor->index < cursor->segment_count &&
+           cursor->offset >= cursor->segments[cursor->index].sectors) {
+        cursor->index++;
+        cursor->offset = 0;
+    }
+    
+    if (cursor->index >= cursor->segment_count) {
+        return NULL;
     }
     
+    uint8_t *base = (uint8_t*)cursor->segments[cursor->index].buffer;
+    return (uint16_t*)(base + (size_t)cursor->offset++ * ATA_SECTOR_SIZE);
+}
+
+// Select the drive and load LBA and sector count, returns true if the EXT command must be used
+static bool ata_setup_lba(uint8_t drive_index, uint64_t lba, uint32_t count) {
+    const ata_drive_t *drive = &detected_drives[drive_index];
+    
     // Get ports for this drive
     uint16_t data_port = ata_get_data_port(drive_index);
-    uint16_t control_port = ata_get_control_port(drive_index);
     bool is_master = ata_is_master(drive_index);
     
     // Calculate port offsets
@@ -544,108 +725,432 @@ bool ata_read_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, void* bu
     uint16_t lba_mid = data_port + 4;
     uint16_t lba_high = data_port + 5;
     uint16_t drive_head = data_port + 6;
+    
+    uint8_t drive_select = is_master ? ATA_DEVICE_MASTER : ATA_DEVICE_SLAVE;
+    bool use_lba48 = drive->lba48 &&
+                     (lba + count > ATA_LBA28_LIMIT || count > ATA_MAX_SECTORS_LBA28);
+    
+    if (use_lba48) {
+        // 48-bit LBA: high-order bytes first, then low-order bytes
+        outb(drive_head, drive_select | ATA_DEVICE_LBA);
+        outb(sector_count, (count >> 8) & 0xFF);
+        outb(lba_low, (lba >> 24) & 0xFF);
+        outb(lba_mid, (lba >> 32) & 0xFF);
+        outb(lba_high, (lba >> 40) & 0xFF);
+        outb(sector_count, count & 0xFF);
+        outb(lba_low, lba & 0xFF);
+        outb(lba_mid, (lba >> 8) & 0xFF);
+        outb(lba_high, (lba >> 16) & 0xFF);
+    } else {
+        // 28-bit LBA, a count of 256 is encoded as 0
+        outb(drive_head, drive_select | ATA_DEVICE_LBA | ((lba >> 24) & 0x0F));
+        outb(features, 0);                  // No features
+        outb(sector_count, count & 0xFF);   // Number of sectors
+        outb(lba_low, lba & 0xFF);          // LBA low byte
+        outb(lba_mid, (lba >> 8) & 0xFF);   // LBA middle byte
+        outb(lba_high, (lba >> 16) & 0xFF); // LBA high byte
+    }
+    
+    return use_lba48;
+}
+
+// Issue one PIO read or write command for up to the per-command sector limit
+static bool ata_pio_command(uint8_t drive_index, uint64_t lba, uint32_t count,
+                            ata_cursor_t *cursor, bool write) {
+    uint16_t data_port = ata_get_data_port(drive_index);
     uint16_t status_cmd = data_port + 7;
     
     // Wait for drive to be ready
     if (!ata_wait_not_busy(status_cmd, ATA_TIMEOUT)) {
-        LOG_ERROR("Drive %d not ready for read operation", drive_index);
+        LOG_ERROR("Drive %d not ready for %s operation", drive_index, write ? "write" : "read");
         return false;
     }
     
-    // Select drive and set up LBA
-    uint8_t drive_select = is_master ? ATA_DEVICE_MASTER : ATA_DEVICE_SLAVE;
-    outb(drive_head, drive_select | ATA_DEVICE_LBA | ((lba >> 24) & 0x0F));
-    
-    // Set up other registers
-    outb(features, 0);                  // No features
-    outb(sector_count, count);          // Number of sectors
-    outb(lba_low, lba & 0xFF);          // LBA low byte
-    outb(lba_mid, (lba >> 8) & 0xFF);   // LBA middle byte
-    outb(lba_high, (lba >> 16) & 0xFF); // LBA high byte
-    
-    // Send read command
-    outb(status_cmd, ATA_CMD_READ_PIO);
-    
-    // Read the data
-    uint16_t* buf = (uint16_t*)buffer;
+    if (ata_setup_lba(drive_index, lba, count)) {
+        outb(status_cmd, write ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_READ_PIO_EXT);
+    } else {
+        outb(status_cmd, write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO);
+    }
     
-    for (int sector = 0; sector < count; sector++) {
-        // Wait for data to be ready
+    for (uint32_t sector = 0; sector < count; sector++) {
+        uint16_t *buf = ata_cursor_next(cursor);
+        if (!buf) {
+            LOG_ERROR("Drive %d: segment list shorter than transfer", drive_index);
+            return false;
+        }
+        
+        // Wait for the drive to deliver or accept the next sector
         if (!ata_wait_drq(status_cmd, ATA_TIMEOUT)) {
             LOG_ERROR("Drive %d timeout waiting for data", drive_index);
             return false;
         }
         
-        // Read 256 words (512 bytes) per sector
-        for (int i = 0; i < 256; i++) {
-            buf[sector * 256 + i] = inw(data_port);
+        // 256 words (512 bytes) per sector
+        if (write) {
+            outsw(data_port, buf, ATA_SECTOR_SIZE / 2);
+        } else {
+            insw(data_port, buf, ATA_SECTOR_SIZE / 2);
         }
     }
     
+    // Writes complete once the drive drops BSY after the last sector
+    if (write && !ata_wait_not_busy(status_cmd, ATA_TIMEOUT)) {
+        LOG_ERROR("Drive %d timeout waiting for write to complete", drive_index);
+        return false;
+    }
+    
     return true;
 }
 
-// Write sectors to a drive
-bool ata_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, const void* buffer) {
-    if (!ata_drive_present(drive_index) || buffer == NULL || count == 0) {
+// Append a physical range to the PRD table, splitting at 64K boundaries
+static bool ata_prd_append(ata_dma_channel_t *channel, size_t *entries, uint64_t phys, uint32_t bytes) {
+    while (bytes > 0) {
+        // A PRD may not cross a 64K boundary
+        uint32_t chunk = PRD_MAX_BYTES - (phys & (PRD_MAX_BYTES - 1));
+        if (chunk > bytes) chunk = bytes;
+        
+        ata_prd_t *last = *entries > 0 ? &channel->prdt[*entries - 1] : NULL;
+        uint32_t last_bytes = last ? (last->bytes ? last->bytes : PRD_MAX_BYTES) : 0;
+        
+        // Extend the previous entry when memory is physically contiguous
+        if (last && last->phys + last_bytes == phys &&
+            (phys & (PRD_MAX_BYTES - 1)) != 0 && last_bytes + chunk <= PRD_MAX_BYTES) {
+            last->bytes = (uint16_t)(last_bytes + chunk);
+        } else {
+            if (*entries >= PRD_MAX_ENTRIES) {
+                return false;
+            }
+            
+            channel->prdt[*entries].phys = (uint32_t)phys;
+            channel->prdt[*entries].bytes = (uint16_t)(chunk & 0xFFFF);
+            channel->prdt[*entries].flags = 0;
+            (*entries)++;
+        }
+        
+        phys += chunk;
+        bytes -= chunk;
+    }
+    
+    return true;
+}
+
+// Build the PRD table for the next count sectors, false if the memory is not DMA-able
+static bool ata_dma_build_prdt(ata_dma_channel_t *channel, ata_cursor_t *cursor, uint32_t count) {
+    size_t entries = 0;
+    
+    while (count > 0) {
+        // Skip finished segments
+        while (cursor->index < cursor->segment_count &&
+               cursor->offset >= cursor->segments[cursor->index].sectors) {
+            cursor->index++;
+            cursor->offset = 0;
+        }
+        if (cursor->index >= cursor->segment_count) {
+            return false;
+        }
+        
+        const block_segment_t *segment = &cursor->segments[cursor->index];
+        uint32_t sectors = segment->sectors - cursor->offset;
+        if (sectors > count) sectors = count;
+        
+        // Translate page by page, buffers need not be physically contiguous
+        uint8_t *virt = (uint8_t*)segment->buffer + (size_t)cursor->offset * ATA_SECTOR_SIZE;
+        uint32_t bytes = sectors * ATA_SECTOR_SIZE;
+        while (bytes > 0) {
+            uint32_t in_page = PMM_BLOCK_SIZE - ((uint64_t)virt & (PMM_BLOCK_SIZE - 1));
+            if (in_page > bytes) in_page = bytes;
+            
+            uint64_t phys = vmm_virt_to_phys(virt);
+            if (phys == 0 || phys + in_page > 0x100000000ULL ||
+                !ata_prd_append(channel, &entries, phys, in_page)) {
+                return false;
+            }
+            
+            virt += in_page;
+            bytes -= in_page;
+        }
+        
+        cursor->offset += sectors;
+        count -= sectors;
+    }
+    
+    if (entries == 0) {
         return false;
     }
     
-    // Get ports for this drive
-    uint16_t data_port = ata_get_data_port(drive_index);
-    uint16_t control_port = ata_get_control_port(drive_index);
-    bool is_master = ata_is_master(drive_index);
+    channel->prdt[entries - 1].flags = PRD_EOT;
+    return true;
+}
+
+// Check whether the DMA command in flight has finished
+static bool ata_dma_done(ata_dma_channel_t *channel) {
+    if (channel->irq_fired) {
+        return true;
+    }
     
-    // Calculate port offsets
-    uint16_t features = data_port + 1;
-    uint16_t sector_count = data_port + 2;
-    uint16_t lba_low = data_port + 3;
-    uint16_t lba_mid = data_port + 4;
-    uint16_t lba_high = data_port + 5;
-    uint16_t drive_head = data_port + 6;
-    uint16_t status_cmd = data_port + 7;
+    // Also catch completion if the interrupt was missed or is masked
+    uint8_t status = inb(channel->bmide + BM_STATUS);
+    if (status & BM_STATUS_IRQ) {
+        channel->bm_status = status;
+        return true;
+    }
+    
+    return false;
+}
+
+// Wait condition of a synchronous DMA command
+static bool ata_dma_cond(void *arg) {
+    return ata_dma_done((ata_dma_channel_t *)arg);
+}
+
+// Sleep until the channel IRQ, rechecking the engine in case the interrupt is missed
+static bool ata_dma_wait(ata_dma_channel_t *channel) {
+    uint64_t deadline = timer_get_uptime_ms() + ATA_TIMEOUT;
+    
+    while (!ata_dma_done(channel)) {
+        if (timer_get_uptime_ms() > deadline) {
+            return false;
+        }
+        
+        wait_event_timeout(&channel->wait, ata_dma_cond, channel, ATA_POLL_MS);
+    }
+    
+    return true;
+}
+
+// Program the bus master engine and issue one DMA command, false if DMA cannot be used
+static bool ata_dma_issue(uint8_t drive_index, uint64_t lba, uint32_t count,
+                          const ata_cursor_t *cursor, bool write, bool *io_error) {
+    ata_dma_channel_t *channel = &dma_channels[drive_index < 2 ? 0 : 1];
+    uint16_t status_cmd = ata_get_data_port(drive_index) + 7;
+    
+    *io_error = false;
+    
+    channel->dma_cursor = *cursor;
+    if (!ata_dma_build_prdt(channel, &channel->dma_cursor, count)) {
+        return false;
+    }
     
     // Wait for drive to be ready
     if (!ata_wait_not_busy(status_cmd, ATA_TIMEOUT)) {
-        LOG_ERROR("Drive %d not ready for write operation", drive_index);
+        LOG_ERROR("Drive %d not ready for DMA", drive_index);
+        *io_error = true;
         return false;
     }
     
-    // Select drive and set up LBA
-    uint8_t drive_select = is_master ? ATA_DEVICE_MASTER : ATA_DEVICE_SLAVE;
-    outb(drive_head, drive_select | ATA_DEVICE_LBA | ((lba >> 24) & 0x0F));
+    // Program the bus master engine
+    outb(channel->bmide + BM_COMMAND, 0);
+    outl(channel->bmide + BM_PRDT, (uint32_t)channel->prdt_phys);
+    outb(channel->bmide + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+    outb(channel->bmide + BM_COMMAND, write ? 0 : BM_CMD_READ);
     
-    // Set up other registers
-    outb(features, 0);                  // No features
-    outb(sector_count, count);          // Number of sectors
-    outb(lba_low, lba & 0xFF);          // LBA low byte
-    outb(lba_mid, (lba >> 8) & 0xFF);   // LBA middle byte
-    outb(lba_high, (lba >> 16) & 0xFF); // LBA high byte
+    channel->irq_fired = false;
+    channel->bm_status = 0;
     
-    // Send write command
-    outb(status_cmd, ATA_CMD_WRITE_PIO);
+    if (ata_setup_lba(drive_index, lba, count)) {
+        outb(status_cmd, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    } else {
+        outb(status_cmd, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    }
     
-    // Write the data
-    const uint16_t* buf = (const uint16_t*)buffer;
+    // Start the transfer
+    outb(channel->bmide + BM_COMMAND, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    return true;
+}
+
+// Stop the engine after a DMA command and check how it ended
+static bool ata_dma_finish(uint8_t drive_index, bool write, bool completed) {
+    ata_dma_channel_t *channel = &dma_channels[drive_index < 2 ? 0 : 1];
+    uint16_t status_cmd = ata_get_data_port(drive_index) + 7;
+    
+    outb(channel->bmide + BM_COMMAND, 0);
+    uint8_t bm_status = channel->bm_status | inb(channel->bmide + BM_STATUS);
+    uint8_t ata_status = inb(status_cmd);
+    outb(channel->bmide + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+    
+    if (!completed || (bm_status & BM_STATUS_ERR) || (ata_status & (ATA_STATUS_ERR | ATA_STATUS_DF))) {
+        LOG_ERROR("Drive %d DMA %s failed: BM=0x%X, Status=0x%X%s", drive_index,
+                  write ? "write" : "read", bm_status, ata_status, completed ? "" : " (timeout)");
+        return false;
+    }
     
-    for (int sector = 0; sector < count; sector++) {
-        // Wait for drive to be ready to accept data
-        if (!ata_wait_drq(status_cmd, ATA_TIMEOUT)) {
-            LOG_ERROR("Drive %d timeout waiting for data ready flag", drive_index);
-            return false;
+    return true;
+}
+
+// Issue one bus master DMA command and wait for it, returns false with the cursor untouched if DMA cannot be used
+static bool ata_dma_command(uint8_t drive_index, uint64_t lba, uint32_t count,
+                            ata_cursor_t *cursor, bool write, bool *io_error) {
+    ata_dma_channel_t *channel = &dma_channels[drive_index < 2 ? 0 : 1];
+    
+    if (!ata_dma_issue(drive_index, lba, count, cursor, write, io_error)) {
+        return false;
+    }
+    
+    bool completed = ata_dma_wait(channel);
+    if (!ata_dma_finish(drive_index, write, completed)) {
+        *io_error = true;
+        return false;
+    }
+    
+    *cursor = channel->dma_cursor;
+    return true;
+}
+
+// Sectors per DMA command for a drive
+static uint32_t ata_dma_max_count(uint8_t drive_index) {
+    return detected_drives[drive_index].lba48 ? ATA_DMA_MAX_SECTORS : ATA_MAX_SECTORS_LBA28;
+}
+
+// End the channel's batch and report it to the block layer
+static void ata_async_finish(ata_dma_channel_t *channel, bool ok) {
+    block_device_t *dev = channel->blockdev;
+    channel->blockdev = NULL;
+    block_complete(dev, ok);
+}
+
+// Issue the batch's next DMA command, doing PIO in place for memory the engine cannot reach
+static void ata_async_advance(ata_dma_channel_t *channel) {
+    while (true) {
+        // Move on to the next command of the batch
+        while (channel->remaining == 0) {
+            if (++channel->command_index >= channel->command_count) {
+                ata_async_finish(channel, true);
+                return;
+            }
+            
+            const block_command_t *cmd = &channel->commands[channel->command_index];
+            channel->cursor = (ata_cursor_t){ cmd->segments, cmd->segment_count, 0, 0 };
+            channel->lba = cmd->sector;
+            channel->remaining = cmd->count;
+        }
+        
+        uint32_t max_count = ata_dma_max_count(channel->drive);
+        channel->chunk = channel->remaining > max_count ? max_count : channel->remaining;
+        
+        bool io_error = false;
+        if (ata_dma_issue(channel->drive, channel->lba, channel->chunk, &channel->cursor,
+                          channel->write, &io_error)) {
+            channel->deadline = timer_get_uptime_ms() + ATA_TIMEOUT;
+            return;
+        }
+        
+        if (io_error || !ata_pio_command(channel->drive, channel->lba, channel->chunk,
+                                         &channel->cursor, channel->write)) {
+            ata_async_finish(channel, false);
+            return;
         }
         
-        // Write 256 words (512 bytes) per sector
-        for (int i = 0; i < 256; i++) {
-            outw(data_port, buf[sector * 256 + i]);
+        channel->lba += channel->chunk;
+        channel->remaining -= channel->chunk;
+    }
+}
+
+// Handle a finished (or timed out) DMA command of the channel's batch
+static void ata_async_progress(ata_dma_channel_t *channel) {
+    bool done = ata_dma_done(channel);
+    if (!done && timer_get_uptime_ms() <= channel->deadline) {
+        return;
+    }
+    
+    if (ata_dma_finish(channel->drive, channel->write, done)) {
+        channel->cursor = channel->dma_cursor;
+    } else {
+        // Retry the command with PIO, like the synchronous path
+        LOG_WARN("Drive %d: retrying with PIO", channel->drive);
+        if (!ata_pio_command(channel->drive, channel->lba, channel->chunk,
+                             &channel->cursor, channel->write)) {
+            ata_async_finish(channel, false);
+            return;
+        }
+    }
+    
+    channel->lba += channel->chunk;
+    channel->remaining -= channel->chunk;
+    ata_async_advance(channel);
+}
+
+// Wait condition of a drain
+static bool ata_channel_idle(void *arg) {
+    return ((ata_dma_channel_t *)arg)->blockdev == NULL;
+}
+
+// Wait for a queued batch on the channel to finish before using it directly
+static void ata_channel_drain(ata_dma_channel_t *channel) {
+    while (channel->blockdev) {
+        uint64_t flags = cpu_irq_save();
+        if (channel->blockdev) {
+            ata_async_progress(channel);
         }
+        cpu_irq_restore(flags);
         
-        // Flush the write
-        outb(status_cmd, ATA_CMD_CACHE_FLUSH);
+        wait_event_timeout(&channel->wait, ata_channel_idle, channel, ATA_POLL_MS);
+    }
+}
+
+// Transfer a run of consecutive sectors to or from a list of memory segments
+bool ata_transfer(uint8_t drive_index, uint64_t lba, const block_segment_t *segments, size_t segment_count, bool write) {
+    if (!ata_drive_present(drive_index) || !segments || segment_count == 0) {
+        return false;
+    }
+    
+    const ata_drive_t *drive = &detected_drives[drive_index];
+    
+    // A queued batch may own the channel
+    ata_channel_drain(&dma_channels[drive_index < 2 ? 0 : 1]);
+    
+    uint64_t total = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        if (!segments[i].buffer) {
+            return false;
+        }
+        total += segments[i].sectors;
+    }
+    
+    if (total == 0) {
+        return false;
+    }
+    
+    if (!drive->lba48 && lba + total > ATA_LBA28_LIMIT) {
+        LOG_ERROR("Drive %d: LBA 0x%llX beyond 28-bit range", drive_index, lba + total - 1);
+        return false;
+    }
+    
+    uint32_t max_count = drive->lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+    ata_cursor_t cursor = { segments, segment_count, 0, 0 };
+    
+    bool use_dma = drive->dma && dma_channels[drive_index < 2 ? 0 : 1].bmide;
+    if (use_dma) {
+        max_count = ata_dma_max_count(drive_index);
+    }
+    
+    // One command per max_count sectors, regardless of how the memory is split
+    while (total > 0) {
+        uint32_t count = total > max_count ? max_count : (uint32_t)total;
         
-        // Wait for write to complete
-        if (!ata_wait_not_busy(status_cmd, ATA_TIMEOUT)) {
-            LOG_ERROR("Drive %d timeout waiting for write to complete", drive_index);
+        // Bus master DMA first; PIO for memory the engine cannot reach or after an error
+        bool io_error = false;
+        if (!use_dma || !ata_dma_command(drive_index, lba, count, &cursor, write, &io_error)) {
+            if (io_error) {
+                LOG_WARN("Drive %d: retrying with PIO", drive_index);
+            }
+            if (!ata_pio_command(drive_index, lba, count, &cursor, write)) {
+                return false;
+            }
+        }
+        lba += count;
+        total -= count;
+    }
+    
+    return true;
+}
+
+// Block layer entry point: run a batch of merged commands one after another
+static bool ata_block_transfer(block_device_t *dev, const block_command_t *commands, size_t count, bool write) {
+    uint8_t drive_index = (uint8_t)(uintptr_t)dev->driver_data;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (!ata_transfer(drive_index, commands[i].sector, commands[i].segments,
+                          commands[i].segment_count, write)) {
             return false;
         }
     }
@@ -653,12 +1158,100 @@ bool ata_write_sectors(uint8_t drive_index, uint32_t lba, uint8_t count, const v
     return true;
 }
 
+// Block layer async entry point: start the batch, the channel IRQ carries it on
+static bool ata_block_start(block_device_t *dev, const block_command_t *commands, size_t count, bool write) {
+    uint8_t drive_index = (uint8_t)(uintptr_t)dev->driver_data;
+    ata_dma_channel_t *channel = &dma_channels[drive_index < 2 ? 0 : 1];
+    
+    // The other drive on the channel may still be running a batch
+    if (!detected_drives[drive_index].dma || !channel->bmide || channel->blockdev) {
+        return false;
+    }
+    
+    channel->blockdev = dev;
+    channel->commands = commands;
+    channel->command_count = count;
+    channel->command_index = 0;
+    channel->cursor = (ata_cursor_t){ commands[0].segments, commands[0].segment_count, 0, 0 };
+    channel->lba = commands[0].sector;
+    channel->remaining = commands[0].count;
+    channel->drive = drive_index;
+    channel->write = write;
+    
+    ata_async_advance(channel);
+    return true;
+}
+
+// Block layer poll hook, catches missed interrupts and timeouts
+static void ata_block_poll(block_device_t *dev) {
+    uint8_t drive_index = (uint8_t)(uintptr_t)dev->driver_data;
+    ata_dma_channel_t *channel = &dma_channels[drive_index < 2 ? 0 : 1];
+    
+    if (channel->blockdev == dev) {
+        ata_async_progress(channel);
+    }
+}
+
+// Block layer flush hook
+static bool ata_block_flush(block_device_t *dev) {
+    return ata_flush_cache((uint8_t)(uintptr_t)dev->driver_data);
+}
+
+// Expose a detected drive through the block layer
+static void ata_register_block_device(int drive_idx) {
+    block_device_t dev;
+    memset(&dev, 0, sizeof(dev));
+    
+    snprintf(dev.name, sizeof(dev.name), "ata%d", drive_idx);
+    dev.sectors = detected_drives[drive_idx].size;
+    dev.max_sectors = detected_drives[drive_idx].lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+    dev.max_segments = BLOCK_MAX_SEGMENTS;
+    dev.driver_data = (void*)(uintptr_t)drive_idx;
+    dev.transfer = ata_block_transfer;
+    dev.flush = ata_block_flush;
+    
+    // DMA drives complete on IRQ 14/15, so submitters can sleep
+    if (detected_drives[drive_idx].dma && dma_channels[drive_idx < 2 ? 0 : 1].bmide) {
+        dev.interrupts = true;
+        dev.start = ata_block_start;
+        dev.poll = ata_block_poll;
+    }
+    
+    if (block_register_device(&dev) < 0) {
+        LOG_WARN("ATA drive %d: block device table full", drive_idx);
+    }
+}
+
+// Read sectors from a drive
+bool ata_read_sectors(uint8_t drive_index, uint64_t lba, uint32_t count, void* buffer) {
+    if (buffer == NULL || count == 0) {
+        return false;
+    }
+    
+    TRACE(TRACE_ATA_READ, lba, count);
+    block_segment_t segment = { buffer, count };
+    return ata_transfer(drive_index, lba, &segment, 1, false);
+}
+
+// Write sectors to a drive
+bool ata_write_sectors(uint8_t drive_index, uint64_t lba, uint32_t count, const void* buffer) {
+    if (buffer == NULL || count == 0) {
+        return false;
+    }
+    
+    TRACE(TRACE_ATA_WRITE, lba, count);
+    block_segment_t segment = { (void*)buffer, count };
+    return ata_transfer(drive_index, lba, &segment, 1, true);
+}
+
 // Flush drive cache to ensure writes are completed
 bool ata_flush_cache(uint8_t drive_index) {
     if (!ata_drive_present(drive_index)) {
         return false;
     }
     
+    ata_channel_drain(&dma_channels[drive_index < 2 ? 0 : 1]);
+    
     // Get ports for this drive
     uint16_t data_port = ata_get_data_port(drive_index);
     uint16_t control_port = ata_get_control_port(drive_index);
@@ -679,7 +1272,7 @@ bool ata_flush_cache(uint8_t drive_index) {
     outb(drive_head, drive_select | ATA_DEVICE_LBA);
     
     // Send cache flush command
-    outb(status_cmd, ATA_CMD_CACHE_FLUSH);
+    outb(status_cmd, detected_drives[drive_index].lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
     
     // Wait for flush to complete
     if (!ata_wait_not_busy(status_cmd, ATA_TIMEOUT)) {
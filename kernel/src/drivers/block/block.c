@@ -0,0 +1,515 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/block/block.h>
+#include <drivers/timer/timer.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/wait.h>
+#include <core/cpu.h>
+#include <memory/slab.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Per-drive request queue
+typedef struct {
+    block_io_t *pending;                            // Waiting requests, sorted by sector
+    uint64_t head;                                  // Sector after the last dispatched batch
+    bool busy;                                      // A batch is with the driver
+    bool in_start;                                  // The driver's start hook is running
+    bool inline_done;                               // The batch completed inside start
+    bool inline_ok;
+    bool batch_write;
+    size_t batch_count;
+    block_io_t *batch[BLOCK_QUEUE_BATCH];
+    block_request_t requests[BLOCK_QUEUE_BATCH];
+    block_command_t commands[BLOCK_QUEUE_BATCH * 2];    // A request tops up at most one command
+    block_segment_t segments[BLOCK_QUEUE_BATCH * 2];
+    size_t command_count;
+    spinlock_t lock;
+} block_queue_t;
+
+// A synchronous submitter waiting for its requests
+typedef struct {
+    volatile size_t remaining;
+    volatile bool failed;
+    wait_queue_t queue;                             // The submitter sleeps here
+} block_wait_t;
+
+// Registered devices
+static block_device_t devices[BLOCK_MAX_DEVICES];
+static block_queue_t queues[BLOCK_MAX_DEVICES];
+static int device_count = 0;
+static spinlock_t register_lock;        // Drivers probing on several CPUs register at once
+
+// Statistics
+static size_t stat_requests = 0;
+static size_t stat_commands = 0;
+static size_t stat_batches = 0;
+static size_t stat_sleeps = 0;
+static size_t stat_sectors_read = 0;
+static size_t stat_sectors_written = 0;
+
+static void run_queue(uint8_t drive);
+
+// Register a device, returns its drive number or -1
+int block_register_device(const block_device_t *device) {
+    if (!device || (!device->transfer && !device->start)) {
+        return -1;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&register_lock);
+    if (device_count >= BLOCK_MAX_DEVICES) {
+        spinlock_release(&register_lock);
+        cpu_irq_restore(flags);
+        return -1;
+    }
+
+    int drive = device_count;
+    devices[drive] = *device;
+    if (devices[drive].max_sectors == 0) devices[drive].max_sectors = 256;
+    if (devices[drive].max_segments == 0 || devices[drive].max_segments > BLOCK_MAX_SEGMENTS) {
+        devices[drive].max_segments = BLOCK_MAX_SEGMENTS;
+    }
+
+    memset(&queues[drive], 0, sizeof(block_queue_t));
+    spinlock_init(&queues[drive].lock);
+
+    // The drive number only becomes valid once the device behind it is filled in
+    __atomic_store_n(&device_count, drive + 1, __ATOMIC_RELEASE);
+    spinlock_release(&register_lock);
+    cpu_irq_restore(flags);
+
+    LOG_INFO("Block device %d: %s (%u MB)", drive, devices[drive].name,
+             (uint32_t)(devices[drive].sectors / 2048));
+    return drive;
+}
+
+// Check if a drive number refers to a registered device
+bool block_device_present(uint8_t drive) {
+    return drive < device_count;
+}
+
+// Get a registered device
+block_device_t *block_get_device(uint8_t drive) {
+    return drive < device_count ? &devices[drive] : NULL;
+}
+
+// Merge sorted requests into commands, returns the number of commands built
+static size_t build_commands(block_device_t *dev, const block_request_t *requests, size_t count,
+                             block_command_t *commands, block_segment_t *segments) {
+    size_t command_count = 0;
+    size_t segment_count = 0;
+    block_command_t *cmd = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        const block_request_t *req = &requests[i];
+        if (req->count == 0 || !req->buffer) {
+            continue;
+        }
+
+        uint64_t sector = req->sector;
+        uint32_t remaining = req->count;
+        uint8_t *buffer = (uint8_t*)req->buffer;
+
+        while (remaining > 0) {
+            // Start a new command when the request is not adjacent or the command is full
+            if (!cmd || sector != cmd->sector + cmd->count ||
+                cmd->count == dev->max_sectors ||
+                cmd->segment_count == dev->max_segments) {
+                cmd = &commands[command_count++];
+                cmd->sector = sector;
+                cmd->count = 0;
+                cmd->segments = &segments[segment_count];
+                cmd->segment_count = 0;
+            }
+
+            uint32_t chunk = dev->max_sectors - cmd->count;
+            if (chunk > remaining) chunk = remaining;
+
+            // Requests whose buffers are contiguous share one segment
+            block_segment_t *last = cmd->segment_count > 0 ? &segments[segment_count - 1] : NULL;
+            if (last && (uint8_t*)last->buffer + (size_t)last->sectors * BLOCK_SECTOR_SIZE == buffer) {
+                last->sectors += chunk;
+            } else {
+                segments[segment_count].buffer = buffer;
+                segments[segment_count].sectors = chunk;
+                segment_count++;
+                cmd->segment_count++;
+            }
+
+            cmd->count += chunk;
+            sector += chunk;
+            buffer += (size_t)chunk * BLOCK_SECTOR_SIZE;
+            remaining -= chunk;
+        }
+    }
+
+    return command_count;
+}
+
+// Insert a request in sector order behind any equal ones, queue lock must be held
+static void enqueue(block_queue_t *queue, block_io_t *io) {
+    block_io_t **link = &queue->pending;
+    while (*link && (*link)->sector <= io->sector) {
+        link = &(*link)->next;
+    }
+    io->next = *link;
+    *link = io;
+}
+
+// Pick where the next batch starts: an expired request, else the elevator's next stop
+static block_io_t **pick_start(block_queue_t *queue) {
+    uint64_t now = timer_get_uptime_ms();
+    block_io_t **oldest = NULL;
+    block_io_t **sweep = NULL;
+
+    for (block_io_t **link = &queue->pending; *link; link = &(*link)->next) {
+        if ((*link)->deadline <= now && (!oldest || (*link)->deadline < (*oldest)->deadline)) {
+            oldest = link;
+        }
+        if (!sweep && (*link)->sector >= queue->head) {
+            sweep = link;
+        }
+    }
+
+    if (oldest) return oldest;
+    if (sweep) return sweep;
+
+    // Nothing ahead of the head, wrap around to the lowest sector
+    return &queue->pending;
+}
+
+// Move the next batch from the pending list into the queue, queue lock must be held
+static void take_batch(block_device_t *dev, block_queue_t *queue) {
+    block_io_t **link = pick_start(queue);
+    bool write = (*link)->write;
+    size_t count = 0;
+
+    // Requests ahead in sector order going the same direction join the batch
+    while (*link && count < BLOCK_QUEUE_BATCH) {
+        block_io_t *io = *link;
+        if (io->write != write) {
+            link = &io->next;
+            continue;
+        }
+
+        *link = io->next;
+        io->next = NULL;
+        queue->batch[count] = io;
+        queue->requests[count].sector = io->sector;
+        queue->requests[count].count = io->count;
+        queue->requests[count].buffer = io->buffer;
+        count++;
+    }
+
+    queue->batch_count = count;
+    queue->batch_write = write;
+    queue->head = queue->requests[count - 1].sector + queue->requests[count - 1].count;
+    queue->command_count = build_commands(dev, queue->requests, count, queue->commands, queue->segments);
+    queue->busy = true;
+
+    stat_batches++;
+    stat_commands += queue->command_count;
+    for (size_t i = 0; i < count; i++) {
+        if (write) {
+            stat_sectors_written += queue->requests[i].count;
+        } else {
+            stat_sectors_read += queue->requests[i].count;
+        }
+    }
+}
+
+// Complete the batch in flight and let the queue move on
+static void finish_batch(block_queue_t *queue, bool ok) {
+    // The queue stays busy until every callback has run, so the batch array is stable
+    for (size_t i = 0; i < queue->batch_count; i++) {
+        block_io_t *io = queue->batch[i];
+        if (io->done) {
+            io->done(io, ok);
+        }
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&queue->lock);
+    queue->batch_count = 0;
+    queue->busy = false;
+    spinlock_release(&queue->lock);
+    cpu_irq_restore(flags);
+}
+
+// Hand batches to the driver until one is left running asynchronously or the queue is empty
+static void run_queue(uint8_t drive) {
+    block_device_t *dev = &devices[drive];
+    block_queue_t *queue = &queues[drive];
+
+    while (true) {
+        uint64_t flags = cpu_irq_save();
+        spinlock_acquire(&queue->lock);
+        if (queue->busy || !queue->pending) {
+            spinlock_release(&queue->lock);
+            cpu_irq_restore(flags);
+            return;
+        }
+        take_batch(dev, queue);
+        spinlock_release(&queue->lock);
+
+        // Interrupts stay off while starting so a completion cannot race the bookkeeping
+        bool started = false;
+        bool done_inline = false;
+        bool ok_inline = false;
+        if (dev->start && queue->command_count > 0) {
+            queue->in_start = true;
+            queue->inline_done = false;
+            started = dev->start(dev, queue->commands, queue->command_count, queue->batch_write);
+            queue->in_start = false;
+            done_inline = queue->inline_done;
+            ok_inline = queue->inline_ok;
+        }
+        cpu_irq_restore(flags);
+
+        // The interrupt handler completes the batch and keeps the queue going
+        if (started && !done_inline) {
+            return;
+        }
+
+        bool ok;
+        if (started) {
+            ok = ok_inline;
+        } else if (queue->command_count == 0) {
+            ok = true;
+        } else if (dev->transfer) {
+            ok = dev->transfer(dev, queue->commands, queue->command_count, queue->batch_write);
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            LOG_ERROR("Block: %s batch on drive %u failed", queue->batch_write ? "write" : "read", drive);
+        }
+        finish_batch(queue, ok);
+    }
+}
+
+// Report the end of a started batch
+void block_complete(block_device_t *dev, bool ok) {
+    if (!dev || dev < devices || dev >= devices + device_count) {
+        return;
+    }
+
+    uint8_t drive = (uint8_t)(dev - devices);
+    block_queue_t *queue = &queues[drive];
+
+    // Finished before start returned, run_queue picks it up
+    if (queue->in_start) {
+        queue->inline_done = true;
+        queue->inline_ok = ok;
+        return;
+    }
+
+    if (!ok) {
+        LOG_ERROR("Block: %s batch on drive %u failed", queue->batch_write ? "write" : "read", drive);
+    }
+    finish_batch(queue, ok);
+    run_queue(drive);
+}
+
+// Queue a request without waiting, its callback runs when the drive finishes it
+bool block_queue_io(uint8_t drive, block_io_t *io) {
+    block_device_t *dev = block_get_device(drive);
+    if (!dev || !io || !io->buffer || io->count == 0 || io->count > dev->max_sectors) {
+        return false;
+    }
+
+    block_queue_t *queue = &queues[drive];
+    io->deadline = timer_get_uptime_ms() + BLOCK_DEADLINE_MS;
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&queue->lock);
+    enqueue(queue, io);
+    stat_requests++;
+    spinlock_release(&queue->lock);
+    cpu_irq_restore(flags);
+
+    run_queue(drive);
+    return true;
+}
+
+// Completion callback of synchronous submissions
+static void wait_done(block_io_t *io, bool ok) {
+    block_wait_t *wait = io->private;
+
+    if (!ok) {
+        wait->failed = true;
+    }
+    if (--wait->remaining == 0) {
+        wait_wake_all(&wait->queue);
+    }
+}
+
+// Wait condition of a submission
+static bool wait_complete(void *arg) {
+    block_wait_t *wait = arg;
+    return wait->remaining == 0;
+}
+
+// Sleep until every request of a submission has completed
+static void wait_for(block_device_t *dev, block_wait_t *wait) {
+    while (wait->remaining > 0) {
+        // Catch completions whose interrupt was missed, and timeouts
+        if (dev->poll) {
+            uint64_t flags = cpu_irq_save();
+            dev->poll(dev);
+            cpu_irq_restore(flags);
+        }
+
+        // The completion interrupt wakes us early, polled devices are checked every slice
+        stat_sleeps++;
+        wait_event_timeout(&wait->queue, wait_complete, wait,
+                           dev->interrupts ? BLOCK_POLL_MS : 1);
+    }
+}
+
+// Submit a batch of reads or writes and wait for it, adjacent requests are merged into single commands
+bool block_submit(uint8_t drive, block_request_t *requests, size_t count, bool write) {
+    block_device_t *dev = block_get_device(drive);
+    if (!dev || !requests || count == 0) {
+        return false;
+    }
+
+    // Requests are queued in pieces the driver can take in one command
+    size_t io_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].count > 0 && requests[i].buffer) {
+            io_count += (requests[i].count + dev->max_sectors - 1) / dev->max_sectors;
+        }
+    }
+    if (io_count == 0) {
+        return true;
+    }
+
+    block_io_t stack_ios[BLOCK_STACK_BATCH];
+    block_io_t *ios = stack_ios;
+    if (io_count > BLOCK_STACK_BATCH) {
+        ios = kmalloc(io_count * sizeof(block_io_t));
+        if (!ios) {
+            LOG_ERROR("Block: no memory for a batch of %u requests", (uint32_t)count);
+            return false;
+        }
+    }
+
+    // Only a scheduled task sleeps, early boot code polls instead
+    block_wait_t wait = { .remaining = io_count, .failed = false };
+    wait_queue_init(&wait.queue);
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t sector = requests[i].sector;
+        uint32_t remaining = requests[i].buffer ? requests[i].count : 0;
+        uint8_t *buffer = requests[i].buffer;
+
+        while (remaining > 0) {
+            uint32_t chunk = remaining > dev->max_sectors ? dev->max_sectors : remaining;
+            ios[n].sector = sector;
+            ios[n].count = chunk;
+            ios[n].buffer = buffer;
+            ios[n].write = write;
+            ios[n].done = wait_done;
+            ios[n].private = &wait;
+            ios[n].next = NULL;
+            n++;
+
+            sector += chunk;
+            buffer += (size_t)chunk * BLOCK_SECTOR_SIZE;
+            remaining -= chunk;
+        }
+    }
+
+    // Queue everything before dispatching so the elevator sees the whole batch
+    block_queue_t *queue = &queues[drive];
+    uint64_t deadline = timer_get_uptime_ms() + BLOCK_DEADLINE_MS;
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&queue->lock);
+    for (size_t i = 0; i < n; i++) {
+        ios[i].deadline = deadline;
+        enqueue(queue, &ios[i]);
+    }
+    stat_requests += n;
+    spinlock_release(&queue->lock);
+    cpu_irq_restore(flags);
+
+    run_queue(drive);
+    wait_for(dev, &wait);
+
+    if (ios != stack_ios) {
+        kfree(ios);
+    }
+    return !wait.failed;
+}
+
+// Read consecutive sectors into one buffer
+bool block_read(uint8_t drive, uint64_t sector, uint32_t count, void *buffer) {
+    block_request_t req = { sector, count, buffer };
+    return block_submit(drive, &req, 1, false);
+}
+
+// Write consecutive sectors from one buffer
+bool block_write(uint8_t drive, uint64_t sector, uint32_t count, const void *buffer) {
+    block_request_t req = { sector, count, (void*)buffer };
+    return block_submit(drive, &req, 1, true);
+}
+
+// Flush the drive's write cache once everything queued has reached the drive
+bool block_flush(uint8_t drive) {
+    block_device_t *dev = block_get_device(drive);
+    if (!dev) {
+        return false;
+    }
+
+    block_queue_t *queue = &queues[drive];
+    while (true) {
+        uint64_t flags = cpu_irq_save();
+        if (dev->poll) {
+            dev->poll(dev);
+        }
+
+        if (!queue->busy && !queue->pending) {
+            cpu_irq_restore(flags);
+            break;
+        }
+
+        if (flags & CPU_RFLAGS_IF) {
+            __asm__ volatile("sti; hlt" : : : "memory");
+        } else {
+            __asm__ volatile("pause");
+        }
+    }
+
+    return !dev->flush || dev->flush(dev);
+}
+
+// Get block layer statistics
+void block_get_stats(block_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->requests = stat_requests;
+    stats->commands = stat_commands;
+    stats->batches = stat_batches;
+    stats->sleeps = stat_sleeps;
+    stats->sectors_read = stat_sectors_read;
+    stats->sectors_written = stat_sectors_written;
+}
+
+// Print registered devices and block layer statistics
+void block_print_stats(void) {
+    LOG_INFO("Block Layer Statistics:");
+    for (int i = 0; i < device_count; i++) {
+        LOG_INFO("  Drive %d: %s, %u MB, %u sectors/command, %s", i, devices[i].name,
+                 (uint32_t)(devices[i].sectors / 2048), devices[i].max_sectors,
+                 devices[i].start ? "interrupt driven" : "synchronous");
+    }
+    LOG_INFO("  Requests: %d, Batches: %d, Commands: %d", stat_requests, stat_batches, stat_commands);
+    LOG_INFO("  Sectors read: %d, Sectors written: %d", stat_sectors_read, stat_sectors_written);
+    LOG_INFO("  Submitter sleeps: %d", stat_sleeps);
+}
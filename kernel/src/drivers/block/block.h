@@ -0,0 +1,116 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BLOCK_SECTOR_SIZE   512
+#define BLOCK_MAX_DEVICES   16
+#define BLOCK_MAX_SEGMENTS  128     // Memory segments merged into one command
+#define BLOCK_STACK_BATCH   16      // Batches up to this size need no allocation
+#define BLOCK_QUEUE_BATCH   32      // Queued requests handed to a driver at once
+#define BLOCK_DEADLINE_MS   500     // Requests waiting this long are served before the elevator order
+#define BLOCK_POLL_MS       10      // Submitters recheck interrupt-driven devices this often
+
+// A run of sectors to transfer to or from one buffer
+typedef struct {
+    uint64_t sector;                // First sector on the drive
+    uint32_t count;                 // Number of sectors
+    void *buffer;                   // count * BLOCK_SECTOR_SIZE bytes
+} block_request_t;
+
+// One contiguous piece of memory in a command
+typedef struct {
+    void *buffer;
+    uint32_t sectors;
+} block_segment_t;
+
+// A merged run of consecutive sectors handed to a driver
+typedef struct {
+    uint64_t sector;
+    uint32_t count;
+    const block_segment_t *segments;
+    size_t segment_count;
+} block_command_t;
+
+// Queued request, completed through its callback
+typedef struct block_io {
+    uint64_t sector;
+    uint32_t count;                 // At most the device's max_sectors
+    void *buffer;
+    bool write;
+    void (*done)(struct block_io *io, bool ok);    // May run in interrupt context
+    void *private;                  // For the submitter
+    uint64_t deadline;              // Set when queued
+    struct block_io *next;
+} block_io_t;
+
+// Block device registered by a driver
+typedef struct block_device {
+    char name[16];
+    uint64_t sectors;               // Capacity
+    uint32_t max_sectors;           // Per command
+    uint32_t max_segments;          // Per command
+    bool interrupts;                // Completions arrive by interrupt, submitters may sleep
+    void *driver_data;
+
+    // Execute a batch of commands in one direction, drivers may run them concurrently
+    bool (*transfer)(struct block_device *dev, const block_command_t *commands, size_t count, bool write);
+
+    // Start a batch and return, the driver reports its end with block_complete (optional,
+    // returning false falls back to transfer)
+    bool (*start)(struct block_device *dev, const block_command_t *commands, size_t count, bool write);
+
+    // Check a started batch for completion or timeout without waiting for the interrupt (optional)
+    void (*poll)(struct block_device *dev);
+
+    // Flush the device's write cache
+    bool (*flush)(struct block_device *dev);
+} block_device_t;
+
+// Block layer statistics
+typedef struct {
+    size_t requests;                // Requests submitted by callers
+    size_t commands;                // Commands issued after merging
+    size_t batches;                 // Batches dispatched from the queues
+    size_t sleeps;                  // Times a submitter slept waiting for an interrupt
+    size_t sectors_read;
+    size_t sectors_written;
+} block_stats_t;
+
+// Register a device, returns its drive number or -1
+int block_register_device(const block_device_t *device);
+
+// Check if a drive number refers to a registered device
+bool block_device_present(uint8_t drive);
+
+// Get a registered device
+block_device_t *block_get_device(uint8_t drive);
+
+// Queue a request without waiting, its callback runs when the drive finishes it
+bool block_queue_io(uint8_t drive, block_io_t *io);
+
+// Report the end of a started batch (called by drivers, usually from their interrupt handler)
+void block_complete(block_device_t *dev, bool ok);
+
+// Submit a batch of reads or writes and wait for it, adjacent requests are merged into
+// single commands
+bool block_submit(uint8_t drive, block_request_t *requests, size_t count, bool write);
+
+// Read consecutive sectors into one buffer
+bool block_read(uint8_t drive, uint64_t sector, uint32_t count, void *buffer);
+
+// Write consecutive sectors from one buffer
+bool block_write(uint8_t drive, uint64_t sector, uint32_t count, const void *buffer);
+
+// Flush the drive's write cache
+bool block_flush(uint8_t drive);
+
+// Get block layer statistics
+void block_get_stats(block_stats_t *stats);
+
+// Print registered devices and block layer statistics
+void block_print_stats(void);
+
+#endif // BLOCK_H
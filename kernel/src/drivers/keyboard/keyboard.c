@@ -1,5 +1,6 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/keyboard/keyboard.h>
-#include <drivers/pic/pic.h>
 #include <core/idt.h>
 #include <lib/io.h>
 #include <utils/log.h>
@@ -225,7 +226,7 @@ void keyboard_init(void) {
     idt_register_handler(IRQ_KEYBOARD, keyboard_interrupt_handler);
     
     // Unmask the keyboard IRQ
-    pic_unmask_irq(1);
+    irq_unmask(1);
     
     LOG_INFO_MSG("Keyboard initialized");
 }
@@ -1,7 +1,8 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/mouse/mouse.h>
 #include <lib/io.h>
 #include <core/idt.h>
-#include <drivers/pic/pic.h>
 #include <utils/log.h>
 #include <stddef.h>
 
@@ -179,7 +180,7 @@ void mouse_init(void) {
     idt_register_handler(IRQ_MOUSE, mouse_interrupt_handler);
     
     // Unmask the mouse IRQ
-    pic_unmask_irq(12);
+    irq_unmask(12);
     
     LOG_INFO_MSG("PS/2 Mouse initialized");
 }
@@ -0,0 +1,913 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
+#include <drivers/nvme/nvme.h>
+#include <drivers/block/block.h>
+#include <drivers/pci/pci.h>
+#include <drivers/timer/timer.h>
+#include <drivers/apic/lapic.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <core/smp.h>
+#include <core/exec/wait.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <memory/slab.h>
+#include <lib/string.h>
+#include <lib/stdio.h>
+#include <utils/log.h>
+
+#define NVME_PAGE_SIZE          4096
+#define NVME_PRP_LIST_BYTES     (NVME_PRP_LIST_ENTRIES * sizeof(uint64_t))
+#define NVME_PRP_PAGES          ((NVME_QUEUE_DEPTH * NVME_PRP_LIST_BYTES + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE)
+#define NVME_STATUS(status)     ((status) >> 1)     // Status field without the phase tag
+
+struct nvme_namespace;
+
+// Waiter of a synchronous command
+typedef struct {
+    completion_t done;
+    volatile uint16_t status;
+} nvme_sync_t;
+
+// What a command ID in flight belongs to, neither for orphans of a timed out batch
+typedef struct {
+    struct nvme_namespace *ns;      // A batch command
+    nvme_sync_t *sync;              // Or a synchronous one
+} nvme_request_t;
+
+// Submission and completion queue pair
+typedef struct {
+    uint16_t id;
+    uint16_t depth;
+    nvme_command_t *sq;
+    uint64_t sq_phys;
+    uint16_t sq_tail;
+    volatile nvme_completion_t *cq;
+    uint64_t cq_phys;
+    uint16_t cq_head;
+    uint16_t phase;                 // Phase tag of new completions, flips on wrap
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint64_t free_cids;             // Bit per command ID not in flight
+    nvme_request_t requests[NVME_QUEUE_DEPTH];
+    uint64_t *prp_lists;            // NVME_PRP_LIST_ENTRIES per command ID
+    uint64_t prp_lists_phys;
+    uint32_t cpu;                   // Where the completion interrupt goes
+
+    // Only the owning CPU touches a queue, with interrupts off, and needs no lock. A queue
+    // several CPUs submit to, or any of them may poll, takes this one.
+    volatile bool shared;
+    spinlock_t lock;
+
+    size_t commands;
+    size_t interrupts;
+} nvme_queue_t;
+
+// Namespace registered as a block device, with the batch the block layer gave it
+typedef struct nvme_namespace {
+    uint32_t nsid;
+    uint64_t sectors;
+    block_device_t *blockdev;
+    nvme_queue_t *queue;            // Queue the batch runs on, the one of the CPU starting it
+    const block_command_t *batch;   // NULL when no batch is running
+    size_t batch_count;
+    size_t batch_next;              // Block command the next NVMe command starts in
+    uint32_t batch_offset;          // Sectors of it already issued
+    uint32_t outstanding;           // NVMe commands in flight
+    bool write;
+    bool failed;
+    uint64_t deadline;              // Reset whenever a command finishes
+} nvme_namespace_t;
+
+// Controller state
+static volatile uint8_t *regs = NULL;
+static size_t regs_size = 0;
+static uint32_t doorbell_stride = 4;
+static uint32_t ready_timeout = 0;
+static uint32_t max_sectors = NVME_MAX_SECTORS;
+static pci_device_t controller;
+static pci_msix_t msix;
+static int irq_vector = -1;         // Shared by every I/O queue, each entry targets its CPU
+static bool irq_enabled = false;
+static nvme_queue_t admin;
+static nvme_queue_t io_queues[MAX_CPUS];
+static uint32_t io_queue_count = 0;
+static uint32_t io_queue_limit = 0; // Pairs the controller and the MSI-X table allow
+static nvme_queue_t *cpu_queues[MAX_CPUS];
+static nvme_namespace_t namespaces[NVME_MAX_NAMESPACES];
+static int namespace_count = 0;
+static char model[41];
+static char serial[21];
+
+static uint32_t read32(uint32_t reg) {
+    return *(volatile uint32_t *)(regs + reg);
+}
+
+static void write32(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(regs + reg) = value;
+}
+
+static uint64_t read64(uint32_t reg) {
+    uint64_t low = read32(reg);
+    return low | ((uint64_t)read32(reg + 4) << 32);
+}
+
+static void write64(uint32_t reg, uint64_t value) {
+    write32(reg, (uint32_t)value);
+    write32(reg + 4, (uint32_t)(value >> 32));
+}
+
+// Wait until (CSTS & mask) == value, false on timeout or a fatal controller status
+static bool wait_status(uint32_t mask, uint32_t value) {
+    uint64_t deadline = timer_get_uptime_ms() + ready_timeout;
+    while ((read32(NVME_REG_CSTS) & mask) != value) {
+        if ((read32(NVME_REG_CSTS) & NVME_CSTS_FATAL) || timer_get_uptime_ms() > deadline) {
+            return false;
+        }
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+// Take a queue's lock if other CPUs can reach it, returns whether it was taken
+static bool queue_lock(nvme_queue_t *q) {
+    if (!q->shared) {
+        return false;
+    }
+    spinlock_acquire(&q->lock);
+    return true;
+}
+
+static void queue_unlock(nvme_queue_t *q, bool locked) {
+    if (locked) {
+        spinlock_release(&q->lock);
+    }
+}
+
+// Give back a queue's memory
+static void free_queue(nvme_queue_t *q) {
+    if (q->sq_phys) pmm_free_page((void*)q->sq_phys);
+    if (q->cq_phys) pmm_free_page((void*)q->cq_phys);
+    if (q->prp_lists_phys) pmm_free_pages((void*)q->prp_lists_phys, NVME_PRP_PAGES);
+    memset(q, 0, sizeof(nvme_queue_t));
+}
+
+// Allocate a queue pair's rings (and PRP lists for I/O queues) and find its doorbells
+static bool alloc_queue(nvme_queue_t *q, uint16_t id, uint16_t depth) {
+    memset(q, 0, sizeof(nvme_queue_t));
+
+    void *sq = pmm_alloc_page();
+    void *cq = pmm_alloc_page();
+    void *prp = id ? pmm_alloc_pages(NVME_PRP_PAGES) : NULL;
+    q->sq_phys = (uint64_t)sq;
+    q->cq_phys = (uint64_t)cq;
+    q->prp_lists_phys = (uint64_t)prp;
+    if (!sq || !cq || (id && !prp)) {
+        free_queue(q);
+        return false;
+    }
+
+    q->id = id;
+    q->depth = depth;
+    q->sq = vmm_phys_to_virt(q->sq_phys);
+    q->cq = vmm_phys_to_virt(q->cq_phys);
+    memset(q->sq, 0, PMM_BLOCK_SIZE);
+    memset((void*)q->cq, 0, PMM_BLOCK_SIZE);
+    if (prp) {
+        q->prp_lists = vmm_phys_to_virt(q->prp_lists_phys);
+    }
+
+    q->sq_doorbell = (volatile uint32_t *)(regs + NVME_REG_DOORBELLS + (2 * id) * doorbell_stride);
+    q->cq_doorbell = (volatile uint32_t *)(regs + NVME_REG_DOORBELLS + (2 * id + 1) * doorbell_stride);
+    q->phase = 1;
+
+    // One entry stays empty, a full ring would look empty to the controller
+    q->free_cids = (1ULL << (depth - 1)) - 1;
+    spinlock_init(&q->lock);
+    return true;
+}
+
+// Take a free command ID, leaving reserve of them, -1 when there is none
+static int alloc_cid(nvme_queue_t *q, int reserve) {
+    if (__builtin_popcountll(q->free_cids) <= reserve) {
+        return -1;
+    }
+    int cid = __builtin_ctzll(q->free_cids);
+    q->free_cids &= ~(1ULL << cid);
+    return cid;
+}
+
+// Copy a command into the submission ring, ring_doorbell hands it over
+static void submit(nvme_queue_t *q, const nvme_command_t *cmd) {
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->depth;
+    q->commands++;
+}
+
+static void ring_doorbell(nvme_queue_t *q) {
+    // Entries live in normal memory, make sure they are written first
+    __asm__ volatile("" ::: "memory");
+    *q->sq_doorbell = q->sq_tail;
+}
+
+// Run an admin command and spin for its completion, only init code uses the admin queue
+static bool admin_command(nvme_command_t *cmd, uint32_t *result) {
+    cmd->cid = 0;
+    submit(&admin, cmd);
+    ring_doorbell(&admin);
+
+    uint64_t deadline = timer_get_uptime_ms() + NVME_TIMEOUT;
+    volatile nvme_completion_t *cqe = &admin.cq[admin.cq_head];
+    while ((cqe->status & 1) != admin.phase) {
+        if (timer_get_uptime_ms() > deadline) {
+            LOG_ERROR("NVMe: admin command 0x%x timed out", cmd->opcode);
+            return false;
+        }
+        __asm__ volatile("pause");
+    }
+
+    uint16_t status = NVME_STATUS(cqe->status);
+    if (result) {
+        *result = cqe->result;
+    }
+    if (++admin.cq_head == admin.depth) {
+        admin.cq_head = 0;
+        admin.phase ^= 1;
+    }
+    *admin.cq_doorbell = admin.cq_head;
+
+    if (status) {
+        LOG_ERROR("NVMe: admin command 0x%x failed with status 0x%x", cmd->opcode, status);
+        return false;
+    }
+    return true;
+}
+
+// Point a command at its data, starting offset sectors into a block command. Returns the
+// sectors covered, which stop early where the next segment cannot continue the PRP list.
+static uint32_t build_prps(nvme_queue_t *q, int cid, const block_command_t *bc, uint32_t offset,
+                           nvme_command_t *cmd) {
+    uint64_t *list = &q->prp_lists[cid * NVME_PRP_LIST_ENTRIES];
+    size_t pages = 0;
+    uint32_t covered = 0;
+    bool page_end = false;
+
+    for (size_t i = 0; i < bc->segment_count && covered < max_sectors; i++) {
+        const block_segment_t *seg = &bc->segments[i];
+        if (offset >= seg->sectors) {
+            offset -= seg->sectors;
+            continue;
+        }
+
+        uint8_t *virt = (uint8_t*)seg->buffer + (size_t)offset * BLOCK_SECTOR_SIZE;
+        uint32_t sectors = seg->sectors - offset;
+        if (sectors > max_sectors - covered) sectors = max_sectors - covered;
+        offset = 0;
+
+        // Only the first entry may start inside a page and only the last end inside one
+        if (pages > 0 && (!page_end || ((uint64_t)virt & (NVME_PAGE_SIZE - 1)))) {
+            break;
+        }
+
+        // Translate page by page, buffers need not be physically contiguous
+        size_t bytes = (size_t)sectors * BLOCK_SECTOR_SIZE;
+        while (bytes > 0) {
+            uint32_t chunk = NVME_PAGE_SIZE - ((uint64_t)virt & (NVME_PAGE_SIZE - 1));
+            if (chunk > bytes) chunk = bytes;
+
+            uint64_t phys = vmm_virt_to_phys(virt);
+            if (!phys || (phys & 3)) {
+                return 0;
+            }
+
+            if (pages == 0) {
+                cmd->prp1 = phys;
+            } else if (pages - 1 < NVME_PRP_LIST_ENTRIES) {
+                list[pages - 1] = phys;
+            } else {
+                return 0;
+            }
+            pages++;
+            page_end = ((phys + chunk) & (NVME_PAGE_SIZE - 1)) == 0;
+
+            virt += chunk;
+            bytes -= chunk;
+        }
+        covered += sectors;
+    }
+
+    // Two pages fit the command itself, more go through the list
+    if (pages == 2) {
+        cmd->prp2 = list[0];
+    } else if (pages > 2) {
+        cmd->prp2 = q->prp_lists_phys + cid * NVME_PRP_LIST_BYTES;
+    }
+    return covered;
+}
+
+// Issue the batch's next commands while the queue has IDs to spare
+static void fill(nvme_namespace_t *ns) {
+    nvme_queue_t *q = ns->queue;
+    bool issued = false;
+
+    while (ns->batch_next < ns->batch_count) {
+        int cid = alloc_cid(q, NVME_SYNC_RESERVE);
+        if (cid < 0) {
+            break;
+        }
+
+        const block_command_t *bc = &ns->batch[ns->batch_next];
+        nvme_command_t cmd;
+        memset(&cmd, 0, sizeof(cmd));
+
+        uint32_t count = build_prps(q, cid, bc, ns->batch_offset, &cmd);
+        if (count == 0) {
+            q->free_cids |= 1ULL << cid;
+            LOG_ERROR("NVMe: nvme0n%u buffer not usable for DMA", ns->nsid);
+            ns->failed = true;
+            break;
+        }
+
+        uint64_t lba = bc->sector + ns->batch_offset;
+        cmd.opcode = ns->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd.cid = (uint16_t)cid;
+        cmd.nsid = ns->nsid;
+        cmd.cdw10 = (uint32_t)lba;
+        cmd.cdw11 = (uint32_t)(lba >> 32);
+        cmd.cdw12 = count - 1;
+
+        q->requests[cid].ns = ns;
+        submit(q, &cmd);
+        ns->outstanding++;
+        issued = true;
+
+        ns->batch_offset += count;
+        if (ns->batch_offset == bc->count) {
+            ns->batch_next++;
+            ns->batch_offset = 0;
+        }
+    }
+
+    if (issued) {
+        ring_doorbell(q);
+    }
+}
+
+// Reap every new completion of a queue
+static void drain(nvme_queue_t *q) {
+    bool reaped = false;
+
+    while (true) {
+        volatile nvme_completion_t *cqe = &q->cq[q->cq_head];
+        uint16_t status = cqe->status;
+        if ((status & 1) != q->phase) {
+            break;
+        }
+
+        uint16_t cid = cqe->cid;
+        if (++q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        reaped = true;
+        if (cid >= q->depth) continue;
+
+        nvme_request_t *req = &q->requests[cid];
+        nvme_namespace_t *ns = req->ns;
+        nvme_sync_t *sync = req->sync;
+        req->ns = NULL;
+        req->sync = NULL;
+        q->free_cids |= 1ULL << cid;
+
+        if (ns) {
+            ns->outstanding--;
+            ns->deadline = timer_get_uptime_ms() + NVME_TIMEOUT;
+            if (NVME_STATUS(status)) {
+                LOG_ERROR_RATELIMITED("NVMe: nvme0n%u command failed with status 0x%x",
+                                      ns->nsid, NVME_STATUS(status));
+                ns->failed = true;
+            }
+        } else if (sync) {
+            sync->status = NVME_STATUS(status);
+            completion_signal(&sync->done);
+        }
+    }
+
+    if (reaped) {
+        *q->cq_doorbell = q->cq_head;
+    }
+}
+
+// Fail a batch whose commands stopped answering. Their IDs stay taken until the controller
+// completes them after all.
+static void batch_timeout(nvme_namespace_t *ns) {
+    nvme_queue_t *q = ns->queue;
+    LOG_ERROR("NVMe: nvme0n%u batch timed out with %u commands in flight", ns->nsid, ns->outstanding);
+
+    for (uint16_t cid = 0; cid < q->depth; cid++) {
+        if (q->requests[cid].ns == ns) {
+            q->requests[cid].ns = NULL;
+        }
+    }
+    ns->outstanding = 0;
+    ns->failed = true;
+}
+
+// Reap a queue's completions, refill its batches and report the ones that ended. The
+// block layer may start the next batch from block_complete, so that happens unlocked.
+static void service(nvme_queue_t *q) {
+    nvme_namespace_t *ended[NVME_MAX_NAMESPACES];
+    bool ended_ok[NVME_MAX_NAMESPACES];
+    int ended_count = 0;
+
+    bool locked = queue_lock(q);
+    drain(q);
+
+    uint64_t now = timer_get_uptime_ms();
+    for (int i = 0; i < namespace_count; i++) {
+        nvme_namespace_t *ns = &namespaces[i];
+        if (!ns->batch || ns->queue != q) continue;
+
+        if (ns->outstanding > 0 && now > ns->deadline) {
+            batch_timeout(ns);
+        }
+        if (!ns->failed) {
+            fill(ns);
+        }
+        if (ns->outstanding == 0 && (ns->failed || ns->batch_next == ns->batch_count)) {
+            ended[ended_count] = ns;
+            ended_ok[ended_count] = !ns->failed;
+            ended_count++;
+            ns->batch = NULL;
+        }
+    }
+    queue_unlock(q, locked);
+
+    for (int i = 0; i < ended_count; i++) {
+        block_complete(ended[i]->blockdev, ended_ok[i]);
+    }
+}
+
+// Completion interrupt, each queue's MSI-X entry targets the CPU owning it
+static void nvme_irq_handler(struct interrupt_frame *frame) {
+    (void)frame;
+
+    nvme_queue_t *q = cpu_queues[cpu_current_id()];
+    if (q) {
+        q->interrupts++;
+        service(q);
+    }
+}
+
+// Block layer entry point: the batch goes to the executing CPU's queue, interrupts are off
+static bool nvme_block_start(block_device_t *dev, const block_command_t *commands, size_t count, bool write) {
+    nvme_namespace_t *ns = dev->driver_data;
+    nvme_queue_t *q = cpu_queues[cpu_current_id()];
+    bool locked = queue_lock(q);
+
+    ns->queue = q;
+    ns->batch = commands;
+    ns->batch_count = count;
+    ns->batch_next = 0;
+    ns->batch_offset = 0;
+    ns->outstanding = 0;
+    ns->write = write;
+    ns->failed = false;
+    ns->deadline = timer_get_uptime_ms() + NVME_TIMEOUT;
+    fill(ns);
+
+    // With every ID taken by other namespaces' batches, their completions refill this one
+    bool started = !ns->failed || ns->outstanding > 0;
+    if (!started) {
+        ns->batch = NULL;
+    }
+
+    queue_unlock(q, locked);
+    return started;
+}
+
+// Block layer poll hook, catches missed interrupts and timeouts. A private queue of another
+// CPU is left to that CPU's interrupt.
+static void nvme_block_poll(block_device_t *dev) {
+    nvme_namespace_t *ns = dev->driver_data;
+    nvme_queue_t *q = ns->queue;
+    if (!q || (!q->shared && q != cpu_queues[cpu_current_id()])) {
+        return;
+    }
+    service(q);
+}
+
+// Run one command on the executing CPU's queue and wait for it
+static bool sync_command(nvme_command_t *cmd) {
+    nvme_sync_t *sync = kmalloc(sizeof(nvme_sync_t));
+    if (!sync) {
+        return false;
+    }
+    completion_init(&sync->done);
+    sync->status = 0;
+
+    uint64_t deadline = timer_get_uptime_ms() + NVME_TIMEOUT;
+    nvme_queue_t *q;
+    while (true) {
+        uint64_t flags = cpu_irq_save();
+        q = cpu_queues[cpu_current_id()];
+        bool locked = queue_lock(q);
+
+        int cid = alloc_cid(q, 0);
+        if (cid >= 0) {
+            cmd->cid = (uint16_t)cid;
+            q->requests[cid].sync = sync;
+            submit(q, cmd);
+            ring_doorbell(q);
+        }
+
+        queue_unlock(q, locked);
+        cpu_irq_restore(flags);
+
+        if (cid >= 0) {
+            break;
+        }
+        if (timer_get_uptime_ms() > deadline) {
+            kfree(sync);
+            return false;
+        }
+        scheduler_yield();
+    }
+
+    while (!completion_wait_timeout(&sync->done, irq_enabled ? NVME_POLL_MS : 1)) {
+        if (!irq_enabled) {
+            uint64_t flags = cpu_irq_save();
+            service(q);
+            cpu_irq_restore(flags);
+        }
+
+        // The record stays behind for a completion arriving after all
+        if (timer_get_uptime_ms() > deadline) {
+            LOG_ERROR("NVMe: command 0x%x timed out", cmd->opcode);
+            return false;
+        }
+    }
+
+    bool ok = sync->status == 0;
+    if (!ok) {
+        LOG_ERROR("NVMe: command 0x%x failed with status 0x%x", cmd->opcode, sync->status);
+    }
+    kfree(sync);
+    return ok;
+}
+
+// Block layer flush hook
+static bool nvme_block_flush(block_device_t *dev) {
+    nvme_namespace_t *ns = dev->driver_data;
+
+    nvme_command_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = ns->nsid;
+    return sync_command(&cmd);
+}
+
+// Create I/O queue pair id on the controller, its completions interrupt the CPU
+static bool create_io_queue(nvme_queue_t *q, uint16_t id, uint32_t cpu, uint32_t apic_id) {
+    uint16_t depth = NVME_QUEUE_DEPTH;
+    uint32_t mqes = NVME_CAP_MQES(read64(NVME_REG_CAP));
+    if (depth > mqes + 1) {
+        depth = (uint16_t)(mqes + 1);
+    }
+
+    if (!alloc_queue(q, id, depth)) {
+        LOG_WARN("NVMe: no memory for I/O queue %u", id);
+        return false;
+    }
+    q->cpu = cpu;
+
+    // MSI-X entry 0 belongs to the admin queue, which is polled
+    if (irq_enabled && !pci_msix_set(&msix, id, (uint8_t)irq_vector, apic_id)) {
+        free_queue(q);
+        return false;
+    }
+
+    nvme_command_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = q->cq_phys;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | id;
+    cmd.cdw11 = NVME_QUEUE_CONTIGUOUS | (irq_enabled ? NVME_CQ_INTERRUPTS | ((uint32_t)id << 16) : 0);
+    if (!admin_command(&cmd, NULL)) {
+        free_queue(q);
+        return false;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = q->sq_phys;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | id;
+    cmd.cdw11 = NVME_QUEUE_CONTIGUOUS | ((uint32_t)id << 16);
+    if (!admin_command(&cmd, NULL)) {
+        // The completion queue stays created, its ID is not used again
+        free_queue(q);
+        return false;
+    }
+
+    return true;
+}
+
+// Copy a space padded identify string
+static void copy_string(char *dest, const uint8_t *src, int length) {
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+    for (int i = length - 1; i >= 0 && (dest[i] == ' ' || dest[i] == '\0'); i--) {
+        dest[i] = '\0';
+    }
+}
+
+// Identify a namespace and register it if its blocks are sectors
+static void probe_namespace(uint32_t nsid, uint8_t *identify, uint64_t identify_phys) {
+    nvme_command_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = identify_phys;
+    cmd.cdw10 = NVME_IDENTIFY_NAMESPACE;
+    memset(identify, 0, PMM_BLOCK_SIZE);
+    if (!admin_command(&cmd, NULL)) {
+        return;
+    }
+
+    uint64_t size;
+    uint32_t format;
+    memcpy(&size, &identify[0], sizeof(size));
+    memcpy(&format, &identify[128 + (identify[26] & 0x0F) * 4], sizeof(format));
+    if (size == 0) {
+        return;
+    }
+
+    // The block layer counts 512 byte sectors
+    uint32_t block_shift = (format >> 16) & 0xFF;
+    if (block_shift != 9) {
+        LOG_WARN("NVMe: nvme0n%u has %u byte blocks, skipped", nsid, 1U << block_shift);
+        return;
+    }
+
+    nvme_namespace_t *ns = &namespaces[namespace_count];
+    memset(ns, 0, sizeof(nvme_namespace_t));
+    ns->nsid = nsid;
+    ns->sectors = size;
+
+    block_device_t dev;
+    memset(&dev, 0, sizeof(dev));
+    snprintf(dev.name, sizeof(dev.name), "nvme0n%u", nsid);
+    dev.sectors = size;
+    dev.max_sectors = max_sectors;
+    dev.max_segments = NVME_MAX_SEGMENTS;
+    dev.interrupts = irq_enabled;
+    dev.driver_data = ns;
+    dev.start = nvme_block_start;
+    dev.poll = nvme_block_poll;
+    dev.flush = nvme_block_flush;
+
+    int drive = block_register_device(&dev);
+    if (drive < 0) {
+        LOG_WARN("NVMe: nvme0n%u: block device table full", nsid);
+        return;
+    }
+    ns->blockdev = block_get_device(drive);
+    namespace_count++;
+
+    LOG_INFO("NVMe: nvme0n%u, %u MB", nsid, (uint32_t)(size / 2048));
+}
+
+// Identify the controller and register its namespaces
+static bool identify(void) {
+    void *page = pmm_alloc_page();
+    if (!page) {
+        return false;
+    }
+    uint8_t *data = vmm_phys_to_virt((uint64_t)page);
+    memset(data, 0, PMM_BLOCK_SIZE);
+
+    nvme_command_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = (uint64_t)page;
+    cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
+    if (!admin_command(&cmd, NULL)) {
+        pmm_free_page(page);
+        return false;
+    }
+
+    copy_string(serial, &data[4], 20);
+    copy_string(model, &data[24], 40);
+
+    // MDTS is a power of two of the smallest page size, 0 means no limit
+    uint8_t mdts = data[77];
+    if (mdts && mdts < 20) {
+        uint64_t limit = ((uint64_t)NVME_PAGE_SIZE << mdts) / BLOCK_SECTOR_SIZE;
+        if (limit < max_sectors) {
+            max_sectors = (uint32_t)limit;
+        }
+    }
+
+    uint32_t nn;
+    memcpy(&nn, &data[516], sizeof(nn));
+    for (uint32_t nsid = 1; nsid <= nn && namespace_count < NVME_MAX_NAMESPACES; nsid++) {
+        probe_namespace(nsid, data, (uint64_t)page);
+    }
+
+    pmm_free_page(page);
+    return true;
+}
+
+// Disable the controller, hand it the admin queue and enable it again
+static bool reset_controller(void) {
+    uint32_t cc = read32(NVME_REG_CC);
+    if (cc & NVME_CC_ENABLE) {
+        write32(NVME_REG_CC, cc & ~NVME_CC_ENABLE);
+    }
+    if (!wait_status(NVME_CSTS_READY, 0)) {
+        LOG_ERROR_MSG("NVMe: controller did not stop");
+        return false;
+    }
+
+    uint16_t depth = NVME_ADMIN_DEPTH;
+    if (!alloc_queue(&admin, 0, depth)) {
+        LOG_ERROR_MSG("NVMe: no memory for the admin queue");
+        return false;
+    }
+
+    write32(NVME_REG_AQA, ((uint32_t)(depth - 1) << 16) | (depth - 1));
+    write64(NVME_REG_ASQ, admin.sq_phys);
+    write64(NVME_REG_ACQ, admin.cq_phys);
+
+    // NVM command set, 4K pages, round robin arbitration
+    write32(NVME_REG_CC, NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_ENABLE);
+    if (!wait_status(NVME_CSTS_READY, NVME_CSTS_READY)) {
+        LOG_ERROR("NVMe: controller did not become ready (CSTS=0x%x)", read32(NVME_REG_CSTS));
+        free_queue(&admin);
+        return false;
+    }
+    return true;
+}
+
+// Find the NVMe controller, set up its admin queue and the boot CPU's I/O queues, and
+// register its namespaces with the block layer
+bool nvme_init(void) {
+    if (!pci_find_device_by_class(0x01, 0x08, &controller) || controller.prog_if != 0x02) {
+        LOG_INFO_MSG("No NVMe controller found");
+        return false;
+    }
+
+    uint64_t bar = pci_get_bar(&controller, 0);
+    if (bar == 0) {
+        LOG_ERROR_MSG("NVMe controller has no BAR0");
+        return false;
+    }
+
+    // Enable memory space and bus mastering
+    uint32_t command = pci_read_config_dword(controller.bus, controller.device, controller.function, PCI_COMMAND);
+    pci_write_config_dword(controller.bus, controller.device, controller.function, PCI_COMMAND, command | 0x6);
+
+    // The doorbell stride decides how far the registers reach
+    regs = vmm_map_physical(bar, PAGE_SIZE_4K, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!regs) {
+        LOG_ERROR("NVMe: failed to map BAR0 at 0x%llx", bar);
+        return false;
+    }
+    uint64_t cap = read64(NVME_REG_CAP);
+    vmm_unmap_physical((void*)regs, PAGE_SIZE_4K);
+
+    doorbell_stride = 4U << NVME_CAP_DSTRD(cap);
+    regs_size = NVME_REG_DOORBELLS + 2 * (MAX_CPUS + 1) * doorbell_stride;
+    regs = vmm_map_physical(bar, regs_size, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!regs) {
+        LOG_ERROR("NVMe: failed to map BAR0 at 0x%llx", bar);
+        return false;
+    }
+
+    if (NVME_CAP_MPSMIN(cap) != 0) {
+        LOG_ERROR_MSG("NVMe: controller does not support 4K pages");
+        regs = NULL;
+        return false;
+    }
+    ready_timeout = (NVME_CAP_TO(cap) + 1) * 500;
+
+    if (!reset_controller()) {
+        regs = NULL;
+        return false;
+    }
+
+    // Ask for a pair per CPU, the answer counts from 0
+    nvme_command_t cmd;
+    uint32_t granted = 0;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEATURE_QUEUES;
+    cmd.cdw11 = ((uint32_t)(MAX_CPUS - 1) << 16) | (MAX_CPUS - 1);
+    io_queue_limit = admin_command(&cmd, &granted) ?
+        ((granted & 0xFFFF) < (granted >> 16) ? (granted & 0xFFFF) : (granted >> 16)) + 1 : 1;
+    if (io_queue_limit > MAX_CPUS) {
+        io_queue_limit = MAX_CPUS;
+    }
+
+    // One vector for every queue, the MSI-X entries steer it to the queues' CPUs
+    bool msix_on = pci_msix_init(&controller, &msix);
+    if (msix_on && msix.entries > 1) {
+        irq_vector = idt_alloc_vector(nvme_irq_handler);
+        irq_enabled = irq_vector >= 0;
+    }
+    if (irq_enabled) {
+        if (io_queue_limit > msix.entries - 1U) {
+            io_queue_limit = msix.entries - 1U;
+        }
+    } else {
+        // Pin interrupts stay off, completions are polled through one shared pair
+        if (!msix_on) {
+            write32(NVME_REG_INTMS, 0xFFFFFFFF);
+        }
+        io_queue_limit = 1;
+    }
+
+    // Every CPU submits through the boot CPU's pair until nvme_init_cpus runs, its interrupts
+    // go to the boot CPU whichever CPU probes the controller
+    if (!create_io_queue(&io_queues[0], 1, 0, smp_cpu(0)->lapic_id)) {
+        LOG_ERROR_MSG("NVMe: failed to create an I/O queue");
+        regs = NULL;
+        return false;
+    }
+    io_queues[0].shared = true;
+    io_queue_count = 1;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        cpu_queues[id] = &io_queues[0];
+    }
+
+    uint32_t version = read32(NVME_REG_VS);
+    LOG_INFO("NVMe: %s, version %u.%u, %s, up to %u I/O queue pairs", model[0] ? model : "controller",
+             version >> 16, (version >> 8) & 0xFF, irq_enabled ? "MSI-X" : "polled", io_queue_limit);
+
+    if (!identify()) {
+        LOG_ERROR_MSG("NVMe: IDENTIFY failed");
+        return false;
+    }
+    return namespace_count > 0;
+}
+
+// Give every other online CPU a queue pair of its own, called once they are up
+void nvme_init_cpus(void) {
+    if (!regs || !irq_enabled || io_queue_count == 0) {
+        return;
+    }
+
+    nvme_queue_t *mapping[MAX_CPUS];
+    mapping[0] = &io_queues[0];
+    for (uint32_t id = 1; id < MAX_CPUS; id++) {
+        cpu_local_t *cpu = smp_cpu(id);
+        mapping[id] = NULL;
+        if (!cpu || !cpu->online || io_queue_count >= io_queue_limit) continue;
+
+        nvme_queue_t *q = &io_queues[io_queue_count];
+        if (create_io_queue(q, (uint16_t)(io_queue_count + 1), id, cpu->lapic_id)) {
+            mapping[id] = q;
+            io_queue_count++;
+        }
+    }
+
+    // CPUs left without a pair share one, which then needs its lock
+    bool boot_shared = false;
+    for (uint32_t id = 1; id < MAX_CPUS; id++) {
+        if (mapping[id]) continue;
+        mapping[id] = &io_queues[id % io_queue_count];
+        mapping[id]->shared = true;
+        if (mapping[id] == &io_queues[0]) boot_shared = true;
+    }
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        __atomic_store_n(&cpu_queues[id], mapping[id], __ATOMIC_RELEASE);
+    }
+
+    // Submitters run with interrupts off, once every CPU took an IPI none is still on the
+    // boot pair under the old mapping
+    if (!boot_shared && smp_sync_cores()) {
+        io_queues[0].shared = false;
+    }
+
+    LOG_INFO("NVMe: %u I/O queue pairs for %u CPUs", io_queue_count, smp_cpu_count());
+}
+
+// Print information about the controller and its namespaces
+void nvme_print_info(void) {
+    if (!regs) {
+        LOG_INFO_MSG("NVMe: no controller");
+        return;
+    }
+
+    LOG_INFO("NVMe: %s (serial %s), %u I/O queue pairs, %s, %u sectors per command",
+             model, serial, io_queue_count, irq_enabled ? "MSI-X" : "polled", max_sectors);
+    for (uint32_t i = 0; i < io_queue_count; i++) {
+        nvme_queue_t *q = &io_queues[i];
+        LOG_INFO("  Queue %u: CPU %u, depth %u, %u commands, %u interrupts%s", q->id, q->cpu,
+                 q->depth, (uint32_t)q->commands, (uint32_t)q->interrupts, q->shared ? ", shared" : "");
+    }
+    for (int i = 0; i < namespace_count; i++) {
+        LOG_INFO("  nvme0n%u: %u MB", namespaces[i].nsid, (uint32_t)(namespaces[i].sectors / 2048));
+    }
+}
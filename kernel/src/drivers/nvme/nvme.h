@@ -0,0 +1,99 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NVME_QUEUE_DEPTH        64      // Entries per submission and completion queue
+#define NVME_ADMIN_DEPTH        16
+#define NVME_MAX_NAMESPACES     4       // Registered with the block layer
+#define NVME_MAX_SECTORS        256     // Per command, bounded further by MDTS
+#define NVME_MAX_SEGMENTS       16      // Per block layer command
+#define NVME_PRP_LIST_ENTRIES   (NVME_MAX_SECTORS * 512 / 4096)     // Pages after the first
+#define NVME_SYNC_RESERVE       4       // Command IDs batches leave to flushes
+#define NVME_TIMEOUT            5000    // Command timeout in ms
+#define NVME_POLL_MS            10      // Flush waiters recheck this often
+
+// Controller registers (BAR0)
+#define NVME_REG_CAP            0x00
+#define NVME_REG_VS             0x08
+#define NVME_REG_INTMS          0x0C    // Pin and MSI interrupt mask set
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1C
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28
+#define NVME_REG_ACQ            0x30
+#define NVME_REG_DOORBELLS      0x1000
+
+// Capabilities
+#define NVME_CAP_MQES(cap)      ((uint32_t)((cap) & 0xFFFF))        // Queue entries - 1
+#define NVME_CAP_TO(cap)        ((uint32_t)(((cap) >> 24) & 0xFF))  // Ready timeout, 500 ms units
+#define NVME_CAP_DSTRD(cap)     ((uint32_t)(((cap) >> 32) & 0xF))   // Doorbell stride, 4 << DSTRD
+#define NVME_CAP_MPSMIN(cap)    ((uint32_t)(((cap) >> 48) & 0xF))   // Smallest page, 4K << MPSMIN
+
+// Controller configuration and status
+#define NVME_CC_ENABLE          (1U << 0)
+#define NVME_CC_IOSQES          (6U << 16)  // 64 byte submission entries
+#define NVME_CC_IOCQES          (4U << 20)  // 16 byte completion entries
+#define NVME_CSTS_READY         (1U << 0)
+#define NVME_CSTS_FATAL         (1U << 1)
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+// NVM commands
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+#define NVME_IDENTIFY_NAMESPACE 0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+#define NVME_FEATURE_QUEUES     0x07
+
+// Queue creation flags
+#define NVME_QUEUE_CONTIGUOUS   (1U << 0)
+#define NVME_CQ_INTERRUPTS      (1U << 1)
+
+// Submission queue entry
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;                   // Command ID, echoed in the completion
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t metadata;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_command_t;
+
+// Completion queue entry
+typedef struct {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;                // Phase tag in bit 0, status field above it
+} __attribute__((packed)) nvme_completion_t;
+
+// Find the NVMe controller, set up its admin queue and the boot CPU's I/O queues, and
+// register its namespaces with the block layer
+bool nvme_init(void);
+
+// Give every other online CPU a queue pair of its own, called once they are up
+void nvme_init_cpus(void);
+
+// Print information about the controller and its namespaces
+void nvme_print_info(void);
+
+#endif // NVME_H
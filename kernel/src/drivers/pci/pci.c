@@ -1,4 +1,10 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/pci/pci.h>
+#include <drivers/acpi/acpi.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
+#include <memory/vmm.h>
 #include <lib/io.h>
 #include <lib/string.h>
 #include <utils/log.h>
@@ -6,9 +12,38 @@
 // Maximum number of PCI devices we'll track
 #define MAX_PCI_DEVICES 256
 
+// Functions an ECAM region can cover, 256 buses of 32 devices with 8 functions
+#define ECAM_FUNCTIONS  (256 * 32 * 8)
+
+// PCI Express memory mapped configuration table
+typedef struct {
+    acpi_sdt_header_t header;
+    uint64_t reserved;
+} __attribute__((packed)) mcfg_t;
+
+// Configuration space of one segment's buses, 4 KiB per function
+typedef struct {
+    uint64_t base;                  // Address of bus 0, even when start_bus is higher
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed)) mcfg_entry_t;
+
 // Global storage for detected PCI devices
 static pci_device_t pci_devices[MAX_PCI_DEVICES];
 static uint16_t detected_device_count = 0;
+static bool scanned = false;
+
+// CF8/CFC is one address and data pair for every CPU
+static spinlock_t port_lock;
+
+// Segment 0's ECAM region, each function's page is mapped the first time it is touched
+static uint64_t ecam_phys = 0;
+static uint8_t *ecam_virt = NULL;
+static uint8_t ecam_start = 0;
+static uint8_t ecam_end = 0;
+static uint8_t ecam_mapped[ECAM_FUNCTIONS / 8];
 
 // Create PCI configuration address
 static uint32_t pci_get_config_addr(uint8_t bus, uint8_t device, 
@@ -20,30 +55,114 @@ static uint32_t pci_get_config_addr(uint8_t bus, uint8_t device,
            (offset & 0xFC);             // Register number (align to 4 bytes)
 }
 
+// Memory mapped configuration dword of a function, NULL when its bus is not in ECAM
+static volatile uint32_t *ecam_address(uint8_t bus, uint8_t device,
+                                       uint8_t function, uint8_t offset) {
+    if (!ecam_virt || bus < ecam_start || bus > ecam_end) {
+        return NULL;
+    }
+
+    uint32_t index = ((uint32_t)bus << 8) | ((device & 0x1F) << 3) | (function & 0x07);
+    uint64_t page = (uint64_t)index * PAGE_SIZE_4K;
+    uint8_t bit = 1U << (index % 8);
+
+    if (!(__atomic_load_n(&ecam_mapped[index / 8], __ATOMIC_ACQUIRE) & bit)) {
+        // Mapping a page twice is harmless, losing the race only costs a lookup
+        if (!vmm_map_physical(ecam_phys + page, PAGE_SIZE_4K,
+                              VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE)) {
+            return NULL;
+        }
+        __atomic_fetch_or(&ecam_mapped[index / 8], bit, __ATOMIC_RELEASE);
+    }
+
+    return (volatile uint32_t *)(ecam_virt + page + (offset & 0xFC));
+}
+
 // Read 32-bit value from PCI configuration space
 uint32_t pci_read_config_dword(uint8_t bus, uint8_t device, 
                                uint8_t function, uint8_t offset) {
+    volatile uint32_t *mmio = ecam_address(bus, device, function, offset);
+    if (mmio) {
+        return *mmio;
+    }
+
     // Ensure 4-byte alignment
     offset &= 0xFC;
-    
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&port_lock);
+
     // Write configuration address
     outl(PCI_CONFIG_ADDR, pci_get_config_addr(bus, device, function, offset));
     
     // Read configuration data
-    return inl(PCI_CONFIG_DATA);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+
+    spinlock_release(&port_lock);
+    cpu_irq_restore(flags);
+    return value;
 }
 
 // Write 32-bit value to PCI configuration space
 void pci_write_config_dword(uint8_t bus, uint8_t device, 
                             uint8_t function, uint8_t offset, uint32_t value) {
+    volatile uint32_t *mmio = ecam_address(bus, device, function, offset);
+    if (mmio) {
+        *mmio = value;
+        return;
+    }
+
     // Ensure 4-byte alignment
     offset &= 0xFC;
-    
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&port_lock);
+
     // Write configuration address
     outl(PCI_CONFIG_ADDR, pci_get_config_addr(bus, device, function, offset));
     
     // Write configuration data
     outl(PCI_CONFIG_DATA, value);
+
+    spinlock_release(&port_lock);
+    cpu_irq_restore(flags);
+}
+
+// Switch segment 0's buses to ECAM when the MCFG describes them
+static void pci_ecam_init(void) {
+    const mcfg_t *mcfg = (const mcfg_t *)acpi_find_table("MCFG");
+    if (!mcfg) {
+        LOG_INFO_MSG("PCI: no MCFG, configuration through port I/O");
+        return;
+    }
+
+    const mcfg_entry_t *entries = (const mcfg_entry_t *)(mcfg + 1);
+    size_t count = (mcfg->header.length - sizeof(mcfg_t)) / sizeof(mcfg_entry_t);
+
+    for (size_t i = 0; i < count; i++) {
+        const mcfg_entry_t *entry = &entries[i];
+        if (entry->segment != 0 || entry->start_bus > entry->end_bus) continue;
+
+        // The HHDM window gets pages filled in lazily, a region above 4 GiB is mapped whole
+        if (entry->base < 0x100000000ULL) {
+            ecam_virt = vmm_phys_to_virt(entry->base);
+        } else {
+            size_t size = (size_t)(entry->end_bus + 1) << 20;
+            ecam_virt = vmm_map_physical(entry->base, size,
+                                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+            if (!ecam_virt) {
+                LOG_ERROR("PCI: failed to map ECAM at 0x%llx", entry->base);
+                return;
+            }
+            memset(ecam_mapped, 0xFF, sizeof(ecam_mapped));
+        }
+
+        ecam_phys = entry->base;
+        ecam_start = entry->start_bus;
+        ecam_end = entry->end_bus;
+        LOG_INFO("PCI: ECAM at 0x%llx for buses %u-%u", ecam_phys, ecam_start, ecam_end);
+        return;
+    }
 }
 
 // Scan for PCI devices
@@ -94,16 +213,25 @@ static void pci_scan_bus(uint8_t bus) {
 
 // Initialize PCI subsystem
 void pci_init(void) {
+    // The boot stage scans once, drivers calling this again find the devices already there,
+    // even while another CPU is probing them
+    if (scanned) {
+        return;
+    }
     LOG_INFO_MSG("Initializing PCI Bus");
     
     // Reset device count
     detected_device_count = 0;
+
+    spinlock_init(&port_lock);
+    pci_ecam_init();
     
     // Scan all possible buses
     for (uint16_t bus = 0; bus < 256; bus++) {
         pci_scan_bus(bus);
     }
     
+    scanned = true;
     LOG_INFO("Total PCI devices detected: %d", detected_device_count);
 }
 
@@ -150,4 +278,175 @@ uint64_t pci_get_bar(const pci_device_t* device, uint8_t bar_index) {
     
     // 32-bit BAR
     return bar_low & 0xFFFFFFF0;
-}
\ No newline at end of file
+}
+
+// Offset of a capability in the function's list, 0 when it has none with the ID
+uint8_t pci_find_capability(const pci_device_t* device, uint8_t cap_id) {
+    if (!device) {
+        return 0;
+    }
+
+    uint32_t status = pci_read_config_dword(device->bus, device->device, device->function,
+                                            PCI_COMMAND) >> 16;
+    if (!(status & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+
+    uint8_t offset = pci_read_config_dword(device->bus, device->device, device->function,
+                                           PCI_CAPABILITY_LIST) & 0xFC;
+
+    // A broken list could loop, there is room for 48 capabilities at most
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        uint32_t header = pci_read_config_dword(device->bus, device->device, device->function,
+                                                offset);
+        if ((header & 0xFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+// Message address reaching the APIC ID, only 8 bits fit without interrupt remapping
+static bool msi_address(uint32_t apic_id, uint32_t *address) {
+    if (apic_id > 0xFF) {
+        LOG_WARN("PCI: APIC ID %u is out of MSI reach", apic_id);
+        return false;
+    }
+    *address = PCI_MSI_ADDRESS | (apic_id << PCI_MSI_DEST_SHIFT);
+    return true;
+}
+
+// Keep the function from also raising its INTx line
+static void disable_intx(const pci_device_t* device) {
+    uint32_t command = pci_read_config_dword(device->bus, device->device, device->function,
+                                             PCI_COMMAND);
+    pci_write_config_dword(device->bus, device->device, device->function, PCI_COMMAND,
+                           (command & 0xFFFF) | PCI_COMMAND_INTX_DISABLE);
+}
+
+// Deliver the function's single MSI message to vector on the CPU with the APIC ID. Called
+// again, it moves the interrupt to another CPU.
+bool pci_enable_msi(const pci_device_t* device, uint8_t vector, uint32_t apic_id) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSI);
+    uint32_t address;
+    if (!cap || !msi_address(apic_id, &address)) {
+        return false;
+    }
+
+    uint8_t bus = device->bus, dev = device->device, fn = device->function;
+    uint32_t header = pci_read_config_dword(bus, dev, fn, cap);
+    uint32_t control = header >> 16;
+
+    // Multiple message enable stays 0, the function gets the one vector
+    pci_write_config_dword(bus, dev, fn, cap, header & ~((PCI_MSI_ENABLE | (0x7 << 4)) << 16));
+
+    pci_write_config_dword(bus, dev, fn, cap + 4, address);
+    if (control & PCI_MSI_64BIT) {
+        pci_write_config_dword(bus, dev, fn, cap + 8, 0);
+        pci_write_config_dword(bus, dev, fn, cap + 12, vector);
+    } else {
+        pci_write_config_dword(bus, dev, fn, cap + 8, vector);
+    }
+
+    disable_intx(device);
+    pci_write_config_dword(bus, dev, fn, cap,
+                           (header & ~((0x7 << 4) << 16)) | (PCI_MSI_ENABLE << 16));
+    return true;
+}
+
+// Turn MSI off again
+void pci_disable_msi(const pci_device_t* device) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSI);
+    if (!cap) {
+        return;
+    }
+
+    uint32_t header = pci_read_config_dword(device->bus, device->device, device->function, cap);
+    pci_write_config_dword(device->bus, device->device, device->function, cap,
+                           header & ~(PCI_MSI_ENABLE << 16));
+}
+
+// Map the MSI-X table and enable MSI-X with every entry masked
+bool pci_msix_init(const pci_device_t* device, pci_msix_t* msix) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSIX);
+    if (!cap || !msix) {
+        return false;
+    }
+
+    uint8_t bus = device->bus, dev = device->device, fn = device->function;
+    uint32_t header = pci_read_config_dword(bus, dev, fn, cap);
+    uint32_t location = pci_read_config_dword(bus, dev, fn, cap + 4);
+    uint16_t entries = ((header >> 16) & PCI_MSIX_SIZE_MASK) + 1;
+
+    uint64_t bar = pci_get_bar(device, location & PCI_MSIX_BIR_MASK);
+    if (!bar) {
+        return false;
+    }
+
+    // The table need not start on a page
+    uint64_t phys = bar + (location & ~PCI_MSIX_BIR_MASK);
+    uint64_t page = phys & ~(uint64_t)(PAGE_SIZE_4K - 1);
+    size_t size = (phys - page) + (size_t)entries * PCI_MSIX_ENTRY_SIZE;
+    uint8_t *mapping = vmm_map_physical(page, size,
+                                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!mapping) {
+        LOG_ERROR("PCI: failed to map the MSI-X table at 0x%llx", phys);
+        return false;
+    }
+
+    msix->table = (volatile uint32_t *)(mapping + (phys - page));
+    msix->entries = entries;
+
+    // Everything stays masked by the function mask while the entries are masked one by one
+    pci_write_config_dword(bus, dev, fn, cap,
+                           header | ((PCI_MSIX_ENABLE | PCI_MSIX_FUNCTION_MASK) << 16));
+    for (uint16_t i = 0; i < entries; i++) {
+        msix->table[i * 4 + 3] |= PCI_MSIX_ENTRY_MASKED;
+    }
+
+    disable_intx(device);
+    pci_write_config_dword(bus, dev, fn, cap,
+                           (header | (PCI_MSIX_ENABLE << 16)) & ~(PCI_MSIX_FUNCTION_MASK << 16));
+
+    LOG_DEBUG("PCI: %02x:%02x.%d MSI-X with %u entries", bus, dev, fn, entries);
+    return true;
+}
+
+// Point an MSI-X entry at vector on the CPU with the APIC ID and unmask it
+bool pci_msix_set(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint32_t apic_id) {
+    uint32_t address;
+    if (!msix || !msix->table || entry >= msix->entries || !msi_address(apic_id, &address)) {
+        return false;
+    }
+
+    // Masked while the message changes, the function never sends half an update
+    volatile uint32_t *slot = &msix->table[entry * 4];
+    slot[3] |= PCI_MSIX_ENTRY_MASKED;
+    slot[0] = address;
+    slot[1] = 0;
+    slot[2] = vector;
+    slot[3] &= ~PCI_MSIX_ENTRY_MASKED;
+    return true;
+}
+
+// Mask an MSI-X entry
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry) {
+    if (!msix || !msix->table || entry >= msix->entries) {
+        return;
+    }
+    msix->table[entry * 4 + 3] |= PCI_MSIX_ENTRY_MASKED;
+}
+
+// Get PCI statistics
+void pci_get_stats(pci_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->devices = detected_device_count;
+    stats->ecam = ecam_virt != NULL;
+    stats->ecam_base = ecam_phys;
+    stats->ecam_start_bus = ecam_start;
+    stats->ecam_end_bus = ecam_end;
+}
@@ -24,6 +24,32 @@
 #define PCI_BASE_ADDRESS_3   0x1C
 #define PCI_BASE_ADDRESS_4   0x20
 #define PCI_BASE_ADDRESS_5   0x24
+#define PCI_CAPABILITY_LIST  0x34
+#define PCI_INTERRUPT_LINE   0x3C
+
+// Command and status bits
+#define PCI_COMMAND_INTX_DISABLE (1U << 10)
+#define PCI_STATUS_CAP_LIST      (1U << 4)
+
+// Capability IDs
+#define PCI_CAP_MSI          0x05
+#define PCI_CAP_MSIX         0x11
+
+// MSI message control, the upper half of the capability's first dword
+#define PCI_MSI_ENABLE       (1U << 0)
+#define PCI_MSI_64BIT        (1U << 7)
+
+// MSI-X message control, table entries and vector control
+#define PCI_MSIX_ENABLE         (1U << 15)
+#define PCI_MSIX_FUNCTION_MASK  (1U << 14)
+#define PCI_MSIX_SIZE_MASK      0x7FF       // Table entries minus one
+#define PCI_MSIX_BIR_MASK       0x7         // BAR holding the table, the rest is its offset
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_MASKED   (1U << 0)
+
+// Message address of fixed, edge triggered delivery to one local APIC in physical mode
+#define PCI_MSI_ADDRESS         0xFEE00000U
+#define PCI_MSI_DEST_SHIFT      12
 
 // PCI Device Structure
 typedef struct {
@@ -37,7 +63,22 @@ typedef struct {
     uint8_t prog_if;
 } pci_device_t;
 
-// Initialize PCI subsystem
+// MSI-X table of a function, mapped by pci_msix_init
+typedef struct {
+    volatile uint32_t *table;
+    uint16_t entries;
+} pci_msix_t;
+
+// PCI statistics
+typedef struct {
+    uint16_t devices;
+    bool ecam;                      // Configuration space is memory mapped
+    uint64_t ecam_base;
+    uint8_t ecam_start_bus;
+    uint8_t ecam_end_bus;
+} pci_stats_t;
+
+// Initialize PCI subsystem, scanning the buses on the first call only
 void pci_init(void);
 
 // Read 32-bit value from PCI configuration space
@@ -55,4 +96,26 @@ bool pci_find_device_by_class(uint8_t class_code, uint8_t subclass,
 // Get Base Address Register (BAR) value
 uint64_t pci_get_bar(const pci_device_t* device, uint8_t bar_index);
 
+// Offset of a capability in the function's list, 0 when it has none with the ID
+uint8_t pci_find_capability(const pci_device_t* device, uint8_t cap_id);
+
+// Deliver the function's single MSI message to vector on the CPU with the APIC ID. Called
+// again, it moves the interrupt to another CPU.
+bool pci_enable_msi(const pci_device_t* device, uint8_t vector, uint32_t apic_id);
+
+// Turn MSI off again
+void pci_disable_msi(const pci_device_t* device);
+
+// Map the MSI-X table and enable MSI-X with every entry masked
+bool pci_msix_init(const pci_device_t* device, pci_msix_t* msix);
+
+// Point an MSI-X entry at vector on the CPU with the APIC ID and unmask it
+bool pci_msix_set(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint32_t apic_id);
+
+// Mask an MSI-X entry
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry);
+
+// Get PCI statistics
+void pci_get_stats(pci_stats_t* stats);
+
 #endif // PCI_H
\ No newline at end of file
@@ -1,3 +1,5 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/pic/pic.h>
 #include <lib/io.h>
 #include <utils/log.h>
@@ -1,3 +1,5 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/serial/serial.h>
 
 bool serial_init(uint16_t port, uint16_t baud_divisor) {
@@ -46,6 +48,21 @@ void serial_write_byte(uint16_t port, uint8_t data) {
     outb(port + SERIAL_DATA, data);
 }
 
+// Write a byte without waiting, the caller knows the transmit FIFO has room for it
+void serial_push_byte(uint16_t port, uint8_t data) {
+    outb(port + SERIAL_DATA, data);
+}
+
+// Raise an interrupt whenever the transmit FIFO runs empty
+void serial_set_tx_interrupt(uint16_t port, bool enabled) {
+    outb(port + SERIAL_INT_EN, enabled ? SERIAL_INT_TX_EMPTY : 0x00);
+}
+
+// Read the pending interrupt cause, which also acknowledges a transmit interrupt
+uint8_t serial_interrupt_id(uint16_t port) {
+    return inb(port + SERIAL_INT_ID);
+}
+
 void serial_write_string(uint16_t port, const char *str) {
     if (!str) {
         return;
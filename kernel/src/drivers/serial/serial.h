@@ -21,10 +21,19 @@
 #define SERIAL_MODEM_STAT 6
 #define SERIAL_SCRATCH    7
 
+// Interrupt identification, read at the FIFO control offset
+#define SERIAL_INT_ID     2
+
 // Status flags
 #define SERIAL_LINE_DATA_READY 0x01
 #define SERIAL_LINE_THR_EMPTY  0x20
 
+// Interrupt enable bits
+#define SERIAL_INT_TX_EMPTY    0x02
+
+// Bytes the transmit FIFO takes once it reports empty
+#define SERIAL_FIFO_DEPTH      16
+
 // Baud rate divisors
 #define SERIAL_BAUD_115200 1
 #define SERIAL_BAUD_57600  2
@@ -35,6 +44,9 @@
 bool serial_init(uint16_t port, uint16_t baud_divisor);
 bool serial_is_transmit_ready(uint16_t port);
 void serial_write_byte(uint16_t port, uint8_t data);
+void serial_push_byte(uint16_t port, uint8_t data);
+void serial_set_tx_interrupt(uint16_t port, bool enabled);
+uint8_t serial_interrupt_id(uint16_t port);
 void serial_write_string(uint16_t port, const char *str);
 void serial_write_hex(uint16_t port, uint64_t value, int num_digits);
 bool serial_is_data_ready(uint16_t port);
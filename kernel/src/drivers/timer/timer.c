@@ -1,61 +1,496 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_DRIVERS
+
 #include <drivers/timer/timer.h>
-#include <drivers/pic/pic.h>
+#include <drivers/apic/lapic.h>
 #include <core/idt.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/wait.h>
 #include <lib/io.h>
 #include <utils/log.h>
+#include <lib/string.h>
 #include <stddef.h>
 
-// Global timer tick counter
+#define NS_PER_SEC          1000000000ULL
+#define WHEEL_MASK          (TIMER_WHEEL_SIZE - 1)
+
+// Per-CPU timer wheel, level 0 holds events due within TIMER_WHEEL_SIZE wheel ticks
+// and every higher level is TIMER_WHEEL_SIZE times coarser
+typedef struct {
+    spinlock_t lock;
+    timer_event_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    uint64_t now;                       // First wheel tick not yet processed
+    uint32_t count;                     // Pending events
+    uint64_t programmed_ns;             // Next clockevent interrupt
+    timer_event_t tick;                 // Periodic scheduler tick
+    uint64_t ticks;
+    bool tick_due;                      // Tick fired, run the callback once the wheel is done
+    bool idle;                          // Tick stopped by timer_idle_enter
+} timer_base_t;
+
+static timer_base_t bases[MAX_CPUS];
+
+// Clocksource, the TSC scaled with 32.32 fixed point multipliers
+static bool tsc_ok = false;
+static bool tsc_invariant = false;
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_boot = 0;
+static uint64_t tsc_ns_mult = 0;        // Nanoseconds per TSC cycle
+static uint64_t ns_tsc_mult = 0;        // TSC cycles per nanosecond
+
+// LAPIC timer rate at divide-by-16
+static uint64_t lapic_hz = 0;
+static uint64_t ns_lapic_mult = 0;
+
+// Clockevent and tick configuration
+static bool initialized = false;
+static timer_event_mode_t mode = TIMER_EVENT_PIT;
+static uint32_t tick_rate = 0;
+static uint64_t tick_period_ns = 0;
+
+// PIT interrupts, the clocksource when there is no TSC
 static volatile uint64_t timer_ticks = 0;
+static uint64_t pit_ticks_base = 0;
+static uint64_t pit_ns_base = 0;
 
 // Registered callback function
 static timer_callback_t timer_callback = NULL;
 
-// Timer interrupt handler
+// Statistics
+static uint64_t stat_ticks = 0;
+static uint64_t stat_interrupts = 0;
+static uint64_t stat_events_fired = 0;
+static uint64_t stat_cascades = 0;
+static uint64_t stat_idle_entries = 0;
+
+// Scale a count by a 32.32 fixed point multiplier
+static inline uint64_t scale(uint64_t value, uint64_t mult) {
+    return (uint64_t)(((unsigned __int128)value * mult) >> 32);
+}
+
+// Multiplier converting nanoseconds to cycles of a clock running at hz
+static uint64_t ns_to_cycles_mult(uint64_t hz) {
+    return ((hz / 1000) << 32) / 1000000;
+}
+
+// Measure the TSC and LAPIC timer rates against PIT channel 2
+static void calibrate(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    bool has_tsc = (edx & CPUID_1_EDX_TSC) != 0;
+
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpu_cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = (edx & CPUID_80000007_EDX_INVARIANT_TSC) != 0;
+    }
+
+    uint64_t flags = cpu_irq_save();
+
+    // Gate channel 2 on with the speaker off, then count down once in mode 0
+    outb(PIT_CHANNEL2_GATE, (inb(PIT_CHANNEL2_GATE) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0);
+    uint32_t count = PIT_FREQUENCY * TIMER_CALIBRATE_MS / 1000;
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+    if (lapic_available()) {
+        lapic_timer_setup(false);
+        lapic_timer_oneshot(0xFFFFFFFF);
+    }
+    uint64_t start = has_tsc ? cpu_rdtsc() : 0;
+
+    // OUT goes high on terminal count
+    while (!(inb(PIT_CHANNEL2_GATE) & 0x20)) {
+        __asm__ volatile("pause");
+    }
+
+    uint64_t end = has_tsc ? cpu_rdtsc() : 0;
+    if (lapic_available()) {
+        lapic_hz = (uint64_t)(0xFFFFFFFF - lapic_timer_current()) * 1000 / TIMER_CALIBRATE_MS;
+        lapic_timer_stop();
+    }
+    cpu_irq_restore(flags);
+
+    if (has_tsc && end > start) {
+        tsc_hz = (end - start) * 1000 / TIMER_CALIBRATE_MS;
+        tsc_ns_mult = (NS_PER_SEC << 32) / tsc_hz;
+        ns_tsc_mult = ns_to_cycles_mult(tsc_hz);
+        tsc_boot = start;
+        tsc_ok = true;
+    }
+    if (lapic_hz) {
+        ns_lapic_mult = ns_to_cycles_mult(lapic_hz);
+    }
+}
+
+// Get uptime in nanoseconds
+uint64_t timer_get_uptime_ns(void) {
+    if (tsc_ok) {
+        return scale(cpu_rdtsc() - tsc_boot, tsc_ns_mult);
+    }
+    if (!tick_period_ns) {
+        return 0;
+    }
+    return pit_ns_base + (timer_ticks - pit_ticks_base) * tick_period_ns;
+}
+
+// Get the TSC clocksource parameters, user mode clocks scale the TSC the same way
+bool timer_get_tsc_clock(uint64_t *tsc_at_boot, uint64_t *ns_mult) {
+    if (!tsc_ok) {
+        return false;
+    }
+    *tsc_at_boot = tsc_boot;
+    *ns_mult = tsc_ns_mult;
+    return true;
+}
+
+// Wheel tick an uptime falls in
+static inline uint64_t wheel_tick(uint64_t ns) {
+    return ns >> TIMER_WHEEL_SHIFT;
+}
+
+// Link an event at the head of a slot list
+static void list_push(timer_event_t **head, timer_event_t *event) {
+    event->next = *head;
+    if (event->next) {
+        event->next->pprev = &event->next;
+    }
+    *head = event;
+    event->pprev = head;
+}
+
+// Unlink an event from whichever list holds it
+static void list_unlink(timer_event_t *event) {
+    *event->pprev = event->next;
+    if (event->next) {
+        event->next->pprev = event->pprev;
+    }
+    event->next = NULL;
+    event->pprev = NULL;
+}
+
+// Move a slot list onto a local head so it can be walked with the slot reused
+static timer_event_t *list_detach(timer_event_t **head, timer_event_t **local) {
+    *local = *head;
+    *head = NULL;
+    if (*local) {
+        (*local)->pprev = local;
+    }
+    return *local;
+}
+
+// Queue an event on the level whose range covers its distance from now
+static void wheel_insert(timer_base_t *base, timer_event_t *event) {
+    // Round up so an event never fires before its expiry
+    uint64_t when = (event->expires_ns + (1ULL << TIMER_WHEEL_SHIFT) - 1) >> TIMER_WHEEL_SHIFT;
+    if (when < base->now) {
+        when = base->now;
+    }
+
+    // Beyond the top level the event parks in its last slot and is requeued from there
+    uint64_t delta = when - base->now;
+    if (delta >= (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))) {
+        when = base->now + (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+        delta = when - base->now;
+    }
+
+    uint32_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_WHEEL_BITS))) {
+        level++;
+    }
+
+    uint32_t slot = (when >> (level * TIMER_WHEEL_BITS)) & WHEEL_MASK;
+    list_push(&base->slots[level][slot], event);
+    base->count++;
+}
+
+// Requeue the events of the higher level slot now points at, they move down a level or more
+static void wheel_cascade(timer_base_t *base, uint32_t level) {
+    uint32_t slot = (base->now >> (level * TIMER_WHEEL_BITS)) & WHEEL_MASK;
+    timer_event_t *local;
+    list_detach(&base->slots[level][slot], &local);
+
+    while (local) {
+        timer_event_t *event = local;
+        list_unlink(event);
+        base->count--;
+        wheel_insert(base, event);
+        stat_cascades++;
+    }
+}
+
+// Fire every event due by now_ns, callbacks run with the wheel unlocked
+static void wheel_run(timer_base_t *base, uint64_t now_ns) {
+    uint64_t target = wheel_tick(now_ns);
+
+    spinlock_acquire(&base->lock);
+    while (base->now <= target) {
+        if (base->count == 0) {
+            base->now = target + 1;
+            break;
+        }
+
+        // Higher levels first so events they hand down can fall through to level 0
+        uint64_t n = base->now;
+        for (uint32_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((n & ((1ULL << (level * TIMER_WHEEL_BITS)) - 1)) == 0) {
+                wheel_cascade(base, level);
+            }
+        }
+
+        // Events added from a callback land at n + 1 or later
+        timer_event_t *local;
+        list_detach(&base->slots[0][n & WHEEL_MASK], &local);
+        base->now = n + 1;
+
+        if (!local) {
+            // Nothing due, skip to the next occupied slot or cascade boundary
+            uint64_t t = n + 1;
+            while (t <= target && (t & WHEEL_MASK) != 0 && !base->slots[0][t & WHEEL_MASK]) {
+                t++;
+            }
+            base->now = t;
+            continue;
+        }
+
+        // One at a time, a callback may cancel an event further down the list
+        while (local) {
+            timer_event_t *event = local;
+            list_unlink(event);
+            base->count--;
+            event->running = true;      // Before pending drops, a lockless cancel sees either
+            event->pending = false;
+            stat_events_fired++;
+
+            spinlock_release(&base->lock);
+            event->fn(event->arg);
+            spinlock_acquire(&base->lock);
+            event->running = false;
+        }
+    }
+    spinlock_release(&base->lock);
+}
+
+// Earliest uptime at which the wheel has work, a cascade point for higher levels
+static uint64_t wheel_next_expiry(timer_base_t *base) {
+    if (base->count == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t best = UINT64_MAX;
+    uint64_t n = base->now;
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint32_t shift = level * TIMER_WHEEL_BITS;
+        uint64_t pos = n >> shift;
+
+        // A higher level slot is handed down when now reaches its start, the
+        // slot now is in only counts if that has not happened yet
+        uint32_t first = (level == 0 || (n & ((1ULL << shift) - 1)) == 0) ? 0 : 1;
+        uint32_t last = level == 0 ? TIMER_WHEEL_SIZE - 1 : TIMER_WHEEL_SIZE;
+        for (uint32_t i = first; i <= last; i++) {
+            if (base->slots[level][(pos + i) & WHEEL_MASK]) {
+                uint64_t when = (pos + i) << shift;
+                if (when < best) {
+                    best = when;
+                }
+                break;
+            }
+        }
+    }
+    return best == UINT64_MAX ? UINT64_MAX : best << TIMER_WHEEL_SHIFT;
+}
+
+// Arm the executing CPU's LAPIC timer for the next wheel event
+static void program_event(timer_base_t *base) {
+    if (mode == TIMER_EVENT_PIT) {
+        return;
+    }
+
+    uint64_t now = timer_get_uptime_ns();
+    spinlock_acquire(&base->lock);
+    uint64_t next = wheel_next_expiry(base);
+    if (next > now + TIMER_IDLE_MAX_NS) {
+        next = now + TIMER_IDLE_MAX_NS;
+    }
+    base->programmed_ns = next;
+    spinlock_release(&base->lock);
+
+    if (mode == TIMER_EVENT_LAPIC_DEADLINE) {
+        // A deadline already passed fires at once
+        lapic_timer_deadline(tsc_boot + scale(next, ns_tsc_mult));
+    } else {
+        uint64_t count = next > now ? scale(next - now, ns_lapic_mult) : 1;
+        lapic_timer_oneshot(count > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)count);
+    }
+}
+
+// Common interrupt work: expire events, rearm, then hand the tick to the scheduler
+static void timer_interrupt(timer_base_t *base) {
+    stat_interrupts++;
+    wheel_run(base, timer_get_uptime_ns());
+    program_event(base);
+
+    // Last, the callback may switch tasks and not return here for a while
+    if (base->tick_due) {
+        base->tick_due = false;
+        base->ticks++;
+        stat_ticks++;
+        if (timer_callback != NULL) {
+            timer_callback(base->ticks);
+        }
+    }
+}
+
+// PIT interrupt handler, the periodic fallback
 static void timer_interrupt_handler(struct interrupt_frame *frame) {
     (void)frame; // Unused parameter
-    
+
     // Increment the tick counter
     timer_ticks++;
-    
-    // Call the registered callback if available
-    if (timer_callback != NULL) {
-        timer_callback(timer_ticks);
+    bases[0].tick_due = true;
+    timer_interrupt(&bases[0]);
+}
+
+// LAPIC timer interrupt handler
+static void lapic_timer_handler(struct interrupt_frame *frame) {
+    (void)frame;
+
+    // EOI first, a task switch in the callback would otherwise hold it back
+    lapic_eoi();
+    timer_interrupt(&bases[cpu_current_id()]);
+}
+
+// Scheduler tick event, rearms itself one period later
+static void tick_event(void *arg) {
+    timer_base_t *base = arg;
+    base->tick_due = true;
+
+    // After a long stall skip the missed ticks instead of firing them back to back
+    uint64_t next = base->tick.expires_ns + tick_period_ns;
+    uint64_t now = timer_get_uptime_ns();
+    if (next <= now) {
+        next = now + tick_period_ns;
     }
+    timer_event_add(&base->tick, next);
 }
 
-// Initialize the timer with the specified frequency
-void timer_init(uint32_t frequency) {
-    LOG_INFO("Initializing timer with frequency %d Hz", frequency);
-    
-    // Set up the timer frequency
-    timer_set_frequency(frequency);
-    
-    // Register our timer interrupt handler
-    idt_register_handler(IRQ_TIMER, timer_interrupt_handler);
-    
-    // Unmask the timer IRQ
-    pic_unmask_irq(0);
-    
-    LOG_INFO_MSG("Timer initialized");
+// Start the LAPIC clockevent and scheduler tick of the executing CPU
+static void start_cpu(void) {
+    timer_base_t *base = &bases[cpu_current_id()];
+    uint64_t now = timer_get_uptime_ns();
+
+    base->now = wheel_tick(now);
+    base->programmed_ns = UINT64_MAX;
+    base->idle = false;
+    lapic_timer_setup(mode == TIMER_EVENT_LAPIC_DEADLINE);
+
+    timer_event_init(&base->tick, tick_event, base);
+    timer_event_add(&base->tick, now + tick_period_ns);
 }
 
-// Set the timer frequency
-void timer_set_frequency(uint32_t frequency) {
+// Program PIT channel 0 as a periodic interrupt
+static void pit_set_frequency(uint32_t frequency) {
     // Calculate divisor
     uint32_t divisor = PIT_FREQUENCY / frequency;
-    
+
     // Send command: Channel 0, Access mode: lobyte/hibyte, Mode 3 (square wave)
     outb(PIT_COMMAND, 0x36);
-    
+
     // Send divisor (low byte first, then high byte)
     outb(PIT_CHANNEL0, divisor & 0xFF);
     outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
 }
 
-// Get the current tick count
+// Initialize the timer with the specified frequency, later calls only change the tick rate
+void timer_init(uint32_t frequency) {
+    if (initialized) {
+        timer_set_frequency(frequency);
+        return;
+    }
+
+    LOG_INFO("Initializing timer with frequency %d Hz", frequency);
+
+    memset(bases, 0, sizeof(bases));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spinlock_init(&bases[i].lock);
+        bases[i].programmed_ns = UINT64_MAX;
+    }
+
+    calibrate();
+    if (tsc_ok) {
+        LOG_INFO("Timer: TSC clocksource at %u kHz%s", (uint32_t)(tsc_hz / 1000),
+                 tsc_invariant ? "" : " (not invariant, may drift with power states)");
+    }
+
+    // The LAPIC needs the TSC to turn wheel expiries into timer counts
+    if (tsc_ok && lapic_available()) {
+        if (lapic_has_tsc_deadline()) {
+            mode = TIMER_EVENT_LAPIC_DEADLINE;
+        } else if (lapic_hz) {
+            mode = TIMER_EVENT_LAPIC_ONESHOT;
+        }
+    }
+
+    timer_set_frequency(frequency);
+    idt_register_handler(IRQ_TIMER, timer_interrupt_handler);
+    bases[0].now = wheel_tick(timer_get_uptime_ns());
+
+    if (mode == TIMER_EVENT_PIT) {
+        // Unmask the timer IRQ
+        irq_unmask(0);
+        LOG_INFO_MSG("Timer: PIT clockevent, periodic tick on the BSP only");
+    } else {
+        idt_register_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+        irq_mask(0);
+        start_cpu();
+        LOG_INFO("Timer: LAPIC clockevent in %s mode, timer at %u kHz",
+                 mode == TIMER_EVENT_LAPIC_DEADLINE ? "TSC-deadline" : "one-shot",
+                 (uint32_t)(lapic_hz / 1000));
+    }
+
+    initialized = true;
+    LOG_INFO_MSG("Timer initialized");
+}
+
+// Start the clockevent of an application processor
+bool timer_init_cpu(void) {
+    lapic_init_cpu();
+    if (!initialized || mode == TIMER_EVENT_PIT) {
+        return false;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    start_cpu();
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// Set the scheduler tick rate
+void timer_set_frequency(uint32_t frequency) {
+    if (frequency == 0) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+
+    // Keep the tick based uptime continuous across the change
+    pit_ns_base = timer_get_uptime_ns();
+    pit_ticks_base = timer_ticks;
+
+    tick_rate = frequency;
+    tick_period_ns = NS_PER_SEC / frequency;
+
+    // LAPIC ticks pick the new period up when they next rearm
+    if (mode == TIMER_EVENT_PIT) {
+        pit_set_frequency(frequency);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Scheduler ticks since boot at the current rate
 uint64_t timer_get_ticks(void) {
-    return timer_ticks;
+    return tick_period_ns ? timer_get_uptime_ns() / tick_period_ns : 0;
 }
 
 // Register a callback function for timer interrupts
@@ -65,19 +500,149 @@ void timer_register_callback(timer_callback_t callback) {
 
 // Get uptime in milliseconds
 uint64_t timer_get_uptime_ms(void) {
-    // This assumes a 100Hz timer.
-    return timer_ticks * 10; // 10ms per tick at 100Hz
+    return timer_get_uptime_ns() / 1000000;
+}
+
+// Prepare an event before its first use
+void timer_event_init(timer_event_t *event, timer_event_fn_t fn, void *arg) {
+    memset(event, 0, sizeof(*event));
+    event->fn = fn;
+    event->arg = arg;
+}
+
+// Arm an event to fire at an absolute uptime, on the executing CPU's wheel
+void timer_event_add(timer_event_t *event, uint64_t expires_ns) {
+    uint64_t flags = cpu_irq_save();
+    timer_event_cancel(event);
+
+    // With the PIT only the BSP gets timer interrupts
+    uint32_t cpu = mode == TIMER_EVENT_PIT ? 0 : cpu_current_id();
+    timer_base_t *base = &bases[cpu];
+
+    spinlock_acquire(&base->lock);
+    event->expires_ns = expires_ns;
+    event->cpu = cpu;
+    event->pending = true;
+    wheel_insert(base, event);
+    bool earlier = expires_ns < base->programmed_ns;
+    spinlock_release(&base->lock);
+
+    // Inside the interrupt handler the wheel is reprogrammed once it is done
+    if (earlier) {
+        program_event(base);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Disarm an event, returns false if it was not pending. Its owner may reuse the entry once
+// this returns, so a callback that already started is waited for.
+bool timer_event_cancel(timer_event_t *event) {
+    if (!event->pending && !event->running) {
+        return false;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    timer_base_t *base = &bases[event->cpu];
+    spinlock_acquire(&base->lock);
+
+    bool was_pending = event->pending;
+    if (was_pending) {
+        list_unlink(event);
+        base->count--;
+        event->pending = false;
+    }
+
+    spinlock_release(&base->lock);
+
+    // Callbacks run on their wheel's CPU with interrupts off, one cancelling (or rearming)
+    // its own event there must not wait for itself
+    while (event->running && event->cpu != cpu_current_id()) {
+        __asm__ volatile("pause");
+    }
+    cpu_irq_restore(flags);
+    return was_pending;
+}
+
+// Stop the scheduler tick of an idle CPU and program its next event instead
+void timer_idle_enter(void) {
+    if (mode == TIMER_EVENT_PIT) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    timer_base_t *base = &bases[cpu_current_id()];
+    if (!base->idle) {
+        base->idle = true;
+        stat_idle_entries++;
+        timer_event_cancel(&base->tick);
+        program_event(base);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Catch up on expired events and restart the tick after idling
+void timer_idle_exit(void) {
+    if (mode == TIMER_EVENT_PIT) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    timer_base_t *base = &bases[cpu_current_id()];
+    if (base->idle) {
+        base->idle = false;
+        uint64_t now = timer_get_uptime_ns();
+        wheel_run(base, now);
+        timer_event_add(&base->tick, now + tick_period_ns);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Block the current task until an uptime, busy-waiting where it cannot sleep
+static void sleep_until(uint64_t deadline_ns) {
+    // Nobody wakes this queue, only the deadline ends the wait
+    wait_queue_t queue;
+    wait_queue_init(&queue);
+    wait_event_deadline(&queue, NULL, NULL, deadline_ns);
 }
 
 // Sleep for a specified number of milliseconds
 void timer_sleep(uint32_t ms) {
-    // Calculate how many ticks we need to wait
-    // This assumes a 100Hz timer.
-    uint64_t target_ticks = timer_ticks + (ms / 10);
-    
-    // Wait until we reach the target tick count
-    while (timer_ticks < target_ticks) {
-        // Yield CPU and wait for next timer interrupt
-        asm volatile("hlt");
-    }
-}
\ No newline at end of file
+    sleep_until(timer_get_uptime_ns() + (uint64_t)ms * 1000000);
+}
+
+// Sleep for a specified number of microseconds
+void timer_sleep_us(uint64_t us) {
+    sleep_until(timer_get_uptime_ns() + us * 1000);
+}
+
+// Get timer statistics
+void timer_get_stats(timer_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->mode = mode;
+    stats->tsc_clocksource = tsc_ok;
+    stats->invariant_tsc = tsc_invariant;
+    stats->tsc_hz = tsc_hz;
+    stats->lapic_hz = lapic_hz;
+    stats->tick_rate = tick_rate;
+    stats->ticks = stat_ticks;
+    stats->interrupts = stat_interrupts;
+    stats->events_fired = stat_events_fired;
+    stats->cascades = stat_cascades;
+    stats->idle_entries = stat_idle_entries;
+}
+
+// Print timer statistics
+void timer_print_stats(void) {
+    static const char *mode_names[] = { "PIT", "LAPIC one-shot", "LAPIC TSC-deadline" };
+
+    LOG_INFO("Timer Statistics:");
+    LOG_INFO("  Clockevent: %s, tick rate: %u Hz", mode_names[mode], tick_rate);
+    LOG_INFO("  Clocksource: %s, TSC: %u kHz, LAPIC timer: %u kHz",
+             tsc_ok ? "TSC" : "PIT ticks", (uint32_t)(tsc_hz / 1000), (uint32_t)(lapic_hz / 1000));
+    LOG_INFO("  Interrupts: %u, scheduler ticks: %u, tickless idle entries: %u",
+             (uint32_t)stat_interrupts, (uint32_t)stat_ticks, (uint32_t)stat_idle_entries);
+    LOG_INFO("  Events fired: %u, cascaded: %u", (uint32_t)stat_events_fired, (uint32_t)stat_cascades);
+}
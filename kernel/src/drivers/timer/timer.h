@@ -10,16 +10,95 @@
 #define PIT_CHANNEL1        0x41       // Channel 1 data port
 #define PIT_CHANNEL2        0x42       // Channel 2 data port
 #define PIT_COMMAND         0x43       // Command register port
+#define PIT_CHANNEL2_GATE   0x61       // Bit 0 gates channel 2, bit 5 reads its output
+
+// TSC and LAPIC timer calibration against PIT channel 2
+#define TIMER_CALIBRATE_MS  10
+
+// Timer wheel geometry, a level n slot spans 1 << (TIMER_WHEEL_SHIFT + n * TIMER_WHEEL_BITS) ns
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_SHIFT   17          // ~131 us at level 0, ~36 minutes of range in total
+
+// Longest a tickless CPU sleeps without an event to wake it
+#define TIMER_IDLE_MAX_NS   1000000000ULL
+
+// Device driving the timer interrupts
+typedef enum {
+    TIMER_EVENT_PIT,                    // Periodic IRQ0 on the BSP only
+    TIMER_EVENT_LAPIC_ONESHOT,          // Per-CPU one-shot LAPIC timer
+    TIMER_EVENT_LAPIC_DEADLINE          // Per-CPU LAPIC timer in TSC-deadline mode
+} timer_event_mode_t;
+
+// Timer event callback, runs in interrupt context on the CPU the event was added on
+typedef void (*timer_event_fn_t)(void *arg);
+
+// One-shot timer event, owned by the caller and linked into a per-CPU wheel while pending
+typedef struct timer_event {
+    uint64_t expires_ns;                // Uptime at which fn runs
+    timer_event_fn_t fn;
+    void *arg;
+    struct timer_event *next;           // Wheel slot list
+    struct timer_event **pprev;         // Link pointing at this event
+    uint32_t cpu;                       // Wheel the event is queued on
+    volatile bool pending;
+    volatile bool running;              // Callback executing, cancel waits for it
+} timer_event_t;
+
+// Timer statistics
+typedef struct {
+    timer_event_mode_t mode;
+    bool tsc_clocksource;
+    bool invariant_tsc;
+    uint64_t tsc_hz;
+    uint64_t lapic_hz;
+    uint32_t tick_rate;
+    uint64_t ticks;                     // Scheduler ticks delivered on all CPUs
+    uint64_t interrupts;
+    uint64_t events_fired;
+    uint64_t cascades;                  // Events moved down a wheel level
+    uint64_t idle_entries;              // Times a CPU stopped its tick to idle
+} timer_stats_t;
 
 // Timer functions
 void timer_init(uint32_t frequency);
+bool timer_init_cpu(void);
 void timer_set_frequency(uint32_t frequency);
 uint64_t timer_get_ticks(void);
 void timer_sleep(uint32_t ms);
+void timer_sleep_us(uint64_t us);
 uint64_t timer_get_uptime_ms(void);
+uint64_t timer_get_uptime_ns(void);
+
+// Get the TSC reading at uptime 0 and the 32.32 nanoseconds per cycle multiplier,
+// false when the uptime is not TSC based
+bool timer_get_tsc_clock(uint64_t *tsc_at_boot, uint64_t *ns_mult);
 
 // Timer callback registration
 typedef void (*timer_callback_t)(uint64_t tick_count);
 void timer_register_callback(timer_callback_t callback);
 
-#endif // TIMER_H
\ No newline at end of file
+// Prepare an event before its first use
+void timer_event_init(timer_event_t *event, timer_event_fn_t fn, void *arg);
+
+// Arm an event to fire at an absolute uptime, rearming a pending event moves it
+void timer_event_add(timer_event_t *event, uint64_t expires_ns);
+
+// Disarm an event, returns false if it was not pending. A callback running on another CPU is
+// waited for, so the event may be reused once this returns (but not freed by its callback).
+bool timer_event_cancel(timer_event_t *event);
+
+// Stop the scheduler tick of an idle CPU and program its next event instead
+void timer_idle_enter(void);
+
+// Catch up on expired events and restart the tick after idling
+void timer_idle_exit(void);
+
+// Get timer statistics
+void timer_get_stats(timer_stats_t *stats);
+
+// Print timer statistics
+void timer_print_stats(void);
+
+#endif // TIMER_H
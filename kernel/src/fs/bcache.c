@@ -0,0 +1,629 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/bcache.h>
+#include <drivers/block/block.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <memory/slab.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/wait.h>
+#include <core/cpu.h>
+#include <utils/log.h>
+#include <utils/trace.h>
+#include <lib/string.h>
+
+// Cache state
+static bcache_buf_t *buffers = NULL;
+static size_t buffer_count = 0;
+static uint32_t cache_block_size = 0;
+static bcache_buf_t **hash_table = NULL;
+static size_t hash_mask = 0;
+static bcache_buf_t *lru_head = NULL;   // Most recently released
+static bcache_buf_t *lru_tail = NULL;   // Eviction candidate
+static uint32_t sectors_per_block = 0;
+static spinlock_t bcache_lock;
+static wait_queue_t io_wait;           // Borrowers waiting for a busy buffer
+static bool ready = false;
+
+// Backing pages for buffer data
+static void **data_pages = NULL;
+static size_t data_page_allocs = 0;
+static size_t pages_per_alloc = 0;
+
+// Statistics
+static size_t dirty_count = 0;
+static size_t stat_hits = 0;
+static size_t stat_misses = 0;
+static size_t stat_evictions = 0;
+static size_t stat_writebacks = 0;
+
+// bcache_lock is held with interrupts off, a holder preempted on its CPU would leave a fault
+// or system call taking the lock there spinning with interrupts off
+static uint64_t cache_lock(void) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&bcache_lock);
+    return flags;
+}
+
+static void cache_unlock(uint64_t flags) {
+    spinlock_release(&bcache_lock);
+    cpu_irq_restore(flags);
+}
+
+// Wait condition of a busy buffer
+static bool buffer_idle(void *arg) {
+    bcache_buf_t *buf = arg;
+    return !buf->busy;
+}
+
+// Hash a (drive, block) pair into a bucket index
+static inline size_t bcache_hash(uint8_t drive, uint32_t block_no) {
+    return ((block_no * 2654435761U) ^ ((uint32_t)drive << 24)) & hash_mask;
+}
+
+// Unlink a buffer from the LRU list
+static void lru_remove(bcache_buf_t *buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else if (lru_head == buf) {
+        lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else if (lru_tail == buf) {
+        lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
+
+// Put a buffer at the most recently used end of the LRU list
+static void lru_push_head(bcache_buf_t *buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = buf;
+    }
+    lru_head = buf;
+    if (!lru_tail) {
+        lru_tail = buf;
+    }
+}
+
+// Put a buffer at the eviction end of the LRU list
+static void lru_push_tail(bcache_buf_t *buf) {
+    buf->lru_next = NULL;
+    buf->lru_prev = lru_tail;
+    if (lru_tail) {
+        lru_tail->lru_next = buf;
+    }
+    lru_tail = buf;
+    if (!lru_head) {
+        lru_head = buf;
+    }
+}
+
+// Remove a buffer from its hash chain
+static void hash_remove(bcache_buf_t *buf) {
+    bcache_buf_t **link = &hash_table[bcache_hash(buf->drive, buf->block_no)];
+    while (*link) {
+        if (*link == buf) {
+            *link = buf->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    buf->hash_next = NULL;
+}
+
+// Find a cached buffer, bcache_lock must be held
+static bcache_buf_t *hash_lookup(uint8_t drive, uint32_t block_no) {
+    bcache_buf_t *buf = hash_table[bcache_hash(drive, block_no)];
+    while (buf) {
+        if (buf->block_no == block_no && buf->drive == drive) {
+            return buf;
+        }
+        buf = buf->hash_next;
+    }
+    return NULL;
+}
+
+// Write a dirty buffer back to disk, bcache_lock is held and dropped across the write.
+// Writes to the buffer meanwhile dirty it again.
+static bool writeback(bcache_buf_t *buf, uint64_t *flags) {
+    if (!buf->dirty || buf->busy) {
+        return !buf->dirty;
+    }
+
+    // Uncommitted journal contents stay in memory
+    if (buf->pinned) {
+        return false;
+    }
+
+    buf->dirty = false;
+    dirty_count--;
+    buf->busy = true;
+    cache_unlock(*flags);
+
+    bool ok = block_write(buf->drive, (uint64_t)buf->block_no * sectors_per_block, sectors_per_block, buf->data);
+
+    *flags = cache_lock();
+    buf->busy = false;
+    if (ok) {
+        stat_writebacks++;
+    } else {
+        LOG_ERROR("Buffer cache: failed to write back block %u", buf->block_no);
+        if (!buf->dirty) {
+            buf->dirty = true;
+            dirty_count++;
+        }
+    }
+    wait_wake_all(&io_wait);
+    return ok;
+}
+
+// Take the least recently used unreferenced clean buffer, bcache_lock must be held
+static bcache_buf_t *evict(void) {
+    for (bcache_buf_t *buf = lru_tail; buf; buf = buf->lru_prev) {
+        if (!buf->dirty && !buf->busy) {
+            lru_remove(buf);
+            if (buf->valid) {
+                hash_remove(buf);
+                stat_evictions++;
+            }
+            buf->valid = false;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+// Look up or claim a buffer for a block, bcache_lock is held. When every free buffer is
+// dirty the lock is dropped for a write-back pass.
+static bcache_buf_t *get_buffer(uint8_t drive, uint32_t block_no, uint64_t *flags) {
+    for (int attempt = 0; ; attempt++) {
+        bcache_buf_t *buf = hash_lookup(drive, block_no);
+        if (buf) {
+            stat_hits++;
+            if (buf->refcount++ == 0) {
+                lru_remove(buf);
+            }
+            return buf;
+        }
+
+        buf = evict();
+        if (buf) {
+            stat_misses++;
+            buf->drive = drive;
+            buf->block_no = block_no;
+            buf->refcount = 1;
+            buf->valid = false;
+            buf->dirty = false;
+            buf->pinned = false;
+
+            size_t bucket = bcache_hash(drive, block_no);
+            buf->hash_next = hash_table[bucket];
+            hash_table[bucket] = buf;
+            return buf;
+        }
+
+        if (attempt > 0 || dirty_count == 0) {
+            LOG_ERROR_MSG("Buffer cache: all buffers are in use");
+            return NULL;
+        }
+        cache_unlock(*flags);
+        bcache_sync();
+        *flags = cache_lock();
+    }
+}
+
+// Wait for the I/O on a borrowed buffer to finish, bcache_lock is held and dropped meanwhile
+static void wait_idle(bcache_buf_t *buf, uint64_t *flags) {
+    while (buf->busy) {
+        cache_unlock(*flags);
+        wait_event(&io_wait, buffer_idle, buf);
+        *flags = cache_lock();
+    }
+}
+
+// Free everything allocated by bcache_init
+static void release_memory(void) {
+    if (data_pages) {
+        for (size_t i = 0; i < data_page_allocs; i++) {
+            if (data_pages[i]) {
+                pmm_free_pages(data_pages[i], pages_per_alloc);
+            }
+        }
+        kfree(data_pages);
+        data_pages = NULL;
+    }
+    data_page_allocs = 0;
+
+    if (hash_table) {
+        kfree(hash_table);
+        hash_table = NULL;
+    }
+
+    if (buffers) {
+        kfree(buffers);
+        buffers = NULL;
+    }
+    buffer_count = 0;
+}
+
+// Set up the cache for a block size, sizing it from free memory
+bool bcache_init(uint32_t block_size) {
+    if (ready) {
+        bcache_shutdown();
+    }
+
+    if (block_size < BLOCK_SECTOR_SIZE || block_size % BLOCK_SECTOR_SIZE != 0) {
+        return false;
+    }
+
+    size_t count = (pmm_get_free_memory() / BCACHE_MEMORY_DIVISOR) / block_size;
+    if (count < BCACHE_MIN_BUFFERS) count = BCACHE_MIN_BUFFERS;
+    if (count > BCACHE_MAX_BUFFERS) count = BCACHE_MAX_BUFFERS;
+
+    // Small blocks share a page, large blocks get contiguous pages
+    size_t bufs_per_alloc = block_size < PMM_BLOCK_SIZE ? PMM_BLOCK_SIZE / block_size : 1;
+    pages_per_alloc = (block_size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+    count = (count + bufs_per_alloc - 1) / bufs_per_alloc * bufs_per_alloc;
+
+    size_t buckets = 1;
+    while (buckets < count) {
+        buckets <<= 1;
+    }
+
+    buffers = kzalloc(count * sizeof(bcache_buf_t));
+    hash_table = kzalloc(buckets * sizeof(bcache_buf_t*));
+    data_page_allocs = count / bufs_per_alloc;
+    data_pages = kzalloc(data_page_allocs * sizeof(void*));
+    if (!buffers || !hash_table || !data_pages) {
+        LOG_ERROR_MSG("Buffer cache: failed to allocate metadata");
+        release_memory();
+        return false;
+    }
+
+    buffer_count = count;
+    hash_mask = buckets - 1;
+    cache_block_size = block_size;
+    sectors_per_block = block_size / BLOCK_SECTOR_SIZE;
+    lru_head = NULL;
+    lru_tail = NULL;
+    dirty_count = 0;
+    spinlock_init(&bcache_lock);
+    wait_queue_init(&io_wait);
+
+    for (size_t i = 0; i < data_page_allocs; i++) {
+        data_pages[i] = pmm_alloc_pages(pages_per_alloc);
+        if (!data_pages[i]) {
+            LOG_ERROR_MSG("Buffer cache: failed to allocate buffer memory");
+            release_memory();
+            return false;
+        }
+
+        uint8_t *base = vmm_phys_to_virt((uint64_t)data_pages[i]);
+        for (size_t j = 0; j < bufs_per_alloc; j++) {
+            bcache_buf_t *buf = &buffers[i * bufs_per_alloc + j];
+            buf->data = base + j * block_size;
+            lru_push_head(buf);
+        }
+    }
+
+    ready = true;
+    LOG_INFO("Buffer cache: %u buffers of %u bytes, %u hash buckets",
+             (uint32_t)buffer_count, block_size, (uint32_t)buckets);
+    return true;
+}
+
+// Write back all dirty buffers and release the cache memory
+void bcache_shutdown(void) {
+    if (!ready) {
+        return;
+    }
+
+    bcache_sync();
+
+    for (size_t i = 0; i < buffer_count; i++) {
+        if (buffers[i].refcount > 0) {
+            LOG_WARN("Buffer cache: block %u still referenced at shutdown", buffers[i].block_no);
+        }
+    }
+
+    ready = false;
+    release_memory();
+}
+
+// Borrow a buffer holding the block, reading it from disk on a miss
+bcache_buf_t *bcache_read(uint8_t drive, uint32_t block_no) {
+    if (!ready) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+
+    bcache_buf_t *buf = get_buffer(drive, block_no, &flags);
+    if (buf) {
+        // Another borrower's read is in flight, when it failed this one tries again
+        wait_idle(buf, &flags);
+    }
+    if (buf && buf->valid) {
+        TRACE(TRACE_BCACHE_HIT, block_no, drive);
+    } else if (buf) {
+        TRACE(TRACE_BCACHE_MISS, block_no, drive);
+        buf->busy = true;
+        cache_unlock(flags);
+
+        bool ok = block_read(drive, (uint64_t)block_no * sectors_per_block, sectors_per_block, buf->data);
+
+        flags = cache_lock();
+        buf->busy = false;
+        buf->valid = ok;
+        wait_wake_all(&io_wait);
+
+        // The buffer goes with the last borrower, the others read it themselves
+        if (!ok) {
+            LOG_ERROR("Buffer cache: failed to read block %u", block_no);
+            if (--buf->refcount == 0) {
+                hash_remove(buf);
+                lru_push_tail(buf);
+            }
+            buf = NULL;
+        }
+    }
+
+    cache_unlock(flags);
+    return buf;
+}
+
+// Borrow a buffer for a block the caller will overwrite entirely
+bcache_buf_t *bcache_get(uint8_t drive, uint32_t block_no) {
+    if (!ready) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+    bcache_buf_t *buf = get_buffer(drive, block_no, &flags);
+    if (buf) {
+        // The caller supplies the contents, so the buffer is valid from here on
+        wait_idle(buf, &flags);
+        buf->valid = true;
+    }
+    cache_unlock(flags);
+    return buf;
+}
+
+// Mark a borrowed buffer as modified
+void bcache_mark_dirty(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (!buf->dirty) {
+        buf->dirty = true;
+        dirty_count++;
+    }
+    cache_unlock(flags);
+}
+
+// Return a borrowed buffer
+void bcache_release(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+
+    if (buf->refcount == 0) {
+        cache_unlock(flags);
+        LOG_WARN("Buffer cache: block %u released too many times", buf->block_no);
+        return;
+    }
+
+    if (--buf->refcount == 0) {
+        lru_push_head(buf);
+    }
+
+    bool flush = dirty_count >= buffer_count / BCACHE_DIRTY_DIVISOR;
+    cache_unlock(flags);
+
+    // Too many dirty buffers, write them back in one pass
+    if (flush) {
+        bcache_sync();
+    }
+}
+
+// Keep a borrowed buffer away from its disk location
+void bcache_pin(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (!buf->pinned) {
+        buf->pinned = true;
+        buf->refcount++;
+    }
+    cache_unlock(flags);
+}
+
+// Drop a pin and let the buffer be written back
+void bcache_unpin(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (!buf->pinned) {
+        cache_unlock(flags);
+        return;
+    }
+    buf->pinned = false;
+    if (!buf->dirty) {
+        buf->dirty = true;
+        dirty_count++;
+    }
+    cache_unlock(flags);
+
+    bcache_release(buf);
+}
+
+// Write back the dirty buffers of one drive as a single merged batch, bcache_lock is held and
+// dropped across the writes. The buffers are busy and clean meanwhile, writes dirty them again.
+static bool sync_drive(uint8_t drive, block_request_t *requests, bcache_buf_t **batch, size_t max,
+                       uint64_t *flags) {
+    size_t count = 0;
+    for (size_t i = 0; i < buffer_count && count < max; i++) {
+        bcache_buf_t *buf = &buffers[i];
+        if (buf->valid && buf->dirty && !buf->pinned && !buf->busy && buf->drive == drive) {
+            requests[count].sector = (uint64_t)buf->block_no * sectors_per_block;
+            requests[count].count = sectors_per_block;
+            requests[count].buffer = buf->data;
+            buf->dirty = false;
+            buf->busy = true;
+            batch[count++] = buf;
+        }
+    }
+
+    if (count == 0) {
+        return true;
+    }
+    dirty_count -= count;
+    cache_unlock(*flags);
+
+    bool ok = block_submit(drive, requests, count, true);
+
+    *flags = cache_lock();
+    for (size_t i = 0; i < count; i++) {
+        batch[i]->busy = false;
+        if (!ok && !batch[i]->dirty) {
+            batch[i]->dirty = true;
+            dirty_count++;
+        }
+    }
+    if (ok) {
+        stat_writebacks += count;
+    }
+    wait_wake_all(&io_wait);
+    return ok;
+}
+
+// Write back all dirty buffers, adjacent blocks go out as single commands
+bool bcache_sync(void) {
+    if (!ready) {
+        return false;
+    }
+
+    uint64_t flags = cache_lock();
+
+    if (dirty_count == 0) {
+        cache_unlock(flags);
+        return true;
+    }
+
+    // Batches are sized once, buffers dirtied meanwhile go out in the next round
+    size_t max = dirty_count;
+    block_request_t *requests = kmalloc(max * sizeof(block_request_t));
+    bcache_buf_t **batch = kmalloc(max * sizeof(bcache_buf_t*));
+
+    bool ok = true;
+    if (requests && batch) {
+        // Dirty buffers of the first drive found each round
+        while (ok && dirty_count > 0) {
+            bcache_buf_t *first = NULL;
+            for (size_t i = 0; i < buffer_count && !first; i++) {
+                if (buffers[i].valid && buffers[i].dirty && !buffers[i].pinned && !buffers[i].busy) {
+                    first = &buffers[i];
+                }
+            }
+            if (!first) {
+                break;
+            }
+            ok = sync_drive(first->drive, requests, batch, max, &flags);
+        }
+    } else {
+        // No memory for a batch, fall back to one block at a time
+        for (size_t i = 0; i < buffer_count && dirty_count > 0; i++) {
+            if (buffers[i].valid && !buffers[i].pinned && !writeback(&buffers[i], &flags)) {
+                ok = false;
+            }
+        }
+    }
+
+    cache_unlock(flags);
+
+    if (requests) kfree(requests);
+    if (batch) kfree(batch);
+    return ok;
+}
+
+// Drop one cached block without writing it back
+void bcache_forget(uint8_t drive, uint32_t block_no) {
+    if (!ready) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    bcache_buf_t *buf = hash_lookup(drive, block_no);
+    if (buf && buf->refcount == 0 && !buf->busy) {
+        if (buf->dirty) {
+            buf->dirty = false;
+            dirty_count--;
+        }
+        hash_remove(buf);
+        buf->valid = false;
+        lru_remove(buf);
+        lru_push_tail(buf);
+    }
+    cache_unlock(flags);
+}
+
+// Drop all cached blocks of a drive that are clean once written back
+void bcache_invalidate(uint8_t drive) {
+    if (!ready) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i < buffer_count; i++) {
+        bcache_buf_t *buf = &buffers[i];
+        if (!buf->valid || buf->drive != drive || buf->refcount > 0 || buf->busy) {
+            continue;
+        }
+
+        // The lock is dropped for the write, a borrower may have come for the block meanwhile.
+        // A block that could not be written (or is pinned by the journal) stays cached.
+        writeback(buf, &flags);
+        if (buf->valid && !buf->dirty && buf->refcount == 0 && !buf->busy) {
+            hash_remove(buf);
+            buf->valid = false;
+        }
+    }
+    cache_unlock(flags);
+}
+
+// Get cache statistics
+void bcache_get_stats(bcache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->buffers = buffer_count;
+    stats->block_size = cache_block_size;
+    stats->hits = stat_hits;
+    stats->misses = stat_misses;
+    stats->evictions = stat_evictions;
+    stats->writebacks = stat_writebacks;
+    stats->dirty = dirty_count;
+}
+
+// Print cache statistics
+void bcache_print_stats(void) {
+    LOG_INFO("Buffer Cache Statistics:");
+    LOG_INFO("  Buffers: %d x %d bytes", buffer_count, cache_block_size);
+    LOG_INFO("  Hits: %d, Misses: %d", stat_hits, stat_misses);
+    LOG_INFO("  Evictions: %d, Write-backs: %d, Dirty: %d",
+             stat_evictions, stat_writebacks, dirty_count);
+}
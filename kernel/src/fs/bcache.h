@@ -0,0 +1,83 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Buffer cache sizing limits
+#define BCACHE_MIN_BUFFERS      64
+#define BCACHE_MAX_BUFFERS      16384
+#define BCACHE_MEMORY_DIVISOR   32      // Use up to 1/32 of free memory
+
+// Fraction of buffers that may be dirty before a write-back pass starts
+#define BCACHE_DIRTY_DIVISOR    4
+
+// Cached block buffer
+typedef struct bcache_buf {
+    uint8_t drive;
+    uint32_t block_no;
+    void *data;                        // Block contents (block_size bytes)
+    uint32_t refcount;                 // Active borrowers, buffer is pinned while > 0
+    bool valid;                        // Data matches (or supersedes) the disk block
+    bool dirty;                        // Data must be written back before eviction
+    bool pinned;                       // Held by a journal transaction, must not reach disk yet
+    volatile bool busy;                // Being read or written, bcache_lock is dropped meanwhile
+    struct bcache_buf *hash_next;      // Next buffer in the same hash bucket
+    struct bcache_buf *lru_prev;       // LRU list of unreferenced buffers
+    struct bcache_buf *lru_next;
+} bcache_buf_t;
+
+// Buffer cache statistics
+typedef struct {
+    size_t buffers;
+    size_t block_size;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t writebacks;
+    size_t dirty;
+} bcache_stats_t;
+
+// Set up the cache for a block size, sizing it from free memory
+bool bcache_init(uint32_t block_size);
+
+// Write back all dirty buffers and release the cache memory
+void bcache_shutdown(void);
+
+// Borrow a buffer holding the block, reading it from disk on a miss
+bcache_buf_t *bcache_read(uint8_t drive, uint32_t block_no);
+
+// Borrow a buffer for a block the caller will overwrite entirely (no disk read)
+bcache_buf_t *bcache_get(uint8_t drive, uint32_t block_no);
+
+// Mark a borrowed buffer as modified
+void bcache_mark_dirty(bcache_buf_t *buf);
+
+// Return a borrowed buffer
+void bcache_release(bcache_buf_t *buf);
+
+// Keep a borrowed buffer cached and away from its disk location until it is unpinned, the
+// pin holds its own reference
+void bcache_pin(bcache_buf_t *buf);
+
+// Drop a pin, the buffer becomes dirty and is written back like any other
+void bcache_unpin(bcache_buf_t *buf);
+
+// Write back all dirty buffers, adjacent blocks go out as single commands
+bool bcache_sync(void);
+
+// Drop one cached block without writing it back (used when another cache owns the block)
+void bcache_forget(uint8_t drive, uint32_t block_no);
+
+// Drop all cached blocks of a drive (dirty blocks are written back first, the ones that
+// stay dirty are kept)
+void bcache_invalidate(uint8_t drive);
+
+// Get cache statistics
+void bcache_get_stats(bcache_stats_t *stats);
+
+// Print cache statistics
+void bcache_print_stats(void);
+
+#endif // BCACHE_H
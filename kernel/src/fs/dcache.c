@@ -0,0 +1,263 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/dcache.h>
+#include <memory/slab.h>
+#include <core/exec/scheduler.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Cache state
+static kmem_cache_t *entry_cache = NULL;
+static dcache_entry_t *hash_table[DCACHE_HASH_BUCKETS];
+static dcache_entry_t *lru_head = NULL;    // Most recently used
+static dcache_entry_t *lru_tail = NULL;    // Eviction candidate
+static spinlock_t dcache_lock;
+static bool ready = false;
+
+// Statistics
+static size_t entry_count = 0;
+static size_t stat_hits = 0;
+static size_t stat_negative_hits = 0;
+static size_t stat_misses = 0;
+static size_t stat_evictions = 0;
+
+// FNV-1a over the name, mixed with the directory inode
+static uint32_t dcache_hash(uint32_t parent, const char *name, size_t len) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash ^ (parent * 2654435761U);
+}
+
+// Unlink an entry from the LRU list
+static void lru_remove(dcache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+// Put an entry at the most recently used end of the LRU list
+static void lru_push_head(dcache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = entry;
+    }
+    lru_head = entry;
+    if (!lru_tail) {
+        lru_tail = entry;
+    }
+}
+
+// Unlink an entry from the cache and free it, dcache_lock must be held
+static void drop_entry(dcache_entry_t *entry) {
+    dcache_entry_t **link = &hash_table[entry->hash & (DCACHE_HASH_BUCKETS - 1)];
+    while (*link) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    lru_remove(entry);
+    kmem_cache_free(entry_cache, entry);
+    entry_count--;
+}
+
+// Find an entry, dcache_lock must be held
+static dcache_entry_t *hash_lookup(uint32_t parent, const char *name, size_t len, uint32_t hash) {
+    dcache_entry_t *entry = hash_table[hash & (DCACHE_HASH_BUCKETS - 1)];
+    while (entry) {
+        if (entry->hash == hash && entry->parent == parent && entry->len == len &&
+            memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+// Set up an empty cache
+bool dcache_init(void) {
+    if (ready) {
+        dcache_shutdown();
+    }
+
+    if (!entry_cache) {
+        entry_cache = kmem_cache_create("dentry", sizeof(dcache_entry_t), 0);
+        if (!entry_cache) {
+            LOG_ERROR_MSG("Dentry cache: failed to create entry cache");
+            return false;
+        }
+    }
+
+    memset(hash_table, 0, sizeof(hash_table));
+    lru_head = NULL;
+    lru_tail = NULL;
+    entry_count = 0;
+    spinlock_init(&dcache_lock);
+
+    ready = true;
+    LOG_INFO("Dentry cache: up to %u entries, %u hash buckets",
+             (uint32_t)DCACHE_MAX_ENTRIES, (uint32_t)DCACHE_HASH_BUCKETS);
+    return true;
+}
+
+// Drop all entries
+void dcache_shutdown(void) {
+    if (!ready) {
+        return;
+    }
+
+    spinlock_acquire(&dcache_lock);
+    while (lru_head) {
+        drop_entry(lru_head);
+    }
+    ready = false;
+    spinlock_release(&dcache_lock);
+}
+
+// Look up a name in a directory
+bool dcache_lookup(uint32_t parent, const char *name, size_t len, uint32_t *ino) {
+    if (!ready || !name || len == 0 || len > DCACHE_NAME_LEN) {
+        return false;
+    }
+
+    uint32_t hash = dcache_hash(parent, name, len);
+
+    spinlock_acquire(&dcache_lock);
+    dcache_entry_t *entry = hash_lookup(parent, name, len, hash);
+    if (!entry) {
+        stat_misses++;
+        spinlock_release(&dcache_lock);
+        return false;
+    }
+
+    if (entry->ino == 0) {
+        stat_negative_hits++;
+    } else {
+        stat_hits++;
+    }
+    if (lru_head != entry) {
+        lru_remove(entry);
+        lru_push_head(entry);
+    }
+    *ino = entry->ino;
+    spinlock_release(&dcache_lock);
+    return true;
+}
+
+// Record a name in a directory, replacing any existing entry
+void dcache_insert(uint32_t parent, const char *name, size_t len, uint32_t ino) {
+    if (!ready || !name || len == 0 || len > DCACHE_NAME_LEN) {
+        return;
+    }
+
+    uint32_t hash = dcache_hash(parent, name, len);
+
+    spinlock_acquire(&dcache_lock);
+    dcache_entry_t *entry = hash_lookup(parent, name, len, hash);
+    if (entry) {
+        entry->ino = ino;
+        if (lru_head != entry) {
+            lru_remove(entry);
+            lru_push_head(entry);
+        }
+        spinlock_release(&dcache_lock);
+        return;
+    }
+
+    // Reuse the least recently used entry once the cache is full
+    if (entry_count >= DCACHE_MAX_ENTRIES && lru_tail) {
+        drop_entry(lru_tail);
+        stat_evictions++;
+    }
+
+    entry = kmem_cache_alloc(entry_cache);
+    if (!entry) {
+        spinlock_release(&dcache_lock);
+        return;
+    }
+
+    entry->parent = parent;
+    entry->ino = ino;
+    entry->hash = hash;
+    entry->len = (uint8_t)len;
+    memcpy(entry->name, name, len);
+
+    size_t bucket = hash & (DCACHE_HASH_BUCKETS - 1);
+    entry->hash_next = hash_table[bucket];
+    hash_table[bucket] = entry;
+    lru_push_head(entry);
+    entry_count++;
+    spinlock_release(&dcache_lock);
+}
+
+// Forget one name in a directory
+void dcache_remove(uint32_t parent, const char *name, size_t len) {
+    if (!ready || !name || len == 0 || len > DCACHE_NAME_LEN) {
+        return;
+    }
+
+    uint32_t hash = dcache_hash(parent, name, len);
+
+    spinlock_acquire(&dcache_lock);
+    dcache_entry_t *entry = hash_lookup(parent, name, len, hash);
+    if (entry) {
+        drop_entry(entry);
+    }
+    spinlock_release(&dcache_lock);
+}
+
+// Forget every name in a directory
+void dcache_invalidate_dir(uint32_t parent) {
+    if (!ready) {
+        return;
+    }
+
+    spinlock_acquire(&dcache_lock);
+    dcache_entry_t *entry = lru_head;
+    while (entry) {
+        dcache_entry_t *next = entry->lru_next;
+        if (entry->parent == parent) {
+            drop_entry(entry);
+        }
+        entry = next;
+    }
+    spinlock_release(&dcache_lock);
+}
+
+// Get cache statistics
+void dcache_get_stats(dcache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    spinlock_acquire(&dcache_lock);
+    stats->entries = entry_count;
+    stats->hits = stat_hits;
+    stats->negative_hits = stat_negative_hits;
+    stats->misses = stat_misses;
+    stats->evictions = stat_evictions;
+    spinlock_release(&dcache_lock);
+}
+
+// Print cache statistics
+void dcache_print_stats(void) {
+    LOG_INFO("Dentry Cache Statistics:");
+    LOG_INFO("  Entries: %d of %d", entry_count, DCACHE_MAX_ENTRIES);
+    LOG_INFO("  Hits: %d, Negative hits: %d, Misses: %d",
+             stat_hits, stat_negative_hits, stat_misses);
+    LOG_INFO("  Evictions: %d", stat_evictions);
+}
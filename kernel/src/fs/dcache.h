@@ -0,0 +1,59 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Dentry cache sizing
+#define DCACHE_MAX_ENTRIES      1024
+#define DCACHE_HASH_BUCKETS     512     // Power of two
+#define DCACHE_NAME_LEN         255
+
+// Cached directory entry, ino 0 records a name known not to exist
+typedef struct dcache_entry {
+    uint32_t parent;                   // Directory inode
+    uint32_t ino;                      // Child inode, 0 for a negative entry
+    uint32_t hash;
+    uint8_t len;
+    char name[DCACHE_NAME_LEN];
+    struct dcache_entry *hash_next;    // Next entry in the same hash bucket
+    struct dcache_entry *lru_prev;     // LRU list, head is the most recently used
+    struct dcache_entry *lru_next;
+} dcache_entry_t;
+
+// Dentry cache statistics
+typedef struct {
+    size_t entries;
+    size_t hits;
+    size_t negative_hits;
+    size_t misses;
+    size_t evictions;
+} dcache_stats_t;
+
+// Set up an empty cache
+bool dcache_init(void);
+
+// Drop all entries
+void dcache_shutdown(void);
+
+// Look up a name in a directory, returns true on a hit with *ino set (0 if the name is
+// known not to exist)
+bool dcache_lookup(uint32_t parent, const char *name, size_t len, uint32_t *ino);
+
+// Record the result of a directory scan or change, ino 0 records a negative entry
+void dcache_insert(uint32_t parent, const char *name, size_t len, uint32_t ino);
+
+// Forget one name in a directory
+void dcache_remove(uint32_t parent, const char *name, size_t len);
+
+// Forget every name in a directory (used when it is removed)
+void dcache_invalidate_dir(uint32_t parent);
+
+// Get cache statistics
+void dcache_get_stats(dcache_stats_t *stats);
+
+// Print cache statistics
+void dcache_print_stats(void);
+
+#endif // DCACHE_H
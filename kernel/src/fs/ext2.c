@@ -1,16 +1,59 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
 #include "ext2.h"
-#include <drivers/ata/ata.h>
+#include <drivers/block/block.h>
 #include <lib/string.h>
 #include <utils/log.h>
 #include <lib/stdio.h>
 #include <memory/pmm.h>
+#include <memory/slab.h>
+#include <fs/bcache.h>
+#include <fs/pagecache.h>
+#include <fs/dcache.h>
+#include <fs/icache.h>
+#include <fs/journal.h>
+#include <drivers/timer/timer.h>
 
 // Global state
 ext2_fs_t fs;
+static kmem_cache_t *file_cache = NULL;
 static bool initialized = false;
 static bool mounted = false;
 static uint8_t *io_buffer = NULL;
 
+// Per group, the lowest bitmap bit that may still be free
+static uint32_t *block_hints = NULL;
+static uint32_t *inode_hints = NULL;
+
+// Free counts changed since the superblock and group descriptors were last written
+static bool counters_dirty = false;
+
+// Journal inode of an ext3 filesystem, kept for mapping log blocks
+static uint32_t journal_ino = 0;
+static ext2_inode_t journal_inode;
+
+// Smallest ext2 block is 1K, so a page never spans more blocks than this
+#define EXT2_MAX_BLOCKS_PER_PAGE (PCACHE_PAGE_SIZE / 1024)
+#define EXT2_READAHEAD_MIN       4      // Pages in the first readahead window
+
+// Take the filesystem lock, again if the calling task already holds it. Page cache fills
+// and flushes run without it, a task waiting for their page may be holding it.
+static void fs_lock(void) {
+    task_t *self = scheduler_get_current_task();
+    if (mutex_is_locked(&fs.lock) && fs.lock.owner == self) {
+        fs.lock_depth++;
+        return;
+    }
+    mutex_lock(&fs.lock);
+    fs.lock_depth = 1;
+}
+
+static void fs_unlock(void) {
+    if (--fs.lock_depth == 0) {
+        mutex_unlock(&fs.lock);
+    }
+}
+
 // Initialize filesystem driver
 bool ext2_init(void) {
     LOG_INFO_MSG("Initializing EXT2 filesystem driver");
@@ -18,15 +61,16 @@ bool ext2_init(void) {
     // Initialize global state
     memset(&fs, 0, sizeof(ext2_fs_t));
     
-    // Init cache
-    for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-        fs.cache[i].valid = false;
-        fs.cache[i].dirty = false;
-    }
-    
     // Init file handles
     for (int i = 0; i < EXT2_MAX_FILES; i++) {
-        fs.open_files[i].is_open = false;
+        fs.open_files[i] = NULL;
+    }
+    mutex_init(&fs.lock);
+    
+    file_cache = kmem_cache_create("ext2_file", sizeof(ext2_file_t), KMEM_CACHE_ALIGN);
+    if (!file_cache) {
+        LOG_ERROR_MSG("Failed to create file handle cache");
+        return false;
     }
     
     // Allocate I/O buffer (8KB)
@@ -43,98 +87,120 @@ bool ext2_init(void) {
     return true;
 }
 
-// Disk I/O helpers
-static bool read_sector(uint8_t drive, uint32_t sector, void *buffer) {
-    return ata_read_sectors(drive, sector, 1, buffer);
-}
-
-static bool write_sector(uint8_t drive, uint32_t sector, void *buffer) {
-    return ata_write_sectors(drive, sector, 1, buffer);
-}
-
-// Read a block from disk
+// Read a block (copying out of the buffer cache)
 bool ext2_read_block(uint8_t drive_index, uint32_t block_no, void *buffer) {
     if (!buffer) return false;
     
-    // Check cache first
-    if (mounted) {
-        for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-            if (fs.cache[i].valid && fs.cache[i].block_no == block_no) {
-                memcpy(buffer, fs.cache[i].data, fs.block_size);
-                return true;
-            }
-        }
-    }
-    
-    // Cache miss, read from disk
-    uint32_t sectors_per_block = fs.block_size / 512;
-    uint32_t start_sector = block_no * sectors_per_block;
-    
-    for (uint32_t i = 0; i < sectors_per_block; i++) {
-        if (!read_sector(drive_index, start_sector + i, (uint8_t*)buffer + (i * 512))) {
-            LOG_ERROR("Failed to read sector %u", start_sector + i);
-            return false;
-        }
-    }
-    
-    // Update cache
-    if (mounted) {
-        // Find free cache entry or replace oldest
-        int cache_idx = 0;
-        for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-            if (!fs.cache[i].valid) {
-                cache_idx = i;
-                break;
-            }
-        }
-        
-        // Allocate cache data if needed
-        if (!fs.cache[cache_idx].data) {
-            fs.cache[cache_idx].data = pmm_alloc_page();
-        }
-        
-        if (fs.cache[cache_idx].data) {
-            fs.cache[cache_idx].block_no = block_no;
-            fs.cache[cache_idx].valid = true;
-            fs.cache[cache_idx].dirty = false;
-            memcpy(fs.cache[cache_idx].data, buffer, fs.block_size);
-        }
+    bcache_buf_t *buf = bcache_read(drive_index, block_no);
+    if (!buf) {
+        return false;
     }
     
+    memcpy(buffer, buf->data, fs.block_size);
+    bcache_release(buf);
     return true;
 }
 
-// Write a block to disk
+// Write a block (into the buffer cache, written back later)
 bool ext2_write_block(uint8_t drive_index, uint32_t block_no, void *buffer) {
     if (!buffer) return false;
     
-    // Update cache if present
-    if (mounted) {
-        for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-            if (fs.cache[i].valid && fs.cache[i].block_no == block_no) {
-                memcpy(fs.cache[i].data, buffer, fs.block_size);
-                fs.cache[i].dirty = true;
-            }
-        }
+    fs_lock();
+    bcache_buf_t *buf = bcache_get(drive_index, block_no);
+    if (buf) {
+        memcpy(buf->data, buffer, fs.block_size);
+        journal_dirty(buf);
+        bcache_release(buf);
+    }
+    fs_unlock();
+    return buf != NULL;
+}
+
+// Copy the in-core superblock and group descriptors into their blocks
+static void write_fs_counters(void) {
+    if (!counters_dirty) return;
+    
+    // The superblock is 1K at byte offset 1024, inside block 0 for larger block sizes
+    bcache_buf_t *buf = bcache_read(fs.drive_index, 1024 / fs.block_size);
+    if (!buf) return;
+    memcpy(buf->data + 1024 % fs.block_size, fs.superblock, sizeof(ext2_superblock_t));
+    journal_dirty(buf);
+    bcache_release(buf);
+    
+    // Group descriptors follow the superblock and are held in whole blocks
+    uint32_t bg_desc_block = fs.superblock->s_first_data_block + 1;
+    uint32_t bg_desc_size = sizeof(ext2_group_desc_t) * fs.groups_count;
+    uint32_t bg_desc_blocks = (bg_desc_size + fs.block_size - 1) / fs.block_size;
+    for (uint32_t i = 0; i < bg_desc_blocks; i++) {
+        buf = bcache_get(fs.drive_index, bg_desc_block + i);
+        if (!buf) return;
+        memcpy(buf->data, (uint8_t*)fs.group_descs + i * fs.block_size, fs.block_size);
+        journal_dirty(buf);
+        bcache_release(buf);
     }
     
-    // Write to disk
-    uint32_t sectors_per_block = fs.block_size / 512;
-    uint32_t start_sector = block_no * sectors_per_block;
+    counters_dirty = false;
+}
+
+// Push cached file data and inodes out before the journal commits the metadata (ordered mode)
+static void flush_metadata(void) {
+    pcache_sync();
+    icache_sync();
+    write_fs_counters();
+}
+
+// Flush all cached metadata and data blocks to disk
+bool ext2_sync(void) {
+    if (!mounted) return false;
+    
+    // File pages first, then the in-core inodes, their write-back dirties metadata blocks
+    fs_lock();
+    bool ok = pcache_sync();
+    ok = icache_sync() && ok;
     
-    for (uint32_t i = 0; i < sectors_per_block; i++) {
-        if (!write_sector(drive_index, start_sector + i, (uint8_t*)buffer + (i * 512))) {
-            LOG_ERROR("Failed to write sector %u", start_sector + i);
-            return false;
-        }
+    if (journal_active()) {
+        // Metadata reaches the log first, then its home blocks
+        ok = journal_commit() && ok;
+        ok = journal_checkpoint() && ok;
+    } else {
+        write_fs_counters();
+        ok = bcache_sync() && ok;
     }
+    ok = block_flush(fs.drive_index) && ok;
+    fs_unlock();
+    return ok;
+}
+
+// Flush one open file's pages and inode to the disk
+bool ext2_fsync(int fd) {
+    fs_lock();
+    bool ok = mounted && fd >= 0 && fd < EXT2_MAX_FILES && fs.open_files[fd] &&
+              ext2_file_sync(fs.open_files[fd]);
+    fs_unlock();
+    return ok;
+}
+
+// Flush a handle's pages and inode to the disk
+bool ext2_file_sync(ext2_file_t *file) {
+    if (!mounted || !file) return false;
     
-    return true;
+    fs_lock();
+    bool ok = pcache_sync_inode(file->inode_num);
+    ok = icache_sync_inode(file->cached) && ok;
+    
+    // The inode's metadata blocks are only durable once the log holds them
+    if (journal_active()) {
+        ok = journal_commit() && ok;
+    } else {
+        ok = bcache_sync() && ok;
+    }
+    ok = block_flush(fs.drive_index) && ok;
+    fs_unlock();
+    return ok;
 }
 
-// Read an inode from disk
-bool ext2_read_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
-    if (!inode || inode_no == 0) return false;
+// Copy an inode out of its inode table block
+static bool read_inode_table(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
     
     // Calculate block group & offset
     uint32_t block_group = (inode_no - 1) / fs.inodes_per_group;
@@ -153,22 +219,22 @@ bool ext2_read_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode
     uint32_t block_offset = index / inodes_per_block;
     uint32_t inode_offset = index % inodes_per_block;
     
-    // Read the block
-    uint8_t *block_data = io_buffer;
-    if (!ext2_read_block(drive_index, inode_table + block_offset, block_data)) {
+    // Borrow the inode table block
+    bcache_buf_t *buf = bcache_read(drive_index, inode_table + block_offset);
+    if (!buf) {
         LOG_ERROR("Failed to read inode block");
         return false;
     }
     
     // Copy the inode
-    memcpy(inode, block_data + (inode_offset * fs.inode_size), sizeof(ext2_inode_t));
+    memcpy(inode, (uint8_t*)buf->data + (inode_offset * fs.inode_size), sizeof(ext2_inode_t));
+    bcache_release(buf);
     
     return true;
 }
 
-// Write an inode to disk
-bool ext2_write_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
-    if (!inode || inode_no == 0) return false;
+// Copy an inode into its inode table block
+static bool write_inode_table(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
     
     // Calculate block group & offset
     uint32_t block_group = (inode_no - 1) / fs.inodes_per_group;
@@ -187,44 +253,119 @@ bool ext2_write_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inod
     uint32_t block_offset = index / inodes_per_block;
     uint32_t inode_offset = index % inodes_per_block;
     
-    // Read the block
-    uint8_t *block_data = io_buffer;
-    if (!ext2_read_block(drive_index, inode_table + block_offset, block_data)) {
+    // Borrow the inode table block
+    bcache_buf_t *buf = bcache_read(drive_index, inode_table + block_offset);
+    if (!buf) {
         LOG_ERROR("Failed to read inode block");
         return false;
     }
     
-    // Update the inode
-    memcpy(block_data + (inode_offset * fs.inode_size), inode, sizeof(ext2_inode_t));
+    // Update the inode in place, the block is written back later
+    memcpy((uint8_t*)buf->data + (inode_offset * fs.inode_size), inode, sizeof(ext2_inode_t));
+    journal_dirty(buf);
+    bcache_release(buf);
     
-    // Write the block back
-    if (!ext2_write_block(drive_index, inode_table + block_offset, block_data)) {
-        LOG_ERROR("Failed to write inode block");
-        return false;
+    return true;
+}
+
+// Inode cache callbacks for the mounted drive
+static bool icache_read_inode(uint32_t inode_no, ext2_inode_t *inode) {
+    return read_inode_table(fs.drive_index, inode_no, inode);
+}
+
+static bool icache_write_inode(uint32_t inode_no, ext2_inode_t *inode) {
+    return write_inode_table(fs.drive_index, inode_no, inode);
+}
+
+// Read an inode, served from its in-core copy
+bool ext2_read_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
+    if (!inode || inode_no == 0) return false;
+    
+    icache_inode_t *ip = icache_get(inode_no);
+    if (!ip) {
+        return read_inode_table(drive_index, inode_no, inode);
     }
     
+    memcpy(inode, &ip->inode, sizeof(ext2_inode_t));
+    icache_put(ip);
     return true;
 }
 
-// Find free bit in bitmap
-static int find_free_bit(uint8_t *bitmap, int size) {
-    for (int i = 0; i < size; i++) {
-        uint8_t byte = bitmap[i];
-        if (byte == 0xFF) continue; // All bits used
-        
-        // Find first zero bit
-        for (int j = 0; j < 8; j++) {
-            if ((byte & (1 << j)) == 0) {
-                return i * 8 + j;
-            }
+// Write an inode, the in-core copy reaches the inode table on sync, close or eviction
+bool ext2_write_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode) {
+    if (!inode || inode_no == 0) return false;
+    
+    fs_lock();
+    bool ok = true;
+    icache_inode_t *ip = icache_get(inode_no);
+    if (!ip) {
+        ok = write_inode_table(drive_index, inode_no, inode);
+    } else {
+        if (inode != &ip->inode) {
+            memcpy(&ip->inode, inode, sizeof(ext2_inode_t));
+        }
+        icache_mark_dirty(ip);
+        icache_put(ip);
+    }
+    fs_unlock();
+    return ok;
+}
+
+// There is no wall clock yet, timestamps count seconds since boot
+static uint32_t ext2_now(void) {
+    return (uint32_t)(timer_get_uptime_ms() / 1000);
+}
+
+// Find the first clear bit in [start, nbits) of a bitmap, a 64-bit word at a time
+static int find_free_bit(const uint8_t *bitmap, uint32_t start, uint32_t nbits) {
+    const uint64_t *words = (const uint64_t*)bitmap;
+    uint32_t bit = start;
+    
+    while (bit < nbits) {
+        uint64_t free = ~words[bit / 64] & (~0ULL << (bit % 64));
+        if (free) {
+            uint32_t found = (bit & ~63u) + __builtin_ctzll(free);
+            return found < nbits ? (int)found : -1;
         }
+        bit = (bit | 63) + 1;
     }
     return -1; // No free bits
 }
 
-// Allocate a block
-uint32_t ext2_allocate_block(uint8_t drive_index) {
-    if (!mounted) return 0;
+// Count the clear bits starting at a clear bit, up to max
+static uint32_t count_free_bits(const uint8_t *bitmap, uint32_t start, uint32_t nbits, uint32_t max) {
+    const uint64_t *words = (const uint64_t*)bitmap;
+    uint32_t limit = nbits - start < max ? nbits : start + max;
+    uint32_t bit = start;
+    
+    while (bit < limit) {
+        uint64_t used = words[bit / 64] & (~0ULL << (bit % 64));
+        if (used) {
+            uint32_t end = (bit & ~63u) + __builtin_ctzll(used);
+            return (end < limit ? end : limit) - start;
+        }
+        bit = (bit | 63) + 1;
+    }
+    return limit - start;
+}
+
+// Mark a run of bits as used
+static void set_bits(uint8_t *bitmap, uint32_t start, uint32_t count) {
+    for (uint32_t bit = start; bit < start + count; bit++) {
+        bitmap[bit / 8] |= (1 << (bit % 8));
+    }
+}
+
+// Number of blocks the bitmap of a group describes, the last group may be short
+static uint32_t group_block_count(uint32_t bg) {
+    uint32_t first = bg * fs.blocks_per_group + fs.superblock->s_first_data_block;
+    uint32_t remaining = fs.blocks_count - first;
+    return remaining < fs.blocks_per_group ? remaining : fs.blocks_per_group;
+}
+
+// Allocate up to count contiguous blocks at or after the goal (0 for no preference)
+static uint32_t allocate_blocks(uint8_t drive_index, uint32_t goal, uint32_t count, uint32_t *allocated) {
+    if (!mounted || count == 0) return 0;
     
     // Check for free blocks
     if (fs.superblock->s_free_blocks_count == 0) {
@@ -232,44 +373,72 @@ uint32_t ext2_allocate_block(uint8_t drive_index) {
         return 0;
     }
     
+    // Start in the goal's group, right at the goal
+    uint32_t first_data = fs.superblock->s_first_data_block;
+    uint32_t goal_bg = 0;
+    uint32_t goal_bit = 0;
+    bool has_goal = goal >= first_data && goal < fs.blocks_count;
+    if (has_goal) {
+        goal_bg = (goal - first_data) / fs.blocks_per_group;
+        goal_bit = (goal - first_data) % fs.blocks_per_group;
+    }
+    
     // Search through block groups
-    for (uint32_t bg = 0; bg < fs.groups_count; bg++) {
+    for (uint32_t n = 0; n < fs.groups_count; n++) {
+        uint32_t bg = (goal_bg + n) % fs.groups_count;
         if (fs.group_descs[bg].bg_free_blocks_count == 0) continue;
         
-        // Read block bitmap
+        // Borrow block bitmap
         uint32_t bitmap_block = fs.group_descs[bg].bg_block_bitmap;
-        uint8_t *bitmap = io_buffer;
-        
-        if (!ext2_read_block(drive_index, bitmap_block, bitmap)) {
+        bcache_buf_t *bitmap_buf = bcache_read(drive_index, bitmap_block);
+        if (!bitmap_buf) {
             LOG_ERROR("Failed to read block bitmap");
             continue;
         }
+        uint8_t *bitmap = bitmap_buf->data;
+        uint32_t nbits = group_block_count(bg);
         
-        // Find a free bit
-        int bit = find_free_bit(bitmap, fs.block_size);
-        if (bit == -1) continue;
+        // Nothing below the hint is free, the goal only matters in its own group
+        uint32_t start = block_hints[bg];
+        if (n == 0 && has_goal && goal_bit > start) {
+            start = goal_bit;
+        }
         
-        // Mark block as used
-        bitmap[bit / 8] |= (1 << (bit % 8));
+        // Find a free bit, retrying from the hint when the goal's tail of the group is full
+        int bit = find_free_bit(bitmap, start, nbits);
+        if (bit == -1 && start != block_hints[bg]) {
+            bit = find_free_bit(bitmap, block_hints[bg], nbits);
+        }
+        if (bit == -1) {
+            bcache_release(bitmap_buf);
+            continue;
+        }
         
-        // Write bitmap back
-        if (!ext2_write_block(drive_index, bitmap_block, bitmap)) {
-            LOG_ERROR("Failed to write block bitmap");
-            return 0;
+        // Take as much of the free run as was asked for
+        uint32_t run = count_free_bits(bitmap, bit, nbits, count);
+        if (run > fs.group_descs[bg].bg_free_blocks_count) {
+            run = fs.group_descs[bg].bg_free_blocks_count;
+        }
+        
+        // Mark blocks as used
+        set_bits(bitmap, bit, run);
+        journal_dirty(bitmap_buf);
+        bcache_release(bitmap_buf);
+        
+        if ((uint32_t)bit <= block_hints[bg]) {
+            block_hints[bg] = bit + run;
         }
         
         // Calculate actual block number
-        uint32_t block_no = bg * fs.blocks_per_group + bit + fs.superblock->s_first_data_block;
+        uint32_t block_no = bg * fs.blocks_per_group + bit + first_data;
         
         // Update counters
-        fs.superblock->s_free_blocks_count--;
-        fs.group_descs[bg].bg_free_blocks_count--;
-        
-        // Zero the block
-        memset(bitmap, 0, fs.block_size);
-        ext2_write_block(drive_index, block_no, bitmap);
+        fs.superblock->s_free_blocks_count -= run;
+        fs.group_descs[bg].bg_free_blocks_count -= run;
+        counters_dirty = true;
         
-        LOG_DEBUG("Allocated block %u", block_no);
+        LOG_DEBUG("Allocated %u blocks at %u", run, block_no);
+        if (allocated) *allocated = run;
         return block_no;
     }
     
@@ -277,8 +446,34 @@ uint32_t ext2_allocate_block(uint8_t drive_index) {
     return 0;
 }
 
+// Allocate up to count contiguous blocks at or after the goal (0 for no preference), the
+// blocks are not zeroed
+uint32_t ext2_allocate_blocks(uint8_t drive_index, uint32_t goal, uint32_t count, uint32_t *allocated) {
+    fs_lock();
+    uint32_t block_no = allocate_blocks(drive_index, goal, count, allocated);
+    fs_unlock();
+    return block_no;
+}
+
+// Allocate a zeroed block
+uint32_t ext2_allocate_block(uint8_t drive_index) {
+    fs_lock();
+    uint32_t block_no = allocate_blocks(drive_index, 0, 1, NULL);
+    
+    // Zero the block
+    bcache_buf_t *block_buf = block_no ? bcache_get(drive_index, block_no) : NULL;
+    if (block_buf) {
+        memset(block_buf->data, 0, fs.block_size);
+        journal_dirty(block_buf);
+        bcache_release(block_buf);
+    }
+    fs_unlock();
+    
+    return block_no;
+}
+
 // Allocate an inode
-uint32_t ext2_allocate_inode(uint8_t drive_index) {
+static uint32_t allocate_inode(uint8_t drive_index) {
     if (!mounted) return 0;
     
     // Check for free inodes
@@ -291,27 +486,27 @@ uint32_t ext2_allocate_inode(uint8_t drive_index) {
     for (uint32_t bg = 0; bg < fs.groups_count; bg++) {
         if (fs.group_descs[bg].bg_free_inodes_count == 0) continue;
         
-        // Read inode bitmap
+        // Borrow inode bitmap
         uint32_t bitmap_block = fs.group_descs[bg].bg_inode_bitmap;
-        uint8_t *bitmap = io_buffer;
-        
-        if (!ext2_read_block(drive_index, bitmap_block, bitmap)) {
+        bcache_buf_t *bitmap_buf = bcache_read(drive_index, bitmap_block);
+        if (!bitmap_buf) {
             LOG_ERROR("Failed to read inode bitmap");
             continue;
         }
+        uint8_t *bitmap = bitmap_buf->data;
         
-        // Find a free bit
-        int bit = find_free_bit(bitmap, fs.block_size);
-        if (bit == -1) continue;
+        // Find a free bit above the group's hint
+        int bit = find_free_bit(bitmap, inode_hints[bg], fs.inodes_per_group);
+        if (bit == -1) {
+            bcache_release(bitmap_buf);
+            continue;
+        }
         
         // Mark inode as used
-        bitmap[bit / 8] |= (1 << (bit % 8));
-        
-        // Write bitmap back
-        if (!ext2_write_block(drive_index, bitmap_block, bitmap)) {
-            LOG_ERROR("Failed to write inode bitmap");
-            return 0;
-        }
+        set_bits(bitmap, bit, 1);
+        journal_dirty(bitmap_buf);
+        bcache_release(bitmap_buf);
+        inode_hints[bg] = bit + 1;
         
         // Calculate actual inode number (1-based)
         uint32_t inode_no = bg * fs.inodes_per_group + bit + 1;
@@ -319,13 +514,14 @@ uint32_t ext2_allocate_inode(uint8_t drive_index) {
         // Update counters
         fs.superblock->s_free_inodes_count--;
         fs.group_descs[bg].bg_free_inodes_count--;
+        counters_dirty = true;
         
         // Initialize inode
         ext2_inode_t inode;
         memset(&inode, 0, sizeof(ext2_inode_t));
         
         // Set times
-        uint32_t current_time = 0;
+        uint32_t current_time = ext2_now();
         inode.i_ctime = current_time;
         inode.i_atime = current_time;
         inode.i_mtime = current_time;
@@ -340,123 +536,133 @@ uint32_t ext2_allocate_inode(uint8_t drive_index) {
     return 0;
 }
 
-// Get block from inode
-static bool get_block_from_inode(ext2_inode_t *inode, uint32_t block_idx, uint32_t *block_no) {
-    if (!inode || !block_no) return false;
+// Allocate an inode
+uint32_t ext2_allocate_inode(uint8_t drive_index) {
+    fs_lock();
+    uint32_t inode_no = allocate_inode(drive_index);
+    fs_unlock();
+    return inode_no;
+}
+
+// Read one block pointer out of an indirect block, counting how many of the following
+// pointers (up to limit) continue it on disk
+static bool read_block_run(uint32_t ind_block, uint32_t index, uint32_t limit,
+                           uint32_t *block_no, uint32_t *run) {
+    *run = 0;
+    if (ind_block == 0) {
+        *block_no = 0;
+        return false;
+    }
     
-    // Check size
-    uint32_t max_blocks = (inode->i_size + fs.block_size - 1) / fs.block_size;
-    if (block_idx >= max_blocks) {
+    bcache_buf_t *buf = bcache_read(fs.drive_index, ind_block);
+    if (!buf) {
         *block_no = 0;
         return false;
     }
     
+    uint32_t *ptrs = (uint32_t*)buf->data;
+    uint32_t ptrs_per_block = fs.block_size / sizeof(uint32_t);
+    *block_no = ptrs[index];
+    if (*block_no != 0) {
+        *run = 1;
+        while (*run < limit && index + *run < ptrs_per_block && ptrs[index + *run] == *block_no + *run) {
+            (*run)++;
+        }
+    }
+    bcache_release(buf);
+    return *block_no != 0;
+}
+
+// Walk the block tree for one file block, run is set to the contiguous blocks found from it
+static bool walk_block_tree(ext2_inode_t *inode, uint32_t block_idx, uint32_t limit,
+                            uint32_t *block_no, uint32_t *run) {
+    uint32_t ptr;
+    
     // Direct blocks
     if (block_idx < EXT2_NDIR_BLOCKS) {
         *block_no = inode->i_block[block_idx];
+        *run = 0;
+        if (*block_no != 0) {
+            *run = 1;
+            while (*run < limit && block_idx + *run < EXT2_NDIR_BLOCKS &&
+                   inode->i_block[block_idx + *run] == *block_no + *run) {
+                (*run)++;
+            }
+        }
         return *block_no != 0;
     }
     
-    // Indirect blocks
-    uint32_t *block_ptrs = (uint32_t *)io_buffer;
+    // Indirect blocks are borrowed from the buffer cache one level at a time
     block_idx -= EXT2_NDIR_BLOCKS;
     uint32_t ptrs_per_block = fs.block_size / sizeof(uint32_t);
     
     // Single indirect
     if (block_idx < ptrs_per_block) {
-        if (inode->i_block[EXT2_IND_BLOCK] == 0) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (!ext2_read_block(fs.drive_index, inode->i_block[EXT2_IND_BLOCK], block_ptrs)) {
-            *block_no = 0;
-            return false;
-        }
-        
-        *block_no = block_ptrs[block_idx];
-        return *block_no != 0;
+        return read_block_run(inode->i_block[EXT2_IND_BLOCK], block_idx, limit, block_no, run);
     }
     
     // Double indirect
     block_idx -= ptrs_per_block;
     if (block_idx < ptrs_per_block * ptrs_per_block) {
-        uint32_t ind_idx = block_idx / ptrs_per_block;
-        uint32_t ind_off = block_idx % ptrs_per_block;
-        
-        if (inode->i_block[EXT2_DIND_BLOCK] == 0) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (!ext2_read_block(fs.drive_index, inode->i_block[EXT2_DIND_BLOCK], block_ptrs)) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (block_ptrs[ind_idx] == 0) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (!ext2_read_block(fs.drive_index, block_ptrs[ind_idx], block_ptrs)) {
+        uint32_t ind_block;
+        if (!read_block_run(inode->i_block[EXT2_DIND_BLOCK], block_idx / ptrs_per_block, 1, &ind_block, &ptr)) {
             *block_no = 0;
             return false;
         }
         
-        *block_no = block_ptrs[ind_off];
-        return *block_no != 0;
+        return read_block_run(ind_block, block_idx % ptrs_per_block, limit, block_no, run);
     }
     
     // Triple indirect (very rare)
     block_idx -= ptrs_per_block * ptrs_per_block;
     if (block_idx < ptrs_per_block * ptrs_per_block * ptrs_per_block) {
-        uint32_t dbl_idx = block_idx / (ptrs_per_block * ptrs_per_block);
         uint32_t remain = block_idx % (ptrs_per_block * ptrs_per_block);
-        uint32_t ind_idx = remain / ptrs_per_block;
-        uint32_t ind_off = remain % ptrs_per_block;
-        
-        if (inode->i_block[EXT2_TIND_BLOCK] == 0) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (!ext2_read_block(fs.drive_index, inode->i_block[EXT2_TIND_BLOCK], block_ptrs)) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (block_ptrs[dbl_idx] == 0) {
-            *block_no = 0;
-            return false;
-        }
-        
-        if (!ext2_read_block(fs.drive_index, block_ptrs[dbl_idx], block_ptrs)) {
-            *block_no = 0;
-            return false;
-        }
+        uint32_t dind_block, ind_block;
         
-        if (block_ptrs[ind_idx] == 0) {
+        if (!read_block_run(inode->i_block[EXT2_TIND_BLOCK], block_idx / (ptrs_per_block * ptrs_per_block), 1, &dind_block, &ptr) ||
+            !read_block_run(dind_block, remain / ptrs_per_block, 1, &ind_block, &ptr)) {
             *block_no = 0;
             return false;
         }
         
-        if (!ext2_read_block(fs.drive_index, block_ptrs[ind_idx], block_ptrs)) {
-            *block_no = 0;
-            return false;
-        }
-        
-        *block_no = block_ptrs[ind_off];
-        return *block_no != 0;
+        return read_block_run(ind_block, remain % ptrs_per_block, limit, block_no, run);
     }
     
     *block_no = 0;
+    *run = 0;
     return false;
 }
 
+// Get block from inode, known runs are answered from the inode's extents
+static bool get_block_from_inode(uint32_t ino, ext2_inode_t *inode, uint32_t block_idx, uint32_t *block_no) {
+    if (!inode || !block_no) return false;
+    
+    // Check size
+    uint32_t max_blocks = (inode->i_size + fs.block_size - 1) / fs.block_size;
+    if (block_idx >= max_blocks) {
+        *block_no = 0;
+        return false;
+    }
+    
+    icache_inode_t *ip = icache_get(ino);
+    if (ip && icache_map_lookup(ip, block_idx, block_no)) {
+        icache_put(ip);
+        return true;
+    }
+    
+    // The walk picks up the rest of the run from the same pointer block, so the blocks
+    // that follow need no walk at all
+    uint32_t run;
+    bool found = walk_block_tree(inode, block_idx, max_blocks - block_idx, block_no, &run);
+    if (found && ip) {
+        icache_map_insert(ip, block_idx, *block_no, run);
+    }
+    icache_put(ip);
+    return found;
+}
+
 // Set block in inode (allocate indirect blocks if needed)
-static bool set_block_in_inode(ext2_inode_t *inode, uint32_t block_idx, uint32_t block_no) {
-    if (!inode) return false;
+static bool set_block_pointer(ext2_inode_t *inode, uint32_t block_idx, uint32_t block_no) {
     
     // Direct blocks
     if (block_idx < EXT2_NDIR_BLOCKS) {
@@ -465,37 +671,51 @@ static bool set_block_in_inode(ext2_inode_t *inode, uint32_t block_idx, uint32_t
     }
     
     // Indirect blocks
-    uint32_t *block_ptrs = (uint32_t *)io_buffer;
     block_idx -= EXT2_NDIR_BLOCKS;
     uint32_t ptrs_per_block = fs.block_size / sizeof(uint32_t);
     
     // Single indirect
     if (block_idx < ptrs_per_block) {
-        // Allocate indirect block if needed
+        // Allocate indirect block if needed (comes back zeroed)
         if (inode->i_block[EXT2_IND_BLOCK] == 0) {
             inode->i_block[EXT2_IND_BLOCK] = ext2_allocate_block(fs.drive_index);
             if (inode->i_block[EXT2_IND_BLOCK] == 0) {
                 return false;
             }
-            
-            memset(block_ptrs, 0, fs.block_size);
-            ext2_write_block(fs.drive_index, inode->i_block[EXT2_IND_BLOCK], block_ptrs);
         }
         
-        // Read indirect block
-if (!ext2_read_block(fs.drive_index, inode->i_block[EXT2_IND_BLOCK], block_ptrs)) {
+        // Update block pointer in the cached indirect block
+        bcache_buf_t *buf = bcache_read(fs.drive_index, inode->i_block[EXT2_IND_BLOCK]);
+        if (!buf) {
+            return false;
+        }
+        
+        ((uint32_t*)buf->data)[block_idx] = block_no;
+        journal_dirty(buf);
+        bcache_release(buf);
+        return true;
+    }
+    
+    // Only implement double/triple indirect if needed
     return false;
 }
 
-// Update block pointer
-block_ptrs[block_idx] = block_no;
-
-// Write back
-return ext2_write_block(fs.drive_index, inode->i_block[EXT2_IND_BLOCK], block_ptrs);
-}
-
-// Only implement double/triple indirect if needed
-return false;
+// Set block in inode, keeping the inode's extents in step
+static bool set_block_in_inode(uint32_t ino, ext2_inode_t *inode, uint32_t block_idx, uint32_t block_no) {
+    if (!inode) return false;
+    
+    if (!set_block_pointer(inode, block_idx, block_no)) {
+        return false;
+    }
+    
+    icache_inode_t *ip = icache_get(ino);
+    if (block_no != 0) {
+        icache_map_insert(ip, block_idx, block_no, 1);
+    } else {
+        icache_map_invalidate(ip);
+    }
+    icache_put(ip);
+    return true;
 }
 
 // Normalize a path
@@ -562,6 +782,11 @@ char *ext2_normalize_path(const char *path) {
 static uint32_t find_file_in_dir(uint8_t drive_index, uint32_t dir_ino, const char *name) {
     if (!name || dir_ino == 0) return 0;
     
+    // Hot names, and names known to be missing, need no directory scan
+    size_t name_len = strlen(name);
+    uint32_t cached_ino;
+    if (dcache_lookup(dir_ino, name, name_len, &cached_ino)) return cached_ino;
+    
     // Read directory inode
     ext2_inode_t dir_inode;
     if (!ext2_read_inode(drive_index, dir_ino, &dir_inode)) return 0;
@@ -572,15 +797,23 @@ static uint32_t find_file_in_dir(uint8_t drive_index, uint32_t dir_ino, const ch
     // Scan directory blocks
     uint32_t offset = 0;
     uint32_t block_idx = 0;
+    bool complete = true;
     
     while (offset < dir_inode.i_size) {
         // Get block
         uint32_t block_no;
-        if (!get_block_from_inode(&dir_inode, block_idx, &block_no) || block_no == 0) break;
+        if (!get_block_from_inode(dir_ino, &dir_inode, block_idx, &block_no) || block_no == 0) {
+            complete = false;
+            break;
+        }
         
-        // Read block
-        uint8_t *block_data = io_buffer;
-        if (!ext2_read_block(drive_index, block_no, block_data)) break;
+        // Borrow block
+        bcache_buf_t *buf = bcache_read(drive_index, block_no);
+        if (!buf) {
+            complete = false;
+            break;
+        }
+        uint8_t *block_data = buf->data;
         
         // Scan entries
         uint32_t block_offset = 0;
@@ -591,25 +824,35 @@ static uint32_t find_file_in_dir(uint8_t drive_index, uint32_t dir_ino, const ch
             
             // Check name
             if (entry->inode != 0 && 
-                entry->name_len == strlen(name) && 
+                entry->name_len == name_len && 
                 strncmp(entry->name, name, entry->name_len) == 0) {
-                return entry->inode;  // Found it
+                uint32_t ino = entry->inode;
+                bcache_release(buf);
+                dcache_insert(dir_ino, name, name_len, ino);
+                return ino;  // Found it
             }
             
             // Next entry
             block_offset += entry->rec_len;
         }
         
+        bcache_release(buf);
+        
         // Next block
         offset += fs.block_size;
         block_idx++;
     }
     
+    // Only a full scan proves the name is missing
+    if (complete) {
+        dcache_insert(dir_ino, name, name_len, 0);
+    }
+    
     return 0;  // Not found
 }
 
 // Lookup a path to find its inode
-uint32_t ext2_lookup_path(uint8_t drive_index, const char *path) {
+static uint32_t lookup_path(uint8_t drive_index, const char *path) {
     if (!path) return 0;
     
     // Normalize path
@@ -660,6 +903,14 @@ uint32_t ext2_lookup_path(uint8_t drive_index, const char *path) {
     return current_ino;
 }
 
+// Lookup a path to find its inode
+uint32_t ext2_lookup_path(uint8_t drive_index, const char *path) {
+    fs_lock();
+    uint32_t ino = lookup_path(drive_index, path);
+    fs_unlock();
+    return ino;
+}
+
 // Add entry to directory
 static bool add_dir_entry(uint8_t drive_index, uint32_t dir_ino, 
                           const char *name, uint32_t ino, uint8_t type) {
@@ -675,6 +926,9 @@ static bool add_dir_entry(uint8_t drive_index, uint32_t dir_ino,
     // Check if it's a directory
     if (!EXT2_S_ISDIR(dir_inode.i_mode)) return false;
     
+    // A failed update leaves the directory unknown, so rescan it next time
+    dcache_remove(dir_ino, name, name_len);
+    
     // Calculate entry size (8-byte aligned)
     uint16_t entry_size = 8 + name_len;
     entry_size = (entry_size + 7) & ~7;
@@ -687,7 +941,7 @@ static bool add_dir_entry(uint8_t drive_index, uint32_t dir_ino,
     while (offset < dir_inode.i_size && !entry_added) {
         // Get block
         uint32_t block_no;
-        if (!get_block_from_inode(&dir_inode, block_idx, &block_no) || block_no == 0) break;
+        if (!get_block_from_inode(dir_ino, &dir_inode, block_idx, &block_no) || block_no == 0) break;
         
         // Read block
         uint8_t *block_data = io_buffer;
@@ -764,38 +1018,306 @@ static bool add_dir_entry(uint8_t drive_index, uint32_t dir_ino,
         if (!ext2_write_block(drive_index, block_no, block_data)) return false;
         
         // Update inode
-        if (!set_block_in_inode(&dir_inode, block_idx, block_no)) return false;
+        if (!set_block_in_inode(dir_ino, &dir_inode, block_idx, block_no)) return false;
         
         // Update size and block count
         dir_inode.i_size += fs.block_size;
         dir_inode.i_blocks += fs.block_size / 512;
-        
-        // Update modification time
-        dir_inode.i_mtime = 0;
-        
-        if (!ext2_write_inode(drive_index, dir_ino, &dir_inode)) return false;
     }
     
+    // A new name modifies the directory wherever it went
+    dir_inode.i_mtime = dir_inode.i_ctime = ext2_now();
+    if (!ext2_write_inode(drive_index, dir_ino, &dir_inode)) return false;
+    
+    dcache_insert(dir_ino, name, name_len, ino);
     return true;
 }
 
-// Mount an EXT2 filesystem
-bool ext2_mount(uint8_t drive_index) {
-    if (!initialized || mounted) return false;
-    
+// Fill runs of page cache pages from their files' blocks, holes and the tail past EOF read
+// as zero. The runs hold PCACHE_READAHEAD_MAX pages at most.
+static bool fill_file_pages(const pcache_fill_t *fills, size_t fill_count) {
+    uint32_t blocks_per_page = PCACHE_PAGE_SIZE / fs.block_size;
+    uint32_t sectors_per_block = fs.block_size / BLOCK_SECTOR_SIZE;
+    uint32_t sizes[PCACHE_READAHEAD_MAX];
+    size_t count = 0;
+    
+    // Fills run concurrently without any lock, each builds its own requests. Small ones fit
+    // on the stack like block_submit's.
+    size_t max_requests = 0;
+    for (size_t f = 0; f < fill_count; f++) {
+        max_requests += fills[f].count * blocks_per_page;
+    }
+    block_request_t stack_requests[BLOCK_STACK_BATCH];
+    block_request_t *requests = stack_requests;
+    if (max_requests > BLOCK_STACK_BATCH) {
+        requests = kmalloc(max_requests * sizeof(block_request_t));
+        if (!requests) {
+            LOG_ERROR("Out of memory filling %u pages", (uint32_t)(max_requests / blocks_per_page));
+            return false;
+        }
+    }
+    
+    bool ok = true;
+    for (size_t f = 0; f < fill_count && ok; f++) {
+        uint32_t ino = fills[f].ino;
+        ext2_inode_t inode;
+        if (!ext2_read_inode(fs.drive_index, ino, &inode)) {
+            ok = false;
+            break;
+        }
+        sizes[f] = inode.i_size;
+        
+        for (size_t p = 0; p < fills[f].count; p++) {
+            uint8_t *data = (uint8_t*)fills[f].pages[p];
+            uint32_t page_index = fills[f].index + p;
+            
+            for (uint32_t i = 0; i < blocks_per_page; i++) {
+                uint8_t *block_data = data + i * fs.block_size;
+                uint32_t block_no;
+                
+                if (get_block_from_inode(ino, &inode, page_index * blocks_per_page + i, &block_no)) {
+                    requests[count].sector = (uint64_t)block_no * sectors_per_block;
+                    requests[count].count = sectors_per_block;
+                    requests[count].buffer = block_data;
+                    count++;
+                } else {
+                    memset(block_data, 0, fs.block_size);
+                }
+            }
+        }
+    }
+    
+    // Contiguous blocks are read with a single command, every run in one batch
+    if (ok && count > 0) {
+        ok = block_submit(fs.drive_index, requests, count, false);
+    }
+    if (requests != stack_requests) {
+        kfree(requests);
+    }
+    if (!ok) {
+        return false;
+    }
+    
+    // Mappings must not see whatever follows EOF in the last block
+    for (size_t f = 0; f < fill_count; f++) {
+        for (size_t p = 0; p < fills[f].count; p++) {
+            uint64_t page_start = (uint64_t)(fills[f].index + p) * PCACHE_PAGE_SIZE;
+            if (page_start + PCACHE_PAGE_SIZE > sizes[f]) {
+                size_t valid = sizes[f] > page_start ? sizes[f] - page_start : 0;
+                memset((uint8_t*)fills[f].pages[p] + valid, 0, PCACHE_PAGE_SIZE - valid);
+            }
+        }
+    }
+    
+    return true;
+}
+
+// Track sequential access to a file and read ahead of pages [first, last]
+static void file_readahead(ext2_file_t *file, uint32_t first, uint32_t last) {
+    uint32_t file_pages = (file->inode->i_size + PCACHE_PAGE_SIZE - 1) / PCACHE_PAGE_SIZE;
+    bool same_page = file->ra_window > 0 && first + 1 == file->ra_next;
+    bool sequential = first == file->ra_next || same_page;
+    
+    file->ra_next = last + 1;
+    
+    // A large read fetches its own pages in one batch
+    if (last > first) {
+        pcache_readahead(file->inode_num, first, last - first + 1);
+    }
+    
+    if (!sequential) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        return;
+    }
+    
+    // Start small and double with every new page read in order
+    if (file->ra_window == 0) {
+        file->ra_window = EXT2_READAHEAD_MIN;
+    } else if (!same_page && file->ra_window < PCACHE_READAHEAD_MAX) {
+        file->ra_window *= 2;
+        if (file->ra_window > PCACHE_READAHEAD_MAX) file->ra_window = PCACHE_READAHEAD_MAX;
+    }
+    
+    // Refill once the reader is within half a window of what was fetched
+    uint32_t start = file->ra_end > last + 1 ? file->ra_end : last + 1;
+    if (start - (last + 1) > file->ra_window / 2 || start >= file_pages) {
+        return;
+    }
+    
+    uint32_t count = file->ra_window;
+    if (start + count > file_pages) {
+        count = file_pages - start;
+    }
+    
+    pcache_readahead(file->inode_num, start, count);
+    file->ra_end = start + count;
+}
+
+// Write a dirty page cache page back to the file's blocks
+static bool flush_file_page(uint32_t ino, uint32_t index, const void *page) {
+    ext2_inode_t inode;
+    if (!ext2_read_inode(fs.drive_index, ino, &inode)) {
+        return false;
+    }
+    
+    const uint8_t *data = (const uint8_t*)page;
+    uint32_t blocks_per_page = PCACHE_PAGE_SIZE / fs.block_size;
+    uint32_t sectors_per_block = fs.block_size / BLOCK_SECTOR_SIZE;
+    block_request_t requests[EXT2_MAX_BLOCKS_PER_PAGE];
+    size_t count = 0;
+    
+    for (uint32_t i = 0; i < blocks_per_page; i++) {
+        uint32_t block_no;
+        
+        // Holes and blocks past EOF have nothing to write to
+        if (!get_block_from_inode(ino, &inode, index * blocks_per_page + i, &block_no)) {
+            continue;
+        }
+        
+        requests[count].sector = (uint64_t)block_no * sectors_per_block;
+        requests[count].count = sectors_per_block;
+        requests[count].buffer = (void*)(data + i * fs.block_size);
+        count++;
+    }
+    
+    // Contiguous blocks are written with a single command
+    return count == 0 || block_submit(fs.drive_index, requests, count, true);
+}
+
+// Make sure every block backing [pos, pos + len) exists and the size covers it
+static bool map_file_blocks(ext2_file_t *file, uint64_t pos, size_t len) {
+    uint32_t first = pos / fs.block_size;
+    uint32_t last = (pos + len - 1) / fs.block_size;
+    uint32_t goal = 0;
+    
+    // Continue right after the previous block, a new file starts in its inode's group
+    uint32_t prev_block;
+    if (first > 0 && get_block_from_inode(file->inode_num, file->inode, first - 1, &prev_block)) {
+        goal = prev_block + 1;
+    } else if (first == 0) {
+        uint32_t bg = (file->inode_num - 1) / fs.inodes_per_group;
+        goal = bg * fs.blocks_per_group + fs.superblock->s_first_data_block;
+    }
+    
+    uint32_t block_idx = first;
+    while (block_idx <= last) {
+        uint32_t block_no;
+        if (get_block_from_inode(file->inode_num, file->inode, block_idx, &block_no)) {
+            goal = block_no + 1;
+            block_idx++;
+            continue;
+        }
+        
+        // Allocate the whole hole as one run if the bitmap allows
+        uint32_t hole = 1;
+        while (block_idx + hole <= last &&
+               !get_block_from_inode(file->inode_num, file->inode, block_idx + hole, &block_no)) {
+            hole++;
+        }
+        
+        uint32_t run;
+        block_no = ext2_allocate_blocks(fs.drive_index, goal, hole, &run);
+        if (block_no == 0) {
+            return false;
+        }
+        
+        for (uint32_t i = 0; i < run; i++) {
+            if (!set_block_in_inode(file->inode_num, file->inode, block_idx + i, block_no + i)) {
+                return false;
+            }
+            
+            // The page cache owns file data, drop any stale copy so it is never written over it
+            bcache_forget(fs.drive_index, block_no + i);
+        }
+        
+        // Update inode blocks
+        file->inode->i_blocks += run * (fs.block_size / 512);
+        goal = block_no + run;
+        block_idx += run;
+    }
+    
+    // Grow the file before the page can be flushed, so write-back sees the new blocks
+    if (pos + len > file->inode->i_size) {
+        file->inode->i_size = pos + len;
+    }
+    
+    icache_mark_dirty(file->cached);
+    return true;
+}
+
+// Map a journal block to its disk block
+static bool journal_bmap(uint32_t logical, uint32_t *physical) {
+    return get_block_from_inode(journal_ino, &journal_inode, logical, physical);
+}
+
+// Open the journal and replay it, returns false only if a replay failed
+static bool mount_journal(void) {
+    journal_ino = fs.superblock->s_journal_inum;
+    if (!read_inode_table(fs.drive_index, journal_ino, &journal_inode) ||
+        !journal_load(fs.drive_index, fs.block_size, journal_bmap, flush_metadata)) {
+        LOG_WARN("No usable journal in inode %u, metadata is not journaled", journal_ino);
+        return true;
+    }
+    
+    if (!journal_needs_recovery()) {
+        return true;
+    }
+    
+    if (!journal_recover()) {
+        LOG_ERROR_MSG("Journal recovery failed");
+        return false;
+    }
+    
+    // Replay rewrote metadata behind the caches, start them over and reread the counters.
+    // Nothing is modified before the replay, a dirty block would now go over replayed data.
+    bcache_stats_t cache_stats;
+    bcache_get_stats(&cache_stats);
+    if (cache_stats.dirty > 0) {
+        LOG_ERROR("%u cached blocks were modified before the journal replay", (uint32_t)cache_stats.dirty);
+        return false;
+    }
+    bcache_invalidate(fs.drive_index);
+    if (!icache_init(icache_read_inode, icache_write_inode)) {
+        return false;
+    }
+    
+    if (!block_read(fs.drive_index, 2, sizeof(ext2_superblock_t) / BLOCK_SECTOR_SIZE, io_buffer)) {
+        return false;
+    }
+    memcpy(fs.superblock, io_buffer, sizeof(ext2_superblock_t));
+    
+    uint32_t bg_desc_block = fs.superblock->s_first_data_block + 1;
+    uint32_t bg_desc_size = sizeof(ext2_group_desc_t) * fs.groups_count;
+    uint32_t bg_desc_blocks = (bg_desc_size + fs.block_size - 1) / fs.block_size;
+    for (uint32_t i = 0; i < bg_desc_blocks; i++) {
+        if (!ext2_read_block(fs.drive_index, bg_desc_block + i,
+                             (uint8_t*)fs.group_descs + (i * fs.block_size))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool unmount_fs(void);
+
+// Mount an EXT2 filesystem
+static bool mount_fs(uint8_t drive_index) {
+    if (!initialized || mounted) return false;
+    
     LOG_INFO("Mounting EXT2 filesystem on drive %u", drive_index);
     
     // Check drive
-    if (!ata_drive_present(drive_index)) {
+    if (!block_device_present(drive_index)) {
         LOG_ERROR("Drive %u not present", drive_index);
         return false;
     }
     
     fs.drive_index = drive_index;
     
-    // Read superblock (sector 2 for 1K blocks)
+    // Read superblock (1K at byte offset 1024)
     uint8_t *sb_buffer = io_buffer;
-    if (!read_sector(drive_index, 2, sb_buffer)) {
+    if (!block_read(drive_index, 2, sizeof(ext2_superblock_t) / BLOCK_SECTOR_SIZE, sb_buffer)) {
         LOG_ERROR("Failed to read superblock");
         return false;
     }
@@ -814,8 +1336,44 @@ bool ext2_mount(uint8_t drive_index) {
     fs.inode_size = sb->s_inode_size > 0 ? sb->s_inode_size : 128;
     fs.groups_count = (sb->s_blocks_count + fs.blocks_per_group - 1) / fs.blocks_per_group;
     
+    // File pages are assembled from whole blocks
+    if (fs.block_size > PCACHE_PAGE_SIZE) {
+        LOG_ERROR("Unsupported block size: %u", fs.block_size);
+        return false;
+    }
+    
+    // Set up the buffer cache for this block size
+    if (!bcache_init(fs.block_size)) {
+        LOG_ERROR("Failed to initialize buffer cache");
+        return false;
+    }
+    
+    // In-core inodes sit on top of the inode table blocks
+    if (!icache_init(icache_read_inode, icache_write_inode)) {
+        LOG_ERROR("Failed to initialize inode cache");
+        bcache_shutdown();
+        return false;
+    }
+    
+    // File data lives in the page cache, shared with mmap and tmpfs
+    if (!pcache_init() || !pcache_set_backing(fill_file_pages, flush_file_page)) {
+        LOG_ERROR("Failed to attach page cache");
+        icache_shutdown();
+        bcache_shutdown();
+        return false;
+    }
+    
+    // Name lookups start cold on every mount
+    if (!dcache_init()) {
+        LOG_ERROR("Failed to initialize dentry cache");
+        pcache_set_backing(NULL, NULL);
+        icache_shutdown();
+        bcache_shutdown();
+        return false;
+    }
+    
     // Copy superblock
-    fs.superblock = (ext2_superblock_t*)pmm_alloc_page();
+    fs.superblock = (ext2_superblock_t*)kmalloc(sizeof(ext2_superblock_t));
     if (!fs.superblock) {
         LOG_ERROR("Failed to allocate memory for superblock");
         return false;
@@ -831,7 +1389,7 @@ bool ext2_mount(uint8_t drive_index) {
     fs.group_descs = (ext2_group_desc_t*)pmm_alloc_pages((bg_desc_blocks * fs.block_size + 4095) / 4096);
     if (!fs.group_descs) {
         LOG_ERROR("Failed to allocate memory for group descriptors");
-        pmm_free_page(fs.superblock);
+        kfree(fs.superblock);
         return false;
     }
     
@@ -841,20 +1399,35 @@ bool ext2_mount(uint8_t drive_index) {
                           (uint8_t*)fs.group_descs + (i * fs.block_size))) {
             LOG_ERROR("Failed to read block group descriptors");
             pmm_free_page(fs.group_descs);
-            pmm_free_page(fs.superblock);
+            kfree(fs.superblock);
             return false;
         }
     }
     
-    // Initialize cache memory
-    for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-        if (!fs.cache[i].data) {
-            fs.cache[i].data = pmm_alloc_page();
-        }
+    // Allocation hints start at the front of every group
+    block_hints = kzalloc(fs.groups_count * sizeof(uint32_t));
+    inode_hints = kzalloc(fs.groups_count * sizeof(uint32_t));
+    if (!block_hints || !inode_hints) {
+        LOG_ERROR("Failed to allocate block group hints");
+        kfree(block_hints);
+        kfree(inode_hints);
+        block_hints = NULL;
+        inode_hints = NULL;
+        pmm_free_page(fs.group_descs);
+        kfree(fs.superblock);
+        return false;
     }
     
     mounted = true;
     strcpy(fs.current_dir, "/");
+    counters_dirty = false;
+    
+    // ext3 filesystems carry a journal, replay it before trusting any metadata
+    if ((fs.superblock->s_feature_compat & EXT2_FEATURE_COMPAT_HAS_JOURNAL) &&
+        fs.superblock->s_journal_inum != 0 && !mount_journal()) {
+        unmount_fs();
+        return false;
+    }
     
     fs.blocks_count = fs.superblock->s_blocks_count;
     fs.inodes_count = fs.superblock->s_inodes_count;
@@ -866,36 +1439,53 @@ bool ext2_mount(uint8_t drive_index) {
     return true;
 }
 
+bool ext2_mount(uint8_t drive_index) {
+    fs_lock();
+    bool ok = mount_fs(drive_index);
+    fs_unlock();
+    return ok;
+}
+
+// Get an open file handle
+ext2_file_t *ext2_get_file(int fd) {
+    if (!mounted || fd < 0 || fd >= EXT2_MAX_FILES) {
+        return NULL;
+    }
+    
+    return fs.open_files[fd];
+}
+
+// Get the mounted filesystem state
+ext2_fs_t *ext2_get_fs(void) {
+    return &fs;
+}
+
 // Unmount filesystem
-bool ext2_unmount(void) {
+static bool unmount_fs(void) {
     if (!mounted) return false;
     
     LOG_INFO_MSG("Unmounting EXT2 filesystem");
     
-    // Flush dirty cache blocks
-    for (int i = 0; i < EXT2_CACHE_SIZE; i++) {
-        if (fs.cache[i].valid && fs.cache[i].dirty) {
-            ext2_write_block(fs.drive_index, fs.cache[i].block_no, fs.cache[i].data);
-        }
-        
-        // Free cache memory
-        if (fs.cache[i].data) {
-            pmm_free_page(fs.cache[i].data);
-            fs.cache[i].data = NULL;
+    // Close open files, dropping their inode references
+    for (int i = 0; i < EXT2_MAX_FILES; i++) {
+        if (fs.open_files[i]) {
+            icache_put(fs.open_files[i]->cached);
+            kmem_cache_free(file_cache, fs.open_files[i]);
+            fs.open_files[i] = NULL;
         }
-        
-        fs.cache[i].valid = false;
-        fs.cache[i].dirty = false;
     }
     
-    // Close open files
-    for (int i = 0; i < EXT2_MAX_FILES; i++) {
-        fs.open_files[i].is_open = false;
-    }
+    // Flush file pages, then inodes, then the counters, commit them and release the caches
+    pcache_set_backing(NULL, NULL);
+    icache_shutdown();
+    write_fs_counters();
+    journal_shutdown();
+    bcache_shutdown();
+    dcache_shutdown();
     
     // Free resources
     if (fs.superblock) {
-        pmm_free_page(fs.superblock);
+        kfree(fs.superblock);
         fs.superblock = NULL;
     }
     
@@ -904,12 +1494,25 @@ bool ext2_unmount(void) {
         fs.group_descs = NULL;
     }
     
+    kfree(block_hints);
+    kfree(inode_hints);
+    block_hints = NULL;
+    inode_hints = NULL;
+    
     mounted = false;
     LOG_INFO_MSG("EXT2 filesystem unmounted");
     
     return true;
 }
 
+// Unmount filesystem
+bool ext2_unmount(void) {
+    fs_lock();
+    bool ok = unmount_fs();
+    fs_unlock();
+    return ok;
+}
+
 // Simple file creation function
 static bool create_file(uint8_t drive_index, const char *path, uint32_t mode, uint8_t type) {
     if (!path) return false;
@@ -982,7 +1585,7 @@ static bool create_file(uint8_t drive_index, const char *path, uint32_t mode, ui
     inode.i_mode = file_type | (mode & 0x1FF);
     
     // Set times
-    inode.i_ctime = inode.i_atime = inode.i_mtime = 0;
+    inode.i_ctime = inode.i_atime = inode.i_mtime = ext2_now();
     
     // Set link count
     inode.i_links_count = 1;
@@ -997,7 +1600,7 @@ static bool create_file(uint8_t drive_index, const char *path, uint32_t mode, ui
 }
 
 // Create a device (character or block)
-bool ext2_create_device(uint8_t drive_index, const char *path, uint32_t mode, uint32_t dev) {
+static bool create_device(uint8_t drive_index, const char *path, uint32_t mode, uint32_t dev) {
     if (!mounted || !path) return false;
     
     // Determine device type
@@ -1034,8 +1637,18 @@ bool ext2_create_device(uint8_t drive_index, const char *path, uint32_t mode, ui
     return ext2_write_inode(drive_index, ino, &inode);
 }
 
+// Create a device (character or block)
+bool ext2_create_device(uint8_t drive_index, const char *path, uint32_t mode, uint32_t dev) {
+    fs_lock();
+    journal_start();
+    bool ok = create_device(drive_index, path, mode, dev);
+    journal_stop();
+    fs_unlock();
+    return ok;
+}
+
 // Create a directory
-bool ext2_mkdir(const char *path, uint32_t mode) {
+static bool make_directory(const char *path, uint32_t mode) {
     if (!mounted || !path) return false;
     
     // Create the directory
@@ -1121,125 +1734,228 @@ bool ext2_mkdir(const char *path, uint32_t mode) {
     // Update directory count
     uint32_t bg = (ino - 1) / fs.inodes_per_group;
     fs.group_descs[bg].bg_used_dirs_count++;
+    counters_dirty = true;
     
     return ext2_write_inode(fs.drive_index, parent_ino, &parent);
 }
 
-// File open function
-int ext2_open(const char *path, uint32_t flags) {
-    if (!mounted || !path) return -1;
-    
-    // Find available file handle
-    int fd = -1;
-    for (int i = 0; i < EXT2_MAX_FILES; i++) {
-        if (!fs.open_files[i].is_open) {
-            fd = i;
-            break;
-        }
-    }
-    
-    if (fd == -1) {
-        LOG_ERROR_MSG("Too many open files");
-        return -1;
-    }
+// Create a directory
+bool ext2_mkdir(const char *path, uint32_t mode) {
+    fs_lock();
+    journal_start();
+    bool ok = make_directory(path, mode);
+    journal_stop();
+    fs_unlock();
+    return ok;
+}
+
+// Open a file without taking a descriptor slot
+static ext2_file_t *open_handle(const char *path, uint32_t flags) {
+    if (!mounted || !path) return NULL;
     
     // Try to find the file
     uint32_t inode_no = ext2_lookup_path(fs.drive_index, path);
     
     // Create if it doesn't exist and O_CREAT is set
     if (inode_no == 0 && (flags & EXT2_O_CREAT)) {
-        if (!create_file(fs.drive_index, path, 0644, EXT2_FT_REG_FILE)) {
-            return -1;
+        journal_start();
+        bool created = create_file(fs.drive_index, path, 0644, EXT2_FT_REG_FILE);
+        journal_stop();
+        if (!created) {
+            return NULL;
         }
         
         inode_no = ext2_lookup_path(fs.drive_index, path);
-        if (inode_no == 0) return -1;
+        if (inode_no == 0) return NULL;
     } 
     else if (inode_no == 0) {
         LOG_ERROR("File not found: %s", path);
-        return -1;
+        return NULL;
     }
     
-    // Read inode
-    ext2_inode_t inode;
-    if (!ext2_read_inode(fs.drive_index, inode_no, &inode)) {
-        return -1;
+    // Share the in-core inode with other handles of the file
+    icache_inode_t *ip = icache_get(inode_no);
+    if (!ip) {
+        return NULL;
     }
     
     // Check file type
-    if (EXT2_S_ISDIR(inode.i_mode) && (flags & (EXT2_O_WRONLY | EXT2_O_RDWR))) {
+    if (EXT2_S_ISDIR(ip->inode.i_mode) && EXT2_WRITABLE(flags)) {
         LOG_ERROR("Cannot open directory for writing");
-        return -1;
+        icache_put(ip);
+        return NULL;
     }
     
     // Truncate if requested
-    if ((flags & EXT2_O_TRUNC) && (flags & (EXT2_O_WRONLY | EXT2_O_RDWR))) {
+    if ((flags & EXT2_O_TRUNC) && EXT2_WRITABLE(flags)) {
         // TODO: implement truncate
     }
     
     // Initialize file handle
-    fs.open_files[fd].inode_num = inode_no;
-    fs.open_files[fd].inode = inode;
-    fs.open_files[fd].flags = flags;
-    fs.open_files[fd].position = 0;
-    fs.open_files[fd].is_open = true;
-    
-    return fd;
+    ext2_file_t *file = kmem_cache_alloc(file_cache);
+    if (!file) {
+        LOG_ERROR_MSG("Failed to allocate file handle");
+        icache_put(ip);
+        return NULL;
+    }
+    
+    file->inode_num = inode_no;
+    file->inode = &ip->inode;
+    file->cached = ip;
+    file->flags = flags;
+    file->position = 0;
+    file->is_open = true;
+    file->ra_next = 0;
+    file->ra_end = 0;
+    file->ra_window = 0;
+    return file;
 }
 
-// Close file
-bool ext2_close(int fd) {
-    if (!mounted || fd < 0 || fd >= EXT2_MAX_FILES || !fs.open_files[fd].is_open) {
+// Open a file without taking a descriptor slot, for callers that keep their own handles
+ext2_file_t *ext2_open_file(const char *path, uint32_t flags) {
+    fs_lock();
+    ext2_file_t *file = open_handle(path, flags);
+    fs_unlock();
+    return file;
+}
+
+// Close a handle from ext2_open_file
+bool ext2_close_file(ext2_file_t *file) {
+    if (!file) {
         return false;
     }
     
-    fs.open_files[fd].is_open = false;
-    return true;
+    // Write the inode back into its table block, the block itself is flushed later
+    fs_lock();
+    bool ok = icache_sync_inode(file->cached);
+    icache_put(file->cached);
+    fs_unlock();
+    
+    kmem_cache_free(file_cache, file);
+    return ok;
 }
 
-// Read from file
-ssize_t ext2_read(int fd, void *buffer, size_t size) {
-    if (!mounted || !buffer || fd < 0 || fd >= EXT2_MAX_FILES || !fs.open_files[fd].is_open) {
+// Put a new handle in a free descriptor slot
+static int open_fd(const char *path, uint32_t flags) {
+    if (!mounted || !path) return -1;
+    
+    // Find available file handle
+    int fd = -1;
+    for (int i = 0; i < EXT2_MAX_FILES; i++) {
+        if (!fs.open_files[i]) {
+            fd = i;
+            break;
+        }
+    }
+    
+    if (fd == -1) {
+        LOG_ERROR_MSG("Too many open files");
         return -1;
     }
     
-    // Check if file is readable
-    if ((fs.open_files[fd].flags & EXT2_O_WRONLY) && 
-        !(fs.open_files[fd].flags & EXT2_O_RDWR)) {
-        LOG_ERROR("File not opened for reading");
+    ext2_file_t *file = open_handle(path, flags);
+    if (!file) {
         return -1;
     }
+    fs.open_files[fd] = file;
     
-    ext2_file_t *file = &fs.open_files[fd];
+    return fd;
+}
+
+// File open function
+int ext2_open(const char *path, uint32_t flags) {
+    fs_lock();
+    int fd = open_fd(path, flags);
+    fs_unlock();
+    return fd;
+}
+
+// Close file
+bool ext2_close(int fd) {
+    fs_lock();
+    ext2_file_t *file = NULL;
+    if (mounted && fd >= 0 && fd < EXT2_MAX_FILES) {
+        file = fs.open_files[fd];
+        fs.open_files[fd] = NULL;
+    }
+    bool ok = ext2_close_file(file);
+    fs_unlock();
+    return ok;
+}
+
+// Get an open file that may be read from
+static ext2_file_t *readable_file(int fd) {
+    if (!mounted || fd < 0 || fd >= EXT2_MAX_FILES || !fs.open_files[fd]) {
+        return NULL;
+    }
     
+    // Check if file is readable
+    if (!EXT2_READABLE(fs.open_files[fd]->flags)) {
+        LOG_ERROR("File not opened for reading");
+        return NULL;
+    }
+    
+    return fs.open_files[fd];
+}
+
+// Copy file data at pos straight out of the cached pages or blocks
+static ssize_t read_at(ext2_file_t *file, void *buffer, size_t size, uint64_t pos) {
     // Check if at end of file
-    if (file->position >= file->inode.i_size) {
+    if (pos >= file->inode->i_size) {
         return 0;
     }
     
     // Limit read size to file size
-    if (file->position + size > file->inode.i_size) {
-        size = file->inode.i_size - file->position;
+    if (pos + size > file->inode->i_size) {
+        size = file->inode->i_size - pos;
     }
     
-    // Calculate block positions
-    uint32_t start_block = file->position / fs.block_size;
-    uint32_t block_offset = file->position % fs.block_size;
-    
     // Read data
     uint8_t *buf = (uint8_t*)buffer;
     size_t bytes_read = 0;
     size_t remaining = size;
     
-    while (remaining > 0) {
+    // Regular file data comes straight out of the shared page cache
+    if (EXT2_S_ISREG(file->inode->i_mode) && remaining > 0) {
+        file_readahead(file, pos / PCACHE_PAGE_SIZE,
+                       (pos + remaining - 1) / PCACHE_PAGE_SIZE);
+    }
+    
+    while (EXT2_S_ISREG(file->inode->i_mode) && remaining > 0) {
+        uint64_t at = pos + bytes_read;
+        uint32_t page_offset = at % PCACHE_PAGE_SIZE;
+        
+        pcache_page_t *page = pcache_read(file->inode_num, at / PCACHE_PAGE_SIZE);
+        if (!page) {
+            break;
+        }
+        
+        size_t to_copy = PCACHE_PAGE_SIZE - page_offset;
+        if (to_copy > remaining) {
+            to_copy = remaining;
+        }
+        
+        memcpy(buf + bytes_read, (uint8_t*)page->data + page_offset, to_copy);
+        pcache_release(page);
+        
+        bytes_read += to_copy;
+        remaining -= to_copy;
+    }
+    
+    // Directories and other inodes are read through the buffer cache
+    uint32_t start_block = pos / fs.block_size;
+    uint32_t block_offset = pos % fs.block_size;
+    
+    while (!EXT2_S_ISREG(file->inode->i_mode) && remaining > 0) {
         // Get block number
         uint32_t block_no;
-        if (!get_block_from_inode(&file->inode, start_block, &block_no) || block_no == 0) {
+        if (!get_block_from_inode(file->inode_num, file->inode, start_block, &block_no) || block_no == 0) {
             break;
         }
         
-        // Read the block
-        if (!ext2_read_block(fs.drive_index, block_no, io_buffer)) {
+        // Borrow the block
+        bcache_buf_t *block_buf = bcache_read(fs.drive_index, block_no);
+        if (!block_buf) {
             break;
         }
         
@@ -1249,8 +1965,9 @@ ssize_t ext2_read(int fd, void *buffer, size_t size) {
             to_copy = remaining;
         }
         
-        // Copy data
-        memcpy(buf + bytes_read, io_buffer + block_offset, to_copy);
+        // Copy data straight from the cached block
+        memcpy(buf + bytes_read, (uint8_t*)block_buf->data + block_offset, to_copy);
+        bcache_release(block_buf);
         
         // Update counters
         bytes_read += to_copy;
@@ -1259,107 +1976,304 @@ ssize_t ext2_read(int fd, void *buffer, size_t size) {
         block_offset = 0;
     }
     
-    // Update file position
-    file->position += bytes_read;
-    
-    // Update access time
-    file->inode.i_atime = 0;
-    ext2_write_inode(fs.drive_index, file->inode_num, &file->inode);
+    // Update access time in memory, relatime keeps most reads from dirtying the inode
+    icache_touch_atime(file->cached, ext2_now());
     
     return bytes_read;
 }
 
-// Write to file
-ssize_t ext2_write(int fd, const void *buffer, size_t size) {
-    if (!mounted || !buffer || fd < 0 || fd >= EXT2_MAX_FILES || !fs.open_files[fd].is_open) {
+// Read from file
+ssize_t ext2_read(int fd, void *buffer, size_t size) {
+    fs_lock();
+    ext2_file_t *file = readable_file(fd);
+    ssize_t bytes_read = -1;
+    if (file && buffer) {
+        bytes_read = read_at(file, buffer, size, file->position);
+        if (bytes_read > 0) {
+            file->position += bytes_read;
+        }
+    }
+    fs_unlock();
+    return bytes_read;
+}
+
+// Read from file at an offset, the file position is left alone
+ssize_t ext2_pread(int fd, void *buffer, size_t size, uint64_t offset) {
+    fs_lock();
+    ext2_file_t *file = readable_file(fd);
+    ssize_t bytes_read = file && buffer ? read_at(file, buffer, size, offset) : -1;
+    fs_unlock();
+    return bytes_read;
+}
+
+// Read into several buffers in turn, stopping at the first short read
+static ssize_t read_vector(int fd, const ext2_iovec_t *iov, int iovcnt) {
+    ext2_file_t *file = readable_file(fd);
+    if (!file || !iov || iovcnt < 0) {
         return -1;
     }
     
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        if (!iov[i].base) return total > 0 ? total : -1;
+        
+        ssize_t n = read_at(file, iov[i].base, iov[i].len, file->position);
+        if (n < 0) return total > 0 ? total : -1;
+        file->position += n;
+        total += n;
+        if ((size_t)n < iov[i].len) break;
+    }
+    return total;
+}
+
+// Read into several buffers in turn, stopping at the first short read
+ssize_t ext2_readv(int fd, const ext2_iovec_t *iov, int iovcnt) {
+    fs_lock();
+    ssize_t total = read_vector(fd, iov, iovcnt);
+    fs_unlock();
+    return total;
+}
+
+// Get an open file that may be written to
+static ext2_file_t *writable_file(int fd) {
+    if (!mounted || fd < 0 || fd >= EXT2_MAX_FILES || !fs.open_files[fd]) {
+        return NULL;
+    }
+    
     // Check if file is writable
-    if (!(fs.open_files[fd].flags & (EXT2_O_WRONLY | EXT2_O_RDWR))) {
+    if (!EXT2_WRITABLE(fs.open_files[fd]->flags)) {
         LOG_ERROR("File not opened for writing");
-        return -1;
+        return NULL;
     }
     
-    ext2_file_t *file = &fs.open_files[fd];
-    
-    // Calculate block positions
-    uint32_t start_block = file->position / fs.block_size;
-    uint32_t block_offset = file->position % fs.block_size;
-    
-    // Write data
+    return fs.open_files[fd];
+}
+
+// Copy data into the file's cached pages at pos, they are flushed to disk later
+static ssize_t write_at(ext2_file_t *file, const void *buffer, size_t size, uint64_t pos) {
+    // Write data into the page cache, it is flushed to disk later
     const uint8_t *buf = (const uint8_t*)buffer;
     size_t bytes_written = 0;
     size_t remaining = size;
     
     while (remaining > 0) {
-        // Get block number
-        uint32_t block_no;
-        if (!get_block_from_inode(&file->inode, start_block, &block_no)) {
-            // Need to allocate a new block
-            block_no = ext2_allocate_block(fs.drive_index);
-            if (block_no == 0) break;
-            
-            // Zero the block
-            memset(io_buffer, 0, fs.block_size);
-            ext2_write_block(fs.drive_index, block_no, io_buffer);
-            
-            // Add to inode
-            if (!set_block_in_inode(&file->inode, start_block, block_no)) {
-                break;
-            }
-            
-            // Update inode blocks
-            file->inode.i_blocks += fs.block_size / 512;
-        }
-        
-        // If we're not writing a full block, read existing data first
-        if (block_offset > 0 || remaining < fs.block_size) {
-            if (!ext2_read_block(fs.drive_index, block_no, io_buffer)) {
-                break;
-            }
-        }
+        uint64_t at = pos + bytes_written;
+        uint32_t page_offset = at % PCACHE_PAGE_SIZE;
         
         // Calculate bytes to copy
-        size_t to_copy = fs.block_size - block_offset;
+        size_t to_copy = PCACHE_PAGE_SIZE - page_offset;
         if (to_copy > remaining) {
             to_copy = remaining;
         }
         
-        // Copy data
-        memcpy(io_buffer + block_offset, buf + bytes_written, to_copy);
+        // Partial writes need the existing data, full pages are overwritten
+        pcache_page_t *page;
+        if (to_copy < PCACHE_PAGE_SIZE) {
+            page = pcache_read(file->inode_num, at / PCACHE_PAGE_SIZE);
+        } else {
+            page = pcache_get(file->inode_num, at / PCACHE_PAGE_SIZE);
+        }
+        if (!page) {
+            break;
+        }
         
-        // Write the block
-        if (!ext2_write_block(fs.drive_index, block_no, io_buffer)) {
+        // Back the written range with blocks before the page can be flushed
+        if (!map_file_blocks(file, at, to_copy)) {
+            pcache_release(page);
             break;
         }
         
+        memcpy((uint8_t*)page->data + page_offset, buf + bytes_written, to_copy);
+        pcache_mark_dirty(page);
+        pcache_release(page);
+        
         // Update counters
         bytes_written += to_copy;
         remaining -= to_copy;
-        start_block++;
-        block_offset = 0;
     }
     
-    // Update file position
-    file->position += bytes_written;
+    // Update modification time, the inode is written back lazily
+    if (bytes_written > 0) {
+        file->inode->i_mtime = ext2_now();
+        icache_mark_written(file->cached);
+    }
     
-    // Update file size if needed
-    if (file->position > file->inode.i_size) {
-        file->inode.i_size = file->position;
+    return bytes_written;
+}
+
+// Write to file
+ssize_t ext2_write(int fd, const void *buffer, size_t size) {
+    fs_lock();
+    ext2_file_t *file = writable_file(fd);
+    ssize_t written = -1;
+    if (file && buffer) {
+        journal_start();
+        written = write_at(file, buffer, size, file->position);
+        journal_stop();
+        file->position += written;
+    }
+    fs_unlock();
+    return written;
+}
+
+// Write to file at an offset, the file position is left alone
+ssize_t ext2_pwrite(int fd, const void *buffer, size_t size, uint64_t offset) {
+    fs_lock();
+    ext2_file_t *file = writable_file(fd);
+    ssize_t written = -1;
+    if (file && buffer) {
+        journal_start();
+        written = write_at(file, buffer, size, offset);
+        journal_stop();
+    }
+    fs_unlock();
+    return written;
+}
+
+// Write several buffers in turn as one journaled operation
+ssize_t ext2_writev(int fd, const ext2_iovec_t *iov, int iovcnt) {
+    fs_lock();
+    ext2_file_t *file = writable_file(fd);
+    if (!file || !iov || iovcnt < 0) {
+        fs_unlock();
+        return -1;
     }
     
-    // Update modification time
-    file->inode.i_mtime = 0;
+    ssize_t total = 0;
+    journal_start();
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        if (!iov[i].base) break;
+        
+        ssize_t n = write_at(file, iov[i].base, iov[i].len, file->position);
+        file->position += n;
+        total += n;
+        if ((size_t)n < iov[i].len) break;
+    }
+    journal_stop();
+    fs_unlock();
+    return total;
+}
+
+// Copy count bytes at pos of in to out_pos of out page by page, without a bounce buffer
+static ssize_t send_pages(ext2_file_t *out, uint64_t out_pos, ext2_file_t *in, uint64_t pos, size_t count) {
+    if (!EXT2_S_ISREG(in->inode->i_mode)) {
+        return -1;
+    }
+    if (pos >= in->inode->i_size) {
+        return 0;
+    }
+    if (pos + count > in->inode->i_size) {
+        count = in->inode->i_size - pos;
+    }
+    if (count == 0) {
+        return 0;
+    }
     
-    // Write back inode
-    ext2_write_inode(fs.drive_index, file->inode_num, &file->inode);
+    file_readahead(in, pos / PCACHE_PAGE_SIZE, (pos + count - 1) / PCACHE_PAGE_SIZE);
     
-    return bytes_written;
- }
- 
+    size_t sent = 0;
+    journal_start();
+    while (sent < count) {
+        uint64_t at = pos + sent;
+        uint32_t page_offset = at % PCACHE_PAGE_SIZE;
+        size_t chunk = PCACHE_PAGE_SIZE - page_offset;
+        if (chunk > count - sent) {
+            chunk = count - sent;
+        }
+        
+        // The source page is borrowed, its data is copied once into the destination page
+        pcache_page_t *page = pcache_read(in->inode_num, at / PCACHE_PAGE_SIZE);
+        if (!page) {
+            break;
+        }
+        ssize_t n = write_at(out, (uint8_t*)page->data + page_offset, chunk, out_pos + sent);
+        pcache_release(page);
+        
+        sent += n;
+        if ((size_t)n < chunk) break;
+    }
+    journal_stop();
+    
+    if (sent > 0) {
+        icache_touch_atime(in->cached, ext2_now());
+    }
+    return sent;
+}
+
+// Copy file data to another file page by page, without a bounce buffer
+ssize_t ext2_sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count) {
+    fs_lock();
+    ext2_file_t *in = readable_file(in_fd);
+    ext2_file_t *out = writable_file(out_fd);
+    if (!in || !out) {
+        fs_unlock();
+        return -1;
+    }
+    
+    uint64_t pos = offset ? *offset : in->position;
+    ssize_t sent = send_pages(out, out->position, in, pos, count);
+    if (sent > 0) {
+        out->position += sent;
+        if (offset) {
+            *offset = pos + sent;
+        } else {
+            in->position = pos + sent;
+        }
+    }
+    fs_unlock();
+    return sent;
+}
+
+// Read from a handle at an offset
+ssize_t ext2_file_read(ext2_file_t *file, void *buffer, size_t size, uint64_t offset) {
+    if (!mounted || !file || !buffer) {
+        return -1;
+    }
+    if (!EXT2_READABLE(file->flags)) {
+        LOG_ERROR("File not opened for reading");
+        return -1;
+    }
+    
+    fs_lock();
+    ssize_t bytes_read = read_at(file, buffer, size, offset);
+    fs_unlock();
+    return bytes_read;
+}
+
+// Write to a handle at an offset as one journaled operation
+ssize_t ext2_file_write(ext2_file_t *file, const void *buffer, size_t size, uint64_t offset) {
+    if (!mounted || !file || !buffer) {
+        return -1;
+    }
+    if (!EXT2_WRITABLE(file->flags)) {
+        LOG_ERROR("File not opened for writing");
+        return -1;
+    }
+    
+    fs_lock();
+    journal_start();
+    ssize_t written = write_at(file, buffer, size, offset);
+    journal_stop();
+    fs_unlock();
+    return written;
+}
+
+// Copy between two handles, see ext2_sendfile
+ssize_t ext2_file_sendfile(ext2_file_t *out, uint64_t out_pos, ext2_file_t *in, uint64_t in_pos, size_t count) {
+    if (!mounted || !out || !in || !EXT2_WRITABLE(out->flags) ||
+        !EXT2_READABLE(in->flags)) {
+        return -1;
+    }
+    
+    fs_lock();
+    ssize_t sent = send_pages(out, out_pos, in, in_pos, count);
+    fs_unlock();
+    return sent;
+}
  // Remove a file
- bool ext2_unlink(const char *path) {
+ static bool unlink_file(const char *path) {
     if (!mounted || !path) return false;
     
     // Normalize path
@@ -1417,7 +2331,7 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
     while (offset < dir_inode.i_size && !entry_removed) {
         // Get block
         uint32_t block_no;
-        if (!get_block_from_inode(&dir_inode, block_idx, &block_no) || block_no == 0) {
+        if (!get_block_from_inode(dir_ino, &dir_inode, block_idx, &block_no) || block_no == 0) {
             break;
         }
         
@@ -1472,21 +2386,43 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
         return false;
     }
     
+    dcache_insert(dir_ino, filename, strlen(filename), 0);
+    
+    // The directory lost a name
+    uint32_t current_time = ext2_now();
+    dir_inode.i_mtime = dir_inode.i_ctime = current_time;
+    if (!ext2_write_inode(fs.drive_index, dir_ino, &dir_inode)) {
+        return false;
+    }
+    
     // Decrement link count
     inode.i_links_count--;
+    inode.i_ctime = current_time;
     
     // If no more links, mark for deletion
     if (inode.i_links_count == 0) {
-        uint32_t current_time = 0;
         inode.i_dtime = current_time;
+        
+        // Cached pages of a deleted file are never flushed
+        pcache_invalidate_inode(file_ino);
     }
     
     // Write inode back
     return ext2_write_inode(fs.drive_index, file_ino, &inode);
  }
+
+// Remove a file
+bool ext2_unlink(const char *path) {
+    fs_lock();
+    journal_start();
+    bool ok = unlink_file(path);
+    journal_stop();
+    fs_unlock();
+    return ok;
+}
  
  // Remove a directory
- bool ext2_rmdir(const char *path) {
+ static bool remove_directory(const char *path) {
     if (!mounted || !path) return false;
     
     // Normalize path
@@ -1546,7 +2482,7 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
     while (offset < dir_inode.i_size && is_empty) {
         // Get block
         uint32_t block_no;
-        if (!get_block_from_inode(&dir_inode, block_idx, &block_no) || block_no == 0) {
+        if (!get_block_from_inode(dir_ino, &dir_inode, block_idx, &block_no) || block_no == 0) {
             break;
         }
         
@@ -1598,7 +2534,7 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
     
     while (offset < parent_inode.i_size && !entry_removed) {
         uint32_t block_no;
-        if (!get_block_from_inode(&parent_inode, block_idx, &block_no) || block_no == 0) {
+        if (!get_block_from_inode(parent_ino, &parent_inode, block_idx, &block_no) || block_no == 0) {
             break;
         }
         
@@ -1646,6 +2582,10 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
         return false;
     }
     
+    // The name is gone, and so is everything cached under the directory
+    dcache_insert(parent_ino, dirname, strlen(dirname), 0);
+    dcache_invalidate_dir(dir_ino);
+    
     // Free directory blocks
     for (block_idx = 0; block_idx < EXT2_NDIR_BLOCKS; block_idx++) {
         if (dir_inode.i_block[block_idx] != 0) {
@@ -1653,12 +2593,14 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
         }
     }
     
-    // Update parent inode (decrease link count for ..)
+    // Update parent inode (decrease link count for ..), it also lost the name
     parent_inode.i_links_count--;
+    parent_inode.i_mtime = parent_inode.i_ctime = ext2_now();
     
     // Update parent's directory count in block group
     uint32_t bg = (dir_ino - 1) / fs.inodes_per_group;
     fs.group_descs[bg].bg_used_dirs_count--;
+    counters_dirty = true;
     
     // Write parent inode
     if (!ext2_write_inode(fs.drive_index, parent_ino, &parent_inode)) {
@@ -1667,8 +2609,158 @@ ssize_t ext2_write(int fd, const void *buffer, size_t size) {
     
     // Mark directory inode as deleted
     dir_inode.i_links_count = 0;
-    dir_inode.i_dtime = 0;
+    dir_inode.i_dtime = dir_inode.i_ctime = ext2_now();
     
     // Write directory inode
     return ext2_write_inode(fs.drive_index, dir_ino, &dir_inode);
- }
\ No newline at end of file
+ }
+
+// Remove a directory
+bool ext2_rmdir(const char *path) {
+    fs_lock();
+    journal_start();
+    bool ok = remove_directory(path);
+    journal_stop();
+    fs_unlock();
+    return ok;
+}
+
+// VFS adapter, the mount's paths go straight to the functions above
+
+static ssize_t vfs_ext2_read(vfs_file_t *file, void *buffer, size_t size, uint64_t offset) {
+    return ext2_file_read(file->private, buffer, size, offset);
+}
+
+static ssize_t vfs_ext2_write(vfs_file_t *file, const void *buffer, size_t size, uint64_t offset) {
+    return ext2_file_write(file->private, buffer, size, offset);
+}
+
+static void fill_vfs_stat(uint32_t ino, const ext2_inode_t *inode, vfs_stat_t *st) {
+    st->ino = ino;
+    st->mode = inode->i_mode;
+    st->nlink = inode->i_links_count;
+    st->size = inode->i_size;
+    st->blocks = inode->i_blocks;
+    st->block_size = fs.block_size;
+    st->atime = inode->i_atime;
+    st->mtime = inode->i_mtime;
+    st->ctime = inode->i_ctime;
+}
+
+static bool vfs_ext2_fstat(vfs_file_t *file, vfs_stat_t *st) {
+    ext2_file_t *handle = file->private;
+    fs_lock();
+    fill_vfs_stat(handle->inode_num, handle->inode, st);
+    fs_unlock();
+    return true;
+}
+
+// Directory records are read through the directory's pages, *pos is a byte offset into them
+static int read_dir_entry(vfs_file_t *file, uint64_t *pos, vfs_dirent_t *entry) {
+    ext2_file_t *handle = file->private;
+    if (!EXT2_S_ISDIR(handle->inode->i_mode)) {
+        return -1;
+    }
+
+    while (true) {
+        ext2_dir_entry_t record;
+        const size_t header = offsetof(ext2_dir_entry_t, name);
+        ssize_t n = read_at(handle, &record, header, *pos);
+        if (n < (ssize_t)header) {
+            return 0;
+        }
+        if (record.rec_len < header) {
+            LOG_ERROR("Corrupt directory entry in inode %u", handle->inode_num);
+            return -1;
+        }
+
+        uint64_t at = *pos;
+        *pos += record.rec_len;
+        if (record.inode == 0) {
+            continue;   // Unused record
+        }
+        if (read_at(handle, entry->name, record.name_len, at + header) != record.name_len) {
+            return -1;
+        }
+
+        entry->name[record.name_len] = '\0';
+        entry->ino = record.inode;
+        entry->type = record.file_type == EXT2_FT_DIR ? VFS_DT_DIR :
+                      record.file_type == EXT2_FT_REG_FILE ? VFS_DT_REG : VFS_DT_UNKNOWN;
+        return 1;
+    }
+}
+
+static int vfs_ext2_readdir(vfs_file_t *file, uint64_t *pos, vfs_dirent_t *entry) {
+    fs_lock();
+    int result = read_dir_entry(file, pos, entry);
+    fs_unlock();
+    return result;
+}
+
+static bool vfs_ext2_fsync(vfs_file_t *file) {
+    return ext2_file_sync(file->private);
+}
+
+static ssize_t vfs_ext2_sendfile(vfs_file_t *out, uint64_t out_pos, vfs_file_t *in, uint64_t in_pos, size_t count) {
+    return ext2_file_sendfile(out->private, out_pos, in->private, in_pos, count);
+}
+
+static void vfs_ext2_close(vfs_file_t *file) {
+    ext2_close_file(file->private);
+}
+
+static const vfs_file_ops_t ext2_vfs_file_ops = {
+    .read = vfs_ext2_read,
+    .write = vfs_ext2_write,
+    .stat = vfs_ext2_fstat,
+    .readdir = vfs_ext2_readdir,
+    .fsync = vfs_ext2_fsync,
+    .sendfile = vfs_ext2_sendfile,
+    .close = vfs_ext2_close,
+};
+
+static bool vfs_ext2_open(vfs_mount_t *mount, const char *path, uint32_t flags, vfs_file_t *file) {
+    ext2_file_t *handle = ext2_open_file(path, flags);
+    if (!handle) {
+        return false;
+    }
+
+    file->ops = &ext2_vfs_file_ops;
+    file->private = handle;
+    file->ino = handle->inode_num;
+    return true;
+}
+
+static bool vfs_ext2_stat(vfs_mount_t *mount, const char *path, vfs_stat_t *st) {
+    fs_lock();
+    uint32_t ino = mounted ? lookup_path(fs.drive_index, path) : 0;
+    icache_inode_t *ip = ino ? icache_get(ino) : NULL;
+    if (ip) {
+        fill_vfs_stat(ino, &ip->inode, st);
+        icache_put(ip);
+    }
+    fs_unlock();
+    return ip != NULL;
+}
+
+static bool vfs_ext2_mkdir(vfs_mount_t *mount, const char *path, uint32_t mode) {
+    return ext2_mkdir(path, mode);
+}
+
+static bool vfs_ext2_rmdir(vfs_mount_t *mount, const char *path) {
+    return ext2_rmdir(path);
+}
+
+static bool vfs_ext2_unlink(vfs_mount_t *mount, const char *path) {
+    return ext2_unlink(path);
+}
+
+const vfs_fs_ops_t ext2_vfs_ops = {
+    .name = "ext2",
+    .open = vfs_ext2_open,
+    .stat = vfs_ext2_stat,
+    .mkdir = vfs_ext2_mkdir,
+    .rmdir = vfs_ext2_rmdir,
+    .unlink = vfs_ext2_unlink,
+};
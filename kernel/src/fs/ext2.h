@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <fs/vfs.h>
+#include <core/exec/wait.h>
 
 // Define ssize_t
 typedef int64_t ssize_t;
@@ -12,6 +14,9 @@ typedef int64_t ssize_t;
 #define EXT2_SUPER_MAGIC 0xEF53
 #define EXT2_ROOT_INO    2
 
+// Compatible features
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x0004  // ext3 journal in s_journal_inum
+
 // File types
 #define EXT2_S_IFREG  0x8000  // Regular file
 #define EXT2_S_IFDIR  0x4000  // Directory
@@ -50,6 +55,10 @@ typedef int64_t ssize_t;
 #define EXT2_O_EXCL      0x0200
 #define EXT2_O_TRUNC     0x0400
 
+// Access mode tests, RDONLY and WRONLY are not single bits of RDWR
+#define EXT2_READABLE(flags) (((flags) & EXT2_O_RDWR) != EXT2_O_WRONLY)
+#define EXT2_WRITABLE(flags) (((flags) & EXT2_O_WRONLY) != 0)
+
 // Block pointers in inode
 #define EXT2_NDIR_BLOCKS 12
 #define EXT2_IND_BLOCK   12
@@ -70,7 +79,6 @@ typedef int64_t ssize_t;
 // Limits
 #define EXT2_NAME_LEN    255
 #define EXT2_MAX_FILES   64
-#define EXT2_CACHE_SIZE  32
 #define EXT2_MAX_PATH    256
 
 // Structures
@@ -112,7 +120,18 @@ typedef struct {
     char     s_volume_name[16];
     char     s_last_mounted[64];
     uint32_t s_algorithm_usage_bitmap;
-    uint8_t  s_padding[820];  // Padding to 1024 bytes
+    
+    // Performance hints
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_padding1;
+    
+    // Journaling support (ext3)
+    uint8_t  s_journal_uuid[16];
+    uint32_t s_journal_inum;
+    uint32_t s_journal_dev;
+    uint32_t s_last_orphan;
+    uint8_t  s_padding[788];  // Padding to 1024 bytes
 } __attribute__((packed)) ext2_superblock_t;
 
 typedef struct {
@@ -157,10 +176,14 @@ typedef struct {
 
 typedef struct {
     uint32_t inode_num;
-    ext2_inode_t inode;
+    ext2_inode_t *inode;            // In-core inode shared by every handle of the file
+    struct icache_inode *cached;    // Reference held on it while the file is open
     uint32_t flags;
     size_t position;
     bool is_open;
+    uint32_t ra_next;        // Page a sequential reader asks for next
+    uint32_t ra_end;         // First page past what has been read ahead
+    uint32_t ra_window;      // Readahead size in pages, 0 while access looks random
 } ext2_file_t;
 
 typedef struct {
@@ -174,27 +197,43 @@ typedef struct {
     uint32_t inodes_count;
     ext2_superblock_t *superblock;
     ext2_group_desc_t *group_descs;
-    ext2_file_t open_files[EXT2_MAX_FILES];
+    ext2_file_t *open_files[EXT2_MAX_FILES];
     char current_dir[EXT2_MAX_PATH];
-    
-    struct {
-        uint32_t block_no;
-        void *data;
-        bool dirty;
-        bool valid;
-    } cache[EXT2_CACHE_SIZE];
+    mutex_t lock;                      // Counters, hints, the file table and the journal transaction
+    uint32_t lock_depth;               // Times the owner took it, entry points call each other
 } ext2_fs_t;
 
+// One buffer of a vectored read or write
+typedef struct {
+    void *base;
+    size_t len;
+} ext2_iovec_t;
+
 // Core functions
 bool ext2_init(void);
 bool ext2_mount(uint8_t drive_index);
 bool ext2_unmount(void);
+bool ext2_sync(void);
+bool ext2_fsync(int fd);
 
 // File operations
 int ext2_open(const char *path, uint32_t flags);
 bool ext2_close(int fd);
 ssize_t ext2_read(int fd, void *buffer, size_t size);
 ssize_t ext2_write(int fd, const void *buffer, size_t size);
+ssize_t ext2_pread(int fd, void *buffer, size_t size, uint64_t offset);
+ssize_t ext2_pwrite(int fd, const void *buffer, size_t size, uint64_t offset);
+ssize_t ext2_readv(int fd, const ext2_iovec_t *iov, int iovcnt);
+ssize_t ext2_writev(int fd, const ext2_iovec_t *iov, int iovcnt);
+ssize_t ext2_sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count);
+
+// Handle operations, for callers that keep handles of their own instead of descriptors
+ext2_file_t *ext2_open_file(const char *path, uint32_t flags);
+bool ext2_close_file(ext2_file_t *file);
+ssize_t ext2_file_read(ext2_file_t *file, void *buffer, size_t size, uint64_t offset);
+ssize_t ext2_file_write(ext2_file_t *file, const void *buffer, size_t size, uint64_t offset);
+ssize_t ext2_file_sendfile(ext2_file_t *out, uint64_t out_pos, ext2_file_t *in, uint64_t in_pos, size_t count);
+bool ext2_file_sync(ext2_file_t *file);
 
 // Directory operations
 bool ext2_mkdir(const char *path, uint32_t mode);
@@ -210,8 +249,14 @@ bool ext2_write_block(uint8_t drive_index, uint32_t block_no, void *buffer);
 bool ext2_read_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode);
 bool ext2_write_inode(uint8_t drive_index, uint32_t inode_no, ext2_inode_t *inode);
 uint32_t ext2_allocate_block(uint8_t drive_index);
+uint32_t ext2_allocate_blocks(uint8_t drive_index, uint32_t goal, uint32_t count, uint32_t *allocated);
 uint32_t ext2_allocate_inode(uint8_t drive_index);
 uint32_t ext2_lookup_path(uint8_t drive_index, const char *path);
 char *ext2_normalize_path(const char *path);
+ext2_file_t *ext2_get_file(int fd);
+ext2_fs_t *ext2_get_fs(void);
+
+// Operations to mount the filesystem in the VFS with
+extern const vfs_fs_ops_t ext2_vfs_ops;
 
 #endif // EXT2_H
\ No newline at end of file
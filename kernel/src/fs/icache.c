@@ -0,0 +1,549 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/icache.h>
+#include <memory/slab.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/wait.h>
+#include <core/cpu.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Cache state
+static kmem_cache_t *inode_cache = NULL;
+static icache_inode_t *hash_table[ICACHE_HASH_BUCKETS];
+static icache_inode_t *lru_head = NULL;    // Most recently released
+static icache_inode_t *lru_tail = NULL;    // Eviction candidate
+static icache_io_fn read_inode = NULL;
+static icache_io_fn write_inode = NULL;
+static spinlock_t icache_lock;
+static wait_queue_t io_wait;           // Borrowers waiting for a busy inode
+static bool ready = false;
+static uint64_t write_clock = 0;       // Source of write_seq, an inode read in gets a fresh one
+
+// Statistics
+static size_t inode_count = 0;
+static size_t dirty_count = 0;
+static size_t stat_hits = 0;
+static size_t stat_misses = 0;
+static size_t stat_evictions = 0;
+static size_t stat_writebacks = 0;
+static size_t stat_map_hits = 0;
+static size_t stat_map_misses = 0;
+
+// icache_lock is held with interrupts off like bcache_lock, page faults take it through the
+// page cache fill path
+static uint64_t cache_lock(void) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&icache_lock);
+    return flags;
+}
+
+static void cache_unlock(uint64_t flags) {
+    spinlock_release(&icache_lock);
+    cpu_irq_restore(flags);
+}
+
+// Wait condition of a busy inode
+static bool inode_idle(void *arg) {
+    icache_inode_t *ip = arg;
+    return !ip->busy;
+}
+
+// Hash an inode number into a bucket index
+static inline size_t icache_hash(uint32_t ino) {
+    return (ino * 2654435761U) & (ICACHE_HASH_BUCKETS - 1);
+}
+
+// Unlink an inode from the LRU list
+static void lru_remove(icache_inode_t *ip) {
+    if (ip->lru_prev) {
+        ip->lru_prev->lru_next = ip->lru_next;
+    } else if (lru_head == ip) {
+        lru_head = ip->lru_next;
+    }
+    if (ip->lru_next) {
+        ip->lru_next->lru_prev = ip->lru_prev;
+    } else if (lru_tail == ip) {
+        lru_tail = ip->lru_prev;
+    }
+    ip->lru_prev = NULL;
+    ip->lru_next = NULL;
+}
+
+// Put an inode at the most recently used end of the LRU list
+static void lru_push_head(icache_inode_t *ip) {
+    ip->lru_prev = NULL;
+    ip->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = ip;
+    }
+    lru_head = ip;
+    if (!lru_tail) {
+        lru_tail = ip;
+    }
+}
+
+// Find a cached inode, icache_lock must be held
+static icache_inode_t *hash_lookup(uint32_t ino) {
+    icache_inode_t *ip = hash_table[icache_hash(ino)];
+    while (ip) {
+        if (ip->ino == ino) {
+            return ip;
+        }
+        ip = ip->hash_next;
+    }
+    return NULL;
+}
+
+// Remove an inode from its hash chain
+static void hash_remove(icache_inode_t *ip) {
+    icache_inode_t **link = &hash_table[icache_hash(ip->ino)];
+    while (*link) {
+        if (*link == ip) {
+            *link = ip->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    ip->hash_next = NULL;
+}
+
+// Write a dirty inode to the inode table, icache_lock is held and dropped across the write.
+// Changes to the inode meanwhile dirty it again.
+static bool writeback(icache_inode_t *ip, uint64_t *flags) {
+    if (!ip->dirty || ip->busy) {
+        return !ip->dirty;
+    }
+
+    ip->dirty = false;
+    dirty_count--;
+    ip->busy = true;
+    cache_unlock(*flags);
+
+    bool ok = write_inode(ip->ino, &ip->inode);
+
+    *flags = cache_lock();
+    ip->busy = false;
+    if (ok) {
+        stat_writebacks++;
+    } else {
+        LOG_ERROR("Inode cache: failed to write back inode %u", ip->ino);
+        if (!ip->dirty) {
+            ip->dirty = true;
+            dirty_count++;
+        }
+    }
+    wait_wake_all(&io_wait);
+    return ok;
+}
+
+// Wait for the I/O on a borrowed inode to finish, icache_lock is held and dropped meanwhile
+static void wait_idle(icache_inode_t *ip, uint64_t *flags) {
+    while (ip->busy) {
+        cache_unlock(*flags);
+        wait_event(&io_wait, inode_idle, ip);
+        *flags = cache_lock();
+    }
+}
+
+// Unlink and free an unreferenced inode, icache_lock must be held
+static void free_inode(icache_inode_t *ip) {
+    hash_remove(ip);
+    lru_remove(ip);
+    if (ip->dirty) {
+        dirty_count--;
+    }
+    kmem_cache_free(inode_cache, ip);
+    inode_count--;
+}
+
+// Free the least recently used clean idle inode, icache_lock must be held. Returns false if
+// every idle inode is dirty or busy.
+static bool evict(void) {
+    for (icache_inode_t *ip = lru_tail; ip; ip = ip->lru_prev) {
+        if (!ip->dirty && !ip->busy) {
+            free_inode(ip);
+            stat_evictions++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Set up an empty cache on top of the inode table callbacks
+bool icache_init(icache_io_fn read_fn, icache_io_fn write_fn) {
+    if (ready) {
+        icache_shutdown();
+    }
+
+    if (!read_fn || !write_fn) {
+        return false;
+    }
+
+    if (!inode_cache) {
+        inode_cache = kmem_cache_create("ext2_inode", sizeof(icache_inode_t), 0);
+        if (!inode_cache) {
+            LOG_ERROR_MSG("Inode cache: failed to create inode cache");
+            return false;
+        }
+    }
+
+    memset(hash_table, 0, sizeof(hash_table));
+    read_inode = read_fn;
+    write_inode = write_fn;
+    lru_head = NULL;
+    lru_tail = NULL;
+    inode_count = 0;
+    dirty_count = 0;
+    spinlock_init(&icache_lock);
+    wait_queue_init(&io_wait);
+
+    ready = true;
+    LOG_INFO("Inode cache: up to %u idle inodes, %u hash buckets",
+             (uint32_t)ICACHE_MAX_INODES, (uint32_t)ICACHE_HASH_BUCKETS);
+    return true;
+}
+
+// Write back dirty inodes and free the cache
+void icache_shutdown(void) {
+    if (!ready) {
+        return;
+    }
+
+    icache_sync();
+
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i < ICACHE_HASH_BUCKETS; i++) {
+        while (hash_table[i]) {
+            icache_inode_t *ip = hash_table[i];
+            if (ip->refcount > 0) {
+                LOG_WARN("Inode cache: inode %u still referenced at shutdown", ip->ino);
+            }
+            free_inode(ip);
+        }
+    }
+    lru_head = NULL;
+    lru_tail = NULL;
+    ready = false;
+    cache_unlock(flags);
+}
+
+// Borrow an in-core inode, reading it from the inode table on a miss. The lock is dropped
+// for the read with the inode hashed as busy, lookups of it wait for the read to end.
+icache_inode_t *icache_get(uint32_t ino) {
+    if (!ready || ino == 0) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+    bool synced = false;
+
+    for (;;) {
+        icache_inode_t *ip = hash_lookup(ino);
+        if (ip) {
+            if (ip->refcount++ == 0) {
+                lru_remove(ip);
+            }
+            wait_idle(ip, &flags);
+            if (ip->valid) {
+                stat_hits++;
+                cache_unlock(flags);
+                return ip;
+            }
+
+            // The read failed and the inode was unhashed, the last borrower frees it
+            if (--ip->refcount == 0) {
+                free_inode(ip);
+            }
+            continue;
+        }
+
+        // Keep the idle inodes bounded, referenced ones never count against the limit. With
+        // only dirty ones idle a write-back pass runs first, the lookup is redone after it.
+        if (inode_count >= ICACHE_MAX_INODES && lru_tail && !evict() && !synced && dirty_count > 0) {
+            synced = true;
+            cache_unlock(flags);
+            icache_sync();
+            flags = cache_lock();
+            continue;
+        }
+        break;
+    }
+
+    stat_misses++;
+    icache_inode_t *ip = kmem_cache_alloc(inode_cache);
+    if (!ip) {
+        cache_unlock(flags);
+        LOG_ERROR("Inode cache: out of memory for inode %u", ino);
+        return NULL;
+    }
+
+    ip->ino = ino;
+    ip->refcount = 1;
+    ip->dirty = false;
+    ip->valid = false;
+    ip->busy = true;
+    ip->write_seq = ++write_clock;
+    ip->extent_count = 0;
+    ip->extent_hint = 0;
+    ip->lru_prev = NULL;
+    ip->lru_next = NULL;
+    ip->hash_next = hash_table[icache_hash(ino)];
+    hash_table[icache_hash(ino)] = ip;
+    inode_count++;
+    cache_unlock(flags);
+
+    bool ok = read_inode(ino, &ip->inode);
+
+    flags = cache_lock();
+    ip->busy = false;
+    ip->valid = ok;
+    wait_wake_all(&io_wait);
+    if (!ok) {
+        // Borrowers that came meanwhile see it invalid and drop their references
+        hash_remove(ip);
+        if (--ip->refcount == 0) {
+            free_inode(ip);
+        }
+        ip = NULL;
+    }
+    cache_unlock(flags);
+    return ip;
+}
+
+// Return a borrowed inode
+void icache_put(icache_inode_t *ip) {
+    if (!ip) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (ip->refcount > 0 && --ip->refcount == 0) {
+        lru_push_head(ip);
+    }
+    cache_unlock(flags);
+}
+
+// Mark a borrowed inode as modified
+void icache_mark_dirty(icache_inode_t *ip) {
+    if (!ip) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (!ip->dirty) {
+        ip->dirty = true;
+        dirty_count++;
+    }
+    cache_unlock(flags);
+}
+
+// Mark a borrowed inode as modified after its data changed
+void icache_mark_written(icache_inode_t *ip) {
+    if (!ip) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    ip->write_seq = ++write_clock;
+    if (!ip->dirty) {
+        ip->dirty = true;
+        dirty_count++;
+    }
+    cache_unlock(flags);
+}
+
+// Record an access, relatime only refreshes atime when it is older than the last change or
+// a day old, so plain reads rarely dirty the inode at all
+void icache_touch_atime(icache_inode_t *ip, uint32_t now) {
+    if (!ip) {
+        return;
+    }
+
+    ext2_inode_t *inode = &ip->inode;
+    if (inode->i_atime > inode->i_mtime && inode->i_atime > inode->i_ctime &&
+        now - inode->i_atime < ICACHE_ATIME_INTERVAL) {
+        return;
+    }
+    if (inode->i_atime == now) {
+        return;
+    }
+
+    inode->i_atime = now;
+    icache_mark_dirty(ip);
+}
+
+// Check if an extent covers a file block
+static inline bool extent_contains(const icache_extent_t *ext, uint32_t logical) {
+    return logical >= ext->logical && logical - ext->logical < ext->length;
+}
+
+// Map a file block through the inode's extents
+bool icache_map_lookup(icache_inode_t *ip, uint32_t logical, uint32_t *physical) {
+    if (!ip || !physical) {
+        return false;
+    }
+
+    uint64_t flags = cache_lock();
+
+    // Sequential access stays in the last extent or moves to the next one
+    uint32_t hint = ip->extent_hint;
+    for (uint32_t i = hint; i < ip->extent_count && i <= hint + 1; i++) {
+        if (extent_contains(&ip->extents[i], logical)) {
+            ip->extent_hint = i;
+            *physical = ip->extents[i].physical + (logical - ip->extents[i].logical);
+            stat_map_hits++;
+            cache_unlock(flags);
+            return true;
+        }
+    }
+
+    // Otherwise binary search the sorted extents
+    uint32_t lo = 0;
+    uint32_t hi = ip->extent_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        icache_extent_t *ext = &ip->extents[mid];
+        if (logical < ext->logical) {
+            hi = mid;
+        } else if (logical - ext->logical >= ext->length) {
+            lo = mid + 1;
+        } else {
+            ip->extent_hint = mid;
+            *physical = ext->physical + (logical - ext->logical);
+            stat_map_hits++;
+            cache_unlock(flags);
+            return true;
+        }
+    }
+
+    stat_map_misses++;
+    cache_unlock(flags);
+    return false;
+}
+
+// Remember a run of mapped blocks
+void icache_map_insert(icache_inode_t *ip, uint32_t logical, uint32_t physical, uint32_t length) {
+    if (!ip || physical == 0 || length == 0) {
+        return;
+    }
+
+    uint32_t end = logical + length;
+    uint32_t delta = physical - logical;    // Equal for every block of one extent
+
+    uint64_t flags = cache_lock();
+
+    // Overlapping a different mapping means blocks were remapped, start over
+    for (uint32_t i = 0; i < ip->extent_count; i++) {
+        icache_extent_t *ext = &ip->extents[i];
+        if (ext->logical < end && logical < ext->logical + ext->length &&
+            ext->physical - ext->logical != delta) {
+            ip->extent_count = 0;
+            break;
+        }
+    }
+
+    // Absorb the extents the run overlaps or touches on disk
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < ip->extent_count; i++) {
+        icache_extent_t *ext = &ip->extents[i];
+        uint32_t ext_end = ext->logical + ext->length;
+        if (ext->logical <= end && logical <= ext_end && ext->physical - ext->logical == delta) {
+            if (ext->logical < logical) logical = ext->logical;
+            if (ext_end > end) end = ext_end;
+            continue;
+        }
+        ip->extents[kept++] = *ext;
+    }
+    ip->extent_count = kept;
+
+    // A badly fragmented file starts over rather than growing a long list
+    if (ip->extent_count == ICACHE_MAX_EXTENTS) {
+        ip->extent_count = 0;
+    }
+
+    uint32_t pos = 0;
+    while (pos < ip->extent_count && ip->extents[pos].logical < logical) {
+        pos++;
+    }
+    memmove(&ip->extents[pos + 1], &ip->extents[pos], (ip->extent_count - pos) * sizeof(icache_extent_t));
+    ip->extents[pos].logical = logical;
+    ip->extents[pos].physical = logical + delta;
+    ip->extents[pos].length = end - logical;
+    ip->extent_count++;
+    ip->extent_hint = pos;
+    cache_unlock(flags);
+}
+
+// Forget the inode's extents
+void icache_map_invalidate(icache_inode_t *ip) {
+    if (!ip) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    ip->extent_count = 0;
+    ip->extent_hint = 0;
+    cache_unlock(flags);
+}
+
+// Write one inode back if it is dirty
+bool icache_sync_inode(icache_inode_t *ip) {
+    if (!ready || !ip) {
+        return false;
+    }
+
+    // A write already under way may have started before the latest change
+    uint64_t flags = cache_lock();
+    wait_idle(ip, &flags);
+    bool ok = writeback(ip, &flags);
+    cache_unlock(flags);
+    return ok;
+}
+
+// Write back all dirty inodes
+bool icache_sync(void) {
+    if (!ready) {
+        return false;
+    }
+
+    // An inode stays hashed while it is written, so the chain can be followed on from it
+    bool ok = true;
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i < ICACHE_HASH_BUCKETS && dirty_count > 0; i++) {
+        for (icache_inode_t *ip = hash_table[i]; ip; ip = ip->hash_next) {
+            if (!writeback(ip, &flags)) {
+                ok = false;
+            }
+        }
+    }
+    cache_unlock(flags);
+    return ok;
+}
+
+// Get cache statistics
+void icache_get_stats(icache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    stats->inodes = inode_count;
+    stats->hits = stat_hits;
+    stats->misses = stat_misses;
+    stats->evictions = stat_evictions;
+    stats->writebacks = stat_writebacks;
+    stats->dirty = dirty_count;
+    stats->map_hits = stat_map_hits;
+    stats->map_misses = stat_map_misses;
+    cache_unlock(flags);
+}
+
+// Print cache statistics
+void icache_print_stats(void) {
+    LOG_INFO("Inode Cache Statistics:");
+    LOG_INFO("  Inodes: %d, Dirty: %d", inode_count, dirty_count);
+    LOG_INFO("  Hits: %d, Misses: %d", stat_hits, stat_misses);
+    LOG_INFO("  Evictions: %d, Write-backs: %d", stat_evictions, stat_writebacks);
+    LOG_INFO("  Block map hits: %d, Tree walks: %d", stat_map_hits, stat_map_misses);
+}
@@ -0,0 +1,101 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fs/ext2.h>
+
+// Inode cache sizing
+#define ICACHE_MAX_INODES       512     // Idle inodes are evicted once this many are cached
+#define ICACHE_HASH_BUCKETS     256     // Power of two
+
+// Block runs remembered per in-core inode
+#define ICACHE_MAX_EXTENTS      16
+
+// Seconds after which relatime refreshes an atime that is already newer than mtime and ctime
+#define ICACHE_ATIME_INTERVAL   (24 * 60 * 60)
+
+// Run of consecutive file blocks stored in consecutive disk blocks
+typedef struct {
+    uint32_t logical;                   // First file block
+    uint32_t physical;                  // Its disk block
+    uint32_t length;                    // Blocks in the run
+} icache_extent_t;
+
+// In-core inode shared by every user of the inode
+typedef struct icache_inode {
+    uint32_t ino;
+    ext2_inode_t inode;
+    uint32_t refcount;                  // Active borrowers, inode is pinned while > 0
+    bool dirty;                         // Must be written to the inode table before eviction
+    bool valid;                         // Read in from the inode table
+    volatile bool busy;                 // Being read or written, icache_lock is dropped meanwhile
+    uint64_t write_seq;                 // Content version, never repeats across evictions
+    icache_extent_t extents[ICACHE_MAX_EXTENTS];   // Known mappings, sorted by logical block
+    uint32_t extent_count;
+    uint32_t extent_hint;               // Last extent hit, sequential lookups try it first
+    struct icache_inode *hash_next;     // Next inode in the same hash bucket
+    struct icache_inode *lru_prev;      // LRU list of unreferenced inodes
+    struct icache_inode *lru_next;
+} icache_inode_t;
+
+// Copy an inode from or to its inode table slot
+typedef bool (*icache_io_fn)(uint32_t ino, ext2_inode_t *inode);
+
+// Inode cache statistics
+typedef struct {
+    size_t inodes;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t writebacks;
+    size_t dirty;
+    size_t map_hits;                    // Block lookups answered from an extent
+    size_t map_misses;                  // Block lookups that walked the indirect tree
+} icache_stats_t;
+
+// Set up an empty cache on top of the inode table callbacks
+bool icache_init(icache_io_fn read_fn, icache_io_fn write_fn);
+
+// Write back dirty inodes and free the cache
+void icache_shutdown(void);
+
+// Borrow an in-core inode, reading it from the inode table on a miss
+icache_inode_t *icache_get(uint32_t ino);
+
+// Return a borrowed inode, it stays cached (dirty or not) until evicted
+void icache_put(icache_inode_t *ip);
+
+// Mark a borrowed inode as modified
+void icache_mark_dirty(icache_inode_t *ip);
+
+// Mark a borrowed inode as modified after its data changed, which moves write_seq on
+void icache_mark_written(icache_inode_t *ip);
+
+// Record an access at time now, only dirtying the inode when relatime asks for it
+void icache_touch_atime(icache_inode_t *ip, uint32_t now);
+
+// Map a file block through the inode's extents, returns false if the run is not known
+bool icache_map_lookup(icache_inode_t *ip, uint32_t logical, uint32_t *physical);
+
+// Remember that length file blocks from logical live at consecutive disk blocks from
+// physical, adjacent runs are merged
+void icache_map_insert(icache_inode_t *ip, uint32_t logical, uint32_t physical, uint32_t length);
+
+// Forget the inode's extents (used when blocks are freed or remapped)
+void icache_map_invalidate(icache_inode_t *ip);
+
+// Write one inode back if it is dirty
+bool icache_sync_inode(icache_inode_t *ip);
+
+// Write back all dirty inodes
+bool icache_sync(void);
+
+// Get cache statistics
+void icache_get_stats(icache_stats_t *stats);
+
+// Print cache statistics
+void icache_print_stats(void);
+
+#endif // ICACHE_H
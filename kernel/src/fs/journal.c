@@ -0,0 +1,636 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/journal.h>
+#include <drivers/block/block.h>
+#include <drivers/timer/timer.h>
+#include <memory/slab.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Journal state, callers serialise filesystem operations like the rest of ext2
+static bool loaded = false;
+static bool active = false;
+static uint8_t journal_drive = 0;
+static uint32_t journal_block_size = 0;
+static uint32_t sectors_per_block = 0;
+static journal_bmap_fn bmap = NULL;
+static journal_prepare_fn prepare = NULL;
+
+// Log layout
+static uint32_t log_first = 0;          // First log block
+static uint32_t log_end = 0;            // One past the last log block
+static uint32_t head = 0;               // Next log block to write
+static bool log_empty = true;           // s_start is 0 on disk
+static uint32_t sequence = 0;           // ID of the running transaction
+static uint32_t tags_per_desc = 0;
+static uint8_t uuid[16];
+
+// Running transaction
+static bcache_buf_t **trans = NULL;
+static size_t trans_count = 0;
+static size_t trans_limit = 0;
+static size_t commit_blocks = 0;
+static uint64_t trans_started = 0;
+static int handles = 0;
+static bool overflow_warned = false;
+
+// Commit buffers
+static journal_superblock_t *jsb = NULL;
+static uint8_t *scratch = NULL;
+static uint8_t *desc_blocks = NULL;
+static void **escapes = NULL;
+static block_request_t *requests = NULL;
+
+// Statistics
+static size_t stat_transactions = 0;
+static size_t stat_blocks_logged = 0;
+static size_t stat_checkpoints = 0;
+static size_t stat_replayed = 0;
+
+// Journal fields are big-endian
+static inline uint32_t be32(uint32_t value) {
+    return __builtin_bswap32(value);
+}
+
+// Log blocks land back at the start once the end is reached
+static inline uint32_t next_log_block(uint32_t pos) {
+    return pos + 1 >= log_end ? log_first : pos + 1;
+}
+
+// Descriptor blocks a transaction of count blocks needs
+static inline size_t desc_blocks_for(size_t count) {
+    return (count + tags_per_desc - 1) / tags_per_desc;
+}
+
+// Read or write one journal block
+static bool journal_io(uint32_t pos, void *buffer, bool write) {
+    uint32_t block_no;
+    if (!bmap(pos, &block_no) || block_no == 0) {
+        LOG_ERROR("Journal: block %u is not mapped", pos);
+        return false;
+    }
+
+    uint64_t sector = (uint64_t)block_no * sectors_per_block;
+    if (write) {
+        return block_write(journal_drive, sector, sectors_per_block, buffer);
+    }
+    return block_read(journal_drive, sector, sectors_per_block, buffer);
+}
+
+// Queue a journal block for a batched write
+static bool add_request(size_t index, uint32_t pos, void *buffer) {
+    uint32_t block_no;
+    if (!bmap(pos, &block_no) || block_no == 0) {
+        LOG_ERROR("Journal: block %u is not mapped", pos);
+        return false;
+    }
+
+    requests[index].sector = (uint64_t)block_no * sectors_per_block;
+    requests[index].count = sectors_per_block;
+    requests[index].buffer = buffer;
+    return true;
+}
+
+// Write the journal superblock with the current log start
+static bool write_superblock(uint32_t start) {
+    jsb->s_start = be32(start);
+    jsb->s_sequence = be32(sequence);
+    return journal_io(0, jsb, true);
+}
+
+// Free everything allocated by journal_load
+static void release_memory(void) {
+    kfree(jsb);
+    kfree(scratch);
+    kfree(desc_blocks);
+    kfree(escapes);
+    kfree(requests);
+    kfree(trans);
+    jsb = NULL;
+    scratch = NULL;
+    desc_blocks = NULL;
+    escapes = NULL;
+    requests = NULL;
+    trans = NULL;
+}
+
+// Open the journal of a mounted filesystem
+bool journal_load(uint8_t drive, uint32_t block_size, journal_bmap_fn bmap_fn, journal_prepare_fn prepare_fn) {
+    if (loaded) {
+        journal_shutdown();
+    }
+
+    if (!bmap_fn || !prepare_fn) {
+        return false;
+    }
+
+    journal_drive = drive;
+    journal_block_size = block_size;
+    sectors_per_block = block_size / BLOCK_SECTOR_SIZE;
+    bmap = bmap_fn;
+    prepare = prepare_fn;
+
+    jsb = kmalloc(block_size);
+    scratch = kmalloc(block_size);
+    if (!jsb || !scratch) {
+        LOG_ERROR_MSG("Journal: failed to allocate buffers");
+        release_memory();
+        return false;
+    }
+
+    if (!journal_io(0, jsb, false)) {
+        LOG_ERROR_MSG("Journal: failed to read superblock");
+        release_memory();
+        return false;
+    }
+
+    uint32_t type = be32(jsb->s_header.h_blocktype);
+    if (be32(jsb->s_header.h_magic) != JOURNAL_MAGIC ||
+        (type != JOURNAL_SUPERBLOCK_V1 && type != JOURNAL_SUPERBLOCK_V2)) {
+        LOG_ERROR_MSG("Journal: invalid superblock");
+        release_memory();
+        return false;
+    }
+
+    if (be32(jsb->s_blocksize) != block_size) {
+        LOG_ERROR("Journal: block size %u does not match the filesystem", be32(jsb->s_blocksize));
+        release_memory();
+        return false;
+    }
+
+    memset(uuid, 0, sizeof(uuid));
+    if (type == JOURNAL_SUPERBLOCK_V2) {
+        uint32_t incompat = be32(jsb->s_feature_incompat);
+        if (incompat & ~JOURNAL_INCOMPAT_REVOKE) {
+            LOG_ERROR("Journal: unsupported features 0x%x", incompat);
+            release_memory();
+            return false;
+        }
+        memcpy(uuid, jsb->s_uuid, sizeof(uuid));
+    }
+
+    log_first = be32(jsb->s_first);
+    log_end = be32(jsb->s_maxlen);
+    if (log_first == 0 || log_end <= log_first || log_end - log_first < JOURNAL_MIN_BLOCKS) {
+        LOG_ERROR("Journal: log of %u blocks is too small", log_end > log_first ? log_end - log_first : 0);
+        release_memory();
+        return false;
+    }
+
+    // Keep a quarter of the log free for the next transaction, a commit never has to wait
+    // for a checkpoint
+    uint32_t log_len = log_end - log_first;
+    tags_per_desc = (block_size - sizeof(journal_header_t) - sizeof(uuid)) / sizeof(journal_block_tag_t);
+    trans_limit = log_len / 4;
+    if (trans_limit > JOURNAL_MAX_TRANS_BLOCKS) trans_limit = JOURNAL_MAX_TRANS_BLOCKS;
+    commit_blocks = trans_limit / 2 < JOURNAL_COMMIT_BLOCKS ? trans_limit / 2 : JOURNAL_COMMIT_BLOCKS;
+    size_t max_desc = desc_blocks_for(trans_limit);
+
+    trans = kmalloc(trans_limit * sizeof(bcache_buf_t*));
+    escapes = kzalloc(trans_limit * sizeof(void*));
+    requests = kmalloc((trans_limit + max_desc) * sizeof(block_request_t));
+    desc_blocks = kmalloc(max_desc * block_size);
+    if (!trans || !escapes || !requests || !desc_blocks) {
+        LOG_ERROR_MSG("Journal: failed to allocate transaction state");
+        release_memory();
+        return false;
+    }
+
+    sequence = be32(jsb->s_sequence);
+    log_empty = jsb->s_start == 0;
+    head = log_first;
+    trans_count = 0;
+    handles = 0;
+    overflow_warned = false;
+
+    loaded = true;
+    active = log_empty;
+    LOG_INFO("Journal: %u log blocks, up to %u blocks per transaction%s",
+             log_len, (uint32_t)trans_limit, log_empty ? "" : ", needs recovery");
+    return true;
+}
+
+// Check if the log holds transactions that may not have reached their home blocks
+bool journal_needs_recovery(void) {
+    return loaded && !log_empty;
+}
+
+// Revoke record found during recovery
+typedef struct {
+    uint32_t block_no;
+    uint32_t sequence;                  // Newest transaction that revoked the block
+} revoke_record_t;
+
+static revoke_record_t *revokes = NULL;
+static size_t revoke_count = 0;
+
+// Remember a revoked block
+static void add_revoke(uint32_t block_no, uint32_t seq) {
+    for (size_t i = 0; i < revoke_count; i++) {
+        if (revokes[i].block_no == block_no) {
+            if ((int32_t)(seq - revokes[i].sequence) > 0) {
+                revokes[i].sequence = seq;
+            }
+            return;
+        }
+    }
+
+    if (revoke_count == JOURNAL_MAX_REVOKES) {
+        LOG_WARN("Journal: too many revoke records, block %u may be replayed", block_no);
+        return;
+    }
+    revokes[revoke_count].block_no = block_no;
+    revokes[revoke_count].sequence = seq;
+    revoke_count++;
+}
+
+// Check if a block logged in transaction seq was revoked by it or a later one
+static bool is_revoked(uint32_t block_no, uint32_t seq) {
+    for (size_t i = 0; i < revoke_count; i++) {
+        if (revokes[i].block_no == block_no) {
+            return (int32_t)(revokes[i].sequence - seq) >= 0;
+        }
+    }
+    return false;
+}
+
+// Recovery passes over the log
+#define PASS_SCAN   0   // Find the end of the last committed transaction
+#define PASS_REVOKE 1   // Collect the revoke records of committed transactions
+#define PASS_REPLAY 2   // Write committed blocks home
+
+// Walk the log from s_start, later passes stop at the end found by the scan
+static bool walk_log(int pass, uint32_t *end_seq) {
+    uint32_t pos = be32(jsb->s_start);
+    uint32_t seq = be32(jsb->s_sequence);
+    uint32_t log_len = log_end - log_first;
+    uint8_t *desc = desc_blocks;
+
+    for (uint32_t steps = 0; steps < log_len; ) {
+        if (pass != PASS_SCAN && (int32_t)(*end_seq - seq) <= 0) {
+            break;
+        }
+
+        if (!journal_io(pos, desc, false)) {
+            return false;
+        }
+
+        journal_header_t *header = (journal_header_t*)desc;
+        if (be32(header->h_magic) != JOURNAL_MAGIC || be32(header->h_sequence) != seq) {
+            break;
+        }
+
+        uint32_t type = be32(header->h_blocktype);
+        pos = next_log_block(pos);
+        steps++;
+
+        if (type == JOURNAL_DESCRIPTOR_BLOCK) {
+            uint8_t *p = desc + sizeof(journal_header_t);
+            uint8_t *end = desc + journal_block_size;
+
+            while (p + sizeof(journal_block_tag_t) <= end) {
+                journal_block_tag_t *tag = (journal_block_tag_t*)p;
+                uint32_t block_no = be32(tag->t_blocknr);
+                uint32_t flags = be32(tag->t_flags);
+                p += sizeof(journal_block_tag_t);
+                if (!(flags & JOURNAL_FLAG_SAME_UUID)) {
+                    p += sizeof(uuid);
+                }
+
+                if (pass == PASS_REPLAY && !is_revoked(block_no, seq)) {
+                    if (!journal_io(pos, scratch, false)) {
+                        return false;
+                    }
+                    if (flags & JOURNAL_FLAG_ESCAPE) {
+                        *(uint32_t*)scratch = be32(JOURNAL_MAGIC);
+                    }
+                    if (!block_write(journal_drive, (uint64_t)block_no * sectors_per_block,
+                                     sectors_per_block, scratch)) {
+                        LOG_ERROR("Journal: failed to replay block %u", block_no);
+                        return false;
+                    }
+                    stat_replayed++;
+                }
+
+                pos = next_log_block(pos);
+                steps++;
+                if (flags & JOURNAL_FLAG_LAST_TAG) {
+                    break;
+                }
+            }
+        } else if (type == JOURNAL_COMMIT_BLOCK) {
+            seq++;
+            if (pass == PASS_SCAN) {
+                *end_seq = seq;
+            }
+        } else if (type == JOURNAL_REVOKE_BLOCK) {
+            if (pass == PASS_REVOKE) {
+                journal_revoke_header_t *revoke = (journal_revoke_header_t*)desc;
+                uint32_t count = be32(revoke->r_count);
+                if (count > journal_block_size) count = journal_block_size;
+                for (uint32_t off = sizeof(journal_revoke_header_t); off + 4 <= count; off += 4) {
+                    add_revoke(be32(*(uint32_t*)(desc + off)), seq);
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    return true;
+}
+
+// Replay every committed transaction to its home blocks and empty the log
+bool journal_recover(void) {
+    if (!loaded) {
+        return false;
+    }
+    if (log_empty) {
+        return true;
+    }
+
+    revokes = kmalloc(JOURNAL_MAX_REVOKES * sizeof(revoke_record_t));
+    if (!revokes) {
+        LOG_ERROR_MSG("Journal: failed to allocate revoke table");
+        return false;
+    }
+    revoke_count = 0;
+
+    uint32_t first_seq = be32(jsb->s_sequence);
+    uint32_t end_seq = first_seq;
+    bool ok = walk_log(PASS_SCAN, &end_seq) && walk_log(PASS_REVOKE, &end_seq) &&
+              walk_log(PASS_REPLAY, &end_seq);
+
+    kfree(revokes);
+    revokes = NULL;
+
+    if (!ok || !block_flush(journal_drive)) {
+        LOG_ERROR_MSG("Journal: recovery failed");
+        return false;
+    }
+
+    LOG_INFO("Journal: replayed %u transactions (%u blocks)",
+             end_seq - first_seq, (uint32_t)stat_replayed);
+
+    // Everything is home now, start the next transaction on an empty log
+    sequence = end_seq;
+    head = log_first;
+    if (!write_superblock(0) || !block_flush(journal_drive)) {
+        return false;
+    }
+    log_empty = true;
+    active = true;
+    return true;
+}
+
+// Commit, checkpoint and close the journal
+void journal_shutdown(void) {
+    if (!loaded) {
+        return;
+    }
+
+    if (active) {
+        handles = 0;
+        journal_commit();
+        journal_checkpoint();
+    }
+
+    for (size_t i = 0; i < trans_count; i++) {
+        bcache_unpin(trans[i]);
+    }
+    trans_count = 0;
+
+    release_memory();
+    loaded = false;
+    active = false;
+}
+
+// Check if metadata changes are being journaled
+bool journal_active(void) {
+    return active;
+}
+
+// Begin a filesystem operation
+void journal_start(void) {
+    if (active) {
+        handles++;
+    }
+}
+
+// End a filesystem operation
+void journal_stop(void) {
+    if (!active || handles == 0) {
+        return;
+    }
+
+    if (--handles > 0 || trans_count == 0) {
+        return;
+    }
+
+    // Operations are grouped, the log sees one write per batch of them
+    if (trans_count >= commit_blocks ||
+        timer_get_uptime_ms() - trans_started >= JOURNAL_COMMIT_INTERVAL_MS) {
+        journal_commit();
+    }
+}
+
+// Add a modified metadata buffer to the running transaction
+void journal_dirty(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+
+    if (!active) {
+        bcache_mark_dirty(buf);
+        return;
+    }
+
+    if (buf->pinned) {
+        return;  // Already in this transaction, its contents are copied to the log at commit
+    }
+
+    if (trans_count == trans_limit) {
+        // An operation outgrew the log, keep it working without atomicity
+        if (!overflow_warned) {
+            LOG_WARN("Journal: transaction full, writing block %u unjournaled", buf->block_no);
+            overflow_warned = true;
+        }
+        bcache_mark_dirty(buf);
+        return;
+    }
+
+    if (trans_count == 0) {
+        trans_started = timer_get_uptime_ms();
+    }
+    bcache_pin(buf);
+    trans[trans_count++] = buf;
+}
+
+// Write the running transaction to the log as one sequential batch
+bool journal_commit(void) {
+    if (!active) {
+        return true;
+    }
+    if (handles > 0) {
+        return false;  // Operations in flight would be split across transactions
+    }
+
+    // Inodes, counters and ordered file data go out before the metadata that refers to them
+    prepare();
+    if (trans_count == 0) {
+        return true;
+    }
+
+    size_t ndesc = desc_blocks_for(trans_count);
+    if (head + ndesc + trans_count + 1 > log_end) {
+        LOG_ERROR_MSG("Journal: no log space for the transaction");
+        return false;
+    }
+
+    // Descriptor blocks, each followed by the blocks it describes
+    uint32_t start = head;
+    uint32_t pos = head;
+    size_t nreq = 0;
+    size_t next = 0;
+    size_t escaped = 0;
+    bool ok = true;
+
+    for (size_t d = 0; d < ndesc && ok; d++) {
+        uint8_t *desc = desc_blocks + d * journal_block_size;
+        memset(desc, 0, journal_block_size);
+        journal_header_t *header = (journal_header_t*)desc;
+        header->h_magic = be32(JOURNAL_MAGIC);
+        header->h_blocktype = be32(JOURNAL_DESCRIPTOR_BLOCK);
+        header->h_sequence = be32(sequence);
+        ok = add_request(nreq++, pos++, desc);
+
+        uint8_t *p = desc + sizeof(journal_header_t);
+        for (size_t k = 0; k < tags_per_desc && next < trans_count && ok; k++, next++) {
+            bcache_buf_t *buf = trans[next];
+            void *data = buf->data;
+            uint32_t flags = k == 0 ? 0 : JOURNAL_FLAG_SAME_UUID;
+            if (k + 1 == tags_per_desc || next + 1 == trans_count) {
+                flags |= JOURNAL_FLAG_LAST_TAG;
+            }
+
+            // A block that looks like a journal block is logged with its magic zeroed
+            if (be32(*(uint32_t*)data) == JOURNAL_MAGIC) {
+                void *copy = kmalloc(journal_block_size);
+                if (!copy) {
+                    ok = false;
+                    break;
+                }
+                memcpy(copy, data, journal_block_size);
+                *(uint32_t*)copy = 0;
+                escapes[escaped++] = copy;
+                data = copy;
+                flags |= JOURNAL_FLAG_ESCAPE;
+            }
+
+            journal_block_tag_t *tag = (journal_block_tag_t*)p;
+            tag->t_blocknr = be32(buf->block_no);
+            tag->t_flags = be32(flags);
+            p += sizeof(journal_block_tag_t);
+            if (k == 0) {
+                memcpy(p, uuid, sizeof(uuid));
+                p += sizeof(uuid);
+            }
+
+            ok = add_request(nreq++, pos++, data);
+        }
+    }
+
+    // Log blocks first, then the commit block once they are stable
+    ok = ok && block_submit(journal_drive, requests, nreq, true);
+    if (ok && log_empty) {
+        ok = write_superblock(start);
+    }
+    ok = ok && block_flush(journal_drive);
+
+    if (ok) {
+        memset(scratch, 0, journal_block_size);
+        journal_header_t *commit = (journal_header_t*)scratch;
+        commit->h_magic = be32(JOURNAL_MAGIC);
+        commit->h_blocktype = be32(JOURNAL_COMMIT_BLOCK);
+        commit->h_sequence = be32(sequence);
+        ok = journal_io(pos++, scratch, true) && block_flush(journal_drive);
+    }
+
+    for (size_t i = 0; i < escaped; i++) {
+        kfree(escapes[i]);
+        escapes[i] = NULL;
+    }
+
+    if (!ok) {
+        LOG_ERROR("Journal: failed to commit transaction %u", sequence);
+        return false;
+    }
+
+    // Committed blocks may now reach their home locations at any time
+    for (size_t i = 0; i < trans_count; i++) {
+        bcache_unpin(trans[i]);
+    }
+    stat_transactions++;
+    stat_blocks_logged += trans_count;
+    trans_count = 0;
+    log_empty = false;
+    head = pos;
+    sequence++;
+
+    // Make room for the largest next transaction
+    if (head + desc_blocks_for(trans_limit) + trans_limit + 1 > log_end) {
+        return journal_checkpoint();
+    }
+    return true;
+}
+
+// Write committed blocks to their home locations and empty the log
+bool journal_checkpoint(void) {
+    if (!active || log_empty) {
+        return true;
+    }
+    if (trans_count > 0) {
+        return false;  // Pinned blocks cannot go home, so the log must keep their older copies
+    }
+
+    if (!bcache_sync() || !block_flush(journal_drive)) {
+        LOG_ERROR_MSG("Journal: checkpoint failed");
+        return false;
+    }
+
+    if (!write_superblock(0) || !block_flush(journal_drive)) {
+        return false;
+    }
+
+    log_empty = true;
+    head = log_first;
+    stat_checkpoints++;
+    return true;
+}
+
+// Get journal statistics
+void journal_get_stats(journal_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->active = active;
+    stats->log_blocks = loaded ? log_end - log_first : 0;
+    stats->sequence = sequence;
+    stats->transactions = stat_transactions;
+    stats->blocks_logged = stat_blocks_logged;
+    stats->checkpoints = stat_checkpoints;
+    stats->replayed = stat_replayed;
+}
+
+// Print journal statistics
+void journal_print_stats(void) {
+    LOG_INFO("Journal Statistics:");
+    if (!active) {
+        LOG_INFO("  Not active");
+        return;
+    }
+    LOG_INFO("  Log: %u blocks, next transaction %u", log_end - log_first, sequence);
+    LOG_INFO("  Transactions: %d, Blocks logged: %d", stat_transactions, stat_blocks_logged);
+    LOG_INFO("  Checkpoints: %d, Replayed: %d", stat_checkpoints, stat_replayed);
+}
@@ -0,0 +1,124 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fs/bcache.h>
+
+// On-disk format shared with ext3 (JBD) and ext4 (JBD2), all fields are big-endian
+#define JOURNAL_MAGIC               0xC03B3998U
+#define JOURNAL_DESCRIPTOR_BLOCK    1
+#define JOURNAL_COMMIT_BLOCK        2
+#define JOURNAL_SUPERBLOCK_V1       3
+#define JOURNAL_SUPERBLOCK_V2       4
+#define JOURNAL_REVOKE_BLOCK        5
+
+// Descriptor tag flags
+#define JOURNAL_FLAG_ESCAPE         1       // Block began with the magic, which was zeroed in the log
+#define JOURNAL_FLAG_SAME_UUID      2       // No UUID follows the tag
+#define JOURNAL_FLAG_DELETED        4
+#define JOURNAL_FLAG_LAST_TAG       8
+
+// Incompatible features understood (revoke records, 32-bit block numbers only)
+#define JOURNAL_INCOMPAT_REVOKE     0x1
+
+// Transaction limits
+#define JOURNAL_MAX_TRANS_BLOCKS    1024    // Metadata blocks one transaction can hold
+#define JOURNAL_COMMIT_BLOCKS       256     // A transaction this large commits when its last operation ends
+#define JOURNAL_COMMIT_INTERVAL_MS  5000    // So does one that is this old
+#define JOURNAL_MIN_BLOCKS          64      // Smaller logs are not used
+#define JOURNAL_MAX_REVOKES         1024    // Revoke records tracked during recovery
+
+// Header at the start of every journal metadata block
+typedef struct {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;                // Transaction ID
+} __attribute__((packed)) journal_header_t;
+
+// Journal superblock, block 0 of the journal
+typedef struct {
+    journal_header_t s_header;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;                  // Blocks in the journal
+    uint32_t s_first;                   // First log block
+    uint32_t s_sequence;                // Transaction ID expected at s_start
+    uint32_t s_start;                   // Log block of the oldest transaction, 0 when clean
+    int32_t  s_errno;
+    uint32_t s_feature_compat;          // Version 2 only from here
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    uint32_t s_nr_users;
+    uint32_t s_dynsuper;
+    uint32_t s_max_transaction;
+    uint32_t s_max_trans_data;
+} __attribute__((packed)) journal_superblock_t;
+
+// Descriptor tag, one per logged block
+typedef struct {
+    uint32_t t_blocknr;                 // Home location of the block
+    uint32_t t_flags;
+} __attribute__((packed)) journal_block_tag_t;
+
+// Revoke block header, followed by 32-bit block numbers
+typedef struct {
+    journal_header_t r_header;
+    uint32_t r_count;                   // Bytes used, including this header
+} __attribute__((packed)) journal_revoke_header_t;
+
+// Map a journal block to its disk block
+typedef bool (*journal_bmap_fn)(uint32_t logical, uint32_t *physical);
+
+// Push in-core metadata into journaled buffers before a commit
+typedef void (*journal_prepare_fn)(void);
+
+// Journal statistics
+typedef struct {
+    bool active;
+    uint32_t log_blocks;
+    uint32_t sequence;
+    size_t transactions;
+    size_t blocks_logged;
+    size_t checkpoints;
+    size_t replayed;
+} journal_stats_t;
+
+// Open the journal of a mounted filesystem, returns false if there is none usable
+bool journal_load(uint8_t drive, uint32_t block_size, journal_bmap_fn bmap, journal_prepare_fn prepare);
+
+// Check if the log holds transactions that may not have reached their home blocks
+bool journal_needs_recovery(void);
+
+// Replay every committed transaction to its home blocks and empty the log
+bool journal_recover(void);
+
+// Commit, checkpoint and close the journal
+void journal_shutdown(void);
+
+// Check if metadata changes are being journaled
+bool journal_active(void);
+
+// Begin a filesystem operation, no commit happens until every operation has ended
+void journal_start(void);
+
+// End a filesystem operation, committing the transaction once it is large or old enough
+void journal_stop(void);
+
+// Add a modified metadata buffer to the running transaction (plain dirty without a journal)
+void journal_dirty(bcache_buf_t *buf);
+
+// Write the running transaction to the log as one sequential batch
+bool journal_commit(void);
+
+// Write committed blocks to their home locations and empty the log
+bool journal_checkpoint(void);
+
+// Get journal statistics
+void journal_get_stats(journal_stats_t *stats);
+
+// Print journal statistics
+void journal_print_stats(void);
+
+#endif // JOURNAL_H
@@ -0,0 +1,663 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/pagecache.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <memory/slab.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/wait.h>
+#include <core/cpu.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Cache state
+static kmem_cache_t *page_desc_cache = NULL;
+static pcache_page_t **hash_table = NULL;
+static size_t hash_mask = 0;
+static pcache_page_t *lru_head = NULL;  // Most recently released
+static pcache_page_t *lru_tail = NULL;  // Eviction candidate
+static pcache_fill_fn fill_page = NULL;
+static pcache_flush_fn flush_page = NULL;
+static spinlock_t pcache_lock;
+static wait_queue_t io_wait;           // Borrowers waiting for a busy page
+static bool ready = false;
+
+// Statistics
+static size_t page_count = 0;
+static size_t memory_pages = 0;        // Pages of memory inodes, not held to max_pages
+static size_t max_pages = 0;
+static size_t dirty_count = 0;
+static size_t stat_hits = 0;
+static size_t stat_misses = 0;
+static size_t stat_evictions = 0;
+static size_t stat_writebacks = 0;
+static size_t stat_readahead = 0;
+
+// pcache_lock is held with interrupts off, a holder preempted on its CPU would leave a fault
+// or system call taking the lock there spinning with interrupts off
+static uint64_t cache_lock(void) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&pcache_lock);
+    return flags;
+}
+
+static void cache_unlock(uint64_t flags) {
+    spinlock_release(&pcache_lock);
+    cpu_irq_restore(flags);
+}
+
+// Wait condition of a busy page
+static bool page_idle(void *arg) {
+    pcache_page_t *page = arg;
+    return !page->busy;
+}
+
+// Hash an (inode, page index) pair into a bucket index
+static inline size_t pcache_hash(uint32_t ino, uint32_t index) {
+    return ((index * 2654435761U) ^ (ino * 40503U)) & hash_mask;
+}
+
+// Unlink a page from the LRU list
+static void lru_remove(pcache_page_t *page) {
+    if (page->lru_prev) {
+        page->lru_prev->lru_next = page->lru_next;
+    } else if (lru_head == page) {
+        lru_head = page->lru_next;
+    }
+    if (page->lru_next) {
+        page->lru_next->lru_prev = page->lru_prev;
+    } else if (lru_tail == page) {
+        lru_tail = page->lru_prev;
+    }
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+}
+
+// Put a page at the most recently used end of the LRU list
+static void lru_push_head(pcache_page_t *page) {
+    page->lru_prev = NULL;
+    page->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = page;
+    }
+    lru_head = page;
+    if (!lru_tail) {
+        lru_tail = page;
+    }
+}
+
+// Remove a page from its hash chain
+static void hash_remove(pcache_page_t *page) {
+    pcache_page_t **link = &hash_table[pcache_hash(page->ino, page->index)];
+    while (*link) {
+        if (*link == page) {
+            *link = page->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    page->hash_next = NULL;
+    if (PCACHE_IS_MEMORY(page->ino)) {
+        memory_pages--;
+    }
+}
+
+// Find a cached page, pcache_lock must be held
+static pcache_page_t *hash_lookup(uint32_t ino, uint32_t index) {
+    pcache_page_t *page = hash_table[pcache_hash(ino, index)];
+    while (page) {
+        if (page->index == index && page->ino == ino) {
+            return page;
+        }
+        page = page->hash_next;
+    }
+    return NULL;
+}
+
+// Flush a dirty page to its file, pcache_lock is held and dropped across the write. Writes
+// to the page meanwhile dirty it again.
+static bool writeback(pcache_page_t *page, uint64_t *flags) {
+    if (!page->dirty) {
+        return true;
+    }
+
+    pcache_flush_fn flush = flush_page;
+    if (!flush) {
+        LOG_ERROR("Page cache: no backing store to flush inode %u page %u", page->ino, page->index);
+        return false;
+    }
+
+    page->dirty = false;
+    dirty_count--;
+    page->busy = true;
+    cache_unlock(*flags);
+
+    bool ok = flush(page->ino, page->index, page->data);
+
+    *flags = cache_lock();
+    page->busy = false;
+    if (ok) {
+        stat_writebacks++;
+    } else {
+        LOG_ERROR("Page cache: failed to flush inode %u page %u", page->ino, page->index);
+        if (!page->dirty) {
+            page->dirty = true;
+            dirty_count++;
+        }
+    }
+    wait_wake_all(&io_wait);
+    return ok;
+}
+
+// Drop a page from the cache and free its memory, pcache_lock must be held
+static void free_page(pcache_page_t *page) {
+    if (page->dirty) {
+        dirty_count--;
+    }
+    hash_remove(page);
+    pmm_free_page((void*)page->phys);
+    kmem_cache_free(page_desc_cache, page);
+    page_count--;
+}
+
+// Take the least recently used unreferenced clean page, pcache_lock must be held. Dirty pages
+// wait for a write-back pass, releases start one once enough of them pile up.
+static pcache_page_t *evict(void) {
+    for (pcache_page_t *page = lru_tail; page; page = page->lru_prev) {
+        if (!page->dirty && !page->busy) {
+            lru_remove(page);
+            hash_remove(page);
+            stat_evictions++;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+// Get a page descriptor with backing memory, pcache_lock must be held
+static pcache_page_t *new_page(void) {
+    if (page_count - memory_pages >= max_pages) {
+        pcache_page_t *page = evict();
+        if (page) {
+            return page;
+        }
+    }
+
+    pcache_page_t *page = kmem_cache_alloc(page_desc_cache);
+    if (!page) {
+        return evict();
+    }
+
+    void *phys = pmm_alloc_page();
+    if (!phys) {
+        kmem_cache_free(page_desc_cache, page);
+        return evict();
+    }
+
+    page->phys = (uint64_t)phys;
+    page->data = vmm_phys_to_virt(page->phys);
+    page_count++;
+    return page;
+}
+
+// Look up or claim a page, pcache_lock must be held
+static pcache_page_t *get_page(uint32_t ino, uint32_t index, bool *cached) {
+    pcache_page_t *page = hash_lookup(ino, index);
+    if (page) {
+        stat_hits++;
+        if (page->refcount++ == 0) {
+            lru_remove(page);
+        }
+        *cached = true;
+        return page;
+    }
+
+    stat_misses++;
+    *cached = false;
+    page = new_page();
+    if (!page) {
+        LOG_ERROR_MSG("Page cache: out of pages");
+        return NULL;
+    }
+
+    page->ino = ino;
+    page->index = index;
+    page->refcount = 1;
+    page->valid = false;
+    page->dirty = false;
+    page->busy = false;
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+
+    size_t bucket = pcache_hash(ino, index);
+    page->hash_next = hash_table[bucket];
+    hash_table[bucket] = page;
+    if (PCACHE_IS_MEMORY(ino)) {
+        memory_pages++;
+    }
+    return page;
+}
+
+// Wait for the I/O on a borrowed page to finish, pcache_lock is held and dropped meanwhile
+static void wait_idle(pcache_page_t *page, uint64_t *flags) {
+    while (page->busy) {
+        cache_unlock(*flags);
+        wait_event(&io_wait, page_idle, page);
+        *flags = cache_lock();
+    }
+}
+
+// Drop the reference to a page that could not be read, pcache_lock must be held. It goes
+// with the last one, other borrowers try to read it themselves.
+static void put_invalid(pcache_page_t *page) {
+    if (--page->refcount == 0) {
+        free_page(page);
+    }
+}
+
+// Read a borrowed page in, pcache_lock is held and dropped across the read
+static bool fill(pcache_page_t *page, uint64_t *flags) {
+    pcache_fill_fn fill_fn = fill_page;
+    if (!fill_fn) {
+        put_invalid(page);      // No backing store attached
+        return false;
+    }
+
+    page->busy = true;
+    cache_unlock(*flags);
+
+    pcache_fill_t request = { page->ino, page->index, &page->data, 1 };
+    bool ok = fill_fn(&request, 1);
+
+    *flags = cache_lock();
+    page->busy = false;
+    page->valid = ok;
+    wait_wake_all(&io_wait);
+
+    if (!ok) {
+        LOG_ERROR("Page cache: failed to fill inode %u page %u", page->ino, page->index);
+        put_invalid(page);
+    }
+    return ok;
+}
+
+// Set up the cache, sizing it from free memory
+bool pcache_init(void) {
+    if (ready) {
+        return true;
+    }
+
+    if (!page_desc_cache) {
+        page_desc_cache = kmem_cache_create("pcache_page", sizeof(pcache_page_t), 0);
+        if (!page_desc_cache) {
+            LOG_ERROR_MSG("Page cache: failed to create descriptor cache");
+            return false;
+        }
+    }
+
+    max_pages = (pmm_get_free_memory() / PCACHE_MEMORY_DIVISOR) / PCACHE_PAGE_SIZE;
+    if (max_pages < PCACHE_MIN_PAGES) max_pages = PCACHE_MIN_PAGES;
+
+    size_t buckets = 1;
+    while (buckets < max_pages) {
+        buckets <<= 1;
+    }
+
+    hash_table = kzalloc(buckets * sizeof(pcache_page_t*));
+    if (!hash_table) {
+        LOG_ERROR_MSG("Page cache: failed to allocate hash table");
+        return false;
+    }
+
+    hash_mask = buckets - 1;
+    fill_page = NULL;
+    flush_page = NULL;
+    lru_head = NULL;
+    lru_tail = NULL;
+    page_count = 0;
+    memory_pages = 0;
+    dirty_count = 0;
+    spinlock_init(&pcache_lock);
+    wait_queue_init(&io_wait);
+
+    ready = true;
+    LOG_INFO("Page cache: up to %u pages, %u hash buckets",
+             (uint32_t)max_pages, (uint32_t)buckets);
+    return true;
+}
+
+// Switch the backing store, the pages of the previous one are flushed and dropped while
+// memory inode pages stay
+bool pcache_set_backing(pcache_fill_fn fill_fn, pcache_flush_fn flush_fn) {
+    if (!ready || !fill_fn != !flush_fn) {
+        return false;
+    }
+
+    pcache_sync();
+
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i <= hash_mask; i++) {
+        pcache_page_t *page = hash_table[i];
+        while (page) {
+            pcache_page_t *next = page->hash_next;
+            if (!PCACHE_IS_MEMORY(page->ino)) {
+                if (page->refcount > 0 || page->busy) {
+                    LOG_WARN("Page cache: inode %u page %u still referenced at detach",
+                             page->ino, page->index);
+                } else {
+                    lru_remove(page);
+                    free_page(page);
+                }
+            }
+            page = next;
+        }
+    }
+    fill_page = fill_fn;
+    flush_page = flush_fn;
+    cache_unlock(flags);
+    return true;
+}
+
+// Flush all dirty pages and release the cache memory
+void pcache_shutdown(void) {
+    if (!ready) {
+        return;
+    }
+
+    pcache_sync();
+
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i <= hash_mask; i++) {
+        while (hash_table[i]) {
+            pcache_page_t *page = hash_table[i];
+            if (page->refcount > 0) {
+                LOG_WARN("Page cache: inode %u page %u still referenced at shutdown",
+                         page->ino, page->index);
+            }
+            free_page(page);
+        }
+    }
+    lru_head = NULL;
+    lru_tail = NULL;
+    ready = false;
+    cache_unlock(flags);
+
+    kfree(hash_table);
+    hash_table = NULL;
+}
+
+// Borrow a file page, filling it on a miss
+pcache_page_t *pcache_read(uint32_t ino, uint32_t index) {
+    if (!ready) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+
+    bool cached;
+    pcache_page_t *page = get_page(ino, index, &cached);
+    if (page) {
+        // Another borrower's read is in flight, when it failed this one tries again
+        wait_idle(page, &flags);
+        if (!page->valid && PCACHE_IS_MEMORY(ino)) {
+            memset(page->data, 0, PCACHE_PAGE_SIZE);
+            page->valid = true;
+        } else if (!page->valid && !fill(page, &flags)) {
+            page = NULL;
+        }
+    }
+
+    cache_unlock(flags);
+    return page;
+}
+
+// Borrow a file page the caller will overwrite entirely
+pcache_page_t *pcache_get(uint32_t ino, uint32_t index) {
+    if (!ready) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+    bool cached;
+    pcache_page_t *page = get_page(ino, index, &cached);
+    if (page) {
+        // The caller supplies the contents, they must not be overwritten by a fill
+        wait_idle(page, &flags);
+        page->valid = true;
+    }
+    cache_unlock(flags);
+    return page;
+}
+
+// Fill up to count pages starting at index ahead of a reader, returns the pages filled
+size_t pcache_readahead(uint32_t ino, uint32_t index, size_t count) {
+    pcache_range_t range = { ino, index, count };
+    return pcache_readahead_batch(&range, 1);
+}
+
+// Fill the missing pages of several ranges with one fill call
+size_t pcache_readahead_batch(const pcache_range_t *ranges, size_t count) {
+    if (!ready || !ranges || count == 0) {
+        return 0;
+    }
+
+    pcache_page_t *pages[PCACHE_READAHEAD_MAX];
+    void *data[PCACHE_READAHEAD_MAX];
+    pcache_fill_t fills[PCACHE_READAHEAD_MAX];
+    size_t n = 0;
+    size_t nfills = 0;
+
+    uint64_t flags = cache_lock();
+
+    for (size_t r = 0; r < count && n < PCACHE_READAHEAD_MAX; r++) {
+        uint32_t ino = ranges[r].ino;
+        uint32_t index = ranges[r].index;
+        size_t left = ranges[r].count;
+        if (PCACHE_IS_MEMORY(ino) || !fill_page) {
+            continue;   // Nothing to read ahead from
+        }
+
+        // The run starts at the first page not cached yet and ends at the next cached one
+        while (left > 0 && hash_lookup(ino, index)) {
+            index++;
+            left--;
+        }
+
+        size_t first = n;
+        while (left > 0 && n < PCACHE_READAHEAD_MAX && !hash_lookup(ino, index + (n - first))) {
+            bool cached;
+            pcache_page_t *page = get_page(ino, index + (n - first), &cached);
+            if (!page) {
+                break;
+            }
+            stat_misses--;
+            page->busy = true;
+            pages[n] = page;
+            data[n] = page->data;
+            n++;
+            left--;
+        }
+
+        if (n > first) {
+            fills[nfills].ino = ino;
+            fills[nfills].index = index;
+            fills[nfills].pages = &data[first];
+            fills[nfills].count = n - first;
+            nfills++;
+        }
+    }
+
+    // The pages stay busy and hashed while the lock is dropped, readers wait for them
+    pcache_fill_fn fill_fn = fill_page;
+    cache_unlock(flags);
+    bool ok = nfills == 0 || fill_fn(fills, nfills);
+    flags = cache_lock();
+
+    // Prefetched pages wait on the LRU list for their reader
+    for (size_t i = 0; i < n; i++) {
+        pages[i]->busy = false;
+        pages[i]->valid = ok;
+        if (!ok) {
+            put_invalid(pages[i]);
+        } else if (--pages[i]->refcount == 0) {
+            lru_push_head(pages[i]);
+        }
+    }
+    if (n > 0) {
+        wait_wake_all(&io_wait);
+    }
+
+    if (ok) {
+        stat_readahead += n;
+    }
+    cache_unlock(flags);
+
+    return ok ? n : 0;
+}
+
+// Borrow a file page only if it is already cached
+pcache_page_t *pcache_lookup(uint32_t ino, uint32_t index) {
+    if (!ready) {
+        return NULL;
+    }
+
+    uint64_t flags = cache_lock();
+    pcache_page_t *page = hash_lookup(ino, index);
+    if (page) {
+        if (page->refcount++ == 0) {
+            lru_remove(page);
+        }
+
+        // A page whose read is still in flight is not cached yet
+        wait_idle(page, &flags);
+        if (!page->valid) {
+            put_invalid(page);
+            page = NULL;
+        }
+    }
+    cache_unlock(flags);
+    return page;
+}
+
+// Mark a borrowed page as modified
+void pcache_mark_dirty(pcache_page_t *page) {
+    if (!page) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    if (!page->dirty && !PCACHE_IS_MEMORY(page->ino)) {
+        page->dirty = true;
+        dirty_count++;
+    }
+    cache_unlock(flags);
+}
+
+// Return a borrowed page
+void pcache_release(pcache_page_t *page) {
+    if (!page) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+
+    if (page->refcount == 0) {
+        cache_unlock(flags);
+        LOG_WARN("Page cache: inode %u page %u released too many times", page->ino, page->index);
+        return;
+    }
+
+    if (--page->refcount == 0) {
+        lru_push_head(page);
+    }
+
+    bool flush = dirty_count >= max_pages / PCACHE_DIRTY_DIVISOR;
+    cache_unlock(flags);
+
+    // Too many dirty pages, flush them in one pass
+    if (flush) {
+        pcache_sync();
+    }
+}
+
+// Flush dirty pages, optionally restricted to one inode
+static bool sync_pages(bool all, uint32_t ino) {
+    if (!ready) {
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i <= hash_mask && dirty_count > 0 && ok; i++) {
+        // The chain may change while a write is out, it is walked again from its head
+        pcache_page_t *page = hash_table[i];
+        while (page && ok) {
+            if (page->dirty && !page->busy && (all || page->ino == ino)) {
+                ok = writeback(page, &flags);
+                page = hash_table[i];
+            } else {
+                page = page->hash_next;
+            }
+        }
+    }
+    cache_unlock(flags);
+    return ok;
+}
+
+// Flush the dirty pages of one inode
+bool pcache_sync_inode(uint32_t ino) {
+    return sync_pages(false, ino);
+}
+
+// Flush all dirty pages
+bool pcache_sync(void) {
+    return sync_pages(true, 0);
+}
+
+// Drop the unreferenced pages of an inode without flushing them
+void pcache_invalidate_inode(uint32_t ino) {
+    if (!ready) {
+        return;
+    }
+
+    uint64_t flags = cache_lock();
+    for (size_t i = 0; i <= hash_mask; i++) {
+        pcache_page_t *page = hash_table[i];
+        while (page) {
+            pcache_page_t *next = page->hash_next;
+            if (page->ino == ino && page->refcount == 0 && !page->busy) {
+                lru_remove(page);
+                free_page(page);
+            }
+            page = next;
+        }
+    }
+    cache_unlock(flags);
+}
+
+// Get cache statistics
+void pcache_get_stats(pcache_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->pages = page_count;
+    stats->memory_pages = memory_pages;
+    stats->max_pages = max_pages;
+    stats->hits = stat_hits;
+    stats->misses = stat_misses;
+    stats->evictions = stat_evictions;
+    stats->writebacks = stat_writebacks;
+    stats->readahead = stat_readahead;
+    stats->dirty = dirty_count;
+}
+
+// Print cache statistics
+void pcache_print_stats(void) {
+    LOG_INFO("Page Cache Statistics:");
+    LOG_INFO("  Pages: %d of %d, %d more for memory inodes", page_count - memory_pages, max_pages, memory_pages);
+    LOG_INFO("  Hits: %d, Misses: %d", stat_hits, stat_misses);
+    LOG_INFO("  Evictions: %d, Write-backs: %d, Dirty: %d",
+             stat_evictions, stat_writebacks, dirty_count);
+    LOG_INFO("  Read ahead: %d pages", stat_readahead);
+}
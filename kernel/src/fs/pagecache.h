@@ -0,0 +1,120 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Page cache sizing limits
+#define PCACHE_PAGE_SIZE        4096
+#define PCACHE_MIN_PAGES        256
+#define PCACHE_MEMORY_DIVISOR   8       // Use up to 1/8 of free memory
+
+// Fraction of pages that may be dirty before a write-back pass starts
+#define PCACHE_DIRTY_DIVISOR    4
+
+// Largest run of pages filled by one readahead call
+#define PCACHE_READAHEAD_MAX    32
+
+// Inodes from here up have no backing store (tmpfs): a missing page reads as zeroes, pages
+// are never dirty or written back, and their owner keeps them pinned to hold the data
+#define PCACHE_MEMORY_INO       0x80000000U
+#define PCACHE_IS_MEMORY(ino)   ((ino) >= PCACHE_MEMORY_INO)
+
+// Consecutive pages of one file, index is the page number within the file
+typedef struct {
+    uint32_t ino;
+    uint32_t index;
+    size_t count;
+} pcache_range_t;
+
+// Pages to fill for one range
+typedef struct {
+    uint32_t ino;
+    uint32_t index;
+    void **pages;
+    size_t count;
+} pcache_fill_t;
+
+// File page I/O callbacks (fill gets runs of pages, possibly of several files, so readahead
+// can read them with one disk batch)
+typedef bool (*pcache_fill_fn)(const pcache_fill_t *fills, size_t count);
+typedef bool (*pcache_flush_fn)(uint32_t ino, uint32_t index, const void *page);
+
+// Cached file page
+typedef struct pcache_page {
+    uint32_t ino;                      // Owning inode
+    uint32_t index;                    // Page number within the file
+    uint64_t phys;                     // Physical address, mapped directly by mmap
+    void *data;                        // Kernel (HHDM) view of the page
+    uint32_t refcount;                 // Readers, writers and mappings, page is pinned while > 0
+    bool valid;                        // Data was read in (or supplied by a borrower)
+    bool dirty;                        // Page must be flushed before eviction
+    volatile bool busy;                // Being filled or flushed, pcache_lock is dropped meanwhile
+    struct pcache_page *hash_next;     // Next page in the same hash bucket
+    struct pcache_page *lru_prev;      // LRU list of unreferenced pages
+    struct pcache_page *lru_next;
+} pcache_page_t;
+
+// Page cache statistics
+typedef struct {
+    size_t pages;
+    size_t memory_pages;               // Of pages, in memory inodes and outside max_pages
+    size_t max_pages;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t writebacks;
+    size_t readahead;                  // Pages filled ahead of readers
+    size_t dirty;
+} pcache_stats_t;
+
+// Set up the cache, sizing it from free memory. Memory inodes work at once, file pages
+// once a backing store is attached.
+bool pcache_init(void);
+
+// Switch the backing store, NULL callbacks detach it. The pages of the previous store are
+// flushed and dropped, memory inode pages stay.
+bool pcache_set_backing(pcache_fill_fn fill_fn, pcache_flush_fn flush_fn);
+
+// Flush all dirty pages and release the cache memory
+void pcache_shutdown(void);
+
+// Borrow a file page, filling it on a miss
+pcache_page_t *pcache_read(uint32_t ino, uint32_t index);
+
+// Borrow a file page the caller will overwrite entirely (no fill)
+pcache_page_t *pcache_get(uint32_t ino, uint32_t index);
+
+// Fill up to count pages starting at index ahead of a reader, returns the pages filled
+size_t pcache_readahead(uint32_t ino, uint32_t index, size_t count);
+
+// Fill the missing pages of several ranges with one fill call, up to PCACHE_READAHEAD_MAX
+// pages in all, returns the pages filled
+size_t pcache_readahead_batch(const pcache_range_t *ranges, size_t count);
+
+// Borrow a file page only if it is already cached
+pcache_page_t *pcache_lookup(uint32_t ino, uint32_t index);
+
+// Mark a borrowed page as modified
+void pcache_mark_dirty(pcache_page_t *page);
+
+// Return a borrowed page
+void pcache_release(pcache_page_t *page);
+
+// Flush the dirty pages of one inode
+bool pcache_sync_inode(uint32_t ino);
+
+// Flush all dirty pages
+bool pcache_sync(void);
+
+// Drop the unreferenced pages of an inode without flushing them
+void pcache_invalidate_inode(uint32_t ino);
+
+// Get cache statistics
+void pcache_get_stats(pcache_stats_t *stats);
+
+// Print cache statistics
+void pcache_print_stats(void);
+
+#endif // PAGECACHE_H
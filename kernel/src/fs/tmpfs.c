@@ -0,0 +1,495 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/tmpfs.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <drivers/timer/timer.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Instances, for statistics
+static tmpfs_t *instances[VFS_MAX_MOUNTS];
+static size_t instance_count = 0;
+
+// Inode numbers are shared by every instance since the page cache is keyed by them
+static uint32_t next_ino = PCACHE_MEMORY_INO;
+
+static const vfs_file_ops_t tmpfs_file_ops;
+
+static uint32_t tmpfs_now(void) {
+    return (uint32_t)(timer_get_uptime_ms() / 1000);
+}
+
+static tmpfs_node_t *node_create(tmpfs_t *fs, tmpfs_node_t *parent, const char *name, size_t len, uint32_t mode) {
+    tmpfs_node_t *node = kzalloc(sizeof(tmpfs_node_t));
+    if (!node) {
+        return NULL;
+    }
+
+    node->ino = __atomic_add_fetch(&next_ino, 1, __ATOMIC_RELAXED);
+    node->mode = mode;
+    node->nlink = VFS_S_ISDIR(mode) ? 2 : 1;
+    node->atime = node->mtime = node->ctime = tmpfs_now();
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+
+    node->parent = parent ? parent : node;
+    if (parent) {
+        node->next = parent->children;
+        parent->children = node;
+        parent->mtime = node->mtime;
+        if (VFS_S_ISDIR(mode)) parent->nlink++;
+    }
+    fs->nodes++;
+    return node;
+}
+
+// Unpin the pages from index on, the page cache may then evict them
+static void release_pages(tmpfs_t *fs, tmpfs_node_t *node, size_t from) {
+    bool dropped = false;
+    for (size_t i = from; i < node->page_slots; i++) {
+        if (node->pages[i]) {
+            pcache_release(node->pages[i]);
+            node->pages[i] = NULL;
+            fs->pages--;
+            dropped = true;
+        }
+    }
+    if (dropped) {
+        pcache_invalidate_inode(node->ino);
+    }
+}
+
+// Set the size of a regular file, only ever used to shrink it
+static void truncate_node(tmpfs_t *fs, tmpfs_node_t *node, uint64_t size) {
+    if (size >= node->size) {
+        return;
+    }
+
+    size_t keep = (size + PCACHE_PAGE_SIZE - 1) / PCACHE_PAGE_SIZE;
+    release_pages(fs, node, keep);
+
+    // The bytes past the end of the last page read back as zeroes if the file grows again
+    size_t tail = size % PCACHE_PAGE_SIZE;
+    if (tail && node->pages[keep - 1]) {
+        memset((uint8_t*)node->pages[keep - 1]->data + tail, 0, PCACHE_PAGE_SIZE - tail);
+    }
+    node->size = size;
+    node->mtime = tmpfs_now();
+}
+
+static void node_free(tmpfs_t *fs, tmpfs_node_t *node) {
+    release_pages(fs, node, 0);
+    kfree(node->pages);
+    kfree(node);
+    fs->nodes--;
+}
+
+// Take a node out of its directory, it is freed at once unless still open
+static void node_unlink(tmpfs_t *fs, tmpfs_node_t *node) {
+    tmpfs_node_t *parent = node->parent;
+    for (tmpfs_node_t **link = &parent->children; *link; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            break;
+        }
+    }
+    if (VFS_S_ISDIR(node->mode)) parent->nlink--;
+    parent->mtime = tmpfs_now();
+
+    node->nlink = 0;
+    node->unlinked = true;
+    if (node->opens == 0) {
+        node_free(fs, node);
+    }
+}
+
+static tmpfs_node_t *find_child(tmpfs_node_t *dir, const char *name, size_t len) {
+    for (tmpfs_node_t *child = dir->children; child; child = child->next) {
+        if (strncmp(child->name, name, len) == 0 && child->name[len] == '\0') {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+// Walk a normalized path to the directory holding its last component. name and len are
+// that component, empty for the root.
+static tmpfs_node_t *lookup_parent(tmpfs_t *fs, const char *path, const char **name, size_t *len) {
+    tmpfs_node_t *dir = fs->root;
+    const char *p = path;
+
+    while (*p == '/') p++;
+    while (*p) {
+        const char *start = p;
+        while (*p && *p != '/') p++;
+        size_t part = p - start;
+        while (*p == '/') p++;
+
+        if (!*p) {
+            *name = start;
+            *len = part;
+            return dir;
+        }
+        dir = find_child(dir, start, part);
+        if (!dir || !VFS_S_ISDIR(dir->mode)) {
+            return NULL;
+        }
+    }
+
+    *name = p;
+    *len = 0;
+    return dir;
+}
+
+static tmpfs_node_t *lookup(tmpfs_t *fs, const char *path) {
+    const char *name;
+    size_t len;
+    tmpfs_node_t *dir = lookup_parent(fs, path, &name, &len);
+    if (!dir || len == 0) {
+        return dir;
+    }
+    return find_child(dir, name, len);
+}
+
+// Make room for count page slots
+static bool grow_slots(tmpfs_node_t *node, size_t count) {
+    if (count <= node->page_slots) {
+        return true;
+    }
+
+    size_t slots = node->page_slots ? node->page_slots : 4;
+    while (slots < count) slots *= 2;
+
+    pcache_page_t **pages = kzalloc(slots * sizeof(pcache_page_t*));
+    if (!pages) {
+        return false;
+    }
+    if (node->pages) {
+        memcpy(pages, node->pages, node->page_slots * sizeof(pcache_page_t*));
+        kfree(node->pages);
+    }
+    node->pages = pages;
+    node->page_slots = slots;
+    return true;
+}
+
+// Pin the pages up to and including index, a missing page of a memory inode reads as zeroes.
+// Every page below the size is pinned already.
+static bool pin_pages(tmpfs_t *fs, tmpfs_node_t *node, size_t index) {
+    if (!grow_slots(node, index + 1)) {
+        return false;
+    }
+
+    for (size_t i = node->size / PCACHE_PAGE_SIZE; i <= index; i++) {
+        if (node->pages[i]) continue;
+        if (fs->pages >= fs->max_pages) {
+            LOG_WARN_RATELIMITED("tmpfs: out of space, %u pages in use", (uint32_t)fs->pages);
+            return false;
+        }
+        node->pages[i] = pcache_read(node->ino, i);
+        if (!node->pages[i]) {
+            return false;
+        }
+        fs->pages++;
+    }
+    return true;
+}
+
+static ssize_t tmpfs_read(vfs_file_t *file, void *buffer, size_t size, uint64_t offset) {
+    tmpfs_t *fs = file->mount->fs_data;
+    tmpfs_node_t *node = file->private;
+    if (!VFS_S_ISREG(node->mode)) {
+        return -1;
+    }
+
+    mutex_lock(&fs->lock);
+    size_t done = 0;
+    if (offset < node->size) {
+        if (size > node->size - offset) size = node->size - offset;
+
+        while (done < size) {
+            size_t index = (offset + done) / PCACHE_PAGE_SIZE;
+            size_t page_off = (offset + done) % PCACHE_PAGE_SIZE;
+            size_t chunk = PCACHE_PAGE_SIZE - page_off;
+            if (chunk > size - done) chunk = size - done;
+
+            pcache_page_t *page = index < node->page_slots ? node->pages[index] : NULL;
+            if (page) {
+                memcpy((uint8_t*)buffer + done, (uint8_t*)page->data + page_off, chunk);
+            } else {
+                memset((uint8_t*)buffer + done, 0, chunk);
+            }
+            done += chunk;
+        }
+        node->atime = tmpfs_now();
+    }
+    mutex_unlock(&fs->lock);
+    return done;
+}
+
+// Write through the pinned pages, a write past the end fills the gap with zeroes
+static ssize_t tmpfs_write(vfs_file_t *file, const void *buffer, size_t size, uint64_t offset) {
+    tmpfs_t *fs = file->mount->fs_data;
+    tmpfs_node_t *node = file->private;
+    if (!VFS_S_ISREG(node->mode)) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    mutex_lock(&fs->lock);
+    size_t done = 0;
+    while (done < size) {
+        size_t index = (offset + done) / PCACHE_PAGE_SIZE;
+        size_t page_off = (offset + done) % PCACHE_PAGE_SIZE;
+        size_t chunk = PCACHE_PAGE_SIZE - page_off;
+        if (chunk > size - done) chunk = size - done;
+
+        if (!pin_pages(fs, node, index)) {
+            break;
+        }
+        memcpy((uint8_t*)node->pages[index]->data + page_off, (const uint8_t*)buffer + done, chunk);
+        done += chunk;
+        if (offset + done > node->size) {
+            node->size = offset + done;
+        }
+    }
+    if (done > 0) {
+        node->mtime = tmpfs_now();
+    }
+    mutex_unlock(&fs->lock);
+    return done > 0 ? (ssize_t)done : -1;
+}
+
+static void fill_stat(tmpfs_node_t *node, vfs_stat_t *st) {
+    size_t pages = 0;
+    for (size_t i = 0; i < node->page_slots; i++) {
+        if (node->pages[i]) pages++;
+    }
+
+    st->ino = node->ino;
+    st->mode = node->mode;
+    st->nlink = node->nlink;
+    st->size = VFS_S_ISDIR(node->mode) ? PCACHE_PAGE_SIZE : node->size;
+    st->blocks = pages * (PCACHE_PAGE_SIZE / 512);
+    st->block_size = PCACHE_PAGE_SIZE;
+    st->atime = node->atime;
+    st->mtime = node->mtime;
+    st->ctime = node->ctime;
+}
+
+static bool tmpfs_fstat(vfs_file_t *file, vfs_stat_t *st) {
+    tmpfs_t *fs = file->mount->fs_data;
+    mutex_lock(&fs->lock);
+    fill_stat(file->private, st);
+    mutex_unlock(&fs->lock);
+    return true;
+}
+
+// Directory entries, "." and ".." come first and then the children
+static int tmpfs_readdir(vfs_file_t *file, uint64_t *pos, vfs_dirent_t *entry) {
+    tmpfs_t *fs = file->mount->fs_data;
+    tmpfs_node_t *dir = file->private;
+    if (!VFS_S_ISDIR(dir->mode)) {
+        return -1;
+    }
+
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *node = NULL;
+    const char *name = NULL;
+    if (*pos == 0) {
+        node = dir;
+        name = ".";
+    } else if (*pos == 1 && !dir->unlinked) {
+        node = dir->parent;
+        name = "..";
+    } else if (!dir->unlinked) {
+        node = dir->children;
+        for (uint64_t i = 2; node && i < *pos; i++) {
+            node = node->next;
+        }
+        if (node) name = node->name;
+    }
+
+    if (node) {
+        entry->ino = node->ino;
+        entry->type = VFS_S_ISDIR(node->mode) ? VFS_DT_DIR : VFS_DT_REG;
+        strcpy(entry->name, name);
+        (*pos)++;
+    }
+    mutex_unlock(&fs->lock);
+    return node ? 1 : 0;
+}
+
+static void tmpfs_close(vfs_file_t *file) {
+    tmpfs_t *fs = file->mount->fs_data;
+    tmpfs_node_t *node = file->private;
+
+    mutex_lock(&fs->lock);
+    if (--node->opens == 0 && node->unlinked) {
+        node_free(fs, node);
+    }
+    mutex_unlock(&fs->lock);
+}
+
+static const vfs_file_ops_t tmpfs_file_ops = {
+    .read = tmpfs_read,
+    .write = tmpfs_write,
+    .stat = tmpfs_fstat,
+    .readdir = tmpfs_readdir,
+    .fsync = NULL,
+    .sendfile = NULL,
+    .close = tmpfs_close,
+};
+
+static bool tmpfs_open(vfs_mount_t *mount, const char *path, uint32_t flags, vfs_file_t *file) {
+    tmpfs_t *fs = mount->fs_data;
+    const char *name;
+    size_t len;
+
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *dir = lookup_parent(fs, path, &name, &len);
+    tmpfs_node_t *node = dir && len ? find_child(dir, name, len) : dir;
+
+    if (node && (flags & VFS_O_CREAT) && (flags & VFS_O_EXCL)) {
+        node = NULL;
+    } else if (!node && dir && (flags & VFS_O_CREAT)) {
+        node = node_create(fs, dir, name, len, VFS_S_IFREG | 0644);
+    } else if (node && VFS_S_ISDIR(node->mode) && VFS_WRITABLE(flags)) {
+        node = NULL;
+    } else if (node && (flags & VFS_O_TRUNC) && VFS_WRITABLE(flags)) {
+        truncate_node(fs, node, 0);
+    }
+
+    if (node) {
+        node->opens++;
+        file->ops = &tmpfs_file_ops;
+        file->private = node;
+        file->ino = VFS_S_ISREG(node->mode) ? node->ino : 0;
+    }
+    mutex_unlock(&fs->lock);
+    return node != NULL;
+}
+
+static bool tmpfs_stat(vfs_mount_t *mount, const char *path, vfs_stat_t *st) {
+    tmpfs_t *fs = mount->fs_data;
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *node = lookup(fs, path);
+    if (node) {
+        fill_stat(node, st);
+    }
+    mutex_unlock(&fs->lock);
+    return node != NULL;
+}
+
+static bool tmpfs_mkdir(vfs_mount_t *mount, const char *path, uint32_t mode) {
+    tmpfs_t *fs = mount->fs_data;
+    const char *name;
+    size_t len;
+
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *dir = lookup_parent(fs, path, &name, &len);
+    bool ok = dir && len && !find_child(dir, name, len) &&
+              node_create(fs, dir, name, len, VFS_S_IFDIR | (mode & 0777)) != NULL;
+    mutex_unlock(&fs->lock);
+    return ok;
+}
+
+static bool tmpfs_rmdir(vfs_mount_t *mount, const char *path) {
+    tmpfs_t *fs = mount->fs_data;
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *node = lookup(fs, path);
+    bool ok = node && node != fs->root && VFS_S_ISDIR(node->mode) && !node->children;
+    if (ok) {
+        node_unlink(fs, node);
+    }
+    mutex_unlock(&fs->lock);
+    return ok;
+}
+
+static bool tmpfs_unlink(vfs_mount_t *mount, const char *path) {
+    tmpfs_t *fs = mount->fs_data;
+    mutex_lock(&fs->lock);
+    tmpfs_node_t *node = lookup(fs, path);
+    bool ok = node && !VFS_S_ISDIR(node->mode);
+    if (ok) {
+        node_unlink(fs, node);
+    }
+    mutex_unlock(&fs->lock);
+    return ok;
+}
+
+const vfs_fs_ops_t tmpfs_fs_ops = {
+    .name = "tmpfs",
+    .open = tmpfs_open,
+    .stat = tmpfs_stat,
+    .mkdir = tmpfs_mkdir,
+    .rmdir = tmpfs_rmdir,
+    .unlink = tmpfs_unlink,
+};
+
+// New empty instance limited to max_pages, 0 for the default share of free memory
+tmpfs_t *tmpfs_create(size_t max_pages) {
+    tmpfs_t *fs = kzalloc(sizeof(tmpfs_t));
+    if (!fs) {
+        return NULL;
+    }
+
+    mutex_init(&fs->lock);
+    fs->max_pages = max_pages ? max_pages :
+                    pmm_get_free_memory() / PCACHE_PAGE_SIZE / TMPFS_DEFAULT_DIVISOR;
+    fs->root = node_create(fs, NULL, "", 0, VFS_S_IFDIR | 0777);
+    if (!fs->root) {
+        kfree(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+// Create an instance and mount it at path
+bool tmpfs_mount(const char *path, size_t max_pages) {
+    if (instance_count >= VFS_MAX_MOUNTS) {
+        return false;
+    }
+
+    tmpfs_t *fs = tmpfs_create(max_pages);
+    if (!fs) {
+        LOG_ERROR_MSG("tmpfs: failed to create instance");
+        return false;
+    }
+    if (!vfs_mount(path, &tmpfs_fs_ops, fs)) {
+        node_free(fs, fs->root);
+        kfree(fs);
+        return false;
+    }
+
+    instances[instance_count++] = fs;
+    LOG_INFO("tmpfs: %s limited to %u KB", path, (uint32_t)(fs->max_pages * (PCACHE_PAGE_SIZE / 1024)));
+    return true;
+}
+
+// Get tmpfs statistics
+void tmpfs_get_stats(tmpfs_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(tmpfs_stats_t));
+    stats->instances = instance_count;
+    for (size_t i = 0; i < instance_count; i++) {
+        stats->nodes += instances[i]->nodes;
+        stats->pages += instances[i]->pages;
+        stats->max_pages += instances[i]->max_pages;
+    }
+}
+
+// Print tmpfs statistics
+void tmpfs_print_stats(void) {
+    tmpfs_stats_t stats;
+    tmpfs_get_stats(&stats);
+    LOG_INFO("tmpfs: %u instances, %u nodes, %u/%u pages",
+             (uint32_t)stats.instances, (uint32_t)stats.nodes,
+             (uint32_t)stats.pages, (uint32_t)stats.max_pages);
+}
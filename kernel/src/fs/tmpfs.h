@@ -0,0 +1,64 @@
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fs/vfs.h>
+#include <fs/pagecache.h>
+#include <core/exec/wait.h>
+
+// An instance may hold up to this fraction of free memory unless mounted with a limit
+#define TMPFS_DEFAULT_DIVISOR   4
+
+// File or directory, regular files keep their data in page cache pages they pin
+typedef struct tmpfs_node {
+    uint32_t ino;                      // In the page cache's memory inode range
+    uint32_t mode;
+    uint32_t nlink;
+    uint64_t size;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+    char name[VFS_NAME_MAX + 1];
+    struct tmpfs_node *parent;
+    struct tmpfs_node *children;       // Directory contents, most recent first
+    struct tmpfs_node *next;           // Next entry of the parent
+    pcache_page_t **pages;             // One pinned page per 4K of size
+    size_t page_slots;
+    uint32_t opens;                    // Open files, an unlinked file is freed with the last
+    bool unlinked;
+} tmpfs_node_t;
+
+// Mounted instance
+typedef struct {
+    tmpfs_node_t *root;
+    mutex_t lock;                      // Sleeping, releasing pages may reach the page cache lock
+    size_t max_pages;
+    size_t pages;
+    size_t nodes;
+} tmpfs_t;
+
+// tmpfs statistics, summed over the instances
+typedef struct {
+    size_t instances;
+    size_t nodes;
+    size_t pages;
+    size_t max_pages;
+} tmpfs_stats_t;
+
+extern const vfs_fs_ops_t tmpfs_fs_ops;
+
+// New empty instance limited to max_pages, 0 for the default share of free memory
+tmpfs_t *tmpfs_create(size_t max_pages);
+
+// Create an instance and mount it at path
+bool tmpfs_mount(const char *path, size_t max_pages);
+
+// Get tmpfs statistics
+void tmpfs_get_stats(tmpfs_stats_t *stats);
+
+// Print tmpfs statistics
+void tmpfs_print_stats(void);
+
+#endif // TMPFS_H
@@ -0,0 +1,694 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_FS
+
+#include <fs/vfs.h>
+#include <memory/slab.h>
+#include <core/cpu.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Mount table, only ever appended to, so lookups read it without the lock
+static vfs_mount_t mounts[VFS_MAX_MOUNTS];
+static volatile size_t mount_count = 0;
+static spinlock_t mount_lock;
+
+// Descriptors of the kernel itself and of tasks without a table of their own
+static vfs_fdtable_t kernel_table;
+
+// Statistics
+static size_t open_files = 0;
+static size_t table_count = 0;
+static size_t stat_opens = 0;
+static size_t stat_lookups = 0;
+
+// Descriptor table of the executing task
+static vfs_fdtable_t *current_table(void) {
+    task_t *task = scheduler_get_current_task();
+    return task && task->files ? task->files : &kernel_table;
+}
+
+// Set up the mount table and the kernel's descriptor table
+bool vfs_init(void) {
+    memset(mounts, 0, sizeof(mounts));
+    mount_count = 0;
+    spinlock_init(&mount_lock);
+
+    memset(&kernel_table, 0, sizeof(kernel_table));
+    strcpy(kernel_table.cwd, "/");
+    spinlock_init(&kernel_table.lock);
+
+    LOG_INFO_MSG("VFS initialized");
+    return true;
+}
+
+// Turn path into an absolute one without ".", ".." or repeated slashes
+bool vfs_normalize(const char *path, char *out) {
+    if (!path || !out || !*path) {
+        return false;
+    }
+
+    // Relative paths start in the working directory
+    size_t len = 0;
+    out[0] = '\0';
+    if (path[0] != '/') {
+        const char *cwd = current_table()->cwd;
+        len = strlen(cwd);
+        memcpy(out, cwd, len + 1);
+        if (len == 1) len = 0;      // The root contributes no component
+    }
+
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+
+        const char *start = p;
+        while (*p && *p != '/') p++;
+        size_t part = p - start;
+
+        if (part == 1 && start[0] == '.') {
+            continue;
+        }
+        if (part == 2 && start[0] == '.' && start[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;     // The slash before the dropped component
+            continue;
+        }
+        if (part > VFS_NAME_MAX || len + 1 + part >= VFS_MAX_PATH) {
+            return false;
+        }
+
+        out[len++] = '/';
+        memcpy(out + len, start, part);
+        len += part;
+    }
+
+    if (len == 0) {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return true;
+}
+
+// Mount covering an absolute path, the longest mount point that is a prefix at a component
+// boundary. sub is the path from the mount point on.
+static vfs_mount_t *find_mount(const char *abs, const char **sub) {
+    vfs_mount_t *best = NULL;
+    size_t count = __atomic_load_n(&mount_count, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < count; i++) {
+        vfs_mount_t *m = &mounts[i];
+        if (best && m->path_len <= best->path_len) continue;
+
+        if (m->path_len == 1) {
+            best = m;
+        } else if (strncmp(abs, m->path, m->path_len) == 0 &&
+                   (abs[m->path_len] == '/' || abs[m->path_len] == '\0')) {
+            best = m;
+        }
+    }
+
+    if (best && sub) {
+        *sub = best->path_len == 1 ? abs : abs + best->path_len;
+        if (!**sub) *sub = "/";
+    }
+    return best;
+}
+
+// Normalize a path and find its mount
+static vfs_mount_t *resolve(const char *path, char *abs, const char **sub) {
+    __atomic_add_fetch(&stat_lookups, 1, __ATOMIC_RELAXED);
+    if (!vfs_normalize(path, abs)) {
+        LOG_ERROR("VFS: invalid path %s", path ? path : "(null)");
+        return NULL;
+    }
+
+    vfs_mount_t *mount = find_mount(abs, sub);
+    if (!mount) {
+        LOG_ERROR("VFS: nothing mounted for %s", abs);
+    }
+    return mount;
+}
+
+// Mount a filesystem at a directory path
+bool vfs_mount(const char *path, const vfs_fs_ops_t *ops, void *fs_data) {
+    char abs[VFS_MAX_PATH];
+    if (!ops || !ops->open || !vfs_normalize(path, abs)) {
+        return false;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&mount_lock);
+
+    bool ok = mount_count < VFS_MAX_MOUNTS;
+    for (size_t i = 0; ok && i < mount_count; i++) {
+        ok = strcmp(mounts[i].path, abs) != 0;
+    }
+    if (ok) {
+        vfs_mount_t *m = &mounts[mount_count];
+        strcpy(m->path, abs);
+        m->path_len = strlen(abs);
+        m->ops = ops;
+        m->fs_data = fs_data;
+        m->open_files = 0;
+        __atomic_store_n(&mount_count, mount_count + 1, __ATOMIC_RELEASE);
+    }
+
+    spinlock_release(&mount_lock);
+    cpu_irq_restore(flags);
+
+    if (!ok) {
+        LOG_ERROR("VFS: cannot mount %s at %s", ops->name, abs);
+        return false;
+    }
+    LOG_INFO("VFS: mounted %s at %s", ops->name, abs);
+    return true;
+}
+
+// Drop a reference to an open file, the last one closes it
+static void file_put(vfs_file_t *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (file->ops->close) {
+        file->ops->close(file);
+    }
+    __atomic_sub_fetch(&file->mount->open_files, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&open_files, 1, __ATOMIC_RELAXED);
+    kfree(file);
+}
+
+// Open file behind a descriptor with a reference for the caller
+static vfs_file_t *file_get(int fd) {
+    vfs_fdtable_t *table = current_table();
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&table->lock);
+    vfs_file_t *file = fd < table->capacity ? table->files[fd] : NULL;
+    if (file) {
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    spinlock_release(&table->lock);
+    cpu_irq_restore(flags);
+    return file;
+}
+
+// Give a file the lowest free descriptor, growing the table when it is full
+static int fd_install(vfs_fdtable_t *table, vfs_file_t *file) {
+    while (true) {
+        uint64_t flags = cpu_irq_save();
+        spinlock_acquire(&table->lock);
+        for (int fd = VFS_FD_BASE; fd < table->capacity; fd++) {
+            if (!table->files[fd]) {
+                table->files[fd] = file;
+                table->open++;
+                spinlock_release(&table->lock);
+                cpu_irq_restore(flags);
+                return fd;
+            }
+        }
+        int capacity = table->capacity;
+        spinlock_release(&table->lock);
+        cpu_irq_restore(flags);
+
+        if (capacity >= VFS_MAX_FDS) {
+            LOG_ERROR_MSG("VFS: too many open files");
+            return -1;
+        }
+
+        // The bigger array is allocated unlocked, another grow in between just wins
+        int grown = capacity ? capacity * 2 : VFS_FD_INITIAL;
+        vfs_file_t **files = kzalloc(grown * sizeof(vfs_file_t*));
+        if (!files) {
+            return -1;
+        }
+
+        flags = cpu_irq_save();
+        spinlock_acquire(&table->lock);
+        vfs_file_t **old = NULL;
+        if (table->capacity == capacity) {
+            if (capacity) memcpy(files, table->files, capacity * sizeof(vfs_file_t*));
+            old = table->files;
+            table->files = files;
+            table->capacity = grown;
+        } else {
+            old = files;
+        }
+        spinlock_release(&table->lock);
+        cpu_irq_restore(flags);
+        kfree(old);
+    }
+}
+
+// Open a file through the filesystem mounted over it
+int vfs_open(const char *path, uint32_t flags) {
+    char abs[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *mount = resolve(path, abs, &sub);
+    if (!mount) {
+        return -1;
+    }
+
+    vfs_file_t *file = kzalloc(sizeof(vfs_file_t));
+    if (!file) {
+        return -1;
+    }
+    file->mount = mount;
+    file->flags = flags;
+    file->refs = 1;
+
+    if (!mount->ops->open(mount, sub, flags, file) || !file->ops) {
+        kfree(file);
+        return -1;
+    }
+    __atomic_add_fetch(&mount->open_files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&open_files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat_opens, 1, __ATOMIC_RELAXED);
+
+    int fd = fd_install(current_table(), file);
+    if (fd < 0) {
+        file_put(file);
+    }
+    return fd;
+}
+
+// Close a descriptor, the file closes with its last descriptor
+bool vfs_close(int fd) {
+    vfs_fdtable_t *table = current_table();
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&table->lock);
+    vfs_file_t *file = fd < table->capacity ? table->files[fd] : NULL;
+    if (file) {
+        table->files[fd] = NULL;
+        table->open--;
+    }
+    spinlock_release(&table->lock);
+    cpu_irq_restore(flags);
+
+    if (!file) {
+        return false;
+    }
+    file_put(file);
+    return true;
+}
+
+// Open file behind a descriptor, valid until the descriptor is closed
+vfs_file_t *vfs_get_file(int fd) {
+    vfs_file_t *file = file_get(fd);
+    if (file) {
+        // The descriptor keeps its own reference
+        file_put(file);
+    }
+    return file;
+}
+
+static ssize_t file_read(vfs_file_t *file, void *buffer, size_t size, uint64_t offset) {
+    if (!VFS_READABLE(file->flags) || !file->ops->read) {
+        return -1;
+    }
+    return file->ops->read(file, buffer, size, offset);
+}
+
+static ssize_t file_write(vfs_file_t *file, const void *buffer, size_t size, uint64_t offset) {
+    if (!VFS_WRITABLE(file->flags) || !file->ops->write) {
+        return -1;
+    }
+    return file->ops->write(file, buffer, size, offset);
+}
+
+// Read at the file position and advance it
+ssize_t vfs_read(int fd, void *buffer, size_t size) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !buffer) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t n = file_read(file, buffer, size, file->position);
+    if (n > 0) {
+        file->position += n;
+    }
+    file_put(file);
+    return n;
+}
+
+// Read at an offset, the file position is left alone
+ssize_t vfs_pread(int fd, void *buffer, size_t size, uint64_t offset) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !buffer) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t n = file_read(file, buffer, size, offset);
+    file_put(file);
+    return n;
+}
+
+// Read into several buffers in turn, stopping at the first short read
+ssize_t vfs_readv(int fd, const vfs_iovec_t *iov, int iovcnt) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !iov || iovcnt < 0) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        ssize_t n = iov[i].base ? file_read(file, iov[i].base, iov[i].len, file->position) : -1;
+        if (n < 0) {
+            if (total == 0) total = -1;
+            break;
+        }
+        file->position += n;
+        total += n;
+        if ((size_t)n < iov[i].len) break;
+    }
+    file_put(file);
+    return total;
+}
+
+// Write at the file position and advance it
+ssize_t vfs_write(int fd, const void *buffer, size_t size) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !buffer) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t n = file_write(file, buffer, size, file->position);
+    if (n > 0) {
+        file->position += n;
+    }
+    file_put(file);
+    return n;
+}
+
+// Write at an offset, the file position is left alone
+ssize_t vfs_pwrite(int fd, const void *buffer, size_t size, uint64_t offset) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !buffer) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t n = file_write(file, buffer, size, offset);
+    file_put(file);
+    return n;
+}
+
+// Write several buffers in turn, stopping at the first short write
+ssize_t vfs_writev(int fd, const vfs_iovec_t *iov, int iovcnt) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !iov || iovcnt < 0) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) continue;
+        ssize_t n = iov[i].base ? file_write(file, iov[i].base, iov[i].len, file->position) : -1;
+        if (n < 0) {
+            if (total == 0) total = -1;
+            break;
+        }
+        file->position += n;
+        total += n;
+        if ((size_t)n < iov[i].len) break;
+    }
+    file_put(file);
+    return total;
+}
+
+// Copy between two files inside the kernel. A filesystem copying its own files does it
+// without a bounce buffer, anything else goes through one page.
+ssize_t vfs_sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count) {
+    vfs_file_t *in = file_get(in_fd);
+    vfs_file_t *out = file_get(out_fd);
+    ssize_t sent = -1;
+    if (!in || !out || !VFS_READABLE(in->flags) || !VFS_WRITABLE(out->flags)) {
+        goto done;
+    }
+
+    uint64_t pos = offset ? *offset : in->position;
+    if (in->ops == out->ops && in->ops->sendfile) {
+        sent = in->ops->sendfile(out, out->position, in, pos, count);
+    } else {
+        void *bounce = kmalloc(PAGE_SIZE_4K);
+        if (!bounce) {
+            goto done;
+        }
+        sent = 0;
+        while ((size_t)sent < count) {
+            size_t chunk = count - sent < PAGE_SIZE_4K ? count - sent : PAGE_SIZE_4K;
+            ssize_t n = file_read(in, bounce, chunk, pos + sent);
+            if (n <= 0) break;
+            ssize_t w = file_write(out, bounce, n, out->position + sent);
+            if (w > 0) sent += w;
+            if (w < n) break;
+        }
+        kfree(bounce);
+    }
+
+    if (sent > 0) {
+        out->position += sent;
+        if (offset) {
+            *offset = pos + sent;
+        } else {
+            in->position = pos + sent;
+        }
+    }
+
+done:
+    if (in) file_put(in);
+    if (out) file_put(out);
+    return sent;
+}
+
+// Move the file position, returns the new one or -1
+int64_t vfs_lseek(int fd, int64_t offset, int whence) {
+    vfs_file_t *file = file_get(fd);
+    if (!file) {
+        return -1;
+    }
+
+    int64_t base;
+    vfs_stat_t st;
+    switch (whence) {
+        case VFS_SEEK_SET:
+            base = 0;
+            break;
+        case VFS_SEEK_CUR:
+            base = (int64_t)file->position;
+            break;
+        case VFS_SEEK_END:
+            base = file->ops->stat && file->ops->stat(file, &st) ? (int64_t)st.size : -1;
+            break;
+        default:
+            base = -1;
+            break;
+    }
+
+    int64_t position = -1;
+    if (base >= 0 && base + offset >= 0) {
+        position = base + offset;
+        file->position = (uint64_t)position;
+    }
+    file_put(file);
+    return position;
+}
+
+// Attributes of an open file
+bool vfs_fstat(int fd, vfs_stat_t *st) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !st) {
+        if (file) file_put(file);
+        return false;
+    }
+
+    memset(st, 0, sizeof(vfs_stat_t));
+    bool ok = file->ops->stat && file->ops->stat(file, st);
+    file_put(file);
+    return ok;
+}
+
+// Next entry of an open directory, 1 for an entry, 0 at the end and -1 on error
+int vfs_readdir(int fd, vfs_dirent_t *entry) {
+    vfs_file_t *file = file_get(fd);
+    if (!file || !entry) {
+        if (file) file_put(file);
+        return -1;
+    }
+
+    int result = file->ops->readdir ? file->ops->readdir(file, &file->position, entry) : -1;
+    file_put(file);
+    return result;
+}
+
+// Flush an open file to its storage, files without any succeed at once
+bool vfs_fsync(int fd) {
+    vfs_file_t *file = file_get(fd);
+    if (!file) {
+        return false;
+    }
+
+    bool ok = !file->ops->fsync || file->ops->fsync(file);
+    file_put(file);
+    return ok;
+}
+
+// Attributes of a path
+bool vfs_stat(const char *path, vfs_stat_t *st) {
+    char abs[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *mount = resolve(path, abs, &sub);
+    if (!mount || !st || !mount->ops->stat) {
+        return false;
+    }
+
+    memset(st, 0, sizeof(vfs_stat_t));
+    return mount->ops->stat(mount, sub, st);
+}
+
+bool vfs_mkdir(const char *path, uint32_t mode) {
+    char abs[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *mount = resolve(path, abs, &sub);
+    return mount && mount->ops->mkdir && mount->ops->mkdir(mount, sub, mode);
+}
+
+// Remove a directory, mount points stay
+bool vfs_rmdir(const char *path) {
+    char abs[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *mount = resolve(path, abs, &sub);
+    if (!mount || !mount->ops->rmdir || strcmp(sub, "/") == 0) {
+        return false;
+    }
+    return mount->ops->rmdir(mount, sub);
+}
+
+bool vfs_unlink(const char *path) {
+    char abs[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *mount = resolve(path, abs, &sub);
+    if (!mount || !mount->ops->unlink || strcmp(sub, "/") == 0) {
+        return false;
+    }
+    return mount->ops->unlink(mount, sub);
+}
+
+// Change the current task's working directory
+bool vfs_chdir(const char *path) {
+    char abs[VFS_MAX_PATH];
+    vfs_stat_t st;
+    if (!vfs_normalize(path, abs) || !vfs_stat(abs, &st) || !VFS_S_ISDIR(st.mode)) {
+        return false;
+    }
+
+    vfs_fdtable_t *table = current_table();
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&table->lock);
+    strcpy(table->cwd, abs);
+    spinlock_release(&table->lock);
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// The current task's working directory
+const char *vfs_getcwd(void) {
+    return current_table()->cwd;
+}
+
+// Empty table for a new task, working in the root
+vfs_fdtable_t *vfs_fdtable_create(void) {
+    vfs_fdtable_t *table = kzalloc(sizeof(vfs_fdtable_t));
+    if (!table) {
+        return NULL;
+    }
+    strcpy(table->cwd, "/");
+    spinlock_init(&table->lock);
+    __atomic_add_fetch(&table_count, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+// Copy of a table for a forked task, both share the open files and their positions
+vfs_fdtable_t *vfs_fdtable_clone(vfs_fdtable_t *table) {
+    vfs_fdtable_t *copy = vfs_fdtable_create();
+    if (!copy || !table) {
+        return copy;
+    }
+
+    // Sized outside the lock, a table that grew in between is copied up to the old size
+    int capacity = table->capacity;
+    vfs_file_t **files = capacity ? kzalloc(capacity * sizeof(vfs_file_t*)) : NULL;
+    if (capacity && !files) {
+        vfs_fdtable_destroy(copy);
+        return NULL;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&table->lock);
+    for (int fd = 0; fd < capacity && fd < table->capacity; fd++) {
+        if (table->files[fd]) {
+            files[fd] = table->files[fd];
+            __atomic_add_fetch(&files[fd]->refs, 1, __ATOMIC_ACQ_REL);
+            copy->open++;
+        }
+    }
+    strcpy(copy->cwd, table->cwd);
+    spinlock_release(&table->lock);
+    cpu_irq_restore(flags);
+
+    copy->files = files;
+    copy->capacity = capacity;
+    return copy;
+}
+
+// Close every descriptor of a table and free it
+void vfs_fdtable_destroy(vfs_fdtable_t *table) {
+    if (!table || table == &kernel_table) {
+        return;
+    }
+
+    for (int fd = 0; fd < table->capacity; fd++) {
+        if (table->files[fd]) {
+            file_put(table->files[fd]);
+        }
+    }
+    kfree(table->files);
+    kfree(table);
+    __atomic_sub_fetch(&table_count, 1, __ATOMIC_RELAXED);
+}
+
+// Get VFS statistics
+void vfs_get_stats(vfs_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->mounts = mount_count;
+    stats->open_files = open_files;
+    stats->tables = table_count;
+    stats->opens = stat_opens;
+    stats->lookups = stat_lookups;
+}
+
+// Print the mount table and VFS statistics
+void vfs_print_stats(void) {
+    LOG_INFO("VFS: %u mounts, %u open files, %u task tables, %u opens, %u lookups",
+             (uint32_t)mount_count, (uint32_t)open_files, (uint32_t)table_count,
+             (uint32_t)stat_opens, (uint32_t)stat_lookups);
+    for (size_t i = 0; i < mount_count; i++) {
+        LOG_INFO("  %s on %s, %u open files", mounts[i].ops->name, mounts[i].path, mounts[i].open_files);
+    }
+}
@@ -0,0 +1,185 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/exec/scheduler.h>
+
+typedef int64_t ssize_t;
+
+// Limits
+#define VFS_MAX_MOUNTS      8
+#define VFS_MAX_PATH        256
+#define VFS_NAME_MAX        255
+
+// Descriptor tables start this small and double up to VFS_MAX_FDS. Numbers below
+// VFS_FD_BASE are left to the console streams and the ring descriptor.
+#define VFS_FD_BASE         3
+#define VFS_FD_INITIAL      16
+#define VFS_MAX_FDS         1024
+
+// Open flags, the values ext2 uses
+#define VFS_O_RDONLY        0x0001
+#define VFS_O_WRONLY        0x0002
+#define VFS_O_RDWR          0x0003
+#define VFS_O_CREAT         0x0100
+#define VFS_O_EXCL          0x0200
+#define VFS_O_TRUNC         0x0400
+
+#define VFS_READABLE(flags) (((flags) & VFS_O_RDWR) != VFS_O_WRONLY)
+#define VFS_WRITABLE(flags) (((flags) & VFS_O_WRONLY) != 0)
+
+// File types in mode, the ext2 encoding
+#define VFS_S_IFMT          0xF000
+#define VFS_S_IFREG         0x8000
+#define VFS_S_IFDIR         0x4000
+#define VFS_S_ISREG(m)      (((m) & VFS_S_IFMT) == VFS_S_IFREG)
+#define VFS_S_ISDIR(m)      (((m) & VFS_S_IFMT) == VFS_S_IFDIR)
+
+// Directory entry types, the getdents encoding
+#define VFS_DT_UNKNOWN      0
+#define VFS_DT_DIR          4
+#define VFS_DT_REG          8
+
+// lseek origins
+#define VFS_SEEK_SET        0
+#define VFS_SEEK_CUR        1
+#define VFS_SEEK_END        2
+
+struct vfs_file;
+struct vfs_mount;
+
+// File attributes
+typedef struct {
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t nlink;
+    uint64_t size;
+    uint64_t blocks;                // 512 byte units
+    uint32_t block_size;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+} vfs_stat_t;
+
+// One directory entry
+typedef struct {
+    uint32_t ino;
+    uint8_t type;                   // VFS_DT_*
+    char name[VFS_NAME_MAX + 1];
+} vfs_dirent_t;
+
+// One buffer of a vectored transfer, laid out like struct iovec
+typedef struct {
+    void *base;
+    size_t len;
+} vfs_iovec_t;
+
+// Operations on an open file, offsets are explicit and the VFS keeps the position
+typedef struct {
+    ssize_t (*read)(struct vfs_file *file, void *buffer, size_t size, uint64_t offset);
+    ssize_t (*write)(struct vfs_file *file, const void *buffer, size_t size, uint64_t offset);
+    bool (*stat)(struct vfs_file *file, vfs_stat_t *st);
+    // Entry at *pos and advance it, 1 for an entry, 0 at the end and -1 on error
+    int (*readdir)(struct vfs_file *file, uint64_t *pos, vfs_dirent_t *entry);
+    bool (*fsync)(struct vfs_file *file);
+    // Optional copy between two files of the filesystem, the VFS bounces through a page otherwise
+    ssize_t (*sendfile)(struct vfs_file *out, uint64_t out_pos, struct vfs_file *in, uint64_t in_pos, size_t count);
+    void (*close)(struct vfs_file *file);
+} vfs_file_ops_t;
+
+// Operations on a mounted filesystem, paths are absolute from the mount point
+typedef struct {
+    const char *name;
+    bool (*open)(struct vfs_mount *mount, const char *path, uint32_t flags, struct vfs_file *file);
+    bool (*stat)(struct vfs_mount *mount, const char *path, vfs_stat_t *st);
+    bool (*mkdir)(struct vfs_mount *mount, const char *path, uint32_t mode);
+    bool (*rmdir)(struct vfs_mount *mount, const char *path);
+    bool (*unlink)(struct vfs_mount *mount, const char *path);
+} vfs_fs_ops_t;
+
+// Mounted filesystem
+typedef struct vfs_mount {
+    char path[VFS_MAX_PATH];        // Normalized, "/" or without a trailing slash
+    size_t path_len;
+    const vfs_fs_ops_t *ops;
+    void *fs_data;
+    uint32_t open_files;
+} vfs_mount_t;
+
+// Open file, shared by the descriptors dup'ed or inherited from the one that opened it
+typedef struct vfs_file {
+    const vfs_file_ops_t *ops;      // Set by the filesystem's open
+    vfs_mount_t *mount;
+    void *private;                  // Filesystem handle
+    uint32_t ino;                   // Page cache inode mmap maps, 0 when the file has none
+    uint32_t flags;
+    uint64_t position;
+    uint32_t refs;
+} vfs_file_t;
+
+// Per-task descriptor table and working directory, copied on fork
+typedef struct vfs_fdtable {
+    vfs_file_t **files;
+    int capacity;
+    int open;
+    char cwd[VFS_MAX_PATH];
+    spinlock_t lock;
+} vfs_fdtable_t;
+
+// VFS statistics
+typedef struct {
+    size_t mounts;
+    size_t open_files;              // Open file objects in every table
+    size_t tables;                  // Descriptor tables of tasks
+    size_t opens;
+    size_t lookups;
+} vfs_stats_t;
+
+// Set up the mount table and the kernel's descriptor table
+bool vfs_init(void);
+
+// Mount a filesystem at a directory path, "/" first
+bool vfs_mount(const char *path, const vfs_fs_ops_t *ops, void *fs_data);
+
+// Turn path into an absolute one without ".", ".." or repeated slashes, relative to the
+// current task's working directory
+bool vfs_normalize(const char *path, char *out);
+
+// Descriptor operations on the current task's table
+int vfs_open(const char *path, uint32_t flags);
+bool vfs_close(int fd);
+vfs_file_t *vfs_get_file(int fd);
+ssize_t vfs_read(int fd, void *buffer, size_t size);
+ssize_t vfs_pread(int fd, void *buffer, size_t size, uint64_t offset);
+ssize_t vfs_readv(int fd, const vfs_iovec_t *iov, int iovcnt);
+ssize_t vfs_write(int fd, const void *buffer, size_t size);
+ssize_t vfs_pwrite(int fd, const void *buffer, size_t size, uint64_t offset);
+ssize_t vfs_writev(int fd, const vfs_iovec_t *iov, int iovcnt);
+ssize_t vfs_sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count);
+int64_t vfs_lseek(int fd, int64_t offset, int whence);
+bool vfs_fstat(int fd, vfs_stat_t *st);
+int vfs_readdir(int fd, vfs_dirent_t *entry);
+bool vfs_fsync(int fd);
+
+// Path operations
+bool vfs_stat(const char *path, vfs_stat_t *st);
+bool vfs_mkdir(const char *path, uint32_t mode);
+bool vfs_rmdir(const char *path);
+bool vfs_unlink(const char *path);
+bool vfs_chdir(const char *path);
+const char *vfs_getcwd(void);
+
+// Descriptor tables of tasks
+vfs_fdtable_t *vfs_fdtable_create(void);
+vfs_fdtable_t *vfs_fdtable_clone(vfs_fdtable_t *table);
+void vfs_fdtable_destroy(vfs_fdtable_t *table);
+
+// Get VFS statistics
+void vfs_get_stats(vfs_stats_t *stats);
+
+// Print the mount table and VFS statistics
+void vfs_print_stats(void);
+
+#endif // VFS_H
@@ -29,3 +29,11 @@ uint32_t inl(uint16_t port) {
     asm volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
     return ret;
 }
+
+void insw(uint16_t port, void *buffer, uint32_t count) {
+    asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsw(uint16_t port, const void *buffer, uint32_t count) {
+    asm volatile ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
@@ -9,5 +9,7 @@ void outw(uint16_t port, uint16_t value);
 uint16_t inw(uint16_t port);
 void outl(uint16_t port, uint32_t value);
 uint32_t inl(uint16_t port);
+void insw(uint16_t port, void *buffer, uint32_t count);
+void outsw(uint16_t port, const void *buffer, uint32_t count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+section .text
+global simd_clear_page
+global simd_copy_page
+
+; SSE2 page kernels, only called between kernel_fpu_begin and kernel_fpu_end.
+; Both use non-temporal stores so a page being cleared or copied does not
+; evict the working set from the cache.
+
+simd_clear_page:
+    ; RDI = 16-byte aligned page
+    pxor xmm0, xmm0
+    mov rcx, 4096 / 64
+.loop:
+    movntdq [rdi + 0], xmm0
+    movntdq [rdi + 16], xmm0
+    movntdq [rdi + 32], xmm0
+    movntdq [rdi + 48], xmm0
+    add rdi, 64
+    dec rcx
+    jnz .loop
+    sfence                ; Order the streaming stores before the page is used
+    ret
+
+simd_copy_page:
+    ; RDI = 16-byte aligned destination, RSI = 16-byte aligned source
+    mov rcx, 4096 / 64
+.loop:
+    movdqa xmm0, [rsi + 0]
+    movdqa xmm1, [rsi + 16]
+    movdqa xmm2, [rsi + 32]
+    movdqa xmm3, [rsi + 48]
+    movntdq [rdi + 0], xmm0
+    movntdq [rdi + 16], xmm1
+    movntdq [rdi + 32], xmm2
+    movntdq [rdi + 48], xmm3
+    add rsi, 64
+    add rdi, 64
+    dec rcx
+    jnz .loop
+    sfence
+    ret
@@ -1,39 +1,176 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <lib/string.h>
+#include <core/cpu.h>
+#include <utils/log.h>
 
-void *memcpy(void *dest, const void *src, size_t n) {
-    uint8_t *pdest = (uint8_t *)dest;
-    const uint8_t *psrc = (const uint8_t *)src;
+// Size classes for the memory kernels
+#define MEM_SMALL       32      // Below this, plain loads and stores beat any string instruction
+#define MEM_REP_MIN     128     // rep movsb/stosb startup cost is amortised above this without FSRM
+
+// String instruction support, detected by string_init
+static bool have_erms = false;
+static bool have_fsrm = false;
+
+// Unaligned word access
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+
+// Keep GCC from turning the copy loops back into calls to the function being defined
+#if defined(__GNUC__) && !defined(__clang__)
+#define MEM_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#else
+#define MEM_NO_LIBCALL
+#endif
+
+// Pick the memory kernels for this CPU
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        have_erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+        have_fsrm = (edx & CPUID_7_EDX_FSRM) != 0;
+    }
+
+    LOG_INFO("String kernels: %s", have_fsrm ? "rep movsb (FSRM)" :
+             have_erms ? "rep movsb (ERMS)" : "64-bit words");
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+    __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
 
+static inline void rep_movsq(void *dest, const void *src, size_t n) {
+    __asm__ volatile("rep movsq" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t c, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+static inline void rep_stosq(void *dest, uint64_t v, size_t n) {
+    __asm__ volatile("rep stosq" : "+D"(dest), "+c"(n) : "a"(v) : "memory");
+}
+
+// Copy fewer than MEM_SMALL bytes, the last word may overlap the previous one
+static inline void copy_small(uint8_t *d, const uint8_t *s, size_t n) {
+    if (n >= 8) {
+        uint64_t last = *(const unaligned_u64 *)(s + n - 8);
+        for (size_t i = 0; i + 8 <= n; i += 8) {
+            *(unaligned_u64 *)(d + i) = *(const unaligned_u64 *)(s + i);
+        }
+        *(unaligned_u64 *)(d + n - 8) = last;
+        return;
+    }
+    if (n >= 4) {
+        uint32_t first = *(const unaligned_u32 *)s;
+        uint32_t last = *(const unaligned_u32 *)(s + n - 4);
+        *(unaligned_u32 *)d = first;
+        *(unaligned_u32 *)(d + n - 4) = last;
+        return;
+    }
     for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+        d[i] = s[i];
+    }
+}
+
+MEM_NO_LIBCALL
+void *memcpy(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if (n < MEM_SMALL) {
+        copy_small(d, s, n);
+        return dest;
+    }
+
+    if (have_fsrm || (have_erms && n >= MEM_REP_MIN)) {
+        rep_movsb(d, s, n);
+        return dest;
+    }
+
+    // Align the destination, move whole words, then the tail
+    size_t head = (size_t)(-(uintptr_t)d & 7);
+    for (size_t i = 0; i < head; i++) {
+        d[i] = s[i];
+    }
+    d += head;
+    s += head;
+    n -= head;
+
+    rep_movsq(d, s, n / 8);
+    for (size_t i = n & ~(size_t)7; i < n; i++) {
+        d[i] = s[i];
     }
 
     return dest;
 }
 
+MEM_NO_LIBCALL
 void *memset(void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
+    uint64_t pattern = (uint8_t)c * 0x0101010101010101ULL;
 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+    if (n < MEM_SMALL) {
+        if (n >= 8) {
+            for (size_t i = 0; i + 8 <= n; i += 8) {
+                *(unaligned_u64 *)(p + i) = pattern;
+            }
+            *(unaligned_u64 *)(p + n - 8) = pattern;
+            return s;
+        }
+        for (size_t i = 0; i < n; i++) {
+            p[i] = (uint8_t)c;
+        }
+        return s;
+    }
+
+    if (have_erms && (have_fsrm || n >= MEM_REP_MIN)) {
+        rep_stosb(p, (uint8_t)c, n);
+        return s;
     }
 
+    // One unaligned word covers the head, then aligned words and an overlapping tail word
+    *(unaligned_u64 *)p = pattern;
+    size_t head = 8 - ((uintptr_t)p & 7);
+    rep_stosq(p + head, pattern, (n - head) / 8);
+    *(unaligned_u64 *)(p + n - 8) = pattern;
+
     return s;
 }
 
+MEM_NO_LIBCALL
 void *memmove(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
-    if (src > dest) {
+    // Forward copies are safe whenever the destination starts below the source
+    // or the ranges do not overlap
+    if (pdest <= psrc || pdest >= psrc + n) {
+        if (n >= MEM_SMALL) {
+            return memcpy(dest, src, n);
+        }
         for (size_t i = 0; i < n; i++) {
             pdest[i] = psrc[i];
         }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+        return dest;
+    }
+
+    // Overlapping with the destination above: copy backwards, a word at a time
+    // once the end of the destination is aligned (DF stays clear for interrupts)
+    while (n > 0 && (((uintptr_t)(pdest + n)) & 7)) {
+        n--;
+        pdest[n] = psrc[n];
+    }
+    while (n >= 8) {
+        n -= 8;
+        *(unaligned_u64 *)(pdest + n) = *(const unaligned_u64 *)(psrc + n);
+    }
+    while (n > 0) {
+        n--;
+        pdest[n] = psrc[n];
     }
 
     return dest;
@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 
+// Select rep movsb/stosb or word loops from CPUID, call once early at boot
+void string_init(void);
+
 void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
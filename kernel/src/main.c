@@ -6,16 +6,35 @@
 #include <lib/string.h>
 #include <utils/log.h>
 #include <utils/sysinfo.h>
+#include <utils/cmdline.h>
+#include <utils/bench.h>
+#include <utils/trace.h>
+#include <utils/ksyms.h>
+#include <utils/profile.h>
 #include <core/gdt.h>
 #include <core/idt.h>
+#include <core/fpu.h>
+#include <core/smp.h>
+#include <core/init.h>
 #include <memory/pmm.h>
 #include <memory/vmm.h>
+#include <memory/slab.h>
+#include <memory/vma.h>
+#include <drivers/acpi/acpi.h>
+#include <drivers/apic/lapic.h>
+#include <drivers/apic/ioapic.h>
 #include <drivers/timer/timer.h>
 #include <drivers/keyboard/keyboard.h>
 #include <drivers/mouse/mouse.h>
+#include <drivers/pci/pci.h>
 #include <drivers/ata/ata.h>
+#include <drivers/ahci/ahci.h>
+#include <drivers/nvme/nvme.h>
 #include <core/exec/scheduler.h>
 #include <fs/ext2.h>
+#include <fs/vfs.h>
+#include <fs/tmpfs.h>
+#include <fs/pagecache.h>
 #include <core/exec/syscalls.h>
 
 __attribute__((used, section(".limine_requests")))
@@ -53,17 +72,59 @@ void setup_fb() {
     memset((void *)framebuffer->address, 0, framebuffer->pitch * framebuffer->height);
 }
 
+// Boot stages, run by init_run once their dependencies are done
+
+static bool init_pci(void) {
+    pci_init();
+    return true;
+}
+
+static bool init_ata(void) {
+    ata_init();
+    return true;
+}
+
+// NVMe gives each online CPU its own queue pair, the APs are up by now
+static bool init_nvme(void) {
+    if (!nvme_init()) {
+        return false;
+    }
+    nvme_init_cpus();
+    return true;
+}
+
+// The page cache holds tmpfs files from the start, ext2 attaches to it when mounted
+static bool init_fs(void) {
+    if (!pcache_init()) {
+        return false;
+    }
+    if (!ext2_init() || !vfs_init()) {
+        return false;
+    }
+
+    // ext2 answers for everything outside /tmp once a drive is mounted
+    return vfs_mount("/", &ext2_vfs_ops, NULL) && tmpfs_mount("/tmp", 0);
+}
+
 // Kernel initialization and setup
 void kmain(void) {
     log_init(LOG_LEVEL_DEBUG);
 
+    // Every later copy and clear goes through these
+    string_init();
+
     LOG_INFO_MSG("KronosOS booting");
 
+    cmdline_init();
+
     setup_fb();
 
     LOG_INFO_MSG("Initializing GDT");
     gdt_init();
 
+    // Per-CPU data is reached through GS from here on
+    smp_init_bsp();
+
     idt_init();
 
     // Initialize the physical memory manager
@@ -76,6 +137,21 @@ void kmain(void) {
 
     vmm_init(memmap_request.response);
 
+    slab_init();
+
+    // Areas of address spaces, the kernel window's reservations included, come from the slab
+    mm_init();
+
+    // Lazy FPU switching needs the slab for per-task state
+    fpu_init();
+
+    // Local APIC first, the timer prefers it over the PIT as clockevent
+    lapic_init();
+
+    // Device interrupts move from the PIC to the I/O APIC before any driver unmasks one
+    acpi_init();
+    ioapic_init();
+
     timer_init(100); // 100 Hz timer frequency
 
     LOG_INFO_MSG("Initializing I/O Drivers (KB, Mouse)");
@@ -85,18 +161,39 @@ void kmain(void) {
     LOG_INFO_MSG("Enabling interrupts");
     interrupt_enable();
 
-    ata_init();
-
-    ext2_init();
+    // Log lines are buffered from here on and leave through the serial interrupt
+    log_start_drain();
 
     syscalls_init();
 
     scheduler_init();
 
+    // Application processors join the scheduler with their own run queues
+    smp_init();
+
+    // Everything below comes up concurrently on whichever CPU is free. The storage drivers
+    // register drives as they probe, so they go one after another to keep the drive numbers.
+    int pci = init_add("pci", init_pci, 0, INIT_ASYNC);
+    int ata = init_add("ata", init_ata, INIT_DEP(pci), INIT_ASYNC);
+    int ahci = init_add("ahci", ahci_init, INIT_DEP(ata), INIT_ASYNC);
+    init_add("nvme", init_nvme, INIT_DEP(ahci), INIT_ASYNC);
+    init_add("fs", init_fs, 0, INIT_ASYNC);
+    init_add("trace", trace_init, 0, INIT_ASYNC);
+    int ksyms = init_add("ksyms", ksyms_init, 0, INIT_ASYNC);
+    init_add("profile", profile_init, INIT_DEP(ksyms), INIT_ASYNC);
+
+    init_run();
+    init_print_report();
+
     LOG_INFO_MSG("Kernel initialized");
 
     sysinfo_print();
 
-    // Main kernel loop
-    while (1) {}
+    // Booted to measure, the results go out over serial before anything else runs
+    if (bench_requested()) {
+        bench_run();
+    }
+
+    // The boot context becomes the BSP's idle task
+    scheduler_idle();
 }
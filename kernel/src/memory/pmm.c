@@ -1,21 +1,248 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
 #include <memory/pmm.h>
 #include <utils/log.h>
+#include <utils/trace.h>
 #include <lib/string.h>
 #include <lib/asm.h>
+#include <core/cpu.h>
+#include <core/fpu.h>
+#include <core/exec/scheduler.h>
+#include <memory/vmm.h>
 
 // Static PMM configuration
 static pmm_config_t pmm_config = {0};
 
 // Use a larger static bitmap for managing memory
 #define STATIC_BITMAP_SIZE 8192  // 8KB = 64K pages = 256MB of memory
+#define PMM_MAX_PAGES (STATIC_BITMAP_SIZE * 8)
 static uint8_t static_bitmap[STATIC_BITMAP_SIZE] = {0};
 static uint8_t *page_bitmap = NULL;
 static size_t bitmap_size = 0;
 
+// Buddy free lists, linked through per-page index arrays so that free
+// pages never need to be mapped to be tracked
+#define PMM_NO_PAGE  0xFFFFFFFFU
+#define PMM_NO_ORDER 0xFF
+static uint32_t free_head[PMM_MAX_ORDER];
+static size_t free_count[PMM_MAX_ORDER];
+static uint32_t free_next[PMM_MAX_PAGES];
+static uint32_t free_prev[PMM_MAX_PAGES];
+static uint8_t block_order[PMM_MAX_PAGES];   // Order of a free block head, PMM_NO_ORDER otherwise
+static uint64_t base_pfn = 0;                // Page frame number of page index 0
+static size_t free_pages_count = 0;
+
+// Holders of a used page beyond the one that allocated it, a free only drops one of them
+static uint16_t page_refs[PMM_MAX_PAGES];
+
+// Lock protecting the bitmap and the buddy free lists
+static spinlock_t pmm_lock;
+
+// Pages parked in a per-CPU cache or pre-zeroed pool. They stay marked used in the bitmap,
+// this tells a second free of one apart from the free of a used page.
+static uint8_t cached_bitmap[(PMM_MAX_PAGES + 7) / 8];
+
+// Per-CPU page cache: a stack of page indices, hottest on top. Single-page
+// allocations and frees only touch the local cache with interrupts off and
+// go to the buddy allocator in batches when it runs empty or full.
+#define PMM_PCP_CAPACITY 64
+#define PMM_PCP_BATCH    16
+typedef struct {
+    uint32_t count;
+    uint32_t pages[PMM_PCP_CAPACITY];
+    size_t hits;
+    size_t misses;
+    size_t refills;
+    size_t drains;
+} pmm_pcp_cache_t;
+static pmm_pcp_cache_t pcp_caches[MAX_CPUS];
+
+// Per-CPU pool of pages already cleared by that CPU's idle loop, taken by
+// pmm_alloc_zeroed_page instead of zeroing on the allocating path
+typedef struct {
+    uint32_t count;
+    uint32_t pages[PMM_ZERO_CAPACITY];
+    size_t hits;
+    size_t misses;
+    size_t zeroed;
+} pmm_zero_pool_t;
+static pmm_zero_pool_t zero_pools[MAX_CPUS];
+
 // Statistics tracking
 static size_t total_allocations = 0;
 static size_t failed_allocations = 0;
 
+// Mark a range of pages as used in the bitmap
+static void bitmap_set_range(size_t index, size_t count) {
+    while (count > 0 && (index % 8) != 0) {
+        page_bitmap[index / 8] |= 1 << (index % 8);
+        index++;
+        count--;
+    }
+    if (count >= 8) {
+        memset(&page_bitmap[index / 8], 0xFF, count / 8);
+        index += count & ~7UL;
+        count &= 7;
+    }
+    while (count > 0) {
+        page_bitmap[index / 8] |= 1 << (index % 8);
+        index++;
+        count--;
+    }
+}
+
+// Mark a range of pages as free in the bitmap
+static void bitmap_clear_range(size_t index, size_t count) {
+    while (count > 0 && (index % 8) != 0) {
+        page_bitmap[index / 8] &= ~(1 << (index % 8));
+        index++;
+        count--;
+    }
+    if (count >= 8) {
+        memset(&page_bitmap[index / 8], 0, count / 8);
+        index += count & ~7UL;
+        count &= 7;
+    }
+    while (count > 0) {
+        page_bitmap[index / 8] &= ~(1 << (index % 8));
+        index++;
+        count--;
+    }
+}
+
+// Check whether a page index is marked used
+static inline bool bitmap_test(size_t index) {
+    return page_bitmap[index / 8] & (1 << (index % 8));
+}
+
+// Mark a page as parked in a cache, returns whether it already was
+static inline bool cached_test_and_set(size_t index) {
+    uint8_t bit = 1 << (index % 8);
+    return __atomic_fetch_or(&cached_bitmap[index / 8], bit, __ATOMIC_RELAXED) & bit;
+}
+
+// Take a page out of a cache
+static inline void cached_clear(size_t index) {
+    __atomic_fetch_and(&cached_bitmap[index / 8], (uint8_t)~(1 << (index % 8)), __ATOMIC_RELAXED);
+}
+
+static inline bool cached_test(size_t index) {
+    return __atomic_load_n(&cached_bitmap[index / 8], __ATOMIC_RELAXED) & (1 << (index % 8));
+}
+
+// Push a block onto the free list of its order
+static void free_list_push(uint32_t index, unsigned int order) {
+    free_prev[index] = PMM_NO_PAGE;
+    free_next[index] = free_head[order];
+    if (free_head[order] != PMM_NO_PAGE) {
+        free_prev[free_head[order]] = index;
+    }
+    free_head[order] = index;
+    block_order[index] = order;
+    free_count[order]++;
+}
+
+// Unlink a block from the free list of its order
+static void free_list_remove(uint32_t index, unsigned int order) {
+    if (free_prev[index] != PMM_NO_PAGE) {
+        free_next[free_prev[index]] = free_next[index];
+    } else {
+        free_head[order] = free_next[index];
+    }
+    if (free_next[index] != PMM_NO_PAGE) {
+        free_prev[free_next[index]] = free_prev[index];
+    }
+    block_order[index] = PMM_NO_ORDER;
+    free_count[order]--;
+}
+
+// Return a block to the free lists, merging with its buddy while possible
+static void buddy_free_block(size_t index, unsigned int order) {
+    uint64_t pfn = base_pfn + index;
+
+    while (order < PMM_MAX_ORDER - 1) {
+        uint64_t buddy_pfn = pfn ^ (1ULL << order);
+        if (buddy_pfn < base_pfn || buddy_pfn + (1ULL << order) > base_pfn + pmm_config.max_pages) {
+            break;
+        }
+
+        size_t buddy_index = buddy_pfn - base_pfn;
+        if (block_order[buddy_index] != order) {
+            break;
+        }
+
+        free_list_remove(buddy_index, order);
+        if (buddy_pfn < pfn) {
+            pfn = buddy_pfn;
+        }
+        order++;
+    }
+
+    free_list_push(pfn - base_pfn, order);
+}
+
+// Free an arbitrary run of pages as a sequence of maximal aligned blocks
+static void buddy_free_range(size_t index, size_t count) {
+    while (count > 0) {
+        uint64_t pfn = base_pfn + index;
+        unsigned int order = 0;
+
+        while (order < PMM_MAX_ORDER - 1 &&
+               (pfn & ((1ULL << (order + 1)) - 1)) == 0 &&
+               (1UL << (order + 1)) <= count) {
+            order++;
+        }
+
+        buddy_free_block(index, order);
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+// Take a block of the given order, splitting a larger one if needed
+static size_t buddy_alloc_block(unsigned int order) {
+    unsigned int current = order;
+    while (current < PMM_MAX_ORDER && free_head[current] == PMM_NO_PAGE) {
+        current++;
+    }
+
+    if (current == PMM_MAX_ORDER) {
+        return PMM_NO_PAGE;
+    }
+
+    uint32_t index = free_head[current];
+    free_list_remove(index, current);
+
+    // Hand the upper halves back until the block is the requested size
+    while (current > order) {
+        current--;
+        free_list_push(index + (1U << current), current);
+    }
+
+    return index;
+}
+
+// Smallest order whose block holds count pages
+static unsigned int order_for_count(size_t count) {
+    unsigned int order = 0;
+    while ((1UL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// Validate a page address and convert it to a page index
+static bool page_to_index(uint64_t page, size_t *index) {
+    if (page < pmm_config.kernel_start || 
+        page >= pmm_config.kernel_end ||
+        (page % pmm_config.page_size) != 0) {
+        return false;
+    }
+
+    *index = (page - pmm_config.kernel_start) / pmm_config.page_size;
+    return *index < pmm_config.max_pages;
+}
+
 // Initialize the PMM with memory map data
 void pmm_init(struct limine_memmap_response *memmap) {
     LOG_INFO_MSG("Initializing Physical Memory Manager");
@@ -127,32 +354,65 @@ void pmm_init(struct limine_memmap_response *memmap) {
             region_end = pmm_config.kernel_end;
         }
         
-        // Mark the overlapping part as used
-        for (uint64_t addr = region_start; addr < region_end; addr += pmm_config.page_size) {
-            // Calculate offset from base
-            uint64_t offset = addr - pmm_config.kernel_start;
-            size_t page_index = offset / pmm_config.page_size;
-            
-            // Ensure we're within bounds of our bitmap
-            if (page_index < pmm_config.max_pages) {
-                // Mark as used in bitmap
-                size_t byte_index = page_index / 8;
-                uint8_t bit_mask = 1 << (page_index % 8);
-                page_bitmap[byte_index] |= bit_mask;
-            }
+        // Mark the overlapping part as used, whole bytes at a time
+        size_t first = (region_start - pmm_config.kernel_start) / pmm_config.page_size;
+        size_t last = (region_end - pmm_config.kernel_start + pmm_config.page_size - 1) / pmm_config.page_size;
+        if (last > pmm_config.max_pages) last = pmm_config.max_pages;
+        if (first < last) {
+            bitmap_set_range(first, last - first);
         }
     }
     
     // Also mark the first few pages as used to avoid conflicts with low memory
-    for (size_t i = 0; i < 256 && i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        page_bitmap[byte_index] |= bit_mask;
-    }
+    bitmap_set_range(0, pmm_config.max_pages < 256 ? pmm_config.max_pages : 256);
     
     // Store total memory size
     pmm_config.total_memory = total_memory;
     
+    // Build the buddy free lists from every run of free pages in the bitmap
+    base_pfn = pmm_config.kernel_start / pmm_config.page_size;
+    for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+        free_head[order] = PMM_NO_PAGE;
+        free_count[order] = 0;
+    }
+    memset(block_order, PMM_NO_ORDER, sizeof(block_order));
+    memset(pcp_caches, 0, sizeof(pcp_caches));
+    memset(zero_pools, 0, sizeof(zero_pools));
+    free_pages_count = 0;
+    spinlock_init(&pmm_lock);
+    
+    size_t run_start = 0;
+    size_t run_length = 0;
+    for (size_t i = 0; i <= pmm_config.max_pages; i++) {
+        // Bytes with every page free or every page used extend or end a run in one step
+        if (i % 8 == 0 && i + 8 <= pmm_config.max_pages && page_bitmap[i / 8] == 0) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length += 8;
+            i += 7;
+            continue;
+        }
+        if (i % 8 == 0 && i + 8 <= pmm_config.max_pages && page_bitmap[i / 8] == 0xFF && run_length == 0) {
+            i += 7;
+            continue;
+        }
+        
+        if (i < pmm_config.max_pages && !bitmap_test(i)) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length++;
+            continue;
+        }
+        
+        if (run_length > 0) {
+            buddy_free_range(run_start, run_length);
+            free_pages_count += run_length;
+            run_length = 0;
+        }
+    }
+    
     LOG_INFO("PMM managing memory from 0x%X to 0x%X (%d MB)", 
            pmm_config.kernel_start, pmm_config.kernel_end, 
            (unsigned int)((pmm_config.kernel_end - pmm_config.kernel_start) / (1024 * 1024)));
@@ -160,6 +420,143 @@ void pmm_init(struct limine_memmap_response *memmap) {
     LOG_INFO_MSG("Physical Memory Manager initialized");
 }
 
+// Take count pages from the buddy allocator, pmm_lock must be held
+static size_t buddy_alloc_pages_locked(size_t count) {
+    unsigned int order = order_for_count(count);
+    if (order >= PMM_MAX_ORDER) {
+        return PMM_NO_PAGE;
+    }
+    
+    size_t index = buddy_alloc_block(order);
+    if (index == PMM_NO_PAGE) {
+        return PMM_NO_PAGE;
+    }
+    
+    // Give back the tail of the block that the caller did not ask for
+    size_t block_pages = 1UL << order;
+    if (block_pages > count) {
+        buddy_free_range(index + count, block_pages - count);
+    }
+    
+    bitmap_set_range(index, count);
+    free_pages_count -= count;
+    return index;
+}
+
+// Drop one extra holder of a shared page, returns false if the caller held the last reference
+static bool drop_shared_ref(size_t index) {
+    uint16_t refs = __atomic_load_n(&page_refs[index], __ATOMIC_ACQUIRE);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&page_refs[index], &refs, refs - 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Return used pages to the buddy allocator, pmm_lock must be held
+static void buddy_free_pages_locked(size_t page_index, size_t count) {
+    // Free runs of used pages, skipping any that are already free or still shared
+    size_t run_start = page_index;
+    size_t run_length = 0;
+    for (size_t i = page_index; i <= page_index + count; i++) {
+        if (i < page_index + count) {
+            if (!bitmap_test(i) || cached_test(i)) {
+                LOG_WARN("PMM: Attempted to free already free page at 0x%X", 
+                       pmm_config.kernel_start + (i * pmm_config.page_size));
+            } else if (!drop_shared_ref(i)) {
+                if (run_length == 0) {
+                    run_start = i;
+                }
+                run_length++;
+                continue;
+            }
+            // A free page or one another holder keeps ends the run
+        }
+        
+        if (run_length > 0) {
+            bitmap_clear_range(run_start, run_length);
+            buddy_free_range(run_start, run_length);
+            free_pages_count += run_length;
+            run_length = 0;
+        }
+    }
+}
+
+// Move up to PMM_PCP_BATCH pages from the buddy allocator into a cache, like every
+// pmm_lock section it runs with interrupts off
+static void pcp_refill(pmm_pcp_cache_t *pcp) {
+    spinlock_acquire(&pmm_lock);
+    while (pcp->count < PMM_PCP_BATCH) {
+        size_t index = buddy_alloc_pages_locked(1);
+        if (index == PMM_NO_PAGE) {
+            break;
+        }
+        cached_test_and_set(index);
+        pcp->pages[pcp->count++] = index;
+    }
+    spinlock_release(&pmm_lock);
+    
+    if (pcp->count > 0) {
+        pcp->refills++;
+    }
+}
+
+// Return the coldest count pages of a cache to the buddy allocator
+static void pcp_drain(pmm_pcp_cache_t *pcp, uint32_t count) {
+    if (count > pcp->count) {
+        count = pcp->count;
+    }
+    if (count == 0) {
+        return;
+    }
+    
+    spinlock_acquire(&pmm_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        cached_clear(pcp->pages[i]);
+        buddy_free_pages_locked(pcp->pages[i], 1);
+    }
+    spinlock_release(&pmm_lock);
+    
+    pcp->count -= count;
+    memmove(pcp->pages, &pcp->pages[count], pcp->count * sizeof(pcp->pages[0]));
+    pcp->drains++;
+}
+
+// Number of pages sitting in per-CPU caches
+static size_t pcp_cached_pages(void) {
+    size_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += pcp_caches[cpu].count;
+    }
+    return total;
+}
+
+// Number of pages sitting in pre-zeroed pools
+static size_t zero_pooled_pages(void) {
+    size_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += zero_pools[cpu].count;
+    }
+    return total;
+}
+
+// Return every page of a pre-zeroed pool to the buddy allocator
+static void zero_pool_drain(pmm_zero_pool_t *pool) {
+    if (pool->count == 0) {
+        return;
+    }
+
+    spinlock_acquire(&pmm_lock);
+    for (uint32_t i = 0; i < pool->count; i++) {
+        cached_clear(pool->pages[i]);
+        buddy_free_pages_locked(pool->pages[i], 1);
+    }
+    spinlock_release(&pmm_lock);
+    pool->count = 0;
+}
+
 // Allocate a single physical page
 void *pmm_alloc_page(void) {
     if (!page_bitmap) {
@@ -167,27 +564,37 @@ void *pmm_alloc_page(void) {
         return NULL;
     }
     
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        // Check if page is free
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            // Mark as used
-            page_bitmap[byte_index] |= bit_mask;
-            
-            // Calculate physical address
-            uint64_t phys_addr = pmm_config.kernel_start + (i * pmm_config.page_size);
-            
-            total_allocations++;
-            LOG_DEBUG("PMM: Allocated page at 0x%X", phys_addr);
-            return (void *)phys_addr;
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_cache_t *pcp = &pcp_caches[cpu_current_id()];
+    
+    if (pcp->count > 0) {
+        pcp->hits++;
+    } else {
+        pcp->misses++;
+        pcp_refill(pcp);
+        if (pcp->count == 0) {
+            // Pre-zeroed pages are still free memory, take one before failing
+            pmm_zero_pool_t *pool = &zero_pools[cpu_current_id()];
+            if (pool->count > 0) {
+                uint32_t index = pool->pages[--pool->count];
+                cached_clear(index);
+                cpu_irq_restore(flags);
+                return (void *)(pmm_config.kernel_start + ((uint64_t)index * pmm_config.page_size));
+            }
+            cpu_irq_restore(flags);
+            failed_allocations++;
+            LOG_WARN_RATELIMITED("PMM: Failed to allocate page - no free pages");
+            return NULL;
         }
     }
     
-    failed_allocations++;
-    LOG_WARN_MSG("PMM: Failed to allocate page - no free pages");
-    return NULL; // No free pages
+    uint32_t index = pcp->pages[--pcp->count];
+    cached_clear(index);
+    cpu_irq_restore(flags);
+    
+    uint64_t phys_addr = pmm_config.kernel_start + ((uint64_t)index * pmm_config.page_size);
+    TRACE(TRACE_PMM_ALLOC, phys_addr, 1);
+    return (void *)phys_addr;
 }
 
 // Allocate multiple consecutive physical pages
@@ -196,156 +603,263 @@ void *pmm_alloc_pages(size_t count) {
         return NULL;
     }
     
-    // For small allocations, use the simple approach
     if (count == 1) {
         return pmm_alloc_page();
     }
     
-    // For larger allocations, find a continuous run of free pages
-    size_t found_pages = 0;
-    size_t start_page = 0;
+    if (order_for_count(count) >= PMM_MAX_ORDER) {
+        failed_allocations++;
+        LOG_WARN("PMM: Allocation of %d pages exceeds the largest buddy block", count);
+        return NULL;
+    }
     
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
+    // Interrupts stay off while pmm_lock is held, an interrupt freeing memory on this CPU
+    // would spin on it forever
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&pmm_lock);
+    size_t index = buddy_alloc_pages_locked(count);
+    spinlock_release(&pmm_lock);
+    
+    if (index == PMM_NO_PAGE) {
+        // Cached single pages may be what keeps a buddy from merging
+        pcp_drain(&pcp_caches[cpu_current_id()], PMM_PCP_CAPACITY);
+        zero_pool_drain(&zero_pools[cpu_current_id()]);
         
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            // This page is free
-            if (found_pages == 0) {
-                // Start of a new run
-                start_page = i;
-            }
-            
-            found_pages++;
-            
-            if (found_pages == count) {
-                // Found enough consecutive pages, mark them all as used
-                for (size_t j = 0; j < count; j++) {
-                    size_t page_idx = start_page + j;
-                    size_t byte_idx = page_idx / 8;
-                    uint8_t mask = 1 << (page_idx % 8);
-                    page_bitmap[byte_idx] |= mask;
-                }
-                
-                // Calculate physical address
-                uint64_t phys_addr = pmm_config.kernel_start + (start_page * pmm_config.page_size);
-                
-                total_allocations++;
-                LOG_DEBUG("PMM: Allocated %d contiguous pages at 0x%X", count, phys_addr);
-                return (void *)phys_addr;
-            }
+        spinlock_acquire(&pmm_lock);
+        index = buddy_alloc_pages_locked(count);
+        spinlock_release(&pmm_lock);
+    }
+    cpu_irq_restore(flags);
+    
+    if (index == PMM_NO_PAGE) {
+        failed_allocations++;
+        LOG_WARN_RATELIMITED("PMM: Failed to allocate %d contiguous pages", count);
+        return NULL;
+    }
+    
+    uint64_t phys_addr = pmm_config.kernel_start + (index * pmm_config.page_size);
+    
+    total_allocations++;
+    TRACE(TRACE_PMM_ALLOC, phys_addr, count);
+    LOG_DEBUG("PMM: Allocated %d pages at 0x%X", count, phys_addr);
+    return (void *)phys_addr;
+}
+
+// Allocate a single physical page filled with zeroes, from the local pre-zeroed pool when it
+// has one
+void *pmm_alloc_zeroed_page(void) {
+    if (!page_bitmap) {
+        LOG_ERROR_MSG("PMM not initialized");
+        return NULL;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    pmm_zero_pool_t *pool = &zero_pools[cpu_current_id()];
+    if (pool->count > 0) {
+        uint32_t index = pool->pages[--pool->count];
+        cached_clear(index);
+        pool->hits++;
+        cpu_irq_restore(flags);
+
+        uint64_t phys_addr = pmm_config.kernel_start + ((uint64_t)index * pmm_config.page_size);
+        TRACE(TRACE_PMM_ALLOC, phys_addr, 1);
+        return (void *)phys_addr;
+    }
+    pool->misses++;
+    cpu_irq_restore(flags);
+
+    // The pool ran dry, clear the page on the caller's time
+    void *page = pmm_alloc_page();
+    if (page) {
+        fpu_clear_page(vmm_phys_to_virt((uint64_t)page));
+    }
+    return page;
+}
+
+// Zero up to max pages into the executing CPU's pool, returns the pages added. Called by the
+// idle loop with interrupts on, each page is cleared with streaming stores before it goes in
+// so a waiting task is held up by at most one page.
+size_t pmm_zero_refill(size_t max) {
+    if (!page_bitmap) {
+        return 0;
+    }
+
+    size_t added = 0;
+    while (added < max) {
+        // Keep the pool from competing for the last free pages
+        uint32_t cpu = cpu_current_id();
+        if (zero_pools[cpu].count >= PMM_ZERO_CAPACITY || free_pages_count < PMM_ZERO_RESERVE) {
+            break;
+        }
+
+        uint64_t flags = cpu_irq_save();
+        spinlock_acquire(&pmm_lock);
+        size_t index = buddy_alloc_pages_locked(1);
+        spinlock_release(&pmm_lock);
+        cpu_irq_restore(flags);
+        if (index == PMM_NO_PAGE) {
+            break;
+        }
+
+        // Moved out of the buddy allocator first, the page belongs to nobody while it is cleared
+        fpu_clear_page(vmm_phys_to_virt(pmm_config.kernel_start + (index * pmm_config.page_size)));
+
+        flags = cpu_irq_save();
+        pmm_zero_pool_t *pool = &zero_pools[cpu_current_id()];
+        bool kept = pool->count < PMM_ZERO_CAPACITY;
+        if (kept) {
+            cached_test_and_set(index);
+            pool->pages[pool->count++] = index;
+            pool->zeroed++;
         } else {
-            // This page is used, reset counter
-            found_pages = 0;
+            spinlock_acquire(&pmm_lock);
+            buddy_free_pages_locked(index, 1);
+            spinlock_release(&pmm_lock);
         }
+        cpu_irq_restore(flags);
+
+        if (!kept) {
+            break;
+        }
+        added++;
     }
-    
-    failed_allocations++;
-    LOG_WARN("PMM: Failed to allocate %d contiguous pages", count);
-    return NULL; // Couldn't find enough consecutive pages
+    return added;
 }
 
 // Free a physical page
 void pmm_free_page(void *page_addr) {
     uint64_t page = (uint64_t)page_addr;
+    size_t page_index;
     
     if (!page_bitmap) {
         return;
     }
     
     // Check if this page is in our managed range
-    if (page < pmm_config.kernel_start || 
-        page >= pmm_config.kernel_end ||
-        (page % pmm_config.page_size) != 0) {
+    if (!page_to_index(page, &page_index)) {
         LOG_WARN("PMM: Attempted to free invalid page address: 0x%X", page);
         return;
     }
     
-    // Calculate the page index
-    size_t page_index = (page - pmm_config.kernel_start) / pmm_config.page_size;
-    
-    if (page_index >= pmm_config.max_pages) {
-        LOG_WARN("PMM: Page index out of range: %d", page_index);
+    if (!bitmap_test(page_index) || cached_test(page_index)) {
+        LOG_WARN("PMM: Attempted to free already free page at 0x%X", page);
         return;
     }
     
-    size_t byte_index = page_index / 8;
-    uint8_t bit_mask = 1 << (page_index % 8);
+    // A shared page stays with its other holders
+    if (drop_shared_ref(page_index)) {
+        return;
+    }
     
-    // Check if the page is already marked as free
-    if (!(page_bitmap[byte_index] & bit_mask)) {
+    // Two racing frees of the same page both got past the check above
+    if (cached_test_and_set(page_index)) {
         LOG_WARN("PMM: Attempted to free already free page at 0x%X", page);
         return;
     }
     
-    // Mark as free
-    page_bitmap[byte_index] &= ~bit_mask;
-    LOG_DEBUG("PMM: Freed page at 0x%X", page);
+    uint64_t flags = cpu_irq_save();
+    pmm_pcp_cache_t *pcp = &pcp_caches[cpu_current_id()];
+    
+    if (pcp->count == PMM_PCP_CAPACITY) {
+        pcp_drain(pcp, PMM_PCP_BATCH);
+    }
+    pcp->pages[pcp->count++] = page_index;
+    
+    cpu_irq_restore(flags);
 }
 
 // Free multiple consecutive physical pages
 void pmm_free_pages(void *page_addr, size_t count) {
     uint64_t page = (uint64_t)page_addr;
+    size_t page_index;
     
     if (!page_bitmap || count == 0) {
         return;
     }
     
-    // For single page, use the simple approach
     if (count == 1) {
         pmm_free_page(page_addr);
         return;
     }
     
     // Check if this page range is in our managed range
-    if (page < pmm_config.kernel_start || 
-        page >= pmm_config.kernel_end ||
-        (page % pmm_config.page_size) != 0) {
-        LOG_WARN("PMM: Attempted to free invalid page range starting at: 0x%X", page);
+    if (!page_to_index(page, &page_index)) {
+        LOG_WARN("PMM: Attempted to free invalid page address: 0x%X", page);
         return;
     }
     
-    uint64_t end_page = page + (count * pmm_config.page_size);
-    if (end_page > pmm_config.kernel_end) {
-        LOG_WARN("PMM: Page range extends beyond managed memory: 0x%X-0x%X", page, end_page);
-        count = (pmm_config.kernel_end - page) / pmm_config.page_size;
+    if (page_index + count > pmm_config.max_pages) {
+        LOG_WARN("PMM: Page range extends beyond managed memory: 0x%X-0x%X", 
+               page, page + (count * pmm_config.page_size));
+        count = pmm_config.max_pages - page_index;
         LOG_WARN("PMM: Adjusting to free only %d pages", count);
     }
     
-    // Free all pages in the range
-    for (size_t i = 0; i < count; i++) {
-        pmm_free_page((void *)(page + (i * pmm_config.page_size)));
-    }
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&pmm_lock);
+    buddy_free_pages_locked(page_index, count);
+    spinlock_release(&pmm_lock);
+    cpu_irq_restore(flags);
     
     LOG_DEBUG("PMM: Freed %d pages starting at 0x%X", count, page);
 }
 
-// Check if a page is free
+// Check if a page is free (pages held in a per-CPU cache count as used)
 bool pmm_is_page_free(void *page_addr) {
-    uint64_t page = (uint64_t)page_addr;
+    size_t page_index;
     
     if (!page_bitmap) {
         return false;
     }
     
     // Check if this page is in our managed range
-    if (page < pmm_config.kernel_start || 
-        page >= pmm_config.kernel_end ||
-        (page % pmm_config.page_size) != 0) {
+    if (!page_to_index((uint64_t)page_addr, &page_index)) {
         return false;
     }
     
-    // Calculate the page index
-    size_t page_index = (page - pmm_config.kernel_start) / pmm_config.page_size;
+    return !bitmap_test(page_index);
+}
+
+// Add a holder to a used page, pages outside the managed range are not counted
+bool pmm_page_ref(void *page_addr) {
+    size_t page_index;
+    if (!page_bitmap || !page_to_index((uint64_t)page_addr, &page_index) || !bitmap_test(page_index) ||
+        cached_test(page_index)) {
+        return false;
+    }
     
-    if (page_index >= pmm_config.max_pages) {
+    if (__atomic_add_fetch(&page_refs[page_index], 1, __ATOMIC_ACQ_REL) == 0) {
+        // Wrapped around, the page can no longer be shared safely
+        __atomic_sub_fetch(&page_refs[page_index], 1, __ATOMIC_ACQ_REL);
+        LOG_WARN("PMM: Reference count overflow on page 0x%X", (uint64_t)page_addr);
+        return false;
+    }
+    return true;
+}
+
+// Drop a holder of a page, the page is freed with its last holder
+bool pmm_page_unref(void *page_addr) {
+    size_t page_index;
+    if (!page_bitmap || !page_to_index((uint64_t)page_addr, &page_index)) {
         return false;
     }
     
-    size_t byte_index = page_index / 8;
-    uint8_t bit_mask = 1 << (page_index % 8);
+    if (drop_shared_ref(page_index)) {
+        return false;
+    }
+    pmm_free_page(page_addr);
+    return true;
+}
+
+// Get the number of holders of a page, 0 if it is free or not managed
+uint32_t pmm_page_refcount(void *page_addr) {
+    size_t page_index;
+    if (!page_bitmap || !page_to_index((uint64_t)page_addr, &page_index) || !bitmap_test(page_index) ||
+        cached_test(page_index)) {
+        return 0;
+    }
     
-    return !(page_bitmap[byte_index] & bit_mask);
+    return (uint32_t)__atomic_load_n(&page_refs[page_index], __ATOMIC_ACQUIRE) + 1;
 }
 
 // Get total free memory
@@ -354,17 +868,7 @@ uint64_t pmm_get_free_memory(void) {
         return 0;
     }
     
-    size_t free_pages = 0;
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            free_pages++;
-        }
-    }
-    
-    return free_pages * pmm_config.page_size;
+    return (free_pages_count + pcp_cached_pages() + zero_pooled_pages()) * pmm_config.page_size;
 }
 
 // Get total used memory
@@ -373,17 +877,17 @@ uint64_t pmm_get_used_memory(void) {
         return 0;
     }
     
-    size_t used_pages = 0;
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (page_bitmap[byte_index] & bit_mask) {
-            used_pages++;
-        }
+    return (pmm_config.max_pages - free_pages_count - pcp_cached_pages() - zero_pooled_pages()) *
+           pmm_config.page_size;
+}
+
+// Get the number of free blocks of a given buddy order
+size_t pmm_get_free_blocks(unsigned int order) {
+    if (!page_bitmap || order >= PMM_MAX_ORDER) {
+        return 0;
     }
     
-    return used_pages * pmm_config.page_size;
+    return free_count[order];
 }
 
 // Get PMM configuration
@@ -400,25 +904,39 @@ void pmm_print_stats(void) {
         return;
     }
     
-    size_t free_pages = 0;
-    size_t used_pages = 0;
+    size_t cached_pages = pcp_cached_pages();
+    size_t zeroed_pages = zero_pooled_pages();
+    size_t free_pages = free_pages_count + cached_pages + zeroed_pages;
+    size_t used_pages = pmm_config.max_pages - free_pages;
+    
+    size_t hits = 0, misses = 0, refills = 0, drains = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        hits += pcp_caches[cpu].hits;
+        misses += pcp_caches[cpu].misses;
+        refills += pcp_caches[cpu].refills;
+        drains += pcp_caches[cpu].drains;
+    }
     
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (page_bitmap[byte_index] & bit_mask) {
-            used_pages++;
-        } else {
-            free_pages++;
-        }
+    size_t zero_hits = 0, zero_misses = 0, zeroed = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        zero_hits += zero_pools[cpu].hits;
+        zero_misses += zero_pools[cpu].misses;
+        zeroed += zero_pools[cpu].zeroed;
     }
     
     LOG_INFO("PMM Statistics:");
     LOG_INFO("  Total pages: %d", pmm_config.max_pages);
     LOG_INFO("  Used pages: %d (%d MB)", used_pages, (used_pages * pmm_config.page_size) / (1024 * 1024));
     LOG_INFO("  Free pages: %d (%d MB)", free_pages, (free_pages * pmm_config.page_size) / (1024 * 1024));
-    LOG_INFO("  Total allocations: %d", total_allocations);
+    LOG_INFO("  Total allocations: %d", total_allocations + hits + misses);
     LOG_INFO("  Failed allocations: %d", failed_allocations);
     LOG_INFO("  Memory range: 0x%X - 0x%X", pmm_config.kernel_start, pmm_config.kernel_end);
-}
\ No newline at end of file
+    LOG_INFO("  Per-CPU cache: %d pages cached, %d hits, %d misses, %d refills, %d drains",
+           cached_pages, hits, misses, refills, drains);
+    LOG_INFO("  Zeroed pool: %d pages ready, %d hits, %d misses, %d cleared while idle",
+           zeroed_pages, zero_hits, zero_misses, zeroed);
+    LOG_INFO("  Free blocks per order:");
+    for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+        LOG_INFO("    Order %d (%d KB): %d", order, (1 << order) * (pmm_config.page_size / 1024), free_count[order]);
+    }
+}
@@ -18,6 +18,18 @@ typedef struct {
 // Define block size for the bitmap (4KiB)
 #define PMM_BLOCK_SIZE 4096
 
+// Buddy allocator orders: order n is a block of 2^n pages (order 10 = 4MiB)
+#define PMM_MAX_ORDER 11
+
+// Pre-zeroed pages each CPU's idle loop keeps ready
+#define PMM_ZERO_CAPACITY 32
+
+// Pages the idle loop zeroes between checks for runnable tasks
+#define PMM_ZERO_BATCH 4
+
+// Free pages below which the idle loop stops zeroing ahead
+#define PMM_ZERO_RESERVE 1024
+
 // Function to initialize the physical memory manager
 void pmm_init(struct limine_memmap_response *memmap);
 
@@ -27,6 +39,12 @@ void *pmm_alloc_page(void);
 // Allocate multiple contiguous physical memory pages
 void *pmm_alloc_pages(size_t count);
 
+// Allocate a single physical memory page filled with zeroes
+void *pmm_alloc_zeroed_page(void);
+
+// Zero up to max free pages ahead into the current CPU's pool, returns the pages added
+size_t pmm_zero_refill(size_t max);
+
 // Free a previously allocated physical memory page
 void pmm_free_page(void *page_addr);
 
@@ -36,6 +54,15 @@ void pmm_free_pages(void *page_addr, size_t count);
 // Check if a page is free
 bool pmm_is_page_free(void *page_addr);
 
+// Add a holder to a used page, every holder frees it once and the last free releases it
+bool pmm_page_ref(void *page_addr);
+
+// Drop a holder of a page, returns true if that released the page
+bool pmm_page_unref(void *page_addr);
+
+// Get the number of holders of a page, 0 if it is free or not managed by the PMM
+uint32_t pmm_page_refcount(void *page_addr);
+
 // Get amount of free physical memory in bytes
 uint64_t pmm_get_free_memory(void);
 
@@ -45,6 +72,9 @@ uint64_t pmm_get_used_memory(void);
 // Get PMM configuration
 void pmm_get_info(pmm_config_t *config);
 
+// Get the number of free blocks of a given buddy order
+size_t pmm_get_free_blocks(unsigned int order);
+
 // Print memory statistics
 void pmm_print_stats(void);
 
@@ -0,0 +1,414 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
+#include <memory/slab.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+// Header magic values, stored at the start of every page owned by the allocator
+#define SLAB_MAGIC  0x51AB51ABU
+#define LARGE_MAGIC 0x1A46E000U
+
+// Number of empty slabs a cache keeps before returning pages to the PMM
+#define SLAB_MAX_EMPTY 1
+
+// Slab header, lives at the start of the slab page
+typedef struct slab {
+    uint32_t magic;
+    uint32_t in_use;                   // Objects handed out from this slab
+    kmem_cache_t *cache;               // Owning cache
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;                   // Singly linked list through free objects
+} slab_t;
+
+// Header for kmalloc allocations larger than the biggest size class
+typedef struct {
+    uint32_t magic;
+    uint32_t pages;
+} large_header_t;
+
+struct kmem_cache {
+    char name[32];
+    size_t object_size;
+    size_t align;
+    size_t first_offset;               // Offset of the first object in a slab
+    size_t objects_per_slab;
+    slab_t *partial;                   // Slabs with free and used objects
+    slab_t *full;                      // Slabs with no free objects
+    slab_t *empty;                     // Slabs with no used objects
+    size_t empty_count;
+    size_t total_slabs;
+    size_t active_objects;
+    size_t allocations;
+    size_t frees;
+    spinlock_t lock;
+    bool in_use;
+};
+
+// Static pool of cache descriptors
+static kmem_cache_t cache_pool[KMEM_MAX_CACHES];
+static spinlock_t cache_pool_lock;
+
+// kmalloc size classes
+static const size_t kmalloc_sizes[] = { 16, 32, 64, 96, 128, 192, 256, 512, 1024 };
+#define KMALLOC_CLASSES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASSES];
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+    "kmalloc-192", "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static bool slab_initialized = false;
+
+// Round value up to a power of two alignment
+static inline size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Unlink a slab from one of the cache lists
+static void slab_list_remove(slab_t **head, slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Push a slab onto one of the cache lists
+static void slab_list_push(slab_t **head, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+// Allocate and carve up a new slab page
+static slab_t *slab_create(kmem_cache_t *cache) {
+    void *page_phys = pmm_alloc_page();
+    if (!page_phys) {
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t*)vmm_phys_to_virt((uint64_t)page_phys);
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free_list = NULL;
+
+    // Thread the free list so that objects are handed out in address order
+    uint8_t *base = (uint8_t*)slab + cache->first_offset;
+    for (size_t i = cache->objects_per_slab; i > 0; i--) {
+        void **obj = (void**)(base + (i - 1) * cache->object_size);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->total_slabs++;
+    return slab;
+}
+
+// Give a slab page back to the PMM
+static void slab_release(kmem_cache_t *cache, slab_t *slab) {
+    slab->magic = 0;
+    cache->total_slabs--;
+    pmm_free_page((void*)vmm_virt_to_phys(slab));
+}
+
+// Initialize the slab allocator
+void slab_init(void) {
+    LOG_INFO_MSG("Initializing slab allocator");
+
+    memset(cache_pool, 0, sizeof(cache_pool));
+    spinlock_init(&cache_pool_lock);
+
+    for (size_t i = 0; i < KMALLOC_CLASSES; i++) {
+        // Align each class to its largest power-of-two divisor, capped at a cache line
+        size_t align = kmalloc_sizes[i] & -kmalloc_sizes[i];
+        if (align > KMEM_CACHE_ALIGN) {
+            align = KMEM_CACHE_ALIGN;
+        }
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], kmalloc_sizes[i], align);
+        if (!kmalloc_caches[i]) {
+            LOG_ERROR("Failed to create %s cache", kmalloc_names[i]);
+        }
+    }
+
+    slab_initialized = true;
+    LOG_INFO_MSG("Slab allocator initialized");
+}
+
+// Create a cache for objects of a fixed size
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (align == 0) {
+        align = sizeof(void*);
+    }
+
+    if (align & (align - 1)) {
+        LOG_ERROR("kmem_cache_create: alignment %d is not a power of two", align);
+        return NULL;
+    }
+
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    size_t object_size = align_up(size, align);
+    size_t first_offset = align_up(sizeof(slab_t), align);
+    if (first_offset + object_size > PAGE_SIZE_4K) {
+        LOG_ERROR("kmem_cache_create: object size %d too large for a slab", size);
+        return NULL;
+    }
+
+    spinlock_acquire(&cache_pool_lock);
+
+    kmem_cache_t *cache = NULL;
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!cache_pool[i].in_use) {
+            cache = &cache_pool[i];
+            break;
+        }
+    }
+
+    if (!cache) {
+        spinlock_release(&cache_pool_lock);
+        LOG_ERROR("kmem_cache_create: no free cache descriptors for %s", name);
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name ? name : "unnamed", sizeof(cache->name) - 1);
+    cache->object_size = object_size;
+    cache->align = align;
+    cache->first_offset = first_offset;
+    cache->objects_per_slab = (PAGE_SIZE_4K - first_offset) / object_size;
+    spinlock_init(&cache->lock);
+    cache->in_use = true;
+
+    spinlock_release(&cache_pool_lock);
+
+    LOG_DEBUG("Created cache %s: object size %d, %d objects per slab",
+              cache->name, cache->object_size, cache->objects_per_slab);
+    return cache;
+}
+
+// Destroy a cache
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (!cache || !cache->in_use) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&cache->lock);
+
+    if (cache->partial || cache->full) {
+        LOG_WARN("Destroying cache %s with %d objects still allocated",
+                 cache->name, cache->active_objects);
+    }
+
+    slab_t *lists[3] = { cache->partial, cache->full, cache->empty };
+    for (int i = 0; i < 3; i++) {
+        slab_t *slab = lists[i];
+        while (slab) {
+            slab_t *next = slab->next;
+            slab_release(cache, slab);
+            slab = next;
+        }
+    }
+
+    cache->in_use = false;
+    spinlock_release(&cache->lock);
+    cpu_irq_restore(flags);
+}
+
+// Allocate an object from a cache
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache || !cache->in_use) {
+        return NULL;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&cache->lock);
+
+    slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                spinlock_release(&cache->lock);
+                cpu_irq_restore(flags);
+                LOG_ERROR_RATELIMITED("Cache %s: out of memory", cache->name);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void **obj = (void**)slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->allocations++;
+
+    spinlock_release(&cache->lock);
+    cpu_irq_restore(flags);
+    return obj;
+}
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!cache || !obj) {
+        return;
+    }
+
+    slab_t *slab = (slab_t*)((uint64_t)obj & PAGE_ADDR_MASK);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        LOG_ERROR("kmem_cache_free: 0x%p does not belong to cache %s", obj, cache->name);
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&cache->lock);
+
+    bool was_full = slab->in_use == cache->objects_per_slab;
+
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->active_objects--;
+    cache->frees++;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_count < SLAB_MAX_EMPTY) {
+            slab_list_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+
+    spinlock_release(&cache->lock);
+    cpu_irq_restore(flags);
+}
+
+// Get statistics for a cache
+bool kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats) {
+    if (!cache || !cache->in_use || !stats) {
+        return false;
+    }
+
+    stats->name = cache->name;
+    stats->object_size = cache->object_size;
+    stats->objects_per_slab = cache->objects_per_slab;
+    stats->active_objects = cache->active_objects;
+    stats->total_slabs = cache->total_slabs;
+    stats->allocations = cache->allocations;
+    stats->frees = cache->frees;
+    return true;
+}
+
+// General purpose allocation
+void *kmalloc(size_t size) {
+    if (size == 0 || !slab_initialized) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < KMALLOC_CLASSES; i++) {
+        if (size <= kmalloc_sizes[i]) {
+            return kmem_cache_alloc(kmalloc_caches[i]);
+        }
+    }
+
+    // Too large for a size class, hand out whole pages with a small header
+    size_t pages = (size + KMEM_CACHE_ALIGN + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+    void *phys = pmm_alloc_pages(pages);
+    if (!phys) {
+        LOG_ERROR("kmalloc: failed to allocate %d bytes", size);
+        return NULL;
+    }
+
+    large_header_t *header = (large_header_t*)vmm_phys_to_virt((uint64_t)phys);
+    header->magic = LARGE_MAGIC;
+    header->pages = pages;
+    return (uint8_t*)header + KMEM_CACHE_ALIGN;
+}
+
+// Zeroed general purpose allocation
+void *kzalloc(size_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Free memory from kmalloc
+void kfree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    uint64_t page = (uint64_t)ptr & PAGE_ADDR_MASK;
+    slab_t *slab = (slab_t*)page;
+
+    if (slab->magic == SLAB_MAGIC) {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    large_header_t *header = (large_header_t*)page;
+    if (header->magic == LARGE_MAGIC && (uint64_t)ptr == page + KMEM_CACHE_ALIGN) {
+        header->magic = 0;
+        pmm_free_pages((void*)vmm_virt_to_phys(header), header->pages);
+        return;
+    }
+
+    LOG_ERROR("kfree: invalid pointer 0x%p", ptr);
+}
+
+// Print statistics for all caches
+void slab_print_stats(void) {
+    LOG_INFO("Slab Statistics:");
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        kmem_cache_t *cache = &cache_pool[i];
+        if (!cache->in_use) {
+            continue;
+        }
+
+        LOG_INFO("  %s: size %d, %d active, %d slabs, %d allocs, %d frees",
+                 cache->name, cache->object_size, cache->active_objects,
+                 cache->total_slabs, cache->allocations, cache->frees);
+    }
+}
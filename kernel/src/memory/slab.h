@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Maximum number of object caches (including the kmalloc size classes)
+#define KMEM_MAX_CACHES   32
+
+// Smallest kmalloc size class
+#define KMALLOC_MIN_SIZE  16
+
+// Default object alignment (one cache line)
+#define KMEM_CACHE_ALIGN  64
+
+// Object cache structure
+typedef struct kmem_cache kmem_cache_t;
+
+// Per-cache statistics
+typedef struct {
+    const char *name;
+    size_t object_size;        // Size of each object including alignment padding
+    size_t objects_per_slab;   // Objects that fit in one slab page
+    size_t active_objects;     // Objects currently allocated
+    size_t total_slabs;        // Slab pages owned by the cache
+    size_t allocations;        // Total successful allocations
+    size_t frees;              // Total frees
+} kmem_cache_stats_t;
+
+// Initialize the slab allocator and the kmalloc size classes
+void slab_init(void);
+
+// Create a cache for objects of a fixed size (align 0 = natural alignment)
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+
+// Destroy a cache, all objects must have been freed
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+// Allocate an object from a cache
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// Get statistics for a cache
+bool kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
+
+// General purpose allocation
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+// Print statistics for all caches
+void slab_print_stats(void);
+
+#endif // SLAB_H
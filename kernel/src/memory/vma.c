@@ -0,0 +1,890 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
+#include <memory/vma.h>
+#include <memory/vmm.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <core/cpu.h>
+#include <core/fpu.h>
+#include <fs/pagecache.h>
+#include <utils/log.h>
+#include <lib/string.h>
+
+#define PAGE_ALIGN_UP(x)    (((x) + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1))
+
+static kmem_cache_t *mm_cache = NULL;
+static kmem_cache_t *vma_cache = NULL;
+
+// Address space whose areas resolve faults on each CPU
+static mm_t *active_mm[MAX_CPUS];
+
+// Statistics
+static vma_stats_t vma_stats = {0};
+
+// Set up the mm and VMA caches
+bool mm_init(void) {
+    if (!mm_cache) {
+        mm_cache = kmem_cache_create("mm", sizeof(mm_t), 0);
+    }
+    if (!vma_cache) {
+        vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0);
+    }
+    if (!mm_cache || !vma_cache) {
+        LOG_ERROR_MSG("VMA: failed to create caches");
+        return false;
+    }
+
+    memset(active_mm, 0, sizeof(active_mm));
+    return true;
+}
+
+// Create an empty mm for an address space
+mm_t *mm_create(uint64_t page_table) {
+    mm_t *mm = kmem_cache_alloc(mm_cache);
+    if (!mm) {
+        return NULL;
+    }
+
+    memset(mm, 0, sizeof(mm_t));
+    mm->page_table = page_table;
+    mm->map_start = VMA_USER_START;
+    mm->map_end = VMA_USER_END;
+    vma_stats.spaces++;
+    return mm;
+}
+
+static vma_t *vma_alloc(uint64_t start, uint64_t end, uint32_t flags) {
+    vma_t *vma = kmem_cache_alloc(vma_cache);
+    if (!vma) {
+        return NULL;
+    }
+
+    memset(vma, 0, sizeof(vma_t));
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma_stats.vmas++;
+    return vma;
+}
+
+static void vma_free(vma_t *vma) {
+    kmem_cache_free(vma_cache, vma);
+    vma_stats.vmas--;
+}
+
+// Free gap between an area and the one before it
+static uint64_t vma_gap(const mm_t *mm, const vma_t *vma) {
+    uint64_t low = vma->prev ? vma->prev->end : mm->map_start;
+    return vma->start > low ? vma->start - low : 0;
+}
+
+static uint64_t compute_subtree_gap(const mm_t *mm, const vma_t *vma) {
+    uint64_t gap = vma_gap(mm, vma);
+    if (vma->rb_left && vma->rb_left->subtree_gap > gap) {
+        gap = vma->rb_left->subtree_gap;
+    }
+    if (vma->rb_right && vma->rb_right->subtree_gap > gap) {
+        gap = vma->rb_right->subtree_gap;
+    }
+    return gap;
+}
+
+// Refresh the gap summaries from an area whose gap or children changed up to the root
+static void propagate_gap(const mm_t *mm, vma_t *vma) {
+    for (; vma; vma = vma->rb_parent) {
+        vma->subtree_gap = compute_subtree_gap(mm, vma);
+    }
+}
+
+static void replace_child(mm_t *mm, vma_t *parent, vma_t *old, vma_t *new) {
+    if (!parent) {
+        mm->vma_root = new;
+    } else if (parent->rb_left == old) {
+        parent->rb_left = new;
+    } else {
+        parent->rb_right = new;
+    }
+}
+
+// Rotations keep the set of areas below the top, so only the two nodes moved need new summaries
+static void rotate_left(mm_t *mm, vma_t *x) {
+    vma_t *y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if (y->rb_left) {
+        y->rb_left->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    replace_child(mm, x->rb_parent, x, y);
+    y->rb_left = x;
+    x->rb_parent = y;
+    x->subtree_gap = compute_subtree_gap(mm, x);
+    y->subtree_gap = compute_subtree_gap(mm, y);
+}
+
+static void rotate_right(mm_t *mm, vma_t *x) {
+    vma_t *y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if (y->rb_right) {
+        y->rb_right->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    replace_child(mm, x->rb_parent, x, y);
+    y->rb_right = x;
+    x->rb_parent = y;
+    x->subtree_gap = compute_subtree_gap(mm, x);
+    y->subtree_gap = compute_subtree_gap(mm, y);
+}
+
+static bool is_red(const vma_t *vma) {
+    return vma && vma->rb_red;
+}
+
+// Link a new area between its neighbours prev and prev->next (or the first area)
+static void vma_link(mm_t *mm, vma_t *vma, vma_t *prev) {
+    vma_t *next = prev ? prev->next : mm->vmas;
+    vma->prev = prev;
+    vma->next = next;
+    if (prev) {
+        prev->next = vma;
+    } else {
+        mm->vmas = vma;
+    }
+    if (next) {
+        next->prev = vma;
+    }
+
+    // The new area is the right child of prev or the left child of next, whichever is free
+    vma_t *parent = NULL;
+    if (prev && !prev->rb_right) {
+        parent = prev;
+        prev->rb_right = vma;
+    } else if (next) {
+        parent = next;
+        next->rb_left = vma;
+    } else {
+        mm->vma_root = vma;
+    }
+    vma->rb_parent = parent;
+    vma->rb_left = vma->rb_right = NULL;
+    vma->rb_red = true;
+    propagate_gap(mm, vma);
+    if (next) {
+        propagate_gap(mm, next);
+    }
+
+    // Recolour and rotate until no red area has a red parent
+    vma_t *node = vma;
+    while (is_red(node->rb_parent)) {
+        vma_t *p = node->rb_parent;
+        vma_t *g = p->rb_parent;
+        if (p == g->rb_left) {
+            vma_t *uncle = g->rb_right;
+            if (is_red(uncle)) {
+                p->rb_red = uncle->rb_red = false;
+                g->rb_red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->rb_right) {
+                rotate_left(mm, p);
+                node = p;
+                p = node->rb_parent;
+            }
+            p->rb_red = false;
+            g->rb_red = true;
+            rotate_right(mm, g);
+        } else {
+            vma_t *uncle = g->rb_left;
+            if (is_red(uncle)) {
+                p->rb_red = uncle->rb_red = false;
+                g->rb_red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->rb_left) {
+                rotate_right(mm, p);
+                node = p;
+                p = node->rb_parent;
+            }
+            p->rb_red = false;
+            g->rb_red = true;
+            rotate_left(mm, g);
+        }
+    }
+    mm->vma_root->rb_red = false;
+    mm->vma_count++;
+}
+
+// Restore the black heights after a black area left the tree above child
+static void erase_fixup(mm_t *mm, vma_t *child, vma_t *parent) {
+    while (child != mm->vma_root && !is_red(child)) {
+        if (child == parent->rb_left) {
+            vma_t *sibling = parent->rb_right;
+            if (is_red(sibling)) {
+                sibling->rb_red = false;
+                parent->rb_red = true;
+                rotate_left(mm, parent);
+                sibling = parent->rb_right;
+            }
+            if (!is_red(sibling->rb_left) && !is_red(sibling->rb_right)) {
+                sibling->rb_red = true;
+                child = parent;
+                parent = child->rb_parent;
+                continue;
+            }
+            if (!is_red(sibling->rb_right)) {
+                sibling->rb_left->rb_red = false;
+                sibling->rb_red = true;
+                rotate_right(mm, sibling);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = false;
+            sibling->rb_right->rb_red = false;
+            rotate_left(mm, parent);
+        } else {
+            vma_t *sibling = parent->rb_left;
+            if (is_red(sibling)) {
+                sibling->rb_red = false;
+                parent->rb_red = true;
+                rotate_right(mm, parent);
+                sibling = parent->rb_left;
+            }
+            if (!is_red(sibling->rb_left) && !is_red(sibling->rb_right)) {
+                sibling->rb_red = true;
+                child = parent;
+                parent = child->rb_parent;
+                continue;
+            }
+            if (!is_red(sibling->rb_left)) {
+                sibling->rb_right->rb_red = false;
+                sibling->rb_red = true;
+                rotate_left(mm, sibling);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = false;
+            sibling->rb_left->rb_red = false;
+            rotate_right(mm, parent);
+        }
+        child = mm->vma_root;
+    }
+    if (child) {
+        child->rb_red = false;
+    }
+}
+
+// Take an area out of the list and the tree and free it
+static void vma_erase(mm_t *mm, vma_t *vma) {
+    vma_t *next = vma->next;
+    if (vma->prev) {
+        vma->prev->next = next;
+    } else {
+        mm->vmas = next;
+    }
+    if (next) {
+        next->prev = vma->prev;
+    }
+
+    vma_t *child;
+    vma_t *parent;
+    bool removed_red;
+    if (!vma->rb_left || !vma->rb_right) {
+        child = vma->rb_left ? vma->rb_left : vma->rb_right;
+        parent = vma->rb_parent;
+        removed_red = vma->rb_red;
+        if (child) {
+            child->rb_parent = parent;
+        }
+        replace_child(mm, parent, vma, child);
+    } else {
+        // The successor (next) takes the area's place in the tree
+        child = next->rb_right;
+        parent = next->rb_parent;
+        removed_red = next->rb_red;
+        if (parent == vma) {
+            parent = next;
+        } else {
+            if (child) {
+                child->rb_parent = parent;
+            }
+            parent->rb_left = child;
+            next->rb_right = vma->rb_right;
+            vma->rb_right->rb_parent = next;
+        }
+        next->rb_parent = vma->rb_parent;
+        replace_child(mm, vma->rb_parent, vma, next);
+        next->rb_left = vma->rb_left;
+        vma->rb_left->rb_parent = next;
+        next->rb_red = vma->rb_red;
+    }
+
+    // The successor's gap grew by the area and its gap
+    propagate_gap(mm, parent);
+    if (next) {
+        propagate_gap(mm, next);
+    }
+    if (!removed_red) {
+        erase_fixup(mm, child, parent);
+    }
+
+    mm->vma_count--;
+    vma_free(vma);
+}
+
+// An area's start or end moved, the gaps on either side of it changed
+static void vma_resized(mm_t *mm, vma_t *vma) {
+    propagate_gap(mm, vma);
+    if (vma->next) {
+        propagate_gap(mm, vma->next);
+    }
+}
+
+// Find the area with the highest start at or below addr
+static vma_t *vma_find_floor(mm_t *mm, uint64_t addr) {
+    vma_t *best = NULL;
+    vma_t *node = mm->vma_root;
+    while (node) {
+        if (node->start <= addr) {
+            best = node;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return best;
+}
+
+// Copy an mm for fork
+mm_t *mm_clone(const mm_t *mm, uint64_t page_table) {
+    mm_t *copy = mm_create(page_table);
+    if (!copy || !mm) {
+        return copy;
+    }
+
+    copy->map_start = mm->map_start;
+    copy->map_end = mm->map_end;
+    copy->brk_start = mm->brk_start;
+    copy->brk = mm->brk;
+    copy->resident = mm->resident;
+
+    // Areas arrive in address order, each goes right after the last one
+    vma_t *last = NULL;
+    for (const vma_t *vma = mm->vmas; vma; vma = vma->next) {
+        vma_t *dup = vma_alloc(vma->start, vma->end, vma->flags);
+        if (!dup) {
+            mm_destroy(copy);
+            return NULL;
+        }
+        dup->ino = vma->ino;
+        dup->file_offset = vma->file_offset;
+        dup->file_bytes = vma->file_bytes;
+        vma_link(copy, dup, last);
+        last = dup;
+    }
+    return copy;
+}
+
+// Free an mm and its areas
+void mm_destroy(mm_t *mm) {
+    if (!mm) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (active_mm[i] == mm) {
+            active_mm[i] = NULL;
+        }
+    }
+    cpu_irq_restore(flags);
+
+    // The whole tree goes, so the list is enough to free it
+    while (mm->vmas) {
+        vma_t *vma = mm->vmas;
+        mm->vmas = vma->next;
+        vma_free(vma);
+    }
+    kmem_cache_free(mm_cache, mm);
+    vma_stats.spaces--;
+}
+
+// Make mm the address space faults on this CPU are resolved in
+mm_t *mm_switch(mm_t *mm) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    mm_t *prev = active_mm[cpu];
+    active_mm[cpu] = mm;
+    if (mm) {
+        vmm_switch_address_space(mm->page_table);
+    }
+    cpu_irq_restore(flags);
+    return prev;
+}
+
+// Get the address space faults on this CPU are resolved in
+mm_t *mm_current(void) {
+    return active_mm[cpu_current_id()];
+}
+
+// Run on another task's address space, interrupts stay off so the CPU cannot change
+mm_t *mm_enter(mm_t *mm, uint64_t *old_space, uint64_t *irq_flags) {
+    *irq_flags = cpu_irq_save();
+    *old_space = vmm_get_current_address_space();
+    return mm_switch(mm);
+}
+
+// Go back to the address space mm_enter left
+void mm_leave(mm_t *old_mm, uint64_t old_space, uint64_t irq_flags) {
+    mm_switch(old_mm);
+    vmm_switch_address_space(old_space);
+    cpu_irq_restore(irq_flags);
+}
+
+// Find the area containing an address
+vma_t *vma_find(mm_t *mm, uint64_t addr) {
+    if (!mm) {
+        return NULL;
+    }
+
+    vma_t *vma = vma_find_floor(mm, addr);
+    return vma && addr < vma->end ? vma : NULL;
+}
+
+// Insert a new area, it joins an adjacent anonymous area with equal flags on either side
+static bool vma_add(mm_t *mm, uint64_t start, uint64_t length, uint32_t flags,
+                    uint32_t ino, uint64_t file_offset, uint64_t file_bytes) {
+    uint64_t end = start + PAGE_ALIGN_UP(length);
+    if (!mm || length == 0 || (start & (PAGE_SIZE_4K - 1)) || end <= start ||
+        start < mm->map_start || end > mm->map_end) {
+        LOG_ERROR("VMA: invalid area 0x%llX+0x%llX", start, length);
+        return false;
+    }
+
+    // The last area starting below the end must finish before the start
+    vma_t *prev = vma_find_floor(mm, end - 1);
+    if (prev && prev->end > start) {
+        LOG_ERROR("VMA: 0x%llX-0x%llX overlaps 0x%llX-0x%llX", start, end, prev->start, prev->end);
+        return false;
+    }
+    vma_t *next = prev ? prev->next : mm->vmas;
+
+    bool join_prev = !ino && prev && prev->end == start && !prev->ino && prev->flags == flags;
+    bool join_next = !ino && next && next->start == end && !next->ino && next->flags == flags;
+    if (join_prev && join_next) {
+        prev->end = next->end;
+        vma_erase(mm, next);
+        vma_resized(mm, prev);
+        return true;
+    }
+    if (join_prev) {
+        prev->end = end;
+        vma_resized(mm, prev);
+        return true;
+    }
+    if (join_next) {
+        next->start = start;
+        vma_resized(mm, next);
+        return true;
+    }
+
+    vma_t *vma = vma_alloc(start, end, flags);
+    if (!vma) {
+        LOG_ERROR_MSG("VMA: out of memory");
+        return false;
+    }
+    vma->ino = ino;
+    vma->file_offset = file_offset;
+    vma->file_bytes = file_bytes;
+    vma_link(mm, vma, prev);
+    return true;
+}
+
+// Add an anonymous area
+bool vma_map_anon(mm_t *mm, uint64_t start, uint64_t length, uint32_t flags) {
+    return vma_add(mm, start, length, flags, 0, 0, 0);
+}
+
+// Add a file-backed area
+bool vma_map_file(mm_t *mm, uint64_t start, uint64_t length, uint32_t flags,
+                  uint32_t ino, uint64_t file_offset, uint64_t file_bytes) {
+    if (ino == 0 || (file_offset & (PAGE_SIZE_4K - 1))) {
+        LOG_ERROR("VMA: file offset 0x%llX is not page aligned", file_offset);
+        return false;
+    }
+    return vma_add(mm, start, length, flags, ino, file_offset, file_bytes);
+}
+
+// Drop the first delta bytes of an area's file backing
+static void vma_advance(vma_t *vma, uint64_t delta) {
+    if (vma->ino) {
+        vma->file_offset += delta;
+        vma->file_bytes = vma->file_bytes > delta ? vma->file_bytes - delta : 0;
+    }
+    vma->start += delta;
+}
+
+// Remove a range from the areas and release its pages
+void vma_unmap(mm_t *mm, uint64_t start, uint64_t length) {
+    if (!mm || length == 0) {
+        return;
+    }
+
+    start &= ~(PAGE_SIZE_4K - 1);
+    uint64_t end = PAGE_ALIGN_UP(start + length);
+
+    vma_t *vma = vma_find_floor(mm, start);
+    if (!vma || vma->end <= start) {
+        vma = vma ? vma->next : mm->vmas;
+    }
+
+    while (vma && vma->start < end) {
+        vma_t *next = vma->next;
+
+        if (vma->start >= start && vma->end <= end) {
+            // Covered entirely
+            vma_erase(mm, vma);
+        } else if (vma->start < start && vma->end > end) {
+            // The hole splits the area in two
+            vma_t *tail = vma_alloc(vma->start, vma->end, vma->flags);
+            if (!tail) {
+                LOG_ERROR_MSG("VMA: out of memory splitting an area");
+                return;
+            }
+            tail->ino = vma->ino;
+            tail->file_offset = vma->file_offset;
+            tail->file_bytes = vma->file_bytes;
+            vma_advance(tail, end - vma->start);
+            vma->end = start;
+            vma_resized(mm, vma);
+            vma_link(mm, tail, vma);
+            break;
+        } else if (vma->start < start) {
+            vma->end = start;
+            vma_resized(mm, vma);
+        } else {
+            vma_advance(vma, end - vma->start);
+            vma_resized(mm, vma);
+        }
+        vma = next;
+    }
+
+    // Reservation maps have no pages of their own
+    if (!mm->page_table) {
+        return;
+    }
+
+    // Pages are released from the page tables, the references they hold go with them
+    uint64_t old_space, irq_flags;
+    mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+    size_t released = vmm_release_pages(start, (end - start) / PAGE_SIZE_4K);
+    mm_leave(old_mm, old_space, irq_flags);
+    mm->resident = mm->resident > released ? mm->resident - released : 0;
+}
+
+// Find the lowest free range of length bytes at or above low
+uint64_t vma_find_gap(mm_t *mm, uint64_t length, uint64_t align, uint64_t low) {
+    if (!mm || length == 0 || align < PAGE_SIZE_4K || (align & (align - 1))) {
+        return 0;
+    }
+
+    // A gap this large holds the range at any alignment
+    length = PAGE_ALIGN_UP(length);
+    uint64_t need = length + align - PAGE_SIZE_4K;
+    low = PAGE_ALIGN_UP(low);
+    if (low < mm->map_start) {
+        low = mm->map_start;
+    }
+    if (need < length || low >= mm->map_end || mm->map_end - low < need) {
+        return 0;
+    }
+    uint64_t limit = low + need;  // Gaps ending below this cannot hold the range above low
+
+    uint64_t gap_start = 0;
+    uint64_t gap_end = 0;
+    bool found = false;
+    vma_t *vma = mm->vma_root;
+    if (vma && vma->subtree_gap >= need) {
+        // Walk the gaps in address order, skipping subtrees with no gap large enough
+        bool descend = true;
+        while (vma) {
+            if (descend && vma->start >= limit && vma->rb_left && vma->rb_left->subtree_gap >= need) {
+                vma = vma->rb_left;
+                continue;
+            }
+
+            gap_start = vma->prev ? vma->prev->end : mm->map_start;
+            gap_end = vma->start;
+            if (gap_end >= limit && gap_end - gap_start >= need) {
+                found = true;
+                break;
+            }
+
+            if (vma->rb_right && vma->rb_right->subtree_gap >= need) {
+                vma = vma->rb_right;
+                descend = true;
+                continue;
+            }
+
+            // Back up to the first ancestor entered from the left, its gap comes next
+            vma_t *child = vma;
+            vma = vma->rb_parent;
+            while (vma && child == vma->rb_right) {
+                child = vma;
+                vma = vma->rb_parent;
+            }
+            descend = false;
+        }
+    }
+
+    if (!found) {
+        // The gap above the highest area
+        vma_t *last = mm->vma_root;
+        while (last && last->rb_right) {
+            last = last->rb_right;
+        }
+        gap_start = last ? last->end : mm->map_start;
+        gap_end = mm->map_end;
+        if (gap_end < limit || gap_end - gap_start < need) {
+            return 0;
+        }
+    }
+
+    uint64_t addr = gap_start > low ? gap_start : low;
+    return (addr + align - 1) & ~(align - 1);
+}
+
+// Back the whole 2 MiB block around a page with one huge page, false to fall back to 4 KiB
+static bool fault_in_huge(mm_t *mm, vma_t *vma, uint64_t page, uint64_t map_flags) {
+    uint64_t block = page & ~(PAGE_SIZE_2M - 1);
+    if (block < vma->start || block + PAGE_SIZE_2M > vma->end) {
+        return false;
+    }
+
+    size_t count = PAGE_SIZE_2M / PAGE_SIZE_4K;
+    void *frames = pmm_alloc_pages(count);
+    if (!frames) {
+        return false;
+    }
+    if ((uint64_t)frames & (PAGE_SIZE_2M - 1)) {
+        pmm_free_pages(frames, count);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        fpu_clear_page(vmm_phys_to_virt((uint64_t)frames + i * PAGE_SIZE_4K));
+    }
+
+    // Refused where part of the block is already mapped with small pages
+    if (!vmm_map_pages(block, (uint64_t)frames, count, map_flags)) {
+        pmm_free_pages(frames, count);
+        return false;
+    }
+
+    mm->resident += count;
+    mm->faults++;
+    vma_stats.huge_faults++;
+    return true;
+}
+
+// Back one page of an area in the current address space
+static bool fault_in(mm_t *mm, vma_t *vma, uint64_t page, bool write) {
+    uint64_t map_flags = VMM_FLAG_USER | VMM_FLAG_REF;
+    if (!(vma->flags & VMA_EXEC)) map_flags |= VMM_FLAG_NO_EXECUTE;
+    if (vma->flags & VMA_SHARED) map_flags |= VMM_FLAG_SHARED;
+
+    if ((vma->flags & VMA_HUGE) && !vma->ino &&
+        fault_in_huge(mm, vma, page, map_flags | ((vma->flags & VMA_WRITE) ? VMM_FLAG_WRITABLE : 0))) {
+        return true;
+    }
+
+    uint64_t offset = page - vma->start;
+    uint64_t frame = 0;
+
+    if (vma->ino && offset < vma->file_bytes) {
+        pcache_page_t *cached = pcache_read(vma->ino, (uint32_t)((vma->file_offset + offset) / PCACHE_PAGE_SIZE));
+        if (!cached) {
+            LOG_ERROR("VMA: failed to read file page for 0x%llX", page);
+            return false;
+        }
+
+        uint64_t bytes = vma->file_bytes - offset;
+        bool whole = bytes >= PAGE_SIZE_4K;
+        bool shared = (vma->flags & VMA_SHARED) && whole;
+
+        // Mapped cache pages hold a reference of their own, eviction only drops the cache's
+        if ((shared || (whole && !write)) && pmm_page_ref((void*)cached->phys)) {
+            frame = cached->phys;
+            if (shared && (vma->flags & VMA_WRITE)) {
+                map_flags |= VMM_FLAG_WRITABLE;
+                pcache_mark_dirty(cached);
+            } else if (!shared) {
+                map_flags |= VMM_FLAG_COW;  // A private copy is made on the first write
+            }
+        } else {
+            void *copy = pmm_alloc_page();
+            if (copy) {
+                void *dest = vmm_phys_to_virt((uint64_t)copy);
+                if (whole) {
+                    fpu_copy_page(dest, cached->data);
+                } else {
+                    memcpy(dest, cached->data, bytes);
+                    memset((uint8_t*)dest + bytes, 0, PAGE_SIZE_4K - bytes);
+                }
+                frame = (uint64_t)copy;
+                if (vma->flags & VMA_WRITE) map_flags |= VMM_FLAG_WRITABLE;
+            }
+        }
+        pcache_release(cached);
+        vma_stats.file_faults++;
+    } else {
+        void *zero = pmm_alloc_zeroed_page();
+        if (zero) {
+            frame = (uint64_t)zero;
+            if (vma->flags & VMA_WRITE) map_flags |= VMM_FLAG_WRITABLE;
+        }
+        vma_stats.anon_faults++;
+    }
+
+    if (!frame) {
+        LOG_ERROR_RATELIMITED("VMA: out of memory faulting in 0x%llX", page);
+        return false;
+    }
+
+    if (!vmm_map_page(page, frame, map_flags)) {
+        pmm_page_unref((void*)frame);
+        return false;
+    }
+
+    mm->resident++;
+    mm->faults++;
+    return true;
+}
+
+// Resolve a fault on a missing page
+bool vma_handle_fault(uint64_t fault_addr, uint32_t error_code) {
+    mm_t *mm = mm_current();
+    if (!mm || fault_addr >= VMA_USER_END) {
+        return false;
+    }
+
+    vma_t *vma = vma_find(mm, fault_addr);
+    bool write = (error_code & PF_WRITE) != 0;
+    if (!vma || !(vma->flags & (VMA_READ | VMA_WRITE | VMA_EXEC)) ||
+        (write && !(vma->flags & VMA_WRITE)) ||
+        ((error_code & PF_FETCH) && !(vma->flags & VMA_EXEC))) {
+        vma_stats.bad_faults++;
+        return false;
+    }
+
+    return fault_in(mm, vma, fault_addr & ~(PAGE_SIZE_4K - 1), write);
+}
+
+// Fault in every page of a range now
+bool vma_populate(mm_t *mm, uint64_t start, uint64_t length) {
+    if (!mm) {
+        return false;
+    }
+
+    uint64_t end = PAGE_ALIGN_UP(start + length);
+    uint64_t old_space, irq_flags;
+    mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+
+    bool ok = true;
+    for (uint64_t page = start & ~(PAGE_SIZE_4K - 1); page < end && ok; page += PAGE_SIZE_4K) {
+        vma_t *vma = vma_find(mm, page);
+        if (!vma) {
+            ok = false;
+        } else if ((vma->flags & (VMA_READ | VMA_WRITE | VMA_EXEC)) && !vmm_is_mapped(page)) {
+            ok = fault_in(mm, vma, page, (vma->flags & VMA_WRITE) != 0);
+        }
+    }
+
+    mm_leave(old_mm, old_space, irq_flags);
+    return ok;
+}
+
+// Copy data into an address space
+bool vma_copy_to(mm_t *mm, uint64_t addr, const void *src, size_t size) {
+    if (!mm) {
+        return false;
+    }
+
+    uint64_t old_space, irq_flags;
+    mm_t *old_mm = mm_enter(mm, &old_space, &irq_flags);
+
+    const uint8_t *from = src;
+    bool ok = true;
+    while (size > 0 && ok) {
+        uint64_t page = addr & ~(PAGE_SIZE_4K - 1);
+        vma_t *vma = vma_find(mm, page);
+        if (!vma) {
+            ok = false;
+            break;
+        }
+
+        // Frames shared copy-on-write or with the page cache are copied before the write
+        if (!vmm_is_mapped(page)) {
+            ok = fault_in(mm, vma, page, true);
+        } else if (!(vma->flags & VMA_SHARED)) {
+            vmm_break_cow(page);
+        }
+        uint64_t phys = vmm_get_physical_address(addr);
+        if (!ok || !phys) {
+            ok = false;
+            break;
+        }
+
+        size_t chunk = PAGE_SIZE_4K - (addr & (PAGE_SIZE_4K - 1));
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(vmm_phys_to_virt(phys), from, chunk);
+        from += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    mm_leave(old_mm, old_space, irq_flags);
+    return ok;
+}
+
+// Move the program break
+uint64_t mm_set_brk(mm_t *mm, uint64_t brk) {
+    if (!mm) {
+        return 0;
+    }
+    if (brk < mm->brk_start) {
+        return mm->brk;
+    }
+
+    uint64_t old_end = PAGE_ALIGN_UP(mm->brk);
+    uint64_t new_end = PAGE_ALIGN_UP(brk);
+    if (new_end > old_end) {
+        // The heap area grows in place, pages appear as they are touched
+        if (!vma_map_anon(mm, old_end, new_end - old_end, VMA_READ | VMA_WRITE)) {
+            return mm->brk;
+        }
+    } else if (new_end < old_end) {
+        vma_unmap(mm, new_end, old_end - new_end);
+    }
+
+    mm->brk = brk;
+    return brk;
+}
+
+// Get VMA statistics
+void vma_get_stats(vma_stats_t *stats) {
+    if (stats) {
+        *stats = vma_stats;
+    }
+}
+
+// Print VMA statistics
+void vma_print_stats(void) {
+    LOG_INFO("VMA Statistics:");
+    LOG_INFO("  Address spaces: %u, areas: %u",
+             (uint32_t)vma_stats.spaces, (uint32_t)vma_stats.vmas);
+    LOG_INFO("  Faults: %u zero-filled, %u from files, %u huge, %u rejected",
+             (uint32_t)vma_stats.anon_faults, (uint32_t)vma_stats.file_faults,
+             (uint32_t)vma_stats.huge_faults, (uint32_t)vma_stats.bad_faults);
+}
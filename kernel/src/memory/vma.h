@@ -0,0 +1,125 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// VMA protection and sharing flags
+#define VMA_READ        (1U << 0)
+#define VMA_WRITE       (1U << 1)
+#define VMA_EXEC        (1U << 2)
+#define VMA_SHARED      (1U << 3)       // Writes are seen by every mapping of the pages
+#define VMA_HUGE        (1U << 4)       // Anonymous memory backed by 2 MiB pages where it can be
+
+// Range of a user address space areas can be placed in, the first pages stay unmapped to catch
+// NULL dereferences
+#define VMA_USER_START  0x0000000000010000ULL
+#define VMA_USER_END    0x0000800000000000ULL
+
+// Mappings without a usable address hint are placed in the lowest free gap from here up
+#define VMA_MMAP_BASE   0x0000700000000000ULL
+
+// Virtual memory area, a page-aligned range of a user address space backed on demand
+typedef struct vma {
+    uint64_t start;                     // First byte
+    uint64_t end;                       // First byte past the area
+    uint32_t flags;
+    uint32_t ino;                       // Backing file, 0 for anonymous memory
+    uint64_t file_offset;               // File offset of start, page aligned
+    uint64_t file_bytes;                // Bytes of file data from start, the rest reads as zero
+    struct vma *next;                   // Next area by address
+    struct vma *prev;                   // Previous area by address
+    struct vma *rb_left;                // Red-black tree keyed by start
+    struct vma *rb_right;
+    struct vma *rb_parent;
+    bool rb_red;
+    uint64_t subtree_gap;               // Largest free gap below an area of this subtree
+} vma_t;
+
+// User address space: its page tables and the areas faults are resolved from.
+// An mm belongs to one task, only that task (or its creator before it runs) touches it.
+// An mm without page tables only reserves address ranges, such as the kernel's own areas.
+typedef struct mm {
+    uint64_t page_table;                // PML4 (CR3 value), 0 for a reservation map
+    uint64_t map_start;                 // Range the areas are placed in
+    uint64_t map_end;
+    vma_t *vmas;                        // Lowest area, the rest follow through next
+    vma_t *vma_root;                    // Tree of the areas, augmented with the free gaps
+    uint32_t vma_count;
+    uint64_t brk_start;                 // Heap start, set by the program loader
+    uint64_t brk;                       // Current program break
+    size_t resident;                    // Pages faulted in
+    size_t faults;                      // Faults resolved from the areas
+} mm_t;
+
+// VMA statistics
+typedef struct {
+    size_t spaces;                      // Live address spaces
+    size_t vmas;                        // Live areas
+    size_t anon_faults;                 // Zero-filled pages
+    size_t file_faults;                 // Pages mapped or copied from the page cache
+    size_t huge_faults;                 // 2 MiB blocks backed by one fault
+    size_t bad_faults;                  // Faults outside any area or against its protection
+} vma_stats_t;
+
+// Set up the mm and VMA caches
+bool mm_init(void);
+
+// Create an empty mm for an address space
+mm_t *mm_create(uint64_t page_table);
+
+// Copy an mm for fork, the page tables are cloned by the caller
+mm_t *mm_clone(const mm_t *mm, uint64_t page_table);
+
+// Free an mm and its areas, the page tables are deleted by the caller
+void mm_destroy(mm_t *mm);
+
+// Make mm the address space faults on this CPU are resolved in, returns the previous one
+mm_t *mm_switch(mm_t *mm);
+
+// Get the address space faults on this CPU are resolved in
+mm_t *mm_current(void);
+
+// Run on mm's address space with interrupts off until mm_leave, returns the previous mm
+mm_t *mm_enter(mm_t *mm, uint64_t *old_space, uint64_t *irq_flags);
+
+// Go back to the address space mm_enter left
+void mm_leave(mm_t *old_mm, uint64_t old_space, uint64_t irq_flags);
+
+// Add an anonymous area, zero-filled on first touch
+bool vma_map_anon(mm_t *mm, uint64_t start, uint64_t length, uint32_t flags);
+
+// Add an area backed by file_bytes of a file from a page-aligned offset, zero beyond them
+bool vma_map_file(mm_t *mm, uint64_t start, uint64_t length, uint32_t flags,
+                  uint32_t ino, uint64_t file_offset, uint64_t file_bytes);
+
+// Remove a range from the areas, splitting the ones it cuts, and release its pages
+void vma_unmap(mm_t *mm, uint64_t start, uint64_t length);
+
+// Find the lowest free range of length bytes at or above low, aligned to align (a power of two
+// of at least a page), returns 0 if there is none
+uint64_t vma_find_gap(mm_t *mm, uint64_t length, uint64_t align, uint64_t low);
+
+// Find the area containing an address
+vma_t *vma_find(mm_t *mm, uint64_t addr);
+
+// Fault in every page of a range now (mm must be current)
+bool vma_populate(mm_t *mm, uint64_t start, uint64_t length);
+
+// Copy data into an address space, backing its pages privately whatever their protection
+bool vma_copy_to(mm_t *mm, uint64_t addr, const void *src, size_t size);
+
+// Resolve a fault on a page missing from the current address space
+bool vma_handle_fault(uint64_t fault_addr, uint32_t error_code);
+
+// Move the program break, returns the new break (the old one if it cannot move)
+uint64_t mm_set_brk(mm_t *mm, uint64_t brk);
+
+// Get VMA statistics
+void vma_get_stats(vma_stats_t *stats);
+
+// Print VMA statistics
+void vma_print_stats(void);
+
+#endif // VMA_H
@@ -1,9 +1,16 @@
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
 #include <memory/vmm.h>
 #include <memory/pmm.h>
 #include <utils/log.h>
 #include <lib/string.h>
 #include <lib/asm.h>
 #include <core/idt.h>
+#include <core/fpu.h>
+#include <core/cpu.h>
+#include <core/smp.h>
+#include <memory/vma.h>
+#include <core/exec/scheduler.h>
 #include <stdint.h>
 
 // Limine HHDM (Higher Half Direct Mapping) reques
@@ -20,42 +27,85 @@ volatile struct limine_kernel_address_request kernel_addr_request = {
     .revision = 0
 };
 
-// Maximum memory regions for dynamic allocation
-#define MAX_MEMORY_AREAS 32
-
 // Page table entry indices calculations
 #define PML4_INDEX(addr) (((addr) >> 39) & 0x1FF)
 #define PDPT_INDEX(addr) (((addr) >> 30) & 0x1FF)
 #define PD_INDEX(addr)   (((addr) >> 21) & 0x1FF)
 #define PT_INDEX(addr)   (((addr) >> 12) & 0x1FF)
 
+// Address shift of each paging level, from PML4 down to PT
+static const int level_shift[4] = {39, 30, 21, 12};
+
 // VMM configuration and state
 static vmm_config_t vmm_config;
 static uint64_t hhdm_offset;
 static uint64_t kernel_phys_base;
 static uint64_t kernel_virt_base;
-static uint64_t current_pml4_phys;
+static uint64_t current_pml4_phys[MAX_CPUS];   // Address space loaded on each CPU
+
+// Address spaces deleted while a CPU still had them loaded, a kernel thread may borrow
+// one indefinitely. They are freed once the last CPU switched off them.
+#define VMM_DEFERRED_SPACES 32
+static spinlock_t deferred_lock;
 
-// Memory regions for dynamic allocation
-static vmm_memory_region_t user_areas[MAX_MEMORY_AREAS];
-static vmm_memory_region_t kernel_areas[MAX_MEMORY_AREAS];
-static int user_area_count = 0;
-static int kernel_area_count = 0;
+// Device mappings are made by drivers probing on several CPUs at once, two of them must not
+// both add the page table a missing entry needs or reserve the same kernel window range
+static spinlock_t device_map_lock;
+static uint64_t deferred_spaces[VMM_DEFERRED_SPACES];
+static volatile uint32_t deferred_count = 0;
+
+// Ranges handed out in the kernel window, user ranges go in the areas of the current mm
+static mm_t kernel_mm = {
+    .map_start = VMM_KERNEL_AREA_BASE,
+    .map_end = VMM_KERNEL_AREA_BASE + VMM_KERNEL_AREA_SIZE,
+};
 
 // Statistics for memory usage
 static struct {
     size_t pages_allocated;
     size_t pages_freed;
     size_t page_faults_handled;
+    size_t pcid_hits;               // Switches that kept the TLB entries of the address space
+    size_t pcid_misses;             // Switches that had to assign and flush a PCID
+    size_t cow_shared;              // Pages shared copy-on-write by fork
+    size_t cow_copies;              // Write faults that copied a shared frame
+    size_t cow_reused;              // Write faults on a frame nobody else held any more
 } vmm_stats = {0};
 
+// Address space tagged by a PCID on one CPU, PCID n + 1 belongs to slot n
+typedef struct {
+    uint64_t pml4_phys;             // 0 if the slot is free
+    uint64_t last_used;             // Load stamp for least recently used eviction
+    bool stale;                     // Kernel mappings changed without flushing this PCID
+} pcid_slot_t;
+
+static pcid_slot_t pcid_slots[MAX_CPUS][VMM_PCID_SLOTS];
+static uint64_t pcid_clock[MAX_CPUS];
+static uint32_t pcid_current[MAX_CPUS];     // PCID loaded in CR3, 0 until the first switch
+
+// Range of an address space every CPU drops in a shootdown, shootdown_lock holds it
+#define VMM_SHOOTDOWN_PAGES 32      // Larger ranges flush the whole TLB instead
+#define VMM_SHOOTDOWN_BATCH 64      // Unmapped frames held back until one shootdown covers them
+static spinlock_t shootdown_lock;
+static uint64_t shootdown_pml4;
+static uint64_t shootdown_start;
+static uint64_t shootdown_end;
+
+// CR4 bit enabling PCIDs
+#define CR4_PCIDE (1ULL << 17)
+
+// INVPCID types
+#define INVPCID_ADDRESS         0   // One address in one PCID
+#define INVPCID_ALL_NON_GLOBAL  3   // Every PCID, global entries kept
+
 // Forward declarations
 static void* phys_to_virt(uint64_t phys);
 static uint64_t virt_to_phys(void* virt);
 static bool map_page_internal(uint64_t pml4_phys, uint64_t virt, uint64_t phys, uint64_t flags);
-static void register_memory_area(vmm_memory_region_t* areas, int* count, uint64_t base, size_t size, uint32_t flags);
 static void page_fault_handler(struct interrupt_frame *frame);
 static uint64_t create_page_table(void);
+static void free_address_space(uint64_t pml4_phys);
+static void shootdown(uint64_t pml4_phys, uint64_t start, uint64_t end);
 
 // Read CR3 register
 static inline uint64_t read_cr3(void) {
@@ -74,6 +124,22 @@ static inline void invlpg(uint64_t addr) {
     asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+// Invalidate TLB entries tagged with a PCID
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+    asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
 // Convert physical address to virtual using HHDM
 static void* phys_to_virt(uint64_t phys) {
     if (phys == 0) return NULL;
@@ -95,7 +161,7 @@ static uint64_t virt_to_phys(void* virt) {
     uint64_t pd_idx = PD_INDEX(addr);
     uint64_t pt_idx = PT_INDEX(addr);
     
-    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys);
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys[cpu_current_id()]);
     if (!pml4 || !(pml4[pml4_idx] & PAGE_PRESENT)) {
         return 0;
     }
@@ -107,7 +173,7 @@ static uint64_t virt_to_phys(void* virt) {
     
     // Check for 1GB page
     if (pdpt[pdpt_idx] & PAGE_HUGE) {
-        return (pdpt[pdpt_idx] & PAGE_ADDR_MASK) + (addr & 0x3FFFFFFF);
+        return (pdpt[pdpt_idx] & PAGE_FRAME_MASK & ~0x3FFFFFFFULL) + (addr & 0x3FFFFFFF);
     }
     
     uint64_t* pd = (uint64_t*)phys_to_virt(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
@@ -117,7 +183,7 @@ static uint64_t virt_to_phys(void* virt) {
     
     // Check for 2MB page
     if (pd[pd_idx] & PAGE_HUGE) {
-        return (pd[pd_idx] & PAGE_ADDR_MASK) + (addr & 0x1FFFFF);
+        return (pd[pd_idx] & PAGE_FRAME_MASK & ~0x1FFFFFULL) + (addr & 0x1FFFFF);
     }
     
     uint64_t* pt = (uint64_t*)phys_to_virt(pd[pd_idx] & PAGE_ADDR_MASK);
@@ -126,45 +192,35 @@ static uint64_t virt_to_phys(void* virt) {
     }
     
     // 4KB page
-    return (pt[pt_idx] & PAGE_ADDR_MASK) + (addr & 0xFFF);
+    return (pt[pt_idx] & PAGE_FRAME_MASK) + (addr & 0xFFF);
 }
 
 // Create a new page table
 static uint64_t create_page_table(void) {
-    void *page = pmm_alloc_page();
+    // Idle CPUs clear pages ahead, a new table rarely waits for its memset
+    void *page = pmm_alloc_zeroed_page();
     if (page == NULL) {
         LOG_ERROR("Failed to allocate page for page table");
         return 0;
     }
     
-    uint64_t phys_addr = virt_to_phys(page);
-    memset(page, 0, PAGE_SIZE_4K);
-    
-    return phys_addr;
+    return (uint64_t)page;
 }
 
-// Register a memory area for dynamic allocation
-static void register_memory_area(vmm_memory_region_t* areas, int* count, uint64_t base, size_t size, uint32_t flags) {
-    if (*count >= MAX_MEMORY_AREAS) {
-        LOG_ERROR("VMM: Too many memory areas");
-        return;
+// Reserve an address range for an allocation, a 2MB aligned one when it can take huge pages
+static uint64_t reserve_range(size_t size, uint64_t flags) {
+    mm_t* mm = (flags & VMM_FLAG_USER) ? mm_current() : &kernel_mm;
+    uint64_t align = size >= PAGE_SIZE_2M ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+    uint64_t base = vma_find_gap(mm, size, align, 0);
+    if (!base || !vma_map_anon(mm, base, size, VMA_READ | VMA_WRITE)) {
+        return 0;
     }
-    
-    areas[*count].base = base;
-    areas[*count].size = size;
-    areas[*count].flags = flags;
-    areas[*count].is_used = false;
-    (*count)++;
+    return base;
 }
 
-// Find a free memory area of the requested size
-static vmm_memory_region_t* find_free_area(vmm_memory_region_t* areas, int count, size_t size, uint32_t flags) {
-    for (int i = 0; i < count; i++) {
-        if (!areas[i].is_used && areas[i].size >= size) {
-            return &areas[i];
-        }
-    }
-    return NULL;
+// Give back a range from reserve_range, its pages are already unmapped
+static void unreserve_range(uint64_t base, size_t size) {
+    vma_unmap(base >= VMM_KERNEL_AREA_BASE ? &kernel_mm : mm_current(), base, size);
 }
 
 // Map a page in the specified page table
@@ -224,7 +280,7 @@ static bool map_page_internal(uint64_t pml4_phys, uint64_t virt, uint64_t phys,
     if ((flags & PAGE_HUGE) && ((virt & 0x3FFFFFFF) == 0) && ((phys & 0x3FFFFFFF) == 0)) {
         // 1GB alignment
         pdpt[pdpt_idx] = phys | flags | PAGE_HUGE;
-        invlpg(virt);
+        vmm_flush_tlb_page(virt);
         return true;
     }
     
@@ -256,7 +312,7 @@ static bool map_page_internal(uint64_t pml4_phys, uint64_t virt, uint64_t phys,
     if ((flags & PAGE_HUGE) && ((virt & 0x1FFFFF) == 0) && ((phys & 0x1FFFFF) == 0)) {
         // 2MB alignment
         pd[pd_idx] = phys | flags | PAGE_HUGE;
-        invlpg(virt);
+        vmm_flush_tlb_page(virt);
         return true;
     }
     
@@ -293,7 +349,7 @@ static bool map_page_internal(uint64_t pml4_phys, uint64_t virt, uint64_t phys,
     pt[pt_idx] = phys | flags;
     
     // Invalidate TLB
-    invlpg(virt);
+    vmm_flush_tlb_page(virt);
     
     return true;
 }
@@ -314,6 +370,9 @@ static void uint64_to_hex(uint64_t value, char* buffer) {
     asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
     
     uint64_t error_code = frame->error_code;
+    if (vmm_handle_page_fault(fault_addr, (uint32_t)error_code)) {
+        return;
+    }
     
     char fault_addr_str[19];
     char rip_str[19];
@@ -364,11 +423,11 @@ void vmm_init(struct limine_memmap_response *memmap) {
     }
     
     // Get CR3 (physical address of PML4)
-    current_pml4_phys = read_cr3();
-    LOG_INFO("Current PML4 physical address: 0x%llX", current_pml4_phys);
+    current_pml4_phys[cpu_current_id()] = read_cr3() & PAGE_FRAME_MASK;
+    LOG_INFO("Current PML4 physical address: 0x%llX", current_pml4_phys[cpu_current_id()]);
     
     // Store configuration
-    vmm_config.kernel_pml4 = current_pml4_phys;
+    vmm_config.kernel_pml4 = current_pml4_phys[cpu_current_id()];
     vmm_config.kernel_virtual_base = kernel_virt_base;
     vmm_config.kernel_virtual_size = 0x10000000; // 256MB by default
     vmm_config.hhdm_offset = hhdm_offset;
@@ -379,147 +438,212 @@ void vmm_init(struct limine_memmap_response *memmap) {
                 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) 
                 : "a"(0x80000001));
     vmm_config.using_nx = (edx & (1 << 20)) != 0;
+    vmm_config.using_1g_pages = (edx & (1 << 26)) != 0;
     LOG_INFO("NX bit %s", vmm_config.using_nx ? "supported" : "not supported");
+    LOG_INFO("1GB pages %s", vmm_config.using_1g_pages ? "supported" : "not supported");
+    
+    // Tag address spaces with PCIDs so switches keep their TLB entries,
+    // CR4.PCIDE can only be set while the loaded CR3 uses PCID 0
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    bool has_pcid = (ecx & CPUID_1_ECX_PCID) != 0;
+    cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    if (has_pcid && (read_cr3() & CR3_PCID_MASK) == 0) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        vmm_config.using_pcid = true;
+        vmm_config.using_invpcid = (ebx & CPUID_7_EBX_INVPCID) != 0;
+        memset(pcid_slots, 0, sizeof(pcid_slots));
+        memset(pcid_current, 0, sizeof(pcid_current));
+    }
+    LOG_INFO("PCID %s%s", vmm_config.using_pcid ? "enabled" : "not supported",
+             vmm_config.using_invpcid ? " with INVPCID" : "");
     
     // Register page fault handler
     idt_register_handler(14, page_fault_handler);
     
-    // Set up memory areas for kernel
-    register_memory_area(kernel_areas, &kernel_area_count, 
-                        hhdm_offset + 0x10000000, // Start at 256MB physical
-                        0x10000000, // 256MB size
-                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
-    
-    // Set up memory areas for user mode
-    register_memory_area(user_areas, &user_area_count,
-                        0x400000, // Start at 4MB
-                        0x10000000, // 256MB size
-                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
+    // Address spaces copy the kernel's PML4 entries when they are created, so the kernel window
+    // gets its PDPT now and later mappings in it show up everywhere
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(vmm_config.kernel_pml4);
+    if (!(pml4[PML4_INDEX(VMM_KERNEL_AREA_BASE)] & PAGE_PRESENT)) {
+        uint64_t pdpt = create_page_table();
+        if (pdpt) {
+            pml4[PML4_INDEX(VMM_KERNEL_AREA_BASE)] = pdpt | PAGE_PRESENT | PAGE_WRITABLE;
+        } else {
+            LOG_ERROR_MSG("VMM: failed to set up the kernel window");
+        }
+    }
     
     LOG_INFO("VMM initialized successfully");
 }
 
-// Map a physical page to a virtual address with specified flags
-bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
-    if (virt_addr == 0) {
-        LOG_ERROR("Cannot map null virtual address");
-        return false;
-    }
-    
-    if (phys_addr == 0) {
-        LOG_ERROR("Cannot map null physical address");
-        return false;
-    }
+// Bring an application processor onto the paging setup chosen by vmm_init
+void vmm_init_cpu(void) {
+    // APs start on the bootloader's page tables, the same ones the BSP booted with
+    uint32_t cpu = cpu_current_id();
+    current_pml4_phys[cpu] = read_cr3() & PAGE_FRAME_MASK;
+    pcid_current[cpu] = 0;
     
-    // Align addresses to page boundaries
-    virt_addr &= PAGE_ADDR_MASK;
-    phys_addr &= PAGE_ADDR_MASK;
-    
-    LOG_DEBUG("Mapping virt 0x%lX to phys 0x%lX with flags 0x%lX", virt_addr, phys_addr, flags);
-    
-    // Get the PML4
-    uint64_t* pml4 = phys_to_virt(current_pml4_phys);
-    if (!pml4) {
-        LOG_ERROR("Cannot access PML4");
-        return false;
+    if (vmm_config.using_pcid && (read_cr3() & CR3_PCID_MASK) == 0) {
+        write_cr4(read_cr4() | CR4_PCIDE);
     }
-    
-    // Get indices for page tables
-    uint64_t pml4_idx = (virt_addr >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt_addr >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt_addr >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt_addr >> 12) & 0x1FF;
-    
-    LOG_DEBUG("Indices: PML4=%lu, PDPT=%lu, PD=%lu, PT=%lu", 
-             pml4_idx, pdpt_idx, pd_idx, pt_idx);
-    
-    // Convert VMM flags to hardware flags
+}
+
+// Translate public VMM flags to page table entry bits (the size bit is added per level)
+static uint64_t hw_flags_for(uint64_t flags) {
     uint64_t hw_flags = PAGE_PRESENT;
     if (flags & VMM_FLAG_WRITABLE) hw_flags |= PAGE_WRITABLE;
     if (flags & VMM_FLAG_USER) hw_flags |= PAGE_USER;
     if (flags & VMM_FLAG_WRITETHROUGH) hw_flags |= PAGE_WRITETHROUGH;
     if (flags & VMM_FLAG_NOCACHE) hw_flags |= PAGE_CACHE_DISABLE;
     if (flags & VMM_FLAG_GLOBAL) hw_flags |= PAGE_GLOBAL;
-    if (flags & VMM_FLAG_HUGE) hw_flags |= PAGE_HUGE;
+    if (flags & VMM_FLAG_SHARED) hw_flags |= PAGE_SHARED;
+    if (flags & VMM_FLAG_COW) hw_flags |= PAGE_COW;
+    if (flags & VMM_FLAG_REF) hw_flags |= PAGE_REF;
     if ((flags & VMM_FLAG_NO_EXECUTE) && vmm_config.using_nx) hw_flags |= PAGE_NO_EXECUTE;
-    
-    // Ensure PDPT exists
-    if (!(pml4[pml4_idx] & PAGE_PRESENT)) {
-        uint64_t pdpt_phys = (uint64_t)pmm_alloc_page();
-        if (!pdpt_phys) {
-            LOG_ERROR("Failed to allocate PDPT");
-            return false;
+    return hw_flags;
+}
+
+// Largest page size that maps virt to phys with at most len bytes
+static uint64_t best_page_size(uint64_t virt, uint64_t phys, uint64_t len) {
+    uint64_t align = virt | phys;
+    if (vmm_config.using_1g_pages && (align & (PAGE_SIZE_1G - 1)) == 0 && len >= PAGE_SIZE_1G) {
+        return PAGE_SIZE_1G;
+    }
+    if ((align & (PAGE_SIZE_2M - 1)) == 0 && len >= PAGE_SIZE_2M) {
+        return PAGE_SIZE_2M;
+    }
+    return PAGE_SIZE_4K;
+}
+
+// Find the entry that maps virt in the current address space, NULL if unmapped
+static uint64_t* lookup_entry(uint64_t virt, uint64_t* size) {
+    uint64_t* table = phys_to_virt(current_pml4_phys[cpu_current_id()]);
+    if (!table) {
+        return NULL;
+    }
+
+    for (int level = 0; level < 4; level++) {
+        uint64_t* entry = &table[(virt >> level_shift[level]) & 0x1FF];
+        if (!(*entry & PAGE_PRESENT)) {
+            return NULL;
         }
-        memset(phys_to_virt(pdpt_phys), 0, PAGE_SIZE_4K);
-        pml4[pml4_idx] = pdpt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        // Propagate user access if in user space
-        if (virt_addr < 0x8000000000000000ULL) pml4[pml4_idx] |= PAGE_USER;
-        LOG_DEBUG("Created new PDPT at 0x%lX", pdpt_phys);
+        if (level == 3 || (level > 0 && (*entry & PAGE_HUGE))) {
+            *size = 1ULL << level_shift[level];
+            return entry;
+        }
+        table = phys_to_virt(*entry & PAGE_FRAME_MASK);
     }
-    
-    // Get PDPT
-    uint64_t pdpt_phys = pml4[pml4_idx] & PAGE_ADDR_MASK;
-    uint64_t* pdpt = phys_to_virt(pdpt_phys);
-    if (!pdpt) {
-        LOG_ERROR("Cannot access PDPT");
+    return NULL;
+}
+
+// Replace a huge entry with a table of 512 entries of the next smaller size
+static bool split_huge_entry(uint64_t* entry, uint64_t size) {
+    uint64_t table_phys = create_page_table();
+    if (!table_phys) {
+        LOG_ERROR("Failed to allocate table to split a huge page");
         return false;
     }
-    
-    // Ensure PD exists
-    if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) {
-        uint64_t pd_phys = (uint64_t)pmm_alloc_page();
-        if (!pd_phys) {
-            LOG_ERROR("Failed to allocate PD");
-            return false;
-        }
-        memset(phys_to_virt(pd_phys), 0, PAGE_SIZE_4K);
-        pdpt[pdpt_idx] = pd_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        // Propagate user access if in user space
-        if (virt_addr < 0x8000000000000000ULL) pdpt[pdpt_idx] |= PAGE_USER;
-        LOG_DEBUG("Created new PD at 0x%lX", pd_phys);
+
+    uint64_t child_size = size / 512;
+    uint64_t base = *entry & PAGE_FRAME_MASK & ~(size - 1);
+    uint64_t child_flags = *entry & ~PAGE_FRAME_MASK;
+    if (child_size == PAGE_SIZE_4K) {
+        child_flags &= ~PAGE_HUGE;  // Bit 7 is PAT in a 4 KiB entry
     }
-    
-    // Get PD
-    uint64_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
-    uint64_t* pd = phys_to_virt(pd_phys);
-    if (!pd) {
-        LOG_ERROR("Cannot access PD");
+
+    uint64_t* table = phys_to_virt(table_phys);
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * child_size) | child_flags;
+    }
+
+    // The new table maps the same range, so the old translations stay valid until flushed
+    *entry = table_phys | PAGE_PRESENT | PAGE_WRITABLE | (*entry & PAGE_USER);
+    vmm_flush_tlb_full();
+    LOG_DEBUG("Split %s page at 0x%llX", size == PAGE_SIZE_1G ? "1GB" : "2MB", base);
+    return true;
+}
+
+// Install one mapping of the given page size (4K, 2M or 1G) in the current address space
+static bool map_entry(uint64_t virt, uint64_t phys, uint64_t hw_flags, uint64_t size) {
+    uint64_t* table = phys_to_virt(current_pml4_phys[cpu_current_id()]);
+    if (!table) {
+        LOG_ERROR("Cannot access PML4");
         return false;
     }
-    
-    // Ensure PT exists
-    if (!(pd[pd_idx] & PAGE_PRESENT)) {
-        uint64_t pt_phys = (uint64_t)pmm_alloc_page();
-        if (!pt_phys) {
-            LOG_ERROR("Failed to allocate PT");
-            return false;
+
+    for (int level = 0; level < 4; level++) {
+        uint64_t* entry = &table[(virt >> level_shift[level]) & 0x1FF];
+        uint64_t level_size = 1ULL << level_shift[level];
+
+        if (level_size == size) {
+            if ((*entry & PAGE_PRESENT) && size > PAGE_SIZE_4K && !(*entry & PAGE_HUGE)) {
+                // A table sits where the huge page goes, it may only be dropped if it maps nothing
+                uint64_t* old = phys_to_virt(*entry & PAGE_FRAME_MASK);
+                for (int i = 0; i < 512; i++) {
+                    if (old[i] & PAGE_PRESENT) {
+                        LOG_WARN("0x%lX is partly mapped with smaller pages, not remapping", virt);
+                        return false;
+                    }
+                }
+                pmm_free_page((void*)(*entry & PAGE_FRAME_MASK));
+            } else if (*entry & PAGE_PRESENT) {
+                LOG_WARN("0x%lX is already mapped to 0x%lX - overwriting",
+                        virt, *entry & PAGE_FRAME_MASK);
+            }
+
+            *entry = phys | hw_flags | (size > PAGE_SIZE_4K ? PAGE_HUGE : 0);
+            vmm_flush_tlb_page(virt);
+            return true;
         }
-        memset(phys_to_virt(pt_phys), 0, PAGE_SIZE_4K);
-        pd[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        // Propagate user access if in user space
-        if (virt_addr < 0x8000000000000000ULL) pd[pd_idx] |= PAGE_USER;
-        LOG_DEBUG("Created new PT at 0x%lX", pt_phys);
+
+        if (!(*entry & PAGE_PRESENT)) {
+            uint64_t table_phys = create_page_table();
+            if (!table_phys) {
+                LOG_ERROR("Failed to allocate page table for 0x%lX", virt);
+                return false;
+            }
+            *entry = table_phys | PAGE_PRESENT | PAGE_WRITABLE;
+            // Propagate user access if in user space
+            if (virt < 0x8000000000000000ULL) *entry |= PAGE_USER;
+        } else if (level > 0 && (*entry & PAGE_HUGE)) {
+            // A smaller mapping inside a huge page needs the page split first
+            if (!split_huge_entry(entry, level_size)) {
+                return false;
+            }
+        }
+
+        table = phys_to_virt(*entry & PAGE_FRAME_MASK);
+    }
+
+    return false;
+}
+
+// Map a physical page to a virtual address with specified flags
+bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
+    if (virt_addr == 0) {
+        LOG_ERROR("Cannot map null virtual address");
+        return false;
     }
     
-    // Get PT
-    uint64_t pt_phys = pd[pd_idx] & PAGE_ADDR_MASK;
-    uint64_t* pt = phys_to_virt(pt_phys);
-    if (!pt) {
-        LOG_ERROR("Cannot access PT");
+    if (phys_addr == 0) {
+        LOG_ERROR("Cannot map null physical address");
         return false;
     }
     
-    // Check if already mapped
-    if (pt[pt_idx] & PAGE_PRESENT) {
-        LOG_WARN("0x%lX is already mapped to 0x%lX - overwriting", 
-                virt_addr, pt[pt_idx] & PAGE_ADDR_MASK);
+    // VMM_FLAG_HUGE asks for the largest page the alignment of both addresses allows
+    uint64_t size = PAGE_SIZE_4K;
+    if (flags & VMM_FLAG_HUGE) {
+        size = best_page_size(virt_addr, phys_addr, PAGE_SIZE_1G);
     }
     
-    // Set the page table entry
-    pt[pt_idx] = phys_addr | hw_flags;
+    // Align addresses to page boundaries
+    virt_addr &= ~(size - 1);
+    phys_addr &= ~(size - 1);
+    
+    LOG_DEBUG("Mapping virt 0x%lX to phys 0x%lX with flags 0x%lX", virt_addr, phys_addr, flags);
     
-    // Invalidate TLB entry
-    asm volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
+    if (!map_entry(virt_addr, phys_addr, hw_flags_for(flags), size)) {
+        return false;
+    }
     
     LOG_DEBUG("Successfully mapped 0x%lX to 0x%lX", virt_addr, phys_addr);
     return true;
@@ -535,165 +659,131 @@ bool vmm_unmap_page(uint64_t virt_addr) {
     // Align address to page boundary
     virt_addr &= PAGE_ADDR_MASK;
     
-    // Get the PML4
-    uint64_t* pml4 = phys_to_virt(current_pml4_phys);
-    if (!pml4) {
-        LOG_ERROR("Cannot access PML4");
-        return false;
-    }
-    
-    // Get indices for page tables
-    uint64_t pml4_idx = (virt_addr >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt_addr >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt_addr >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt_addr >> 12) & 0x1FF;
-    
-    // Check if PML4 entry exists
-    if (!(pml4[pml4_idx] & PAGE_PRESENT)) {
-        LOG_WARN("Address 0x%lX not mapped at PML4 level", virt_addr);
-        return false;
-    }
-    
-    // Get PDPT
-    uint64_t pdpt_phys = pml4[pml4_idx] & PAGE_ADDR_MASK;
-    uint64_t* pdpt = phys_to_virt(pdpt_phys);
-    if (!pdpt) {
-        LOG_ERROR("Cannot access PDPT for 0x%lX", virt_addr);
-        return false;
-    }
-    
-    // Check if PDPT entry exists
-    if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) {
-        LOG_WARN("Address 0x%lX not mapped at PDPT level", virt_addr);
-        return false;
-    }
-    
-    // Check for 1GB page
-    if (pdpt[pdpt_idx] & PAGE_HUGE) {
-        LOG_DEBUG("Unmapping 1GB page at 0x%lX", virt_addr);
-        pdpt[pdpt_idx] = 0;
-        asm volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
-        return true;
-    }
-    
-    // Get PD
-    uint64_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
-    uint64_t* pd = phys_to_virt(pd_phys);
-    if (!pd) {
-        LOG_ERROR("Cannot access PD for 0x%lX", virt_addr);
-        return false;
-    }
-    
-    // Check if PD entry exists
-    if (!(pd[pd_idx] & PAGE_PRESENT)) {
-        LOG_WARN("Address 0x%lX not mapped at PD level", virt_addr);
-        return false;
-    }
-    
-    // Check for 2MB page
-    if (pd[pd_idx] & PAGE_HUGE) {
-        LOG_DEBUG("Unmapping 2MB page at 0x%lX", virt_addr);
-        pd[pd_idx] = 0;
-        asm volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
-        return true;
-    }
-    
-    // Get PT
-    uint64_t pt_phys = pd[pd_idx] & PAGE_ADDR_MASK;
-    uint64_t* pt = phys_to_virt(pt_phys);
-    if (!pt) {
-        LOG_ERROR("Cannot access PT for 0x%lX", virt_addr);
+    uint64_t size;
+    uint64_t* entry = lookup_entry(virt_addr, &size);
+    if (!entry) {
+        LOG_WARN("Address 0x%lX not mapped", virt_addr);
         return false;
     }
     
-    // Check if page is mapped
-    if (!(pt[pt_idx] & PAGE_PRESENT)) {
-        LOG_WARN("Address 0x%lX not mapped at PT level", virt_addr);
-        return false;
+    // Only the 4 KiB page goes, the rest of a huge page stays mapped
+    while (size > PAGE_SIZE_4K) {
+        if (!split_huge_entry(entry, size)) {
+            return false;
+        }
+        entry = lookup_entry(virt_addr, &size);
     }
     
     // Unmap the page
-    pt[pt_idx] = 0;
+    *entry = 0;
     
-    // Invalidate TLB entry
-    asm volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
+    // Invalidate the TLB entry on every CPU
+    shootdown(current_pml4_phys[cpu_current_id()], virt_addr, virt_addr + PAGE_SIZE_4K);
     
     LOG_DEBUG("Successfully unmapped 0x%lX", virt_addr);
     return true;
 }
 
-// Map multiple pages
+// Map multiple pages, using the largest page size the alignment allows at each step
 bool vmm_map_pages(uint64_t virt_addr, uint64_t phys_addr, size_t count, uint64_t flags) {
-    // Check if we can use huge pages
-    if ((flags & VMM_FLAG_HUGE) && 
-        (virt_addr & 0x1FFFFF) == 0 && 
-        (phys_addr & 0x1FFFFF) == 0 && 
-        count >= 512) {
-        
-        // Use 2MB pages
-        size_t huge_pages = count / 512;
-        size_t remaining = count % 512;
-        
-        // Map huge pages
-        for (size_t i = 0; i < huge_pages; i++) {
-            if (!vmm_map_page(virt_addr + i * PAGE_SIZE_2M, 
-                              phys_addr + i * PAGE_SIZE_2M, 
-                              flags)) {
-                // Clean up on failure
-                for (size_t j = 0; j < i; j++) {
-                    vmm_unmap_page(virt_addr + j * PAGE_SIZE_2M);
-                }
-                return false;
-            }
+    uint64_t hw_flags = hw_flags_for(flags);
+    uint64_t len = (uint64_t)count * PAGE_SIZE_4K;
+    uint64_t done = 0;
+    
+    while (done < len) {
+        uint64_t size = best_page_size(virt_addr + done, phys_addr + done, len - done);
+        if (!map_entry(virt_addr + done, phys_addr + done, hw_flags, size)) {
+            // Clean up on failure
+            vmm_unmap_pages(virt_addr, done / PAGE_SIZE_4K);
+            return false;
+        }
+        done += size;
+    }
+    
+    return true;
+}
+
+// Unmap multiple pages, whole huge pages are removed with one entry
+bool vmm_unmap_pages(uint64_t virt_addr, size_t count) {
+    uint64_t start = virt_addr;
+    uint64_t end = virt_addr + (uint64_t)count * PAGE_SIZE_4K;
+    bool ok = true;
+    
+    while (virt_addr < end) {
+        uint64_t size;
+        uint64_t* entry = lookup_entry(virt_addr, &size);
+        if (!entry) {
+            virt_addr += PAGE_SIZE_4K;
+            continue;
         }
         
-        // Map remaining regular pages if any
-        if (remaining > 0) {
-            uint64_t start_virt = virt_addr + huge_pages * PAGE_SIZE_2M;
-            uint64_t start_phys = phys_addr + huge_pages * PAGE_SIZE_2M;
-            
-            for (size_t i = 0; i < remaining; i++) {
-                if (!vmm_map_page(start_virt + i * PAGE_SIZE_4K,
-                                 start_phys + i * PAGE_SIZE_4K,
-                                 flags & ~VMM_FLAG_HUGE)) {
-                    // Clean up on failure
-                    for (size_t j = 0; j < i; j++) {
-                        vmm_unmap_page(start_virt + j * PAGE_SIZE_4K);
-                    }
-                    for (size_t j = 0; j < huge_pages; j++) {
-                        vmm_unmap_page(virt_addr + j * PAGE_SIZE_2M);
-                    }
-                    return false;
-                }
+        // A huge page only partly covered by the range is split first
+        if ((virt_addr & (size - 1)) != 0 || end - virt_addr < size) {
+            if (!split_huge_entry(entry, size)) {
+                ok = false;
+                break;
             }
+            continue;
         }
         
-        return true;
+        *entry = 0;
+        virt_addr += size;
     }
     
-    // Use regular 4KB pages
-    for (size_t i = 0; i < count; i++) {
-        if (!vmm_map_page(virt_addr + i * PAGE_SIZE_4K, 
-                         phys_addr + i * PAGE_SIZE_4K, 
-                         flags & ~VMM_FLAG_HUGE)) {
-            // Clean up on failure
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap_page(virt_addr + j * PAGE_SIZE_4K);
+    // One shootdown for the whole range, the caller frees the frames after it
+    shootdown(current_pml4_phys[cpu_current_id()], start, virt_addr < end ? virt_addr : end);
+    return ok;
+}
+
+// Unmap user pages and drop the references their mappings hold
+size_t vmm_release_pages(uint64_t virt_addr, size_t count) {
+    uint64_t end = virt_addr + (uint64_t)count * PAGE_SIZE_4K;
+    uint64_t pml4_phys = current_pml4_phys[cpu_current_id()];
+    uint64_t frames[VMM_SHOOTDOWN_BATCH];
+    uint32_t held = 0;
+    uint64_t batch_start = virt_addr;
+    size_t released = 0;
+    
+    while (virt_addr < end) {
+        uint64_t size;
+        uint64_t* entry = lookup_entry(virt_addr, &size);
+        if (!entry) {
+            virt_addr += PAGE_SIZE_4K;
+            continue;
+        }
+        
+        // References are counted per 4 KiB frame
+        if (size > PAGE_SIZE_4K) {
+            if (!split_huge_entry(entry, size)) {
+                break;
             }
-            return false;
+            continue;
+        }
+        
+        uint64_t old = *entry;
+        *entry = 0;
+        if (old & PAGE_REF) {
+            frames[held++] = old & PAGE_FRAME_MASK;
+        }
+        released++;
+        virt_addr += PAGE_SIZE_4K;
+        
+        // No CPU may reach a frame through a stale entry once the PMM can hand it out
+        if (held == VMM_SHOOTDOWN_BATCH) {
+            shootdown(pml4_phys, batch_start, virt_addr);
+            for (uint32_t i = 0; i < held; i++) {
+                pmm_page_unref((void*)frames[i]);
+            }
+            held = 0;
+            batch_start = virt_addr;
         }
     }
     
-    return true;
-}
-
-// Unmap multiple pages
-bool vmm_unmap_pages(uint64_t virt_addr, size_t count) {
-    // Check each page since we might have mixed page sizes
-    for (size_t i = 0; i < count; i++) {
-        vmm_unmap_page(virt_addr + i * PAGE_SIZE_4K);
+    shootdown(pml4_phys, batch_start, virt_addr < end ? virt_addr : end);
+    for (uint32_t i = 0; i < held; i++) {
+        pmm_page_unref((void*)frames[i]);
     }
-    return true;
+    return released;
 }
 
 // Get physical address for a virtual address
@@ -714,7 +804,7 @@ bool vmm_is_mapped(uint64_t virt_addr) {
     uint64_t pd_idx = PD_INDEX(virt_addr);
     uint64_t pt_idx = PT_INDEX(virt_addr);
     
-    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys);
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys[cpu_current_id()]);
     if (!pml4 || !(pml4[pml4_idx] & PAGE_PRESENT)) {
         return false;
     }
@@ -756,7 +846,7 @@ uint64_t vmm_create_address_space(void) {
     }
     
     // Get current PML4
-    uint64_t* src_pml4 = (uint64_t*)phys_to_virt(current_pml4_phys);
+    uint64_t* src_pml4 = (uint64_t*)phys_to_virt(current_pml4_phys[cpu_current_id()]);
     uint64_t* new_pml4 = (uint64_t*)phys_to_virt(pml4_phys);
     
     // Copy kernel space mappings (higher half)
@@ -767,12 +857,147 @@ uint64_t vmm_create_address_space(void) {
     return pml4_phys;
 }
 
-// Delete an address space
+// Copy one level of user page tables, leaf frames are shared and gain a reference
+static bool clone_table(uint64_t* src, uint64_t* dst, int level) {
+    size_t count = level == 0 ? 256 : 512;  // The PML4 upper half is the kernel's
+
+    for (size_t i = 0; i < count; i++) {
+        if (!(src[i] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        // Per-page reference counts need 4 KiB mappings
+        if (level > 0 && level < 3 && (src[i] & PAGE_HUGE)) {
+            if (!split_huge_entry(&src[i], 1ULL << level_shift[level])) {
+                return false;
+            }
+        }
+
+        if (level < 3) {
+            uint64_t table_phys = create_page_table();
+            if (!table_phys) {
+                return false;
+            }
+            dst[i] = table_phys | (src[i] & ~PAGE_FRAME_MASK);
+            if (!clone_table(phys_to_virt(src[i] & PAGE_FRAME_MASK), phys_to_virt(table_phys), level + 1)) {
+                return false;
+            }
+            continue;
+        }
+
+        uint64_t entry = src[i];
+        uint64_t frame = entry & PAGE_FRAME_MASK;
+        if (!pmm_page_ref((void*)frame)) {
+            // Too widely shared frames are copied now, device memory is mapped as it is
+            if ((entry & (PAGE_WRITABLE | PAGE_COW)) && !(entry & PAGE_SHARED) && pmm_page_refcount((void*)frame)) {
+                void* copy = pmm_alloc_page();
+                if (!copy) {
+                    return false;
+                }
+                fpu_copy_page(phys_to_virt((uint64_t)copy), phys_to_virt(frame));
+                dst[i] = (uint64_t)copy | (entry & ~(PAGE_FRAME_MASK | PAGE_COW)) | PAGE_WRITABLE | PAGE_REF;
+                continue;
+            }
+            dst[i] = entry & ~PAGE_REF;
+            continue;
+        }
+
+        // Private writable pages are write-protected on both sides until one of them writes
+        if ((entry & PAGE_WRITABLE) && !(entry & PAGE_SHARED)) {
+            entry = (entry & ~PAGE_WRITABLE) | PAGE_COW;
+            src[i] = entry;
+        }
+        dst[i] = entry | PAGE_REF;
+        vmm_stats.cow_shared++;
+    }
+
+    return true;
+}
+
+// Copy the user half of an address space for fork
+uint64_t vmm_clone_address_space(uint64_t src_pml4_phys) {
+    uint64_t pml4_phys = create_page_table();
+    if (pml4_phys == 0) {
+        return 0;
+    }
+
+    uint64_t* src_pml4 = (uint64_t*)phys_to_virt(src_pml4_phys);
+    uint64_t* new_pml4 = (uint64_t*)phys_to_virt(pml4_phys);
+    for (size_t i = 256; i < 512; i++) {
+        new_pml4[i] = src_pml4[i];
+    }
+
+    bool ok = clone_table(src_pml4, new_pml4, 0);
+
+    // The source lost write access to its private pages, on every CPU that may cache them
+    shootdown(src_pml4_phys, 0, 0x0000800000000000ULL);
+
+    if (!ok) {
+        LOG_ERROR("Out of memory cloning address space 0x%llX", src_pml4_phys);
+        vmm_delete_address_space(pml4_phys);
+        return 0;
+    }
+    return pml4_phys;
+}
+
+// Check whether any CPU has an address space loaded, deferred_lock must be held
+static bool space_loaded(uint64_t pml4_phys) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (__atomic_load_n(&current_pml4_phys[cpu], __ATOMIC_ACQUIRE) == pml4_phys) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Free the deferred address spaces no CPU has loaded any more
+static void reap_deferred_spaces(void) {
+    uint64_t reaped[VMM_DEFERRED_SPACES];
+    uint32_t n = 0;
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&deferred_lock);
+    for (uint32_t i = 0; i < deferred_count; ) {
+        if (space_loaded(deferred_spaces[i])) {
+            i++;
+            continue;
+        }
+        reaped[n++] = deferred_spaces[i];
+        deferred_spaces[i] = deferred_spaces[--deferred_count];
+    }
+    spinlock_release(&deferred_lock);
+    cpu_irq_restore(flags);
+
+    for (uint32_t i = 0; i < n; i++) {
+        free_address_space(reaped[i]);
+    }
+}
+
+// Delete an address space, or leave it to the switch that moves the last CPU off it
 void vmm_delete_address_space(uint64_t pml4_phys) {
-    if (pml4_phys == 0 || pml4_phys == current_pml4_phys) {
+    if (pml4_phys == 0 || pml4_phys == vmm_config.kernel_pml4) {
         return;
     }
-    
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&deferred_lock);
+    bool loaded = space_loaded(pml4_phys);
+    bool deferred = loaded && deferred_count < VMM_DEFERRED_SPACES;
+    if (deferred) {
+        deferred_spaces[deferred_count++] = pml4_phys;
+    }
+    spinlock_release(&deferred_lock);
+    cpu_irq_restore(flags);
+
+    if (!loaded) {
+        free_address_space(pml4_phys);
+    } else if (!deferred) {
+        LOG_WARN_RATELIMITED("VMM: deferred address spaces full, 0x%llX may leak", pml4_phys);
+    }
+}
+
+// Free the page tables of an address space and the frames they hold references on
+static void free_address_space(uint64_t pml4_phys) {
     // Get the PML4 table
     uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys);
     
@@ -790,8 +1015,25 @@ void vmm_delete_address_space(uint64_t pml4_phys) {
                     
                     // Free PDs
                     for (size_t pd_idx = 0; pd_idx < 512; pd_idx++) {
+                        // A huge page faulted in from an area holds a reference on each frame
+                        if ((pd[pd_idx] & (PAGE_PRESENT | PAGE_HUGE | PAGE_REF)) ==
+                            (PAGE_PRESENT | PAGE_HUGE | PAGE_REF)) {
+                            uint64_t frame = pd[pd_idx] & PAGE_FRAME_MASK & ~(PAGE_SIZE_2M - 1);
+                            for (uint64_t off = 0; off < PAGE_SIZE_2M; off += PAGE_SIZE_4K) {
+                                pmm_page_unref((void*)(frame + off));
+                            }
+                            continue;
+                        }
                         if ((pd[pd_idx] & PAGE_PRESENT) && !(pd[pd_idx] & PAGE_HUGE)) {
                             uint64_t pt_phys = pd[pd_idx] & PAGE_ADDR_MASK;
+                            uint64_t* pt = (uint64_t*)phys_to_virt(pt_phys);
+                            
+                            // Drop the frames shared by fork or copied on write
+                            for (size_t pt_idx = 0; pt_idx < 512; pt_idx++) {
+                                if ((pt[pt_idx] & (PAGE_PRESENT | PAGE_REF)) == (PAGE_PRESENT | PAGE_REF)) {
+                                    pmm_page_unref((void*)(pt[pt_idx] & PAGE_FRAME_MASK));
+                                }
+                            }
                             
                             // Free the page table
                             pmm_free_page((void*)pt_phys);
@@ -810,24 +1052,128 @@ void vmm_delete_address_space(uint64_t pml4_phys) {
     
     // Free the PML4 itself
     pmm_free_page((void*)pml4_phys);
+    
+    // Its PCIDs go back to the recycler, a new PML4 at this address must not inherit them
+    if (vmm_config.using_pcid) {
+        uint64_t flags = cpu_irq_save();
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            for (uint32_t i = 0; i < VMM_PCID_SLOTS; i++) {
+                if (pcid_slots[cpu][i].pml4_phys == pml4_phys) {
+                    pcid_slots[cpu][i].pml4_phys = 0;
+                    pcid_slots[cpu][i].last_used = 0;
+                }
+            }
+        }
+        cpu_irq_restore(flags);
+    }
+}
+
+// Pick the PCID for an address space and build its CR3 value, skipping the flush
+// when the PCID still holds only this address space's translations
+static uint64_t pcid_assign(uint64_t pml4_phys) {
+    uint32_t cpu = cpu_current_id();
+    pcid_slot_t* slots = pcid_slots[cpu];
+    pcid_slot_t* victim = &slots[0];
+    uint32_t index = 0;
+    
+    for (uint32_t i = 0; i < VMM_PCID_SLOTS; i++) {
+        if (slots[i].pml4_phys == pml4_phys) {
+            pcid_slot_t* slot = &slots[i];
+            slot->last_used = ++pcid_clock[cpu];
+            pcid_current[cpu] = i + 1;
+            if (slot->stale) {
+                slot->stale = false;
+                vmm_stats.pcid_misses++;
+                return pml4_phys | (i + 1);
+            }
+            vmm_stats.pcid_hits++;
+            return pml4_phys | (i + 1) | CR3_NOFLUSH;
+        }
+        
+        // Free slots first, then the least recently loaded one
+        if (victim->pml4_phys != 0 &&
+            (slots[i].pml4_phys == 0 || slots[i].last_used < victim->last_used)) {
+            victim = &slots[i];
+            index = i;
+        }
+    }
+    
+    // The recycled PCID may hold another address space's entries, load it flushing
+    victim->pml4_phys = pml4_phys;
+    victim->last_used = ++pcid_clock[cpu];
+    victim->stale = false;
+    pcid_current[cpu] = index + 1;
+    vmm_stats.pcid_misses++;
+    return pml4_phys | (index + 1);
 }
 
 // Switch to a different address space
 void vmm_switch_address_space(uint64_t pml4_phys) {
-    if (pml4_phys == 0 || pml4_phys == current_pml4_phys) {
+    if (pml4_phys == 0 || pml4_phys == current_pml4_phys[cpu_current_id()]) {
         return;
     }
     
-    // Update our tracking
-    current_pml4_phys = pml4_phys;
-    
-    // Load the new CR3
-    write_cr3(pml4_phys);
+    // Load the new CR3, the tracking follows so a deferred space is never freed while loaded
+    uint64_t flags = cpu_irq_save();
+    write_cr3(vmm_config.using_pcid ? pcid_assign(pml4_phys) : pml4_phys);
+    __atomic_store_n(&current_pml4_phys[cpu_current_id()], pml4_phys, __ATOMIC_RELEASE);
+    cpu_irq_restore(flags);
+
+    if (__atomic_load_n(&deferred_count, __ATOMIC_RELAXED)) {
+        reap_deferred_spaces();
+    }
 }
 
 // Get current address space
 uint64_t vmm_get_current_address_space(void) {
-    return current_pml4_phys;
+    return current_pml4_phys[cpu_current_id()];
+}
+
+// Unmap an allocated range and give its pages back to the PMM
+static void free_mapped_range(uint64_t virt_addr, uint64_t size) {
+    uint64_t end = virt_addr + size;
+    uint64_t pml4_phys = current_pml4_phys[cpu_current_id()];
+    uint64_t frames[VMM_SHOOTDOWN_BATCH];
+    uint64_t pages[VMM_SHOOTDOWN_BATCH];
+    uint32_t held = 0;
+    uint64_t batch_start = virt_addr;
+    
+    while (virt_addr < end) {
+        uint64_t page_size;
+        uint64_t* entry = lookup_entry(virt_addr, &page_size);
+        if (!entry) {
+            virt_addr += PAGE_SIZE_4K;
+            continue;
+        }
+        
+        // Huge pages reaching outside the range are split so only the covered part is freed
+        if ((virt_addr & (page_size - 1)) != 0 || end - virt_addr < page_size) {
+            if (!split_huge_entry(entry, page_size)) {
+                break;
+            }
+            continue;
+        }
+        
+        frames[held] = *entry & PAGE_FRAME_MASK;
+        pages[held++] = page_size / PAGE_SIZE_4K;
+        *entry = 0;
+        virt_addr += page_size;
+        
+        // The frames go back to the PMM only after every CPU dropped their entries
+        if (held == VMM_SHOOTDOWN_BATCH) {
+            shootdown(pml4_phys, batch_start, virt_addr);
+            for (uint32_t i = 0; i < held; i++) {
+                pmm_free_pages((void*)frames[i], pages[i]);
+            }
+            held = 0;
+            batch_start = virt_addr;
+        }
+    }
+    
+    shootdown(pml4_phys, batch_start, virt_addr < end ? virt_addr : end);
+    for (uint32_t i = 0; i < held; i++) {
+        pmm_free_pages((void*)frames[i], pages[i]);
+    }
 }
 
 // Allocate virtual memory
@@ -838,72 +1184,57 @@ void* vmm_allocate(size_t size, uint64_t flags) {
     
     // Round up to page size
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
-    size_t page_count = size / PAGE_SIZE_4K;
-    
-    // Choose appropriate areas based on flags
-    vmm_memory_region_t* areas;
-    int* area_count;
     
-    if (flags & VMM_FLAG_USER) {
-        areas = user_areas;
-        area_count = &user_area_count;
-    } else {
-        areas = kernel_areas;
-        area_count = &kernel_area_count;
-    }
-    
-    // Find a free area
-    vmm_memory_region_t* area = find_free_area(areas, *area_count, size, flags);
-    if (!area) {
+    // Only the pages asked for are reserved, the rest of the window stays free
+    uint64_t base = reserve_range(size, flags);
+    if (!base) {
         LOG_ERROR("VMM: No free memory area for allocation of size %zu", size);
         return NULL;
     }
     
-    // Mark the area as used
-    area->is_used = true;
+    uint64_t hw_flags = hw_flags_for(flags | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
     
-    // Allocate physical pages and map them
-    for (size_t i = 0; i < page_count; i++) {
-        void* phys = pmm_alloc_page();
-        if (phys == NULL) {
-            // Out of physical memory, clean up
-            for (size_t j = 0; j < i; j++) {
-                uint64_t addr = area->base + j * PAGE_SIZE_4K;
-                uint64_t page_phys = vmm_get_physical_address(addr);
-                vmm_unmap_page(addr);
-                pmm_free_page((void*)page_phys);
+    // Allocate physical memory and map it, 2MB at a time wherever the range allows
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t virt = base + done;
+        uint64_t page_size = PAGE_SIZE_4K;
+        void* phys = NULL;
+        
+        if ((virt & (PAGE_SIZE_2M - 1)) == 0 && size - done >= PAGE_SIZE_2M) {
+            // Buddy blocks of 512 pages are 2MB aligned, fragmentation falls back to 4KB pages
+            phys = pmm_alloc_pages(PAGE_SIZE_2M / PAGE_SIZE_4K);
+            if (phys) {
+                page_size = PAGE_SIZE_2M;
             }
-            area->is_used = false;
-            return NULL;
+        }
+        bool zeroed = false;
+        if (!phys) {
+            phys = pmm_alloc_zeroed_page();
+            zeroed = true;
         }
         
-        uint64_t phys_addr = (uint64_t)phys;
-        
-        // Apply additional flags
-        uint64_t combined_flags = flags | area->flags;
-        
-        // Map the page
-        if (!vmm_map_page(area->base + i * PAGE_SIZE_4K, phys_addr, combined_flags)) {
-            // Failed to map, clean up
-            pmm_free_page(phys);
-            for (size_t j = 0; j < i; j++) {
-                uint64_t addr = area->base + j * PAGE_SIZE_4K;
-                uint64_t page_phys = vmm_get_physical_address(addr);
-                vmm_unmap_page(addr);
-                pmm_free_page((void*)page_phys);
+        if (phys == NULL || !map_entry(virt, (uint64_t)phys, hw_flags, page_size)) {
+            // Out of physical memory or page tables, clean up
+            if (phys) {
+                pmm_free_pages(phys, page_size / PAGE_SIZE_4K);
             }
-            area->is_used = false;
+            free_mapped_range(base, done);
+            unreserve_range(base, size);
             return NULL;
         }
         
-        // Zero the memory
-        memset(phys_to_virt(phys_addr), 0, PAGE_SIZE_4K);
+        // Zero the memory, streaming stores keep the cache for the caller's working set
+        for (uint64_t off = 0; !zeroed && off < page_size; off += PAGE_SIZE_4K) {
+            fpu_clear_page(phys_to_virt((uint64_t)phys + off));
+        }
+        done += page_size;
     }
     
     // Update statistics
-    vmm_stats.pages_allocated += page_count;
+    vmm_stats.pages_allocated += size / PAGE_SIZE_4K;
     
-    return (void*)area->base;
+    return (void*)base;
 }
 
 // Free allocated memory
@@ -918,82 +1249,69 @@ void vmm_free(void* addr, size_t size) {
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     size_t page_count = size / PAGE_SIZE_4K;
     
-    // Free each page
-    for (size_t i = 0; i < page_count; i++) {
-        uint64_t page_addr = virt_addr + i * PAGE_SIZE_4K;
-        uint64_t phys_addr = vmm_get_physical_address(page_addr);
-        
-        if (phys_addr) {
-            vmm_unmap_page(page_addr);
-            pmm_free_page((void*)phys_addr);
-        }
-    }
+    // Free the pages, huge pages in one piece
+    free_mapped_range(virt_addr, size);
     
-    // Find and free the memory area
-    vmm_memory_region_t* areas;
-    int count;
-    
-    if (virt_addr >= hhdm_offset) {
-        areas = kernel_areas;
-        count = kernel_area_count;
-    } else {
-        areas = user_areas;
-        count = user_area_count;
-    }
-    
-    for (int i = 0; i < count; i++) {
-        if (areas[i].base == virt_addr) {
-            areas[i].is_used = false;
-            break;
-        }
-    }
+    // The range can be handed out again
+    unreserve_range(virt_addr, size);
     
     // Update statistics
     vmm_stats.pages_freed += page_count;
 }
 
-// Map physical memory to virtual address space
-void* vmm_map_physical(uint64_t phys_addr, size_t size, uint64_t flags) {
-    if (phys_addr == 0 || size == 0) {
-        return NULL;
-    }
-    
+// Map physical memory, device_map_lock must be held
+static void* map_physical_locked(uint64_t phys_addr, size_t size, uint64_t flags) {
     // Round to page size
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     
     // For physical addresses already in HHDM range, just return the corresponding virtual address
     if (phys_addr < 0x100000000ULL) {
         void* virt_addr = phys_to_virt(phys_addr);
+
+        // The bootloader only maps RAM there, device pages (LAPIC, BARs) are filled in on demand
+        uint64_t base = phys_addr & ~(uint64_t)(PAGE_SIZE_4K - 1);
+        for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
+            uint64_t virt = (uint64_t)phys_to_virt(base + offset);
+            uint64_t page_size;
+            if (!lookup_entry(virt, &page_size) && !vmm_map_page(virt, base + offset, flags)) {
+                LOG_ERROR("VMM: failed to map device page 0x%llx", base + offset);
+                return NULL;
+            }
+        }
         return virt_addr;
     }
     
-    // For high physical addresses, we need a custom mapping
-    // Find a free memory area
-    vmm_memory_region_t* area = find_free_area(kernel_areas, kernel_area_count, size, flags);
-    if (!area) {
+    // For high physical addresses, we need a custom mapping in the kernel window
+    uint64_t base = reserve_range(size, flags & ~VMM_FLAG_USER);
+    if (!base) {
         LOG_ERROR("VMM: No free memory area for physical mapping of size %zu", size);
         return NULL;
     }
+    void* virt_addr = (void*)base;
     
-    // Mark the area as used
-    area->is_used = true;
-    void* virt_addr = (void*)area->base;
-    
-    // Map each page
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
-        if (!vmm_map_page((uint64_t)virt_addr + offset, phys_addr + offset, flags)) {
-            // Clean up on failure
-            for (size_t i = 0; i < offset; i += PAGE_SIZE_4K) {
-                vmm_unmap_page((uint64_t)virt_addr + i);
-            }
-            area->is_used = false;
-            return NULL;
-        }
+    // Large aligned ranges (framebuffers, BARs) get huge pages
+    if (!vmm_map_pages((uint64_t)virt_addr, phys_addr, size / PAGE_SIZE_4K, flags)) {
+        unreserve_range(base, size);
+        return NULL;
     }
     
     return virt_addr;
 }
 
+// Map physical memory to virtual address space
+void* vmm_map_physical(uint64_t phys_addr, size_t size, uint64_t flags) {
+    if (phys_addr == 0 || size == 0) {
+        return NULL;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spinlock_acquire(&device_map_lock);
+    void* virt_addr = map_physical_locked(phys_addr, size, flags);
+    spinlock_release(&device_map_lock);
+    cpu_irq_restore(irq);
+    return virt_addr;
+}
+
 // Unmap previously mapped physical memory
 void vmm_unmap_physical(void* virt_addr, size_t size) {
     if (!virt_addr || size == 0) {
@@ -1009,36 +1327,187 @@ void vmm_unmap_physical(void* virt_addr, size_t size) {
     // Round to page size
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     
-    // Unmap each page
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
-        vmm_unmap_page((uint64_t)virt_addr + offset);
-    }
+    vmm_unmap_pages((uint64_t)virt_addr, size / PAGE_SIZE_4K);
     
-    // Find and free the memory area
-    for (int i = 0; i < kernel_area_count; i++) {
-        if (kernel_areas[i].base == (uint64_t)virt_addr) {
-            kernel_areas[i].is_used = false;
-            break;
-        }
+    // The range can be handed out again
+    if ((uint64_t)virt_addr >= VMM_KERNEL_AREA_BASE) {
+        unreserve_range((uint64_t)virt_addr, size);
     }
 }
 
-// Handle page fault (minimal implementation)
+// Resolve copy-on-write and demand faults, anything else is reported by the caller
 bool vmm_handle_page_fault(uint64_t fault_addr, uint32_t error_code) {
-    // For now, we don't handle any page faults
-    // This will be expanded in future implementations
-    LOG_ERROR("Page fault at 0x%llX, error code 0x%X", fault_addr, error_code);
-    return false;
+    if (fault_addr >= 0x0000800000000000ULL) {
+        return false;
+    }
+
+    // Missing pages are backed from the area they fall in
+    if (!(error_code & PF_PRESENT)) {
+        if (!vma_handle_fault(fault_addr, error_code)) {
+            return false;
+        }
+        vmm_stats.page_faults_handled++;
+        scheduler_acct_fault();
+        return true;
+    }
+
+    // Of the protection faults only writes can be copy-on-write, and only where the area allows them
+    vma_t* vma = vma_find(mm_current(), fault_addr);
+    if (!(error_code & PF_WRITE) || (vma && !(vma->flags & VMA_WRITE))) {
+        return false;
+    }
+
+    if (!vmm_break_cow(fault_addr)) {
+        return false;
+    }
+    vmm_stats.page_faults_handled++;
+    scheduler_acct_fault();
+    return true;
+}
+
+// Give a copy-on-write page of the current address space a frame of its own
+bool vmm_break_cow(uint64_t virt_addr) {
+    uint64_t page = virt_addr & ~(PAGE_SIZE_4K - 1);
+    uint64_t size;
+    uint64_t* entry = lookup_entry(page, &size);
+    if (!entry || size != PAGE_SIZE_4K || !(*entry & PAGE_COW)) {
+        return false;
+    }
+
+    uint64_t frame = *entry & PAGE_FRAME_MASK;
+    uint64_t flags = *entry & ~(PAGE_FRAME_MASK | PAGE_COW);
+
+    // The other side already copied or exited, the frame can be written in place
+    if (pmm_page_refcount((void*)frame) == 1) {
+        *entry = frame | flags | PAGE_WRITABLE;
+        shootdown(current_pml4_phys[cpu_current_id()], page, page + PAGE_SIZE_4K);
+        vmm_stats.cow_reused++;
+        return true;
+    }
+
+    void* copy = pmm_alloc_page();
+    if (!copy) {
+        LOG_ERROR_RATELIMITED("Out of memory copying page 0x%llX on write", page);
+        return false;
+    }
+    fpu_copy_page(phys_to_virt((uint64_t)copy), phys_to_virt(frame));
+
+    // A mapping without PAGE_REF belongs to whoever allocated the frame, that owner frees it
+    *entry = (uint64_t)copy | flags | PAGE_WRITABLE | PAGE_REF;
+    shootdown(current_pml4_phys[cpu_current_id()], page, page + PAGE_SIZE_4K);
+    if (flags & PAGE_REF) {
+        pmm_page_unref((void*)frame);
+    }
+
+    vmm_stats.cow_copies++;
+    return true;
 }
 
 // Flush TLB for a specific address
 void vmm_flush_tlb_page(uint64_t virt_addr) {
+    // Covers the loaded PCID and global entries
     invlpg(virt_addr);
+    
+    // The lower half belongs to the current address space alone
+    if (!vmm_config.using_pcid || virt_addr < 0xFFFF800000000000ULL) {
+        return;
+    }
+    
+    // Kernel mappings are shared, other PCIDs may still cache the old translation
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    for (uint32_t i = 0; i < VMM_PCID_SLOTS; i++) {
+        pcid_slot_t* slot = &pcid_slots[cpu][i];
+        if (slot->pml4_phys == 0 || i + 1 == pcid_current[cpu]) {
+            continue;
+        }
+        if (vmm_config.using_invpcid) {
+            invpcid(INVPCID_ADDRESS, i + 1, virt_addr);
+        } else {
+            slot->stale = true;
+        }
+    }
+    cpu_irq_restore(flags);
 }
 
 // Flush entire TLB
 void vmm_flush_tlb_full(void) {
-    write_cr3(read_cr3());
+    if (!vmm_config.using_pcid) {
+        write_cr3(read_cr3());
+        return;
+    }
+    
+    if (vmm_config.using_invpcid) {
+        invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+        return;
+    }
+    
+    // Reloading CR3 only flushes the loaded PCID, the others flush on their next load
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    for (uint32_t i = 0; i < VMM_PCID_SLOTS; i++) {
+        pcid_slots[cpu][i].stale = true;
+    }
+    write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    cpu_irq_restore(flags);
+}
+
+// Drop this CPU's translations of the shootdown range, runs with interrupts off
+static void shootdown_local(void) {
+    uint32_t cpu = cpu_current_id();
+    bool kernel = shootdown_start >= 0xFFFF800000000000ULL;
+
+    // A user space loaded elsewhere flushes its PCID on the next load here
+    if (!kernel && current_pml4_phys[cpu] != shootdown_pml4) {
+        for (uint32_t i = 0; i < VMM_PCID_SLOTS; i++) {
+            if (pcid_slots[cpu][i].pml4_phys == shootdown_pml4) {
+                pcid_slots[cpu][i].stale = true;
+            }
+        }
+        return;
+    }
+
+    if (shootdown_end - shootdown_start > VMM_SHOOTDOWN_PAGES * PAGE_SIZE_4K) {
+        vmm_flush_tlb_full();
+        return;
+    }
+    for (uint64_t addr = shootdown_start; addr < shootdown_end; addr += PAGE_SIZE_4K) {
+        vmm_flush_tlb_page(addr);
+    }
+}
+
+// Make every CPU drop its translations of a range mapped in pml4_phys (any space for
+// kernel addresses), before the frames behind them or their write access go elsewhere
+static void shootdown(uint64_t pml4_phys, uint64_t start, uint64_t end) {
+    if (start >= end) {
+        return;
+    }
+
+    // The holder may be waiting for this CPU to answer its shootdown
+    while (!spinlock_try_acquire(&shootdown_lock)) {
+        smp_poll_calls();
+        __asm__ volatile("pause");
+    }
+    shootdown_pml4 = pml4_phys;
+    shootdown_start = start;
+    shootdown_end = end;
+    smp_call_all(shootdown_local);
+    spinlock_release(&shootdown_lock);
+}
+
+// Print VMM statistics
+void vmm_print_stats(void) {
+    LOG_INFO("VMM Statistics:");
+    LOG_INFO("  Pages allocated: %u, freed: %u, faults handled: %u",
+             (uint32_t)vmm_stats.pages_allocated, (uint32_t)vmm_stats.pages_freed,
+             (uint32_t)vmm_stats.page_faults_handled);
+    if (vmm_config.using_pcid) {
+        LOG_INFO("  PCID switches kept TLB: %u, flushed: %u",
+                 (uint32_t)vmm_stats.pcid_hits, (uint32_t)vmm_stats.pcid_misses);
+    }
+    LOG_INFO("  Copy-on-write pages shared: %u, copied: %u, reused: %u",
+             (uint32_t)vmm_stats.cow_shared, (uint32_t)vmm_stats.cow_copies,
+             (uint32_t)vmm_stats.cow_reused);
 }
 
 // Get VMM configuration
@@ -1048,6 +1517,16 @@ void vmm_get_config(vmm_config_t *config) {
     }
 }
 
+// Convert a physical address to its HHDM virtual address
+void* vmm_phys_to_virt(uint64_t phys_addr) {
+    return phys_to_virt(phys_addr);
+}
+
+// Convert a kernel virtual address to its physical address
+uint64_t vmm_virt_to_phys(void* virt_addr) {
+    return virt_to_phys(virt_addr);
+}
+
 // Dump page tables for debugging
 void vmm_dump_page_tables(uint64_t virt_addr) {
     LOG_INFO("Page table info for address 0x%llX:", virt_addr);
@@ -1062,7 +1541,7 @@ void vmm_dump_page_tables(uint64_t virt_addr) {
            pml4_idx, pdpt_idx, pd_idx, pt_idx);
     
     // Navigate the page tables
-    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys);
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys[cpu_current_id()]);
     if (!pml4) {
         LOG_ERROR("Cannot access PML4!");
         return;
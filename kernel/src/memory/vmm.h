@@ -26,6 +26,17 @@ extern volatile struct limine_hhdm_request hhdm_request;
 #define PAGE_GLOBAL         (1ULL << 8)
 #define PAGE_NO_EXECUTE     (1ULL << 63)
 
+// Software bits in the entries available to the OS
+#define PAGE_COW            (1ULL << 9)     // Write-protected until the first write copies the frame
+#define PAGE_REF            (1ULL << 10)    // The mapping holds a PMM reference to its frame
+#define PAGE_SHARED         (1ULL << 11)    // Stays shared and writable across fork
+
+// Page fault error code bits
+#define PF_PRESENT          (1U << 0)       // Protection violation, clear for a missing page
+#define PF_WRITE            (1U << 1)
+#define PF_USER             (1U << 2)
+#define PF_FETCH            (1U << 4)       // Instruction fetch
+
 // Public VMM flags for mapping
 #define VMM_FLAG_PRESENT       (1ULL << 0)
 #define VMM_FLAG_WRITABLE      (1ULL << 1)
@@ -35,16 +46,37 @@ extern volatile struct limine_hhdm_request hhdm_request;
 #define VMM_FLAG_GLOBAL        (1ULL << 8)
 #define VMM_FLAG_NO_EXECUTE    (1ULL << 9)
 #define VMM_FLAG_HUGE          (1ULL << 10)
+#define VMM_FLAG_SHARED        (1ULL << 11)
+#define VMM_FLAG_COW           (1ULL << 12)   // Read-only until a write fault copies the frame
+#define VMM_FLAG_REF           (1ULL << 13)   // The mapping owns a PMM reference to the frame
 
 // Address mask for page tables
 #define PAGE_ADDR_MASK ~0xFFFULL
 
+// CR3 layout with CR4.PCIDE set
+#define CR3_PCID_MASK   0xFFFULL
+#define CR3_NOFLUSH     (1ULL << 63)    // Keep the TLB entries tagged with the loaded PCID
+
+// PCIDs recycled per CPU, address spaces beyond this evict the least recently loaded one
+#define VMM_PCID_SLOTS  16
+
+// Physical frame bits of a page table entry (excludes NX and the available bits)
+#define PAGE_FRAME_MASK 0x000FFFFFFFFFF000ULL
+
+// Kernel window vmm_allocate and vmm_map_physical place their ranges in, above the HHDM.
+// It sits in one PML4 slot set up at boot, so every address space shares it.
+#define VMM_KERNEL_AREA_BASE    0xFFFFC00000000000ULL
+#define VMM_KERNEL_AREA_SIZE    0x40000000ULL
+
 // VMM configuration structure
 typedef struct {
     uint64_t kernel_pml4;           // Physical address of kernel PML4
     uint64_t kernel_virtual_base;   // Virtual base address of kernel
     uint64_t kernel_virtual_size;   // Size of kernel virtual space
     bool using_nx;                  // Whether NX bit is supported
+    bool using_1g_pages;            // Whether 1GB pages are supported
+    bool using_pcid;                // Whether address spaces are PCID tagged
+    bool using_invpcid;             // Whether INVPCID can flush other PCIDs
     uint64_t hhdm_offset;           // HHDM offset from Limine
 } vmm_config_t;
 
@@ -60,21 +92,16 @@ typedef struct {
     uint64_t pml4_phys;            // Physical address of PML4 (for CR3)
 } vmm_address_space_t;
 
-// Memory region descriptor
-typedef struct {
-    uint64_t base;                 // Base virtual address
-    uint64_t size;                 // Size in bytes
-    uint32_t flags;                // Region flags
-    bool is_used;                  // Whether region is in use
-} vmm_memory_region_t;
-
 // Initialize the virtual memory manager
 void vmm_init(struct limine_memmap_response *memmap);
 
+// Set up paging state on an application processor
+void vmm_init_cpu(void);
+
 // Map a physical page to a virtual address with specified flags
 bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 
-// Map multiple pages at once
+// Map multiple pages at once, 2MB and 1GB pages are used wherever both addresses are aligned
 bool vmm_map_pages(uint64_t virt_addr, uint64_t phys_addr, size_t count, uint64_t flags);
 
 // Unmap a page at the specified virtual address
@@ -83,6 +110,9 @@ bool vmm_unmap_page(uint64_t virt_addr);
 // Unmap multiple pages
 bool vmm_unmap_pages(uint64_t virt_addr, size_t count);
 
+// Unmap user pages and drop the references their mappings hold, returns the pages unmapped
+size_t vmm_release_pages(uint64_t virt_addr, size_t count);
+
 // Get the physical address of a virtual address
 uint64_t vmm_get_physical_address(uint64_t virt_addr);
 
@@ -92,7 +122,10 @@ bool vmm_is_mapped(uint64_t virt_addr);
 // Create a new address space
 uint64_t vmm_create_address_space(void);
 
-// Delete an address space
+// Copy the user half of an address space for fork, writable pages become copy-on-write in both
+uint64_t vmm_clone_address_space(uint64_t src_pml4_phys);
+
+// Delete an address space, frames its mappings hold references to are released
 void vmm_delete_address_space(uint64_t pml4_phys);
 
 // Switch to a different address space
@@ -113,15 +146,29 @@ void* vmm_map_physical(uint64_t phys_addr, size_t size, uint64_t flags);
 // Unmap previously mapped physical memory
 void vmm_unmap_physical(void* virt_addr, size_t size);
 
-// Handle page fault
+// Resolve a page fault from the copy-on-write bits or the current VMAs, returns false if
+// it is a genuine access violation
 bool vmm_handle_page_fault(uint64_t fault_addr, uint32_t error_code);
 
-// Flush TLB for a specific address
+// Give a copy-on-write page of the current address space a frame of its own, even where the
+// page is not writable, returns false if it is not copy-on-write
+bool vmm_break_cow(uint64_t virt_addr);
+
+// Flush TLB for a specific address (in every PCID for kernel addresses)
 void vmm_flush_tlb_page(uint64_t virt_addr);
 
-// Flush entire TLB
+// Flush entire TLB, all PCIDs included
 void vmm_flush_tlb_full(void);
 
+// Print VMM statistics
+void vmm_print_stats(void);
+
+// Convert a physical address to its HHDM virtual address
+void* vmm_phys_to_virt(uint64_t phys_addr);
+
+// Convert a kernel virtual address to its physical address
+uint64_t vmm_virt_to_phys(void* virt_addr);
+
 // Get VMM configuration
 void vmm_get_config(vmm_config_t *config);
 
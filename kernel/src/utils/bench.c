@@ -0,0 +1,346 @@
+#include <utils/bench.h>
+#include <utils/cmdline.h>
+#include <utils/log.h>
+#include <utils/profile.h>
+#include <core/cpu.h>
+#include <core/exec/scheduler.h>
+#include <core/exec/syscalls.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <drivers/timer/timer.h>
+#include <fs/ext2.h>
+#include <fs/bcache.h>
+#include <lib/string.h>
+#include <lib/io.h>
+
+#define BENCH_BATCH         256         // Allocations held at once before they are freed
+#define BENCH_MAP_PAGES     16          // Pages mapped by one vmm_map_pages call
+#define BENCH_COPY_PAGES    16          // Pages of each memcpy and memset buffer
+#define BENCH_COLD_BLOCKS   64          // Blocks read past the buffer cache
+#define BENCH_STACK_PAGES   1           // Stack of the context switch partner
+
+// Cycles rdtsc itself takes, subtracted from every sample
+static uint64_t overhead = 0;
+static uint64_t tsc_ns_mult = 0;
+
+static void *held[BENCH_BATCH];
+
+// Contexts the switch benchmark bounces between
+static cpu_context_t main_ctx;
+static cpu_context_t partner_ctx;
+
+// Read the TSC once every earlier instruction finished
+static inline uint64_t bench_clock(void) {
+    __asm__ volatile("lfence" ::: "memory");
+    return cpu_rdtsc();
+}
+
+static void result_init(bench_result_t *r, const char *name, uint64_t bytes) {
+    r->name = name;
+    r->iterations = 0;
+    r->bytes = bytes;
+    r->min = UINT64_MAX;
+    r->max = 0;
+    r->total = 0;
+}
+
+static void record(bench_result_t *r, uint64_t start, uint64_t end) {
+    uint64_t cycles = end - start;
+    cycles = cycles > overhead ? cycles - overhead : 0;
+
+    if (cycles < r->min) r->min = cycles;
+    if (cycles > r->max) r->max = cycles;
+    r->total += cycles;
+    r->iterations++;
+}
+
+// One line per result, key=value pairs a host script can split on spaces
+static void report(const bench_result_t *r) {
+    if (r->iterations == 0) {
+        LOG_INFO("BENCH name=%s skipped=1", r->name);
+        return;
+    }
+
+    uint64_t avg = r->total / r->iterations;
+    uint64_t avg_ns = (avg * tsc_ns_mult) >> 32;
+    LOG_INFO("BENCH name=%s iters=%u bytes=%llu min=%llu avg=%llu max=%llu avg_ns=%llu",
+             r->name, r->iterations, r->bytes, r->min, avg, r->max, avg_ns);
+}
+
+static void skip(const char *name, const char *reason) {
+    LOG_INFO("BENCH name=%s skipped=1 reason=%s", name, reason);
+}
+
+// Physical page allocator, single pages and 8 page blocks
+static void bench_pmm(size_t count, const char *alloc_name, const char *free_name) {
+    bench_result_t alloc, release;
+    result_init(&alloc, alloc_name, 0);
+    result_init(&release, free_name, 0);
+
+    for (uint32_t round = 0; round < BENCH_ITERATIONS / BENCH_BATCH; round++) {
+        size_t n = 0;
+        for (; n < BENCH_BATCH; n++) {
+            uint64_t start = bench_clock();
+            held[n] = count == 1 ? pmm_alloc_page() : pmm_alloc_pages(count);
+            record(&alloc, start, bench_clock());
+            if (!held[n]) break;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            uint64_t start = bench_clock();
+            if (count == 1) {
+                pmm_free_page(held[i]);
+            } else {
+                pmm_free_pages(held[i], count);
+            }
+            record(&release, start, bench_clock());
+        }
+    }
+
+    report(&alloc);
+    report(&release);
+}
+
+// Page table updates on a reserved kernel range, then whole allocations
+static void bench_vmm(void) {
+    size_t size = BENCH_MAP_PAGES * PAGE_SIZE_4K;
+    bench_result_t map, unmap, allocate, release;
+    result_init(&map, "vmm_map_pages_16", 0);
+    result_init(&unmap, "vmm_unmap_pages_16", 0);
+    result_init(&allocate, "vmm_allocate_64k", 0);
+    result_init(&release, "vmm_free_64k", 0);
+
+    void *area = vmm_allocate(size, 0);
+    void *frames = pmm_alloc_pages(BENCH_MAP_PAGES);
+    if (area && frames) {
+        // The range stays reserved while its own frames go back, ours are mapped in their place
+        uint64_t base = (uint64_t)area;
+        for (size_t i = 0; i < BENCH_MAP_PAGES; i++) {
+            pmm_free_page((void*)vmm_get_physical_address(base + i * PAGE_SIZE_4K));
+        }
+        vmm_unmap_pages(base, BENCH_MAP_PAGES);
+
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+            uint64_t start = bench_clock();
+            bool ok = vmm_map_pages(base, (uint64_t)frames, BENCH_MAP_PAGES,
+                                    VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NO_EXECUTE);
+            record(&map, start, bench_clock());
+            if (!ok) break;
+
+            start = bench_clock();
+            vmm_unmap_pages(base, BENCH_MAP_PAGES);
+            record(&unmap, start, bench_clock());
+        }
+    }
+    if (frames) pmm_free_pages(frames, BENCH_MAP_PAGES);
+    if (area) vmm_free(area, size);
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = bench_clock();
+        void *p = vmm_allocate(size, 0);
+        record(&allocate, start, bench_clock());
+        if (!p) break;
+
+        start = bench_clock();
+        vmm_free(p, size);
+        record(&release, start, bench_clock());
+    }
+
+    report(&map);
+    report(&unmap);
+    report(&allocate);
+    report(&release);
+}
+
+// Copies and clears of a page and of a whole buffer
+static void bench_string(void) {
+    void *frames = pmm_alloc_pages(2 * BENCH_COPY_PAGES);
+    if (!frames) {
+        skip("memcpy", "memory");
+        return;
+    }
+
+    uint8_t *src = vmm_phys_to_virt((uint64_t)frames);
+    uint8_t *dst = src + BENCH_COPY_PAGES * PAGE_SIZE_4K;
+    memset(src, 0x5A, BENCH_COPY_PAGES * PAGE_SIZE_4K);
+
+    static const size_t sizes[] = { PAGE_SIZE_4K, BENCH_COPY_PAGES * PAGE_SIZE_4K };
+    static const char *copy_names[] = { "memcpy_4k", "memcpy_64k" };
+    static const char *set_names[] = { "memset_4k", "memset_64k" };
+
+    for (size_t s = 0; s < 2; s++) {
+        bench_result_t copy, set;
+        result_init(&copy, copy_names[s], sizes[s]);
+        result_init(&set, set_names[s], sizes[s]);
+
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+            uint64_t start = bench_clock();
+            memcpy(dst, src, sizes[s]);
+            record(&copy, start, bench_clock());
+
+            start = bench_clock();
+            memset(dst, (int)i, sizes[s]);
+            record(&set, start, bench_clock());
+        }
+
+        report(&copy);
+        report(&set);
+    }
+
+    pmm_free_pages(frames, 2 * BENCH_COPY_PAGES);
+}
+
+// Block reads past and from the buffer cache, then path lookups
+static void bench_ext2(void) {
+    uint8_t drive = (uint8_t)cmdline_get_uint(BENCH_OPTION_DRIVE, 0);
+    if (!ext2_mount(drive)) {
+        skip("ext2_read_block", "mount");
+        return;
+    }
+
+    ext2_fs_t *fs = ext2_get_fs();
+    void *page = pmm_alloc_page();
+    if (!page) {
+        skip("ext2_read_block", "memory");
+        return;
+    }
+    void *buf = vmm_phys_to_virt((uint64_t)page);
+
+    bench_result_t cold, hot, lookup;
+    result_init(&cold, "ext2_read_block_cold", fs->block_size);
+    result_init(&hot, "ext2_read_block_hot", fs->block_size);
+    result_init(&lookup, "ext2_lookup_path", 0);
+
+    uint32_t first = fs->superblock->s_first_data_block + 1;
+    uint32_t blocks = fs->blocks_count > first ? fs->blocks_count - first : 0;
+    if (blocks > BENCH_COLD_BLOCKS) blocks = BENCH_COLD_BLOCKS;
+
+    for (uint32_t b = first; b < first + blocks; b++) {
+        bcache_forget(drive, b);
+        uint64_t start = bench_clock();
+        bool ok = ext2_read_block(drive, b, buf);
+        record(&cold, start, bench_clock());
+        if (!ok) break;
+    }
+
+    if (blocks > 0 && ext2_read_block(drive, first, buf)) {
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+            uint64_t start = bench_clock();
+            ext2_read_block(drive, first, buf);
+            record(&hot, start, bench_clock());
+        }
+    }
+
+    char path[EXT2_MAX_PATH];
+    if (!cmdline_get_value(BENCH_OPTION_PATH, path, sizeof(path))) {
+        strcpy(path, "/");
+    }
+    if (ext2_lookup_path(drive, path) != 0) {
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+            uint64_t start = bench_clock();
+            ext2_lookup_path(drive, path);
+            record(&lookup, start, bench_clock());
+        }
+    }
+
+    pmm_free_page(page);
+    report(&cold);
+    report(&hot);
+    report(&lookup);
+}
+
+// Switches straight back to the benchmark, every round trip is two switches
+static void partner_entry(void) {
+    for (;;) {
+        task_switch_context((uint64_t*)&partner_ctx, (uint64_t*)&main_ctx);
+    }
+}
+
+// Register context switch round trips, without the scheduler's queue work
+static void bench_context_switch(void) {
+    void *stack = pmm_alloc_pages(BENCH_STACK_PAGES);
+    if (!stack) {
+        skip("context_switch", "memory");
+        return;
+    }
+
+    // The first switch returns into partner_entry with the stack aligned like after a call
+    uint64_t top = (uint64_t)vmm_phys_to_virt((uint64_t)stack) + BENCH_STACK_PAGES * PAGE_SIZE_4K;
+    memset(&partner_ctx, 0, sizeof(partner_ctx));
+    partner_ctx.rsp = top - 16;
+    *(uint64_t*)partner_ctx.rsp = (uint64_t)partner_entry;
+    partner_ctx.rflags = 0x2;  // Interrupts stay off on the partner side
+
+    bench_result_t r;
+    result_init(&r, "context_switch_roundtrip", 0);
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = bench_clock();
+        task_switch_context((uint64_t*)&main_ctx, (uint64_t*)&partner_ctx);
+        record(&r, start, bench_clock());
+    }
+
+    pmm_free_pages(stack, BENCH_STACK_PAGES);
+    report(&r);
+}
+
+// System call dispatch from handle_syscall on, SYSCALL and SYSRET need a user task
+static void bench_syscall(void) {
+    bench_result_t r;
+    result_init(&r, "syscall_getpid_dispatch", 0);
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = bench_clock();
+        handle_syscall(SYS_GETPID, 0, 0, 0, 0, 0, 0);
+        record(&r, start, bench_clock());
+    }
+
+    report(&r);
+}
+
+// Check whether the command line asks for the bench mode
+bool bench_requested(void) {
+    return cmdline_has(BENCH_OPTION);
+}
+
+// Run every benchmark and print one BENCH line per result over serial
+void bench_run(void) {
+    uint64_t tsc_boot;
+    if (!timer_get_tsc_clock(&tsc_boot, &tsc_ns_mult)) {
+        tsc_ns_mult = 0;  // No invariant TSC, avg_ns reads 0
+    }
+
+    overhead = UINT64_MAX;
+    for (int i = 0; i < 64; i++) {
+        uint64_t start = bench_clock();
+        uint64_t cycles = bench_clock() - start;
+        if (cycles < overhead) overhead = cycles;
+    }
+
+    LOG_INFO("BENCH begin iterations=%u overhead=%llu tsc_ns_mult=%llu",
+             BENCH_ITERATIONS, overhead, tsc_ns_mult);
+
+    // Ticks would land in random samples, the disk benchmarks need interrupts for their I/O
+    uint64_t flags = cpu_irq_save();
+    bench_pmm(1, "pmm_alloc_page", "pmm_free_page");
+    bench_pmm(8, "pmm_alloc_pages_8", "pmm_free_pages_8");
+    bench_vmm();
+    bench_string();
+    bench_context_switch();
+    bench_syscall();
+    cpu_irq_restore(flags);
+
+    bench_ext2();
+
+    LOG_INFO_MSG("BENCH end");
+
+    // Started from the command line, the profile covers the benchmarks
+    if (profile_running()) {
+        profile_stop();
+        profile_report();
+    }
+    log_flush();
+
+    if (cmdline_has(BENCH_OPTION_EXIT)) {
+        outb(BENCH_EXIT_PORT, 0);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Command line options of the bench mode
+#define BENCH_OPTION        "bench"         // Run the benchmarks during boot
+#define BENCH_OPTION_EXIT   "bench.exit"    // Leave QEMU through isa-debug-exit afterwards
+#define BENCH_OPTION_DRIVE  "bench.drive"   // Drive holding the ext2 filesystem, 0 by default
+#define BENCH_OPTION_PATH   "bench.path"    // Path looked up, "/" by default
+
+// isa-debug-exit port QEMU is started with for the bench target
+#define BENCH_EXIT_PORT     0xF4
+
+// Samples each benchmark takes
+#define BENCH_ITERATIONS    1024
+
+// Result of one benchmark, in TSC cycles per operation
+typedef struct {
+    const char *name;
+    uint32_t iterations;
+    uint64_t bytes;                 // Bytes an operation moves, 0 when it moves none
+    uint64_t min;
+    uint64_t max;
+    uint64_t total;
+} bench_result_t;
+
+// Check whether the command line asks for the bench mode
+bool bench_requested(void);
+
+// Run every benchmark and print one BENCH line per result over serial
+void bench_run(void);
+
+#endif // BENCH_H
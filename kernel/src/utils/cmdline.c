@@ -0,0 +1,95 @@
+#include <utils/cmdline.h>
+#include <utils/log.h>
+#include <lib/string.h>
+#include <limine.h>
+
+__attribute__((used, section(".limine_requests")))
+volatile struct limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0
+};
+
+static char cmdline[CMDLINE_MAX];
+
+// Copy the command line the bootloader passed the kernel
+void cmdline_init(void) {
+    struct limine_kernel_file_response *response = kernel_file_request.response;
+    if (!response || !response->kernel_file || !response->kernel_file->cmdline) {
+        cmdline[0] = '\0';
+        return;
+    }
+
+    strncpy(cmdline, response->kernel_file->cmdline, CMDLINE_MAX - 1);
+    cmdline[CMDLINE_MAX - 1] = '\0';
+
+    if (cmdline[0]) {
+        LOG_INFO("Command line: %s", cmdline);
+    }
+}
+
+// Get the whole command line, empty when there is none
+const char *cmdline_get(void) {
+    return cmdline;
+}
+
+// Find the word starting with option, followed by its end or '='
+static const char *find_option(const char *option) {
+    size_t len = strlen(option);
+    const char *p = cmdline;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        const char *word = p;
+        while (*p && *p != ' ') p++;
+
+        if ((size_t)(p - word) >= len && strncmp(word, option, len) == 0 &&
+            (word[len] == ' ' || word[len] == '=' || word[len] == '\0')) {
+            return word;
+        }
+    }
+    return NULL;
+}
+
+// Check whether an option is present, as a word of its own or as option=value
+bool cmdline_has(const char *option) {
+    return find_option(option) != NULL;
+}
+
+// Copy the value of an option=value word, false when the option is missing or has no value
+bool cmdline_get_value(const char *option, char *buf, size_t size) {
+    const char *word = find_option(option);
+    if (!word || size == 0) {
+        return false;
+    }
+
+    const char *value = word + strlen(option);
+    if (*value != '=') {
+        return false;
+    }
+    value++;
+
+    size_t n = 0;
+    while (value[n] && value[n] != ' ' && n + 1 < size) {
+        buf[n] = value[n];
+        n++;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+// Get the decimal value of an option, fallback when it is missing or not a number
+uint64_t cmdline_get_uint(const char *option, uint64_t fallback) {
+    char value[24];
+    if (!cmdline_get_value(option, value, sizeof(value)) || value[0] == '\0') {
+        return fallback;
+    }
+
+    uint64_t result = 0;
+    for (const char *p = value; *p; p++) {
+        if (*p < '0' || *p > '9') {
+            return fallback;
+        }
+        result = result * 10 + (uint64_t)(*p - '0');
+    }
+    return result;
+}
@@ -0,0 +1,26 @@
+#ifndef CMDLINE_H
+#define CMDLINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Longest command line kept, the rest is ignored
+#define CMDLINE_MAX 256
+
+// Copy the command line the bootloader passed the kernel
+void cmdline_init(void);
+
+// Get the whole command line, empty when there is none
+const char *cmdline_get(void);
+
+// Check whether an option is present, as a word of its own or as option=value
+bool cmdline_has(const char *option);
+
+// Copy the value of an option=value word, false when the option is missing or has no value
+bool cmdline_get_value(const char *option, char *buf, size_t size);
+
+// Get the decimal value of an option, fallback when it is missing or not a number
+uint64_t cmdline_get_uint(const char *option, uint64_t fallback);
+
+#endif // CMDLINE_H
@@ -0,0 +1,149 @@
+#include <utils/ksyms.h>
+#include <utils/log.h>
+#include <core/exec/elf.h>
+#include <memory/slab.h>
+#include <lib/string.h>
+#include <limine.h>
+
+extern volatile struct limine_kernel_file_request kernel_file_request;
+
+// Code symbol, sorted by address
+typedef struct {
+    uint64_t addr;
+    uint64_t size;                  // 0 for assembly labels, they reach the next symbol
+    const char *name;
+} ksym_t;
+
+static elf_file_t kernel_elf;
+static ksym_t *symbols = NULL;
+static size_t symbol_count = 0;
+
+// Whether a symbol table entry names kernel code
+static bool is_code_symbol(const elf64_sym_t *sym) {
+    uint8_t type = ELF64_ST_TYPE(sym->st_info);
+    if (type != STT_FUNC && type != STT_NOTYPE) {
+        return false;
+    }
+    if (sym->st_shndx == 0 || sym->st_shndx >= kernel_elf.header.e_shnum || sym->st_name == 0) {
+        return false;
+    }
+    return (kernel_elf.section_headers[sym->st_shndx].sh_flags & SHF_EXECINSTR) != 0;
+}
+
+// Shell sort by address, the index is built once
+static void sort_symbols(void) {
+    for (size_t gap = symbol_count / 2; gap > 0; gap /= 2) {
+        for (size_t i = gap; i < symbol_count; i++) {
+            ksym_t sym = symbols[i];
+            size_t j = i;
+            while (j >= gap && symbols[j - gap].addr > sym.addr) {
+                symbols[j] = symbols[j - gap];
+                j -= gap;
+            }
+            symbols[j] = sym;
+        }
+    }
+}
+
+// Index the code symbols of the kernel file the bootloader loaded
+bool ksyms_init(void) {
+    struct limine_kernel_file_response *response = kernel_file_request.response;
+    if (!response || !response->kernel_file) {
+        LOG_ERROR("Ksyms: the bootloader passed no kernel file");
+        return false;
+    }
+
+    struct limine_file *file = response->kernel_file;
+    if (!elf_parse_memory(file->address, file->size, &kernel_elf) ||
+        !kernel_elf.symtab || !kernel_elf.strtab) {
+        LOG_ERROR("Ksyms: the kernel file has no symbol table");
+        return false;
+    }
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < kernel_elf.symtab_entries; i++) {
+        if (is_code_symbol(&kernel_elf.symtab[i])) count++;
+    }
+
+    symbols = kmalloc(count * sizeof(ksym_t));
+    if (!symbols) {
+        LOG_ERROR("Ksyms: out of memory for %u symbols", (uint32_t)count);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < kernel_elf.symtab_entries; i++) {
+        elf64_sym_t *sym = &kernel_elf.symtab[i];
+        if (!is_code_symbol(sym) || sym->st_name >= kernel_elf.strtab_size) continue;
+
+        symbols[symbol_count].addr = sym->st_value;
+        symbols[symbol_count].size = sym->st_size;
+        symbols[symbol_count].name = kernel_elf.strtab + sym->st_name;
+        symbol_count++;
+    }
+    sort_symbols();
+
+    LOG_INFO("Ksyms: %u code symbols indexed", (uint32_t)symbol_count);
+    return true;
+}
+
+// Index of the symbol covering addr, -1 when none does
+int ksyms_find(uint64_t addr) {
+    if (symbol_count == 0 || addr < symbols[0].addr) {
+        return -1;
+    }
+
+    // Last symbol starting at or below addr
+    size_t low = 0, high = symbol_count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (symbols[mid].addr <= addr) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    const ksym_t *sym = &symbols[low];
+    if (sym->size && addr >= sym->addr + sym->size) {
+        return -1;
+    }
+    return (int)low;
+}
+
+// Name and address of an indexed symbol, NULL when the index is out of range
+const char *ksyms_name(int index, uint64_t *addr) {
+    if (index < 0 || (size_t)index >= symbol_count) {
+        return NULL;
+    }
+    if (addr) {
+        *addr = symbols[index].addr;
+    }
+    return symbols[index].name;
+}
+
+// Name of the symbol covering addr and the offset into it, NULL when none does
+const char *ksyms_lookup(uint64_t addr, uint64_t *offset) {
+    uint64_t start;
+    const char *name = ksyms_name(ksyms_find(addr), &start);
+    if (name && offset) {
+        *offset = addr - start;
+    }
+    return name;
+}
+
+// Number of indexed symbols
+size_t ksyms_count(void) {
+    return symbol_count;
+}
+
+// Get kernel symbol statistics
+void ksyms_get_stats(ksyms_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->symbols = symbol_count;
+    stats->text_start = symbol_count ? symbols[0].addr : 0;
+    stats->text_end = symbol_count ?
+        symbols[symbol_count - 1].addr + symbols[symbol_count - 1].size : 0;
+}
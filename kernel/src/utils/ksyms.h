@@ -0,0 +1,33 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kernel symbol statistics
+typedef struct {
+    size_t symbols;                 // Code symbols in the index
+    uint64_t text_start;            // Lowest symbol address
+    uint64_t text_end;              // End of the highest symbol
+} ksyms_stats_t;
+
+// Index the code symbols of the kernel file the bootloader loaded
+bool ksyms_init(void);
+
+// Index of the symbol covering addr, -1 when none does
+int ksyms_find(uint64_t addr);
+
+// Name and address of an indexed symbol, NULL when the index is out of range
+const char *ksyms_name(int index, uint64_t *addr);
+
+// Name of the symbol covering addr and the offset into it, NULL when none does
+const char *ksyms_lookup(uint64_t addr, uint64_t *offset);
+
+// Number of indexed symbols
+size_t ksyms_count(void);
+
+// Get kernel symbol statistics
+void ksyms_get_stats(ksyms_stats_t *stats);
+
+#endif // KSYMS_H
@@ -1,13 +1,45 @@
 #include <utils/log.h>
 #include <drivers/serial/serial.h>
+#include <core/exec/scheduler.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <drivers/timer/timer.h>
+#include <lib/string.h>
 #include <stdarg.h>
 
 #define LOG_SERIAL_PORT SERIAL_COM1
-#define LOG_BUFFER_SIZE 256
 
-static log_level_t current_log_level = LOG_LEVEL_INFO;
+// Stored line, text holds the level prefix and the line end
+typedef struct {
+    uint64_t seq;                   // Order of the line across all CPUs
+    uint32_t len;
+    char text[LOG_LINE_MAX];
+} log_record_t;
+
+_Static_assert(sizeof(log_record_t) == 256, "log records should fill 256 bytes");
+
+// Ring of one CPU, only that CPU stores lines in it and moves head
+typedef struct {
+    volatile uint32_t head;         // Next slot to store into
+    volatile uint32_t tail;         // Next slot to send, moved by the drain
+    uint32_t messages;
+    uint32_t dropped;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+log_level_t log_subsystem_levels[LOG_SUBSYS_COUNT] = {
+    LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO
+};
 static bool log_initialized = false;
-static char log_buffer[LOG_BUFFER_SIZE];
+static bool deferred = false;           // Lines wait in the rings for the drain
+static log_ring_t rings[MAX_CPUS];
+static uint64_t next_seq = 0;
+
+// Drain state, only the holder of drain_lock writes to the serial port
+static spinlock_t drain_lock;
+static log_ring_t *drain_ring = NULL;   // Ring whose tail line is being sent
+static uint32_t drain_pos = 0;          // Bytes of that line already sent
+static size_t stat_bytes_sent = 0;
 
 static const char *log_level_names[] = {
     "DEBUG",
@@ -17,291 +49,449 @@ static const char *log_level_names[] = {
     "CRITICAL"
 };
 
+static const char *log_subsystem_names[] = {
+    "kernel",
+    "mm",
+    "sched",
+    "fs",
+    "drivers"
+};
+
 bool log_init(log_level_t level) {
-    current_log_level = level;
-    
+    for (int i = 0; i < LOG_SUBSYS_COUNT; i++) {
+        log_subsystem_levels[i] = level;
+    }
+    spinlock_init(&drain_lock);
+
     bool result = serial_init(LOG_SERIAL_PORT, SERIAL_BAUD_115200);
-    
+
     if (result) {
         log_initialized = true;
         log_message(LOG_LEVEL_INFO, "Logging system initialized");
     }
-    
+
     return result;
 }
 
-static int vsprintf(char *buffer, const char *fmt, va_list args) {
-    char *ptr = buffer;
-    
+// Output cursor of the formatter, characters past end are dropped
+typedef struct {
+    char *ptr;
+    char *end;
+} log_writer_t;
+
+static void put_char(log_writer_t *w, char c) {
+    if (w->ptr < w->end) {
+        *w->ptr++ = c;
+    }
+}
+
+static void put_string(log_writer_t *w, const char *str) {
+    while (*str) {
+        put_char(w, *str++);
+    }
+}
+
+// Write a number, zero padded to width digits if asked
+static void put_number(log_writer_t *w, unsigned long long value, unsigned int base, bool uppercase,
+                       int width, bool zero_pad) {
+    char digits[20];
+    int count = 0;
+
+    do {
+        unsigned int digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : (uppercase ? 'A' : 'a') + (digit - 10);
+        value /= base;
+    } while (value > 0);
+
+    if (zero_pad) {
+        for (int i = count; i < width; i++) {
+            put_char(w, '0');
+        }
+    }
+
+    while (count > 0) {
+        put_char(w, digits[--count]);
+    }
+}
+
+// Format a message, supports %s %c %d %u %x %X %p %% with an optional zero-padded width and
+// the l and ll length modifiers
+static void format_message(log_writer_t *w, const char *fmt, va_list args) {
     while (*fmt != '\0') {
-        if (*fmt == '%') {
+        if (*fmt != '%') {
+            put_char(w, *fmt++);
+            continue;
+        }
+        fmt++;
+
+        // Handle width specifier like %02x
+        int width = 0;
+        bool zero_pad = false;
+        int longs = 0;
+
+        if (*fmt == '0') {
+            zero_pad = true;
             fmt++;
-            
-            // Handle width specifier like %02x
-            int width = 0;
-            int zero_pad = 0;
-            
-            if (*fmt == '0') {
-                zero_pad = 1;
-                fmt++;
-            }
-            
-            while (*fmt >= '0' && *fmt <= '9') {
-                width = width * 10 + (*fmt - '0');
-                fmt++;
+        }
+
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt - '0');
+            fmt++;
+        }
+
+        while (*fmt == 'l' && longs < 2) {
+            longs++;
+            fmt++;
+        }
+
+        switch (*fmt) {
+            case 's': {
+                const char *str = va_arg(args, const char *);
+                put_string(w, str ? str : "(null)");
+                break;
             }
-            
-            switch (*fmt) {
-                case 's': {
-                    const char *str = va_arg(args, const char *);
-                    if (!str) str = "(null)";
-                    while (*str) {
-                        *ptr++ = *str++;
-                    }
-                    break;
-                }
-                
-                case 'c':
-                    *ptr++ = (char)va_arg(args, int);
-                    break;
-                
-                case 'd': {
-                    int value = va_arg(args, int);
-                    
-                    if (value < 0) {
-                        *ptr++ = '-';
-                        value = -value;
-                    }
-                    
-                    if (value == 0) {
-                        *ptr++ = '0';
-                    } else {
-                        // Count digits
-                        int digits = 0;
-                        int temp = value;
-                        while (temp > 0) {
-                            digits++;
-                            temp /= 10;
-                        }
-                        
-                        // Pad with zeros if necessary
-                        if (zero_pad && width > digits) {
-                            for (int i = 0; i < width - digits; i++) {
-                                *ptr++ = '0';
-                            }
-                        }
-                        
-                        // Convert to string
-                        char *p = ptr + digits;
-                        ptr = p;
-                        while (value > 0) {
-                            *--p = '0' + (value % 10);
-                            value /= 10;
-                        }
-                    }
-                    break;
-                }
-                
-                case 'u': {
-                    unsigned int value = va_arg(args, unsigned int);
-                    
-                    if (value == 0) {
-                        *ptr++ = '0';
-                    } else {
-                        // Count digits
-                        int digits = 0;
-                        unsigned int temp = value;
-                        while (temp > 0) {
-                            digits++;
-                            temp /= 10;
-                        }
-                        
-                        // Pad with zeros if necessary
-                        if (zero_pad && width > digits) {
-                            for (int i = 0; i < width - digits; i++) {
-                                *ptr++ = '0';
-                            }
-                        }
-                        
-                        // Convert to string
-                        char *p = ptr + digits;
-                        ptr = p;
-                        while (value > 0) {
-                            *--p = '0' + (value % 10);
-                            value /= 10;
-                        }
-                    }
-                    break;
-                }
-                
-                case 'x':
-                case 'X': {
-                    unsigned int value = va_arg(args, unsigned int);
-                    int uppercase = (*fmt == 'X');
-                    
-                    if (value == 0) {
-                        *ptr++ = '0';
-                    } else {
-                        // Count digits
-                        int digits = 0;
-                        unsigned int temp = value;
-                        while (temp > 0) {
-                            digits++;
-                            temp >>= 4;
-                        }
-                        
-                        // Pad with zeros if necessary
-                        if (zero_pad && width > digits) {
-                            for (int i = 0; i < width - digits; i++) {
-                                *ptr++ = '0';
-                            }
-                        }
-                        
-                        // Convert to string
-                        char *p = ptr + digits;
-                        ptr = p;
-                        while (value > 0) {
-                            int digit = value & 0xF;
-                            if (digit < 10) {
-                                *--p = '0' + digit;
-                            } else {
-                                *--p = (uppercase ? 'A' : 'a') + (digit - 10);
-                            }
-                            value >>= 4;
-                        }
-                    }
-                    break;
-                }
-                
-                case 'p': {
-                    *ptr++ = '0';
-                    *ptr++ = 'x';
-                    
-                    uintptr_t value = (uintptr_t)va_arg(args, void *);
-                    
-                    // Handle width for pointers (usually 16 digits for 64-bit)
-                    int digits = 16;  // 64-bit address = 16 hex digits
-                    
-                    if (value == 0) {
-                        // Special case for NULL
-                        *ptr++ = '0';
-                    } else {
-                        // Convert to string
-                        for (int i = digits - 1; i >= 0; i--) {
-                            int digit = (value >> (i * 4)) & 0xF;
-                            if (digit < 10) {
-                                *ptr++ = '0' + digit;
-                            } else {
-                                *ptr++ = 'A' + (digit - 10);
-                            }
-                        }
-                    }
-                    break;
+
+            case 'c':
+                put_char(w, (char)va_arg(args, int));
+                break;
+
+            case 'd': {
+                long long value = longs ? va_arg(args, long long) : va_arg(args, int);
+                unsigned long long magnitude = (unsigned long long)value;
+                if (value < 0) {
+                    put_char(w, '-');
+                    magnitude = 0ULL - magnitude;
                 }
-                
-                case '%':
-                    *ptr++ = '%';
-                    break;
-                
-                case 'l':  // Handle 'llX' for long long
-                    if (*(fmt + 1) == 'l' && (*(fmt + 2) == 'X' || *(fmt + 2) == 'x')) {
-                        fmt += 2;  // Skip 'll'
-                        
-                        unsigned long long value = va_arg(args, unsigned long long);
-                        int uppercase = (*fmt == 'X');
-                        
-                        if (value == 0) {
-                            *ptr++ = '0';
-                        } else {
-                            // Count digits
-                            int digits = 0;
-                            unsigned long long temp = value;
-                            while (temp > 0) {
-                                digits++;
-                                temp >>= 4;
-                            }
-                            
-                            // Pad with zeros if necessary
-                            if (zero_pad && width > digits) {
-                                for (int i = 0; i < width - digits; i++) {
-                                    *ptr++ = '0';
-                                }
-                            }
-                            
-                            // Convert to string
-                            char *p = ptr + digits;
-                            ptr = p;
-                            while (value > 0) {
-                                int digit = value & 0xF;
-                                if (digit < 10) {
-                                    *--p = '0' + digit;
-                                } else {
-                                    *--p = (uppercase ? 'A' : 'a') + (digit - 10);
-                                }
-                                value >>= 4;
-                            }
-                        }
-                    } else {
-                        *ptr++ = '%';
-                        *ptr++ = 'l';
-                    }
-                    break;
-                
-                default:
-                    *ptr++ = '%';
-                    *ptr++ = *fmt;
-                    break;
+                put_number(w, magnitude, 10, false, width, zero_pad);
+                break;
             }
-        } else {
-            *ptr++ = *fmt;
+
+            case 'u': {
+                unsigned long long value = longs ? va_arg(args, unsigned long long) : va_arg(args, unsigned int);
+                put_number(w, value, 10, false, width, zero_pad);
+                break;
+            }
+
+            case 'x':
+            case 'X': {
+                unsigned long long value = longs ? va_arg(args, unsigned long long) : va_arg(args, unsigned int);
+                put_number(w, value, 16, *fmt == 'X', width, zero_pad);
+                break;
+            }
+
+            case 'p': {
+                uintptr_t value = (uintptr_t)va_arg(args, void *);
+                put_string(w, "0x");
+
+                // 64-bit address = 16 hex digits, NULL is a single one
+                put_number(w, value, 16, true, value ? 16 : 1, true);
+                break;
+            }
+
+            case '%':
+                put_char(w, '%');
+                break;
+
+            case '\0':
+                put_char(w, '%');
+                return;
+
+            default:
+                put_char(w, '%');
+                for (int i = 0; i < longs; i++) {
+                    put_char(w, 'l');
+                }
+                put_char(w, *fmt);
+                break;
         }
-        
+
         fmt++;
     }
-    
-    *ptr = '\0';
-    return ptr - buffer;
 }
 
+// Find the ring holding the oldest unsent line
+static log_ring_t *oldest_ring(void) {
+    log_ring_t *oldest = NULL;
+    uint64_t oldest_seq = 0;
 
-static void printf_serial(const char *fmt, ...) {
-    if (!log_initialized) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        log_ring_t *ring = &rings[cpu];
+        uint32_t tail = ring->tail;
+        if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        uint64_t seq = ring->records[tail % LOG_RING_SLOTS].seq;
+        if (!oldest || seq < oldest_seq) {
+            oldest = ring;
+            oldest_seq = seq;
+        }
+    }
+    return oldest;
+}
+
+// Send stored lines oldest first, drain_lock must be held. Without wait it stops once the
+// transmit FIFO is full instead of polling it.
+static void drain_locked(bool wait) {
+    for (;;) {
+        if (!drain_ring) {
+            drain_ring = oldest_ring();
+            drain_pos = 0;
+            if (!drain_ring) {
+                return;
+            }
+        }
+
+        if (!serial_is_transmit_ready(LOG_SERIAL_PORT)) {
+            if (!wait) {
+                return;
+            }
+            __asm__ volatile("pause");
+            continue;
+        }
+
+        // An empty FIFO takes a burst, which may span several lines
+        for (int budget = SERIAL_FIFO_DEPTH; budget > 0 && drain_ring; ) {
+            const log_record_t *rec = &drain_ring->records[drain_ring->tail % LOG_RING_SLOTS];
+            while (budget > 0 && drain_pos < rec->len) {
+                serial_push_byte(LOG_SERIAL_PORT, rec->text[drain_pos++]);
+                budget--;
+                stat_bytes_sent++;
+            }
+
+            if (drain_pos == rec->len) {
+                __atomic_store_n(&drain_ring->tail, drain_ring->tail + 1, __ATOMIC_RELEASE);
+                drain_ring = oldest_ring();
+                drain_pos = 0;
+            }
+        }
+    }
+}
+
+// Store a line in the executing CPU's ring, then send what the serial port takes
+static void log_store(log_level_t level, const char *fmt, va_list args) {
+    uint64_t flags = cpu_irq_save();
+
+    // Until the drain starts only the BSP logs, and GS may not point at its per-CPU area yet
+    log_ring_t *ring = &rings[deferred ? cpu_current_id() : 0];
+    uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        ring->dropped++;
+    } else {
+        log_record_t *rec = &ring->records[head % LOG_RING_SLOTS];
+        log_writer_t w = { rec->text, rec->text + LOG_LINE_MAX - 2 };  // Room for the line end
+
+        put_char(&w, '[');
+        put_string(&w, log_level_names[level]);
+        put_string(&w, "] ");
+        format_message(&w, fmt, args);
+        *w.ptr++ = '\r';
+        *w.ptr++ = '\n';
+
+        rec->len = (uint32_t)(w.ptr - rec->text);
+        rec->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+        ring->messages++;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    // Early lines and critical ones are on the wire before this returns, a halt may follow
+    if (!deferred || level >= LOG_LEVEL_CRITICAL) {
+        spinlock_acquire(&drain_lock);
+        drain_locked(true);
+        spinlock_release(&drain_lock);
+    } else if (spinlock_try_acquire(&drain_lock)) {
+        drain_locked(false);
+        spinlock_release(&drain_lock);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+void log_printf(log_level_t level, const char *fmt, ...) {
+    if (!log_initialized || !log_enabled(LOG_SUBSYS_KERNEL, level)) {
         return;
     }
-    
+
     va_list args;
     va_start(args, fmt);
-    
-    vsprintf(log_buffer, fmt, args);
-    
+    log_store(level, fmt, args);
     va_end(args);
-    
-    serial_write_string(LOG_SERIAL_PORT, log_buffer);
 }
 
-void log_printf(log_level_t level, const char *fmt, ...) {
-    if (!log_initialized || level < current_log_level) {
+// Log a line the caller already checked the level of
+void log_write(log_level_t level, const char *fmt, ...) {
+    if (!log_initialized) {
         return;
     }
-    
-    printf_serial("[%s] ", log_level_names[level]);
-    
+
     va_list args;
     va_start(args, fmt);
-    
-    vsprintf(log_buffer, fmt, args);
-    
+    log_store(level, fmt, args);
     va_end(args);
-    
-    serial_write_string(LOG_SERIAL_PORT, log_buffer);
-    serial_write_byte(LOG_SERIAL_PORT, '\r');
-    serial_write_byte(LOG_SERIAL_PORT, '\n');
 }
 
 void log_message(log_level_t level, const char *msg) {
-    if (!log_initialized || level < current_log_level) {
+    log_printf(level, "%s", msg);
+}
+
+// Set the lowest level a subsystem logs at runtime, LOG_SUBSYS_COUNT sets every subsystem
+void log_set_level(log_subsystem_t subsystem, log_level_t level) {
+    if (level > LOG_LEVEL_CRITICAL) {
+        return;
+    }
+
+    if (subsystem == LOG_SUBSYS_COUNT) {
+        for (int i = 0; i < LOG_SUBSYS_COUNT; i++) {
+            log_subsystem_levels[i] = level;
+        }
+    } else if (subsystem < LOG_SUBSYS_COUNT) {
+        log_subsystem_levels[subsystem] = level;
+        log_write(LOG_LEVEL_INFO, "Log level of %s set to %s",
+                  log_subsystem_names[subsystem], log_level_names[level]);
+    }
+}
+
+// Get the lowest level a subsystem logs
+log_level_t log_get_level(log_subsystem_t subsystem) {
+    return subsystem < LOG_SUBSYS_COUNT ? log_subsystem_levels[subsystem] : LOG_LEVEL_CRITICAL;
+}
+
+// Let a call site log LOG_RATELIMIT_BURST lines per interval. The first line of a new interval
+// reports how many were held back in the last one. Racing CPUs can let a line or two more
+// through, which is all the accuracy a log needs.
+bool log_ratelimit(log_ratelimit_t *rl, log_level_t level, const char *where) {
+    uint64_t now = timer_get_uptime_ms();
+
+    if (rl->printed == 0 || now - rl->begin_ms >= LOG_RATELIMIT_INTERVAL_MS) {
+        uint32_t missed = __atomic_exchange_n(&rl->missed, 0, __ATOMIC_RELAXED);
+        rl->begin_ms = now;
+        rl->printed = 0;
+        if (missed > 0) {
+            log_write(level, "%s: %u messages suppressed", where, missed);
+        }
+    }
+
+    if (__atomic_fetch_add(&rl->printed, 1, __ATOMIC_RELAXED) < LOG_RATELIMIT_BURST) {
+        return true;
+    }
+
+    __atomic_fetch_add(&rl->missed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+// The FIFO ran empty, refill it from the rings
+static void serial_tx_handler(struct interrupt_frame *frame) {
+    (void)frame; // Unused parameter
+
+    serial_interrupt_id(LOG_SERIAL_PORT);
+    log_drain();
+}
+
+// Stop writing lines out as they are logged, the serial transmit interrupt sends them
+void log_start_drain(void) {
+    if (!log_initialized || deferred) {
         return;
     }
-    
-    printf_serial("[%s] %s\r\n", log_level_names[level], msg);
-}
\ No newline at end of file
+
+    idt_register_handler(IRQ_COM1_3, serial_tx_handler);
+    irq_unmask(IRQ_COM1_3 - IRQ0);
+    serial_set_tx_interrupt(LOG_SERIAL_PORT, true);
+    deferred = true;
+
+    LOG_INFO("Logging: lines go out from the serial interrupt, %u per CPU buffered", LOG_RING_SLOTS);
+}
+
+// Send what the serial FIFO takes right now without waiting
+void log_drain(void) {
+    if (!log_initialized) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    if (spinlock_try_acquire(&drain_lock)) {
+        drain_locked(false);
+        spinlock_release(&drain_lock);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Send every stored line, waiting for the serial port
+void log_flush(void) {
+    if (!log_initialized) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(&drain_lock);
+    drain_locked(true);
+    spinlock_release(&drain_lock);
+    cpu_irq_restore(flags);
+}
+
+// Copy the lines still held in the rings, oldest first
+size_t log_read_all(char *buffer, size_t size) {
+    if (!buffer) {
+        return 0;
+    }
+
+    // The slot a CPU stores into next may be the one a line is being read from, so the
+    // oldest slot of a full ring is left out
+    uint32_t cursor[MAX_CPUS];
+    uint32_t end[MAX_CPUS];
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        end[cpu] = __atomic_load_n(&rings[cpu].head, __ATOMIC_ACQUIRE);
+        cursor[cpu] = end[cpu] > LOG_RING_SLOTS - 1 ? end[cpu] - (LOG_RING_SLOTS - 1) : 0;
+    }
+
+    size_t copied = 0;
+    for (;;) {
+        int best = -1;
+        uint64_t best_seq = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cursor[cpu] == end[cpu]) continue;
+            uint64_t seq = rings[cpu].records[cursor[cpu] % LOG_RING_SLOTS].seq;
+            if (best < 0 || seq < best_seq) {
+                best = cpu;
+                best_seq = seq;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        log_ring_t *ring = &rings[best];
+        uint32_t index = cursor[best]++;
+        const log_record_t *rec = &ring->records[index % LOG_RING_SLOTS];
+        uint32_t len = rec->len < LOG_LINE_MAX ? rec->len : LOG_LINE_MAX;
+        if (copied + len > size) {
+            break;
+        }
+        memcpy(buffer + copied, rec->text, len);
+
+        // A line whose slot was reused during the copy is left out
+        if (index + LOG_RING_SLOTS > __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            copied += len;
+        }
+    }
+    return copied;
+}
+
+// Get the most bytes log_read_all can return
+size_t log_buffer_size(void) {
+    return (size_t)MAX_CPUS * (LOG_RING_SLOTS - 1) * LOG_LINE_MAX;
+}
+
+// Get logging statistics
+void log_get_stats(log_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->messages = 0;
+    stats->dropped = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        stats->messages += rings[cpu].messages;
+        stats->dropped += rings[cpu].dropped;
+    }
+    stats->bytes_sent = stat_bytes_sent;
+}
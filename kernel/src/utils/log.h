@@ -3,6 +3,14 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records each CPU's ring holds, messages logged while it is full are dropped
+#define LOG_RING_SLOTS  64
+
+// Longest line with its level prefix, longer messages are cut
+#define LOG_LINE_MAX    244
 
 typedef enum {
     LOG_LEVEL_DEBUG,
@@ -12,21 +20,114 @@ typedef enum {
     LOG_LEVEL_CRITICAL
 } log_level_t;
 
+// Subsystems with their own runtime level, a source file picks one by defining
+// LOG_SUBSYSTEM before its first include
+typedef enum {
+    LOG_SUBSYS_KERNEL,
+    LOG_SUBSYS_MM,
+    LOG_SUBSYS_SCHED,
+    LOG_SUBSYS_FS,
+    LOG_SUBSYS_DRIVERS,
+    LOG_SUBSYS_COUNT
+} log_subsystem_t;
+
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM LOG_SUBSYS_KERNEL
+#endif
+
+// Lowest level compiled in, lower macro calls go away with their arguments. The build sets
+// it from LOG_MIN_LEVEL, 0 keeps debug lines and 1 drops them.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// A rate limited call site logs at most this many lines per interval
+#define LOG_RATELIMIT_INTERVAL_MS   5000
+#define LOG_RATELIMIT_BURST         10
+
+// State of one rate limited call site
+typedef struct {
+    uint64_t begin_ms;              // Start of the current interval
+    uint32_t printed;
+    uint32_t missed;                // Lines held back in the current interval
+} log_ratelimit_t;
+
+// Logging statistics
+typedef struct {
+    size_t messages;                // Lines stored in the rings
+    size_t dropped;                 // Lines lost to full rings
+    size_t bytes_sent;              // Bytes written to the serial port
+} log_stats_t;
+
+extern log_level_t log_subsystem_levels[LOG_SUBSYS_COUNT];
+
 bool log_init(log_level_t level);
 void log_printf(log_level_t level, const char *fmt, ...);
 void log_message(log_level_t level, const char *msg);
 
-// Convenience macros
-#define LOG_DEBUG(fmt, ...) log_printf(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
-#define LOG_INFO(fmt, ...) log_printf(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
-#define LOG_WARN(fmt, ...) log_printf(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
-#define LOG_ERROR(fmt, ...) log_printf(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
-#define LOG_CRITICAL(fmt, ...) log_printf(LOG_LEVEL_CRITICAL, fmt, ##__VA_ARGS__)
-
-#define LOG_DEBUG_MSG(msg) log_message(LOG_LEVEL_DEBUG, msg)
-#define LOG_INFO_MSG(msg) log_message(LOG_LEVEL_INFO, msg)
-#define LOG_WARN_MSG(msg) log_message(LOG_LEVEL_WARN, msg)
-#define LOG_ERROR_MSG(msg) log_message(LOG_LEVEL_ERROR, msg)
-#define LOG_CRITICAL_MSG(msg) log_message(LOG_LEVEL_CRITICAL, msg)
+// Log a line the caller already checked the level of
+void log_write(log_level_t level, const char *fmt, ...);
+
+// Set the lowest level a subsystem logs at runtime, LOG_SUBSYS_COUNT sets every subsystem
+void log_set_level(log_subsystem_t subsystem, log_level_t level);
+
+// Get the lowest level a subsystem logs
+log_level_t log_get_level(log_subsystem_t subsystem);
+
+// Check whether a rate limited call site may log now
+bool log_ratelimit(log_ratelimit_t *rl, log_level_t level, const char *where);
+
+// Check whether a level is compiled in and enabled for a subsystem
+static inline bool log_enabled(log_subsystem_t subsystem, log_level_t level) {
+    return level >= LOG_MIN_LEVEL && level >= log_subsystem_levels[subsystem];
+}
+
+// Stop writing lines out as they are logged, the serial transmit interrupt sends them from
+// here on (interrupts must be enabled)
+void log_start_drain(void);
+
+// Send what the serial FIFO takes right now without waiting
+void log_drain(void);
+
+// Send every stored line, waiting for the serial port
+void log_flush(void);
+
+// Copy the lines still held in the rings, oldest first, returns the bytes copied
+size_t log_read_all(char *buffer, size_t size);
+
+// Get the most bytes log_read_all can return
+size_t log_buffer_size(void);
+
+// Get logging statistics
+void log_get_stats(log_stats_t *stats);
+
+// Convenience macros, the arguments are only evaluated when the line is logged
+#define LOG_AT(level, fmt, ...) \
+    (log_enabled(LOG_SUBSYSTEM, level) ? log_write(level, fmt, ##__VA_ARGS__) : (void)0)
+
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_CRITICAL(fmt, ...) LOG_AT(LOG_LEVEL_CRITICAL, fmt, ##__VA_ARGS__)
+
+#define LOG_DEBUG_MSG(msg) LOG_AT(LOG_LEVEL_DEBUG, "%s", msg)
+#define LOG_INFO_MSG(msg) LOG_AT(LOG_LEVEL_INFO, "%s", msg)
+#define LOG_WARN_MSG(msg) LOG_AT(LOG_LEVEL_WARN, "%s", msg)
+#define LOG_ERROR_MSG(msg) LOG_AT(LOG_LEVEL_ERROR, "%s", msg)
+#define LOG_CRITICAL_MSG(msg) LOG_AT(LOG_LEVEL_CRITICAL, "%s", msg)
+
+// Rate limited variants for paths that can fail over and over, each call site has its own limit
+#define LOG_AT_RATELIMITED(level, fmt, ...) do { \
+        static log_ratelimit_t _log_rl; \
+        if (log_enabled(LOG_SUBSYSTEM, level) && log_ratelimit(&_log_rl, level, __func__)) { \
+            log_write(level, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG_RATELIMITED(fmt, ...) LOG_AT_RATELIMITED(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_INFO_RATELIMITED(fmt, ...) LOG_AT_RATELIMITED(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_WARN_RATELIMITED(fmt, ...) LOG_AT_RATELIMITED(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_ERROR_RATELIMITED(fmt, ...) LOG_AT_RATELIMITED(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
 
 #endif // LOG_H
\ No newline at end of file
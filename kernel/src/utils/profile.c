@@ -0,0 +1,488 @@
+#include <utils/profile.h>
+#include <utils/ksyms.h>
+#include <utils/cmdline.h>
+#include <utils/log.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <core/smp.h>
+#include <core/exec/scheduler.h>
+#include <drivers/apic/lapic.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <memory/slab.h>
+#include <lib/string.h>
+#include <lib/stdio.h>
+#include <lib/asm.h>
+
+// Architectural performance monitoring MSRs
+#define MSR_PMC0                    0xC1
+#define MSR_PERFEVTSEL0             0x186
+#define MSR_PERF_GLOBAL_STATUS      0x38E
+#define MSR_PERF_GLOBAL_CTRL        0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL    0x390
+
+// Event select bits
+#define EVTSEL_USR                  (1ULL << 16)
+#define EVTSEL_OS                   (1ULL << 17)
+#define EVTSEL_INT                  (1ULL << 20)    // Interrupt through the LVT on overflow
+#define EVTSEL_EN                   (1ULL << 22)
+
+// PMC0 is the only counter used
+#define PMC0_BIT                    1ULL
+
+// Counter writes only take 32 bits, sign extended, so a period has to fit in 31
+#define PERIOD_MAX                  0x7FFFFFFFULL
+
+#define SAMPLE_PAGES \
+    ((PROFILE_SAMPLES * sizeof(profile_sample_t) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K)
+
+// Keys of the frames that have no kernel symbol
+#define KEY_UNKNOWN                 (-1)
+#define KEY_USER                    (-2)
+
+// Event encodings, arch_bit is the CPUID leaf 0xA EBX bit that reports it missing
+typedef struct {
+    const char *name;
+    uint8_t event;
+    uint8_t umask;
+    int arch_bit;                   // -1 for a model-specific event
+    uint64_t period;                // Default events between samples
+} event_desc_t;
+
+static const event_desc_t events[PROFILE_EVENT_COUNT] = {
+    { "cycles",      0x3C, 0x00,  0, 1000000 },
+    { "llc-misses",  0x2E, 0x41,  4, 10000 },
+    { "dtlb-misses", 0x08, 0x01, -1, 10000 }
+};
+
+// Samples of one CPU, only its NMI handler writes them
+typedef struct {
+    profile_sample_t *samples;
+    volatile uint32_t count;
+    uint32_t dropped;
+} profile_buffer_t;
+
+static profile_buffer_t buffers[MAX_CPUS];
+static bool supported = false;
+static bool intel = false;
+static uint32_t arch_events_len = 0;
+static uint32_t arch_events_missing = 0;
+static volatile bool running = false;
+static volatile bool paused = false;    // Readers keep the buffers still while they copy
+static profile_event_t current_event = PROFILE_CYCLES;
+static uint64_t current_period = 0;
+static uint64_t evtsel = 0;
+
+// Index of the executing CPU from its LAPIC ID, an NMI may arrive before swapgs
+static uint32_t nmi_cpu_id(void) {
+    uint32_t apic = lapic_id();
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        cpu_local_t *cpu = smp_cpu(id);
+        if (cpu && cpu->online && cpu->lapic_id == apic) {
+            return id;
+        }
+    }
+    return MAX_CPUS;
+}
+
+// Walk the frame pointers of a kernel sample. Each frame has to sit higher on the same
+// stack than the last one, so a register that is not a frame pointer ends the walk.
+static uint16_t walk_stack(const struct interrupt_frame *frame, uint64_t *stack) {
+    uint64_t low = frame->rsp;
+    uint64_t high = frame->rsp + PROFILE_STACK_SPAN;
+    uint64_t fp = frame->rbp;
+    uint16_t depth = 0;
+
+    while (depth < PROFILE_STACK_DEPTH && fp >= low && fp + 16 <= high && !(fp & 7)) {
+        const uint64_t *record = (const uint64_t *)fp;
+        uint64_t ret = record[1];
+        if (!(ret >> 63)) break;
+
+        stack[depth++] = ret;
+        low = fp + 16;
+        fp = record[0];
+    }
+    return depth;
+}
+
+// Counter overflow, taken as an NMI so code running with interrupts off is sampled too
+static void nmi_handler(struct interrupt_frame *frame) {
+    uint64_t status = cpu_read_msr(MSR_PERF_GLOBAL_STATUS);
+    if (!(status & PMC0_BIT)) {
+        LOG_CRITICAL("Exception: Non-maskable interrupt at RIP=0x%llx", frame->rip);
+        hcf();
+    }
+
+    uint32_t cpu = nmi_cpu_id();
+    profile_buffer_t *buffer = cpu < MAX_CPUS ? &buffers[cpu] : NULL;
+
+    if (running && !paused && buffer && buffer->samples) {
+        if (buffer->count < PROFILE_SAMPLES) {
+            profile_sample_t *sample = &buffer->samples[buffer->count];
+            task_t *task = scheduler_get_cpu_task(cpu);
+            sample->rip = frame->rip;
+            sample->tid = task ? task->tid : 0;
+            sample->cpu = (uint16_t)cpu;
+            sample->depth = (frame->cs & 3) ? 0 : walk_stack(frame, sample->stack);
+            __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+        } else {
+            buffer->dropped++;
+        }
+    }
+
+    // Rearm, delivery masked the LVT
+    cpu_write_msr(MSR_PMC0, -current_period);
+    cpu_write_msr(MSR_PERF_GLOBAL_OVF_CTRL, PMC0_BIT);
+    if (running) {
+        lapic_set_lvt_perf(LAPIC_LVT_NMI);
+    }
+}
+
+// Load the counter setup on the executing CPU, smp_call_all runs it everywhere
+static void program_cpu(void) {
+    cpu_write_msr(MSR_PERF_GLOBAL_CTRL, 0);
+
+    if (!running) {
+        cpu_write_msr(MSR_PERFEVTSEL0, 0);
+        lapic_set_lvt_perf(LAPIC_LVT_NMI | LAPIC_LVT_MASKED);
+        cpu_write_msr(MSR_PERF_GLOBAL_OVF_CTRL, PMC0_BIT);
+        return;
+    }
+
+    lapic_set_lvt_perf(LAPIC_LVT_NMI);
+    cpu_write_msr(MSR_PMC0, -current_period);
+    cpu_write_msr(MSR_PERFEVTSEL0, evtsel);
+    cpu_write_msr(MSR_PERF_GLOBAL_OVF_CTRL, PMC0_BIT);
+    cpu_write_msr(MSR_PERF_GLOBAL_CTRL, PMC0_BIT);
+}
+
+// Check whether this CPU can count an event
+static bool event_available(profile_event_t event) {
+    int bit = events[event].arch_bit;
+    if (bit < 0) {
+        return intel;
+    }
+    return (uint32_t)bit < arch_events_len && !(arch_events_missing & (1U << bit));
+}
+
+// Find an event by the name the command line uses
+static bool event_from_name(const char *name, profile_event_t *event) {
+    for (int i = 0; i < PROFILE_EVENT_COUNT; i++) {
+        if (strcmp(name, events[i].name) == 0) {
+            *event = (profile_event_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Detect the performance counters and start sampling if the command line asks for it
+bool profile_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    intel = ebx == 0x756E6547 && edx == 0x49656E69 && ecx == 0x6C65746E;    // GenuineIntel
+
+    if (max_leaf >= 0xA) {
+        cpu_cpuid(0xA, 0, &eax, &ebx, &ecx, &edx);
+        uint32_t version = eax & 0xFF;
+        uint32_t counters = (eax >> 8) & 0xFF;
+        arch_events_len = (eax >> 24) & 0xFF;
+        arch_events_missing = ebx;
+
+        // The global control and overflow MSRs came with version 2
+        supported = version >= 2 && counters >= 1;
+    }
+
+    if (!supported) {
+        LOG_INFO("Profile: no architectural performance counters, sampling unavailable");
+        return !cmdline_has(PROFILE_OPTION);
+    }
+
+    idt_register_handler(INT_NMI, nmi_handler);
+    LOG_INFO("Profile: performance counters found");
+
+    if (!cmdline_has(PROFILE_OPTION)) {
+        return true;
+    }
+
+    char name[16];
+    profile_event_t event = PROFILE_CYCLES;
+    if (cmdline_get_value(PROFILE_OPTION, name, sizeof(name)) && name[0] &&
+        !event_from_name(name, &event)) {
+        LOG_ERROR("Profile: unknown event %s", name);
+        return false;
+    }
+    return profile_start(event, cmdline_get_uint(PROFILE_OPTION_PERIOD, 0));
+}
+
+// Sample event on every CPU once per period events, 0 picks the event's default period
+bool profile_start(profile_event_t event, uint64_t period) {
+    if (!supported || event >= PROFILE_EVENT_COUNT || !event_available(event)) {
+        LOG_ERROR("Profile: event %d cannot be counted on this CPU", event);
+        return false;
+    }
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        cpu_local_t *cpu = smp_cpu(id);
+        if (!cpu || !cpu->online || buffers[id].samples) continue;
+
+        void *frames = pmm_alloc_pages(SAMPLE_PAGES);
+        if (!frames) {
+            LOG_ERROR("Profile: out of memory for the samples of CPU %u", id);
+            return false;
+        }
+        buffers[id].samples = vmm_phys_to_virt((uint64_t)frames);
+    }
+
+    if (!period) {
+        period = events[event].period;
+    }
+    if (period > PERIOD_MAX) {
+        period = PERIOD_MAX;
+    }
+
+    current_event = event;
+    current_period = period;
+    evtsel = events[event].event | ((uint64_t)events[event].umask << 8) |
+             EVTSEL_USR | EVTSEL_OS | EVTSEL_INT | EVTSEL_EN;
+    running = true;
+
+    bool ok = smp_call_all(program_cpu);
+    LOG_INFO("Profile: sampling %s every %u events", events[event].name, (uint32_t)period);
+    return ok;
+}
+
+// Stop sampling on every CPU
+void profile_stop(void) {
+    if (!running) {
+        return;
+    }
+
+    running = false;
+    smp_call_all(program_cpu);
+    LOG_INFO("Profile: stopped");
+}
+
+// Check whether the counters are sampling
+bool profile_running(void) {
+    return running;
+}
+
+// Copy the samples of every CPU, returns the bytes copied
+size_t profile_read(void *buffer, size_t size) {
+    profile_sample_t *out = buffer;
+    size_t max = size / sizeof(profile_sample_t);
+    size_t n = 0;
+
+    paused = true;
+    for (uint32_t id = 0; id < MAX_CPUS && n < max; id++) {
+        profile_buffer_t *buf = &buffers[id];
+        for (uint32_t i = 0; buf->samples && i < buf->count && n < max; i++) {
+            out[n++] = buf->samples[i];
+        }
+    }
+    paused = false;
+
+    return n * sizeof(profile_sample_t);
+}
+
+// Symbol keys of a sample, outermost caller first and the sampled function last.
+// Return addresses are looked up one byte back, a call can be a function's last instruction.
+static size_t sample_key(const profile_sample_t *sample, int *key) {
+    if (!(sample->rip >> 63)) {
+        key[0] = KEY_USER;
+        return 1;
+    }
+
+    size_t n = 0;
+    for (int i = sample->depth - 1; i >= 0; i--) {
+        key[n++] = ksyms_find(sample->stack[i] - 1);
+    }
+    key[n++] = ksyms_find(sample->rip);
+    return n;
+}
+
+// Name a key stands for
+static const char *key_name(int key) {
+    if (key == KEY_USER) {
+        return "[user]";
+    }
+    const char *name = ksyms_name(key, NULL);
+    return name ? name : "[unknown]";
+}
+
+// Hash of a sample's keys (FNV-1a)
+static uint32_t key_hash(const int *key, size_t n) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= (uint32_t)key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+// Hottest functions by the samples that landed in them
+static void report_flat(profile_sample_t **samples, size_t total) {
+    size_t slots = ksyms_count() + 2;       // The last two count user and unknown samples
+    uint32_t *counts = kzalloc(slots * sizeof(uint32_t));
+    if (!counts) {
+        LOG_ERROR("Profile: out of memory for the flat report");
+        return;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        int key[PROFILE_STACK_DEPTH + 1];
+        size_t n = sample_key(samples[i], key);
+        int leaf = key[n - 1];
+        counts[leaf == KEY_USER ? slots - 2 : leaf == KEY_UNKNOWN ? slots - 1 : (size_t)leaf]++;
+    }
+
+    for (int rank = 0; rank < PROFILE_FLAT_TOP; rank++) {
+        size_t best = 0;
+        for (size_t s = 1; s < slots; s++) {
+            if (counts[s] > counts[best]) best = s;
+        }
+        if (!counts[best]) break;
+
+        const char *name = best == slots - 2 ? "[user]" :
+                           best == slots - 1 ? "[unknown]" : key_name((int)best);
+        uint32_t permille = (uint32_t)((uint64_t)counts[best] * 1000 / total);
+        LOG_INFO("PROFILE flat %u %u.%u%% %s", counts[best], permille / 10, permille % 10, name);
+        log_flush();
+        counts[best] = 0;
+    }
+
+    kfree(counts);
+}
+
+// Every distinct stack with its sample count, in the folded format flame graph tools read
+static void report_folded(profile_sample_t **samples, size_t total) {
+    // Open addressing over sample indices, each slot holds its first sample and a count
+    size_t size = 1;
+    while (size < total * 2) size <<= 1;
+    uint32_t *first = kzalloc(size * sizeof(uint32_t));     // Sample index + 1, 0 when free
+    uint32_t *count = kzalloc(size * sizeof(uint32_t));
+    if (!first || !count) {
+        LOG_ERROR("Profile: out of memory for the folded report");
+        kfree(first);
+        kfree(count);
+        return;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        int key[PROFILE_STACK_DEPTH + 1];
+        size_t n = sample_key(samples[i], key);
+        size_t slot = key_hash(key, n) & (size - 1);
+
+        while (first[slot]) {
+            int other[PROFILE_STACK_DEPTH + 1];
+            size_t m = sample_key(samples[first[slot] - 1], other);
+            if (m == n && memcmp(key, other, n * sizeof(int)) == 0) break;
+            slot = (slot + 1) & (size - 1);
+        }
+        if (!first[slot]) {
+            first[slot] = (uint32_t)i + 1;
+        }
+        count[slot]++;
+    }
+
+    for (size_t slot = 0; slot < size; slot++) {
+        if (!first[slot]) continue;
+
+        int key[PROFILE_STACK_DEPTH + 1];
+        size_t n = sample_key(samples[first[slot] - 1], key);
+
+        // Room for the log prefix and the count, a deeper stack loses its innermost frames
+        char line[LOG_LINE_MAX - 48];
+        size_t len = 0;
+        for (size_t f = 0; f < n; f++) {
+            int w = snprintf(line + len, sizeof(line) - len, "%s%s", f ? ";" : "", key_name(key[f]));
+            if (w < 0 || len + (size_t)w >= sizeof(line)) break;
+            len += (size_t)w;
+        }
+        line[len] = '\0';
+
+        LOG_INFO("PROFILE folded %s %u", line, count[slot]);
+        log_flush();
+    }
+
+    kfree(first);
+    kfree(count);
+}
+
+// Write the hottest functions and every distinct stack, folded for flame graphs, over serial
+void profile_report(void) {
+    size_t total = 0;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        total += buffers[id].count;
+    }
+
+    LOG_INFO("PROFILE event=%s period=%u samples=%u symbols=%u",
+             events[current_event].name, (uint32_t)current_period, (uint32_t)total,
+             (uint32_t)ksyms_count());
+    if (!total) {
+        return;
+    }
+
+    profile_sample_t **samples = kmalloc(total * sizeof(profile_sample_t *));
+    if (!samples) {
+        LOG_ERROR("Profile: out of memory for the report");
+        return;
+    }
+
+    paused = true;
+    size_t n = 0;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        profile_buffer_t *buf = &buffers[id];
+        for (uint32_t i = 0; buf->samples && i < buf->count && n < total; i++) {
+            samples[n++] = &buf->samples[i];
+        }
+    }
+
+    report_flat(samples, n);
+    report_folded(samples, n);
+    paused = false;
+
+    kfree(samples);
+}
+
+// Drop every sample
+void profile_clear(void) {
+    paused = true;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        buffers[id].count = 0;
+        buffers[id].dropped = 0;
+    }
+    paused = false;
+}
+
+// Get profiler statistics
+void profile_get_stats(profile_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->supported = supported;
+    stats->running = running;
+    stats->event = current_event;
+    stats->period = current_period;
+    stats->samples = 0;
+    stats->dropped = 0;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        stats->samples += buffers[id].count;
+        stats->dropped += buffers[id].dropped;
+    }
+}
+
+// Print profiler statistics
+void profile_print_stats(void) {
+    profile_stats_t stats;
+    profile_get_stats(&stats);
+
+    LOG_INFO("Profile Statistics:");
+    LOG_INFO("  Counters: %s, sampling: %s (%s every %u)",
+             stats.supported ? "yes" : "no", stats.running ? "yes" : "no",
+             events[stats.event].name, (uint32_t)stats.period);
+    LOG_INFO("  Samples held: %u, dropped: %u", (uint32_t)stats.samples, (uint32_t)stats.dropped);
+}
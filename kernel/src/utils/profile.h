@@ -0,0 +1,86 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Samples each CPU's buffer holds, sampling on that CPU stops when it is full
+#define PROFILE_SAMPLES         4096
+
+// Callers walked up the frame pointer chain of a kernel sample
+#define PROFILE_STACK_DEPTH     8
+
+// Bytes above the interrupted RSP a frame pointer may point into, one kernel stack
+#define PROFILE_STACK_SPAN      16384
+
+// Functions the flat report lists
+#define PROFILE_FLAT_TOP        20
+
+// Command line options starting the profiler at boot
+#define PROFILE_OPTION          "profile"           // Event name, "cycles" when left empty
+#define PROFILE_OPTION_PERIOD   "profile.period"    // Events between samples
+
+// Events the counter can sample on
+typedef enum {
+    PROFILE_CYCLES,                 // Unhalted core cycles
+    PROFILE_LLC_MISSES,             // Last level cache misses
+    PROFILE_DTLB_MISSES,            // Data TLB load misses causing a page walk, Intel only
+    PROFILE_EVENT_COUNT
+} profile_event_t;
+
+// One overflow of the counter
+typedef struct {
+    uint64_t rip;
+    uint32_t tid;                   // Interrupted task, 0 when there is none
+    uint16_t cpu;
+    uint16_t depth;                 // Return addresses held in stack
+    uint64_t stack[PROFILE_STACK_DEPTH];    // Innermost caller first
+} profile_sample_t;
+
+// sys_kprofile operations
+#define PROFILE_OP_START        0   // Sample the event in the argument's low byte, every
+                                    // argument >> 8 events (0 picks the default period)
+#define PROFILE_OP_STOP         1
+#define PROFILE_OP_READ         2   // Copy the samples, CPU by CPU
+#define PROFILE_OP_REPORT       3   // Write the flat and folded reports over serial
+#define PROFILE_OP_CLEAR        4
+
+// Profiler statistics
+typedef struct {
+    bool supported;                 // Architectural performance monitoring is there
+    bool running;
+    profile_event_t event;
+    uint64_t period;
+    size_t samples;                 // Samples held
+    size_t dropped;                 // Overflows with a full buffer
+} profile_stats_t;
+
+// Detect the performance counters and start sampling if the command line asks for it
+bool profile_init(void);
+
+// Sample event on every CPU once per period events, 0 picks the event's default period
+bool profile_start(profile_event_t event, uint64_t period);
+
+// Stop sampling on every CPU
+void profile_stop(void);
+
+// Check whether the counters are sampling
+bool profile_running(void);
+
+// Copy the samples of every CPU, returns the bytes copied
+size_t profile_read(void *buffer, size_t size);
+
+// Write the hottest functions and every distinct stack, folded for flame graphs, over serial
+void profile_report(void);
+
+// Drop every sample
+void profile_clear(void);
+
+// Get profiler statistics
+void profile_get_stats(profile_stats_t *stats);
+
+// Print profiler statistics
+void profile_print_stats(void);
+
+#endif // PROFILE_H
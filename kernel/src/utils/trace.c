@@ -0,0 +1,268 @@
+#include <utils/trace.h>
+#include <utils/cmdline.h>
+#include <utils/log.h>
+#include <core/cpu.h>
+#include <core/idt.h>
+#include <core/smp.h>
+#include <core/exec/scheduler.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <lib/string.h>
+#include <lib/asm.h>
+
+#define TRACE_RING_PAGES \
+    ((TRACE_RING_RECORDS * sizeof(trace_record_t) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K)
+
+#define OPCODE_INT3     0xCC
+#define OPCODE_JMP32    0xE9
+#define SITE_SIZE       5
+
+// Bounds of the trace_sites section, set by the linker script
+extern trace_site_t __start_trace_sites[];
+extern trace_site_t __stop_trace_sites[];
+
+// Ring of one CPU, only that CPU writes it
+typedef struct {
+    trace_record_t *records;
+    volatile uint64_t head;         // Records written, the slot is head % TRACE_RING_RECORDS
+} trace_ring_t;
+
+static trace_ring_t rings[MAX_CPUS];
+static uint32_t enabled_mask = 0;
+static volatile bool paused = false;    // Readers keep the rings still while they copy
+static spinlock_t patch_lock;
+static volatile uint64_t patch_addr = 0;    // Site being rewritten, its int3 acts as the NOP
+static size_t stat_patches = 0;
+static bool ready = false;
+
+static const uint8_t site_nop[SITE_SIZE] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+
+static const char *event_names[TRACE_EVENT_COUNT] = {
+    "sched_switch",
+    "syscall_enter",
+    "syscall_exit",
+    "irq_enter",
+    "ata_read",
+    "ata_write",
+    "bcache_hit",
+    "bcache_miss",
+    "pmm_alloc"
+};
+
+// A CPU ran into a site while it was rewritten, it carries on as if the site were a NOP
+static void breakpoint_handler(struct interrupt_frame *frame) {
+    uint64_t addr = __atomic_load_n(&patch_addr, __ATOMIC_ACQUIRE);
+    if (addr && frame->rip == addr + 1) {
+        frame->rip = addr + SITE_SIZE;
+        return;
+    }
+
+    LOG_CRITICAL("Exception: Breakpoint at RIP=0x%llx", frame->rip);
+    hcf();
+}
+
+// Rewrite a site through a writable alias of the kernel image. Other CPUs only ever see
+// whole instructions: an int3 goes in first, then the tail, then the new first byte, with
+// every CPU serialized in between.
+static bool patch_site(uint64_t addr, const uint8_t *code) {
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE_4K - 1);
+    uint64_t phys = vmm_get_physical_address(page);
+    if (!phys) {
+        return false;
+    }
+
+    // The image is physically contiguous, a site crossing into the next page stays mapped
+    uint8_t *alias = vmm_map_physical(phys, 2 * PAGE_SIZE_4K, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
+    if (!alias) {
+        return false;
+    }
+    volatile uint8_t *site = alias + (addr - page);
+
+    __atomic_store_n(&patch_addr, addr, __ATOMIC_RELEASE);
+    site[0] = OPCODE_INT3;
+    smp_sync_cores();
+    for (int i = 1; i < SITE_SIZE; i++) {
+        site[i] = code[i];
+    }
+    smp_sync_cores();
+    site[0] = code[0];
+    smp_sync_cores();
+    __atomic_store_n(&patch_addr, 0, __ATOMIC_RELEASE);
+
+    vmm_unmap_physical(alias, 2 * PAGE_SIZE_4K);
+    stat_patches++;
+    return true;
+}
+
+// Allocate the rings and enable the events the command line asks for
+bool trace_init(void) {
+    spinlock_init(&patch_lock);
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        cpu_local_t *cpu = smp_cpu(id);
+        if (!cpu || !cpu->online) continue;
+
+        void *frames = pmm_alloc_pages(TRACE_RING_PAGES);
+        if (!frames) {
+            LOG_ERROR("Trace: out of memory for the ring of CPU %u", id);
+            return false;
+        }
+        rings[id].records = vmm_phys_to_virt((uint64_t)frames);
+        rings[id].head = 0;
+    }
+
+    idt_register_handler(INT_BREAKPOINT, breakpoint_handler);
+    ready = true;
+
+    LOG_INFO("Trace: %u tracepoints, %u records per CPU",
+             (uint32_t)(__stop_trace_sites - __start_trace_sites), TRACE_RING_RECORDS);
+
+    uint32_t mask = (uint32_t)cmdline_get_uint(TRACE_OPTION, 0);
+    return mask == 0 || trace_set_mask(mask);
+}
+
+// Enable exactly the events in mask, patching their sites
+bool trace_set_mask(uint32_t mask) {
+    if (!ready) {
+        return false;
+    }
+    mask &= TRACE_ALL_EVENTS;
+
+    bool ok = true;
+    spinlock_acquire(&patch_lock);
+    for (trace_site_t *site = __start_trace_sites; site < __stop_trace_sites; site++) {
+        uint32_t bit = 1U << site->event;
+        if ((mask & bit) == (enabled_mask & bit)) continue;
+
+        uint8_t code[SITE_SIZE];
+        if (mask & bit) {
+            int32_t rel = (int32_t)(site->target - (site->addr + SITE_SIZE));
+            code[0] = OPCODE_JMP32;
+            memcpy(&code[1], &rel, sizeof(rel));
+        } else {
+            memcpy(code, site_nop, SITE_SIZE);
+        }
+
+        if (!patch_site(site->addr, code)) {
+            LOG_ERROR("Trace: failed to patch the site at 0x%llx", site->addr);
+            ok = false;
+        }
+    }
+    enabled_mask = mask;
+    spinlock_release(&patch_lock);
+
+    LOG_INFO("Trace: event mask 0x%x", mask);
+    return ok;
+}
+
+// Get the enabled events
+uint32_t trace_get_mask(void) {
+    return enabled_mask;
+}
+
+// Store a record in the executing CPU's ring, called by the tracepoints
+void trace_record(trace_event_t event, uint64_t arg0, uint64_t arg1) {
+    if (paused) {
+        return;
+    }
+
+    // Interrupts off, an interrupt's own tracepoint would take the same slot
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    trace_ring_t *ring = &rings[cpu];
+
+    if (ring->records) {
+        trace_record_t *rec = &ring->records[ring->head % TRACE_RING_RECORDS];
+        task_t *task = scheduler_get_current_task();
+        rec->tsc = cpu_rdtsc();
+        rec->event = (uint16_t)event;
+        rec->cpu = (uint16_t)cpu;
+        rec->tid = task ? task->tid : 0;
+        rec->arg0 = arg0;
+        rec->arg1 = arg1;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+// First record still held in a ring
+static uint64_t ring_first(const trace_ring_t *ring) {
+    return ring->head > TRACE_RING_RECORDS ? ring->head - TRACE_RING_RECORDS : 0;
+}
+
+// Copy the records of every CPU, returns the bytes copied
+size_t trace_read(void *buffer, size_t size) {
+    trace_record_t *out = buffer;
+    size_t max = size / sizeof(trace_record_t);
+    size_t n = 0;
+
+    paused = true;
+    for (uint32_t id = 0; id < MAX_CPUS && n < max; id++) {
+        trace_ring_t *ring = &rings[id];
+        if (!ring->records) continue;
+
+        for (uint64_t i = ring_first(ring); i < ring->head && n < max; i++) {
+            out[n++] = ring->records[i % TRACE_RING_RECORDS];
+        }
+    }
+    paused = false;
+
+    return n * sizeof(trace_record_t);
+}
+
+// Write the records over serial as one TRACE line each
+void trace_dump(void) {
+    paused = true;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        trace_ring_t *ring = &rings[id];
+        if (!ring->records) continue;
+
+        for (uint64_t i = ring_first(ring); i < ring->head; i++) {
+            const trace_record_t *rec = &ring->records[i % TRACE_RING_RECORDS];
+            LOG_INFO("TRACE cpu=%u tsc=%llu event=%s tid=%u arg0=0x%llx arg1=0x%llx",
+                     rec->cpu, rec->tsc,
+                     rec->event < TRACE_EVENT_COUNT ? event_names[rec->event] : "unknown",
+                     rec->tid, rec->arg0, rec->arg1);
+
+            // Far more lines than the log rings hold, each one leaves before the next
+            log_flush();
+        }
+    }
+    paused = false;
+}
+
+// Drop every record
+void trace_clear(void) {
+    paused = true;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        rings[id].head = 0;
+    }
+    paused = false;
+}
+
+// Get trace statistics
+void trace_get_stats(trace_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->mask = enabled_mask;
+    stats->sites = (size_t)(__stop_trace_sites - __start_trace_sites);
+    stats->records = 0;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        stats->records += rings[id].head;
+    }
+    stats->patches = stat_patches;
+}
+
+// Print trace statistics
+void trace_print_stats(void) {
+    trace_stats_t stats;
+    trace_get_stats(&stats);
+
+    LOG_INFO("Trace Statistics:");
+    LOG_INFO("  Event mask: 0x%x, tracepoints: %u, sites patched: %u",
+             stats.mask, (uint32_t)stats.sites, (uint32_t)stats.patches);
+    LOG_INFO("  Records written: %u", (uint32_t)stats.records);
+}
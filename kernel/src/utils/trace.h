@@ -0,0 +1,110 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Records each CPU's ring holds, the oldest are overwritten
+#define TRACE_RING_RECORDS  4096
+
+// Command line option holding the event mask enabled at boot, as a decimal number
+#define TRACE_OPTION        "trace"
+
+// Events, the comments name what arg0 and arg1 hold
+typedef enum {
+    TRACE_SCHED_SWITCH,         // Previous task ID, next task ID
+    TRACE_SYSCALL_ENTER,        // System call number, first argument
+    TRACE_SYSCALL_EXIT,         // System call number, result
+    TRACE_IRQ_ENTER,            // Vector, interrupted RIP
+    TRACE_ATA_READ,             // First LBA, sector count
+    TRACE_ATA_WRITE,            // First LBA, sector count
+    TRACE_BCACHE_HIT,           // Block, drive
+    TRACE_BCACHE_MISS,          // Block, drive
+    TRACE_PMM_ALLOC,            // Physical address, page count
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+#define TRACE_ALL_EVENTS    ((1U << TRACE_EVENT_COUNT) - 1)
+
+// Binary record, a host decoder merges the CPUs by timestamp
+typedef struct {
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t tid;                   // Running task, 0 when there is none
+    uint64_t arg0;
+    uint64_t arg1;
+} trace_record_t;
+
+// Site a tracepoint macro leaves in the trace_sites section
+typedef struct {
+    uint64_t addr;                  // 5 byte NOP, patched to a jump while the event is on
+    uint64_t target;                // Code recording the event
+    uint64_t event;
+} trace_site_t;
+
+// sys_trace operations
+#define TRACE_OP_SET_MASK   0       // Enable exactly the events in the argument
+#define TRACE_OP_GET_MASK   1
+#define TRACE_OP_READ       2       // Copy the records, oldest first on each CPU
+#define TRACE_OP_DUMP       3       // Write the records over serial
+#define TRACE_OP_CLEAR      4
+
+// Trace statistics
+typedef struct {
+    uint32_t mask;                  // Enabled events
+    size_t sites;                   // Tracepoints in the kernel
+    size_t records;                 // Records written since boot
+    size_t patches;                 // Sites rewritten
+} trace_stats_t;
+
+// Allocate the rings and enable the events the command line asks for
+bool trace_init(void);
+
+// Enable exactly the events in mask, patching their sites
+bool trace_set_mask(uint32_t mask);
+
+// Get the enabled events
+uint32_t trace_get_mask(void);
+
+// Store a record in the executing CPU's ring, called by the tracepoints
+void trace_record(trace_event_t event, uint64_t arg0, uint64_t arg1);
+
+// Copy the records of every CPU, returns the bytes copied
+size_t trace_read(void *buffer, size_t size);
+
+// Write the records over serial as one TRACE line each
+void trace_dump(void);
+
+// Drop every record
+void trace_clear(void);
+
+// Get trace statistics
+void trace_get_stats(trace_stats_t *stats);
+
+// Print trace statistics
+void trace_print_stats(void);
+
+// Jump label of a tracepoint. The site is a 5 byte NOP while the event is off, enabling
+// it patches in a jump to the true branch.
+static inline __attribute__((always_inline)) bool trace_site_enabled(trace_event_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection trace_sites, \"aw\"\n\t"
+                 ".balign 8\n\t"
+                 ".quad 1b, %l[on], %c0\n\t"
+                 ".popsection"
+                 : : "i"(event) : : on);
+    return false;
+on:
+    return true;
+}
+
+// Tracepoint, the arguments are only evaluated while the event is on
+#define TRACE(event, arg0, arg1) do { \
+        if (trace_site_enabled(event)) { \
+            trace_record(event, (uint64_t)(arg0), (uint64_t)(arg1)); \
+        } \
+    } while (0)
+
+#endif // TRACE_H